@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <time.h>
+#include <limits.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -34,6 +35,8 @@
 #include "xslt.h"
 #include "fserve.h"
 #include "admin.h"
+#include "slave.h"
+#include "matchfile.h"
 
 #include "format.h"
 
@@ -71,6 +74,7 @@
 #define COMMAND_RAW_LISTSTREAM              103
 #define COMMAND_PLAINTEXT_LISTSTREAM        104
 #define COMMAND_RAW_QUEUE_RELOAD            105
+#define COMMAND_PLAINTEXT_METRICS           106
 #define COMMAND_TRANSFORMED_LIST_MOUNTS     201
 #define COMMAND_TRANSFORMED_STATS           202
 #define COMMAND_TRANSFORMED_LISTSTREAM      203
@@ -79,8 +83,10 @@
 /* Client management commands (block 301-399 and 401-499) */
 #define COMMAND_RAW_KILL_CLIENT             301
 #define COMMAND_RAW_KILL_SOURCE             302
+#define COMMAND_RAW_FILTER_CLIENTS          303
 #define COMMAND_TRANSFORMED_KILL_CLIENT     401
 #define COMMAND_TRANSFORMED_KILL_SOURCE     402
+#define COMMAND_TRANSFORMED_FILTER_CLIENTS  403
 
 /* Admin commands requiring no auth (block 501-599) */
 #define COMMAND_BUILDM3U                    501
@@ -105,12 +111,15 @@
 #define STREAMLIST_RAW_REQUEST              "streamlist"
 #define STREAMLIST_TRANSFORMED_REQUEST      "streamlist.xsl"
 #define STREAMLIST_PLAINTEXT_REQUEST        "streamlist.txt"
+#define METRICS_PLAINTEXT_REQUEST           "metrics"
 #define MOVECLIENTS_RAW_REQUEST             "moveclients"
 #define MOVECLIENTS_TRANSFORMED_REQUEST     "moveclients.xsl"
 #define KILLCLIENT_RAW_REQUEST              "killclient"
 #define KILLCLIENT_TRANSFORMED_REQUEST      "killclient.xsl"
 #define KILLSOURCE_RAW_REQUEST              "killsource"
 #define KILLSOURCE_TRANSFORMED_REQUEST      "killsource.xsl"
+#define FILTERCLIENTS_RAW_REQUEST           "filterclients"
+#define FILTERCLIENTS_TRANSFORMED_REQUEST   "filterclients.xsl"
 #define ADMIN_XSL_RESPONSE                  "response.xsl"
 #define MANAGEAUTH_RAW_REQUEST              "manageauth"
 #define MANAGEAUTH_TRANSFORMED_REQUEST      "manageauth.xsl"
@@ -150,12 +159,15 @@ static const admin_command_t commands[] = {
  {COMMAND_RAW_LISTSTREAM,              STREAMLIST_RAW_REQUEST,             ADMINTYPE_GENERAL, RAW},
  {COMMAND_PLAINTEXT_LISTSTREAM,        STREAMLIST_PLAINTEXT_REQUEST,       ADMINTYPE_GENERAL, PLAINTEXT},
  {COMMAND_TRANSFORMED_LISTSTREAM,      STREAMLIST_TRANSFORMED_REQUEST,     ADMINTYPE_GENERAL, TRANSFORMED},
+ {COMMAND_PLAINTEXT_METRICS,           METRICS_PLAINTEXT_REQUEST,          ADMINTYPE_GENERAL, PLAINTEXT},
  {COMMAND_RAW_MOVE_CLIENTS,            MOVECLIENTS_RAW_REQUEST,            ADMINTYPE_MOUNT,   RAW},
  {COMMAND_TRANSFORMED_MOVE_CLIENTS,    MOVECLIENTS_TRANSFORMED_REQUEST,    ADMINTYPE_HYBRID,  TRANSFORMED},
  {COMMAND_RAW_KILL_CLIENT,             KILLCLIENT_RAW_REQUEST,             ADMINTYPE_MOUNT,   RAW},
  {COMMAND_TRANSFORMED_KILL_CLIENT,     KILLCLIENT_TRANSFORMED_REQUEST,     ADMINTYPE_MOUNT,   TRANSFORMED},
  {COMMAND_RAW_KILL_SOURCE,             KILLSOURCE_RAW_REQUEST,             ADMINTYPE_MOUNT,   RAW},
  {COMMAND_TRANSFORMED_KILL_SOURCE,     KILLSOURCE_TRANSFORMED_REQUEST,     ADMINTYPE_MOUNT,   TRANSFORMED},
+ {COMMAND_RAW_FILTER_CLIENTS,          FILTERCLIENTS_RAW_REQUEST,          ADMINTYPE_MOUNT,   RAW},
+ {COMMAND_TRANSFORMED_FILTER_CLIENTS,  FILTERCLIENTS_TRANSFORMED_REQUEST,  ADMINTYPE_MOUNT,   TRANSFORMED},
  {COMMAND_RAW_MANAGEAUTH,              MANAGEAUTH_RAW_REQUEST,             ADMINTYPE_GENERAL, RAW},
  {COMMAND_TRANSFORMED_MANAGEAUTH,      MANAGEAUTH_TRANSFORMED_REQUEST,     ADMINTYPE_GENERAL, TRANSFORMED},
  {COMMAND_RAW_UPDATEMETADATA,          UPDATEMETADATA_RAW_REQUEST,         ADMINTYPE_MOUNT,   RAW},
@@ -201,8 +213,11 @@ static void command_move_clients(client_t *client, source_t *source,
 static void command_stats(client_t *client, const char *mount, int response);
 static void command_queue_reload(client_t *client, int response);
 static void command_list_mounts(client_t *client, int response);
+static void command_metrics(client_t *client);
 static void command_kill_client(client_t *client, source_t *source,
         int response);
+static void command_filter_clients(client_t *client, source_t *source,
+        int response);
 static void command_manageauth(client_t *client, int response);
 static void command_buildm3u(client_t *client, const char *mount);
 static void command_kill_source(client_t *client, source_t *source,
@@ -303,6 +318,7 @@ void admin_send_response(xmlDocPtr     doc,
         client_set_queue(client, NULL);
         client->refbuf = refbuf_new(buf_len);
 
+        client_keepalive(client);
         ret = util_http_build_header(client->refbuf->data, buf_len, 0,
                                      0, 200, NULL,
                                      "text/xml", "utf-8",
@@ -313,13 +329,9 @@ void admin_send_response(xmlDocPtr     doc,
             xmlFree(buff);
             return;
         } else if (buf_len < (size_t)(len + ret + 64)) {
-            void *new_data;
             buf_len = ret + len + 64;
-            new_data = realloc(client->refbuf->data, buf_len);
-            if (new_data) {
+            if (refbuf_resize(client->refbuf, buf_len) == 0) {
                 ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
-                client->refbuf->data = new_data;
-                client->refbuf->len = buf_len;
                 ret = util_http_build_header(client->refbuf->data, buf_len, 0,
                                              0, 200, NULL,
                                              "text/xml", "utf-8",
@@ -469,6 +481,9 @@ static void admin_handle_general_request(client_t *client)
         case COMMAND_PLAINTEXT_LISTSTREAM:
             command_list_mounts(client, PLAINTEXT);
         break;
+        case COMMAND_PLAINTEXT_METRICS:
+            command_metrics(client);
+        break;
         case COMMAND_TRANSFORMED_STATS:
             command_stats(client, NULL, TRANSFORMED);
         break;
@@ -527,6 +542,9 @@ static void admin_handle_mount_request(client_t *client, source_t *source)
         case COMMAND_RAW_KILL_SOURCE:
             command_kill_source(client, source, RAW);
         break;
+        case COMMAND_RAW_FILTER_CLIENTS:
+            command_filter_clients(client, source, RAW);
+        break;
         case COMMAND_TRANSFORMED_STATS:
             command_stats(client, source->mount, TRANSFORMED);
         break;
@@ -545,6 +563,9 @@ static void admin_handle_mount_request(client_t *client, source_t *source)
         case COMMAND_TRANSFORMED_KILL_SOURCE:
             command_kill_source(client, source, TRANSFORMED);
         break;
+        case COMMAND_TRANSFORMED_FILTER_CLIENTS:
+            command_filter_clients(client, source, TRANSFORMED);
+        break;
         case COMMAND_TRANSFORMED_UPDATEMETADATA:
             command_updatemetadata(client, source, TRANSFORMED);
         break;
@@ -653,17 +674,214 @@ static void command_move_clients(client_t   *client,
     xmlFreeDoc(doc);
 }
 
-static inline xmlNodePtr __add_listener(client_t        *client,
-                                        xmlNodePtr      parent,
-                                        time_t          now,
-                                        operation_mode  mode)
+/* what is kept of a listener for listing it once the list lock is dropped */
+typedef struct {
+    unsigned long id;
+    char *ip;
+    char *useragent;
+    char *referer;
+    char *username;
+    char *role;
+    time_t con_time;
+    unsigned int lag_ms;
+    int tls;
+} listener_info_t;
+
+#define LISTENER_FIELD_IP           (1<<0)
+#define LISTENER_FIELD_USERAGENT    (1<<1)
+#define LISTENER_FIELD_REFERER      (1<<2)
+#define LISTENER_FIELD_CONNECTED    (1<<3)
+#define LISTENER_FIELD_USERNAME     (1<<4)
+#define LISTENER_FIELD_ROLE         (1<<5)
+#define LISTENER_FIELD_TLS          (1<<6)
+#define LISTENER_FIELD_LAG          (1<<7)
+#define LISTENER_FIELD_ALL          0xff
+
+static const struct {
+    const char *name;
+    unsigned int field;
+} listener_fields[] = {
+    {"ip",          LISTENER_FIELD_IP},
+    {"useragent",   LISTENER_FIELD_USERAGENT},
+    {"referer",     LISTENER_FIELD_REFERER},
+    {"connected",   LISTENER_FIELD_CONNECTED},
+    {"username",    LISTENER_FIELD_USERNAME},
+    {"role",        LISTENER_FIELD_ROLE},
+    {"tls",         LISTENER_FIELD_TLS},
+    {"lag",         LISTENER_FIELD_LAG},
+    {NULL,          0}
+};
+
+/* comma separated field names to a mask, the id is always included */
+static unsigned int __listener_fields(const char *fields)
+{
+    unsigned int mask = 0;
+    size_t len;
+    int i;
+
+    if (fields == NULL || *fields == '\0')
+        return LISTENER_FIELD_ALL;
+    while (*fields) {
+        len = strcspn(fields, ",");
+        for (i = 0; listener_fields[i].name; i++) {
+            if (strlen(listener_fields[i].name) == len &&
+                    strncmp(listener_fields[i].name, fields, len) == 0)
+                mask |= listener_fields[i].field;
+        }
+        fields += len;
+        if (*fields == ',')
+            fields++;
+    }
+    return mask;
+}
+
+static inline char *__listener_strdup(const char *str)
+{
+    return str ? strdup(str) : NULL;
+}
+
+static void __copy_listener(listener_info_t *info, client_t *client, unsigned int fields)
+{
+    memset(info, 0, sizeof(listener_info_t));
+    info->id = client->con->id;
+    if (fields & LISTENER_FIELD_IP)
+        info->ip = __listener_strdup(client->con->ip);
+    if (fields & LISTENER_FIELD_USERAGENT)
+        info->useragent = __listener_strdup(httpp_getvar(client->parser, "user-agent"));
+    if (fields & LISTENER_FIELD_REFERER)
+        info->referer = __listener_strdup(httpp_getvar(client->parser, "referer"));
+    if (fields & LISTENER_FIELD_USERNAME)
+        info->username = __listener_strdup(client->username);
+    if (fields & LISTENER_FIELD_ROLE)
+        info->role = __listener_strdup(client->role);
+    info->con_time = client->con->con_time;
+    info->lag_ms = client->lag_ms;
+#ifdef HAVE_OPENSSL
+    info->tls = client->con->ssl ? 1 : 0;
+#endif
+}
+
+static void __free_listeners(listener_info_t *info, unsigned long count)
+{
+    unsigned long i;
+
+    for (i = 0; i < count; i++) {
+        free(info[i].ip);
+        free(info[i].useragent);
+        free(info[i].referer);
+        free(info[i].username);
+        free(info[i].role);
+    }
+    free(info);
+}
+
+/* a heap of clients with the largest id at the top */
+static void __listener_heap_swap(client_t **heap, unsigned long a, unsigned long b)
+{
+    client_t *tmp = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = tmp;
+}
+
+static void __listener_heap_up(client_t **heap, unsigned long i)
+{
+    while (i && heap[(i-1)/2]->con->id < heap[i]->con->id) {
+        __listener_heap_swap(heap, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+
+static void __listener_heap_down(client_t **heap, unsigned long count, unsigned long i)
+{
+    while (1) {
+        unsigned long largest = i, child = 2*i + 1;
+
+        if (child < count && heap[child]->con->id > heap[largest]->con->id)
+            largest = child;
+        if (child + 1 < count && heap[child+1]->con->id > heap[largest]->con->id)
+            largest = child + 1;
+        if (largest == i)
+            break;
+        __listener_heap_swap(heap, i, largest);
+        i = largest;
+    }
+}
+
+static int __compare_listener_id(const void *a, const void *b)
+{
+    const listener_info_t *la = a, *lb = b;
+
+    return la->id < lb->id ? -1 : (la->id > lb->id);
+}
+
+/* Copy out the listeners so the document is built without holding the
+ * list lock. With a limit, the listeners with the lowest ids above start
+ * are taken in id order and *more says if there are others after them.
+ */
+static listener_info_t *__copy_listeners(source_t *source, unsigned long start,
+        unsigned long limit, unsigned int fields, unsigned long *count, int *more)
+{
+    listener_info_t *info = NULL;
+    client_t **heap = NULL;
+    unsigned long i, n = 0, matched = 0;
+
+    *count = 0;
+    *more = 0;
+    listener_list_rlock(&source->client_list);
+    if (limit == 0) {
+        if (source->client_list.count)
+            info = calloc(source->client_list.count, sizeof(listener_info_t));
+        for (i = 0; info && i < source->client_list.count; i++)
+            __copy_listener(&info[n++], source->client_list.clients[i], fields);
+        listener_list_unlock(&source->client_list);
+        *count = n;
+        return info;
+    }
+
+    if (limit > source->client_list.count)
+        limit = source->client_list.count;
+    if (limit)
+        heap = calloc(limit, sizeof(client_t *));
+    for (i = 0; heap && i < source->client_list.count; i++) {
+        client_t *client = source->client_list.clients[i];
+
+        if (client->con->id <= start)
+            continue;
+        matched++;
+        if (n < limit) {
+            heap[n] = client;
+            __listener_heap_up(heap, n++);
+        } else if (client->con->id < heap[0]->con->id) {
+            heap[0] = client;
+            __listener_heap_down(heap, n, 0);
+        }
+    }
+    if (n)
+        info = calloc(n, sizeof(listener_info_t));
+    for (i = 0; info && i < n; i++)
+        __copy_listener(&info[i], heap[i], fields);
+    listener_list_unlock(&source->client_list);
+    free(heap);
+
+    if (info == NULL)
+        return NULL;
+    qsort(info, n, sizeof(listener_info_t), __compare_listener_id);
+    *count = n;
+    *more = matched > n;
+    return info;
+}
+
+static xmlNodePtr __add_listener(listener_info_t *info,
+                                 xmlNodePtr      parent,
+                                 time_t          now,
+                                 operation_mode  mode,
+                                 unsigned int    fields)
 {
-    const char *tmp;
     xmlNodePtr node;
     char buf[22];
 
-    /* TODO: kh has support for a child node "lag". We should add that.
-     * BEFORE RELEASE NEXT DOCUMENT #2097: Changed case of child nodes to lower case.
+    /* BEFORE RELEASE NEXT DOCUMENT #2097: Changed case of child nodes to lower case.
      * The case of <ID>, <IP>, <UserAgent> and <Connected> got changed to lower case.
      */
 
@@ -672,34 +890,37 @@ static inline xmlNodePtr __add_listener(client_t        *client,
         return NULL;
 
     memset(buf, '\000', sizeof(buf));
-    snprintf(buf, sizeof(buf)-1, "%lu", client->con->id);
+    snprintf(buf, sizeof(buf)-1, "%lu", info->id);
     xmlSetProp(node, XMLSTR("id"), XMLSTR(buf));
     xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "ID" : "id"), XMLSTR(buf));
 
-    xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "IP" : "ip"), XMLSTR(client->con->ip));
+    if (info->ip)
+        xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "IP" : "ip"), XMLSTR(info->ip));
 
-    tmp = httpp_getvar(client->parser, "user-agent");
-    if (tmp)
-        xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "UserAgent" : "useragent"), XMLSTR(tmp));
+    if (info->useragent)
+        xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "UserAgent" : "useragent"), XMLSTR(info->useragent));
 
-    tmp = httpp_getvar(client->parser, "referer");
-    if (tmp)
-        xmlNewTextChild(node, NULL, XMLSTR("referer"), XMLSTR(tmp));
+    if (info->referer)
+        xmlNewTextChild(node, NULL, XMLSTR("referer"), XMLSTR(info->referer));
 
-    snprintf(buf, sizeof(buf), "%lu", (unsigned long)(now - client->con->con_time));
-    xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "Connected" : "connected"), XMLSTR(buf));
+    if (fields & LISTENER_FIELD_CONNECTED) {
+        snprintf(buf, sizeof(buf), "%lu", (unsigned long)(now - info->con_time));
+        xmlNewTextChild(node, NULL, XMLSTR(mode == OMODE_LEGACY ? "Connected" : "connected"), XMLSTR(buf));
+    }
 
-    if (client->username)
-        xmlNewTextChild(node, NULL, XMLSTR("username"), XMLSTR(client->username));
+    if (info->username)
+        xmlNewTextChild(node, NULL, XMLSTR("username"), XMLSTR(info->username));
 
-    if (client->role)
-        xmlNewTextChild(node, NULL, XMLSTR("role"), XMLSTR(client->role));
+    if (info->role)
+        xmlNewTextChild(node, NULL, XMLSTR("role"), XMLSTR(info->role));
 
-#ifdef HAVE_OPENSSL
-    xmlNewTextChild(node, NULL, XMLSTR("tls"), XMLSTR(client->con->ssl ? "true" : "false"));
-#else
-    xmlNewTextChild(node, NULL, XMLSTR("tls"), XMLSTR("false"));
-#endif
+    if (fields & LISTENER_FIELD_TLS)
+        xmlNewTextChild(node, NULL, XMLSTR("tls"), XMLSTR(info->tls ? "true" : "false"));
+
+    if (fields & LISTENER_FIELD_LAG) {
+        snprintf(buf, sizeof(buf), "%u", info->lag_ms);
+        xmlNewTextChild(node, NULL, XMLSTR("lag_ms"), XMLSTR(buf));
+    }
 
     return node;
 }
@@ -709,17 +930,18 @@ void admin_add_listeners_to_mount(source_t          *source,
                                   operation_mode    mode)
 {
     time_t now = time(NULL);
-    avl_node *client_node;
-
-    avl_tree_rlock(source->client_tree);
-    client_node = avl_get_first(source->client_tree);
-    while(client_node) {
-        __add_listener((client_t *)client_node->key, parent, now, mode);
-        client_node = avl_get_next(client_node);
-    }
-    avl_tree_unlock(source->client_tree);
+    listener_info_t *info;
+    unsigned long i, count;
+    int more;
+
+    info = __copy_listeners(source, 0, 0, LISTENER_FIELD_ALL, &count, &more);
+    for (i = 0; i < count; i++)
+        __add_listener(&info[i], parent, now, mode, LISTENER_FIELD_ALL);
+    __free_listeners(info, count);
 }
 
+/* start, limit and fields allow the listeners of a large mount to be
+ * fetched a page at a time, ordered by id */
 static void command_show_listeners(client_t *client,
                                    source_t *source,
                                    int      response)
@@ -727,6 +949,24 @@ static void command_show_listeners(client_t *client,
     xmlDocPtr doc;
     xmlNodePtr node, srcnode;
     char buf[22];
+    const char *start = NULL, *limit = NULL, *fields = NULL;
+    unsigned long i, count, start_id = 0, max = 0;
+    unsigned int field_mask;
+    listener_info_t *info;
+    time_t now = time(NULL);
+    int more;
+
+    COMMAND_OPTIONAL(client, "start", start);
+    COMMAND_OPTIONAL(client, "limit", limit);
+    COMMAND_OPTIONAL(client, "fields", fields);
+    if (start)
+        start_id = strtoul(start, NULL, 10);
+    if (limit)
+        max = strtoul(limit, NULL, 10);
+    /* a start on its own still gives the rest in id order */
+    if (start && max == 0)
+        max = ULONG_MAX;
+    field_mask = __listener_fields(fields);
 
     doc = xmlNewDoc(XMLSTR("1.0"));
     node = xmlNewDocNode(doc, NULL, XMLSTR("icestats"), NULL);
@@ -739,7 +979,15 @@ static void command_show_listeners(client_t *client,
     /* BEFORE RELEASE NEXT DOCUMENT #2097: Changed "Listeners" to lower case. */
     xmlNewTextChild(srcnode, NULL, XMLSTR(client->mode == OMODE_LEGACY ? "Listeners" : "listeners"), XMLSTR(buf));
 
-    admin_add_listeners_to_mount(source, srcnode, client->mode);
+    info = __copy_listeners(source, start_id, max, field_mask, &count, &more);
+    for (i = 0; i < count; i++)
+        __add_listener(&info[i], srcnode, now, client->mode, field_mask);
+    /* the start for the next page */
+    if (more) {
+        snprintf(buf, sizeof(buf), "%lu", info[count-1].id);
+        xmlNewTextChild(srcnode, NULL, XMLSTR("next"), XMLSTR(buf));
+    }
+    __free_listeners(info, count);
 
     admin_send_response(doc, client, response,
         LISTCLIENTS_TRANSFORMED_REQUEST);
@@ -805,6 +1053,24 @@ xmlNodePtr admin_add_role_to_authentication(auth_t *auth, xmlNodePtr parent)
     xmlSetProp(rolenode, XMLSTR("can-deleteuser"), XMLSTR(auth->deleteuser ? "true" : "false"));
     xmlSetProp(rolenode, XMLSTR("can-listuser"), XMLSTR(auth->listuser ? "true" : "false"));
 
+    if (!auth->immediate) {
+        unsigned long wait_ms = 0;
+        int pending;
+
+        thread_mutex_lock(&auth->lock);
+        pending = auth->pending_count;
+        if (auth->queue_served)
+            wait_ms = (unsigned long)(auth->queue_wait_us / auth->queue_served / 1000);
+        thread_mutex_unlock(&auth->lock);
+
+        snprintf(idbuf, sizeof(idbuf), "%lu", (unsigned long)auth->thread_count);
+        xmlSetProp(rolenode, XMLSTR("workers"), XMLSTR(idbuf));
+        snprintf(idbuf, sizeof(idbuf), "%d", pending);
+        xmlSetProp(rolenode, XMLSTR("queue-length"), XMLSTR(idbuf));
+        snprintf(idbuf, sizeof(idbuf), "%lu", wait_ms);
+        xmlSetProp(rolenode, XMLSTR("queue-wait-ms"), XMLSTR(idbuf));
+    }
+
     return rolenode;
 }
 
@@ -995,6 +1261,130 @@ static void command_kill_client(client_t *client,
     xmlFreeDoc(doc);
 }
 
+/* the admin request waiting on a listener filter */
+typedef struct {
+    client_t *client;
+    int response;
+} filter_clients_t;
+
+static void filter_clients_free(source_filter_t *filter)
+{
+    matchfile_release(filter->ips);
+    free(filter->useragent);
+    free(filter->dest_mount);
+    free(filter->arg);
+    free(filter);
+}
+
+/* called by the source thread once the filter is done with, sends the
+ * response to the admin request that queued it */
+static void filter_clients_done(source_filter_t *filter, const char *mount, long count)
+{
+    filter_clients_t *request = filter->arg;
+    xmlDocPtr doc;
+    xmlNodePtr node;
+    char buf[255];
+
+    doc = xmlNewDoc(XMLSTR("1.0"));
+    node = xmlNewDocNode(doc, NULL, XMLSTR("iceresponse"), NULL);
+    xmlDocSetRootElement(doc, node);
+    if (count < 0) {
+        snprintf(buf, sizeof(buf), "Listener filter on %s not applied", mount);
+        xmlNewTextChild(node, NULL, XMLSTR("message"), XMLSTR(buf));
+        xmlNewTextChild(node, NULL, XMLSTR("return"), XMLSTR("0"));
+    } else {
+        if (filter->dest_mount)
+            snprintf(buf, sizeof(buf), "%ld clients moved from %s to %s", count, mount, filter->dest_mount);
+        else
+            snprintf(buf, sizeof(buf), "%ld clients removed from %s", count, mount);
+        ICECAST_LOG_INFO("Admin request: %s", buf);
+        xmlNewTextChild(node, NULL, XMLSTR("message"), XMLSTR(buf));
+        xmlNewTextChild(node, NULL, XMLSTR("return"), XMLSTR("1"));
+    }
+    admin_send_response(doc, request->client, request->response, ADMIN_XSL_RESPONSE);
+    xmlFreeDoc(doc);
+    filter_clients_free(filter);
+}
+
+/* drop or move the listeners matching a filter in one pass, for shedding
+ * load. action is kill or move, the latter with a destination. The source
+ * thread answers the request once it has applied the filter, so nothing is
+ * held while waiting for it */
+static void command_filter_clients(client_t *client,
+                                   source_t *source,
+                                   int      response)
+{
+    const char *action, *dest_mount = NULL, *value;
+    const char *ip = NULL, *useragent = NULL;
+    source_filter_t *filter;
+    filter_clients_t *request;
+    unsigned int percent = 100;
+
+    COMMAND_REQUIRE(client, "action", action);
+
+    COMMAND_OPTIONAL(client, "ip", ip);
+    COMMAND_OPTIONAL(client, "useragent", useragent);
+    if ((COMMAND_OPTIONAL(client, "percent", value)))
+        percent = atoi(value);
+    if (percent == 0 || percent > 100) {
+        client_send_error(client, 400, 0, "percent must be from 1 to 100");
+        return;
+    }
+
+    if (strcmp(action, "move") == 0) {
+        source_t *dest;
+
+        COMMAND_REQUIRE(client, "destination", dest_mount);
+        dest = source_find_mount(dest_mount);
+        if (dest == NULL || dest == source) {
+            client_send_error(client, 400, 0, "Invalid mount specified");
+            return;
+        }
+    } else if (strcmp(action, "kill") != 0) {
+        client_send_error(client, 400, 0, "action must be kill or move");
+        return;
+    }
+
+    filter = calloc(1, sizeof(source_filter_t));
+    request = calloc(1, sizeof(filter_clients_t));
+    if (filter == NULL || request == NULL) {
+        free(filter);
+        free(request);
+        client_send_error(client, 500, 0, "memory exhausted");
+        return;
+    }
+    filter->arg = request;
+    filter->done = filter_clients_done;
+    filter->percent = percent;
+    if ((COMMAND_OPTIONAL(client, "min_connected", value)))
+        filter->min_connected = atol(value);
+    if ((COMMAND_OPTIONAL(client, "max_connected", value)))
+        filter->max_connected = atol(value);
+    if (useragent)
+        filter->useragent = strdup(useragent);
+    if (dest_mount)
+        filter->dest_mount = strdup(dest_mount);
+    if (ip) {
+        /* addresses and CIDR ranges, as in the allow and deny lists */
+        filter->ips = matchfile_new_list(ip);
+        if (filter->ips == NULL) {
+            filter_clients_free(filter);
+            client_send_error(client, 400, 0, "Invalid ip filter");
+            return;
+        }
+    }
+    if ((useragent && filter->useragent == NULL) || (dest_mount && filter->dest_mount == NULL)) {
+        filter_clients_free(filter);
+        client_send_error(client, 500, 0, "memory exhausted");
+        return;
+    }
+    request->client = client;
+    request->response = response;
+
+    if (source_filter_listeners(source, filter) < 0)
+        filter_clients_done(filter, source->mount, -1);
+}
+
 static void command_fallback(client_t *client,
                              source_t *source,
                              int      response)
@@ -1157,11 +1547,37 @@ static void command_list_mounts(client_t *client, int response)
     ICECAST_LOG_DEBUG("List mounts request");
 
     if (response == PLAINTEXT) {
-        ssize_t ret = util_http_build_header(client->refbuf->data,
-                                             PER_CLIENT_REFBUF_SIZE, 0,
-                                             0, 200, NULL,
-                                             "text/plain", "utf-8",
-                                             "", NULL, client);
+        char etag[40];
+        const char *match = httpp_getvar(client->parser, "if-none-match");
+        const char *server = httpp_get_query_param(client->parser, "rserverip");
+        int status = 200;
+        ssize_t ret;
+
+        /* a slave polling for the list may offer to take listeners */
+        if (server) {
+            const char *port = httpp_get_query_param(client->parser, "rport");
+            const char *clients = httpp_get_query_param(client->parser, "clients");
+            const char *limit = httpp_get_query_param(client->parser, "limit");
+            const char *interval = httpp_get_query_param(client->parser, "interval");
+
+            slave_redirect_update(client->con->ip, server,
+                port ? atoi(port) : 0, clients ? atoi(clients) : 0,
+                limit ? atoi(limit) : 0, interval ? atoi(interval) : 0);
+        }
+
+        /* slaves poll this, so let them skip an unchanged list */
+        stats_get_streams_etag (etag, sizeof (etag));
+        if (match && strcmp (match, etag) == 0)
+            status = 304;
+
+        ret = util_http_build_header(client->refbuf->data,
+                                     PER_CLIENT_REFBUF_SIZE, 0,
+                                     0, status, NULL,
+                                     "text/plain", "utf-8",
+                                     NULL, NULL, client);
+        if (ret != -1 && ret < PER_CLIENT_REFBUF_SIZE)
+            ret += snprintf (client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret,
+                    "ETag: %s\r\n\r\n", etag);
 
         if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
             ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
@@ -1170,9 +1586,10 @@ static void command_list_mounts(client_t *client, int response)
         }
 
         client->refbuf->len = strlen (client->refbuf->data);
-        client->respcode = 200;
+        client->respcode = status;
 
-        client->refbuf->next = stats_get_streams ();
+        if (status == 200)
+            client->refbuf->next = stats_get_streams ();
         fserve_add_client (client, NULL);
     } else {
         xmlDocPtr doc;
@@ -1186,6 +1603,40 @@ static void command_list_mounts(client_t *client, int response)
     }
 }
 
+/* stats for scrapers, the text is shared by all requests until the stats
+ * change */
+static void command_metrics(client_t *client)
+{
+    refbuf_t *metrics = stats_get_metrics();
+    ssize_t ret;
+
+    if (metrics == NULL) {
+        client_send_error(client, 503, 0, "Stats not available yet.");
+        return;
+    }
+    client_keepalive(client);
+    ret = util_http_build_header(client->refbuf->data,
+                                 PER_CLIENT_REFBUF_SIZE, 0,
+                                 0, 200, NULL,
+                                 "application/openmetrics-text; version=1.0.0", "utf-8",
+                                 NULL, NULL, client);
+    if (ret != -1 && ret < PER_CLIENT_REFBUF_SIZE)
+        ret += snprintf(client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret,
+                "Content-Length: %u\r\n\r\n", metrics->len);
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error(client, 500, 0, "Header generation failed.");
+        refbuf_release(metrics);
+        return;
+    }
+
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->respcode = 200;
+    client->refbuf->next = refbuf_slice(metrics, 0, metrics->len);
+    refbuf_release(metrics);
+    fserve_add_client (client, NULL);
+}
+
 static void command_updatemetadata(client_t *client,
                                    source_t *source,
                                    int      response)
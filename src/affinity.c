@@ -0,0 +1,103 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* affinity.c
+ **
+ ** threads pin themselves to the CPU list given for their class in
+ ** <cpu-affinity>, eg "0-7,16-23". Memory a thread first touches is then
+ ** placed on its own node by the kernel, which with the per thread refbuf
+ ** caches keeps a source's buffers local to the threads sending them.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "affinity.h"
+
+#define CATMODULE "affinity"
+
+#include "logging.h"
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/* fill set from a list of CPUs and ranges, returns the number of CPUs in
+ * it or -1 if the list is not valid */
+static int affinity_parse (const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+
+    CPU_ZERO (set);
+    while (*p)
+    {
+        char *end;
+        unsigned long first, last, cpu;
+
+        while (isspace ((unsigned char)*p) || *p == ',')
+            p++;
+        if (*p == '\0')
+            break;
+        first = strtoul (p, &end, 10);
+        if (end == p)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-')
+        {
+            p++;
+            last = strtoul (p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET (cpu, set);
+    }
+    return CPU_COUNT (set);
+}
+#endif
+
+
+void affinity_apply (affinity_class cls)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    ice_config_t *config = config_get_config ();
+    const char *list = config->cpu_affinity [cls];
+
+    if (list)
+    {
+        cpu_set_t set;
+        int ret;
+
+        if (affinity_parse (list, &set) <= 0)
+            ICECAST_LOG_WARN("Ignoring CPU list \"%s\"", list);
+        else if ((ret = pthread_setaffinity_np (pthread_self (), sizeof (set), &set)) != 0)
+            ICECAST_LOG_WARN("Unable to set CPU affinity to \"%s\": %s", list, strerror (ret));
+        else
+            ICECAST_LOG_DEBUG("Thread placed on CPUs %s", list);
+    }
+    config_release_config ();
+#else
+    (void)cls;
+#endif
+}
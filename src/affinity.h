@@ -0,0 +1,27 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* affinity.h
+**
+** pinning threads to the CPUs listed for their class
+**
+*/
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include "cfgfile.h"
+
+/* restrict the calling thread to the CPUs configured for its class, if
+ * any. Called by a thread as it starts */
+void affinity_apply(affinity_class cls);
+
+#endif  /* __AFFINITY_H__ */
@@ -27,12 +27,15 @@
 #include "auth.h"
 #include "source.h"
 #include "client.h"
+#include "objpool.h"
 #include "cfgfile.h"
 #include "stats.h"
 #include "common/httpp/httpp.h"
 #include "fserve.h"
 #include "admin.h"
 #include "acl.h"
+#include "trace.h"
+#include "common/avl/avl.h"
 
 #include "logging.h"
 #define CATMODULE "auth"
@@ -45,8 +48,30 @@ struct auth_stack_tag {
     auth_stack_t *next;
 };
 
+/* decision cache in front of the backend, entries are kept in insertion
+ * order so the oldest can be dropped first when the cache is full.
+ */
+typedef struct auth_cache_entry_tag {
+    char *key;
+    auth_result result;
+    time_t expires;
+    time_t timelimit;   /* seconds the backend left the client, 0 for no limit */
+    struct auth_cache_entry_tag *next;
+} auth_cache_entry_t;
+
+struct auth_cache_tag {
+    mutex_t lock;
+    avl_tree *entries;
+    auth_cache_entry_t *oldest, **newest;
+    size_t count;
+    size_t size;
+    time_t ttl;
+    time_t negative_ttl;
+};
+
 /* code */
 static void __handle_auth_client(auth_t *auth, auth_client *auth_user);
+static void auth_cache_free(auth_cache_t *cache);
 
 static mutex_t _auth_lock; /* protects _current_id */
 static volatile unsigned long _current_id = 0;
@@ -68,6 +93,7 @@ static auth_client *auth_client_setup (client_t *client)
 
     do {
         const char *header;
+        char buf[512];
         char *userpass, *tmp;
         char *username, *password;
 
@@ -81,7 +107,10 @@ static auth_client *auth_client_setup (client_t *client)
             break;
 
         if (strncmp(header, "Basic ", 6) == 0) {
-            userpass = util_base64_decode (header+6);
+            /* the usual short credentials are decoded on the stack */
+            userpass = buf;
+            if (util_base64_decode_buf (header+6, buf, sizeof(buf)) < 0)
+                userpass = strlen (header+6) < sizeof(buf) ? NULL : util_base64_decode (header+6);
             if (userpass == NULL) {
                 ICECAST_LOG_WARN("Base64 decode of Authorization header \"%s\" failed",
                         header+6);
@@ -90,7 +119,8 @@ static auth_client *auth_client_setup (client_t *client)
 
             tmp = strchr(userpass, ':');
             if (tmp == NULL) {
-                free(userpass);
+                if (userpass != buf)
+                    free(userpass);
                 break;
             }
 
@@ -99,13 +129,14 @@ static auth_client *auth_client_setup (client_t *client)
             password = tmp+1;
             client->username = strdup(username);
             client->password = strdup(password);
-            free (userpass);
+            if (userpass != buf)
+                free (userpass);
             break;
         }
         ICECAST_LOG_INFO("unhandled authorization header: %s", header);
     } while (0);
 
-    auth_user = calloc(1, sizeof(auth_client));
+    auth_user = objpool_alloc(OBJPOOL_AUTH_CLIENT, sizeof(auth_client));
     auth_user->client = client;
     return auth_user;
 }
@@ -128,12 +159,15 @@ static void queue_auth_client (auth_client *auth_user)
     if (auth->immediate) {
         __handle_auth_client(auth, auth_user);
     } else {
+        ICECAST_TRACE2 (auth_enqueue, auth->mount, auth_user->client->con->id);
+        auth_user->queued = stats_time_us();
         thread_mutex_lock (&auth->lock);
         *auth->tailp = auth_user;
         auth->tailp = &auth_user->next;
         auth->pending_count++;
         ICECAST_LOG_INFO("auth on %s has %d pending", auth->mount, auth->pending_count);
         thread_mutex_unlock (&auth->lock);
+        thread_cond_signal (&auth->cond);
     }
 }
 
@@ -156,12 +190,18 @@ void auth_release (auth_t *authenticator) {
 
     /* cleanup auth thread attached to this auth */
     if (authenticator->running) {
+        size_t i;
+
         authenticator->running = 0;
-        thread_join(authenticator->thread);
+        thread_cond_broadcast(&authenticator->cond);
+        for (i = 0; i < authenticator->thread_count; i++)
+            thread_join(authenticator->threads[i]);
+        free(authenticator->threads);
     }
 
     if (authenticator->free)
         authenticator->free(authenticator);
+    auth_cache_free(authenticator->cache);
     if (authenticator->type)
         xmlFree (authenticator->type);
     if (authenticator->role)
@@ -170,6 +210,7 @@ void auth_release (auth_t *authenticator) {
         xmlFree (authenticator->management_url);
     thread_mutex_unlock(&authenticator->lock);
     thread_mutex_destroy(&authenticator->lock);
+    thread_cond_destroy(&authenticator->cond);
     if (authenticator->mount)
         free(authenticator->mount);
     acl_release(authenticator->acl);
@@ -192,9 +233,162 @@ static void auth_client_free (auth_client *auth_user)
 {
     if (auth_user == NULL)
         return;
-    free (auth_user);
+    objpool_free (OBJPOOL_AUTH_CLIENT, auth_user);
+}
+
+
+static int auth_cache_compare(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp(((auth_cache_entry_t *)a)->key, ((auth_cache_entry_t *)b)->key);
+}
+
+static int auth_cache_free_entry(void *key)
+{
+    auth_cache_entry_t *entry = key;
+
+    free(entry->key);
+    free(entry);
+    return 1;
+}
+
+static auth_cache_t *auth_cache_new(size_t size, time_t ttl, time_t negative_ttl)
+{
+    auth_cache_t *cache = calloc(1, sizeof(auth_cache_t));
+
+    if (cache == NULL)
+        return NULL;
+    thread_mutex_create(&cache->lock);
+    cache->entries = avl_tree_new(auth_cache_compare, NULL);
+    cache->newest = &cache->oldest;
+    cache->size = size;
+    cache->ttl = ttl;
+    cache->negative_ttl = negative_ttl;
+    return cache;
+}
+
+static void auth_cache_free(auth_cache_t *cache)
+{
+    if (cache == NULL)
+        return;
+    avl_tree_free(cache->entries, auth_cache_free_entry);
+    thread_mutex_destroy(&cache->lock);
+    free(cache);
 }
 
+/* credentials, mount and address of the client, NULL if there is no mount */
+static char *auth_cache_key(client_t *client)
+{
+    const char *mount = httpp_getvar(client->parser, HTTPP_VAR_RAWURI);
+    size_t len;
+    char *key;
+
+    if (mount == NULL)
+        mount = httpp_getvar(client->parser, HTTPP_VAR_URI);
+    if (mount == NULL)
+        return NULL;
+
+    len = strlen(mount) + strlen(client->con->ip) + 4;
+    if (client->username)
+        len += strlen(client->username);
+    if (client->password)
+        len += strlen(client->password);
+
+    key = malloc(len);
+    if (key == NULL)
+        return NULL;
+    snprintf(key, len, "%s\n%s\n%s\n%s",
+            client->username ? client->username : "",
+            client->password ? client->password : "",
+            mount, client->con->ip);
+    return key;
+}
+
+/* returns 1 and sets *result if a decision is cached for this client */
+static int auth_cache_lookup(auth_t *auth, client_t *client, auth_result *result)
+{
+    auth_cache_t *cache = auth->cache;
+    auth_cache_entry_t search, *entry = NULL;
+    time_t now = time(NULL);
+    int hit = 0;
+
+    search.key = auth_cache_key(client);
+    if (search.key == NULL)
+        return 0;
+
+    thread_mutex_lock(&cache->lock);
+    if (avl_get_by_key(cache->entries, &search, (void **)&entry) == 0 && entry->expires > now) {
+        *result = entry->result;
+        if (entry->timelimit)
+            client->con->discon_time = now + entry->timelimit;
+        hit = 1;
+    }
+    thread_mutex_unlock(&cache->lock);
+    free(search.key);
+
+    stats_event_inc(NULL, hit ? "auth_cache_hits" : "auth_cache_misses");
+    return hit;
+}
+
+/* remember a backend decision for this client */
+static void auth_cache_store(auth_t *auth, client_t *client, auth_result result)
+{
+    auth_cache_t *cache = auth->cache;
+    auth_cache_entry_t search, *entry = NULL;
+    time_t now = time(NULL), ttl;
+
+    switch (result) {
+        case AUTH_OK:
+            ttl = cache->ttl;
+            break;
+        case AUTH_FAILED:
+        case AUTH_FORBIDDEN:
+        case AUTH_NOMATCH:
+            ttl = cache->negative_ttl;
+            break;
+        default:
+            return;
+    }
+    if (ttl <= 0)
+        return;
+
+    search.key = auth_cache_key(client);
+    if (search.key == NULL)
+        return;
+
+    thread_mutex_lock(&cache->lock);
+    if (avl_get_by_key(cache->entries, &search, (void **)&entry) == 0) {
+        free(search.key);
+    } else {
+        /* make room, expired entries go first as they are oldest */
+        while (cache->oldest && (cache->count >= cache->size || cache->oldest->expires <= now)) {
+            auth_cache_entry_t *old = cache->oldest;
+
+            cache->oldest = old->next;
+            if (cache->oldest == NULL)
+                cache->newest = &cache->oldest;
+            cache->count--;
+            avl_delete(cache->entries, old, auth_cache_free_entry);
+        }
+        entry = calloc(1, sizeof(auth_cache_entry_t));
+        if (entry == NULL) {
+            thread_mutex_unlock(&cache->lock);
+            free(search.key);
+            return;
+        }
+        entry->key = search.key;
+        avl_insert(cache->entries, entry);
+        *cache->newest = entry;
+        cache->newest = &entry->next;
+        cache->count++;
+    }
+    entry->result = result;
+    entry->expires = now + ttl;
+    entry->timelimit = 0;
+    if (result == AUTH_OK && client->con->discon_time > now)
+        entry->timelimit = client->con->discon_time - now;
+    thread_mutex_unlock(&cache->lock);
+}
 
 /* verify that the client is still connected. */
 static int is_client_connected (client_t *client) {
@@ -209,26 +403,39 @@ static int is_client_connected (client_t *client) {
     return 1;
 }
 
-static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
-    client_t *client = auth_user->client;
-    auth_result ret = AUTH_FAILED;
-
-    /* make sure there is still a client at this point, a slow backend request
-     * can be avoided if client has disconnected */
+/* make sure there is still a client at this point, a slow backend request
+ * can be avoided if client has disconnected */
+static int auth_new_client_check (client_t *client) {
     if (is_client_connected(client) == 0) {
         ICECAST_LOG_DEBUG("client is no longer connected");
         client->respcode = 400;
         auth_release (client->auth);
         client->auth = NULL;
-        return AUTH_FAILED;
+        return -1;
     }
+    return 0;
+}
+
+/* drop the auth from a client the backend has refused */
+static void auth_new_client_failed (client_t *client) {
+    auth_release (client->auth);
+    client->auth = NULL;
+}
+
+static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
+    client_t *client = auth_user->client;
+    auth_result ret = AUTH_FAILED;
+
+    if (auth_new_client_check(client) < 0)
+        return AUTH_FAILED;
 
     if (auth->authenticate_client) {
         ret = auth->authenticate_client(auth_user);
+        if (auth->cache)
+            auth_cache_store(auth, client, ret);
         if (ret != AUTH_OK)
         {
-            auth_release (client->auth);
-            client->auth = NULL;
+            auth_new_client_failed(client);
             return ret;
         }
     }
@@ -236,6 +443,16 @@ static auth_result auth_new_client (auth_t *auth, auth_client *auth_user) {
 }
 
 
+static void auth_remove_client_done(client_t *client)
+{
+    auth_release(client->auth);
+    client->auth = NULL;
+
+    /* client is going, so auth is not an issue at this point */
+    acl_release(client->acl);
+    client->acl = NULL;
+}
+
 /* wrapper function for auth thread to drop client connections
  */
 static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
@@ -248,26 +465,13 @@ static auth_result auth_remove_client(auth_t *auth, auth_client *auth_user)
     if (client->auth->release_client)
         ret = client->auth->release_client(auth_user);
 
-    auth_release(client->auth);
-    client->auth = NULL;
-
-    /* client is going, so auth is not an issue at this point */
-    acl_release(client->acl);
-    client->acl = NULL;
+    auth_remove_client_done(client);
 
     return ret;
 }
 
-static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
-    auth_result result;
-
-    if (auth_user->process) {
-        result = auth_user->process(auth, auth_user);
-    } else {
-        ICECAST_LOG_ERROR("client auth process not set");
-        result = AUTH_FAILED;
-    }
-
+static void __finish_auth_client (auth_t *auth, auth_client *auth_user, auth_result result) {
+    ICECAST_TRACE3 (auth_complete, auth->mount, auth_user->client->con->id, (int)result);
     if (result == AUTH_OK) {
         if (auth_user->client->acl)
             acl_release(auth_user->client->acl);
@@ -285,40 +489,107 @@ static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
     auth_client_free (auth_user);
 }
 
+static void __handle_auth_client (auth_t *auth, auth_client *auth_user) {
+    auth_result result;
+
+    if (auth_user->process) {
+        result = auth_user->process(auth, auth_user);
+    } else {
+        ICECAST_LOG_ERROR("client auth process not set");
+        result = AUTH_FAILED;
+    }
+
+    __finish_auth_client(auth, auth_user, result);
+}
+
+/* hand a batch of queued clients to the backend in one go and finish each
+ * of them as __handle_auth_client() would.
+ */
+static void __handle_auth_batch (auth_t *auth, auth_client **users, size_t count) {
+    auth_result results[AUTH_BATCH_MAX];
+    size_t i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (!users[i]->release && auth_new_client_check(users[i]->client) < 0) {
+            __finish_auth_client(auth, users[i], AUTH_FAILED);
+            continue;
+        }
+        users[n++] = users[i];
+    }
+    if (n == 0)
+        return;
+
+    auth->authenticate_batch(auth, users, results, n);
+
+    for (i = 0; i < n; i++) {
+        if (users[i]->release) {
+            auth_remove_client_done(users[i]->client);
+        } else {
+            if (auth->cache)
+                auth_cache_store(auth, users[i]->client, results[i]);
+            if (results[i] != AUTH_OK)
+                auth_new_client_failed(users[i]->client);
+        }
+        __finish_auth_client(auth, users[i], results[i]);
+    }
+}
+
 /* The auth thread main loop. */
 static void *auth_run_thread (void *arg)
 {
     auth_t *auth = arg;
+    size_t batch_max = 1;
+
+    if (auth->authenticate_batch && auth->batch_max > 1)
+        batch_max = auth->batch_max > AUTH_BATCH_MAX ? AUTH_BATCH_MAX : auth->batch_max;
 
     ICECAST_LOG_INFO("Authentication thread started");
     while (auth->running)
     {
+        auth_client *batch[AUTH_BATCH_MAX];
+        size_t count = 0, i;
+        uint64_t now;
+
         /* usually no clients are waiting, so don't bother taking locks */
-        if (auth->head)
+        if (auth->head == NULL)
         {
-            auth_client *auth_user;
+            /* woken by queue_auth_client(), a missed wakeup only delays */
+            config_drop_pin ();
+            thread_cond_timedwait (&auth->cond, 150);
+            continue;
+        }
 
-            /* may become NULL before lock taken */
-            thread_mutex_lock (&auth->lock);
-            auth_user = (auth_client*)auth->head;
-            if (auth_user == NULL)
-            {
-                thread_mutex_unlock (&auth->lock);
-                continue;
-            }
+        /* may become NULL before lock taken, other workers share the queue */
+        thread_mutex_lock (&auth->lock);
+        if (auth->head)
             ICECAST_LOG_DEBUG("%d client(s) pending on %s (role %s)", auth->pending_count, auth->mount, auth->role);
+        now = stats_time_us();
+        while (auth->head && count < batch_max)
+        {
+            auth_client *auth_user = auth->head;
+
             auth->head = auth_user->next;
             if (auth->head == NULL)
                 auth->tailp = &auth->head;
             auth->pending_count--;
-            thread_mutex_unlock(&auth->lock);
+            auth->queue_wait_us += now - auth_user->queued;
+            auth->queue_served++;
             auth_user->next = NULL;
+            batch[count++] = auth_user;
+        }
+        thread_mutex_unlock(&auth->lock);
 
-            __handle_auth_client(auth, auth_user);
+        for (i = 0; i < count; i++)
+            stats_histogram_record_global (STATS_HISTOGRAM_AUTH_WAIT,
+                    now - batch[i]->queued);
 
-            continue;
+        if (batch_max > 1) {
+            if (count)
+                __handle_auth_batch(auth, batch, count);
+        } else {
+            for (i = 0; i < count; i++)
+                __handle_auth_client(auth, batch[i]);
         }
-        thread_sleep (150000);
     }
     ICECAST_LOG_INFO("Authentication thread shutting down");
     return NULL;
@@ -329,6 +600,7 @@ static void *auth_run_thread (void *arg)
  */
 static void auth_add_client(auth_t *auth, client_t *client, void (*on_no_match)(client_t *client, void (*on_result)(client_t *client, void *userdata, auth_result result), void *userdata), void (*on_result)(client_t *client, void *userdata, auth_result result), void *userdata) {
     auth_client *auth_user;
+    auth_result result;
 
     ICECAST_LOG_DEBUG("Trying to add client %p to auth %p's (role %s) queue.", client, auth, auth->role);
 
@@ -350,11 +622,20 @@ static void auth_add_client(auth_t *auth, client_t *client, void (*on_no_match)(
 
     auth_release(client->auth);
     auth_addref(client->auth = auth);
+    client->auth_cached = 0;
     auth_user = auth_client_setup(client);
     auth_user->process = auth_new_client;
     auth_user->on_no_match = on_no_match;
     auth_user->on_result = on_result;
     auth_user->userdata = userdata;
+    if (auth->cache && auth_cache_lookup(auth, client, &result)) {
+        ICECAST_LOG_DEBUG("cached decision for client %lu", client->con->id);
+        client->auth_cached = 1;
+        if (result != AUTH_OK)
+            auth_new_client_failed(client);
+        __finish_auth_client(auth, auth_user, result);
+        return;
+    }
     ICECAST_LOG_INFO("adding client for authentication");
     queue_auth_client(auth_user);
 }
@@ -371,9 +652,11 @@ int auth_release_client (client_t *client) {
      * and the auth/fserve thread */
     client_set_queue (client, NULL);
 
-    if (client->auth && client->auth->release_client) {
+    /* no removal for a client the backend was never told about */
+    if (client->auth && client->auth->release_client && !client->auth_cached) {
         auth_client *auth_user = auth_client_setup(client);
         auth_user->process = auth_remove_client;
+        auth_user->release = 1;
         queue_auth_client(auth_user);
         return 1;
     } else if (client->auth) {
@@ -438,13 +721,14 @@ auth_t *auth_get_authenticator(xmlNodePtr node)
     auth_t *auth = calloc(1, sizeof(auth_t));
     config_options_t *options = NULL, **next_option = &options;
     xmlNodePtr option;
-    char *method;
+    char *method, *tmp;
     size_t i;
 
     if (auth == NULL)
         return NULL;
 
     thread_mutex_create(&auth->lock);
+    thread_cond_create(&auth->cond);
     auth->refcount = 1;
     auth->id = _next_auth_id();
     auth->type = (char*)xmlGetProp(node, XMLSTR("type"));
@@ -456,6 +740,40 @@ auth_t *auth_get_authenticator(xmlNodePtr node)
         return NULL;
     }
 
+    tmp = (char*)xmlGetProp(node, XMLSTR("cache-ttl"));
+    if (tmp) {
+        long ttl = atol(tmp), negative_ttl = 0, size = 1024;
+
+        xmlFree(tmp);
+        tmp = (char*)xmlGetProp(node, XMLSTR("cache-negative-ttl"));
+        if (tmp) {
+            negative_ttl = atol(tmp);
+            xmlFree(tmp);
+        }
+        tmp = (char*)xmlGetProp(node, XMLSTR("cache-size"));
+        if (tmp) {
+            size = atol(tmp);
+            xmlFree(tmp);
+        }
+        if ((ttl > 0 || negative_ttl > 0) && size > 0)
+            auth->cache = auth_cache_new(size, ttl, negative_ttl);
+    }
+
+    auth->workers = 1;
+    tmp = (char*)xmlGetProp(node, XMLSTR("workers"));
+    if (tmp) {
+        long workers = atol(tmp);
+
+        xmlFree(tmp);
+        if (workers < 1 || workers > AUTH_WORKERS_MAX) {
+            ICECAST_LOG_ERROR("Invalid number of authentication workers: %ld (1 to %d)", workers, AUTH_WORKERS_MAX);
+            auth_release(auth);
+            return NULL;
+        }
+        auth->workers = workers;
+        auth->workers_set = 1;
+    }
+
     method = (char*)xmlGetProp(node, XMLSTR("method"));
     if (method) {
         char *cur = method;
@@ -537,7 +855,18 @@ auth_t *auth_get_authenticator(xmlNodePtr node)
             auth->tailp = &auth->head;
             if (!auth->immediate) {
                 auth->running = 1;
-                auth->thread = thread_create("auth thread", auth_run_thread, auth, THREAD_ATTACHED);
+                auth->threads = calloc(auth->workers, sizeof(thread_type *));
+                for (i = 0; auth->threads && i < auth->workers; i++) {
+                    auth->threads[i] = thread_create("auth thread", auth_run_thread, auth, THREAD_ATTACHED);
+                    if (auth->threads[i] == NULL)
+                        break;
+                    auth->thread_count++;
+                }
+                if (auth->thread_count == 0) {
+                    ICECAST_LOG_ERROR("Can not start authentication thread");
+                    auth_release(auth);
+                    auth = NULL;
+                }
             }
         }
     }
@@ -20,6 +20,7 @@
 
 struct source_tag;
 struct auth_tag;
+struct auth_cache_tag;
 
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
@@ -35,6 +36,11 @@ struct auth_tag;
 #define AUTH_TYPE_URL             "url"
 #define AUTH_TYPE_HTPASSWD        "htpasswd"
 
+/* upper bound on clients handed to a backend's authenticate_batch() */
+#define AUTH_BATCH_MAX 32
+/* upper bound on worker threads per authenticator */
+#define AUTH_WORKERS_MAX 16
+
 typedef enum
 {
     /* XXX: ??? */
@@ -62,6 +68,8 @@ typedef struct auth_client_tag
     void        (*on_no_match)(client_t *client, void (*on_result)(client_t *client, void *userdata, auth_result result), void *userdata);
     void        (*on_result)(client_t *client, void *userdata, auth_result result);
     void         *userdata;
+    uint64_t     queued;    /* stats_time_us when queued for the auth thread */
+    int          release;   /* queued by auth_release_client() rather than for authentication */
     struct auth_client_tag *next;
 } auth_client;
 
@@ -88,6 +96,13 @@ typedef struct auth_tag
     auth_result (*authenticate_client)(auth_client *aclient);
     auth_result (*release_client)(auth_client *auth_user);
 
+    /* Optional: run up to batch_max queued clients against the backend at
+     * once, storing each result in results[]. Entries with release set are
+     * releases as for release_client(), the others are authentications.
+     */
+    void (*authenticate_batch)(struct auth_tag *auth, auth_client **users, auth_result *results, size_t count);
+    size_t batch_max;
+
     /* auth state-specific free call */
     void (*free)(struct auth_tag *self);
 
@@ -96,14 +111,23 @@ typedef struct auth_tag
     auth_result (*listuser)(struct auth_tag *auth, xmlNodePtr srcnode);
 
     mutex_t lock;
+    cond_t cond; /* signalled when a client is queued */
     int running;
     size_t refcount;
 
-    thread_type *thread;
+    /* worker threads sharing the queue. Backends see workers before they
+     * are set up and must allow that many concurrent calls. workers_set
+     * is true if the count was given in the config. */
+    thread_type **threads;
+    size_t thread_count;
+    size_t workers;
+    int workers_set;
 
     /* per-auth queue for clients */
     auth_client *head, **tailp;
     int pending_count;
+    uint64_t queue_wait_us; /* total time served clients spent queued */
+    unsigned long queue_served;
 
     void *state;
     char *type;
@@ -113,9 +137,13 @@ typedef struct auth_tag
     acl_t *acl;
     /* role name for later matching, may be NULL if no role name was given in config */
     char  *role;
+
+    /* cache of backend decisions, NULL unless enabled in config */
+    struct auth_cache_tag *cache;
 } auth_t;
 
 typedef struct auth_stack_tag auth_stack_t;
+typedef struct auth_cache_tag auth_cache_t;
 
 /* prototypes for auths that do not need own header file */
 int auth_get_anonymous_auth(auth_t *auth, config_options_t *options);
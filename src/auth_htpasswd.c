@@ -43,27 +43,48 @@
 static auth_result htpasswd_adduser (auth_t *auth, const char *username, const char *password);
 static auth_result htpasswd_deleteuser(auth_t *auth, const char *username);
 static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode);
-static int _free_user (void *key);
 
-typedef struct {
+/* seconds between checks of the file for changes */
+#define HTPASSWD_RECHECK_INTERVAL   2
+
+typedef struct htpasswd_user_tag {
     char *name;
     char *pass;
+    unsigned int hash;
+    struct htpasswd_user_tag *next;
 } htpasswd_user;
 
+/* users hashed by name, never changed once built */
+typedef struct {
+    htpasswd_user **buckets;
+    size_t mask;
+    size_t count;
+} htpasswd_table;
+
 typedef struct {
     char *filename;
-    rwlock_t file_rwlock;
-    avl_tree *users;
+    rwlock_t file_rwlock;       /* protects users and the file itself */
+    htpasswd_table *users;
+
+    mutex_t reload_lock;        /* protects the fields below */
     time_t mtime;
+    time_t checked;
+    int reloading;
+    thread_type *reload_thread;
 } htpasswd_auth_state;
 
+static void htpasswd_table_free(htpasswd_table *table);
+static void htpasswd_reload_wait(htpasswd_auth_state *htpasswd);
+
 static void htpasswd_clear(auth_t *self)
 {
     htpasswd_auth_state *state = self->state;
+
+    htpasswd_reload_wait(state);
     free(state->filename);
-    if (state->users)
-        avl_tree_free (state->users, _free_user);
+    htpasswd_table_free(state->users);
     thread_rwlock_destroy(&state->file_rwlock);
+    thread_mutex_destroy(&state->reload_lock);
     free(state);
 }
 
@@ -84,68 +105,86 @@ static char *get_hash(const char *data, int len)
 }
 
 
-static int compare_users(void *arg, void *a, void *b)
+static int compare_users(const void *a, const void *b)
 {
-    htpasswd_user *user1 = (htpasswd_user *)a;
-    htpasswd_user *user2 = (htpasswd_user *)b;
-
-    (void)arg;
+    const htpasswd_user *user1 = *(htpasswd_user * const *)a;
+    const htpasswd_user *user2 = *(htpasswd_user * const *)b;
 
     return strcmp (user1->name, user2->name);
 }
 
 
-static int _free_user(void *key)
+/* FNV-1a */
+static unsigned int hash_name(const char *name)
 {
-    htpasswd_user *user = (htpasswd_user *)key;
+    unsigned int hash = 2166136261U;
 
-    free (user->name); /* ->pass is part of same buffer */
-    free (user);
-    return 1;
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619U;
+    }
+    return hash;
 }
 
 
-static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
+static void htpasswd_table_free(htpasswd_table *table)
 {
-    FILE *passwdfile;
-    avl_tree *new_users;
-    int num = 0;
-    struct stat file_stat;
-    char *sep;
-    char line [MAX_LINE_LEN];
+    size_t i;
 
-    if (htpasswd->filename == NULL)
+    if (table == NULL)
         return;
-    if (stat (htpasswd->filename, &file_stat) < 0) {
-        ICECAST_LOG_WARN("failed to check status of %s", htpasswd->filename);
 
-        /* Create a dummy users tree for things to use later */
-        thread_rwlock_wlock (&htpasswd->file_rwlock);
-        if(!htpasswd->users)
-            htpasswd->users = avl_tree_new(compare_users, NULL);
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
+    for (i = 0; i <= table->mask; i++) {
+        htpasswd_user *user = table->buckets[i];
 
-        return;
-    }
+        while (user) {
+            htpasswd_user *next = user->next;
 
-    if (file_stat.st_mtime == htpasswd->mtime) {
-        /* common case, no update to file */
-        return;
+            free (user->name); /* ->pass is part of same buffer */
+            free (user);
+            user = next;
+        }
     }
-    ICECAST_LOG_INFO("re-reading htpasswd file \"%s\"", htpasswd->filename);
-    passwdfile = fopen (htpasswd->filename, "rb");
+    free(table->buckets);
+    free(table);
+}
+
+
+static htpasswd_user *htpasswd_table_find(htpasswd_table *table, const char *name)
+{
+    unsigned int hash = hash_name(name);
+    htpasswd_user *user;
+
+    if (table == NULL)
+        return NULL;
+
+    for (user = table->buckets[hash & table->mask]; user; user = user->next)
+        if (user->hash == hash && strcmp(user->name, name) == 0)
+            return user;
+    return NULL;
+}
+
+
+/* read the file into a new table, the first entry for a name wins */
+static htpasswd_table *htpasswd_table_load(const char *filename)
+{
+    FILE *passwdfile;
+    htpasswd_table *table;
+    htpasswd_user *list = NULL, **tail = &list, *entry;
+    size_t count = 0, size = 16;
+    int num = 0;
+    char *sep;
+    char line [MAX_LINE_LEN];
+
+    passwdfile = fopen (filename, "rb");
     if (passwdfile == NULL) {
         ICECAST_LOG_WARN("Failed to open authentication database \"%s\": %s",
-                htpasswd->filename, strerror(errno));
-        return;
+                filename, strerror(errno));
+        return NULL;
     }
-    htpasswd->mtime = file_stat.st_mtime;
-
-    new_users = avl_tree_new (compare_users, NULL);
 
     while (get_line(passwdfile, line, MAX_LINE_LEN)) {
         int len;
-        htpasswd_user *entry;
 
         num++;
         if (!line[0] || line[0] == '#')
@@ -153,7 +192,7 @@ static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
 
         sep = strrchr (line, ':');
         if (sep == NULL) {
-            ICECAST_LOG_WARN("No separator on line %d (%s)", num, htpasswd->filename);
+            ICECAST_LOG_WARN("No separator on line %d (%s)", num, filename);
             continue;
         }
         entry = calloc (1, sizeof (htpasswd_user));
@@ -162,15 +201,179 @@ static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd)
         *sep = 0;
         memcpy (entry->name, line, len);
         entry->pass = entry->name + (sep-line) + 1;
-        avl_insert (new_users, entry);
+        entry->hash = hash_name(entry->name);
+        *tail = entry;
+        tail = &entry->next;
+        count++;
     }
     fclose (passwdfile);
 
+    while (size < count)
+        size <<= 1;
+    table = calloc(1, sizeof(htpasswd_table));
+    table->buckets = calloc(size, sizeof(htpasswd_user *));
+    table->mask = size - 1;
+
+    while (list) {
+        entry = list;
+        list = entry->next;
+        entry->next = NULL;
+        if (htpasswd_table_find(table, entry->name)) {
+            free (entry->name);
+            free (entry);
+            continue;
+        }
+        entry->next = table->buckets[entry->hash & table->mask];
+        table->buckets[entry->hash & table->mask] = entry;
+        table->count++;
+    }
+
+    return table;
+}
+
+
+/* swap in a new table, lookups only ever wait for the pointer swap */
+static void htpasswd_table_install(htpasswd_auth_state *htpasswd, htpasswd_table *table)
+{
+    htpasswd_table *old;
+
     thread_rwlock_wlock (&htpasswd->file_rwlock);
-    if (htpasswd->users)
-        avl_tree_free (htpasswd->users, _free_user);
-    htpasswd->users = new_users;
+    old = htpasswd->users;
+    htpasswd->users = table;
     thread_rwlock_unlock (&htpasswd->file_rwlock);
+    htpasswd_table_free(old);
+}
+
+
+/* re-read the file if it changed, reloading must be set by the caller */
+static void htpasswd_reload(htpasswd_auth_state *htpasswd)
+{
+    struct stat file_stat;
+    htpasswd_table *table = NULL;
+    int changed;
+
+    if (stat (htpasswd->filename, &file_stat) < 0) {
+        ICECAST_LOG_WARN("failed to check status of %s", htpasswd->filename);
+
+        /* Create a dummy users table for things to use later */
+        thread_rwlock_rlock (&htpasswd->file_rwlock);
+        changed = htpasswd->users == NULL;
+        thread_rwlock_unlock (&htpasswd->file_rwlock);
+        if (changed) {
+            table = calloc(1, sizeof(htpasswd_table));
+            table->buckets = calloc(1, sizeof(htpasswd_user *));
+            htpasswd_table_install(htpasswd, table);
+        }
+        return;
+    }
+
+    thread_mutex_lock (&htpasswd->reload_lock);
+    changed = file_stat.st_mtime != htpasswd->mtime;
+    thread_mutex_unlock (&htpasswd->reload_lock);
+    if (!changed) {
+        /* common case, no update to file */
+        return;
+    }
+
+    ICECAST_LOG_INFO("re-reading htpasswd file \"%s\"", htpasswd->filename);
+    table = htpasswd_table_load(htpasswd->filename);
+    if (table == NULL)
+        return;
+
+    thread_mutex_lock (&htpasswd->reload_lock);
+    htpasswd->mtime = file_stat.st_mtime;
+    thread_mutex_unlock (&htpasswd->reload_lock);
+
+    htpasswd_table_install(htpasswd, table);
+    ICECAST_LOG_INFO("loaded %lu users from \"%s\"", (unsigned long)table->count, htpasswd->filename);
+}
+
+
+static void *htpasswd_reload_thread(void *arg)
+{
+    htpasswd_auth_state *htpasswd = arg;
+
+    htpasswd_reload(htpasswd);
+
+    thread_mutex_lock (&htpasswd->reload_lock);
+    htpasswd->reloading = 0;
+    thread_mutex_unlock (&htpasswd->reload_lock);
+    return NULL;
+}
+
+
+/* wait for a background reload, if any, and reap its thread */
+static void htpasswd_reload_wait(htpasswd_auth_state *htpasswd)
+{
+    thread_type *thread;
+
+    while (1) {
+        thread_mutex_lock (&htpasswd->reload_lock);
+        if (htpasswd->reloading == 0)
+            break;
+        thread_mutex_unlock (&htpasswd->reload_lock);
+        thread_sleep (10000);
+    }
+    thread = htpasswd->reload_thread;
+    htpasswd->reload_thread = NULL;
+    thread_mutex_unlock (&htpasswd->reload_lock);
+
+    if (thread)
+        thread_join(thread);
+}
+
+
+/* Check the file for changes. From the auth path this is rate limited and
+ * a changed file is read by a background thread while lookups carry on
+ * against the current table. With sync set the reload is done before
+ * returning, for operations that need to see the file as it is now.
+ */
+static void htpasswd_recheckfile(htpasswd_auth_state *htpasswd, int sync)
+{
+    time_t now = time(NULL);
+    thread_type *finished = NULL;
+
+    if (htpasswd->filename == NULL)
+        return;
+
+    if (sync) {
+        htpasswd_reload_wait(htpasswd);
+        thread_mutex_lock (&htpasswd->reload_lock);
+        htpasswd->reloading = 1;
+        htpasswd->checked = now;
+        thread_mutex_unlock (&htpasswd->reload_lock);
+
+        htpasswd_reload(htpasswd);
+
+        thread_mutex_lock (&htpasswd->reload_lock);
+        htpasswd->reloading = 0;
+        thread_mutex_unlock (&htpasswd->reload_lock);
+        return;
+    }
+
+    thread_mutex_lock (&htpasswd->reload_lock);
+    if (htpasswd->reloading || (now - htpasswd->checked) < HTPASSWD_RECHECK_INTERVAL) {
+        thread_mutex_unlock (&htpasswd->reload_lock);
+        return;
+    }
+    htpasswd->checked = now;
+    finished = htpasswd->reload_thread;
+    htpasswd->reload_thread = NULL;
+    htpasswd->reloading = 1;
+    thread_mutex_unlock (&htpasswd->reload_lock);
+
+    /* the last reload has finished, as reloading was clear */
+    if (finished)
+        thread_join(finished);
+
+    finished = thread_create("htpasswd reload", htpasswd_reload_thread, htpasswd, THREAD_ATTACHED);
+    thread_mutex_lock (&htpasswd->reload_lock);
+    if (finished) {
+        htpasswd->reload_thread = finished;
+    } else {
+        htpasswd->reloading = 0;
+    }
+    thread_mutex_unlock (&htpasswd->reload_lock);
 }
 
 
@@ -179,8 +382,9 @@ static auth_result htpasswd_auth (auth_client *auth_user)
     auth_t *auth = auth_user->client->auth;
     htpasswd_auth_state *htpasswd = auth->state;
     client_t *client = auth_user->client;
-    htpasswd_user entry;
-    void *result;
+    htpasswd_user *found;
+    char *hashed_pw;
+    int match;
 
     if (!client->username || !client->password)
         return AUTH_NOMATCH;
@@ -189,26 +393,23 @@ static auth_result htpasswd_auth (auth_client *auth_user)
         ICECAST_LOG_ERROR("No filename given in options for authenticator.");
         return AUTH_NOMATCH;
     }
-    htpasswd_recheckfile (htpasswd);
+    htpasswd_recheckfile (htpasswd, 0);
+
+    hashed_pw = get_hash (client->password, strlen (client->password));
 
     thread_rwlock_rlock (&htpasswd->file_rwlock);
-    entry.name = client->username;
-    if (avl_get_by_key (htpasswd->users, &entry, &result) == 0) {
-        htpasswd_user *found = result;
-        char *hashed_pw;
+    found = htpasswd_table_find (htpasswd->users, client->username);
+    match = found && hashed_pw && strcmp (found->pass, hashed_pw) == 0;
+    thread_rwlock_unlock (&htpasswd->file_rwlock);
+    free (hashed_pw);
 
-        thread_rwlock_unlock (&htpasswd->file_rwlock);
-        hashed_pw = get_hash (client->password, strlen (client->password));
-        if (strcmp (found->pass, hashed_pw) == 0) {
-            free (hashed_pw);
-            return AUTH_OK;
-        }
-        free (hashed_pw);
+    if (match)
+        return AUTH_OK;
+    if (found) {
         ICECAST_LOG_DEBUG("incorrect password for client with username: %s", client->username);
         return AUTH_FAILED;
     }
     ICECAST_LOG_DEBUG("no such username: %s", client->username);
-    thread_rwlock_unlock (&htpasswd->file_rwlock);
     return AUTH_NOMATCH;
 }
 
@@ -221,7 +422,9 @@ int  auth_get_htpasswd_auth (auth_t *authenticator, config_options_t *options)
     authenticator->adduser = htpasswd_adduser;
     authenticator->deleteuser = htpasswd_deleteuser;
     authenticator->listuser = htpasswd_userlist;
-    authenticator->immediate = 1;
+    /* lookups are cheap, but re-reading a changed file is not. With
+     * workers configured that happens on the auth threads instead. */
+    authenticator->immediate = !authenticator->workers_set;
 
     state = calloc(1, sizeof(htpasswd_auth_state));
 
@@ -243,7 +446,8 @@ int  auth_get_htpasswd_auth (auth_t *authenticator, config_options_t *options)
     authenticator->state = state;
 
     thread_rwlock_create(&state->file_rwlock);
-    htpasswd_recheckfile(state);
+    thread_mutex_create(&state->reload_lock);
+    htpasswd_recheckfile(state, 1);
 
     return 0;
 }
@@ -254,15 +458,12 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
     FILE *passwdfile;
     char *hashed_password = NULL;
     htpasswd_auth_state *state = auth->state;
-    htpasswd_user entry;
-    void *result;
 
-    htpasswd_recheckfile (state);
+    htpasswd_recheckfile (state, 1);
 
     thread_rwlock_wlock (&state->file_rwlock);
 
-    entry.name = (char*)username;
-    if (avl_get_by_key (state->users, &entry, &result) == 0) {
+    if (htpasswd_table_find (state->users, username)) {
         thread_rwlock_unlock (&state->file_rwlock);
         return AUTH_USEREXISTS;
     }
@@ -284,6 +485,7 @@ static auth_result htpasswd_adduser (auth_t *auth, const char *username, const c
 
     fclose(passwdfile);
     thread_rwlock_unlock (&state->file_rwlock);
+    htpasswd_recheckfile(state, 1);
 
     return AUTH_USERADDED;
 }
@@ -369,7 +571,7 @@ static auth_result htpasswd_deleteuser(auth_t *auth, const char *username)
     }
     free(tmpfile);
     thread_rwlock_unlock(&state->file_rwlock);
-    htpasswd_recheckfile(state);
+    htpasswd_recheckfile(state, 1);
 
     return AUTH_USERDELETED;
 }
@@ -379,22 +581,35 @@ static auth_result htpasswd_userlist(auth_t *auth, xmlNodePtr srcnode)
 {
     htpasswd_auth_state *state;
     xmlNodePtr newnode;
-    avl_node *node;
+    htpasswd_user **users, *user;
+    size_t i, count = 0;
 
     state = auth->state;
 
-    htpasswd_recheckfile(state);
+    htpasswd_recheckfile(state, 1);
 
     thread_rwlock_rlock(&state->file_rwlock);
-    node = avl_get_first(state->users);
-    while (node) {
-        htpasswd_user *user = (htpasswd_user *)node->key;
+    if (state->users == NULL || state->users->count == 0) {
+        thread_rwlock_unlock(&state->file_rwlock);
+        return AUTH_OK;
+    }
+    /* the table is unordered, list users by name as before */
+    users = malloc(state->users->count * sizeof(htpasswd_user *));
+    if (users == NULL) {
+        thread_rwlock_unlock(&state->file_rwlock);
+        return AUTH_FAILED;
+    }
+    for (i = 0; i <= state->users->mask; i++)
+        for (user = state->users->buckets[i]; user; user = user->next)
+            users[count++] = user;
+    qsort(users, count, sizeof(htpasswd_user *), compare_users);
+    for (i = 0; i < count; i++) {
         newnode = xmlNewChild(srcnode, NULL, XMLSTR("user"), NULL);
-        xmlNewTextChild(newnode, NULL, XMLSTR("username"), XMLSTR(user->name));
-        xmlNewTextChild(newnode, NULL, XMLSTR("password"), XMLSTR(user->pass));
-        node = avl_get_next(node);
+        xmlNewTextChild(newnode, NULL, XMLSTR("username"), XMLSTR(users[i]->name));
+        xmlNewTextChild(newnode, NULL, XMLSTR("password"), XMLSTR(users[i]->pass));
     }
     thread_rwlock_unlock(&state->file_rwlock);
+    free(users);
 
     return AUTH_OK;
 }
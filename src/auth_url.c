@@ -77,6 +77,26 @@
 #include "logging.h"
 #define CATMODULE "auth_url"
 
+/* One request to the auth server. The easy handles are kept for the
+ * lifetime of the auth so libcurl can reuse its connections to the server.
+ */
+typedef struct {
+    CURL        *handle;
+    char         errormsg[CURL_ERROR_SIZE];
+    auth_result  result;
+    auth_client *auth_user; /* NULL when idle */
+    char        *userpwd;
+    char         post[4096];
+} auth_url_request;
+
+/* the requests of one auth worker, requests[0] serves the one at a time
+ * case, all of them are used through multi when max_inflight is above 1 */
+typedef struct {
+    auth_url_request *requests;
+    CURLM      *multi;
+    int         busy;
+} auth_url_lane;
+
 typedef struct {
     char       *pass_headers; // headers passed from client to addurl.
     char       *prefix_headers; // prefix for passed headers.
@@ -91,20 +111,33 @@ typedef struct {
     char       *timelimit_header;
     int         timelimit_header_len;
     char       *userpwd;
-    CURL       *handle;
-    char        errormsg[CURL_ERROR_SIZE];
-    auth_result result;
+    /* one lane per auth worker */
+    mutex_t     lanes_lock;
+    auth_url_lane *lanes;
+    size_t      lane_count;
+    size_t      request_count;  /* per lane */
 } auth_url;
 
 
 static void auth_url_clear(auth_t *self)
 {
     auth_url *url;
+    size_t i, j;
 
     ICECAST_LOG_INFO("Doing auth URL cleanup");
     url = self->state;
     self->state = NULL;
-    icecast_curl_free(url->handle);
+    for (i = 0; i < url->lane_count; i++) {
+        auth_url_lane *lane = &url->lanes[i];
+
+        for (j = 0; lane->requests && j < url->request_count; j++)
+            icecast_curl_free(lane->requests[j].handle);
+        if (lane->multi)
+            curl_multi_cleanup(lane->multi);
+        free(lane->requests);
+    }
+    free(url->lanes);
+    thread_mutex_destroy(&url->lanes_lock);
     free(url->username);
     free(url->password);
     free(url->pass_headers);
@@ -124,15 +157,15 @@ static size_t handle_returned_header(void      *ptr,
                                      size_t    nmemb,
                                      void      *stream)
 {
-    auth_client *auth_user = stream;
+    auth_url_request *request = stream;
     unsigned bytes = size * nmemb;
-    client_t *client = auth_user->client;
+    client_t *client = request->auth_user->client;
 
     if (client) {
         auth_t *auth = client->auth;
         auth_url *url = auth->state;
         if (strncasecmp(ptr, url->auth_header, url->auth_header_len) == 0)
-            url->result = AUTH_OK;
+            request->result = AUTH_OK;
         if (strncasecmp(ptr, url->timelimit_header,
                 url->timelimit_header_len) == 0) {
             unsigned int limit = 0;
@@ -141,10 +174,10 @@ static size_t handle_returned_header(void      *ptr,
         }
         if (strncasecmp (ptr, "icecast-auth-message: ", 22) == 0) {
             char *eol;
-            snprintf(url->errormsg, sizeof(url->errormsg), "%s", (char*)ptr+22);
-            eol = strchr(url->errormsg, '\r');
+            snprintf(request->errormsg, sizeof(request->errormsg), "%s", (char*)ptr+22);
+            eol = strchr(request->errormsg, '\r');
             if (eol == NULL)
-                eol = strchr(url->errormsg, '\n');
+                eol = strchr(request->errormsg, '\n');
             if (eol)
                 *eol = '\0';
         }
@@ -153,11 +186,84 @@ static size_t handle_returned_header(void      *ptr,
     return (int)bytes;
 }
 
-static auth_result url_remove_client(auth_client *auth_user)
+/* take the lane of the calling worker, there is one per worker */
+static auth_url_lane *url_lane_get(auth_url *url)
+{
+    auth_url_lane *lane = NULL;
+    size_t i;
+
+    thread_mutex_lock(&url->lanes_lock);
+    for (i = 0; i < url->lane_count; i++) {
+        if (url->lanes[i].busy == 0) {
+            lane = &url->lanes[i];
+            lane->busy = 1;
+            break;
+        }
+    }
+    thread_mutex_unlock(&url->lanes_lock);
+    if (lane == NULL)
+        ICECAST_LOG_ERROR("no free auth request lane");
+    return lane;
+}
+
+static void url_lane_put(auth_url *url, auth_url_lane *lane)
+{
+    thread_mutex_lock(&url->lanes_lock);
+    lane->busy = 0;
+    thread_mutex_unlock(&url->lanes_lock);
+}
+
+/* set the credentials and target of a request whose post data is filled in */
+static void url_request_prepare(auth_url         *url,
+                                auth_url_request *request,
+                                auth_client      *auth_user,
+                                const char       *target)
+{
+    client_t *client = auth_user->client;
+
+    request->auth_user = auth_user;
+    request->userpwd = NULL;
+
+    if (strchr(target, '@') == NULL) {
+        if (url->userpwd) {
+            curl_easy_setopt(request->handle, CURLOPT_USERPWD, url->userpwd);
+        } else {
+            /* auth'd requests may not have a user/pass, but may use query args */
+            if (client->username && client->password) {
+                size_t len = strlen(client->username) +
+                    strlen(client->password) + 2;
+                request->userpwd = malloc(len);
+                snprintf(request->userpwd, len, "%s:%s",
+                    client->username, client->password);
+                curl_easy_setopt(request->handle, CURLOPT_USERPWD, request->userpwd);
+            } else {
+                curl_easy_setopt(request->handle, CURLOPT_USERPWD, "");
+            }
+        }
+    } else {
+        /* url has user/pass but libcurl may need to clear any existing settings */
+        curl_easy_setopt(request->handle, CURLOPT_USERPWD, "");
+    }
+    curl_easy_setopt(request->handle, CURLOPT_URL, target);
+    curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, request->post);
+    curl_easy_setopt(request->handle, CURLOPT_WRITEHEADER, request);
+    request->errormsg[0] = '\0';
+    request->result = AUTH_FAILED;
+}
+
+static void url_request_finish(auth_url_request *request)
+{
+    free(request->userpwd);
+    request->userpwd = NULL;
+    request->auth_user = NULL;
+}
+
+/* build the listener_remove request, returns 0 if there is nothing to send */
+static int url_remove_setup(auth_url         *url,
+                            auth_url_request *request,
+                            auth_client      *auth_user)
 {
     client_t       *client      = auth_user->client;
-    auth_t         *auth        = client->auth;
-    auth_url       *url         = auth->state;
     time_t          duration    = time(NULL) - client->con->con_time;
     char           *username,
                    *password,
@@ -166,14 +272,12 @@ static auth_result url_remove_client(auth_client *auth_user)
     const char     *mountreq;
     ice_config_t   *config;
     int             port;
-    char           *userpwd     = NULL,
-                    post[4096];
     const char     *agent;
     char           *user_agent,
                    *ipaddr;
 
     if (url->removeurl == NULL)
-        return AUTH_OK;
+        return 0;
 
     config = config_get_config();
     server = util_url_escape(config->hostname);
@@ -206,7 +310,7 @@ static auth_result url_remove_client(auth_client *auth_user)
     mount = util_url_escape(mountreq);
     ipaddr = util_url_escape(client->con->ip);
 
-    snprintf(post, sizeof (post),
+    snprintf(request->post, sizeof (request->post),
             "action=%s&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&duration=%lu&ip=%s&agent=%s",
             url->removeaction, /* already escaped */
@@ -220,47 +324,49 @@ static auth_result url_remove_client(auth_client *auth_user)
     free(ipaddr);
     free(user_agent);
 
-    if (strchr (url->removeurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) +
-                    strlen(client->password) + 2;
-                userpwd = malloc(len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-    }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->removeurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
+    url_request_prepare(url, request, auth_user, url->removeurl);
+    return 1;
+}
 
-    if (curl_easy_perform (url->handle))
+static auth_result url_remove_result(auth_url         *url,
+                                     auth_url_request *request,
+                                     CURLcode          res)
+{
+    if (res)
         ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->removeurl, url->errormsg);
+            url->removeurl, request->errormsg);
 
-    free(userpwd);
+    url_request_finish(request);
 
     return AUTH_OK;
 }
 
+static auth_result url_remove_client(auth_client *auth_user)
+{
+    auth_url          *url      = auth_user->client->auth->state;
+    auth_url_lane     *lane     = url_lane_get(url);
+    auth_url_request  *request;
+    auth_result        result   = AUTH_OK;
 
-static auth_result url_add_client(auth_client *auth_user)
+    if (lane == NULL)
+        return AUTH_OK;
+
+    request = &lane->requests[0];
+    if (url_remove_setup(url, request, auth_user))
+        result = url_remove_result(url, request, curl_easy_perform(request->handle));
+
+    url_lane_put(url, lane);
+    return result;
+}
+
+
+/* build the listener_add request, returns 0 if there is nothing to send */
+static int url_add_setup(auth_url         *url,
+                         auth_url_request *request,
+                         auth_client      *auth_user)
 {
     client_t       *client      = auth_user->client;
-    auth_t         *auth        = client->auth;
-    auth_url       *url         = auth->state;
-    int             res         = 0,
-                    port;
+    int             port;
     const char     *agent;
     char           *user_agent,
                    *username,
@@ -270,7 +376,7 @@ static auth_result url_add_client(auth_client *auth_user)
                    *ipaddr,
                    *server;
     ice_config_t   *config;
-    char           *userpwd    = NULL, post [4096];
+    char           *post        = request->post;
     ssize_t         post_offset;
     char           *pass_headers,
                    *cur_header,
@@ -279,7 +385,7 @@ static auth_result url_add_client(auth_client *auth_user)
     char           *header_valesc;
 
     if (url->addurl == NULL)
-        return AUTH_OK;
+        return 0;
 
     config = config_get_config();
     server = util_url_escape(config->hostname);
@@ -312,7 +418,7 @@ static auth_result url_add_client(auth_client *auth_user)
     mount = util_url_escape(mountreq);
     ipaddr = util_url_escape(client->con->ip);
 
-    post_offset = snprintf(post, sizeof (post),
+    post_offset = snprintf(post, sizeof (request->post),
             "action=%s&server=%s&port=%d&client=%lu&mount=%s"
             "&user=%s&pass=%s&ip=%s&agent=%s",
             url->addaction, /* already escaped */
@@ -342,7 +448,7 @@ static auth_result url_add_client(auth_client *auth_user)
             if (header_val) {
                 header_valesc = util_url_escape (header_val);
                 post_offset += snprintf(post + post_offset,
-                                        sizeof(post) - post_offset,
+                                        sizeof(request->post) - post_offset,
                                         "&%s%s=%s",
                                         url->prefix_headers ? url->prefix_headers : "",
                                         cur_header, header_valesc);
@@ -353,46 +459,127 @@ static auth_result url_add_client(auth_client *auth_user)
         }
     }
 
-    if (strchr(url->addurl, '@') == NULL) {
-        if (url->userpwd) {
-            curl_easy_setopt(url->handle, CURLOPT_USERPWD, url->userpwd);
-        } else {
-            /* auth'd requests may not have a user/pass, but may use query args */
-            if (client->username && client->password) {
-                size_t len = strlen(client->username) + strlen(client->password) + 2;
-                userpwd = malloc (len);
-                snprintf(userpwd, len, "%s:%s",
-                    client->username, client->password);
-                curl_easy_setopt(url->handle, CURLOPT_USERPWD, userpwd);
-            } else {
-                curl_easy_setopt (url->handle, CURLOPT_USERPWD, "");
-            }
-        }
-    } else {
-        /* url has user/pass but libcurl may need to clear any existing settings */
-        curl_easy_setopt(url->handle, CURLOPT_USERPWD, "");
-    }
-    curl_easy_setopt(url->handle, CURLOPT_URL, url->addurl);
-    curl_easy_setopt(url->handle, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt(url->handle, CURLOPT_WRITEHEADER, auth_user);
-    url->errormsg[0] = '\0';
+    url_request_prepare(url, request, auth_user, url->addurl);
+    return 1;
+}
 
-    url->result = AUTH_FAILED;
-    res = curl_easy_perform(url->handle);
+static auth_result url_add_result(auth_url         *url,
+                                  auth_url_request *request,
+                                  CURLcode          res)
+{
+    auth_result result = request->result;
 
-    free(userpwd);
+    url_request_finish(request);
 
     if (res) {
         ICECAST_LOG_WARN("auth to server %s failed with %s",
-            url->addurl, url->errormsg);
+            url->addurl, request->errormsg);
         return AUTH_FAILED;
     }
     /* we received a response, lets see what it is */
-    if (url->result == AUTH_FAILED) {
+    if (result == AUTH_FAILED) {
         ICECAST_LOG_INFO("client auth (%s) failed with \"%s\"",
-            url->addurl, url->errormsg);
+            url->addurl, request->errormsg);
+    }
+    return result;
+}
+
+static auth_result url_add_client(auth_client *auth_user)
+{
+    auth_url          *url      = auth_user->client->auth->state;
+    auth_url_lane     *lane     = url_lane_get(url);
+    auth_url_request  *request;
+    auth_result        result   = AUTH_OK;
+
+    if (lane == NULL)
+        return AUTH_FAILED;
+
+    request = &lane->requests[0];
+    if (url_add_setup(url, request, auth_user))
+        result = url_add_result(url, request, curl_easy_perform(request->handle));
+
+    url_lane_put(url, lane);
+    return result;
+}
+
+/* run a batch of adds and removes concurrently, request i serves users[i] */
+static void url_batch(auth_t        *auth,
+                      auth_client  **users,
+                      auth_result   *results,
+                      size_t         count)
+{
+    auth_url   *url         = auth->state;
+    auth_url_lane *lane     = url_lane_get(url);
+    size_t      i,
+                active      = 0;
+    int         running     = 0,
+                left;
+    CURLMsg    *msg;
+
+    if (lane == NULL) {
+        for (i = 0; i < count; i++)
+            results[i] = users[i]->release ? AUTH_OK : AUTH_FAILED;
+        return;
+    }
+
+    for (i = 0; i < count && i < url->request_count; i++) {
+        auth_url_request *request = &lane->requests[i];
+        int queued;
+
+        if (users[i]->release) {
+            queued = url_remove_setup(url, request, users[i]);
+        } else {
+            queued = url_add_setup(url, request, users[i]);
+        }
+        results[i] = AUTH_OK;
+        if (queued == 0)
+            continue;
+        curl_easy_setopt(request->handle, CURLOPT_PRIVATE, request);
+        curl_multi_add_handle(lane->multi, request->handle);
+        active++;
+    }
+    for (; i < count; i++)
+        results[i] = users[i]->release ? AUTH_OK : AUTH_FAILED;
+
+    while (active) {
+        if (curl_multi_perform(lane->multi, &running) != CURLM_OK)
+            break;
+        while ((msg = curl_multi_info_read(lane->multi, &left))) {
+            auth_url_request *request;
+            char *priv = NULL;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+            request = (auth_url_request *)priv;
+            i = request - lane->requests;
+            curl_multi_remove_handle(lane->multi, request->handle);
+            if (users[i]->release) {
+                results[i] = url_remove_result(url, request, msg->data.result);
+            } else {
+                results[i] = url_add_result(url, request, msg->data.result);
+            }
+            active--;
+        }
+        if (active && running)
+            curl_multi_wait(lane->multi, NULL, 0, 1000, NULL);
     }
-    return url->result;
+
+    /* only left over if the multi handle itself failed */
+    for (i = 0; active && i < count && i < url->request_count; i++) {
+        auth_url_request *request = &lane->requests[i];
+
+        if (request->auth_user == NULL)
+            continue;
+        ICECAST_LOG_WARN("auth request for client %lu abandoned", request->auth_user->client->con->id);
+        curl_multi_remove_handle(lane->multi, request->handle);
+        url_request_finish(request);
+        if (!users[i]->release)
+            results[i] = AUTH_FAILED;
+        active--;
+    }
+
+    url_lane_put(url, lane);
 }
 
 static auth_result auth_url_adduser(auth_t      *auth,
@@ -417,6 +604,8 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     auth_url    *url_info;
     const char  *addaction      = "listener_add";
     const char  *removeaction   = "listener_remove";
+    long         max_inflight   = 1;
+    size_t       i, j;
 
     authenticator->free         = auth_url_clear;
     authenticator->adduser      = auth_url_adduser;
@@ -425,6 +614,7 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
 
     url_info                    = calloc(1, sizeof(auth_url));
     authenticator->state        = url_info;
+    thread_mutex_create(&url_info->lanes_lock);
 
     /* default headers */
     url_info->auth_header       = strdup("icecast-auth-user: 1\r\n");
@@ -463,6 +653,8 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
         } else if (strcmp(options->name, "timelimit_header") == 0) {
             free(url_info->timelimit_header);
             url_info->timelimit_header = strdup(options->value);
+        } else if (strcmp(options->name, "max_inflight") == 0) {
+            max_inflight = atol(options->value);
         } else {
             ICECAST_LOG_ERROR("Unknown option: %s", options->name);
         }
@@ -472,19 +664,57 @@ int auth_get_url_auth(auth_t *authenticator, config_options_t *options)
     url_info->addaction = util_url_escape(addaction);
     url_info->removeaction = util_url_escape(removeaction);
 
-    url_info->handle = icecast_curl_new(NULL, &url_info->errormsg[0]);
-    if (url_info->handle == NULL) {
+    if (max_inflight < 1)
+        max_inflight = 1;
+    if (max_inflight > AUTH_BATCH_MAX)
+        max_inflight = AUTH_BATCH_MAX;
+
+    url_info->request_count = max_inflight;
+    url_info->lanes = calloc(authenticator->workers, sizeof(auth_url_lane));
+    if (url_info->lanes == NULL) {
         auth_url_clear(authenticator);
         return -1;
     }
+    for (i = 0; i < authenticator->workers; i++) {
+        auth_url_lane *lane = &url_info->lanes[i];
+
+        url_info->lane_count++;
+        lane->requests = calloc(max_inflight, sizeof(auth_url_request));
+        if (lane->requests == NULL) {
+            auth_url_clear(authenticator);
+            return -1;
+        }
+        for (j = 0; j < (size_t)max_inflight; j++) {
+            auth_url_request *request = &lane->requests[j];
+
+            request->handle = icecast_curl_new(NULL, &request->errormsg[0]);
+            if (request->handle == NULL) {
+                auth_url_clear(authenticator);
+                return -1;
+            }
+            curl_easy_setopt(request->handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
+        }
+
+        if (max_inflight > 1) {
+            lane->multi = curl_multi_init();
+            if (lane->multi == NULL) {
+                auth_url_clear(authenticator);
+                return -1;
+            }
+            /* keep one idle connection per slot open to the auth server */
+            curl_multi_setopt(lane->multi, CURLMOPT_MAXCONNECTS, max_inflight);
+        }
+    }
+    if (max_inflight > 1) {
+        authenticator->authenticate_batch = url_batch;
+        authenticator->batch_max = max_inflight;
+    }
 
     if (url_info->auth_header)
         url_info->auth_header_len = strlen (url_info->auth_header);
     if (url_info->timelimit_header)
         url_info->timelimit_header_len = strlen (url_info->timelimit_header);
 
-    curl_easy_setopt(url_info->handle, CURLOPT_HEADERFUNCTION, handle_returned_header);
-
     if (url_info->username && url_info->password) {
         int len = strlen(url_info->username) + strlen(url_info->password) + 2;
         url_info->userpwd = malloc(len);
@@ -0,0 +1,595 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench.c
+ **
+ ** helpers shared by the benchmark programs. Timing and the report, the
+ ** corpus files, the synthetic streams used when no recordings are given
+ ** and sources which read a stream from memory.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <ogg/ogg.h>
+
+#include "common/thread/thread.h"
+#include "common/net/sock.h"
+#include "common/httpp/httpp.h"
+
+#include "bench.h"
+#include "cfgfile.h"
+#include "global.h"
+#include "connection.h"
+#include "refbuf.h"
+#include "objpool.h"
+#include "client.h"
+#include "stats.h"
+#include "playlist.h"
+#include "format.h"
+#include "yp.h"
+#include "logging.h"
+
+#define CATMODULE "bench"
+
+/* the most handed back by one read, about what a socket read gets */
+#define BENCH_READ_SIZE     4096
+
+double bench_seconds = 1.0;
+const char *bench_only;
+
+/* a connection reading from memory, con comes first so the read hook can
+ * find the rest */
+typedef struct bench_feed_tag
+{
+    connection_t con;
+    const char *data;
+    size_t len;
+    size_t pos;
+} bench_feed_t;
+
+
+void bench_initialize (void)
+{
+    log_initialize ();
+    thread_initialize ();
+    sock_initialize ();
+    config_initialize ();
+    global_initialize ();
+    refbuf_initialize ();
+    objpool_initialize ();
+    stats_initialize ();
+    yp_initialize ();
+    global.running = ICECAST_RUNNING;
+}
+
+
+void bench_shutdown (void)
+{
+    global.running = ICECAST_HALTING;
+    yp_shutdown ();
+    stats_shutdown ();
+    refbuf_shutdown ();
+    objpool_shutdown ();
+    global_shutdown ();
+    config_shutdown ();
+    sock_shutdown ();
+    thread_shutdown ();
+    log_shutdown ();
+}
+
+
+uint64_t bench_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* returns 0 if the benchmark is not one of those asked for */
+int bench_start (bench_t *bench, const char *name, const char *corpus)
+{
+    if (bench_only && strstr (name, bench_only) == NULL)
+        return 0;
+    bench->name = name;
+    bench->corpus = corpus;
+    bench->ops = 0;
+    bench->bytes = 0;
+    bench->start = bench_now_ns ();
+    return 1;
+}
+
+
+/* true until the time for the benchmark is up, checked between batches */
+int bench_running (bench_t *bench)
+{
+    return bench_now_ns () - bench->start < (uint64_t)(bench_seconds * 1e9);
+}
+
+
+void bench_report (bench_t *bench)
+{
+    double seconds = (bench_now_ns () - bench->start) / 1e9;
+
+    printf ("{\"benchmark\": \"%s\", \"corpus\": \"%s\", \"ops\": %" PRIu64
+            ", \"bytes\": %" PRIu64 ", \"seconds\": %.6f, \"ns_per_op\": %.1f"
+            ", \"mb_per_s\": %.2f}\n",
+            bench->name, bench->corpus, bench->ops, bench->bytes, seconds,
+            bench->ops ? seconds * 1e9 / bench->ops : 0.0,
+            seconds > 0 ? bench->bytes / seconds / 1e6 : 0.0);
+    fflush (stdout);
+}
+
+
+void bench_data_append (bench_data_t *data, const void *buf, size_t len)
+{
+    char *grown = realloc (data->data, data->len + len + 1);
+
+    if (grown == NULL)
+        abort ();
+    data->data = grown;
+    memcpy (data->data + data->len, buf, len);
+    data->len += len;
+    data->data [data->len] = '\0';
+}
+
+
+void bench_data_free (bench_data_t *data)
+{
+    free (data->data);
+    data->data = NULL;
+    data->len = 0;
+}
+
+
+/* read a file, relative to dir if given. Returns -1 if it cannot be read */
+int bench_load (bench_data_t *data, const char *dir, const char *name)
+{
+    char path [4096], buf [16384];
+    FILE *file;
+    size_t len;
+
+    if (dir)
+        snprintf (path, sizeof (path), "%s/%s", dir, name);
+    else
+        snprintf (path, sizeof (path), "%s", name);
+    file = fopen (path, "rb");
+    if (file == NULL)
+    {
+        fprintf (stderr, "unable to read %s: %s\n", path, strerror (errno));
+        return -1;
+    }
+    while ((len = fread (buf, 1, sizeof (buf), file)) > 0)
+        bench_data_append (data, buf, len);
+    fclose (file);
+    return 0;
+}
+
+
+/* the next line of a text corpus without its line ending, NULL at the end */
+const char *bench_next_line (const bench_data_t *data, size_t *pos, size_t *len)
+{
+    const char *line, *end;
+
+    if (data->data == NULL || *pos >= data->len)
+        return NULL;
+    line = data->data + *pos;
+    end = memchr (line, '\n', data->len - *pos);
+    if (end == NULL)
+        end = data->data + data->len;
+    *pos = end - data->data + 1;
+    *len = end - line;
+    if (*len && line [*len - 1] == '\r')
+        (*len)--;
+    return line;
+}
+
+
+/* a fixed sequence so that runs can be compared */
+uint32_t bench_random (void)
+{
+    static uint32_t state = 2463534242U;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+
+static void bench_fill (unsigned char *buf, size_t len)
+{
+    while (len--)
+        *buf++ = (unsigned char)bench_random ();
+}
+
+
+void bench_mark (unsigned char *buf, uint32_t seq)
+{
+    memcpy (buf, BENCH_MARKER, 4);
+    buf [4] = seq >> 24;
+    buf [5] = (seq >> 16) & 0xff;
+    buf [6] = (seq >> 8) & 0xff;
+    buf [7] = seq & 0xff;
+}
+
+
+/* returns 1 if a marker starts at buf, which has BENCH_MARKER_SIZE bytes */
+int bench_marker (const unsigned char *buf, uint32_t *seq)
+{
+    if (memcmp (buf, BENCH_MARKER, 4) != 0)
+        return 0;
+    *seq = ((uint32_t)buf [4] << 24) | ((uint32_t)buf [5] << 16) |
+        ((uint32_t)buf [6] << 8) | buf [7];
+    return 1;
+}
+
+
+static void bench_append_pages (bench_data_t *data, ogg_stream_state *os, int flush)
+{
+    ogg_page page;
+
+    while (flush ? ogg_stream_flush (os, &page) : ogg_stream_pageout (os, &page))
+    {
+        bench_data_append (data, page.header, page.header_len);
+        bench_data_append (data, page.body, page.body_len);
+    }
+}
+
+
+/* Ogg Opus, stereo 20ms packets at about 64kbps. The packets are not real
+ * audio but the plugin only looks at the pages */
+void bench_make_opus (bench_data_t *data, unsigned int seconds)
+{
+    static const unsigned char head[19] = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',
+        1, 2, 0x38, 0x01, 0x80, 0xbb, 0, 0, 0, 0, 0 };
+    static const unsigned char tags[] = { 'O', 'p', 'u', 's', 'T', 'a', 'g', 's',
+        13, 0, 0, 0, 'i', 'c', 'e', 'c', 'a', 's', 't', ' ', 'b', 'e', 'n', 'c', 'h',
+        0, 0, 0, 0 };
+    unsigned char audio [160];
+    ogg_stream_state os;
+    ogg_packet packet;
+    unsigned int i;
+
+    ogg_stream_init (&os, 0x1cec);
+    memset (&packet, 0, sizeof (packet));
+    packet.packet = (unsigned char *)head;
+    packet.bytes = sizeof (head);
+    packet.b_o_s = 1;
+    ogg_stream_packetin (&os, &packet);
+    bench_append_pages (data, &os, 1);
+
+    packet.packet = (unsigned char *)tags;
+    packet.bytes = sizeof (tags);
+    packet.b_o_s = 0;
+    packet.packetno = 1;
+    ogg_stream_packetin (&os, &packet);
+    bench_append_pages (data, &os, 1);
+
+    for (i = 0; i < seconds * 50; i++)
+    {
+        bench_fill (audio, sizeof (audio));
+        audio[0] = 0xfc;    /* CELT fullband 20ms, stereo */
+        bench_mark (audio + 1, i);
+        packet.packet = audio;
+        packet.bytes = sizeof (audio);
+        packet.packetno = i + 2;
+        packet.granulepos = (ogg_int64_t)(i + 1) * 960;
+        packet.e_o_s = (i + 1 == seconds * 50);
+        ogg_stream_packetin (&os, &packet);
+        bench_append_pages (data, &os, 0);
+    }
+    bench_append_pages (data, &os, 1);
+    ogg_stream_clear (&os);
+}
+
+
+/* EBML elements are an id, a variable length size then the payload */
+static void ebml_put (bench_data_t *data, uint32_t id, const void *payload, uint64_t len)
+{
+    unsigned char buf [12];
+    unsigned int n = 0, size_len = 1, i;
+
+    if (id > 0xffffff)
+        buf [n++] = id >> 24;
+    if (id > 0xffff)
+        buf [n++] = (id >> 16) & 0xff;
+    if (id > 0xff)
+        buf [n++] = (id >> 8) & 0xff;
+    buf [n++] = id & 0xff;
+    if (len == (uint64_t)-1)
+    {
+        /* unknown size, for the segment of a live stream */
+        memcpy (buf + n, "\x01\xff\xff\xff\xff\xff\xff\xff", 8);
+        bench_data_append (data, buf, n + 8);
+        return;
+    }
+    while (size_len < 8 && len >= ((uint64_t)1 << (7 * size_len)) - 1)
+        size_len++;
+    for (i = 0; i < size_len; i++)
+        buf [n + i] = (len >> (8 * (size_len - 1 - i))) & 0xff;
+    buf [n] |= 0x80 >> (size_len - 1);
+    bench_data_append (data, buf, n + size_len);
+    if (payload && len)
+        bench_data_append (data, payload, len);
+}
+
+
+static void ebml_put_uint (bench_data_t *data, uint32_t id, uint64_t value)
+{
+    unsigned char buf [8];
+    unsigned int len = 1, i;
+
+    while (len < 8 && (value >> (8 * len)))
+        len++;
+    for (i = 0; i < len; i++)
+        buf [i] = (value >> (8 * (len - 1 - i))) & 0xff;
+    ebml_put (data, id, buf, len);
+}
+
+
+static void ebml_put_child (bench_data_t *data, uint32_t id, bench_data_t *child)
+{
+    ebml_put (data, id, child->data, child->len);
+    bench_data_free (child);
+}
+
+
+/* WebM with one Opus track, a cluster each second holding 20ms blocks */
+void bench_make_webm (bench_data_t *data, unsigned int seconds)
+{
+    static const unsigned char opus_head[19] = { 'O', 'p', 'u', 's', 'H', 'e', 'a', 'd',
+        1, 2, 0x38, 0x01, 0x80, 0xbb, 0, 0, 0, 0, 0 };
+    bench_data_t header = { NULL, 0 }, info = { NULL, 0 }, tracks = { NULL, 0 };
+    bench_data_t entry = { NULL, 0 }, audio = { NULL, 0 }, cluster = { NULL, 0 };
+    unsigned char block [4 + 160];
+    unsigned int s, i;
+
+    ebml_put_uint (&header, 0x4286, 1);
+    ebml_put_uint (&header, 0x42f7, 1);
+    ebml_put_uint (&header, 0x42f2, 4);
+    ebml_put_uint (&header, 0x42f3, 8);
+    ebml_put (&header, 0x4282, "webm", 4);
+    ebml_put_uint (&header, 0x4287, 4);
+    ebml_put_uint (&header, 0x4285, 2);
+    ebml_put_child (data, 0x1a45dfa3, &header);
+
+    ebml_put (data, 0x18538067, NULL, (uint64_t)-1);
+
+    ebml_put_uint (&info, 0x2ad7b1, 1000000);
+    ebml_put (&info, 0x4d80, "icecast bench", 13);
+    ebml_put (&info, 0x5741, "icecast bench", 13);
+    ebml_put_child (data, 0x1549a966, &info);
+
+    ebml_put (&audio, 0xb5, "\x47\x3b\x80\x00", 4);   /* 48000.0 */
+    ebml_put_uint (&audio, 0x9f, 2);
+    ebml_put_uint (&entry, 0xd7, 1);
+    ebml_put_uint (&entry, 0x73c5, 1);
+    ebml_put_uint (&entry, 0x83, 2);
+    ebml_put (&entry, 0x86, "A_OPUS", 6);
+    ebml_put (&entry, 0x63a2, opus_head, sizeof (opus_head));
+    ebml_put_child (&entry, 0xe1, &audio);
+    ebml_put_child (&tracks, 0xae, &entry);
+    ebml_put_child (data, 0x1654ae6b, &tracks);
+
+    for (s = 0; s < seconds; s++)
+    {
+        ebml_put_uint (&cluster, 0xe7, (uint64_t)s * 1000);
+        for (i = 0; i < 50; i++)
+        {
+            block [0] = 0x81;               /* track 1 */
+            block [1] = (i * 20) >> 8;      /* timecode in the cluster */
+            block [2] = (i * 20) & 0xff;
+            block [3] = 0x80;               /* keyframe */
+            bench_fill (block + 4, sizeof (block) - 4);
+            bench_mark (block + 4, s * 50 + i);
+            ebml_put (&cluster, 0xa3, block, sizeof (block));
+        }
+        ebml_put_child (data, 0x1f43b675, &cluster);
+    }
+}
+
+
+/* MPEG-1 layer 3 at 128kbps, with shoutcast style metadata inserted every
+ * metaint bytes if that is set. Every eighth block carries the next title,
+ * the others are empty as they are when a title has not changed. */
+void bench_make_mp3 (bench_data_t *data, unsigned int seconds,
+        unsigned int metaint, const bench_data_t *titles)
+{
+    unsigned char frame [417];
+    unsigned int frames = seconds * 38, i, blocks = 0, since_meta = 0;
+    size_t title_pos = 0;
+
+    for (i = 0; i < frames; i++)
+    {
+        unsigned int done = 0;
+
+        bench_fill (frame, sizeof (frame));
+        memcpy (frame, "\xff\xfb\x90\x00", 4);
+        bench_mark (frame + 4, i);
+        while (done < sizeof (frame))
+        {
+            unsigned int len = sizeof (frame) - done;
+            char meta [1 + 255 * 16];
+            const char *title = NULL;
+            size_t title_len = 0;
+            unsigned int length;
+            int meta_len;
+
+            if (metaint && len > metaint - since_meta)
+                len = metaint - since_meta;
+            bench_data_append (data, frame + done, len);
+            done += len;
+            since_meta += len;
+            if (metaint == 0 || since_meta < metaint)
+                continue;
+            since_meta = 0;
+            memset (meta, 0, sizeof (meta));
+            if (blocks++ % 8 == 0 && titles)
+            {
+                title = bench_next_line (titles, &title_pos, &title_len);
+                if (title == NULL)
+                {
+                    title_pos = 0;
+                    title = bench_next_line (titles, &title_pos, &title_len);
+                }
+            }
+            if (title == NULL)
+            {
+                bench_data_append (data, meta, 1);
+                continue;
+            }
+            if (title_len > 255 * 16 - 16)
+                title_len = 255 * 16 - 16;
+            meta_len = snprintf (meta + 1, sizeof (meta) - 1, "StreamTitle='%.*s';",
+                    (int)title_len, title);
+            length = (meta_len + 15) / 16;
+            meta [0] = (char)length;
+            bench_data_append (data, meta, 1 + length * 16);
+        }
+    }
+}
+
+
+static int bench_feed_read (connection_t *con, void *buf, size_t len)
+{
+    bench_feed_t *feed = (bench_feed_t *)con;
+
+    if (feed->pos >= feed->len)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len > BENCH_READ_SIZE)
+        len = BENCH_READ_SIZE;
+    if (len > feed->len - feed->pos)
+        len = feed->len - feed->pos;
+    memcpy (buf, feed->data + feed->pos, len);
+    feed->pos += len;
+    return (int)len;
+}
+
+
+source_t *bench_source_new (const char *mount, const char *content_type, unsigned int metaint)
+{
+    source_t *source = calloc (1, sizeof (source_t));
+    bench_feed_t *feed = calloc (1, sizeof (bench_feed_t));
+    client_t *client = calloc (1, sizeof (client_t));
+
+    if (source == NULL || feed == NULL || client == NULL)
+        abort ();
+    feed->con.sock = SOCK_ERROR;
+    feed->con.serversock = SOCK_ERROR;
+    feed->con.ip = strdup ("127.0.0.1");
+    feed->con.read = bench_feed_read;
+    client->con = &feed->con;
+
+    source->mount = strdup (mount);
+    source->history = playlist_new (4);
+    thread_mutex_create (&source->lock);
+    source->parser = httpp_create_parser ();
+    httpp_initialize (source->parser, NULL);
+    httpp_setvar (source->parser, "content-type", content_type);
+    if (metaint)
+    {
+        char value [20];
+
+        snprintf (value, sizeof (value), "%u", metaint);
+        httpp_setvar (source->parser, "icy-metaint", value);
+    }
+    client->parser = source->parser;
+    source->client = client;
+    source->con = client->con;
+    source->listener_poll_fd = -1;
+    return source;
+}
+
+
+/* start reading data from the beginning with a new format plugin */
+void bench_source_feed (source_t *source, const bench_data_t *data)
+{
+    bench_feed_t *feed = (bench_feed_t *)source->con;
+
+    if (source->format)
+        source->format->free_plugin (source->format);
+    source->format = NULL;
+    if (format_get_plugin (format_get_type (httpp_getvar (source->parser, "content-type")),
+                source) < 0)
+    {
+        fprintf (stderr, "no format plugin for %s\n", source->mount);
+        abort ();
+    }
+    feed->data = data ? data->data : NULL;
+    feed->len = data ? data->len : 0;
+    feed->pos = 0;
+    source->running = 1;
+}
+
+
+int bench_source_fed (source_t *source)
+{
+    bench_feed_t *feed = (bench_feed_t *)source->con;
+
+    return feed->pos >= feed->len;
+}
+
+
+/* read the whole of data through the plugin as the source thread would,
+ * returns the number of buffers it made for the queue */
+unsigned long bench_source_pass (source_t *source, const bench_data_t *data)
+{
+    unsigned long buffers = 0;
+
+    bench_source_feed (source, data);
+    while (source->running)
+    {
+        refbuf_t *refbuf = source->format->get_buffer (source);
+
+        if (refbuf)
+        {
+            buffers++;
+            refbuf_release (refbuf);
+            continue;
+        }
+        if (bench_source_fed (source))
+            break;
+    }
+    return buffers;
+}
+
+
+void bench_source_free (source_t *source)
+{
+    bench_feed_t *feed = (bench_feed_t *)source->con;
+
+    if (source->format)
+        source->format->free_plugin (source->format);
+    httpp_destroy (source->parser);
+    playlist_release (source->history);
+    thread_mutex_destroy (&source->lock);
+    free (feed->con.ip);
+    free (feed);
+    free (source->client);
+    free (source->mount);
+    free (source);
+}
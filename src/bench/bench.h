@@ -0,0 +1,90 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench.h
+**
+** helpers shared by the benchmark programs run by make bench
+**
+*/
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "source.h"
+
+/* a running benchmark, reported as one line of JSON */
+typedef struct bench_tag
+{
+    const char *name;       /* the function measured */
+    const char *corpus;     /* what it was run over */
+    uint64_t start;
+    uint64_t ops;
+    uint64_t bytes;
+} bench_t;
+
+/* data from the corpus directory or made up by one of the generators */
+typedef struct bench_data_tag
+{
+    char *data;
+    size_t len;
+} bench_data_t;
+
+/* how long each benchmark runs for, and which ones are run */
+extern double bench_seconds;
+extern const char *bench_only;
+
+void bench_initialize (void);
+void bench_shutdown (void);
+
+uint64_t bench_now_ns (void);
+int  bench_start (bench_t *bench, const char *name, const char *corpus);
+int  bench_running (bench_t *bench);
+void bench_report (bench_t *bench);
+
+void bench_data_append (bench_data_t *data, const void *buf, size_t len);
+void bench_data_free (bench_data_t *data);
+int  bench_load (bench_data_t *data, const char *dir, const char *name);
+uint32_t bench_random (void);
+
+/* synthetic streams, the same for every run. The payload of each packet
+ * or frame starts with a marker holding its number, so that a listener can
+ * tell when what it reads was sent */
+#define BENCH_MARKER        "IcBm"
+#define BENCH_MARKER_SIZE   8
+
+void bench_make_opus (bench_data_t *data, unsigned int seconds);
+void bench_make_webm (bench_data_t *data, unsigned int seconds);
+void bench_make_mp3 (bench_data_t *data, unsigned int seconds,
+        unsigned int metaint, const bench_data_t *titles);
+void bench_mark (unsigned char *buf, uint32_t seq);
+int  bench_marker (const unsigned char *buf, uint32_t *seq);
+const char *bench_next_line (const bench_data_t *data, size_t *pos, size_t *len);
+
+/* a source whose stream is read from memory through the connection read
+ * hook, each pass starts a fresh format plugin on the data */
+source_t *bench_source_new (const char *mount, const char *content_type, unsigned int metaint);
+void bench_source_feed (source_t *source, const bench_data_t *data);
+int  bench_source_fed (source_t *source);
+unsigned long bench_source_pass (source_t *source, const bench_data_t *data);
+void bench_source_free (source_t *source);
+
+/* the parser benchmarks, each in the file which includes the plugin */
+void bench_ogg (const char *corpus, const bench_data_t *data);
+void bench_ebml (const char *corpus, const bench_data_t *data);
+void bench_ebml_var_int (void);
+void bench_mp3 (const char *corpus, const bench_data_t *data, unsigned int metaint);
+void bench_shoutcast_metadata (const bench_data_t *titles);
+void bench_util (const bench_data_t *uris, const bench_data_t *credentials);
+
+#endif  /* __BENCH_H__ */
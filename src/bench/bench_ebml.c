@@ -0,0 +1,95 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench_ebml.c
+ **
+ ** benchmarks for the EBML plugin, which is included here so that the
+ ** number parsing can be timed on its own
+ **
+ */
+
+#include "../format_ebml.c"
+
+#include "bench.h"
+
+/* var ints in the buffer for ebml_parse_var_int */
+#define BENCH_VAR_INTS      65536
+
+
+void bench_ebml (const char *corpus, const bench_data_t *data)
+{
+    source_t *source = bench_source_new ("/bench.webm", "video/webm", 0);
+    bench_t bench;
+
+    if (bench_start (&bench, "ebml_get_buffer", corpus))
+    {
+        while (bench_running (&bench))
+        {
+            bench.ops += bench_source_pass (source, data);
+            bench.bytes += data->len;
+        }
+        bench_report (&bench);
+    }
+    bench_source_free (source);
+}
+
+
+/* Sizes and ids as they turn up in a stream, mostly one or two bytes with
+ * the odd longer one and some of unknown size */
+void bench_ebml_var_int (void)
+{
+    bench_data_t numbers = { NULL, 0 };
+    unsigned char *end;
+    unsigned int i;
+    bench_t bench;
+
+    if (bench_start (&bench, "ebml_parse_var_int", "mixed-lengths") == 0)
+        return;
+    for (i = 0; i < BENCH_VAR_INTS; i++)
+    {
+        uint32_t r = bench_random ();
+        unsigned char buf [8];
+        unsigned int len, n;
+
+        if (r % 100 < 60)
+            len = 1;
+        else if (r % 100 < 85)
+            len = 2;
+        else if (r % 100 < 95)
+            len = 4;
+        else
+            len = (r >> 8) % 8 + 1;
+        for (n = 0; n < len; n++)
+            buf [n] = (unsigned char)(bench_random () >> 3);
+        if (r % 50 == 0)
+            memset (buf, 0xff, len);    /* unknown */
+        buf [0] = (buf [0] & (0xff >> len)) | (0x80 >> (len - 1));
+        bench_data_append (&numbers, buf, len);
+    }
+    end = (unsigned char *)numbers.data + numbers.len;
+    bench.start = bench_now_ns ();
+    while (bench_running (&bench))
+    {
+        unsigned char *p = (unsigned char *)numbers.data;
+        uint_least64_t value;
+        ssize_t len;
+
+        while ((len = ebml_parse_var_int (p, end, &value)) > 0)
+        {
+            p += len;
+            bench.ops++;
+        }
+        bench.bytes += numbers.len;
+    }
+    bench_report (&bench);
+    bench_data_free (&numbers);
+}
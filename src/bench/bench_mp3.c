@@ -0,0 +1,91 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench_mp3.c
+ **
+ ** benchmarks for the MP3 plugin, which is included here so that the
+ ** shoutcast metadata handling can be timed on its own
+ **
+ */
+
+#include "../format_mp3.c"
+
+#include "bench.h"
+
+
+/* with metaint set the plugin reads through mp3_get_filter_meta */
+void bench_mp3 (const char *corpus, const bench_data_t *data, unsigned int metaint)
+{
+    source_t *source = bench_source_new ("/bench.mp3", "audio/mpeg", metaint);
+    bench_t bench;
+
+    if (bench_start (&bench, metaint ? "mp3_get_filter_meta" : "mp3_get_no_meta", corpus))
+    {
+        while (bench_running (&bench))
+        {
+            bench.ops += bench_source_pass (source, data);
+            bench.bytes += data->len;
+        }
+        bench_report (&bench);
+    }
+    bench_source_free (source);
+}
+
+
+/* the titles as the metadata blocks they arrive in */
+void bench_shoutcast_metadata (const bench_data_t *titles)
+{
+    source_t *source;
+    bench_data_t blocks = { NULL, 0 };
+    const char *title;
+    size_t pos = 0, len;
+    bench_t bench;
+
+    if (bench_start (&bench, "filter_shoutcast_metadata", "titles") == 0)
+        return;
+    while ((title = bench_next_line (titles, &pos, &len)))
+    {
+        char meta [1 + 255 * 16];
+        unsigned int length;
+        int meta_len;
+
+        if (len > 255 * 16 - 16)
+            len = 255 * 16 - 16;
+        memset (meta, 0, sizeof (meta));
+        meta_len = snprintf (meta + 1, sizeof (meta) - 1, "StreamTitle='%.*s';", (int)len, title);
+        length = (meta_len + 15) / 16;
+        meta [0] = (char)length;
+        bench_data_append (&blocks, meta, 1 + length * 16);
+    }
+    if (blocks.len == 0)
+        return;
+
+    source = bench_source_new ("/bench.mp3", "audio/mpeg", 16000);
+    bench_source_feed (source, NULL);
+    bench.start = bench_now_ns ();
+    while (bench_running (&bench))
+    {
+        pos = 0;
+        while (pos < blocks.len)
+        {
+            unsigned int block_len = 1 + (unsigned char)blocks.data [pos] * 16;
+
+            filter_shoutcast_metadata (source, blocks.data + pos, block_len);
+            pos += block_len;
+            bench.ops++;
+            bench.bytes += block_len;
+        }
+    }
+    bench_report (&bench);
+    bench_source_free (source);
+    bench_data_free (&blocks);
+}
@@ -0,0 +1,129 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench_ogg.c
+ **
+ ** benchmarks for the Ogg plugin, which is included here so that the page
+ ** handling can be timed on its own
+ **
+ */
+
+#include "../format_ogg.c"
+
+#include "bench.h"
+
+
+/* the complete pages of the stream, they point into in */
+static ogg_page *bench_ogg_pages (refbuf_t *in, unsigned int *count)
+{
+    ogg_state_t scan;
+    ogg_page *pages = NULL;
+    unsigned int allocated = 0;
+
+    memset (&scan, 0, sizeof (scan));
+    scan.in = in;
+    scan.in_end = in->len;
+    *count = 0;
+    while (1)
+    {
+        if (*count == allocated)
+        {
+            allocated += 256;
+            pages = realloc (pages, allocated * sizeof (ogg_page));
+        }
+        if (ogg_input_page (&scan, &pages [*count]) == 0)
+            break;
+        (*count)++;
+    }
+    return pages;
+}
+
+
+/* each pass goes through the pages with a new plugin, as ogg_get_buffer
+ * does once it has found them in the input */
+static unsigned long bench_ogg_process (source_t *source, refbuf_t *in,
+        ogg_page *pages, unsigned int count)
+{
+    format_plugin_t *plugin;
+    ogg_state_t *ogg_info;
+    unsigned long buffers = 0;
+    unsigned int i;
+
+    bench_source_feed (source, NULL);
+    plugin = source->format;
+    ogg_info = plugin->_state;
+    refbuf_addref (in);
+    ogg_info->in = in;
+    ogg_info->in_end = in->len;
+    ogg_info->in_start = in->len;
+    for (i = 0; i < count; i++)
+    {
+        ogg_codec_t *codec;
+        refbuf_t *refbuf;
+
+        if (ogg_page_bos (&pages [i]))
+        {
+            process_initial_page (plugin, &pages [i]);
+            continue;
+        }
+        ogg_info->bos_completed = 1;
+        refbuf = process_ogg_page (ogg_info, &pages [i], plugin);
+        codec = ogg_info->current;
+        while (refbuf || (codec && codec->process &&
+                    (refbuf = codec->process (ogg_info, codec, plugin))))
+        {
+            buffers++;
+            refbuf_release (refbuf);
+            refbuf = NULL;
+        }
+        ogg_info->current = NULL;
+        if (ogg_info->error)
+            break;
+    }
+    return buffers;
+}
+
+
+void bench_ogg (const char *corpus, const bench_data_t *data)
+{
+    source_t *source = bench_source_new ("/bench.ogg", "application/ogg", 0);
+    refbuf_t *in = refbuf_new (data->len);
+    ogg_page *pages;
+    unsigned int count;
+    bench_t bench;
+
+    memcpy (in->data, data->data, data->len);
+    pages = bench_ogg_pages (in, &count);
+
+    if (bench_start (&bench, "ogg_get_buffer", corpus))
+    {
+        while (bench_running (&bench))
+        {
+            bench.ops += bench_source_pass (source, data);
+            bench.bytes += data->len;
+        }
+        bench_report (&bench);
+    }
+    if (bench_start (&bench, "process_ogg_page", corpus))
+    {
+        while (bench_running (&bench))
+        {
+            bench_ogg_process (source, in, pages, count);
+            bench.ops += count;
+            bench.bytes += data->len;
+        }
+        bench_report (&bench);
+    }
+    free (pages);
+    refbuf_release (in);
+    bench_source_free (source);
+}
@@ -0,0 +1,131 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* bench_util.c
+ **
+ ** benchmarks for the URL and base64 helpers used on each request, the
+ ** allocating functions next to the ones writing to a caller's buffer
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "util.h"
+
+/* as big as the stack buffers the callers use */
+#define BENCH_UTIL_BUFFER   1024
+
+typedef struct bench_strings_tag
+{
+    char **strings;
+    unsigned int count;
+    size_t bytes;
+} bench_strings_t;
+
+
+/* each line of the corpus as a string of its own */
+static void bench_strings (bench_strings_t *set, const bench_data_t *data)
+{
+    const char *line;
+    size_t pos = 0, len;
+
+    memset (set, 0, sizeof (*set));
+    while ((line = bench_next_line (data, &pos, &len)))
+    {
+        if (len == 0)
+            continue;
+        set->strings = realloc (set->strings, (set->count + 1) * sizeof (char *));
+        set->strings [set->count] = calloc (1, len + 1);
+        memcpy (set->strings [set->count], line, len);
+        set->count++;
+        set->bytes += len;
+    }
+}
+
+
+static void bench_strings_free (bench_strings_t *set)
+{
+    unsigned int i;
+
+    for (i = 0; i < set->count; i++)
+        free (set->strings [i]);
+    free (set->strings);
+    memset (set, 0, sizeof (*set));
+}
+
+
+/* run one of the helpers over all the strings until the time is up, the
+ * allocating ones free their result */
+#define BENCH_UTIL(name, set, call)                             \
+    do {                                                        \
+        bench_t bench;                                          \
+        unsigned int i;                                         \
+        if (bench_start (&bench, name, corpus) == 0)            \
+            break;                                              \
+        while (bench_running (&bench))                          \
+        {                                                       \
+            for (i = 0; i < (set)->count; i++)                  \
+            {                                                   \
+                const char *in = (set)->strings [i];            \
+                call;                                           \
+            }                                                   \
+            bench.ops += (set)->count;                          \
+            bench.bytes += (set)->bytes;                        \
+        }                                                       \
+        bench_report (&bench);                                  \
+    } while (0)
+
+
+void bench_util (const bench_data_t *uris, const bench_data_t *credentials)
+{
+    bench_strings_t escaped, plain, encoded;
+    char buf [BENCH_UTIL_BUFFER];
+    const char *corpus = "uris";
+    unsigned int i;
+
+    bench_strings (&escaped, uris);
+    bench_strings (&encoded, credentials);
+
+    /* what is escaped on the way out is what came in unescaped */
+    memset (&plain, 0, sizeof (plain));
+    plain.strings = calloc (escaped.count + 1, sizeof (char *));
+    for (i = 0; i < escaped.count; i++)
+    {
+        char *s = util_url_unescape (escaped.strings [i]);
+
+        if (s == NULL)
+            continue;
+        plain.strings [plain.count++] = s;
+        plain.bytes += strlen (s);
+    }
+
+    BENCH_UTIL ("util_url_unescape", &escaped, free (util_url_unescape (in)));
+    BENCH_UTIL ("util_url_unescape_buf", &escaped, util_url_unescape_buf (in, buf, sizeof (buf)));
+    BENCH_UTIL ("util_normalise_uri", &escaped, free (util_normalise_uri (in)));
+    BENCH_UTIL ("util_normalise_uri_buf", &escaped, util_normalise_uri_buf (in, buf, sizeof (buf)));
+    corpus = "unescaped-uris";
+    BENCH_UTIL ("util_url_escape", &plain, free (util_url_escape (in)));
+    BENCH_UTIL ("util_url_escape_buf", &plain, util_url_escape_buf (in, buf, sizeof (buf)));
+    corpus = "credentials";
+    BENCH_UTIL ("util_base64_decode", &encoded, free (util_base64_decode (in)));
+    BENCH_UTIL ("util_base64_decode_buf", &encoded, util_base64_decode_buf (in, buf, sizeof (buf)));
+
+    bench_strings_free (&escaped);
+    bench_strings_free (&plain);
+    bench_strings_free (&encoded);
+}
@@ -0,0 +1,950 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* fanout.c
+ **
+ ** icecast-bench, the fan-out benchmark run by make bench-fanout. The
+ ** server runs in this process on a loopback port. For each format a
+ ** source sends a synthetic stream at its real rate and listeners read it
+ ** over loopback as fast as they can or at a given speed. Each format
+ ** prints one line of JSON with the throughput, the CPU and memory used
+ ** by the server for each listener and the latency from the source write
+ ** to the listener read.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common/thread/thread.h"
+#include "common/net/sock.h"
+#include "common/net/resolver.h"
+
+#include "bench.h"
+#include "cfgfile.h"
+#include "global.h"
+#include "connection.h"
+#include "refbuf.h"
+#include "objpool.h"
+#include "intro.h"
+#include "util.h"
+#include "slave.h"
+#include "stats.h"
+#include "logging.h"
+#include "xslt.h"
+#include "fserve.h"
+#include "yp.h"
+#include "auth.h"
+#include "event.h"
+#include "curl.h"
+
+/* listeners handled by each reader thread */
+#define FANOUT_PER_READER       256
+/* the most read from a listener socket at once */
+#define FANOUT_READ_SIZE        16384
+/* how often the sources send what is due */
+#define FANOUT_SOURCE_INTERVAL  20000
+/* stream left over after the run, connecting the listeners takes a while */
+#define FANOUT_SPARE_SECONDS    120
+#define FANOUT_SOURCE_PASSWORD  "bench"
+
+enum { FANOUT_WARMUP, FANOUT_MEASURE, FANOUT_DONE };
+enum { LISTENER_HEADER, LISTENER_BODY, LISTENER_GONE };
+
+typedef struct fanout_format_tag
+{
+    const char *name;           /* as given to -f */
+    const char *mount;
+    const char *content_type;
+    unsigned int metaint;       /* sent by the source, asked for by listeners */
+} fanout_format_t;
+
+static const fanout_format_t fanout_formats[] = {
+    { "opus",   "/bench.opus",  "audio/ogg",    0 },
+    { "mp3",    "/bench.mp3",   "audio/mpeg",   16000 },
+    { "webm",   "/bench.webm",  "video/webm",   0 }
+};
+
+/* where each marker is in the stream, in the order they are sent */
+typedef struct fanout_marker_tag
+{
+    size_t offset;
+    uint32_t seq;
+} fanout_marker_t;
+
+typedef struct fanout_stream_tag
+{
+    const fanout_format_t *format;
+    bench_data_t data;
+    double rate;                /* bytes a second */
+    fanout_marker_t *markers;
+    unsigned int marker_count;
+    volatile uint64_t *sent;    /* when each marker went out, by seq */
+    uint32_t seq_count;
+    volatile int state;         /* 0 starting, 1 streaming, -1 failed */
+    volatile uint64_t cpu_ns;
+    thread_type *thread;
+} fanout_stream_t;
+
+typedef struct fanout_listener_tag
+{
+    sock_t sock;
+    int state;
+    unsigned int header_read;
+    unsigned int header_match;  /* how much of the blank line is seen */
+    unsigned char tail [BENCH_MARKER_SIZE - 1];
+    unsigned int tail_len;      /* a marker may be split between reads */
+    double tokens;              /* bytes it may read at the set speed */
+    uint64_t last;
+} fanout_listener_t;
+
+typedef struct fanout_reader_tag
+{
+    mutex_t lock;
+    fanout_listener_t *listeners;
+    unsigned int count;         /* added by the main thread under the lock */
+    uint32_t *samples;          /* latencies in microseconds */
+    size_t sample_count;
+    size_t sample_alloc;
+    uint64_t bytes;             /* read while measuring */
+    unsigned int refused;       /* status was not 200 */
+    unsigned int dropped;       /* closed by the server */
+    volatile uint64_t cpu_ns;
+    thread_type *thread;
+} fanout_reader_t;
+
+static int fanout_port;
+static volatile int fanout_phase;
+static volatile uint64_t fanout_measure_start;
+static fanout_stream_t *fanout_stream;
+
+static unsigned int fanout_listeners = 100;
+static double fanout_speed;             /* kbit/s, 0 for as fast as possible */
+static double fanout_seconds = 10.0;
+static double fanout_warmup = 2.0;
+
+
+static void usage (void)
+{
+    fprintf (stderr, "usage: icecast-bench [-l listeners] [-s kbps] [-t seconds] [-w seconds] [-f formats] [-c corpus-dir]\n"
+            "  -l  listeners for each format, default 100\n"
+            "  -s  speed each listener reads at in kbit/s, default 0 for as fast as it can\n"
+            "  -t  time to measure each format for, default 10 seconds\n"
+            "  -w  time between the listeners connecting and measuring, default 2 seconds\n"
+            "  -f  formats to run, default opus,mp3,webm\n"
+            "  -c  directory with the titles for the mp3 metadata\n");
+    exit (1);
+}
+
+
+static uint64_t fanout_thread_cpu_ns (void)
+{
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t fanout_process_cpu_ns (void)
+{
+    struct rusage usage;
+
+    getrusage (RUSAGE_SELF, &usage);
+    return ((uint64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000 +
+        ((uint64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+
+/* resident memory, the peak where the current figure is not available */
+static uint64_t fanout_rss (void)
+{
+    FILE *statm = fopen ("/proc/self/statm", "r");
+    unsigned long size, resident;
+    struct rusage usage;
+
+    if (statm)
+    {
+        int ret = fscanf (statm, "%lu %lu", &size, &resident);
+
+        fclose (statm);
+        if (ret == 2)
+            return (uint64_t)resident * sysconf (_SC_PAGESIZE);
+    }
+    getrusage (RUSAGE_SELF, &usage);
+    return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+
+/* a loopback port nothing is using, handed back for the server to bind */
+static int fanout_free_port (void)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof (sa);
+    int fd = socket (AF_INET, SOCK_STREAM, 0), port = -1;
+
+    if (fd < 0)
+        return -1;
+    memset (&sa, 0, sizeof (sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    if (bind (fd, (struct sockaddr *)&sa, sizeof (sa)) == 0 &&
+            getsockname (fd, (struct sockaddr *)&sa, &len) == 0)
+        port = ntohs (sa.sin_port);
+    close (fd);
+    return port;
+}
+
+
+static int fanout_write_config (char *path, size_t size)
+{
+    const char *tmpdir = getenv ("TMPDIR");
+    FILE *file;
+    int fd;
+
+    if (tmpdir == NULL || tmpdir [0] == '\0')
+        tmpdir = "/tmp";
+    snprintf (path, size, "%s/icecast-bench-XXXXXX", tmpdir);
+    fd = mkstemp (path);
+    if (fd < 0 || (file = fdopen (fd, "w")) == NULL)
+    {
+        fprintf (stderr, "unable to write the config in %s: %s\n", tmpdir, strerror (errno));
+        return -1;
+    }
+    fprintf (file, "<icecast>\n"
+            "    <hostname>127.0.0.1</hostname>\n"
+            "    <limits>\n"
+            "        <clients>%u</clients>\n"
+            "        <sources>%u</sources>\n"
+            "    </limits>\n"
+            "    <authentication>\n"
+            "        <source-password>" FANOUT_SOURCE_PASSWORD "</source-password>\n"
+            "        <admin-password>" FANOUT_SOURCE_PASSWORD "</admin-password>\n"
+            "    </authentication>\n"
+            "    <listen-socket>\n"
+            "        <port>%d</port>\n"
+            "        <bind-address>127.0.0.1</bind-address>\n"
+            "    </listen-socket>\n"
+            "    <paths>\n"
+            "        <logdir>%s</logdir>\n"
+            "        <webroot>%s</webroot>\n"
+            "        <adminroot>%s</adminroot>\n"
+            "    </paths>\n"
+            "</icecast>\n",
+            fanout_listeners + 100,
+            (unsigned int)(sizeof (fanout_formats) / sizeof (fanout_formats [0])) + 1,
+            fanout_port, tmpdir, tmpdir, tmpdir);
+    if (fclose (file) != 0)
+        return -1;
+    return 0;
+}
+
+
+static void *fanout_accept_thread (void *arg)
+{
+    (void)arg;
+    connection_accept_loop ();
+    connection_setup_sockets (NULL);
+    return NULL;
+}
+
+
+/* start the server as main does and accept in a thread of its own */
+static thread_type *fanout_server_start (const char *config_file)
+{
+    int i;
+
+    log_initialize ();
+    thread_initialize ();
+    sock_initialize ();
+    resolver_initialize ();
+    config_initialize ();
+    connection_initialize ();
+    global_initialize ();
+    source_routes_initialize ();
+    refbuf_initialize ();
+    objpool_initialize ();
+    intro_cache_initialize ();
+    xslt_initialize ();
+#ifdef HAVE_CURL
+    icecast_curl_initialize ();
+#endif
+
+    errorlog = log_open_file (stderr);
+    log_set_level (errorlog, ICECAST_LOGLEVEL_WARN);
+    accesslog = -1;
+    playlistlog = -1;
+
+    if (config_initial_parse_file (config_file) != 0)
+    {
+        fprintf (stderr, "unable to parse %s\n", config_file);
+        return NULL;
+    }
+    if (connection_setup_sockets (config_get_config_unlocked ()) < 1)
+    {
+        fprintf (stderr, "unable to bind to 127.0.0.1:%d\n", fanout_port);
+        return NULL;
+    }
+    for (i = 0; i < global.server_sockets; i++)
+    {
+        if (sock_listen (global.serversock [i], ICECAST_LISTEN_QUEUE) == SOCK_ERROR)
+        {
+            fprintf (stderr, "unable to listen on 127.0.0.1:%d\n", fanout_port);
+            return NULL;
+        }
+        sock_set_blocking (global.serversock [i], 0);
+    }
+
+    stats_initialize ();
+    fserve_initialize ();
+    logging_initialize ();
+    global.running = ICECAST_RUNNING;
+    yp_initialize ();
+    slave_initialize ();
+    auth_initialise ();
+    event_initialise ();
+
+    return thread_create ("Accept Thread", fanout_accept_thread, NULL, THREAD_ATTACHED);
+}
+
+
+static void fanout_server_stop (thread_type *accept_thread)
+{
+    global.running = ICECAST_HALTING;
+    if (accept_thread)
+        thread_join (accept_thread);
+
+    event_shutdown ();
+    fserve_shutdown ();
+    slave_shutdown ();
+    auth_shutdown ();
+    yp_shutdown ();
+    stats_shutdown ();
+    logging_shutdown ();
+    intro_cache_shutdown ();
+    refbuf_shutdown ();
+    objpool_shutdown ();
+    source_routes_shutdown ();
+    global_shutdown ();
+    connection_shutdown ();
+    config_shutdown ();
+    resolver_shutdown ();
+    sock_shutdown ();
+    thread_shutdown ();
+#ifdef HAVE_CURL
+    icecast_curl_shutdown ();
+#endif
+    log_close (errorlog);
+    log_shutdown ();
+    xslt_shutdown ();
+}
+
+
+static int fanout_write (sock_t sock, const char *buf, size_t len)
+{
+    while (len)
+    {
+        int ret = sock_write_bytes (sock, buf, len);
+
+        if (ret <= 0)
+        {
+            if (ret < 0 && sock_recoverable (sock_error ()))
+                continue;
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+
+/* read the response up to the blank line, returns the status */
+static int fanout_read_response (sock_t sock)
+{
+    char response [2048];
+    size_t len = 0;
+
+    while (len < sizeof (response) - 1)
+    {
+        struct pollfd ufds = { sock, POLLIN, 0 };
+        int ret;
+
+        if (poll (&ufds, 1, 5000) <= 0)
+            return -1;
+        ret = sock_read_bytes (sock, response + len, 1);
+        if (ret <= 0)
+            return -1;
+        len += ret;
+        response [len] = '\0';
+        if (len > 4 && strcmp (response + len - 4, "\r\n\r\n") == 0)
+            break;
+    }
+    if (strncmp (response, "HTTP/1.", 7) != 0 || len < 12)
+        return -1;
+    return atoi (response + 9);
+}
+
+
+/* find the markers the generator put in, those split by metadata are lost */
+static void fanout_stream_markers (fanout_stream_t *stream)
+{
+    const unsigned char *data = (const unsigned char *)stream->data.data;
+    size_t pos;
+    uint32_t seq;
+
+    for (pos = 0; pos + BENCH_MARKER_SIZE <= stream->data.len; pos++)
+    {
+        if (data [pos] != BENCH_MARKER [0] || bench_marker (data + pos, &seq) == 0)
+            continue;
+        stream->markers = realloc (stream->markers,
+                (stream->marker_count + 1) * sizeof (fanout_marker_t));
+        stream->markers [stream->marker_count].offset = pos;
+        stream->markers [stream->marker_count].seq = seq;
+        stream->marker_count++;
+        if (seq >= stream->seq_count)
+            stream->seq_count = seq + 1;
+        pos += BENCH_MARKER_SIZE - 1;
+    }
+    stream->sent = calloc (stream->seq_count + 1, sizeof (uint64_t));
+}
+
+
+/* The source client, it sends the stream at the rate it would be played,
+ * noting when each marker goes out */
+static void *fanout_source_thread (void *arg)
+{
+    fanout_stream_t *stream = arg;
+    const fanout_format_t *format = stream->format;
+    char request [1024], metaint [40] = "";
+    char *credentials = util_base64_encode ("source:" FANOUT_SOURCE_PASSWORD,
+            strlen ("source:" FANOUT_SOURCE_PASSWORD));
+    unsigned int marker = 0;
+    size_t sent = 0;
+    uint64_t start;
+    sock_t sock;
+    int status;
+
+    sock = sock_connect_wto ("127.0.0.1", fanout_port, 5);
+    if (sock == SOCK_ERROR)
+    {
+        fprintf (stderr, "source for %s unable to connect\n", format->mount);
+        free (credentials);
+        stream->state = -1;
+        return NULL;
+    }
+    if (format->metaint)
+        snprintf (metaint, sizeof (metaint), "Icy-MetaInt: %u\r\n", format->metaint);
+    snprintf (request, sizeof (request), "PUT %s HTTP/1.1\r\n"
+            "Host: 127.0.0.1:%d\r\n"
+            "Authorization: Basic %s\r\n"
+            "Content-Type: %s\r\n"
+            "Ice-Name: icecast bench\r\n"
+            "Ice-Public: 0\r\n"
+            "%s"
+            "Expect: 100-continue\r\n"
+            "\r\n", format->mount, fanout_port, credentials, format->content_type, metaint);
+    free (credentials);
+    if (fanout_write (sock, request, strlen (request)) < 0 ||
+            ((status = fanout_read_response (sock)) != 100 && status != 200))
+    {
+        fprintf (stderr, "source for %s not accepted\n", format->mount);
+        sock_close (sock);
+        stream->state = -1;
+        return NULL;
+    }
+
+    start = bench_now_ns ();
+    while (fanout_phase != FANOUT_DONE)
+    {
+        uint64_t now = bench_now_ns ();
+        size_t due = (size_t)(stream->rate * (now - start) / 1e9);
+
+        stream->cpu_ns = fanout_thread_cpu_ns ();
+        if (due > stream->data.len)
+            due = stream->data.len;
+        while (marker < stream->marker_count && stream->markers [marker].offset < due)
+            stream->sent [stream->markers [marker++].seq] = now;
+        if (due > sent)
+        {
+            if (fanout_write (sock, stream->data.data + sent, due - sent) < 0)
+            {
+                fprintf (stderr, "source for %s dropped\n", format->mount);
+                if (stream->state == 0)
+                    stream->state = -1;
+                break;
+            }
+            sent = due;
+        }
+        /* a second in, the listeners get some burst */
+        if (stream->state == 0 && now - start > 1000000000)
+            stream->state = 1;
+        thread_sleep (FANOUT_SOURCE_INTERVAL);
+    }
+    stream->cpu_ns = fanout_thread_cpu_ns ();
+    sock_close (sock);
+    return NULL;
+}
+
+
+/* how much the listener may read now, its speed is kept as a bucket of
+ * bytes topped up as time goes by */
+static size_t fanout_listener_allowed (fanout_listener_t *listener, uint64_t now)
+{
+    double rate = fanout_speed * 1000 / 8, limit = FANOUT_READ_SIZE + rate / 10;
+
+    if (fanout_speed <= 0)
+        return FANOUT_READ_SIZE;
+    listener->tokens += rate * (now - listener->last) / 1e9;
+    listener->last = now;
+    if (listener->tokens > limit)
+        listener->tokens = limit;
+    if (listener->tokens < 1)
+        return 0;
+    return listener->tokens < FANOUT_READ_SIZE ? (size_t)listener->tokens : FANOUT_READ_SIZE;
+}
+
+
+static void fanout_sample (fanout_reader_t *reader, uint64_t latency_ns)
+{
+    if (reader->sample_count == reader->sample_alloc)
+    {
+        reader->sample_alloc = reader->sample_alloc ? reader->sample_alloc * 2 : 4096;
+        reader->samples = realloc (reader->samples, reader->sample_alloc * sizeof (uint32_t));
+        if (reader->samples == NULL)
+            abort ();
+    }
+    reader->samples [reader->sample_count++] = latency_ns > (uint64_t)UINT32_MAX * 1000 ?
+        UINT32_MAX : (uint32_t)(latency_ns / 1000);
+}
+
+
+static void fanout_listener_gone (fanout_reader_t *reader, fanout_listener_t *listener, int refused)
+{
+    sock_close (listener->sock);
+    listener->sock = SOCK_ERROR;
+    listener->state = LISTENER_GONE;
+    if (refused)
+        reader->refused++;
+    else
+        reader->dropped++;
+}
+
+
+static void fanout_listener_read (fanout_reader_t *reader, fanout_listener_t *listener,
+        unsigned char *buf, size_t allowed, uint64_t now)
+{
+    unsigned char *p, *end;
+    int measuring = fanout_phase == FANOUT_MEASURE;
+    int ret;
+
+    memcpy (buf, listener->tail, listener->tail_len);
+    ret = sock_read_bytes (listener->sock, buf + listener->tail_len, allowed);
+    if (ret <= 0)
+    {
+        if (ret < 0 && sock_recoverable (sock_error ()))
+            return;
+        fanout_listener_gone (reader, listener, listener->state == LISTENER_HEADER);
+        return;
+    }
+    if (fanout_speed > 0)
+        listener->tokens -= ret;
+    if (measuring)
+        reader->bytes += ret;
+    p = buf + listener->tail_len;
+    end = p + ret;
+
+    if (listener->state == LISTENER_HEADER)
+    {
+        if (listener->header_read == 0 && ret >= 12 &&
+                (memcmp (p, "HTTP/1.", 7) != 0 || memcmp (p + 8, " 200", 4) != 0))
+        {
+            fanout_listener_gone (reader, listener, 1);
+            return;
+        }
+        listener->header_read += ret;
+        for (; p < end && listener->header_match < 4; p++)
+        {
+            if (*p == "\r\n\r\n" [listener->header_match])
+                listener->header_match++;
+            else
+                listener->header_match = *p == '\r' ? 1 : 0;
+        }
+        if (listener->header_match < 4)
+            return;
+        listener->state = LISTENER_BODY;
+    }
+    else
+        p = buf;
+
+    for (; p + BENCH_MARKER_SIZE <= end; p++)
+    {
+        uint32_t seq;
+        uint64_t sent;
+
+        p = memchr (p, BENCH_MARKER [0], end - p);
+        if (p == NULL || p + BENCH_MARKER_SIZE > end)
+            break;
+        if (bench_marker (p, &seq) == 0 || seq >= fanout_stream->seq_count)
+            continue;
+        sent = fanout_stream->sent [seq];
+        /* the burst on connecting is not counted */
+        if (measuring && sent >= fanout_measure_start && now > sent)
+            fanout_sample (reader, now - sent);
+    }
+    listener->tail_len = end - buf < BENCH_MARKER_SIZE - 1 ?
+        (unsigned int)(end - buf) : BENCH_MARKER_SIZE - 1;
+    memcpy (listener->tail, end - listener->tail_len, listener->tail_len);
+}
+
+
+static void *fanout_reader_thread (void *arg)
+{
+    fanout_reader_t *reader = arg;
+    struct pollfd ufds [FANOUT_PER_READER];
+    size_t allowed [FANOUT_PER_READER];
+    unsigned int slots [FANOUT_PER_READER];
+    unsigned char *buf = malloc (FANOUT_READ_SIZE + BENCH_MARKER_SIZE);
+
+    if (buf == NULL)
+        abort ();
+    while (fanout_phase != FANOUT_DONE)
+    {
+        uint64_t now = bench_now_ns ();
+        unsigned int count, i, n = 0;
+
+        reader->cpu_ns = fanout_thread_cpu_ns ();
+        thread_mutex_lock (&reader->lock);
+        count = reader->count;
+        thread_mutex_unlock (&reader->lock);
+        for (i = 0; i < count; i++)
+        {
+            fanout_listener_t *listener = &reader->listeners [i];
+
+            if (listener->state == LISTENER_GONE)
+                continue;
+            allowed [n] = fanout_listener_allowed (listener, now);
+            if (allowed [n] == 0)
+                continue;
+            ufds [n].fd = listener->sock;
+            ufds [n].events = POLLIN;
+            ufds [n].revents = 0;
+            slots [n++] = i;
+        }
+        if (n == 0)
+        {
+            thread_sleep (10000);
+            continue;
+        }
+        if (poll (ufds, n, 10) <= 0)
+            continue;
+        now = bench_now_ns ();
+        for (i = 0; i < n; i++)
+            if (ufds [i].revents)
+                fanout_listener_read (reader, &reader->listeners [slots [i]], buf, allowed [i], now);
+    }
+    reader->cpu_ns = fanout_thread_cpu_ns ();
+    free (buf);
+    return NULL;
+}
+
+
+static int fanout_connect_listener (fanout_reader_t *reader, const fanout_format_t *format)
+{
+    fanout_listener_t *listener;
+    char request [512];
+    sock_t sock;
+
+    sock = sock_connect_wto ("127.0.0.1", fanout_port, 5);
+    if (sock == SOCK_ERROR)
+        return -1;
+    snprintf (request, sizeof (request), "GET %s HTTP/1.0\r\n"
+            "Host: 127.0.0.1:%d\r\n"
+            "User-Agent: icecast-bench\r\n"
+            "%s"
+            "\r\n", format->mount, fanout_port, format->metaint ? "Icy-MetaData: 1\r\n" : "");
+    if (fanout_write (sock, request, strlen (request)) < 0)
+    {
+        sock_close (sock);
+        return -1;
+    }
+    listener = &reader->listeners [reader->count];
+    memset (listener, 0, sizeof (*listener));
+    listener->sock = sock;
+    listener->state = LISTENER_HEADER;
+    listener->last = bench_now_ns ();
+    thread_mutex_lock (&reader->lock);
+    reader->count++;
+    thread_mutex_unlock (&reader->lock);
+    return 0;
+}
+
+
+static int fanout_compare (const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double fanout_percentile (const uint32_t *samples, size_t count, double p)
+{
+    size_t i;
+
+    if (count == 0)
+        return 0.0;
+    i = (size_t)(p * (count - 1) + 0.5);
+    return samples [i] / 1000.0;
+}
+
+
+static void fanout_sleep (double seconds)
+{
+    uint64_t end = bench_now_ns () + (uint64_t)(seconds * 1e9);
+
+    while (bench_now_ns () < end)
+        thread_sleep (10000);
+}
+
+
+/* the time used by the benchmark threads, which is not the server's */
+static uint64_t fanout_bench_cpu_ns (fanout_reader_t *readers, unsigned int count,
+        fanout_stream_t *stream)
+{
+    uint64_t cpu = fanout_thread_cpu_ns () + stream->cpu_ns;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        cpu += readers [i].cpu_ns;
+    return cpu;
+}
+
+
+static void fanout_run (const fanout_format_t *format, const bench_data_t *titles)
+{
+    unsigned int reader_count = (fanout_listeners + FANOUT_PER_READER - 1) / FANOUT_PER_READER;
+    unsigned int seconds = (unsigned int)(fanout_warmup + fanout_seconds) + FANOUT_SPARE_SECONDS;
+    unsigned int i, connected = 0, refused = 0, dropped = 0;
+    fanout_reader_t *readers = calloc (reader_count, sizeof (fanout_reader_t));
+    fanout_stream_t stream;
+    uint64_t rss_start = 0, rss_end = 0, cpu_start = 0, cpu_end = 0, start = 0, end = 0;
+    uint64_t bytes = 0;
+    uint32_t *samples;
+    size_t sample_count = 0;
+    double elapsed, server_cpu;
+
+    memset (&stream, 0, sizeof (stream));
+    stream.format = format;
+    if (strcmp (format->name, "opus") == 0)
+        bench_make_opus (&stream.data, seconds);
+    else if (strcmp (format->name, "webm") == 0)
+        bench_make_webm (&stream.data, seconds);
+    else
+        bench_make_mp3 (&stream.data, seconds, format->metaint, titles);
+    stream.rate = (double)stream.data.len / seconds;
+    fanout_stream_markers (&stream);
+    fanout_stream = &stream;
+    fanout_phase = FANOUT_WARMUP;
+
+    for (i = 0; i < reader_count; i++)
+    {
+        readers [i].listeners = calloc (FANOUT_PER_READER, sizeof (fanout_listener_t));
+        thread_mutex_create (&readers [i].lock);
+        readers [i].thread = thread_create ("Bench Reader", fanout_reader_thread,
+                &readers [i], THREAD_ATTACHED);
+    }
+    stream.thread = thread_create ("Bench Source", fanout_source_thread, &stream, THREAD_ATTACHED);
+    while (stream.state == 0)
+        thread_sleep (10000);
+
+    if (stream.state > 0)
+    {
+        rss_start = fanout_rss ();
+        for (i = 0; i < fanout_listeners; i++)
+            if (fanout_connect_listener (&readers [i % reader_count], format) == 0)
+                connected++;
+        fanout_sleep (fanout_warmup);
+        rss_end = fanout_rss ();
+
+        start = bench_now_ns ();
+        cpu_start = fanout_process_cpu_ns () - fanout_bench_cpu_ns (readers, reader_count, &stream);
+        fanout_measure_start = start;
+        fanout_phase = FANOUT_MEASURE;
+        fanout_sleep (fanout_seconds);
+        end = bench_now_ns ();
+        cpu_end = fanout_process_cpu_ns () - fanout_bench_cpu_ns (readers, reader_count, &stream);
+    }
+    fanout_phase = FANOUT_DONE;
+
+    thread_join (stream.thread);
+    for (i = 0; i < reader_count; i++)
+    {
+        unsigned int n;
+
+        thread_join (readers [i].thread);
+        for (n = 0; n < readers [i].count; n++)
+            if (readers [i].listeners [n].state != LISTENER_GONE)
+                sock_close (readers [i].listeners [n].sock);
+        bytes += readers [i].bytes;
+        refused += readers [i].refused;
+        dropped += readers [i].dropped;
+        sample_count += readers [i].sample_count;
+    }
+
+    samples = malloc ((sample_count + 1) * sizeof (uint32_t));
+    sample_count = 0;
+    for (i = 0; i < reader_count; i++)
+    {
+        if (readers [i].sample_count)
+            memcpy (samples + sample_count, readers [i].samples,
+                    readers [i].sample_count * sizeof (uint32_t));
+        sample_count += readers [i].sample_count;
+        free (readers [i].samples);
+        free (readers [i].listeners);
+        thread_mutex_destroy (&readers [i].lock);
+    }
+    free (readers);
+    qsort (samples, sample_count, sizeof (uint32_t), fanout_compare);
+
+    if (stream.state > 0)
+    {
+        elapsed = (end - start) / 1e9;
+        server_cpu = cpu_end > cpu_start ? (cpu_end - cpu_start) / 1e9 : 0.0;
+        connected -= refused;
+        printf ("{\"benchmark\": \"fanout\", \"format\": \"%s\", \"listeners\": %u"
+                ", \"connected\": %u, \"dropped\": %u, \"listener_kbps\": %.1f"
+                ", \"stream_kbps\": %.1f, \"seconds\": %.6f, \"bytes\": %" PRIu64
+                ", \"mb_per_s\": %.2f, \"cpu_percent\": %.2f, \"cpu_us_per_listener_s\": %.2f"
+                ", \"rss_bytes_per_listener\": %.0f, \"latency_samples\": %lu"
+                ", \"latency_ms_p50\": %.3f, \"latency_ms_p90\": %.3f"
+                ", \"latency_ms_p99\": %.3f, \"latency_ms_max\": %.3f}\n",
+                format->name, fanout_listeners, connected, dropped, fanout_speed,
+                stream.rate * 8 / 1000, elapsed, bytes,
+                elapsed > 0 ? bytes / elapsed / 1e6 : 0.0,
+                elapsed > 0 ? server_cpu * 100 / elapsed : 0.0,
+                elapsed > 0 && connected ? server_cpu * 1e6 / elapsed / connected : 0.0,
+                connected && rss_end > rss_start ? (double)(rss_end - rss_start) / connected : 0.0,
+                (unsigned long)sample_count,
+                fanout_percentile (samples, sample_count, 0.50),
+                fanout_percentile (samples, sample_count, 0.90),
+                fanout_percentile (samples, sample_count, 0.99),
+                sample_count ? samples [sample_count - 1] / 1000.0 : 0.0);
+        fflush (stdout);
+    }
+    else
+        fprintf (stderr, "no source for %s, skipped\n", format->mount);
+
+    free (samples);
+    free (stream.markers);
+    free ((void *)stream.sent);
+    bench_data_free (&stream.data);
+    fanout_stream = NULL;
+}
+
+
+/* two sockets for each listener and a few for the server */
+static void fanout_raise_fd_limit (void)
+{
+    struct rlimit limit;
+    rlim_t wanted = (rlim_t)fanout_listeners * 2 + 64;
+
+    if (getrlimit (RLIMIT_NOFILE, &limit) < 0)
+        return;
+    if (limit.rlim_cur < wanted)
+    {
+        limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > wanted ?
+            wanted : limit.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < wanted)
+        fprintf (stderr, "only %lu files can be open, not all the listeners may connect\n",
+                (unsigned long)limit.rlim_cur);
+}
+
+
+int main (int argc, char **argv)
+{
+    const char *corpus_dir = "bench/corpus", *formats = "opus,mp3,webm";
+    bench_data_t titles = { NULL, 0 };
+    char config_file [4096];
+    thread_type *accept_thread;
+    unsigned int i;
+    int arg;
+
+    for (arg = 1; arg < argc; arg++)
+    {
+        if (argv [arg][0] != '-' || arg + 1 >= argc)
+            usage ();
+        if (strcmp (argv [arg], "-l") == 0)
+            fanout_listeners = atoi (argv [++arg]);
+        else if (strcmp (argv [arg], "-s") == 0)
+            fanout_speed = atof (argv [++arg]);
+        else if (strcmp (argv [arg], "-t") == 0)
+            fanout_seconds = atof (argv [++arg]);
+        else if (strcmp (argv [arg], "-w") == 0)
+            fanout_warmup = atof (argv [++arg]);
+        else if (strcmp (argv [arg], "-f") == 0)
+            formats = argv [++arg];
+        else if (strcmp (argv [arg], "-c") == 0)
+            corpus_dir = argv [++arg];
+        else
+            usage ();
+    }
+    if (fanout_listeners == 0 || fanout_seconds <= 0 || fanout_warmup < 0 || fanout_speed < 0)
+        usage ();
+    if (bench_load (&titles, corpus_dir, "titles.txt") < 0)
+        return 1;
+
+    signal (SIGPIPE, SIG_IGN);
+    fanout_raise_fd_limit ();
+    fanout_port = fanout_free_port ();
+    if (fanout_port < 0 || fanout_write_config (config_file, sizeof (config_file)) < 0)
+        return 1;
+    accept_thread = fanout_server_start (config_file);
+    remove (config_file);
+    if (accept_thread == NULL)
+    {
+        fanout_server_stop (NULL);
+        return 1;
+    }
+
+    for (i = 0; i < sizeof (fanout_formats) / sizeof (fanout_formats [0]); i++)
+    {
+        size_t len = strlen (fanout_formats [i].name);
+        const char *p = strstr (formats, fanout_formats [i].name);
+
+        if (p && (p == formats || p [-1] == ',') && (p [len] == '\0' || p [len] == ','))
+            fanout_run (&fanout_formats [i], &titles);
+    }
+
+    fanout_server_stop (accept_thread);
+    bench_data_free (&titles);
+    return 0;
+}
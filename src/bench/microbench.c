@@ -0,0 +1,201 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* microbench.c
+ **
+ ** micro benchmarks for the stream parsers, request handling and the URL
+ ** and base64 helpers, run by make bench. Each benchmark prints one line
+ ** of JSON with the time per operation and the throughput. Recordings can
+ ** be given on the command line and are run alongside the synthetic
+ ** streams.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/httpp/httpp.h"
+
+#include "bench.h"
+
+/* length of the synthetic streams */
+#define BENCH_STREAM_SECONDS    120
+
+
+static void usage (void)
+{
+    fprintf (stderr, "usage: icecast-microbench [-t seconds] [-b name] [-c corpus-dir] [recording ...]\n"
+            "  -t  time to run each benchmark for, default 1 second\n"
+            "  -b  only run the benchmarks with name in theirs\n"
+            "  -c  directory with the requests, titles, uris and credentials\n"
+            "  recordings ending in .ogg, .oga, .opus, .webm, .mka, .mkv or .mp3\n");
+    exit (1);
+}
+
+
+/* the requests are separated by blank lines, each is sent with CRLF line
+ * endings and the blank line which ends the headers */
+static void bench_httpp (const bench_data_t *corpus)
+{
+    bench_data_t requests = { NULL, 0 };
+    size_t *offsets = NULL, pos = 0, len, start = 0;
+    unsigned int count = 0, i;
+    const char *line;
+    bench_t bench;
+
+    if (bench_start (&bench, "httpp_parse", "requests") == 0)
+        return;
+    while (1)
+    {
+        line = bench_next_line (corpus, &pos, &len);
+        if (line && len)
+        {
+            bench_data_append (&requests, line, len);
+            bench_data_append (&requests, "\r\n", 2);
+            continue;
+        }
+        if (requests.len > start)
+        {
+            bench_data_append (&requests, "\r\n", 2);
+            offsets = realloc (offsets, (count + 2) * sizeof (size_t));
+            offsets [count++] = start;
+            start = requests.len;
+        }
+        if (line == NULL)
+            break;
+    }
+    if (count == 0)
+        return;
+    offsets [count] = requests.len;
+
+    bench.start = bench_now_ns ();
+    while (bench_running (&bench))
+    {
+        for (i = 0; i < count; i++)
+        {
+            http_parser_t *parser = httpp_create_parser ();
+
+            httpp_initialize (parser, NULL);
+            httpp_parse (parser, requests.data + offsets [i], offsets [i + 1] - offsets [i]);
+            httpp_destroy (parser);
+        }
+        bench.ops += count;
+        bench.bytes += requests.len;
+    }
+    bench_report (&bench);
+    free (offsets);
+    bench_data_free (&requests);
+}
+
+
+static int bench_ends_with (const char *name, const char *suffix)
+{
+    size_t len = strlen (name), suffix_len = strlen (suffix);
+
+    return len > suffix_len && strcmp (name + len - suffix_len, suffix) == 0;
+}
+
+
+static void bench_recording (const char *path)
+{
+    const char *name = strrchr (path, '/');
+    bench_data_t data = { NULL, 0 };
+
+    name = name ? name + 1 : path;
+    if (bench_load (&data, NULL, path) < 0)
+        return;
+    if (bench_ends_with (name, ".ogg") || bench_ends_with (name, ".oga") ||
+            bench_ends_with (name, ".opus"))
+        bench_ogg (name, &data);
+    else if (bench_ends_with (name, ".webm") || bench_ends_with (name, ".mka") ||
+            bench_ends_with (name, ".mkv"))
+        bench_ebml (name, &data);
+    else if (bench_ends_with (name, ".mp3"))
+        bench_mp3 (name, &data, 0);
+    else
+        fprintf (stderr, "not sure what %s is, skipped\n", path);
+    bench_data_free (&data);
+}
+
+
+int main (int argc, char **argv)
+{
+    static const unsigned int metaints[] = { 512, 8192, 16000, 32768 };
+    const char *corpus_dir = "bench/corpus";
+    bench_data_t titles = { NULL, 0 }, requests = { NULL, 0 }, stream = { NULL, 0 };
+    bench_data_t uris = { NULL, 0 }, credentials = { NULL, 0 };
+    char corpus [32];
+    unsigned int i;
+    int arg;
+
+    for (arg = 1; arg < argc && argv [arg][0] == '-'; arg++)
+    {
+        if (arg + 1 >= argc)
+            usage ();
+        if (strcmp (argv [arg], "-t") == 0)
+            bench_seconds = atof (argv [++arg]);
+        else if (strcmp (argv [arg], "-b") == 0)
+            bench_only = argv [++arg];
+        else if (strcmp (argv [arg], "-c") == 0)
+            corpus_dir = argv [++arg];
+        else
+            usage ();
+    }
+    if (bench_seconds <= 0)
+        usage ();
+    if (bench_load (&titles, corpus_dir, "titles.txt") < 0 ||
+            bench_load (&requests, corpus_dir, "requests.txt") < 0 ||
+            bench_load (&uris, corpus_dir, "uris.txt") < 0 ||
+            bench_load (&credentials, corpus_dir, "credentials.txt") < 0)
+        return 1;
+
+    bench_initialize ();
+
+    bench_make_opus (&stream, BENCH_STREAM_SECONDS);
+    bench_ogg ("opus-synthetic", &stream);
+    bench_data_free (&stream);
+
+    bench_make_webm (&stream, BENCH_STREAM_SECONDS);
+    bench_ebml ("webm-synthetic", &stream);
+    bench_data_free (&stream);
+    bench_ebml_var_int ();
+
+    bench_make_mp3 (&stream, BENCH_STREAM_SECONDS, 0, NULL);
+    bench_mp3 ("mp3-synthetic", &stream, 0);
+    bench_data_free (&stream);
+    for (i = 0; i < sizeof (metaints) / sizeof (metaints [0]); i++)
+    {
+        bench_make_mp3 (&stream, BENCH_STREAM_SECONDS, metaints [i], &titles);
+        snprintf (corpus, sizeof (corpus), "mp3-icy-%u", metaints [i]);
+        bench_mp3 (corpus, &stream, metaints [i]);
+        bench_data_free (&stream);
+    }
+    bench_shoutcast_metadata (&titles);
+
+    bench_httpp (&requests);
+    bench_util (&uris, &credentials);
+
+    for (; arg < argc; arg++)
+        bench_recording (argv [arg]);
+
+    bench_data_free (&titles);
+    bench_data_free (&requests);
+    bench_data_free (&uris);
+    bench_data_free (&credentials);
+    bench_shutdown ();
+    return 0;
+}
@@ -20,9 +20,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #ifndef _WIN32
 #include <fnmatch.h>
 #endif
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
 
@@ -50,6 +54,9 @@
 #define CONFIG_DEFAULT_THREADPOOL_SIZE  4
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT   30
 #define CONFIG_DEFAULT_HEADER_TIMEOUT   15
+#define CONFIG_DEFAULT_KEEPALIVE_TIMEOUT 5
+#define CONFIG_DEFAULT_KEEPALIVE_PER_IP 16
+#define CONFIG_DEFAULT_FILESERVE_CACHE  64
 #define CONFIG_DEFAULT_SOURCE_TIMEOUT   10
 #define CONFIG_DEFAULT_MASTER_USERNAME  "relay"
 #define CONFIG_DEFAULT_SHOUTCAST_MOUNT  "/stream"
@@ -66,6 +73,7 @@
 #define CONFIG_DEFAULT_GROUP            NULL
 #define CONFIG_MASTER_UPDATE_INTERVAL   120
 #define CONFIG_YP_URL_TIMEOUT           10
+#define CONFIG_DEFAULT_TLS_TICKET_KEY_LIFETIME 43200
 #define CONFIG_DEFAULT_CIPHER_LIST      "ECDHE-RSA-AES128-GCM-SHA256:"\
                                         "ECDHE-ECDSA-AES128-GCM-SHA256:"\
                                         "ECDHE-RSA-AES256-GCM-SHA384:"\
@@ -113,7 +121,39 @@
 #define MIMETYPESFILE                   ".\\mime.types"
 #endif
 
-static ice_config_t _current_configuration;
+/* A reload publishes a new snapshot instead of changing the config in
+ * place. Readers pin the current snapshot for as long as they are between
+ * config_get_config() and config_release_config(). A thread keeps its pin
+ * after releasing while the snapshot stays current, so getting the config
+ * normally is a single load, and drops it with config_drop_pin() before it
+ * waits. A replaced snapshot whose last pin goes is retired, and retired
+ * ones are cleared by config_reclaim() under the write lock, by the
+ * reloading thread or later by the slave thread, never by whichever reader
+ * happened to let go last. _locks.config_lock now only serialises reloads,
+ * unless the per thread pins are not available when readers take it as
+ * before.
+ */
+typedef struct config_snapshot_tag {
+    ice_config_t config;
+    unsigned int refs;      /* under _current_lock */
+    struct config_snapshot_tag *next;   /* on _retired */
+} config_snapshot_t;
+
+typedef struct {
+    config_snapshot_t *snapshot;
+    unsigned int depth;
+    int grabbed;            /* holding config_lock for writing */
+} config_pin_t;
+
+#ifdef HAVE_STDATOMIC_H
+static _Atomic(config_snapshot_t *) _current;
+#else
+static config_snapshot_t *_current;
+#endif
+static spin_t _current_lock;
+static config_snapshot_t *_retired;     /* under _current_lock */
+static pthread_key_t _pin_key;
+static int _pinning = 0;
 static ice_config_locks _locks;
 
 static void _set_defaults(ice_config_t *c);
@@ -121,6 +161,7 @@ static void _parse_root(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_limits(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_directory(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_paths(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
+static void _parse_cpu_affinity(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_logging(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 static void _parse_security(xmlDocPtr doc, xmlNodePtr node, ice_config_t *c);
 
@@ -145,6 +186,10 @@ static void _parse_events(event_registration_t **events, xmlNodePtr node);
 
 static void merge_mounts(mount_proxy * dst, mount_proxy * src);
 static inline void _merge_mounts_all(ice_config_t *c);
+static void config_compile_http_headers_all(ice_config_t *c);
+static void config_index(ice_config_t *c);
+static void config_index_free(struct config_index_tag *index);
+static mount_proxy *config_index_find_normal(struct config_index_tag *index, const char *mount);
 
 operation_mode config_str_to_omode(const char *str)
 {
@@ -176,16 +221,156 @@ static void release_locks(void)
     thread_rwlock_destroy(&_locks.config_lock);
 }
 
+static void _snapshot_unref(config_snapshot_t *snapshot)
+{
+    unsigned int refs;
+
+    thread_spin_lock(&_current_lock);
+    refs = --snapshot->refs;
+    if (refs == 0) {
+        snapshot->next = _retired;
+        _retired = snapshot;
+    }
+    thread_spin_unlock(&_current_lock);
+}
+
+/* clear the retired snapshots, with config_lock held for writing */
+static void _snapshot_reclaim_locked(void)
+{
+    config_snapshot_t *snapshot;
+
+    thread_spin_lock(&_current_lock);
+    snapshot = _retired;
+    _retired = NULL;
+    thread_spin_unlock(&_current_lock);
+
+    while (snapshot) {
+        config_snapshot_t *next = snapshot->next;
+
+        config_clear(&snapshot->config);
+        free(snapshot);
+        snapshot = next;
+    }
+}
+
+static inline config_snapshot_t *_snapshot_current(void)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_load_explicit(&_current, memory_order_acquire);
+#else
+    config_snapshot_t *snapshot;
+
+    thread_spin_lock(&_current_lock);
+    snapshot = _current;
+    thread_spin_unlock(&_current_lock);
+    return snapshot;
+#endif
+}
+
+/* swap in a new current snapshot, returns the previous one */
+static config_snapshot_t *_snapshot_publish(config_snapshot_t *snapshot)
+{
+    config_snapshot_t *old;
+
+    thread_spin_lock(&_current_lock);
+#ifdef HAVE_STDATOMIC_H
+    old = atomic_exchange_explicit(&_current, snapshot, memory_order_acq_rel);
+#else
+    old = _current;
+    _current = snapshot;
+#endif
+    thread_spin_unlock(&_current_lock);
+    return old;
+}
+
+static void _pin_release(void *arg)
+{
+    config_pin_t *pin = arg;
+
+    if (pin->snapshot)
+        _snapshot_unref(pin->snapshot);
+    free(pin);
+}
+
+static config_pin_t *_pin_get(void)
+{
+    config_pin_t *pin = pthread_getspecific(_pin_key);
+
+    if (pin == NULL) {
+        pin = calloc(1, sizeof(config_pin_t));
+        if (pin && pthread_setspecific(_pin_key, pin) != 0) {
+            free(pin);
+            pin = NULL;
+        }
+    }
+    return pin;
+}
+
+/* take a reference on the current snapshot unless the pin already has it */
+static void _pin_update(config_pin_t *pin)
+{
+    config_snapshot_t *snapshot = _snapshot_current();
+
+    if (pin->snapshot == snapshot)
+        return;
+
+    thread_spin_lock(&_current_lock);
+    /* reload the pointer, the one above may since have been released */
+#ifdef HAVE_STDATOMIC_H
+    snapshot = atomic_load_explicit(&_current, memory_order_relaxed);
+#else
+    snapshot = _current;
+#endif
+    if (snapshot)
+        snapshot->refs++;
+    thread_spin_unlock(&_current_lock);
+
+    if (pin->snapshot)
+        _snapshot_unref(pin->snapshot);
+    pin->snapshot = snapshot;
+}
+
 void config_initialize(void)
 {
+    config_snapshot_t *snapshot;
+
     create_locks();
+    thread_spin_create(&_current_lock);
+    if (pthread_key_create(&_pin_key, _pin_release) == 0)
+        _pinning = 1;
+
+    snapshot = calloc(1, sizeof(config_snapshot_t));
+    if (snapshot == NULL)
+        abort();
+    snapshot->refs = 1;
+#ifdef HAVE_STDATOMIC_H
+    atomic_init(&_current, snapshot);
+#else
+    _current = snapshot;
+#endif
 }
 
 void config_shutdown(void)
 {
-    config_get_config();
-    config_clear(&_current_configuration);
-    config_release_config();
+    config_snapshot_t *snapshot;
+
+    thread_rwlock_wlock(&(_locks.config_lock));
+    if (_pinning) {
+        config_pin_t *pin = pthread_getspecific(_pin_key);
+
+        _pinning = 0;
+        if (pin) {
+            pthread_setspecific(_pin_key, NULL);
+            _pin_release(pin);
+        }
+        pthread_key_delete(_pin_key);
+    }
+    snapshot = _snapshot_publish(NULL);
+    if (snapshot)
+        _snapshot_unref(snapshot);
+    _snapshot_reclaim_locked();
+    thread_rwlock_unlock(&(_locks.config_lock));
+    thread_spin_destroy(&_current_lock);
     release_locks();
 }
 
@@ -407,6 +592,51 @@ static void config_clear_http_header(ice_config_http_header_t *header)
     }
 }
 
+/* join the static headers that go out with every status into one string so
+ * building a response does not walk the list. Headers limited to a status
+ * are left to the per request loop, flagged by per_status.
+ */
+static char *config_compile_http_headers(ice_config_http_header_t *header, int *per_status)
+{
+    ice_config_http_header_t *cur;
+    size_t len = 1;
+    char *ret, *p;
+
+    *per_status = 0;
+    for (cur = header; cur; cur = cur->next) {
+        if (cur->type != HTTP_HEADER_TYPE_STATIC || !cur->name || !cur->value)
+            continue;
+        if (cur->status != 0) {
+            *per_status = 1;
+            continue;
+        }
+        len += strlen(cur->name) + strlen(cur->value) + 4;
+    }
+
+    ret = p = malloc(len);
+    if (!ret) {
+        *per_status = 1;
+        return NULL;
+    }
+    for (cur = header; cur; cur = cur->next) {
+        if (cur->type != HTTP_HEADER_TYPE_STATIC || !cur->name || !cur->value || cur->status != 0)
+            continue;
+        p += sprintf(p, "%s: %s\r\n", cur->name, cur->value);
+    }
+    *p = 0;
+    return ret;
+}
+
+static void config_compile_http_headers_all(ice_config_t *c)
+{
+    mount_proxy *mountinfo;
+
+    c->http_headers_compiled = config_compile_http_headers(c->http_headers, &c->http_headers_per_status);
+    for (mountinfo = c->mounts; mountinfo; mountinfo = mountinfo->next)
+        mountinfo->http_headers_compiled = config_compile_http_headers(mountinfo->http_headers,
+                &mountinfo->http_headers_per_status);
+}
+
 static inline ice_config_http_header_t *config_copy_http_header(ice_config_http_header_t *header)
 {
     ice_config_http_header_t *ret = NULL;
@@ -453,6 +683,7 @@ static void config_clear_mount(mount_proxy *mount)
 {
     if (mount->mountname)           xmlFree(mount->mountname);
     if (mount->dumpfile)            xmlFree(mount->dumpfile);
+    if (mount->timeshift)           xmlFree(mount->timeshift);
     if (mount->intro_filename)      xmlFree(mount->intro_filename);
     if (mount->fallback_mount)      xmlFree(mount->fallback_mount);
     if (mount->stream_name)         xmlFree(mount->stream_name);
@@ -467,6 +698,7 @@ static void config_clear_mount(mount_proxy *mount)
 
     event_registration_release(mount->event);
     config_clear_http_header(mount->http_headers);
+    free(mount->http_headers_compiled);
     free(mount);
 }
 
@@ -493,9 +725,7 @@ void config_clear(ice_config_t *c)
                         *nextmount;
     aliases             *alias,
                         *nextalias;
-#ifdef USE_YP
     int                 i;
-#endif
 
     free(c->config_filename);
 
@@ -510,6 +740,7 @@ void config_clear(ice_config_t *c)
     if (c->null_device)     xmlFree(c->null_device);
     if (c->cert_file)       xmlFree(c->cert_file);
     if (c->cipher_list)     xmlFree(c->cipher_list);
+    if (c->tls_ticket_key_file) xmlFree(c->tls_ticket_key_file);
     if (c->pidfile)         xmlFree(c->pidfile);
     if (c->banfile)         xmlFree(c->banfile);
     if (c->allowfile)       xmlFree(c->allowfile);
@@ -517,6 +748,8 @@ void config_clear(ice_config_t *c)
     if (c->access_log)      xmlFree(c->access_log);
     if (c->error_log)       xmlFree(c->error_log);
     if (c->shoutcast_mount) xmlFree(c->shoutcast_mount);
+    for (i = 0; i < AFFINITY_CLASSES; i++)
+        if (c->cpu_affinity[i]) xmlFree(c->cpu_affinity[i]);
     if (c->authstack)       auth_stack_release(c->authstack);
     if (c->master_server)   xmlFree(c->master_server);
     if (c->master_username) xmlFree(c->master_username);
@@ -575,18 +808,122 @@ void config_clear(ice_config_t *c)
 #endif
 
     config_clear_http_header(c->http_headers);
+    free(c->http_headers_compiled);
+    config_index_free(c->index);
     memset(c, 0, sizeof(ice_config_t));
 }
 
+/* FNV-1a over the serialised element */
+static uint64_t config_fingerprint(xmlDocPtr doc, xmlNodePtr node, uint64_t hash)
+{
+    xmlBufferPtr buf = xmlBufferCreate();
+    const unsigned char *p;
+    int len;
+
+    if (buf == NULL)
+        return hash + 1;
+    len = xmlNodeDump(buf, doc, node, 0, 0);
+    p = xmlBufferContent(buf);
+    for (; len > 0; len--, p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    xmlBufferFree(buf);
+    return hash;
+}
+
+void config_reload_diff_free(config_reload_diff_t *diff)
+{
+    size_t i;
+
+    if (diff == NULL)
+        return;
+    for (i = 0; i < diff->count; i++)
+        free(diff->mounts[i]);
+    free(diff->mounts);
+    free(diff);
+}
+
+static int config_reload_diff_add(config_reload_diff_t *diff, const char *mount, size_t *size)
+{
+    if (diff->count == *size) {
+        size_t n = *size ? *size * 2 : 16;
+        char **mounts = realloc(diff->mounts, n * sizeof(char *));
+
+        if (mounts == NULL)
+            return -1;
+        diff->mounts = mounts;
+        *size = n;
+    }
+    diff->mounts[diff->count] = strdup(mount);
+    if (diff->mounts[diff->count] == NULL)
+        return -1;
+    diff->count++;
+    return 0;
+}
+
+/* compare the normal mounts of the two configs, NULL if that fails */
+static config_reload_diff_t *config_reload_diff(ice_config_t *old, ice_config_t *new)
+{
+    config_reload_diff_t *diff = calloc(1, sizeof(config_reload_diff_t));
+    mount_proxy *mount;
+    size_t size = 0;
+
+    if (diff == NULL)
+        return NULL;
+    if (old->index == NULL || new->index == NULL ||
+            old->settings_fingerprint != new->settings_fingerprint) {
+        diff->settings = 1;
+        return diff;
+    }
+
+    for (mount = new->mounts; mount; mount = mount->next) {
+        mount_proxy *previous;
+
+        if (mount->mounttype != MOUNT_TYPE_NORMAL || mount->mountname == NULL)
+            continue;
+        /* only the first of a name is used */
+        if (config_index_find_normal(new->index, mount->mountname) != mount)
+            continue;
+        previous = config_index_find_normal(old->index, mount->mountname);
+        if (previous && previous->fingerprint == mount->fingerprint)
+            continue;
+        if (config_reload_diff_add(diff, mount->mountname, &size) < 0) {
+            config_reload_diff_free(diff);
+            return NULL;
+        }
+        if (previous)
+            diff->changed++;
+        else
+            diff->added++;
+    }
+    for (mount = old->mounts; mount; mount = mount->next) {
+        if (mount->mounttype != MOUNT_TYPE_NORMAL || mount->mountname == NULL)
+            continue;
+        if (config_index_find_normal(old->index, mount->mountname) != mount)
+            continue;
+        if (config_index_find_normal(new->index, mount->mountname))
+            continue;
+        if (config_reload_diff_add(diff, mount->mountname, &size) < 0) {
+            config_reload_diff_free(diff);
+            return NULL;
+        }
+        diff->removed++;
+    }
+    return diff;
+}
+
 void config_reread_config(void)
 {
     int           ret;
     ice_config_t *config;
     ice_config_t  new_config;
+    config_reload_diff_t *diff;
     /* reread config file */
 
-    config = config_grab_config(); /* Both to get the lock, and to be able
-                                     to find out the config filename */
+    /* only one reload at a time, the current config stays while we hold it */
+    thread_rwlock_wlock(&(_locks.config_lock));
+    config = config_get_config_unlocked();
     xmlSetGenericErrorFunc("config", log_parse_failure);
     ret = config_parse_file(config->config_filename, &new_config);
     if(ret < 0) {
@@ -606,24 +943,40 @@ void config_reread_config(void)
                 ICECAST_LOG_ERROR("Parse error in reading %s", config->config_filename);
             break;
         }
-        config_release_config();
+        thread_rwlock_unlock(&(_locks.config_lock));
     } else {
-        config_clear(config);
+        diff = config_reload_diff(config, &new_config);
         config_set_config(&new_config);
         config = config_get_config_unlocked();
         restart_logging(config);
         yp_recheck_config(config);
         fserve_recheck_mime_types(config);
         stats_global(config);
-        config_release_config();
-        slave_update_all_mounts();
+        thread_rwlock_unlock(&(_locks.config_lock));
+
+        if (diff == NULL || diff->settings) {
+            ICECAST_LOG_INFO("Config reloaded, updating all mounts");
+            config_reload_diff_free(diff);
+            stats_event(NULL, "config_reload_mounts", "all");
+            slave_update_all_mounts();
+        } else {
+            ICECAST_LOG_INFO("Config reloaded, %u mounts added, %u changed, %u removed",
+                    diff->added, diff->changed, diff->removed);
+            stats_event_args(NULL, "config_reload_mounts", "%u added, %u changed, %u removed",
+                    diff->added, diff->changed, diff->removed);
+            slave_update_changed_mounts(diff);
+        }
     }
 }
 
 int config_initial_parse_file(const char *filename)
 {
-    /* Since we're already pointing at it, we don't need to copy it in place */
-    return config_parse_file(filename, &_current_configuration);
+    ice_config_t new_config;
+    int ret = config_parse_file(filename, &new_config);
+
+    if (ret == 0)
+        config_set_config(&new_config);
+    return ret;
 }
 
 int config_parse_file(const char *filename, ice_config_t *configuration)
@@ -653,6 +1006,8 @@ int config_parse_file(const char *filename, ice_config_t *configuration)
     _parse_root(doc, node->xmlChildrenNode, configuration);
     xmlFreeDoc(doc);
     _merge_mounts_all(configuration);
+    config_compile_http_headers_all(configuration);
+    config_index(configuration);
     return 0;
 }
 
@@ -668,30 +1023,102 @@ ice_config_locks *config_locks(void)
 
 void config_release_config(void)
 {
+    config_pin_t *pin;
+
+    if (!_pinning || (pin = pthread_getspecific(_pin_key)) == NULL || pin->depth == 0) {
+        thread_rwlock_unlock(&(_locks.config_lock));
+        return;
+    }
+    if (--pin->depth)
+        return;
+    /* the snapshot stays pinned while it is current */
+    if (pin->snapshot && pin->snapshot != _snapshot_current()) {
+        _snapshot_unref(pin->snapshot);
+        pin->snapshot = NULL;
+    }
+    if (pin->grabbed) {
+        pin->grabbed = 0;
+        /* the reload is done with the old config now */
+        _snapshot_reclaim_locked();
+        thread_rwlock_unlock(&(_locks.config_lock));
+    }
+}
+
+void config_drop_pin(void)
+{
+    config_pin_t *pin;
+
+    if (!_pinning || (pin = pthread_getspecific(_pin_key)) == NULL ||
+            pin->depth || pin->snapshot == NULL)
+        return;
+    _snapshot_unref(pin->snapshot);
+    pin->snapshot = NULL;
+}
+
+void config_reclaim(void)
+{
+    config_snapshot_t *retired;
+
+    thread_spin_lock(&_current_lock);
+    retired = _retired;
+    thread_spin_unlock(&_current_lock);
+    if (retired == NULL)
+        return;
+    thread_rwlock_wlock(&(_locks.config_lock));
+    _snapshot_reclaim_locked();
     thread_rwlock_unlock(&(_locks.config_lock));
 }
 
 ice_config_t *config_get_config(void)
 {
-    thread_rwlock_rlock(&(_locks.config_lock));
-    return &_current_configuration;
+    config_pin_t *pin;
+
+    if (!_pinning || (pin = _pin_get()) == NULL) {
+        thread_rwlock_rlock(&(_locks.config_lock));
+        return config_get_config_unlocked();
+    }
+    /* nested calls see the same config */
+    if (pin->depth++ == 0)
+        _pin_update(pin);
+    return &pin->snapshot->config;
 }
 
 ice_config_t *config_grab_config(void)
 {
+    config_pin_t *pin;
+
     thread_rwlock_wlock(&(_locks.config_lock));
-    return &_current_configuration;
+    if (_pinning && (pin = _pin_get()) != NULL) {
+        if (pin->depth++ == 0)
+            _pin_update(pin);
+        pin->grabbed = 1;
+        return &pin->snapshot->config;
+    }
+    return config_get_config_unlocked();
 }
 
-/* MUST be called with the lock held! */
+/* Publishes config as the current configuration, taking over what it
+ * holds. The previous config is cleared here, or by config_reclaim()
+ * once nothing refers to it any more.
+ * MUST be called with the lock held!
+ */
 void config_set_config(ice_config_t *config)
 {
-    memcpy(&_current_configuration, config, sizeof(ice_config_t));
+    config_snapshot_t *snapshot = calloc(1, sizeof(config_snapshot_t));
+
+    if (snapshot == NULL)
+        abort();
+    memcpy(&snapshot->config, config, sizeof(ice_config_t));
+    snapshot->refs = 1;
+    snapshot = _snapshot_publish(snapshot);
+    if (snapshot)
+        _snapshot_unref(snapshot);
+    _snapshot_reclaim_locked();
 }
 
 ice_config_t *config_get_config_unlocked(void)
 {
-    return &_current_configuration;
+    return &_snapshot_current()->config;
 }
 
 static void _set_defaults(ice_config_t *configuration)
@@ -712,6 +1139,12 @@ static void _set_defaults(ice_config_t *configuration)
         ->client_timeout = CONFIG_DEFAULT_CLIENT_TIMEOUT;
     configuration
         ->header_timeout = CONFIG_DEFAULT_HEADER_TIMEOUT;
+    configuration
+        ->keepalive_timeout = CONFIG_DEFAULT_KEEPALIVE_TIMEOUT;
+    configuration
+        ->keepalive_per_ip = CONFIG_DEFAULT_KEEPALIVE_PER_IP;
+    configuration
+        ->fileserve_cache = CONFIG_DEFAULT_FILESERVE_CACHE;
     configuration
         ->source_timeout = CONFIG_DEFAULT_SOURCE_TIMEOUT;
     configuration
@@ -744,6 +1177,10 @@ static void _set_defaults(ice_config_t *configuration)
         ->log_dir = (char *) xmlCharStrdup(CONFIG_DEFAULT_LOG_DIR);
     configuration
         ->cipher_list = (char *) xmlCharStrdup(CONFIG_DEFAULT_CIPHER_LIST);
+    configuration
+        ->tls_session_cache = -1;
+    configuration
+        ->tls_ticket_key_lifetime = CONFIG_DEFAULT_TLS_TICKET_KEY_LIFETIME;
     configuration
         ->null_device = (char *) xmlCharStrdup(CONFIG_DEFAULT_NULL_FILE);
     configuration
@@ -839,12 +1276,28 @@ static void _parse_root(xmlDocPtr       doc,
         ->listen_sock->port = 8000;
     configuration
         ->listen_sock_count = 1;
+    configuration->settings_fingerprint = 14695981039346656037ULL;
 
     do {
         if (node == NULL)
             break;
         if (xmlIsBlankNode(node))
             continue;
+        /* relays are compared by the slave thread */
+        if (xmlStrcmp(node->name, XMLSTR("relay")) != 0) {
+            int normal_mount = 0;
+
+            if (xmlStrcmp(node->name, XMLSTR("mount")) == 0) {
+                xmlChar *type = xmlGetProp(node, XMLSTR("type"));
+
+                normal_mount = type == NULL || xmlStrcmp(type, XMLSTR("normal")) == 0;
+                if (type)
+                    xmlFree(type);
+            }
+            /* a default mount may apply to any of the normal ones */
+            if (!normal_mount)
+                configuration->settings_fingerprint = config_fingerprint(doc, node, configuration->settings_fingerprint);
+        }
         if (xmlStrcmp(node->name, XMLSTR("location")) == 0) {
             if (configuration->location)
                 xmlFree(configuration->location);
@@ -932,6 +1385,8 @@ static void _parse_root(xmlDocPtr       doc,
             configuration->shoutcast_mount = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
         } else if (xmlStrcmp(node->name, XMLSTR("limits")) == 0) {
             _parse_limits(doc, node->xmlChildrenNode, configuration);
+        } else if (xmlStrcmp(node->name, XMLSTR("cpu-affinity")) == 0) {
+            _parse_cpu_affinity(doc, node->xmlChildrenNode, configuration);
         } else if (xmlStrcmp(node->name, XMLSTR("http-headers")) == 0) {
             _parse_http_headers(doc, node->xmlChildrenNode, &(configuration->http_headers));
         } else if (xmlStrcmp(node->name, XMLSTR("relay")) == 0) {
@@ -1038,11 +1493,21 @@ static void _parse_limits(xmlDocPtr     doc,
             configuration->source_limit = atoi(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("redirect-threshold")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->redirect_threshold = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("queue-size")) == 0) {
             tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
             configuration->queue_size_limit = atoi(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("memory-budget")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->memory_budget = tmp == NULL ? 0 : strtoul(tmp, NULL, 10);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("threadpool")) == 0) {
             ICECAST_LOG_WARN("<threadpool> functionality was removed in Icecast"
 			     " version 2.3.0, please remove this from your config.");
@@ -1056,6 +1521,41 @@ static void _parse_limits(xmlDocPtr     doc,
             configuration->header_timeout = atoi(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("keepalive-timeout")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->keepalive_timeout = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("keepalive-per-ip")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->keepalive_per_ip = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("request-threads")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->request_threads = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("relay-threads")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->relay_threads = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("fileserve-threads")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->fileserve_threads = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("fileserve-io-uring")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->fileserve_io_uring = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("fileserve-cache")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->fileserve_cache = tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("source-timeout")) == 0) {
             tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
             configuration->source_timeout = atoi(tmp);
@@ -1267,6 +1767,8 @@ static void _parse_mount(xmlDocPtr      doc,
     mount->max_history          = -1;
     mount->next                 = NULL;
 
+    mount->fingerprint = config_fingerprint(doc, node, 14695981039346656037ULL);
+
     tmp = (char *)xmlGetProp(node, XMLSTR("type"));
     if (tmp) {
         if (strcmp(tmp, "normal") == 0) {
@@ -1301,6 +1803,55 @@ static void _parse_mount(xmlDocPtr      doc,
         } else if (xmlStrcmp(node->name, XMLSTR("dump-file")) == 0) {
             mount->dumpfile = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("dump-file-queue-size")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->dumpfile_queue_size = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("dump-file-overflow")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp == NULL || strcmp(tmp, "drop") == 0) {
+                mount->dumpfile_overflow = DUMPFILE_OVERFLOW_DROP;
+            } else if (strcmp(tmp, "stop") == 0) {
+                mount->dumpfile_overflow = DUMPFILE_OVERFLOW_STOP;
+            } else {
+                ICECAST_LOG_WARN("Unknown dump-file-overflow: %s", tmp);
+            }
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("timeshift")) == 0) {
+            mount->timeshift = (char *)xmlNodeListGetString(doc,
+                node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("timeshift-segment")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->timeshift_segment = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("timeshift-duration")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->timeshift_duration = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("hls")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->hls = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("hls-segment")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->hls_segment = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("hls-segments")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->hls_segments = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("dump-file-preallocate")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->dumpfile_preallocate = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("intro")) == 0) {
             mount->intro_filename = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
@@ -1324,6 +1875,78 @@ static void _parse_mount(xmlDocPtr      doc,
                 mount->max_history = 256; /* deny super huge values */
             if(tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("sender-threads")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->sender_threads = atoi(tmp);
+            if (mount->sender_threads < 0)
+                mount->sender_threads = 0;
+            if (mount->sender_threads > 64)
+                mount->sender_threads = 64; /* deny super huge values */
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-events")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->listener_events = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("slow-listener-action")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp == NULL || strcmp(tmp, "disconnect") == 0) {
+                mount->slow_listener_action = SLOW_LISTENER_DISCONNECT;
+            } else if (strcmp(tmp, "burst") == 0) {
+                mount->slow_listener_action = SLOW_LISTENER_SKIP_BURST;
+            } else if (strcmp(tmp, "latest") == 0) {
+                mount->slow_listener_action = SLOW_LISTENER_SKIP_LATEST;
+            } else {
+                ICECAST_LOG_WARN("Unknown slow-listener-action: %s", tmp);
+            }
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("io-uring")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->io_uring = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("zerocopy")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->zerocopy = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("metadata-interval")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->metadata_interval = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("low-latency")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->low_latency = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("so-sndbuf")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->so_sndbuf = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("so-notsent-lowat")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->so_notsent_lowat = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-rate")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->listener_rate = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("listener-burst")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->listener_burst = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("queue-ring")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->queue_ring = util_str_to_bool(tmp);
+            if(tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("charset")) == 0) {
             mount->charset = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
@@ -1409,6 +2032,11 @@ static void _parse_mount(xmlDocPtr      doc,
             mount->burst_size = atoi(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("burst-duration")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            mount->burst_duration = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("cluster-password")) == 0) {
             mount->cluster_password = (char *)xmlNodeListGetString(doc,
                 node->xmlChildrenNode, 1);
@@ -1654,6 +2282,11 @@ static void _parse_relay(xmlDocPtr      doc,
             relay->on_demand = util_str_to_bool(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("on-demand-warm")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            relay->on_demand_warm = util_str_to_bool(tmp);
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("bind")) == 0) {
             if (relay->bind)
                 xmlFree(relay->bind);
@@ -1718,6 +2351,26 @@ static void _parse_listen_socket(xmlDocPtr      doc,
             listener->so_sndbuf = atoi(tmp);
             if(tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("acceptors")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            listener->acceptors = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("so-notsent-lowat")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            listener->so_notsent_lowat = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("accept-rate")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            listener->accept_rate = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("accept-burst")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            listener->accept_burst = tmp == NULL ? 0 : atoi(tmp);
+            if(tmp)
+                xmlFree(tmp);
         }
     } while ((node = node->next));
 
@@ -1858,6 +2511,12 @@ static void _parse_directory(xmlDocPtr      doc,
                     atoi(tmp);
             if (tmp)
                 xmlFree(tmp);
+        } else if (xmlStrcmp(node->name, XMLSTR("max-inflight")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->yp_max_inflight[configuration->num_yp_directories] =
+                tmp == NULL ? 0 : atoi(tmp);
+            if (tmp)
+                xmlFree(tmp);
         }
     } while ((node = node->next));
     if (configuration->yp_url[configuration->num_yp_directories] == NULL)
@@ -1865,6 +2524,36 @@ static void _parse_directory(xmlDocPtr      doc,
     configuration->num_yp_directories++;
 }
 
+/* element names in <cpu-affinity>, in affinity_class order */
+static const char *_affinity_names[AFFINITY_CLASSES] = {
+    "source", "sender", "relay", "fileserve", "acceptor", "request"
+};
+
+static void _parse_cpu_affinity(xmlDocPtr       doc,
+                                xmlNodePtr      node,
+                                ice_config_t   *configuration)
+{
+    unsigned int i;
+
+    do {
+        if (node == NULL)
+            break;
+        if (xmlIsBlankNode(node))
+            continue;
+
+        for (i = 0; i < AFFINITY_CLASSES; i++) {
+            if (xmlStrcmp(node->name, XMLSTR(_affinity_names[i])) == 0) {
+                if (configuration->cpu_affinity[i])
+                    xmlFree(configuration->cpu_affinity[i]);
+                configuration->cpu_affinity[i] = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+                break;
+            }
+        }
+        if (i == AFFINITY_CLASSES)
+            ICECAST_LOG_WARN("Unknown thread class <%s> in <cpu-affinity>", node->name);
+    } while ((node = node->next));
+}
+
 static void _parse_paths(xmlDocPtr      doc,
                          xmlNodePtr     node,
                          ice_config_t  *configuration)
@@ -1923,6 +2612,30 @@ static void _parse_paths(xmlDocPtr      doc,
             if (configuration->cipher_list)
                 xmlFree(configuration->cipher_list);
             configuration->cipher_list = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-session-cache")) == 0) {
+            temp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->tls_session_cache = temp == NULL ? 0 : atoi(temp);
+            if (temp)
+                xmlFree(temp);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-session-timeout")) == 0) {
+            temp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->tls_session_timeout = temp == NULL ? 0 : atoi(temp);
+            if (temp)
+                xmlFree(temp);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-ticket-key-file")) == 0) {
+            if (configuration->tls_ticket_key_file)
+                xmlFree(configuration->tls_ticket_key_file);
+            configuration->tls_ticket_key_file = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-ticket-key-lifetime")) == 0) {
+            temp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->tls_ticket_key_lifetime = temp == NULL ? 0 : atoi(temp);
+            if (temp)
+                xmlFree(temp);
+        } else if (xmlStrcmp(node->name, XMLSTR("tls-kernel-offload")) == 0) {
+            temp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            configuration->tls_ktls = util_str_to_bool(temp);
+            if (temp)
+                xmlFree(temp);
         } else if (xmlStrcmp(node->name, XMLSTR("webroot")) == 0) {
             if (!(temp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1))) {
                 ICECAST_LOG_WARN("<webroot> setting must not be empty.");
@@ -2010,6 +2723,18 @@ static void _parse_logging(xmlDocPtr        doc,
             if (configuration->access_log)
                 xmlFree(configuration->access_log);
             configuration->access_log = tmp;
+        } else if (xmlStrcmp(node->name, XMLSTR("accesslog-format")) == 0) {
+            tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);
+            if (tmp == NULL || strcmp(tmp, "combined") == 0) {
+                configuration->access_log_format = ACCESS_LOG_FORMAT_COMBINED;
+            } else if (strcmp(tmp, "json") == 0) {
+                configuration->access_log_format = ACCESS_LOG_FORMAT_JSON;
+            } else {
+                ICECAST_LOG_WARN("Unknown <accesslog-format> %s, using combined.", tmp);
+                configuration->access_log_format = ACCESS_LOG_FORMAT_COMBINED;
+            }
+            if (tmp)
+                xmlFree(tmp);
         } else if (xmlStrcmp(node->name, XMLSTR("errorlog")) == 0) {
             if (!(tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1))) {
                 ICECAST_LOG_WARN("<errorlog> setting must not be empty.");
@@ -2206,6 +2931,24 @@ static void merge_mounts(mount_proxy * dst, mount_proxy * src)
 
     if (!dst->dumpfile)
         dst->dumpfile = (char*)xmlStrdup((xmlChar*)src->dumpfile);
+    if (!dst->dumpfile_queue_size)
+        dst->dumpfile_queue_size = src->dumpfile_queue_size;
+    if (dst->dumpfile_overflow == DUMPFILE_OVERFLOW_DROP)
+        dst->dumpfile_overflow = src->dumpfile_overflow;
+    if (!dst->dumpfile_preallocate)
+        dst->dumpfile_preallocate = src->dumpfile_preallocate;
+    if (!dst->timeshift)
+        dst->timeshift = (char*)xmlStrdup((xmlChar*)src->timeshift);
+    if (!dst->timeshift_segment)
+        dst->timeshift_segment = src->timeshift_segment;
+    if (!dst->timeshift_duration)
+        dst->timeshift_duration = src->timeshift_duration;
+    if (!dst->hls)
+        dst->hls = src->hls;
+    if (!dst->hls_segment)
+        dst->hls_segment = src->hls_segment;
+    if (!dst->hls_segments)
+        dst->hls_segments = src->hls_segments;
     if (!dst->intro_filename)
         dst->intro_filename = (char*)xmlStrdup((xmlChar*)src->intro_filename);
     if (!dst->fallback_when_full)
@@ -2220,6 +2963,8 @@ static void merge_mounts(mount_proxy * dst, mount_proxy * src)
         dst->no_mount = src->no_mount;
     if (dst->burst_size == -1)
         dst->burst_size = src->burst_size;
+    if (!dst->burst_duration)
+        dst->burst_duration = src->burst_duration;
     if (!dst->queue_size_limit)
         dst->queue_size_limit = src->queue_size_limit;
     if (!dst->hidden)
@@ -2252,6 +2997,30 @@ static void merge_mounts(mount_proxy * dst, mount_proxy * src)
         dst->yp_public = src->yp_public;
     if (dst->max_history == -1)
         dst->max_history = src->max_history;
+    if (!dst->sender_threads)
+        dst->sender_threads = src->sender_threads;
+    if (!dst->listener_events)
+        dst->listener_events = src->listener_events;
+    if (!dst->queue_ring)
+        dst->queue_ring = src->queue_ring;
+    if (dst->slow_listener_action == SLOW_LISTENER_DISCONNECT)
+        dst->slow_listener_action = src->slow_listener_action;
+    if (!dst->io_uring)
+        dst->io_uring = src->io_uring;
+    if (!dst->zerocopy)
+        dst->zerocopy = src->zerocopy;
+    if (!dst->low_latency)
+        dst->low_latency = src->low_latency;
+    if (!dst->metadata_interval)
+        dst->metadata_interval = src->metadata_interval;
+    if (!dst->so_sndbuf)
+        dst->so_sndbuf = src->so_sndbuf;
+    if (!dst->so_notsent_lowat)
+        dst->so_notsent_lowat = src->so_notsent_lowat;
+    if (!dst->listener_rate) {
+        dst->listener_rate = src->listener_rate;
+        dst->listener_burst = src->listener_burst;
+    }
 
     if (dst->http_headers) {
         http_header_next = dst->http_headers;
@@ -2275,6 +3044,169 @@ static inline void _merge_mounts_all(ice_config_t *c) {
     }
 }
 
+/* Built once per config load so config_find_mount() and
+ * config_get_listen_sock() do not walk the lists for every request.
+ * Normal mounts are hashed by name, default mounts are kept in config
+ * order, as the first match wins, with the literal part of each pattern
+ * checked before fnmatch().
+ */
+typedef struct {
+    mount_proxy *mount;
+    size_t prefix_len;       /* up to the first wildcard */
+    int literal;             /* plain name, compared with strcmp */
+} config_default_mount_t;
+
+typedef struct config_index_tag {
+    mount_proxy **mounts;   /* open addressing, first mount of a name */
+    size_t mount_mask;
+    config_default_mount_t *defaults;
+    size_t default_count;
+    listener_t **listeners; /* same order as global.serversock */
+    size_t listener_count;
+} config_index_t;
+
+/* FNV-1a */
+static unsigned int config_hash_name(const char *name)
+{
+    unsigned int hash = 2166136261U;
+
+    for (; *name; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void config_index_free(config_index_t *index)
+{
+    if (index == NULL)
+        return;
+    free(index->mounts);
+    free(index->defaults);
+    free(index->listeners);
+    free(index);
+}
+
+void config_index_listeners(ice_config_t *config)
+{
+    config_index_t *index = config->index;
+    listener_t *listener;
+    size_t count = 0;
+
+    if (index == NULL)
+        return;
+
+    for (listener = config->listen_sock; listener; listener = listener->next)
+        count++;
+    free(index->listeners);
+    index->listeners = calloc(count ? count : 1, sizeof(listener_t *));
+    index->listener_count = 0;
+    if (index->listeners == NULL)
+        return;
+    for (listener = config->listen_sock; listener; listener = listener->next)
+        index->listeners[index->listener_count++] = listener;
+}
+
+static void config_index(ice_config_t *c)
+{
+    config_index_t *index;
+    mount_proxy *mountinfo;
+    size_t normal = 0, defaults = 0, size = 16;
+
+    config_index_free(c->index);
+    c->index = NULL;
+
+    for (mountinfo = c->mounts; mountinfo; mountinfo = mountinfo->next) {
+        if (mountinfo->mounttype == MOUNT_TYPE_NORMAL)
+            normal++;
+        else if (mountinfo->mounttype == MOUNT_TYPE_DEFAULT)
+            defaults++;
+    }
+    /* at most half full */
+    while (size < normal * 2)
+        size <<= 1;
+
+    index = calloc(1, sizeof(config_index_t));
+    if (index == NULL)
+        return;
+    index->mounts = calloc(size, sizeof(mount_proxy *));
+    index->defaults = calloc(defaults ? defaults : 1, sizeof(config_default_mount_t));
+    if (index->mounts == NULL || index->defaults == NULL) {
+        config_index_free(index);
+        return;
+    }
+    index->mount_mask = size - 1;
+
+    for (mountinfo = c->mounts; mountinfo; mountinfo = mountinfo->next) {
+        if (mountinfo->mounttype == MOUNT_TYPE_NORMAL) {
+            size_t slot;
+
+            if (mountinfo->mountname == NULL)
+                continue;
+            slot = config_hash_name(mountinfo->mountname) & index->mount_mask;
+            while (index->mounts[slot]) {
+                if (strcmp(index->mounts[slot]->mountname, mountinfo->mountname) == 0)
+                    break;
+                slot = (slot + 1) & index->mount_mask;
+            }
+            if (index->mounts[slot] == NULL)
+                index->mounts[slot] = mountinfo;
+        } else if (mountinfo->mounttype == MOUNT_TYPE_DEFAULT) {
+            config_default_mount_t *entry = &index->defaults[index->default_count++];
+
+            entry->mount = mountinfo;
+            if (mountinfo->mountname) {
+#ifndef _WIN32
+                entry->prefix_len = strcspn(mountinfo->mountname, "*?[\\");
+                entry->literal = mountinfo->mountname[entry->prefix_len] == '\0';
+#else
+                entry->prefix_len = strlen(mountinfo->mountname);
+                entry->literal = 1;
+#endif
+            }
+        }
+    }
+
+    c->index = index;
+    config_index_listeners(c);
+}
+
+static mount_proxy *config_index_find_default(config_index_t *index, const char *mount)
+{
+    size_t i;
+
+    for (i = 0; i < index->default_count; i++) {
+        config_default_mount_t *entry = &index->defaults[i];
+
+        if (!mount || !entry->mount->mountname)
+            return entry->mount;
+        if (entry->literal) {
+            if (strcmp(entry->mount->mountname, mount) == 0)
+                return entry->mount;
+            continue;
+        }
+        if (strncmp(entry->mount->mountname, mount, entry->prefix_len) != 0)
+            continue;
+#ifndef _WIN32
+        if (fnmatch(entry->mount->mountname, mount, FNM_PATHNAME) == 0)
+            return entry->mount;
+#endif
+    }
+    return NULL;
+}
+
+static mount_proxy *config_index_find_normal(config_index_t *index, const char *mount)
+{
+    size_t slot = config_hash_name(mount) & index->mount_mask;
+
+    while (index->mounts[slot]) {
+        if (strcmp(index->mounts[slot]->mountname, mount) == 0)
+            return index->mounts[slot];
+        slot = (slot + 1) & index->mount_mask;
+    }
+    return NULL;
+}
+
 /* return the mount details that match the supplied mountpoint */
 mount_proxy *config_find_mount (ice_config_t        *config,
                                 const char          *mount,
@@ -2286,6 +3218,15 @@ mount_proxy *config_find_mount (ice_config_t        *config,
     if (!mount && type != MOUNT_TYPE_DEFAULT)
         return NULL;
 
+    if (config->index) {
+        mountinfo = NULL;
+        if (type == MOUNT_TYPE_NORMAL)
+            mountinfo = config_index_find_normal(config->index, mount);
+        if (mountinfo == NULL)
+            mountinfo = config_index_find_default(config->index, mount);
+        return mountinfo;
+    }
+
     for (; mountinfo; mountinfo = mountinfo->next) {
         if (mountinfo->mounttype != type)
             continue;
@@ -2322,6 +3263,13 @@ listener_t *config_get_listen_sock(ice_config_t *config, connection_t *con)
     listener_t *listener;
     int i = 0;
 
+    if (config->index && config->index->listeners) {
+        i = connection_serversock_slot(con->serversock);
+        if (i < 0 || (size_t)i >= config->index->listener_count)
+            return NULL;
+        return config->index->listeners[i];
+    }
+
     listener = config->listen_sock;
     while (listener) {
         if (i >= global.server_sockets) {
@@ -86,20 +86,72 @@ typedef struct _config_options {
     struct _config_options *next;
 } config_options_t;
 
+typedef enum _slow_listener_action {
+ /* Drop listeners which have fallen too far behind. */
+ SLOW_LISTENER_DISCONNECT = 0,
+ /* Move them on to the start of the burst data. */
+ SLOW_LISTENER_SKIP_BURST,
+ /* Move them on to the most recent sync point. */
+ SLOW_LISTENER_SKIP_LATEST
+} slow_listener_action;
+
+typedef enum _dumpfile_overflow_action {
+ /* Leave out what cannot be queued for the dump file. */
+ DUMPFILE_OVERFLOW_DROP = 0,
+ /* Stop writing the dump file. */
+ DUMPFILE_OVERFLOW_STOP
+} dumpfile_overflow_action;
+
+typedef enum _access_log_format {
+ /* Combined log format lines. */
+ ACCESS_LOG_FORMAT_COMBINED = 0,
+ /* One JSON object per line. */
+ ACCESS_LOG_FORMAT_JSON
+} access_log_format;
+
 typedef enum _mount_type {
  MOUNT_TYPE_NORMAL,
  MOUNT_TYPE_DEFAULT
 } mount_type;
 
+/* the kinds of thread that can be given their own CPUs */
+typedef enum _affinity_class {
+ AFFINITY_SOURCE = 0,
+ AFFINITY_SENDER,
+ AFFINITY_RELAY,
+ AFFINITY_FILESERVE,
+ AFFINITY_ACCEPTOR,
+ AFFINITY_REQUEST,
+ AFFINITY_CLASSES
+} affinity_class;
+
 typedef struct _mount_proxy {
     /* The mountpoint this proxy is used for */
     char *mountname;
     /* The type of the mount point */
     mount_type mounttype;
+    /* hash of the <mount> element, to find out what a reload changed */
+    uint64_t fingerprint;
     /* Filename to dump this stream to (will be appended).
      * NULL to not dump.
      */
     char *dumpfile;
+    /* bytes waiting to be written to it before the overflow action, with
+     * how far ahead the file is allocated, 0 for the defaults */
+    unsigned int dumpfile_queue_size;
+    dumpfile_overflow_action dumpfile_overflow;
+    unsigned int dumpfile_preallocate;
+    /* directory to record the stream to in segments for listeners to
+     * start back in time, with the segment length and how long to keep
+     * them in seconds */
+    char *timeshift;
+    unsigned int timeshift_segment;
+    unsigned int timeshift_duration;
+    /* HLS output, with the segment length in seconds and the number of
+     * segments in the playlist */
+    int hls;
+    unsigned int hls_segment;
+    unsigned int hls_segments;
     /* Send contents of file to client before the stream */
     char *intro_filename;
     /* Switch new listener to fallback source when max listeners reached */
@@ -122,6 +174,8 @@ typedef struct _mount_proxy {
      * from global setting
      */
     int burst_size;
+    /* length of stream in ms to burst instead of burst_size, 0 if unset */
+    unsigned int burst_duration;
     unsigned int queue_size_limit;
     /* Do we list this on the xsl pages */
     int hidden;
@@ -133,10 +187,47 @@ typedef struct _mount_proxy {
     int mp3_meta_interval;
     /* additional HTTP headers */
     ice_config_http_header_t *http_headers;
+    /* the static headers sent regardless of status, joined once at load.
+     * Set http_headers_per_status if some header needs the full loop */
+    char *http_headers_compiled;
+    int http_headers_per_status;
 
     /* maximum history size of played songs */
     ssize_t max_history;
 
+    /* number of threads used to send data to listeners, 0 or 1 sends
+     * everything from the source thread */
+    int sender_threads;
+
+    /* wake up the source thread when listener sockets become writable */
+    int listener_events;
+
+    /* keep the stream queue on a ring, listeners hold positions on it */
+    int queue_ring;
+
+    /* what to do with listeners which fall off the end of the queue */
+    slow_listener_action slow_listener_action;
+
+    /* submit the listener writes of each pass in batches through io_uring */
+    int io_uring;
+
+    /* send to listeners without copying the stream data into the kernel */
+    int zerocopy;
+
+    /* no burst, small socket buffers and prioritised listener sockets */
+    int low_latency;
+
+    /* least ms between metadata updates sent to listeners */
+    unsigned int metadata_interval;
+
+    /* kernel send buffer size and unsent data limit for listener sockets */
+    int so_sndbuf;
+    int so_notsent_lowat;
+
+    /* new listeners allowed per second and in a burst, 0 for no limit */
+    unsigned int listener_rate;
+    unsigned int listener_burst;
+
     struct event_registration_tag *event;
 
     char *cluster_password;
@@ -169,6 +260,11 @@ typedef struct _listener_t {
     struct _listener_t *next;
     int port;
     int so_sndbuf;
+    int so_notsent_lowat;
+    int acceptors;
+    /* new connections taken on per second and in a burst, 0 for no limit */
+    unsigned int accept_rate;
+    unsigned int accept_burst;
     char *bind_address;
     int shoutcast_compat;
     char *shoutcast_mount;
@@ -183,10 +279,26 @@ typedef struct ice_config_tag {
 
     int client_limit;
     int source_limit;
+    int redirect_threshold; /* clients beyond which listeners go to slaves */
     unsigned int queue_size_limit;
     unsigned int burst_size;
+    /* bytes of stream data queued over all sources before queues shrink */
+    unsigned long memory_budget;
+    /* CPU lists from <cpu-affinity>, NULL to leave a thread class alone */
+    char *cpu_affinity[AFFINITY_CLASSES];
     int client_timeout;
     int header_timeout;
+    /* seconds a finished connection waits for its next request, 0 to close */
+    int keepalive_timeout;
+    /* connections from one address kept open waiting for a request */
+    unsigned int keepalive_per_ip;
+    int request_threads;
+    /* threads running active relays between them, 0 for one each */
+    int relay_threads;
+    int fileserve_threads;
+    /* batch the writes of each file serving pass through io_uring */
+    int fileserve_io_uring;
+    int fileserve_cache;
     int source_timeout;
     int fileserve;
     int on_demand; /* global setting for all relays */
@@ -214,6 +326,8 @@ typedef struct ice_config_tag {
     char *master_password;
 
     ice_config_http_header_t *http_headers;
+    char *http_headers_compiled;
+    int http_headers_per_status;
 
     /* is TLS supported by the server? */
     int tls_ok;
@@ -221,6 +335,10 @@ typedef struct ice_config_tag {
     relay_server *relay;
 
     mount_proxy *mounts;
+    /* lookup tables over mounts and listen_sock, see config_index() */
+    struct config_index_tag *index;
+    /* hash of everything but normal mounts and relays */
+    uint64_t settings_fingerprint;
 
     char *server_id;
     char *base_dir;
@@ -231,11 +349,17 @@ typedef struct ice_config_tag {
     char *allowfile;
     char *cert_file;
     char *cipher_list;
+    int tls_ktls;
+    int tls_session_cache;
+    int tls_session_timeout;
+    char *tls_ticket_key_file;
+    int tls_ticket_key_lifetime;
     char *webroot_dir;
     char *adminroot_dir;
     aliases *aliases;
 
     char *access_log;
+    access_log_format access_log_format;
     char *error_log;
     char *playlist_log;
     int loglevel;
@@ -249,9 +373,24 @@ typedef struct ice_config_tag {
     char *yp_url[MAX_YP_DIRECTORIES];
     int yp_url_timeout[MAX_YP_DIRECTORIES];
     int yp_touch_interval[MAX_YP_DIRECTORIES];
+    int yp_max_inflight[MAX_YP_DIRECTORIES];
     int num_yp_directories;
 } ice_config_t;
 
+/* What a reload changed, handed on to the slave thread so only the
+ * affected sources are updated. With settings set everything is.
+ */
+typedef struct config_reload_diff_tag {
+    int settings;
+    unsigned int added;
+    unsigned int changed;
+    unsigned int removed;
+    size_t count;
+    char **mounts;          /* normal mounts added, changed or removed */
+} config_reload_diff_t;
+
+void config_reload_diff_free(config_reload_diff_t *diff);
+
 typedef struct {
     rwlock_t config_lock;
     mutex_t relay_lock;
@@ -271,6 +410,7 @@ listener_t *config_clear_listener (listener_t *listener);
 void config_clear(ice_config_t *config);
 mount_proxy *config_find_mount(ice_config_t *config, const char *mount, mount_type type);
 listener_t *config_get_listen_sock(ice_config_t *config, connection_t *con);
+void config_index_listeners(ice_config_t *config);
 
 config_options_t *config_parse_options(xmlNodePtr node);
 void config_clear_options(config_options_t *options);
@@ -282,6 +422,11 @@ ice_config_locks *config_locks(void);
 ice_config_t *config_get_config(void);
 ice_config_t *config_grab_config(void);
 void config_release_config(void);
+/* let go of the config this thread keeps pinned, for threads about to wait
+ * so that an old config is not kept over a reload */
+void config_drop_pin(void);
+/* clear replaced configs nothing refers to any more */
+void config_reclaim(void);
 
 /* To be used ONLY in one-time startup code */
 ice_config_t *config_get_config_unlocked(void);
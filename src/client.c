@@ -23,6 +23,17 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
 
 #include "common/thread/thread.h"
 #include "common/avl/avl.h"
@@ -31,9 +42,11 @@
 #include "cfgfile.h"
 #include "connection.h"
 #include "refbuf.h"
+#include "objpool.h"
 #include "format.h"
 #include "stats.h"
 #include "fserve.h"
+#include "global.h"
 
 #include "client.h"
 #include "auth.h"
@@ -55,30 +68,30 @@ static inline void client_send_500(client_t *client, const char *message);
 
 /* create a client_t with the provided connection and parser details. Return
  * 0 on success, -1 if server limit has been reached.  In either case a
- * client_t is returned just in case a message needs to be returned. Should
- * be called with global lock held.
+ * client_t is returned just in case a message needs to be returned.
  */
 int client_create(client_t **c_ptr, connection_t *con, http_parser_t *parser)
 {
     ice_config_t    *config;
-    client_t        *client = (client_t *) calloc(1, sizeof(client_t));
+    client_t        *client = objpool_alloc(OBJPOOL_CLIENT, sizeof(client_t));
     int              ret    = -1;
+    int              clients;
 
     if (client == NULL)
         abort();
 
     config = config_get_config();
 
-    global.clients++;
-    if (config->client_limit < global.clients) {
-        ICECAST_LOG_WARN("server client limit reached (%d/%d)", config->client_limit, global.clients);
+    clients = global_clients_add(1);
+    if (config->client_limit < clients) {
+        ICECAST_LOG_WARN("server client limit reached (%d/%d)", config->client_limit, clients);
     } else {
         ret = 0;
     }
 
     config_release_config ();
 
-    stats_event_args (NULL, "clients", "%d", global.clients);
+    stats_event_args (NULL, "clients", "%d", clients);
     client->con = con;
     client->parser = parser;
     client->protocol = ICECAST_PROTOCOL_HTTP;
@@ -104,6 +117,15 @@ static inline void client_reuseconnection(client_t *client) {
     reuse = client->reuse;
     client->con->sock = -1; /* TODO: do not use magic */
 
+    /* carry over the request count, keep-alive slot and any pipelined data */
+    con->requests = client->con->requests + 1;
+    con->keepalive = client->con->keepalive;
+    con->pending = client->con->pending;
+    con->pending_len = client->con->pending_len;
+    client->con->keepalive = 0;
+    client->con->pending = NULL;
+    client->con->pending_len = 0;
+
     /* handle to keep the TLS connection */
 #ifdef HAVE_OPENSSL
     if (client->con->ssl) {
@@ -113,9 +135,12 @@ static inline void client_reuseconnection(client_t *client) {
         con->ssl  = client->con->ssl;
         con->read = client->con->read;
         con->send = client->con->send;
+        con->sendv = client->con->sendv;
+        con->ktls = client->con->ktls;
         client->con->ssl  = NULL;
         client->con->read = NULL;
         client->con->send = NULL;
+        client->con->sendv = NULL;
     }
 #endif
 
@@ -134,7 +159,9 @@ void client_destroy(client_t *client)
     if (client == NULL)
         return;
 
-    if (client->reuse != ICECAST_REUSE_CLOSE) {
+    /* a connection which failed or a server shutting down is not reused */
+    if (client->reuse != ICECAST_REUSE_CLOSE && client->con &&
+            client->con->error == 0 && global.running == ICECAST_RUNNING) {
         client_reuseconnection(client);
         return;
     }
@@ -145,6 +172,9 @@ void client_destroy(client_t *client)
         refbuf_release (client->refbuf);
         client->refbuf = NULL;
     }
+    refbuf_release (client->burst_end);
+    client->burst_end = NULL;
+    client_zerocopy_release (client);
 
     if (auth_release_client(client))
         return;
@@ -161,10 +191,7 @@ void client_destroy(client_t *client)
     if (client->encoding)
         httpp_encoding_release(client->encoding);
 
-    global_lock();
-    global.clients--;
-    stats_event_args(NULL, "clients", "%d", global.clients);
-    global_unlock();
+    stats_event_args(NULL, "clients", "%d", global_clients_add(-1));
 
     /* we need to free client specific format data (if any) */
     if (client->free_client_data)
@@ -175,7 +202,7 @@ void client_destroy(client_t *client)
     free(client->role);
     acl_release(client->acl);
 
-    free(client);
+    objpool_free(OBJPOOL_CLIENT, client);
 }
 
 /* helper function for reading data from a client */
@@ -216,6 +243,50 @@ int client_read_bytes(client_t *client, void *buf, unsigned len)
     return bytes;
 }
 
+/* look for token in a comma separated header value */
+static int client_header_has_token(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',')
+            value++;
+        if (strncasecmp(value, token, len) == 0 &&
+                (value[len] == '\0' || value[len] == ',' || value[len] == ' ' || value[len] == '\t'))
+            return 1;
+        value = strchr(value, ',');
+    }
+    return 0;
+}
+
+/* keep the connection open for another request once the response is sent,
+ * if the request allows it. Only for responses with a known length */
+void client_keepalive(client_t *client)
+{
+    const char *version, *connection;
+
+    if (client == NULL || client->con == NULL || client->parser == NULL)
+        return;
+    if (client->reuse != ICECAST_REUSE_CLOSE)
+        return;
+    /* anything following a request with a body is not a request, and
+     * responses to HEAD are sent with their body */
+    if (client->parser->req_type != httpp_req_get)
+        return;
+    if (strcmp("HTTP", httpp_getvar(client->parser, HTTPP_VAR_PROTOCOL)) != 0)
+        return;
+    version = httpp_getvar(client->parser, HTTPP_VAR_VERSION);
+    connection = httpp_getvar(client->parser, "connection");
+    if (client_header_has_token(connection, "close"))
+        return;
+    /* HTTP/1.0 clients have to ask for it */
+    if ((version == NULL || strcmp(version, "1.0") == 0) &&
+            client_header_has_token(connection, "keep-alive") == 0)
+        return;
+    if (connection_keepalive_take(client->con))
+        client->reuse = ICECAST_REUSE_KEEPALIVE;
+}
+
 void client_send_error(client_t *client, int status, int plain, const char *message)
 {
     ssize_t ret;
@@ -232,7 +303,7 @@ void client_send_error(client_t *client, int status, int plain, const char *mess
          return;
     }
 
-    client->reuse = ICECAST_REUSE_KEEPALIVE;
+    client_keepalive(client);
 
     ret = util_http_build_header(client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
                                  0, status, NULL,
@@ -352,6 +423,315 @@ int client_send_bytes(client_t *client, const void *buf, unsigned len)
     return ret;
 }
 
+/* helper function for sending several blocks of data in one go */
+int client_send_vector(client_t *client, const struct iovec *iov, unsigned count)
+{
+    int ret = client->con->sendv(client->con, iov, count);
+
+    if (client->con->error)
+        ICECAST_LOG_DEBUG("Client connection died");
+
+    return ret;
+}
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#define CLIENT_ZEROCOPY 1
+#endif
+
+/* zero copy sends not yet reported complete by the kernel, each holds a
+ * reference on the buffers it was sent from */
+#define CLIENT_ZEROCOPY_SENDS  32
+/* below this the page pinning costs more than the copy */
+#define CLIENT_ZEROCOPY_MIN    8192
+/* how long the sends of a finished client are waited on, in seconds */
+#define CLIENT_ZEROCOPY_LINGER 30
+
+typedef struct {
+    uint32_t id;
+    unsigned int count;
+    refbuf_t *refs[FORMAT_MAX_IOV];
+} client_zerocopy_send_t;
+
+struct _client_zerocopy_tag {
+    /* the id the kernel gives the next zero copy send */
+    uint32_t next_id;
+    /* set once the kernel reports it had to copy the data anyway */
+    int copied;
+    unsigned int head;
+    unsigned int count;
+    client_zerocopy_send_t sends[CLIENT_ZEROCOPY_SENDS];
+    /* once the client has gone, a duplicate of the socket to read the
+     * completions from and when to give up on them */
+    int linger_sock;
+    time_t linger_until;
+    struct _client_zerocopy_tag *linger_next;
+};
+
+#ifdef CLIENT_ZEROCOPY
+/* sends of finished clients still waiting for the kernel */
+static pthread_mutex_t client_zerocopy_linger_lock = PTHREAD_MUTEX_INITIALIZER;
+static client_zerocopy_t *client_zerocopy_lingering;
+#endif
+
+/* Switch the client socket to zero copy sends, returns 0 on success.
+ * Not available for TLS connections as the data is encrypted first.
+ */
+int client_enable_zerocopy(client_t *client)
+{
+#ifdef CLIENT_ZEROCOPY
+    int on = 1;
+
+    if (client->zerocopy)
+        return 0;
+#ifdef HAVE_OPENSSL
+    if (client->con->ssl)
+        return -1;
+#endif
+    if (setsockopt(client->con->sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+        return -1;
+    client->zerocopy = calloc(1, sizeof(client_zerocopy_t));
+    if (client->zerocopy == NULL)
+        return -1;
+    return 0;
+#else
+    (void)client;
+    return -1;
+#endif
+}
+
+/* drop the oldest sends up to and including the kernel id given */
+static void client_zerocopy_complete(client_zerocopy_t *zc, uint32_t upto)
+{
+    while (zc->count)
+    {
+        client_zerocopy_send_t *send = &zc->sends[zc->head];
+        unsigned int i;
+
+        if ((int32_t)(send->id - upto) > 0)
+            break;
+        for (i = 0; i < send->count; i++)
+            refbuf_release(send->refs[i]);
+        zc->head = (zc->head + 1) % CLIENT_ZEROCOPY_SENDS;
+        zc->count--;
+    }
+}
+
+/* pick up any completion reports waiting on the socket error queue */
+static void client_zerocopy_collect(client_zerocopy_t *zc, sock_t sock)
+{
+#ifdef CLIENT_ZEROCOPY
+    while (zc->count)
+    {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0)
+            break;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if ((cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) &&
+                    (cm->cmsg_level != SOL_IPV6 || cm->cmsg_type != IPV6_RECVERR))
+                continue;
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied = 1;
+            client_zerocopy_complete(zc, err->ee_data);
+        }
+    }
+#else
+    (void)zc;
+    (void)sock;
+#endif
+}
+
+/* Release the buffers of the sends the kernel has finished with. Called
+ * for each listener pass of the source so the buffers go back promptly
+ * even when the client is not sending.
+ */
+void client_zerocopy_reap(client_t *client)
+{
+    if (client->zerocopy && client->zerocopy->count)
+        client_zerocopy_collect(client->zerocopy, client->con->sock);
+}
+
+/* Send the vector built from the queue starting at client->refbuf without
+ * copying it into the kernel. The buffers are held until the kernel says it
+ * is done with them. Falls back to a normal send when that is not possible.
+ */
+int client_send_queue_zerocopy(client_t *client, const struct iovec *iov, unsigned count)
+{
+#ifdef CLIENT_ZEROCOPY
+    client_zerocopy_t *zc = client->zerocopy;
+    client_zerocopy_send_t *send;
+    struct msghdr msg;
+    refbuf_t *refbuf;
+    size_t total = 0;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < count; i++)
+        total += iov[i].iov_len;
+    if (zc == NULL || count > FORMAT_MAX_IOV || total < CLIENT_ZEROCOPY_MIN)
+        return client_send_vector(client, iov, count);
+
+    client_zerocopy_collect(zc, client->con->sock);
+    if (zc->copied || zc->count == CLIENT_ZEROCOPY_SENDS)
+        return client_send_vector(client, iov, count);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = count;
+    ret = sendmsg(client->con->sock, &msg, MSG_ZEROCOPY);
+    if (ret < 0)
+    {
+        if (errno == ENOBUFS)
+            return client_send_vector(client, iov, count);
+        if (!sock_recoverable(sock_error()))
+        {
+            client->con->error = 1;
+            ICECAST_LOG_DEBUG("Client connection died");
+        }
+        return ret;
+    }
+    client->con->sent_bytes += ret;
+
+    send = &zc->sends[(zc->head + zc->count) % CLIENT_ZEROCOPY_SENDS];
+    send->id = zc->next_id++;
+    send->count = 0;
+    for (i = 0, refbuf = client->refbuf; i < count && refbuf; i++, refbuf = refbuf->next)
+    {
+        refbuf_addref(refbuf);
+        send->refs[send->count++] = refbuf;
+    }
+    zc->count++;
+    return ret;
+#else
+    return client_send_vector(client, iov, count);
+#endif
+}
+
+/* drop every send still held, the kernel is done with them or the wait is
+ * over */
+static void client_zerocopy_free(client_zerocopy_t *zc)
+{
+    if (zc->count)
+        client_zerocopy_complete(zc, zc->sends[(zc->head + zc->count - 1) % CLIENT_ZEROCOPY_SENDS].id);
+    free(zc);
+}
+
+/* The client is finished. The kernel may still be sending from the
+ * buffers, so sends not yet complete keep them until it reports so. The
+ * socket is duplicated for that and shut down for writing, so the listener
+ * still sees the end of the stream when the connection is closed.
+ */
+void client_zerocopy_release(client_t *client)
+{
+    client_zerocopy_t *zc = client->zerocopy;
+
+    if (zc == NULL)
+        return;
+    client->zerocopy = NULL;
+    client_zerocopy_collect(zc, client->con->sock);
+#ifdef CLIENT_ZEROCOPY
+    if (zc->count && client->con->error == 0)
+    {
+        zc->linger_sock = dup(client->con->sock);
+        if (zc->linger_sock >= 0)
+        {
+            shutdown(zc->linger_sock, SHUT_WR);
+            zc->linger_until = time(NULL) + CLIENT_ZEROCOPY_LINGER;
+            pthread_mutex_lock(&client_zerocopy_linger_lock);
+            zc->linger_next = client_zerocopy_lingering;
+            client_zerocopy_lingering = zc;
+            pthread_mutex_unlock(&client_zerocopy_linger_lock);
+            return;
+        }
+    }
+#endif
+    client_zerocopy_free(zc);
+}
+
+/* Check the sends of finished clients, releasing those the kernel is done
+ * with or that have waited too long. With force all are released.
+ */
+void client_zerocopy_linger_check(int force)
+{
+#ifdef CLIENT_ZEROCOPY
+    client_zerocopy_t *zc, **trail, *done = NULL;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&client_zerocopy_linger_lock);
+    trail = &client_zerocopy_lingering;
+    while ((zc = *trail))
+    {
+        client_zerocopy_collect(zc, zc->linger_sock);
+        if (zc->count && force == 0 && now < zc->linger_until)
+        {
+            trail = &zc->linger_next;
+            continue;
+        }
+        *trail = zc->linger_next;
+        zc->linger_next = done;
+        done = zc;
+    }
+    pthread_mutex_unlock(&client_zerocopy_linger_lock);
+
+    while ((zc = done))
+    {
+        done = zc->linger_next;
+        if (zc->count)
+            ICECAST_LOG_DEBUG("giving up on %u zero copy sends", zc->count);
+        close(zc->linger_sock);
+        client_zerocopy_free(zc);
+    }
+#else
+    (void)force;
+#endif
+}
+
+/* request headers still looked at once a listener is streaming, by the
+ * access log, listener lists, source filters and auth on release */
+static const char *client_compact_keep[] = {
+    HTTPP_VAR_REQ_TYPE, HTTPP_VAR_URI, HTTPP_VAR_RAWURI, HTTPP_VAR_PROTOCOL,
+    HTTPP_VAR_VERSION, "referer", "user-agent", NULL
+};
+
+/* called once a listener has its response headers, replace the parser by
+ * one holding only the headers needed for the rest of the connection so
+ * the bulk of the request is freed.
+ */
+void client_compact(client_t *client)
+{
+    http_parser_t *parser;
+    const char *value;
+    size_t i;
+
+    if (client->parser == NULL)
+        return;
+
+    parser = httpp_create_parser();
+    if (parser == NULL)
+        return;
+    httpp_initialize(parser, NULL);
+    parser->req_type = client->parser->req_type;
+
+    for (i = 0; client_compact_keep[i]; i++) {
+        value = httpp_getvar(client->parser, client_compact_keep[i]);
+        if (value)
+            httpp_setvar(parser, client_compact_keep[i], value);
+    }
+
+    httpp_destroy(client->parser);
+    client->parser = parser;
+}
+
 void client_set_queue(client_t *client, refbuf_t *refbuf)
 {
     refbuf_t *to_release = client->refbuf;
@@ -362,4 +742,10 @@ void client_set_queue(client_t *client, refbuf_t *refbuf)
     client->pos = 0;
     if (to_release)
         refbuf_release(to_release);
+    /* any burst snapshot being sent is finished with */
+    if (client->burst_end)
+    {
+        refbuf_release(client->burst_end);
+        client->burst_end = NULL;
+    }
 }
@@ -40,6 +40,8 @@ typedef enum _reuse_tag {
     ICECAST_REUSE_UPGRADETLS
 } reuse_t;
 
+typedef struct _client_zerocopy_tag client_zerocopy_t;
+
 typedef struct _client_tag
 {
     /* mode of operation for this client */
@@ -90,8 +92,20 @@ typedef struct _client_tag
     /* position in first buffer */
     unsigned int pos;
 
+    /* sequence of refbuf when following a source queue ring, in which case
+     * no reference is held on refbuf.  0 when not on a ring */
+    uint64_t queue_seq;
+
+    /* while sending a burst snapshot, the last queue buffer it contains */
+    refbuf_t *burst_end;
+
+    /* age in ms of the last stream buffer fully sent, how far behind live */
+    unsigned int lag_ms;
+
     /* auth used for this client */
     struct auth_tag *auth;
+    /* admitted from the auth cache, so the backend never saw it added */
+    int auth_cached;
 
     /* Format-handler-specific data for this client */
     void *format_data;
@@ -105,15 +119,32 @@ typedef struct _client_tag
     /* function to check if refbuf needs updating */
     int (*check_buffer)(struct source_tag *source, struct _client_tag *client);
 
+    /* outstanding zero copy sends, NULL when not in use */
+    client_zerocopy_t *zerocopy;
+
+    /* set while the source waits for the socket to drain */
+    int wait_writable;
+
+    /* link while waiting on the pending queue of a source */
+    struct _client_tag *next_pending;
+
 } client_t;
 
 int client_create (client_t **c_ptr, connection_t *con, http_parser_t *parser);
 void client_destroy(client_t *client);
 void client_send_error(client_t *client, int status, int plain, const char *message);
+void client_keepalive(client_t *client);
 void client_send_101(client_t *client, reuse_t reuse);
 void client_send_426(client_t *client, reuse_t reuse);
 int client_send_bytes (client_t *client, const void *buf, unsigned len);
+int client_send_vector (client_t *client, const struct iovec *iov, unsigned count);
 int client_read_bytes (client_t *client, void *buf, unsigned len);
 void client_set_queue (client_t *client, refbuf_t *refbuf);
+void client_compact (client_t *client);
+int client_enable_zerocopy (client_t *client);
+int client_send_queue_zerocopy (client_t *client, const struct iovec *iov, unsigned count);
+void client_zerocopy_reap (client_t *client);
+void client_zerocopy_release (client_t *client);
+void client_zerocopy_linger_check (int force);
 
 #endif  /* __CLIENT_H__ */
@@ -25,10 +25,22 @@
 #include <sys/poll.h>
 #endif
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
 
 #ifndef _WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #else
 #include <winsock2.h>
 #endif
@@ -39,17 +51,24 @@
 #include "common/avl/avl.h"
 #include "common/net/sock.h"
 #include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
 
 #include "cfgfile.h"
 #include "global.h"
+#include "affinity.h"
 #include "util.h"
 #include "connection.h"
 #include "refbuf.h"
+#include "objpool.h"
 #include "client.h"
 #include "stats.h"
 #include "logging.h"
 #include "xslt.h"
+#include "json.h"
 #include "fserve.h"
+#include "timeshift.h"
+#include "hls.h"
+#include "slave.h"
 #include "sighandler.h"
 
 #include "yp.h"
@@ -81,9 +100,18 @@ typedef struct client_queue_tag {
     client_t *client;
     int offset;
     int stream_offset;
+    /* how far the data has been searched for the end of the headers */
+    size_t scan_offset;
     int shoutcast;
     char *shoutcast_mount;
     struct client_queue_tag *next;
+    /* when the headers must have arrived by, and the wheel slot links */
+    time_t expire;
+    struct client_queue_tag *wheel_next, **wheel_prev;
+    /* set if the connection came in over a limit, only source and admin
+     * requests are let through then, others get this status */
+    int reject_status;
+    const char *reject_message;
 } client_queue_t;
 
 typedef struct _thread_queue_tag {
@@ -95,11 +123,122 @@ static spin_t _connection_lock; // protects _current_id, _con_queue, _con_queue_
 static volatile unsigned long _current_id = 0;
 static int _initialized = 0;
 
-static volatile client_queue_t *_req_queue = NULL, **_req_queue_tail = &_req_queue;
+
+/* Requests still sending their headers. They are kept on a timer wheel of
+ * one second slots by expiry time, a slot holds everything expiring in
+ * that second of any lap so entries are checked against their own expiry.
+ * Where epoll is available the sockets are in an epoll set and only those
+ * with data are read, otherwise every request is tried on each pass.
+ */
+#define REQUEST_WHEEL_SLOTS         64
+#define REQUEST_EVENTS_MAX          64
+
+static client_queue_t *_req_wheel[REQUEST_WHEEL_SLOTS];
+static time_t _req_wheel_time;
+static unsigned int _req_count;
+static int _req_poll_fd = -1;
 static volatile client_queue_t *_con_queue = NULL, **_con_queue_tail = &_con_queue;
+
+/* requests queued from any thread, moved to the request queue by the
+ * accept loop which is the only one to touch that */
+static spin_t _intake_lock;
+static client_queue_t *_intake_queue = NULL, **_intake_queue_tail = &_intake_queue;
+/* written to when the intake queue gets its first entry, so the accept
+ * loop waiting on the listening sockets picks it up straight away */
+static int _intake_wake[2] = { -1, -1 };
+
+/* A listen-socket with several acceptors is opened more than once with
+ * SO_REUSEPORT. The first copy is in global.serversock and handled by the
+ * accept loop, the others each get a thread of their own. Connections
+ * accepted on them are marked as coming from the first copy so the
+ * listen-socket settings are found as usual.
+ */
+typedef struct acceptor_tag {
+    sock_t sock;
+    sock_t serversock;
+    thread_type *thread;
+} acceptor_t;
+
+static acceptor_t *_acceptors;
+static int _acceptor_count;
+
+/* position of each listen-socket in global.serversock, indexed by the
+ * socket itself, which is also the position of its listener in the config.
+ * Replaced while acceptors and workers may be looking it up, so both sides
+ * hold the lock */
+static int *_serversock_slots;
+static int _serversock_slot_count;
+static spin_t _serversock_lock;
+
+/* threads handling requests once the headers are in, if not done by the
+ * accept loop itself. They sleep on the cond while the queue is empty */
+static thread_type **_request_workers;
+static int _request_worker_count;
+/* the workers check for queued requests and wait under this mutex, and are
+ * signalled under it, so a request queued as one goes to sleep is seen */
+static pthread_mutex_t _request_lock;
+static pthread_cond_t _request_cond;
+
+/* Connections over the client limit or the accept rate of their
+ * listen-socket are still read up to this many at a time, so sources and
+ * admin requests get in while listeners are turned away. Beyond that they
+ * are rejected straight away. Protected by _connection_lock.
+ */
+#define CONNECTION_PRIORITY_RESERVE 16
+
+typedef struct accept_rate_tag {
+    sock_t serversock;
+    connection_rate_t bucket;
+} accept_rate_t;
+
+static unsigned int _admission_reserved;
+static accept_rate_t *_accept_rates;
+static int _accept_rate_count;
+/* connections kept open per address, for the keep-alive limit */
+typedef struct keepalive_ip_tag {
+    char *ip;
+    unsigned int count;
+} keepalive_ip_t;
+static avl_tree *_keepalive_ips;
+static unsigned int _req_count_reported;
 static int ssl_ok;
 #ifdef HAVE_OPENSSL
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+
 static SSL_CTX *ssl_ctx;
+
+/* Session ticket keys, the first is used for new tickets and the others
+ * are still accepted. They are either generated here and rotated after
+ * their lifetime, or read from a key file shared between servers which is
+ * picked up again when it changes.
+ */
+#define TLS_TICKET_KEYS             4
+#define TLS_TICKET_KEY_CHECK        60
+
+typedef struct tls_ticket_key_tag {
+    unsigned char name[16];
+    unsigned char hmac_key[16];
+    unsigned char aes_key[16];
+} tls_ticket_key_t;
+
+/* the spin lock covers the keys and when they were last checked, taken on
+ * every handshake. Reading the key file or making a key is done under the
+ * mutex by the one handshake finding them due, and the new keys swapped in
+ * under the spin lock */
+static spin_t _tls_ticket_lock;
+static tls_ticket_key_t tls_ticket_keys[TLS_TICKET_KEYS];
+static int tls_ticket_key_count;
+static time_t tls_ticket_key_checked;
+static int tls_ticket_key_interval;
+
+static mutex_t _tls_ticket_update_lock;
+static char *tls_ticket_key_file;
+static time_t tls_ticket_key_mtime;
 #endif
 
 /* filtering client connection based on IP */
@@ -109,19 +248,58 @@ rwlock_t _source_shutdown_rwlock;
 
 static void _handle_connection(void);
 
+static int _compare_keepalive_ips(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp(((keepalive_ip_t *)a)->ip, ((keepalive_ip_t *)b)->ip);
+}
+
+static int _free_keepalive_ip(void *key)
+{
+    keepalive_ip_t *entry = key;
+
+    free(entry->ip);
+    free(entry);
+    return 1;
+}
+
 void connection_initialize(void)
 {
     if (_initialized)
         return;
 
     thread_spin_create (&_connection_lock);
+    thread_spin_create (&_intake_lock);
+    thread_spin_create (&_serversock_lock);
+    pthread_mutex_init (&_request_lock, NULL);
+    pthread_cond_init (&_request_cond, NULL);
+#ifdef HAVE_OPENSSL
+    thread_spin_create (&_tls_ticket_lock);
+    thread_mutex_create (&_tls_ticket_update_lock);
+#endif
     thread_mutex_create(&move_clients_mutex);
     thread_rwlock_create(&_source_shutdown_rwlock);
     thread_cond_create(&global.shutdown_cond);
-    _req_queue = NULL;
-    _req_queue_tail = &_req_queue;
+    memset(_req_wheel, 0, sizeof(_req_wheel));
+    _req_wheel_time = time(NULL);
+    _req_count = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    _req_poll_fd = epoll_create(REQUEST_EVENTS_MAX);
+    if (_req_poll_fd < 0)
+        ICECAST_LOG_WARN("Unable to create request event set, polling all requests");
+#endif
     _con_queue = NULL;
     _con_queue_tail = &_con_queue;
+    _keepalive_ips = avl_tree_new(_compare_keepalive_ips, NULL);
+#ifndef _WIN32
+    if (pipe(_intake_wake) == 0) {
+        fcntl(_intake_wake[0], F_SETFL, O_NONBLOCK);
+        fcntl(_intake_wake[1], F_SETFL, O_NONBLOCK);
+    } else {
+        ICECAST_LOG_WARN("Unable to create intake wakeup pipe, polling for handed over requests");
+        _intake_wake[0] = _intake_wake[1] = -1;
+    }
+#endif
 
     _initialized = 1;
 }
@@ -133,13 +311,37 @@ void connection_shutdown(void)
 
 #ifdef HAVE_OPENSSL
     SSL_CTX_free (ssl_ctx);
+    free (tls_ticket_key_file);
+    tls_ticket_key_file = NULL;
+    thread_spin_destroy (&_tls_ticket_lock);
+    thread_mutex_destroy (&_tls_ticket_update_lock);
 #endif
     matchfile_release(banned_ip);
     matchfile_release(allowed_ip);
  
     thread_cond_destroy(&global.shutdown_cond);
     thread_rwlock_destroy(&_source_shutdown_rwlock);
+#ifdef HAVE_SYS_EPOLL_H
+    if (_req_poll_fd >= 0)
+        close(_req_poll_fd);
+#endif
+    _req_poll_fd = -1;
+    if (_intake_wake[0] >= 0) {
+        close(_intake_wake[0]);
+        close(_intake_wake[1]);
+    }
+    _intake_wake[0] = _intake_wake[1] = -1;
+    while (_accept_rate_count)
+        connection_rate_destroy(&_accept_rates[--_accept_rate_count].bucket);
+    free(_accept_rates);
+    _accept_rates = NULL;
+    avl_tree_free(_keepalive_ips, _free_keepalive_ip);
+    _keepalive_ips = NULL;
     thread_spin_destroy (&_connection_lock);
+    thread_spin_destroy (&_serversock_lock);
+    thread_spin_destroy (&_intake_lock);
+    pthread_cond_destroy (&_request_cond);
+    pthread_mutex_destroy (&_request_lock);
     thread_mutex_destroy(&move_clients_mutex);
 
     _initialized = 0;
@@ -158,6 +360,218 @@ static unsigned long _next_connection_id(void)
 
 
 #ifdef HAVE_OPENSSL
+/* read the ticket keys from the shared key file, which holds one or more
+ * 48 byte keys with the current one first. Called with the update lock
+ * held, returns 0 if the keys were loaded */
+static int tls_ticket_keys_load(void)
+{
+    tls_ticket_key_t keys[TLS_TICKET_KEYS];
+    struct stat st;
+    FILE *file;
+    size_t count;
+
+    if (stat(tls_ticket_key_file, &st) < 0) {
+        ICECAST_LOG_WARN("Unable to read TLS ticket key file %s", tls_ticket_key_file);
+        return -1;
+    }
+    if (st.st_mtime == tls_ticket_key_mtime)
+        return 0;
+    file = fopen(tls_ticket_key_file, "rb");
+    if (file == NULL) {
+        ICECAST_LOG_WARN("Unable to open TLS ticket key file %s", tls_ticket_key_file);
+        return -1;
+    }
+    count = fread(keys, sizeof(tls_ticket_key_t), TLS_TICKET_KEYS, file);
+    fclose(file);
+    if (count == 0) {
+        ICECAST_LOG_WARN("No keys found in TLS ticket key file %s", tls_ticket_key_file);
+        return -1;
+    }
+    thread_spin_lock(&_tls_ticket_lock);
+    memcpy(tls_ticket_keys, keys, count * sizeof(tls_ticket_key_t));
+    tls_ticket_key_count = count;
+    thread_spin_unlock(&_tls_ticket_lock);
+    tls_ticket_key_mtime = st.st_mtime;
+    ICECAST_LOG_INFO("Loaded %d TLS ticket keys from %s", (int)count, tls_ticket_key_file);
+    return 0;
+}
+
+/* make a new current key, keeping the older ones for decryption. Called
+ * with the update lock held */
+static void tls_ticket_keys_rotate(void)
+{
+    tls_ticket_key_t keys[TLS_TICKET_KEYS];
+    int count;
+
+    if (RAND_bytes((unsigned char *)&keys[0], sizeof(tls_ticket_key_t)) != 1) {
+        ICECAST_LOG_WARN("Unable to generate a TLS ticket key");
+        return;
+    }
+    thread_spin_lock(&_tls_ticket_lock);
+    memcpy(&keys[1], &tls_ticket_keys[0], (TLS_TICKET_KEYS - 1) * sizeof(tls_ticket_key_t));
+    count = tls_ticket_key_count < TLS_TICKET_KEYS ? tls_ticket_key_count + 1 : TLS_TICKET_KEYS;
+    memcpy(tls_ticket_keys, keys, count * sizeof(tls_ticket_key_t));
+    tls_ticket_key_count = count;
+    thread_spin_unlock(&_tls_ticket_lock);
+}
+
+/* bring the keys up to date, from the key file or by making a new one */
+static void tls_ticket_keys_update(void)
+{
+    thread_mutex_lock(&_tls_ticket_update_lock);
+    if (tls_ticket_key_file)
+        tls_ticket_keys_load();
+    else
+        tls_ticket_keys_rotate();
+    thread_mutex_unlock(&_tls_ticket_update_lock);
+}
+
+/* check if the keys are due a change, with the ticket lock held. Only the
+ * caller getting 1 back does the update */
+static int tls_ticket_keys_due(time_t now)
+{
+    if (now - tls_ticket_key_checked < tls_ticket_key_interval)
+        return 0;
+    tls_ticket_key_checked = now;
+    return 1;
+}
+
+/* pick the key for a ticket and set up its cipher, the HMAC is left to the
+ * caller. Returns as the ticket key callback does, key is filled in if > 0 */
+static int tls_ticket_key_setup(unsigned char *name, unsigned char *iv,
+        EVP_CIPHER_CTX *ectx, int enc, tls_ticket_key_t *found)
+{
+    tls_ticket_key_t key;
+    int i, ret = 0, due;
+
+    thread_spin_lock(&_tls_ticket_lock);
+    due = tls_ticket_keys_due(time(NULL));
+    thread_spin_unlock(&_tls_ticket_lock);
+    if (due)
+        tls_ticket_keys_update();
+
+    thread_spin_lock(&_tls_ticket_lock);
+    if (enc) {
+        if (tls_ticket_key_count) {
+            key = tls_ticket_keys[0];
+            ret = 1;
+        }
+    } else {
+        for (i = 0; i < tls_ticket_key_count; i++) {
+            if (memcmp(name, tls_ticket_keys[i].name, 16) == 0) {
+                key = tls_ticket_keys[i];
+                /* ask for a new ticket if an older key was used */
+                ret = i ? 2 : 1;
+                break;
+            }
+        }
+    }
+    thread_spin_unlock(&_tls_ticket_lock);
+
+    if (ret == 0)
+        return 0;
+    if (enc) {
+        memcpy(name, key.name, 16);
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+            return -1;
+        if (EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes_key, iv) != 1)
+            return -1;
+    } else {
+        if (EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key.aes_key, iv) != 1)
+            return -1;
+    }
+    *found = key;
+    return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+        EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+{
+    tls_ticket_key_t key;
+    OSSL_PARAM params[3];
+    int ret = tls_ticket_key_setup(name, iv, ectx, enc, &key);
+
+    (void)ssl;
+    if (ret <= 0)
+        return ret;
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+        return -1;
+    return ret;
+}
+#else
+static int tls_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+        EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+{
+    tls_ticket_key_t key;
+    int ret = tls_ticket_key_setup(name, iv, ectx, enc, &key);
+
+    (void)ssl;
+    if (ret <= 0)
+        return ret;
+    if (HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1)
+        return -1;
+    return ret;
+}
+#endif
+
+/* count full and resumed handshakes */
+static void tls_info_cb(const SSL *ssl, int where, int ret)
+{
+    (void)ret;
+    if ((where & SSL_CB_HANDSHAKE_DONE) == 0)
+        return;
+    if (SSL_session_reused((SSL *)ssl))
+        stats_event_inc(NULL, "tls_handshakes_resumed");
+    else
+        stats_event_inc(NULL, "tls_handshakes_full");
+}
+
+static void tls_setup_sessions(ice_config_t *config)
+{
+    static const unsigned char session_id_context[] = "icecast";
+
+    SSL_CTX_set_session_id_context(ssl_ctx, session_id_context, sizeof(session_id_context) - 1);
+    if (config->tls_session_cache == 0) {
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_OFF);
+    } else {
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_SERVER);
+        if (config->tls_session_cache > 0)
+            SSL_CTX_sess_set_cache_size(ssl_ctx, config->tls_session_cache);
+    }
+    if (config->tls_session_timeout > 0)
+        SSL_CTX_set_timeout(ssl_ctx, config->tls_session_timeout);
+
+    thread_mutex_lock(&_tls_ticket_update_lock);
+    free(tls_ticket_key_file);
+    tls_ticket_key_file = config->tls_ticket_key_file ? strdup(config->tls_ticket_key_file) : NULL;
+    tls_ticket_key_mtime = 0;
+    thread_spin_lock(&_tls_ticket_lock);
+    /* a key file is checked for changes, generated keys are rotated */
+    if (tls_ticket_key_file)
+        tls_ticket_key_interval = TLS_TICKET_KEY_CHECK;
+    else
+        tls_ticket_key_interval = config->tls_ticket_key_lifetime > 0 ?
+            config->tls_ticket_key_lifetime : 43200;
+    tls_ticket_key_count = 0;
+    tls_ticket_key_checked = time(NULL);
+    thread_spin_unlock(&_tls_ticket_lock);
+    thread_mutex_unlock(&_tls_ticket_update_lock);
+    tls_ticket_keys_update();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_ctx, tls_ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, tls_ticket_key_cb);
+#endif
+
+    SSL_CTX_set_info_callback(ssl_ctx, tls_info_cb);
+    stats_event(NULL, "tls_handshakes_full", "0");
+    stats_event(NULL, "tls_handshakes_resumed", "0");
+}
+
 static void get_ssl_certificate(ice_config_t *config)
 {
     SSL_METHOD *method;
@@ -175,6 +589,14 @@ static void get_ssl_certificate(ice_config_t *config)
 #else
     SSL_CTX_set_options(ssl_ctx, ssl_opts|SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3);
 #endif
+    if (config->tls_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS);
+        ICECAST_LOG_INFO("Using kernel TLS where available");
+#else
+        ICECAST_LOG_WARN("Kernel TLS is not supported by this OpenSSL");
+#endif
+    }
 
     do {
         if (config->cert_file == NULL)
@@ -194,6 +616,7 @@ static void get_ssl_certificate(ice_config_t *config)
         if (SSL_CTX_set_cipher_list(ssl_ctx, config->cipher_list) <= 0) {
             ICECAST_LOG_WARN("Invalid cipher list: %s", config->cipher_list);
         }
+        tls_setup_sessions(config);
         config->tls_ok = ssl_ok = 1;
         ICECAST_LOG_INFO("Certificate found at %s", config->cert_file);
         ICECAST_LOG_INFO("Using ciphers %s", config->cipher_list);
@@ -221,6 +644,9 @@ static int connection_read_ssl(connection_t *con, void *buf, size_t len)
     return bytes;
 }
 
+static int connection_send(connection_t *con, const void *buf, size_t len);
+static int connection_sendv(connection_t *con, const struct iovec *iov, size_t count);
+
 static int connection_send_ssl(connection_t *con, const void *buf, size_t len)
 {
     int bytes = SSL_write (con->ssl, buf, len);
@@ -234,9 +660,37 @@ static int connection_send_ssl(connection_t *con, const void *buf, size_t len)
         con->error = 1;
     } else {
         con->sent_bytes += bytes;
+#ifdef SSL_OP_ENABLE_KTLS
+        /* once the kernel has the send keys it frames the records itself,
+         * so the plain socket writes, vectored or not, can be used */
+        if (BIO_get_ktls_send(SSL_get_wbio(con->ssl))) {
+            con->ktls = 1;
+            con->send = connection_send;
+            con->sendv = connection_sendv;
+            ICECAST_LOG_DEBUG("Kernel TLS in use for connection %lu", con->id);
+        }
+#endif
     }
     return bytes;
 }
+
+/* TLS records are built per write, so just go through the vector */
+static int connection_sendv_ssl(connection_t *con, const struct iovec *iov, size_t count)
+{
+    int written = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        int ret = connection_send_ssl(con, iov[i].iov_base, iov[i].iov_len);
+
+        if (ret < 0)
+            return written ? written : -1;
+        written += ret;
+        if ((size_t)ret < iov[i].iov_len)
+            break;
+    }
+    return written;
+}
 #else
 
 /* SSL not compiled in, so at least log it */
@@ -274,10 +728,55 @@ static int connection_send(connection_t *con, const void *buf, size_t len)
     return bytes;
 }
 
+static int connection_sendv(connection_t *con, const struct iovec *iov, size_t count)
+{
+    int bytes = (int)sock_writev(con->sock, iov, count);
+    if (bytes < 0) {
+        if (!sock_recoverable(sock_error()))
+            con->error = 1;
+    } else {
+        con->sent_bytes += bytes;
+    }
+    return bytes;
+}
+
+/* can file data go to the socket as it is, not through the TLS library */
+int connection_can_sendfile(connection_t *con)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    return con->send == connection_send;
+#else
+    (void)con;
+    return 0;
+#endif
+}
+
+/* send up to len bytes of fd starting at offset, which is moved on by the
+ * amount sent. Returns 0 at the end of the file and -1 if nothing could be
+ * sent, the connection is marked if that is an error */
+ssize_t connection_sendfile(connection_t *con, int fd, off_t *offset, size_t len)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    ssize_t bytes = sendfile(con->sock, fd, offset, len);
+
+    if (bytes < 0) {
+        if (!sock_recoverable(sock_error()))
+            con->error = 1;
+    } else {
+        con->sent_bytes += bytes;
+    }
+    return bytes;
+#else
+    (void)fd; (void)offset; (void)len;
+    con->error = 1;
+    return -1;
+#endif
+}
+
 connection_t *connection_create (sock_t sock, sock_t serversock, char *ip)
 {
     connection_t *con;
-    con = (connection_t *)calloc(1, sizeof(connection_t));
+    con = objpool_alloc(OBJPOOL_CONNECTION, sizeof(connection_t));
     if (con) {
         con->sock       = sock;
         con->serversock = serversock;
@@ -286,6 +785,7 @@ connection_t *connection_create (sock_t sock, sock_t serversock, char *ip)
         con->ip         = ip;
         con->read       = connection_read;
         con->send       = connection_send;
+        con->sendv      = connection_sendv;
     }
 
     return con;
@@ -301,6 +801,7 @@ void connection_uses_ssl(connection_t *con)
 
     con->read = connection_read_ssl;
     con->send = connection_send_ssl;
+    con->sendv = connection_sendv_ssl;
     con->ssl = SSL_new(ssl_ctx);
     SSL_set_accept_state(con->ssl);
     SSL_set_fd(con->ssl, con->sock);
@@ -312,25 +813,100 @@ ssize_t connection_read_bytes(connection_t *con, void *buf, size_t len)
     return con->read(con, buf, len);
 }
 
+/* MUST be called with the global lock held or from the accept loop */
+static void connection_index_serversocks(void)
+{
+#ifndef _WIN32
+    int i, size = 0, *slots, *old;
+
+    for (i = 0; i < global.server_sockets; i++)
+        if (global.serversock[i] >= size)
+            size = global.serversock[i] + 1;
+    /* build the new table, then swap it in */
+    slots = malloc((size ? size : 1) * sizeof(int));
+    if (slots == NULL)
+        return;
+    for (i = 0; i < size; i++)
+        slots[i] = -1;
+    for (i = 0; i < global.server_sockets; i++)
+        slots[global.serversock[i]] = i;
+
+    thread_spin_lock(&_serversock_lock);
+    old = _serversock_slots;
+    _serversock_slots = slots;
+    _serversock_slot_count = size;
+    thread_spin_unlock(&_serversock_lock);
+    free(old);
+#endif
+}
+
+int connection_serversock_slot(sock_t serversock)
+{
+    int i;
+
+#ifndef _WIN32
+    thread_spin_lock(&_serversock_lock);
+    if (_serversock_slots) {
+        i = -1;
+        if (serversock >= 0 && serversock < _serversock_slot_count)
+            i = _serversock_slots[serversock];
+        thread_spin_unlock(&_serversock_lock);
+        return i;
+    }
+    thread_spin_unlock(&_serversock_lock);
+#endif
+    for (i = 0; i < global.server_sockets; i++)
+        if (global.serversock[i] == serversock)
+            return i;
+    return -1;
+}
+
+/* empty the intake wakeup pipe, the queue itself is taken after */
+static void _intake_wake_clear(void)
+{
+    char buf[64];
+
+    if (_intake_wake[0] < 0)
+        return;
+    while (read(_intake_wake[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
 static sock_t wait_for_serversock(int timeout)
 {
 #ifdef HAVE_POLL
-    struct pollfd ufds [global.server_sockets];
-    int i, ret;
+    struct pollfd ufds [global.server_sockets + 2];
+    int i, ret, count = global.server_sockets;
 
     for(i=0; i < global.server_sockets; i++) {
         ufds[i].fd = global.serversock[i];
         ufds[i].events = POLLIN;
         ufds[i].revents = 0;
     }
+    /* also wake up when a request has data waiting */
+    if (_req_poll_fd >= 0) {
+        ufds[count].fd = _req_poll_fd;
+        ufds[count].events = POLLIN;
+        ufds[count].revents = 0;
+        count++;
+    }
+    /* and when another thread hands over a request */
+    if (_intake_wake[0] >= 0) {
+        ufds[count].fd = _intake_wake[0];
+        ufds[count].events = POLLIN;
+        ufds[count].revents = 0;
+        count++;
+    }
 
-    ret = poll(ufds, global.server_sockets, timeout);
+    ret = poll(ufds, count, timeout);
     if(ret < 0) {
         return SOCK_ERROR;
     } else if(ret == 0) {
         return SOCK_ERROR;
     } else {
         int dst;
+
+        _intake_wake_clear();
         for(i=0; i < global.server_sockets; i++) {
             if(ufds[i].revents & POLLIN)
                 return ufds[i].fd;
@@ -351,6 +927,7 @@ static sock_t wait_for_serversock(int timeout)
             dst++;
         }
         global.server_sockets = dst;
+        connection_index_serversocks();
         return SOCK_ERROR;
     }
 #else
@@ -366,6 +943,16 @@ static sock_t wait_for_serversock(int timeout)
         if (max == SOCK_ERROR || global.serversock[i] > max)
             max = global.serversock[i];
     }
+    if (_req_poll_fd >= 0) {
+        FD_SET(_req_poll_fd, &rfds);
+        if (max == SOCK_ERROR || _req_poll_fd > max)
+            max = _req_poll_fd;
+    }
+    if (_intake_wake[0] >= 0) {
+        FD_SET(_intake_wake[0], &rfds);
+        if (max == SOCK_ERROR || _intake_wake[0] > max)
+            max = _intake_wake[0];
+    }
 
     if(timeout >= 0) {
         tv.tv_sec = timeout/1000;
@@ -379,6 +966,7 @@ static sock_t wait_for_serversock(int timeout)
     } else if(ret == 0) {
         return SOCK_ERROR;
     } else {
+        _intake_wake_clear();
         for(i=0; i < global.server_sockets; i++) {
             if(FD_ISSET(global.serversock[i], &rfds))
                 return global.serversock[i];
@@ -388,19 +976,28 @@ static sock_t wait_for_serversock(int timeout)
 #endif
 }
 
+/* accept a connection on sock, which is a copy of the listening socket
+ * serversock */
+static connection_t *_accept_on_socket(sock_t sock, sock_t serversock);
+
 static connection_t *_accept_connection(int duration)
 {
-    sock_t sock, serversock;
-    char *ip;
+    sock_t serversock = wait_for_serversock (duration);
 
-    serversock = wait_for_serversock (duration);
     if (serversock == SOCK_ERROR)
         return NULL;
+    return _accept_on_socket (serversock, serversock);
+}
+
+static connection_t *_accept_on_socket(sock_t listening, sock_t serversock)
+{
+    sock_t sock;
+    char *ip;
 
     /* malloc enough room for a full IP address (including ipv6) */
     ip = (char *)malloc(MAX_ADDR_LEN);
 
-    sock = sock_accept(serversock, ip, MAX_ADDR_LEN);
+    sock = sock_accept(listening, ip, MAX_ADDR_LEN);
     if (sock != SOCK_ERROR) {
         connection_t *con = NULL;
         /* Make any IPv4 mapped IPv6 address look like a normal IPv4 address */
@@ -433,6 +1030,11 @@ static void _add_connection(client_queue_t *node)
     *_con_queue_tail = node;
     _con_queue_tail = (volatile client_queue_t **) &node->next;
     thread_spin_unlock(&_connection_lock);
+    if (_request_worker_count) {
+        pthread_mutex_lock(&_request_lock);
+        pthread_cond_signal(&_request_cond);
+        pthread_mutex_unlock(&_request_lock);
+    }
 }
 
 
@@ -458,87 +1060,169 @@ static client_queue_t *_get_connection(void)
 }
 
 
-/* run along queue checking for any data that has come in or a timeout */
-static void process_request_queue (void)
+/* claim a place in the priority reserve, returns 0 if it is used up */
+static int _admission_reserve(void)
 {
-    client_queue_t **node_ref = (client_queue_t **)&_req_queue;
-    ice_config_t *config = config_get_config();
-    int timeout = config->header_timeout;
-    config_release_config();
+    int ret = 0;
 
-    while (*node_ref) {
-        client_queue_t *node = *node_ref;
-        client_t *client = node->client;
-        int len = PER_CLIENT_REFBUF_SIZE - 1 - node->offset;
-        char *buf = client->refbuf->data + node->offset;
+    thread_spin_lock(&_connection_lock);
+    if (_admission_reserved < CONNECTION_PRIORITY_RESERVE) {
+        _admission_reserved++;
+        ret = 1;
+    }
+    thread_spin_unlock(&_connection_lock);
+    return ret;
+}
 
-        if (len > 0) {
-            if (client->con->con_time + timeout <= time(NULL)) {
-                len = 0;
-            } else {
-                len = client_read_bytes(client, buf, len);
-            }
+static void _admission_release(void)
+{
+    thread_spin_lock(&_connection_lock);
+    _admission_reserved--;
+    thread_spin_unlock(&_connection_lock);
+}
+
+/* free a request node, giving back its place in the reserve if it had one */
+static void _free_request_node(client_queue_t *node)
+{
+    if (node->reject_status)
+        _admission_release();
+    free(node->shoutcast_mount);
+    objpool_free(OBJPOOL_CLIENT_QUEUE, node);
+}
+
+/* source clients and admin requests get in even when over the limits */
+static int _is_priority_request(client_t *client, const char *uri)
+{
+    if (client->parser->req_type == httpp_req_source ||
+            client->parser->req_type == httpp_req_put)
+        return 1;
+    if (strcmp(uri, "/admin.cgi") == 0 || strncmp(uri, "/admin/", 7) == 0)
+        return 1;
+    return 0;
+}
+
+/* stop waiting on the headers of a request */
+static void _remove_request(client_queue_t *node)
+{
+    if (node->wheel_next)
+        node->wheel_next->wheel_prev = node->wheel_prev;
+    *node->wheel_prev = node->wheel_next;
+    node->wheel_next = NULL;
+    node->wheel_prev = NULL;
+    _req_count--;
+#ifdef HAVE_SYS_EPOLL_H
+    if (_req_poll_fd >= 0)
+        epoll_ctl(_req_poll_fd, EPOLL_CTL_DEL, node->client->con->sock, NULL);
+#endif
+}
+
+static void _drop_request(client_queue_t *node)
+{
+    _remove_request(node);
+    client_destroy(node->client);
+    _free_request_node(node);
+}
+
+/* pass the request on if its headers are complete, returns 1 if so */
+static int _request_headers_end (client_queue_t *node)
+{
+    client_t *client = node->client;
+    size_t end;
+
+    if (node->offset == 0)
+        return 0;
+    /* the shoutcast password is on a line of its own, otherwise look for
+     * the end of the http style headers. stream_offset refers to the
+     * start of any data sent after them, we don't want to lose that */
+    end = util_find_terminator(client->refbuf->data, node->offset,
+            &node->scan_offset, node->shoutcast != 1);
+    if (end && node->shoutcast != 1)
+        node->stream_offset = end;
+
+    if (end) {
+        _remove_request(node);
+        node->next = NULL;
+        _add_connection(node);
+        return 1;
+    }
+    return 0;
+}
+
+/* read what has arrived for a request and pass it on once the headers
+ * are complete */
+static void process_request (client_queue_t *node)
+{
+    client_t *client = node->client;
+    int len = PER_CLIENT_REFBUF_SIZE - 1 - node->offset;
+    char *buf = client->refbuf->data + node->offset;
+
+    if (len > 0)
+        len = client_read_bytes(client, buf, len);
+
+    if (len > 0) {
+        node->offset += len;
+        client->refbuf->data[node->offset] = '\000';
+        _request_headers_end(node);
+    } else if (len == 0 || client->con->error) {
+        _drop_request(node);
+    }
+}
+
+/* drop the requests whose headers did not arrive in time, working through
+ * the wheel slots for each second since the last call */
+static void expire_requests (time_t now)
+{
+    time_t when = _req_wheel_time;
+
+    if (now - when >= REQUEST_WHEEL_SLOTS)
+        when = now - REQUEST_WHEEL_SLOTS + 1;
+    for (; when <= now; when++) {
+        client_queue_t *node = _req_wheel[when % REQUEST_WHEEL_SLOTS];
+
+        while (node) {
+            client_queue_t *next = node->wheel_next;
+
+            if (node->expire <= now)
+                _drop_request(node);
+            node = next;
         }
+    }
+    _req_wheel_time = now;
+}
 
-        if (len > 0) {
-            int pass_it = 1;
-            char *ptr;
-
-            /* handle \n, \r\n and nsvcap which for some strange reason has
-             * EOL as \r\r\n */
-            node->offset += len;
-            client->refbuf->data[node->offset] = '\000';
-            do {
-                if (node->shoutcast == 1) {
-                    /* password line */
-                    if (strstr (client->refbuf->data, "\r\r\n") != NULL)
-                        break;
-                    if (strstr (client->refbuf->data, "\r\n") != NULL)
-                        break;
-                    if (strstr (client->refbuf->data, "\n") != NULL)
-                        break;
-                }
-                /* stream_offset refers to the start of any data sent after the
-                 * http style headers, we don't want to lose those */
-                ptr = strstr(client->refbuf->data, "\r\r\n\r\r\n");
-                if (ptr) {
-                    node->stream_offset = (ptr+6) - client->refbuf->data;
-                    break;
-                }
-                ptr = strstr(client->refbuf->data, "\r\n\r\n");
-                if (ptr) {
-                    node->stream_offset = (ptr+4) - client->refbuf->data;
-                    break;
-                }
-                ptr = strstr(client->refbuf->data, "\n\n");
-                if (ptr) {
-                    node->stream_offset = (ptr+2) - client->refbuf->data;
-                    break;
-                }
-                pass_it = 0;
-            } while (0);
-
-            if (pass_it) {
-                if ((client_queue_t **)_req_queue_tail == &(node->next))
-                    _req_queue_tail = (volatile client_queue_t **)node_ref;
-                *node_ref = node->next;
-                node->next = NULL;
-                _add_connection(node);
-                continue;
-            }
-        } else {
-            if (len == 0 || client->con->error) {
-                if ((client_queue_t **)_req_queue_tail == &node->next)
-                    _req_queue_tail = (volatile client_queue_t **)node_ref;
-                *node_ref = node->next;
-                client_destroy(client);
-                free(node);
-                continue;
+/* read from the requests which have data and drop any that timed out */
+static void process_request_queue (void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (_req_poll_fd >= 0) {
+        struct epoll_event events[REQUEST_EVENTS_MAX];
+        int i, ret = epoll_wait(_req_poll_fd, events, REQUEST_EVENTS_MAX, 0);
+
+        for (i = 0; i < ret; i++)
+            process_request(events[i].data.ptr);
+    } else
+#endif
+    {
+        int slot;
+
+        for (slot = 0; slot < REQUEST_WHEEL_SLOTS; slot++) {
+            client_queue_t *node = _req_wheel[slot];
+
+            while (node) {
+                client_queue_t *next = node->wheel_next;
+
+                process_request(node);
+                node = next;
             }
         }
-        node_ref = &node->next;
     }
-    _handle_connection();
+    expire_requests(time(NULL));
+    if (_req_count != _req_count_reported) {
+        _req_count_reported = _req_count;
+        stats_event_args(NULL, "request_queue", "%u", _req_count);
+    }
+    if (_request_worker_count == 0)
+        _handle_connection();
 }
 
 
@@ -547,13 +1231,87 @@ static void process_request_queue (void)
  */
 static void _add_request_queue(client_queue_t *node)
 {
-    *_req_queue_tail = node;
-    _req_queue_tail = (volatile client_queue_t **)&node->next;
+    ice_config_t *config = config_get_config();
+    client_queue_t **slot;
+
+    /* a kept alive connection waits for its next request as long as the
+     * keep-alive timeout allows */
+    if (node->client->con->requests)
+        node->expire = node->client->con->con_time + config->keepalive_timeout;
+    else
+        node->expire = node->client->con->con_time + config->header_timeout;
+    config_release_config();
+
+    slot = &_req_wheel[node->expire % REQUEST_WHEEL_SLOTS];
+    node->wheel_next = *slot;
+    node->wheel_prev = slot;
+    if (*slot)
+        (*slot)->wheel_prev = &node->wheel_next;
+    *slot = node;
+    _req_count++;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (_req_poll_fd >= 0) {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = node;
+        if (epoll_ctl(_req_poll_fd, EPOLL_CTL_ADD, node->client->con->sock, &event) < 0)
+            ICECAST_LOG_WARN("Unable to wait on request from %s", node->client->con->ip);
+    }
+#endif
+}
+
+/* hand a request to the accept loop, can be called from any thread */
+static void _add_intake_queue(client_queue_t *node)
+{
+    int first;
+
+    node->next = NULL;
+    thread_spin_lock (&_intake_lock);
+    first = _intake_queue == NULL;
+    *_intake_queue_tail = node;
+    _intake_queue_tail = &node->next;
+    thread_spin_unlock (&_intake_lock);
+    /* the accept loop only needs waking for the first, it takes them all */
+    if (first && _intake_wake[1] >= 0) {
+        char c = 0;
+
+        if (write(_intake_wake[1], &c, 1) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            ICECAST_LOG_DEBUG("Unable to wake the accept loop");
+    }
+}
+
+/* move the requests handed over by other threads onto the request queue */
+static void _take_intake_queue(void)
+{
+    client_queue_t *node;
+
+    if (_intake_queue == NULL)
+        return;
+    thread_spin_lock (&_intake_lock);
+    node = _intake_queue;
+    _intake_queue = NULL;
+    _intake_queue_tail = &_intake_queue;
+    thread_spin_unlock (&_intake_lock);
+
+    while (node) {
+        client_queue_t *next = node->next;
+
+        node->next = NULL;
+        _add_request_queue (node);
+        /* a kept alive connection may have its next request in already,
+         * either read with the last or held by the TLS layer */
+        if (node->client->con->requests && _request_headers_end (node) == 0)
+            process_request (node);
+        node = next;
+    }
 }
 
 static client_queue_t *create_client_node(client_t *client)
 {
-    client_queue_t *node = calloc (1, sizeof (client_queue_t));
+    client_queue_t *node = objpool_alloc (OBJPOOL_CLIENT_QUEUE, sizeof (client_queue_t));
     ice_config_t *config;
     listener_t *listener;
 
@@ -572,6 +1330,8 @@ static client_queue_t *create_client_node(client_t *client)
             connection_uses_ssl(client->con);
         if (listener->shoutcast_mount)
             node->shoutcast_mount = strdup(listener->shoutcast_mount);
+        /* the send buffer size is inherited from the listening socket */
+        connection_set_send_limits(client->con, 0, listener->so_notsent_lowat);
     }
 
     config_release_config();
@@ -579,17 +1339,203 @@ static client_queue_t *create_client_node(client_t *client)
     return node;
 }
 
+/* limit how much the kernel holds for a connection. sndbuf is the send
+ * buffer size and notsent_lowat the amount of unsent data before the
+ * socket stops being writable, either is left alone if 0.
+ */
+void connection_set_send_limits(connection_t *con, int sndbuf, int notsent_lowat)
+{
+    if (sndbuf > 0)
+        sock_set_send_buffer(con->sock, sndbuf);
+#ifdef TCP_NOTSENT_LOWAT
+    if (notsent_lowat > 0 && setsockopt(con->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                (const void *)&notsent_lowat, sizeof(notsent_lowat)) < 0)
+        ICECAST_LOG_DEBUG("Unable to set unsent data limit on connection %lu", con->id);
+#else
+    (void)notsent_lowat;
+#endif
+}
+
+/* ask for the connection to be sent ahead of bulk traffic, both by the
+ * local queueing and with the DSCP expedited forwarding class on the wire */
+void connection_set_low_delay(connection_t *con)
+{
+    int ok = 0;
+#ifdef SO_PRIORITY
+    int priority = 6;
+
+    if (setsockopt(con->sock, SOL_SOCKET, SO_PRIORITY, (const void *)&priority, sizeof(priority)) == 0)
+        ok = 1;
+#endif
+#ifdef IP_TOS
+    {
+        int tos = 0xb8;
+
+        if (setsockopt(con->sock, IPPROTO_IP, IP_TOS, (const void *)&tos, sizeof(tos)) == 0)
+            ok = 1;
+#ifdef IPV6_TCLASS
+        else if (setsockopt(con->sock, IPPROTO_IPV6, IPV6_TCLASS, (const void *)&tos, sizeof(tos)) == 0)
+            ok = 1;
+#endif
+    }
+#endif
+    if (ok == 0)
+        ICECAST_LOG_DEBUG("Unable to prioritise connection %lu", con->id);
+}
+
+void connection_rate_init(connection_rate_t *bucket)
+{
+    memset(bucket, 0, sizeof(*bucket));
+    thread_spin_create(&bucket->lock);
+}
+
+/* change the limits, a bucket starts off full */
+void connection_rate_set(connection_rate_t *bucket, unsigned int rate, unsigned int burst)
+{
+    if (burst == 0)
+        burst = rate;
+    thread_spin_lock(&bucket->lock);
+    if (bucket->rate != rate || bucket->burst != burst) {
+        bucket->rate = rate;
+        bucket->burst = burst;
+        bucket->tokens = (uint64_t)burst * 1000;
+        bucket->last = timing_get_time();
+    }
+    thread_spin_unlock(&bucket->lock);
+}
+
+/* take a token for a new connection, returns 0 if there are none left */
+int connection_rate_take(connection_rate_t *bucket)
+{
+    int ret = 1;
+    uint64_t now;
+
+    if (bucket->rate == 0)
+        return 1;
+    now = timing_get_time();
+    thread_spin_lock(&bucket->lock);
+    if (bucket->rate) {
+        uint64_t max = (uint64_t)bucket->burst * 1000;
+
+        if (now > bucket->last) {
+            bucket->tokens += (now - bucket->last) * bucket->rate;
+            if (bucket->tokens > max)
+                bucket->tokens = max;
+        }
+        bucket->last = now;
+        if (bucket->tokens >= 1000)
+            bucket->tokens -= 1000;
+        else
+            ret = 0;
+    }
+    thread_spin_unlock(&bucket->lock);
+    return ret;
+}
+
+void connection_rate_destroy(connection_rate_t *bucket)
+{
+    thread_spin_destroy(&bucket->lock);
+}
+
+/* count the connection against the keep-alive limit of its address,
+ * returns 0 if it is to be closed after the response instead */
+int connection_keepalive_take(connection_t *con)
+{
+    ice_config_t *config;
+    keepalive_ip_t key, *entry;
+    void *result;
+    unsigned int limit;
+    int ret = 1;
+
+    if (con->keepalive)
+        return 1;
+    config = config_get_config();
+    limit = config->keepalive_per_ip;
+    if (config->keepalive_timeout <= 0)
+        limit = 0;
+    config_release_config();
+    if (limit == 0 || con->ip == NULL || _keepalive_ips == NULL)
+        return 0;
+
+    key.ip = con->ip;
+    avl_tree_wlock(_keepalive_ips);
+    if (avl_get_by_key(_keepalive_ips, &key, &result) == 0) {
+        entry = result;
+        if (entry->count >= limit)
+            ret = 0;
+        else
+            entry->count++;
+    } else {
+        entry = calloc(1, sizeof(keepalive_ip_t));
+        if (entry)
+            entry->ip = strdup(con->ip);
+        if (entry == NULL || entry->ip == NULL) {
+            /* no memory to count it, so do not keep it alive */
+            free(entry);
+            avl_tree_unlock(_keepalive_ips);
+            return 0;
+        }
+        entry->count = 1;
+        avl_insert(_keepalive_ips, entry);
+    }
+    avl_tree_unlock(_keepalive_ips);
+    if (ret)
+        con->keepalive = 1;
+    return ret;
+}
+
+/* the connection is closing or no longer kept alive */
+void connection_keepalive_release(connection_t *con)
+{
+    keepalive_ip_t key;
+    void *result;
+
+    if (con->keepalive == 0 || _keepalive_ips == NULL)
+        return;
+    con->keepalive = 0;
+    key.ip = con->ip;
+    avl_tree_wlock(_keepalive_ips);
+    if (avl_get_by_key(_keepalive_ips, &key, &result) == 0) {
+        keepalive_ip_t *entry = result;
+
+        if (--entry->count == 0)
+            avl_delete(_keepalive_ips, entry, _free_keepalive_ip);
+    }
+    avl_tree_unlock(_keepalive_ips);
+}
+
+/* the accept rate bucket of the listen-socket a connection came in on */
+static int _accept_rate_take(connection_t *con)
+{
+    int i;
+
+    for (i = 0; i < _accept_rate_count; i++)
+        if (_accept_rates[i].serversock == con->serversock)
+            return connection_rate_take(&_accept_rates[i].bucket);
+    return 1;
+}
+
 void connection_queue(connection_t *con)
 {
     client_queue_t *node;
     client_t *client = NULL;
+    int reject_status = 0;
+    const char *reject_message = NULL;
+
+    /* another request on a kept alive connection is not a new connection */
+    if (con->requests == 0 && _accept_rate_take(con) == 0) {
+        reject_status = 503;
+        reject_message = "Too many new connections, try again later";
+    }
 
-    global_lock();
     if (client_create(&client, con, NULL) < 0) {
-        global_unlock();
-        client_send_error(client, 403, 1, "Icecast connection limit reached");
-        /* don't be too eager as this is an imposed hard limit */
-        thread_sleep(400000);
+        reject_status = 403;
+        reject_message = "Icecast connection limit reached";
+    }
+    /* don't hold things up for a rejection, the client is told so and gone */
+    if (reject_status && _admission_reserve() == 0) {
+        stats_event_inc(NULL, "connections_rejected");
+        client_send_error(client, reject_status, 1, reject_message);
         return;
     }
 
@@ -597,21 +1543,123 @@ void connection_queue(connection_t *con)
     client->refbuf->data[PER_CLIENT_REFBUF_SIZE-1] = '\000';
 
     if (sock_set_blocking(client->con->sock, 0) || sock_set_nodelay(client->con->sock)) {
-        global_unlock();
         ICECAST_LOG_WARN("Failed to set tcp options on client connection, dropping");
+        if (reject_status)
+            _admission_release();
         client_destroy(client);
         return;
     }
     node = create_client_node(client);
-    global_unlock();
 
     if (node == NULL) {
+        if (reject_status)
+            _admission_release();
         client_destroy(client);
         return;
     }
+    node->reject_status = reject_status;
+    node->reject_message = reject_message;
+
+    if (con->pending) {
+        /* pipelined, the next request was read along with the last */
+        unsigned int len = con->pending_len;
+
+        if (len > PER_CLIENT_REFBUF_SIZE - 1)
+            len = PER_CLIENT_REFBUF_SIZE - 1;
+        memcpy(client->refbuf->data, con->pending, len);
+        client->refbuf->data[len] = '\000';
+        node->offset = len;
+        free(con->pending);
+        con->pending = NULL;
+        con->pending_len = 0;
+    }
+
+    _add_intake_queue(node);
+    if (con->requests)
+        stats_event_inc(NULL, "connections_reused");
+    else
+        stats_event_inc(NULL, "connections");
+}
+
+
+/* nothing queued for the request workers */
+static int _con_queue_empty(void)
+{
+    int empty;
+
+    thread_spin_lock(&_connection_lock);
+    empty = _con_queue == NULL;
+    thread_spin_unlock(&_connection_lock);
+    return empty;
+}
+
+static void *connection_request_worker(void *arg)
+{
+    (void)arg;
+    affinity_apply(AFFINITY_REQUEST);
+    while (1) {
+        _handle_connection();
+        config_drop_pin();
+        pthread_mutex_lock(&_request_lock);
+        while (global.running == ICECAST_RUNNING && _con_queue_empty())
+            pthread_cond_wait(&_request_cond, &_request_lock);
+        pthread_mutex_unlock(&_request_lock);
+        if (global.running != ICECAST_RUNNING)
+            break;
+    }
+    return NULL;
+}
+
+static void connection_start_request_workers(int count)
+{
+    int i;
+
+    if (count < 1)
+        return;
+    _request_workers = calloc(count, sizeof(thread_type *));
+    if (_request_workers == NULL)
+        return;
+    /* set first so that requests queued from here on wake the workers */
+    _request_worker_count = count;
+    for (i = 0; i < count; i++)
+        _request_workers[i] = thread_create("Request Thread",
+                connection_request_worker, NULL, THREAD_ATTACHED);
+    ICECAST_LOG_INFO("using %d request threads", count);
+}
+
+static void connection_stop_request_workers(void)
+{
+    int i;
+
+    /* the shutdown is already flagged, so each either sees it before it
+     * waits or is woken by this */
+    pthread_mutex_lock(&_request_lock);
+    pthread_cond_broadcast(&_request_cond);
+    pthread_mutex_unlock(&_request_lock);
+    for (i = 0; i < _request_worker_count; i++) {
+        if (_request_workers[i])
+            thread_join(_request_workers[i]);
+    }
+    free(_request_workers);
+    _request_workers = NULL;
+    _request_worker_count = 0;
+}
+
+static void *connection_acceptor_thread(void *arg)
+{
+    acceptor_t *acceptor = arg;
+
+    affinity_apply(AFFINITY_ACCEPTOR);
+    while (global.running == ICECAST_RUNNING) {
+        connection_t *con;
 
-    _add_request_queue(node);
-    stats_event_inc(NULL, "connections");
+        if (util_timed_wait_for_fd (acceptor->sock, 300) <= 0)
+            continue;
+        con = _accept_on_socket (acceptor->sock, acceptor->serversock);
+        if (con)
+            connection_queue (con);
+    }
+    return NULL;
 }
 
 void connection_accept_loop(void)
@@ -620,10 +1668,19 @@ void connection_accept_loop(void)
     ice_config_t *config;
     int duration = 300;
 
+    int i;
+    uint64_t scan_start;
+
     config = config_get_config();
     get_ssl_certificate(config);
+    i = config->request_threads;
     config_release_config();
 
+    connection_start_request_workers(i);
+    for (i = 0; i < _acceptor_count; i++)
+        _acceptors[i].thread = thread_create ("Acceptor Thread",
+                connection_acceptor_thread, &_acceptors[i], THREAD_ATTACHED);
+
     while (global.running == ICECAST_RUNNING) {
         con = _accept_connection (duration);
 
@@ -631,11 +1688,26 @@ void connection_accept_loop(void)
             connection_queue(con);
             duration = 5;
         } else {
-            if (_req_queue == NULL)
+            if (_intake_queue == NULL && (_req_count == 0 || _req_poll_fd >= 0))
                 duration = 300; /* use longer timeouts when nothing waiting */
+            /* without the wakeup pipe requests handed over by other threads
+             * are only seen when the wait ends */
+            if (_intake_wake[0] < 0 && _acceptor_count && duration > 30)
+                duration = 30;
         }
+        _take_intake_queue();
+        scan_start = stats_time_us();
         process_request_queue();
+        stats_histogram_record_global (STATS_HISTOGRAM_REQUEST_SCAN,
+                stats_time_us() - scan_start);
+    }
+
+    for (i = 0; i < _acceptor_count; i++) {
+        if (_acceptors[i].thread)
+            thread_join (_acceptors[i].thread);
+        _acceptors[i].thread = NULL;
     }
+    connection_stop_request_workers();
 
     /* Give all the other threads notification to shut down */
     thread_cond_broadcast(&global.shutdown_cond);
@@ -652,12 +1724,13 @@ void connection_accept_loop(void)
 int connection_complete_source(source_t *source, int response)
 {
     ice_config_t *config;
-
-    global_lock();
-    ICECAST_LOG_DEBUG("sources count is %d", global.sources);
+    int sources;
 
     config = config_get_config();
-    if (global.sources < config->source_limit) {
+    sources = global_sources_reserve(config->source_limit);
+    ICECAST_LOG_DEBUG("sources count is %d", global_sources());
+
+    if (sources >= 0) {
         const char *contenttype;
         mount_proxy *mountinfo;
         format_type_t format_type;
@@ -669,7 +1742,7 @@ int connection_complete_source(source_t *source, int response)
 
             if (format_type == FORMAT_ERROR) {
                 config_release_config();
-                global_unlock();
+                global_sources_add(-1);
                 if (response) {
                     client_send_error(source->client, 403, 1, "Content-type not supported");
                     source->client = NULL;
@@ -679,7 +1752,7 @@ int connection_complete_source(source_t *source, int response)
             }
         } else if (source->parser->req_type == httpp_req_put) {
             config_release_config();
-            global_unlock();
+            global_sources_add(-1);
             if (response) {
                 client_send_error(source->client, 403, 1, "No Content-type given");
                 source->client = NULL;
@@ -694,7 +1767,7 @@ int connection_complete_source(source_t *source, int response)
         }
 
         if (format_get_plugin (format_type, source) < 0) {
-            global_unlock();
+            global_sources_add(-1);
             config_release_config();
             if (response) {
                 client_send_error(source->client, 403, 1, "internal format allocation problem");
@@ -704,11 +1777,10 @@ int connection_complete_source(source_t *source, int response)
             return -1;
         }
 
-        global.sources++;
-        stats_event_args(NULL, "sources", "%d", global.sources);
-        global_unlock();
+        stats_event_args(NULL, "sources", "%d", sources);
 
         source->running = 1;
+        source_routes_changed();
         mountinfo = config_find_mount(config, source->mount, MOUNT_TYPE_NORMAL);
         source_update_settings(config, source, mountinfo);
         config_release_config();
@@ -720,9 +1792,8 @@ int connection_complete_source(source_t *source, int response)
         return 0;
     }
     ICECAST_LOG_WARN("Request to add source when maximum source limit "
-        "reached %d", global.sources);
+        "reached %d", config->source_limit);
 
-    global_unlock();
     config_release_config();
 
     if (response) {
@@ -863,9 +1934,7 @@ static int __add_listener_to_source(source_t *source, client_t *client)
     memset(client->refbuf->data, 0, PER_CLIENT_REFBUF_SIZE);
 
     /* lets add the client to the active list */
-    avl_tree_wlock(source->pending_tree);
-    avl_insert(source->pending_tree, client);
-    avl_tree_unlock(source->pending_tree);
+    listener_queue_push(&source->pending, client);
 
     if (source->running == 0 && source->on_demand) {
         /* enable on-demand relay to start, wake up the slave thread */
@@ -876,38 +1945,23 @@ static int __add_listener_to_source(source_t *source, client_t *client)
     return 0;
 }
 
-/* count the number of clients on a mount with same username and same role as the given one */
+/* count the number of clients on a mount with same username and same role as
+ * the given one, clients still on the pending queue are not included */
 static inline ssize_t __count_user_role_on_mount (source_t *source, client_t *client) {
     ssize_t ret = 0;
-    avl_node *node;
+    unsigned long i;
 
-    avl_tree_rlock(source->client_tree);
-    node = avl_get_first(source->client_tree);
-    while (node) {
-        client_t *existing_client = (client_t *)node->key;
+    listener_list_rlock(&source->client_list);
+    for (i = 0; i < source->client_list.count; i++) {
+        client_t *existing_client = source->client_list.clients[i];
         if (existing_client->username && client->username &&
             strcmp(existing_client->username, client->username) == 0 &&
             existing_client->role && client->role &&
             strcmp(existing_client->role, client->role) == 0) {
             ret++;
         }
-        node = avl_get_next(node);
     }
-    avl_tree_unlock(source->client_tree);
-
-    avl_tree_rlock(source->pending_tree);
-    node = avl_get_first(source->pending_tree);
-    while (node) {
-        client_t *existing_client = (client_t *)node->key;
-        if (existing_client->username && client->username &&
-            strcmp(existing_client->username, client->username) == 0 &&
-            existing_client->role && client->role &&
-            strcmp(existing_client->role, client->role) == 0){
-            ret++;
-        }
-        node = avl_get_next(node);
-    }
-    avl_tree_unlock(source->pending_tree);
+    listener_list_unlock(&source->client_list);
     return ret;
 }
 
@@ -943,6 +1997,12 @@ static void _handle_get_request(client_t *client, char *uri) {
         return;
     }
 
+    if (strcmp(uri, "/status.json") == 0) {
+        ICECAST_LOG_DEBUG("Stats request, sending JSON stats");
+        json_send_status(client);
+        return;
+    }
+
     if (util_check_valid_extension(uri) == XSLT_CONTENT) {
         /* If the file exists, then transform it, otherwise, write a 404 */
         ICECAST_LOG_DEBUG("Stats request, sending XSL transformed stats");
@@ -981,10 +2041,42 @@ static void _handle_get_request(client_t *client, char *uri) {
             if (connection_duration > 0) /* -1 = not set (-> default=unlimited), 0 = unlimited */
                 client->con->discon_time = connection_duration + time(NULL);
         }
+        if (!in_error && connection_rate_take(&source->listener_rate) == 0) {
+            stats_event_inc(NULL, "connections_rejected");
+            client_send_error(client, 503, 1, "Too many new listeners, try again later");
+            in_error = 1;
+        }
+        if (!in_error) {
+            /* a listener starting back in time is sent the recording */
+            const char *offset = httpp_get_query_param(client->parser, "offset");
+            timeshift_t *ts = NULL;
+
+            if (offset) {
+                thread_mutex_lock(&source->lock);
+                ts = source->timeshift;
+                if (ts)
+                    timeshift_addref(ts);
+                thread_mutex_unlock(&source->lock);
+            }
+            if (ts) {
+                long seconds = strtol(offset[0] == '-' ? offset + 1 : offset, NULL, 10);
+
+                /* handed on, so not added as a listener below */
+                if (seconds > 0 && timeshift_add_client(ts, client, source->format->contenttype, seconds) == 0)
+                    in_error = 1;
+                timeshift_release(ts);
+            }
+        }
+        /* a busy server can hand the listener to one of its slaves */
+        if (!in_error && slave_redirect_client(source, client, source->mount) == 0)
+            in_error = 1;
         if (!in_error && __add_listener_to_source(source, client) == -1) {
             client_send_error(client, 403, 1, "Rejecting client for whatever reason");
         }
         avl_tree_unlock(global.source_tree);
+    } else if (hls_handle_request(client, uri) == 0) {
+        /* a playlist or segment of a mount */
+        avl_tree_unlock(global.source_tree);
     } else {
         /* file */
         avl_tree_unlock(global.source_tree);
@@ -1004,26 +2096,21 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
     if (node->shoutcast == 1)
     {
         char *ptr, *headers;
+        size_t from = 0, end;
 
         /* Get rid of trailing \r\n or \n after password */
-        ptr = strstr(client->refbuf->data, "\r\r\n");
-        if (ptr) {
-            headers = ptr+3;
-        } else {
-            ptr = strstr(client->refbuf->data, "\r\n");
-            if (ptr) {
-                headers = ptr+2;
-            } else {
-                ptr = strstr(client->refbuf->data, "\n");
-                if (ptr)
-                    headers = ptr+1;
-            }
+        end = util_find_terminator(client->refbuf->data, node->offset, &from, 0);
+        ptr = NULL;
+        if (end) {
+            headers = client->refbuf->data + end;
+            ptr = headers - 1;
+            while (ptr > client->refbuf->data && ptr[-1] == '\r' && headers - ptr < 3)
+                ptr--;
         }
 
         if (ptr == NULL){
             client_destroy(client);
-            free(node->shoutcast_mount);
-            free(node);
+            _free_request_node(node);
             return;
         }
         *ptr = '\0';
@@ -1031,9 +2118,10 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
         client->password = strdup(client->refbuf->data);
         node->offset -= (headers - client->refbuf->data);
         memmove(client->refbuf->data, headers, node->offset+1);
+        node->scan_offset = 0;
         node->shoutcast = 2;
         /* we've checked the password, now send it back for reading headers */
-        _add_request_queue(node);
+        _add_intake_queue(node);
         return;
     }
     /* actually make a copy as we are dropping the config lock */
@@ -1072,8 +2160,7 @@ static void _handle_shoutcast_compatible(client_queue_t *node)
         client_destroy(client);
     }
     free(http_compliant);
-    free(node->shoutcast_mount);
-    free(node);
+    _free_request_node(node);
     return;
 }
 
@@ -1216,6 +2303,15 @@ static void _handle_authentication_mount_generic(client_t *client, void *uri, mo
 
     config = config_get_config();
     mountproxy = __find_non_admin_mount(config, uri, type);
+    if (!mountproxy) {
+        /* HLS playlists and segments are authenticated as their mount */
+        char *hls_mount = hls_mount_name(uri);
+
+        if (hls_mount) {
+            mountproxy = __find_non_admin_mount(config, hls_mount, type);
+            free(hls_mount);
+        }
+    }
     if (!mountproxy) {
         int command_type = admin_get_command_type(client->admin_command);
         if (command_type == ADMINTYPE_MOUNT || command_type == ADMINTYPE_HYBRID) {
@@ -1310,6 +2406,8 @@ static void _handle_connection(void)
         if (node) {
             client_t *client = node->client;
             int already_parsed = 0;
+            int reject_status = node->reject_status;
+            const char *reject_message = node->reject_message;
 
             /* Check for special shoutcast compatability processing */
             if (node->shoutcast) {
@@ -1338,16 +2436,28 @@ static void _handle_connection(void)
                     char *ptr = client->refbuf->data;
                     client->refbuf->len = node->offset - node->stream_offset;
                     memmove (ptr, ptr + node->stream_offset, client->refbuf->len);
+                    /* a GET may have the next request pipelined behind it,
+                     * keep that for when the response is done */
+                    if (parser->req_type == httpp_req_get) {
+                        free(client->con->pending);
+                        client->con->pending = malloc(client->refbuf->len);
+                        if (client->con->pending) {
+                            memcpy(client->con->pending, ptr, client->refbuf->len);
+                            client->con->pending_len = client->refbuf->len;
+                        }
+                    }
                 }
 
+                /* no longer idle, the limit is on connections waiting */
+                connection_keepalive_release(client->con);
+
                 rawuri = httpp_getvar(parser, HTTPP_VAR_URI);
 
                 /* assign a port-based shoutcast mountpoint if required */
                 if (node->shoutcast_mount && strcmp (rawuri, "/admin.cgi") == 0)
                     httpp_set_query_param (client->parser, "mount", node->shoutcast_mount);
 
-                free (node->shoutcast_mount);
-                free (node);
+                _free_request_node(node);
 
                 if (strcmp("ICE",  httpp_getvar(parser, HTTPP_VAR_PROTOCOL)) &&
                     strcmp("HTTP", httpp_getvar(parser, HTTPP_VAR_PROTOCOL))) {
@@ -1388,9 +2498,16 @@ static void _handle_connection(void)
                     client->admin_command = admin_get_command(uri + 7);
                 }
 
+                if (reject_status && !_is_priority_request(client, uri)) {
+                    stats_event_inc(NULL, "connections_rejected");
+                    client_send_error(client, reject_status, 1, reject_message);
+                    free(uri);
+                    continue;
+                }
+
                 _handle_authentication(client, uri);
             } else {
-                free (node);
+                _free_request_node(node);
                 ICECAST_LOG_ERROR("HTTP request parsing failed");
                 client_destroy (client);
             }
@@ -1401,6 +2518,92 @@ static void _handle_connection(void)
 }
 
 
+#ifdef SO_REUSEPORT
+/* open a listening socket which others can share the port with, IPv6 is
+ * preferred as it normally takes IPv4 connections too */
+static sock_t connection_reuseport_socket(int port, const char *bind_address)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[10];
+    sock_t sock = SOCK_ERROR;
+    int pass, on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(bind_address, service, &hints, &res) != 0)
+        return SOCK_ERROR;
+
+    for (pass = 0; pass < 2 && sock == SOCK_ERROR; pass++) {
+        for (ai = res; ai; ai = ai->ai_next) {
+            if ((ai->ai_family == AF_INET6) != (pass == 0))
+                continue;
+            sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sock == SOCK_ERROR)
+                continue;
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof(on));
+            if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const void *)&on, sizeof(on)) == 0 &&
+                    bind(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            sock_close(sock);
+            sock = SOCK_ERROR;
+        }
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+#endif
+
+/* get a listening socket ready for accepting connections */
+static sock_t connection_listen_socket(listener_t *listener, int shared)
+{
+    sock_t sock;
+
+#ifdef SO_REUSEPORT
+    if (shared)
+        sock = connection_reuseport_socket(listener->port, listener->bind_address);
+    else
+#endif
+        sock = sock_get_server_socket (listener->port, listener->bind_address);
+    if (sock == SOCK_ERROR)
+        return SOCK_ERROR;
+    if (sock_listen (sock, ICECAST_LISTEN_QUEUE) == SOCK_ERROR) {
+        sock_close (sock);
+        return SOCK_ERROR;
+    }
+    /* some win32 setups do not do TCP win scaling well, so allow an override */
+    if (listener->so_sndbuf)
+        sock_set_send_buffer (sock, listener->so_sndbuf);
+    sock_set_blocking (sock, 0);
+    return sock;
+}
+
+/* open the extra copies of a listening socket for the acceptor threads */
+static void connection_add_acceptors(listener_t *listener, sock_t serversock)
+{
+    int i;
+
+    for (i = 1; i < listener->acceptors; i++) {
+        acceptor_t *acceptors = realloc(_acceptors, (_acceptor_count + 1) * sizeof(acceptor_t));
+        sock_t sock;
+
+        if (acceptors == NULL)
+            break;
+        _acceptors = acceptors;
+        sock = connection_listen_socket(listener, 1);
+        if (sock == SOCK_ERROR) {
+            ICECAST_LOG_WARN("Could not open acceptor %d for port %d", i, listener->port);
+            break;
+        }
+        _acceptors[_acceptor_count].sock = sock;
+        _acceptors[_acceptor_count].serversock = serversock;
+        _acceptors[_acceptor_count].thread = NULL;
+        _acceptor_count++;
+    }
+}
+
 /* called when listening thread is not checking for incoming connections */
 int connection_setup_sockets (ice_config_t *config)
 {
@@ -1414,7 +2617,19 @@ int connection_setup_sockets (ice_config_t *config)
         free (global.serversock);
         global.serversock = NULL;
     }
+    for (count = 0; count < _acceptor_count; count++)
+        sock_close (_acceptors[count].sock);
+    free (_acceptors);
+    _acceptors = NULL;
+    _acceptor_count = 0;
+    count = 0;
     if (config == NULL) {
+        thread_spin_lock(&_serversock_lock);
+        free(_serversock_slots);
+        _serversock_slots = NULL;
+        _serversock_slot_count = 0;
+        thread_spin_unlock(&_serversock_lock);
+        global.server_sockets = 0;
         global_unlock();
         return 0;
     }
@@ -1434,6 +2649,7 @@ int connection_setup_sockets (ice_config_t *config)
 
     count = 0;
     global.serversock = calloc(config->listen_sock_count, sizeof(sock_t));
+    _accept_rates = calloc(config->listen_sock_count, sizeof(accept_rate_t));
 
     listener = config->listen_sock;
     prev = &config->listen_sock;
@@ -1441,20 +2657,30 @@ int connection_setup_sockets (ice_config_t *config)
         int successful = 0;
 
         do {
-            sock_t sock = sock_get_server_socket (listener->port, listener->bind_address);
+            int shared = 0;
+            sock_t sock;
+
+#ifdef SO_REUSEPORT
+            shared = listener->acceptors > 1;
+#else
+            if (listener->acceptors > 1)
+                ICECAST_LOG_WARN("SO_REUSEPORT is not available, using one acceptor for port %d", listener->port);
+#endif
+            sock = connection_listen_socket (listener, shared);
             if (sock == SOCK_ERROR)
                 break;
-            if (sock_listen (sock, ICECAST_LISTEN_QUEUE) == SOCK_ERROR) {
-                sock_close (sock);
-                break;
-            }
-            /* some win32 setups do not do TCP win scaling well, so allow an override */
-            if (listener->so_sndbuf)
-                sock_set_send_buffer (sock, listener->so_sndbuf);
-            sock_set_blocking (sock, 0);
             successful = 1;
             global.serversock [count] = sock;
             count++;
+            if (listener->accept_rate && _accept_rates) {
+                accept_rate_t *rate = &_accept_rates[_accept_rate_count++];
+
+                rate->serversock = sock;
+                connection_rate_init(&rate->bucket);
+                connection_rate_set(&rate->bucket, listener->accept_rate, listener->accept_burst);
+            }
+            if (shared)
+                connection_add_acceptors (listener, sock);
         } while(0);
         if (successful == 0) {
             if (listener->bind_address) {
@@ -1477,6 +2703,8 @@ int connection_setup_sockets (ice_config_t *config)
         listener = listener->next;
     }
     global.server_sockets = count;
+    connection_index_serversocks();
+    config_index_listeners(config);
     global_unlock();
 
     if (count == 0)
@@ -1493,10 +2721,12 @@ void connection_close(connection_t *con)
 
     if (con->sock != -1) /* TODO: do not use magic */
         sock_close(con->sock);
+    connection_keepalive_release(con);
     if (con->ip)
         free(con->ip);
+    free(con->pending);
 #ifdef HAVE_OPENSSL
     if (con->ssl) { SSL_shutdown(con->ssl); SSL_free(con->ssl); }
 #endif
-    free(con);
+    objpool_free(OBJPOOL_CONNECTION, con);
 }
@@ -41,25 +41,59 @@ typedef struct connection_tag
     sock_t sock;
     sock_t serversock;
     int error;
+    /* TLS records are built by the kernel, plain writes can be used */
+    int ktls;
 
 #ifdef HAVE_OPENSSL
     SSL *ssl; /* SSL handler */
 #endif
     int (*send)(struct connection_tag *handle, const void *buf, size_t len);
+    int (*sendv)(struct connection_tag *handle, const struct iovec *iov, size_t count);
     int (*read)(struct connection_tag *handle, void *buf, size_t len);
 
     char *ip;
+
+    /* requests already answered on this connection */
+    unsigned int requests;
+    /* set while counted against the keep-alive limit of its address */
+    int keepalive;
+    /* data read past the end of the last request, the start of the next */
+    char *pending;
+    unsigned int pending_len;
 } connection_t;
 
+/* token bucket limiting how fast connections are taken on. Tokens are
+ * counted in thousandths, rate is per second and 0 means no limit */
+typedef struct connection_rate_tag
+{
+    spin_t lock;
+    unsigned int rate;
+    unsigned int burst;
+    uint64_t tokens;
+    uint64_t last;
+} connection_rate_t;
+
 void connection_initialize(void);
 void connection_shutdown(void);
 void connection_accept_loop(void);
 int connection_setup_sockets(struct ice_config_tag *config);
+int connection_serversock_slot(sock_t serversock);
 void connection_close(connection_t *con);
 connection_t *connection_create(sock_t sock, sock_t serversock, char *ip);
 int connection_complete_source(struct source_tag *source, int response);
 void connection_queue(connection_t *con);
+void connection_set_send_limits(connection_t *con, int sndbuf, int notsent_lowat);
+void connection_set_low_delay(connection_t *con);
 void connection_uses_ssl(connection_t *con);
+int connection_keepalive_take(connection_t *con);
+void connection_keepalive_release(connection_t *con);
+int connection_can_sendfile(connection_t *con);
+ssize_t connection_sendfile(connection_t *con, int fd, off_t *offset, size_t len);
+
+void connection_rate_init(connection_rate_t *bucket);
+void connection_rate_set(connection_rate_t *bucket, unsigned int rate, unsigned int burst);
+int connection_rate_take(connection_rate_t *bucket);
+void connection_rate_destroy(connection_rate_t *bucket);
 
 ssize_t connection_read_bytes(connection_t *con, void *buf, size_t len);
 
@@ -0,0 +1,369 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* dumpfile.c
+ **
+ ** stream dump files. The source thread only queues references to the
+ ** buffers, a writer thread per file takes whatever is queued and writes
+ ** it out in one go so a slow disk does not hold up the listeners. The
+ ** writes can be moved on to a new file part way, in order with the data.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef HAVE_FALLOCATE
+#include <linux/falloc.h>
+#endif
+
+#include "common/thread/thread.h"
+
+#include "dumpfile.h"
+#include "logging.h"
+
+#define CATMODULE "dumpfile"
+
+/* most buffers queued at once, a power of 2 */
+#define DUMPFILE_ENTRIES    1024
+
+/* buffers handed to a single writev */
+#define DUMPFILE_BATCH      64
+
+struct dumpfile_tag
+{
+    mutex_t lock;
+    cond_t cond;
+    thread_type *thread;
+    int fd;
+    char *filename;
+
+    /* queued buffers are from head up to tail, an entry with a name in
+     * place of a buffer moves the writes on to that file */
+    refbuf_t *entries[DUMPFILE_ENTRIES];
+    char *names[DUMPFILE_ENTRIES];
+    unsigned int head, tail;
+    size_t queued;
+    size_t queue_size;
+    dumpfile_overflow_action overflow;
+
+    /* how far ahead the file has been allocated */
+    size_t preallocate;
+    off_t written, allocated;
+
+    dumpfile_done_t callback;
+    void *callback_arg;
+
+    unsigned long dropped;
+    int running;
+    int error;
+};
+
+
+/* done with the current file, give back what was allocated beyond the
+ * end and let the callback know */
+static void dumpfile_finish_file (dumpfile_t *dump, int failed)
+{
+    if (dump->fd < 0)
+        return;
+#ifdef HAVE_FALLOCATE
+    if (dump->allocated > dump->written)
+        fallocate (dump->fd, FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE,
+                dump->written, dump->allocated - dump->written);
+#endif
+    close (dump->fd);
+    dump->fd = -1;
+    if (dump->callback)
+        dump->callback (dump->callback_arg, dump->filename, failed);
+}
+
+
+/* start writing to the file, appending to anything there already */
+static int dumpfile_open_file (dumpfile_t *dump)
+{
+    dump->fd = open (dump->filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (dump->fd < 0)
+        return -1;
+    dump->written = lseek (dump->fd, 0, SEEK_END);
+    if (dump->written < 0)
+        dump->written = 0;
+    dump->allocated = dump->written;
+    return 0;
+}
+
+
+/* allocate the file ahead of the writes so it is not extended a piece
+ * at a time */
+static void dumpfile_preallocate (dumpfile_t *dump, size_t len)
+{
+#ifdef HAVE_FALLOCATE
+    if (dump->preallocate == 0 || dump->written + (off_t)len <= dump->allocated)
+        return;
+    if (fallocate (dump->fd, FALLOC_FL_KEEP_SIZE, dump->written, dump->preallocate + len) < 0)
+    {
+        ICECAST_LOG_DEBUG("cannot preallocate %s: %s", dump->filename, strerror (errno));
+        dump->preallocate = 0;
+        return;
+    }
+    dump->allocated = dump->written + dump->preallocate + len;
+#else
+    (void)dump;
+    (void)len;
+#endif
+}
+
+
+/* write out all of the vector, returns 0 or -1 on error */
+static int dumpfile_writev (dumpfile_t *dump, struct iovec *iov, int count)
+{
+    while (count)
+    {
+        ssize_t ret = writev (dump->fd, iov, count);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        dump->written += ret;
+        while (count && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+
+static void *dumpfile_thread (void *arg)
+{
+    dumpfile_t *dump = arg;
+    int failed = 0;
+
+    thread_mutex_lock (&dump->lock);
+    while (1)
+    {
+        struct iovec iov[DUMPFILE_BATCH];
+        unsigned int count, i;
+        size_t len = 0;
+
+        if (dump->head == dump->tail)
+        {
+            if (dump->running == 0)
+                break;
+            thread_mutex_unlock (&dump->lock);
+            /* a missed wakeup only delays the write */
+            thread_cond_timedwait (&dump->cond, 500);
+            thread_mutex_lock (&dump->lock);
+            continue;
+        }
+        if (dump->names [dump->head & (DUMPFILE_ENTRIES - 1)])
+        {
+            unsigned int slot = dump->head & (DUMPFILE_ENTRIES - 1);
+            char *filename = dump->names [slot];
+
+            dump->names [slot] = NULL;
+            thread_mutex_unlock (&dump->lock);
+
+            dumpfile_finish_file (dump, failed);
+            free (dump->filename);
+            dump->filename = filename;
+            failed = 0;
+            if (dumpfile_open_file (dump) < 0)
+            {
+                ICECAST_LOG_WARN("Cannot open dump file %s: %s", filename, strerror (errno));
+                failed = 1;
+            }
+
+            thread_mutex_lock (&dump->lock);
+            dump->error = failed;
+            dump->head++;
+            continue;
+        }
+        for (count = 0; count < DUMPFILE_BATCH && dump->head + count != dump->tail; count++)
+        {
+            unsigned int slot = (dump->head + count) & (DUMPFILE_ENTRIES - 1);
+            refbuf_t *refbuf = dump->entries [slot];
+
+            if (dump->names [slot])
+                break;
+            iov[count].iov_base = refbuf->data;
+            iov[count].iov_len = refbuf->len;
+            len += refbuf->len;
+        }
+        thread_mutex_unlock (&dump->lock);
+
+        /* after a failure the rest is only released */
+        if (failed == 0)
+        {
+            dumpfile_preallocate (dump, len);
+            if (dumpfile_writev (dump, iov, count) < 0)
+            {
+                ICECAST_LOG_WARN("Write to dump file %s failed, disabling: %s",
+                        dump->filename, strerror (errno));
+                failed = 1;
+            }
+        }
+
+        thread_mutex_lock (&dump->lock);
+        dump->error = failed;
+        for (i = 0; i < count; i++)
+        {
+            unsigned int slot = dump->head++ & (DUMPFILE_ENTRIES - 1);
+
+            refbuf_release (dump->entries [slot]);
+            dump->entries [slot] = NULL;
+        }
+        dump->queued -= len;
+    }
+    thread_mutex_unlock (&dump->lock);
+    return NULL;
+}
+
+
+/* open the file for appending, and start its writer */
+dumpfile_t *dumpfile_open (const char *filename, size_t queue_size,
+        dumpfile_overflow_action overflow, size_t preallocate)
+{
+    dumpfile_t *dump = calloc (1, sizeof (dumpfile_t));
+
+    if (dump == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    dump->filename = strdup (filename);
+    if (dumpfile_open_file (dump) < 0)
+    {
+        free (dump->filename);
+        free (dump);
+        return NULL;
+    }
+    dump->queue_size = queue_size ? queue_size : DUMPFILE_QUEUE_DEFAULT;
+    dump->overflow = overflow;
+    dump->preallocate = preallocate;
+    dump->running = 1;
+    thread_mutex_create (&dump->lock);
+    thread_cond_create (&dump->cond);
+    dump->thread = thread_create ("Dumpfile Thread", dumpfile_thread, dump, THREAD_ATTACHED);
+    return dump;
+}
+
+
+/* have the callback told of each file once it is written and closed,
+ * set before anything is queued */
+void dumpfile_set_callback (dumpfile_t *dump, dumpfile_done_t callback, void *arg)
+{
+    dump->callback = callback;
+    dump->callback_arg = arg;
+}
+
+
+/* queue the buffer to be written. Returns 0, or -1 if the dump has failed
+ * or overflowed under the stop action, and should be closed
+ */
+int dumpfile_write (dumpfile_t *dump, refbuf_t *refbuf)
+{
+    int ret = 0, wake = 0;
+
+    if (refbuf->len == 0)
+        return 0;
+
+    thread_mutex_lock (&dump->lock);
+    if (dump->error)
+        ret = -1;
+    else if (dump->tail - dump->head == DUMPFILE_ENTRIES ||
+            dump->queued + refbuf->len > dump->queue_size)
+    {
+        if (dump->overflow == DUMPFILE_OVERFLOW_STOP)
+        {
+            ICECAST_LOG_WARN("Writes to dump file %s are too far behind, disabling", dump->filename);
+            ret = -1;
+        }
+        else if (dump->dropped++ == 0)
+            ICECAST_LOG_WARN("Writes to dump file %s are too far behind, dropping data", dump->filename);
+    }
+    else
+    {
+        refbuf_addref (refbuf);
+        wake = (dump->head == dump->tail);
+        dump->entries [dump->tail++ & (DUMPFILE_ENTRIES - 1)] = refbuf;
+        dump->queued += refbuf->len;
+    }
+    thread_mutex_unlock (&dump->lock);
+
+    if (wake)
+        thread_cond_signal (&dump->cond);
+    return ret;
+}
+
+
+/* move the writes on to the file, after what is already queued. Returns
+ * 0, or -1 if it cannot be queued now */
+int dumpfile_switch (dumpfile_t *dump, const char *filename)
+{
+    int ret = -1, wake = 0;
+
+    thread_mutex_lock (&dump->lock);
+    if (dump->tail - dump->head < DUMPFILE_ENTRIES)
+    {
+        unsigned int slot = dump->tail++ & (DUMPFILE_ENTRIES - 1);
+
+        wake = (dump->head + 1 == dump->tail);
+        dump->entries [slot] = NULL;
+        dump->names [slot] = strdup (filename);
+        ret = 0;
+    }
+    thread_mutex_unlock (&dump->lock);
+
+    if (wake)
+        thread_cond_signal (&dump->cond);
+    return ret;
+}
+
+
+/* write out what is still queued, then close the file */
+void dumpfile_close (dumpfile_t *dump)
+{
+    if (dump == NULL)
+        return;
+
+    thread_mutex_lock (&dump->lock);
+    dump->running = 0;
+    thread_mutex_unlock (&dump->lock);
+    thread_cond_signal (&dump->cond);
+    thread_join (dump->thread);
+
+    if (dump->dropped)
+        ICECAST_LOG_WARN("%lu buffers were not written to dump file %s", dump->dropped, dump->filename);
+    dumpfile_finish_file (dump, dump->error);
+    thread_cond_destroy (&dump->cond);
+    thread_mutex_destroy (&dump->lock);
+    free (dump->filename);
+    free (dump);
+}
@@ -0,0 +1,41 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* dumpfile.h
+**
+** stream dump files written out by a thread of their own
+**
+*/
+#ifndef __DUMPFILE_H__
+#define __DUMPFILE_H__
+
+#include <stddef.h>
+
+#include "refbuf.h"
+#include "cfgfile.h"
+
+/* bytes queued for writing by default before the overflow action */
+#define DUMPFILE_QUEUE_DEFAULT  (4 * 1024 * 1024)
+
+typedef struct dumpfile_tag dumpfile_t;
+
+/* called from the writer once a file has been written and closed */
+typedef void (*dumpfile_done_t)(void *arg, const char *filename, int failed);
+
+dumpfile_t *dumpfile_open (const char *filename, size_t queue_size,
+        dumpfile_overflow_action overflow, size_t preallocate);
+void dumpfile_set_callback (dumpfile_t *dump, dumpfile_done_t callback, void *arg);
+int dumpfile_write (dumpfile_t *dump, refbuf_t *refbuf);
+int dumpfile_switch (dumpfile_t *dump, const char *filename);
+void dumpfile_close (dumpfile_t *dump);
+
+#endif  /* __DUMPFILE_H__ */
@@ -20,11 +20,18 @@
 #include "event_url.h"
 #include "logging.h"
 #include "admin.h"
+#include "stats.h"
 
 #define CATMODULE "event"
 
+/* events waiting for the event thread, beyond this new ones are dropped */
+#define EVENT_QUEUE_MAX 1024
+
 static mutex_t event_lock;
+static cond_t event_cond; /* signalled when an event is queued */
 static event_t *event_queue = NULL;
+static event_t **event_queue_tail = &event_queue;
+static size_t event_queue_length = 0;
 static int event_running = 0;
 static thread_type *event_thread = NULL;
 
@@ -58,23 +65,20 @@ static void event_release(event_t *event) {
     free(event);
 }
 
-static void event_push(event_t **event, event_t *next) {
-    size_t i = 0;
-
-    if (!event || !next)
-        return;
+/* append to event_queue, event_lock must be held. Returns -1 if full */
+static int event_push(event_t *next) {
+    if (!next)
+        return 0;
 
-    while (*event && i < 128) {
-        event = &(*event)->next;
-        i++;
+    if (event_queue_length >= EVENT_QUEUE_MAX) {
+        ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", next);
+        return -1;
     }
 
-    if (i == 128) {
-        ICECAST_LOG_ERROR("Can not push event %p into queue. Queue is full.", event);
-        return;
-    }
-
-    event_addref(*event = next);
+    event_addref(*event_queue_tail = next);
+    event_queue_tail = &next->next;
+    event_queue_length++;
+    return 0;
 }
 
 static void event_push_reglist(event_t *event, event_registration_t *reglist) {
@@ -149,36 +153,72 @@ static inline void _try_registrations(event_registration_t *er, event_t *event)
     thread_mutex_unlock(&er->lock);
 }
 
+/* let backends that hold back events deliver them */
+static inline void _flush_registrations(event_registration_t *er) {
+    if (!er)
+        return;
+
+    thread_mutex_lock(&er->lock);
+    while (1) {
+        if (er->flush)
+            er->flush(er->state);
+
+       if (er->next) {
+           event_registration_t *next = er->next;
+
+           thread_mutex_lock(&next->lock);
+           thread_mutex_unlock(&er->lock);
+           er = next;
+       } else {
+           break;
+       }
+    }
+    thread_mutex_unlock(&er->lock);
+}
+
 static void *event_run_thread (void *arg) {
     int running = 0;
 
     (void)arg;
 
     do {
-        event_t *event;
+        event_t *batch, *event;
         size_t i;
 
+        /* take everything queued so backends can deliver it together */
         thread_mutex_lock(&event_lock);
         running = event_running;
-        if (event_queue) {
-            event = event_queue;
-            event_queue = event_queue->next;
-            event->next = NULL;
-        } else {
-            event = NULL;
-        }
+        batch = event_queue;
+        event_queue = NULL;
+        event_queue_tail = &event_queue;
+        event_queue_length = 0;
         thread_mutex_unlock(&event_lock);
 
-        /* sleep if nothing todo and then try again */
-        if (!event) {
-            thread_sleep(150000);
+        /* wait if nothing todo and then try again, a missed wakeup only delays */
+        if (!batch) {
+            if (running) {
+                config_drop_pin();
+                thread_cond_timedwait(&event_cond, 150);
+            }
             continue;
         }
 
-        for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
-            _try_registrations(event->reglist[i], event);
+        for (event = batch; event; event = event->next)
+            for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
+                _try_registrations(event->reglist[i], event);
 
-        event_release(event);
+        /* registrations are shared between events, flushing an already
+         * flushed one is cheap */
+        for (event = batch; event; event = event->next)
+            for (i = 0; i < (sizeof(event->reglist)/sizeof(*event->reglist)); i++)
+                _flush_registrations(event->reglist[i]);
+
+        while (batch) {
+            event = batch;
+            batch = event->next;
+            event->next = NULL;
+            event_release(event);
+        }
     } while (running);
 
     return NULL;
@@ -187,6 +227,7 @@ static void *event_run_thread (void *arg) {
 void event_initialise(void) {
     /* create mutex */
     thread_mutex_create(&event_lock);
+    thread_cond_create(&event_cond);
 
     /* initialise everything */
     thread_mutex_lock(&event_lock);
@@ -205,6 +246,7 @@ void event_shutdown(void) {
     thread_mutex_lock(&event_lock);
     event_running = 0;
     thread_mutex_unlock(&event_lock);
+    thread_cond_signal(&event_cond);
 
     /* join thread as soon as it stopped */
     thread_join(event_thread);
@@ -214,9 +256,12 @@ void event_shutdown(void) {
     event_thread = NULL;
     event_release(event_queue);
     event_queue = NULL;
+    event_queue_tail = &event_queue;
+    event_queue_length = 0;
     thread_mutex_unlock(&event_lock);
 
     /* destry mutex */
+    thread_cond_destroy(&event_cond);
     thread_mutex_destroy(&event_lock);
 }
 
@@ -331,9 +376,17 @@ void event_registration_push(event_registration_t **er, event_registration_t *ta
 
 /* event signaling */
 void event_emit(event_t *event) {
+    int ret;
+
     thread_mutex_lock(&event_lock);
-    event_push(&event_queue, event);
+    ret = event_push(event);
     thread_mutex_unlock(&event_lock);
+
+    if (ret < 0) {
+        stats_event_inc(NULL, "events_dropped");
+    } else {
+        thread_cond_signal(&event_cond);
+    }
 }
 
 /* this function needs to extract all the info from the client, source and mount object
@@ -85,6 +85,9 @@ struct event_registration_tag {
     /* emit events */
     int (*emit)(void *state, event_t *event);
 
+    /* optional: deliver events emit() held back, called after each batch */
+    int (*flush)(void *state);
+
     /* free backend state */
     void (*free)(void *state);
 };
@@ -18,6 +18,12 @@
 /* for __setup_empty_script_environment() */
 #include <sys/stat.h>
 #include <fcntl.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#include <signal.h>
+#include <stdlib.h>
+extern char **environ;
+#endif
 #endif
 
 #include "event.h"
@@ -112,57 +118,207 @@ static inline char **__setup_argv(event_exec_t *self, event_t *event) {
 /* this sets up the new environment for script execution.
  * We ignore most failtures as we can not handle them anyway.
  */
+#ifdef HAVE_POSIX_SPAWN
+/* The environment handed to posix_spawn(): our variables first, followed
+ * by the inherited ones they do not override. Only the first own entries
+ * are allocated here. */
+typedef struct {
+    char **envp;
+    size_t count;
+    size_t size;
+    size_t own;
+} event_exec_env_t;
+
+static void __env_append(event_exec_env_t *env, char *entry) {
+    if (env->count + 1 >= env->size) {
+        size_t size = env->size ? env->size * 2 : 64;
+        char **envp = realloc(env->envp, size * sizeof(char *));
+
+        if (!envp)
+            return;
+        env->envp = envp;
+        env->size = size;
+    }
+    env->envp[env->count++] = entry;
+    env->envp[env->count] = NULL;
+}
+
+static inline void __update_environ(event_exec_env_t *env, const char *name, const char *value) {
+    size_t len;
+    char *entry;
+
+    if (!name || !value) return;
+    len = strlen(name) + strlen(value) + 2;
+    entry = malloc(len);
+    if (!entry)
+        return;
+    snprintf(entry, len, "%s=%s", name, value);
+    __env_append(env, entry);
+    env->own = env->count;
+}
+
+static void __env_inherit(event_exec_env_t *env) {
+    char **cur;
+    size_t i;
+
+    for (cur = environ; cur && *cur; cur++) {
+        const char *eq = strchr(*cur, '=');
+        size_t len = eq ? (size_t)(eq - *cur) + 1 : strlen(*cur);
+
+        for (i = 0; i < env->own; i++)
+            if (strncmp(env->envp[i], *cur, len) == 0)
+                break;
+        if (i == env->own)
+            __env_append(env, *cur);
+    }
+}
+
+static void __env_free(event_exec_env_t *env) {
+    size_t i;
+
+    for (i = 0; i < env->own; i++)
+        free(env->envp[i]);
+    free(env->envp);
+}
+#else
+typedef void event_exec_env_t;
 #ifdef HAVE_SETENV
-static inline void __update_environ(const char *name, const char *value) {
+static inline void __update_environ(event_exec_env_t *env, const char *name, const char *value) {
+    (void)env;
     if (!name || !value) return;
     setenv(name, value, 1);
 }
 #else
-#define __update_environ(x,y)
+#define __update_environ(e,x,y)
 #endif
-static inline void __setup_environ(ice_config_t *config, event_exec_t *self, event_t *event) {
+#endif
+static inline void __setup_environ(ice_config_t *config, event_exec_t *self, event_t *event, event_exec_env_t *env) {
     mount_proxy *mountinfo;
     source_t *source;
     char buf[80];
 
     /* BEFORE RELEASE 2.5.0 DOCUMENT: Document all those env vars. */
-    __update_environ("ICECAST_VERSION",   ICECAST_VERSION_STRING);
-    __update_environ("ICECAST_HOSTNAME",  config->hostname);
-    __update_environ("ICECAST_ADMIN",     config->admin);
-    __update_environ("ICECAST_LOGDIR",    config->log_dir);
-    __update_environ("EVENT_URI",         event->uri);
-    __update_environ("EVENT_TRIGGER",     event->trigger); /* new name */
-    __update_environ("SOURCE_ACTION",     event->trigger); /* old name (deprecated) */
-    __update_environ("CLIENT_IP",         event->connection_ip);
-    __update_environ("CLIENT_ROLE",       event->client_role);
-    __update_environ("CLIENT_USERNAME",   event->client_username);
-    __update_environ("CLIENT_USERAGENT",  event->client_useragent);
+    __update_environ(env, "ICECAST_VERSION",   ICECAST_VERSION_STRING);
+    __update_environ(env, "ICECAST_HOSTNAME",  config->hostname);
+    __update_environ(env, "ICECAST_ADMIN",     config->admin);
+    __update_environ(env, "ICECAST_LOGDIR",    config->log_dir);
+    __update_environ(env, "EVENT_URI",         event->uri);
+    __update_environ(env, "EVENT_TRIGGER",     event->trigger); /* new name */
+    __update_environ(env, "SOURCE_ACTION",     event->trigger); /* old name (deprecated) */
+    __update_environ(env, "CLIENT_IP",         event->connection_ip);
+    __update_environ(env, "CLIENT_ROLE",       event->client_role);
+    __update_environ(env, "CLIENT_USERNAME",   event->client_username);
+    __update_environ(env, "CLIENT_USERAGENT",  event->client_useragent);
 
     snprintf(buf, sizeof(buf), "%lu", event->connection_id);
-    __update_environ("CLIENT_ID",         buf);
+    __update_environ(env, "CLIENT_ID",         buf);
     snprintf(buf, sizeof(buf), "%lli", (long long int)event->connection_time);
-    __update_environ("CLIENT_CONNECTION_TIME", buf);
+    __update_environ(env, "CLIENT_CONNECTION_TIME", buf);
     snprintf(buf, sizeof(buf), "%i", event->client_admin_command);
-    __update_environ("CLIENT_ADMIN_COMMAND", buf);
+    __update_environ(env, "CLIENT_ADMIN_COMMAND", buf);
 
     mountinfo = config_find_mount(config, event->uri, MOUNT_TYPE_NORMAL);
     if (mountinfo) {
-        __update_environ("MOUNT_NAME",        mountinfo->stream_name);
-        __update_environ("MOUNT_DESCRIPTION", mountinfo->stream_description);
-        __update_environ("MOUNT_URL",         mountinfo->stream_url);
-        __update_environ("MOUNT_GENRE",       mountinfo->stream_genre);
+        __update_environ(env, "MOUNT_NAME",        mountinfo->stream_name);
+        __update_environ(env, "MOUNT_DESCRIPTION", mountinfo->stream_description);
+        __update_environ(env, "MOUNT_URL",         mountinfo->stream_url);
+        __update_environ(env, "MOUNT_GENRE",       mountinfo->stream_genre);
     }
 
     avl_tree_rlock(global.source_tree);
     source = source_find_mount(event->uri);
     if (source) {
-        __update_environ("SOURCE_MOUNTPOINT", source->mount);
-        __update_environ("SOURCE_PUBLIC",     source->yp_public ? "true" : "false");
-        __update_environ("SROUCE_HIDDEN",     source->hidden    ? "true" : "false");
+        __update_environ(env, "SOURCE_MOUNTPOINT", source->mount);
+        __update_environ(env, "SOURCE_PUBLIC",     source->yp_public ? "true" : "false");
+        __update_environ(env, "SROUCE_HIDDEN",     source->hidden    ? "true" : "false");
     }
     avl_tree_unlock(global.source_tree);
 }
 
+#ifdef HAVE_POSIX_SPAWN
+/* children we started, reaped without blocking on the next run. Only used
+ * from the event thread. */
+#define EVENT_EXEC_CHILDREN_MAX 256
+static pid_t _children[EVENT_EXEC_CHILDREN_MAX];
+static size_t _children_count = 0;
+
+static void __reap_children(void) {
+    size_t i = 0;
+
+    while (i < _children_count) {
+        if (waitpid(_children[i], NULL, WNOHANG) != 0) {
+            _children[i] = _children[--_children_count];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* posix_spawn() does not copy the parent's page tables, so its cost does not
+ * grow with the size of the server as fork() does.
+ */
+static void _run_script (event_exec_t *self, event_t *event) {
+    ice_config_t *config;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    event_exec_env_t env;
+    sigset_t mask;
+    pid_t pid;
+    int fd, ret;
+
+    __reap_children();
+
+    if (access(self->executable, R_OK|X_OK) != 0) {
+        ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(errno));
+        return;
+    }
+
+    memset(&env, 0, sizeof(env));
+    config = config_get_config();
+    __setup_environ(config, self, event, &env);
+    __env_inherit(&env);
+
+    /* null device on stdin, stdout and stderr, close the rest */
+    posix_spawn_file_actions_init(&actions);
+    for (fd = 0; fd < 3; fd++)
+        posix_spawn_file_actions_addopen(&actions, fd, config->null_device, O_RDWR, 0);
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+#else
+    for (fd = 3; fd < 1024; fd++)
+        posix_spawn_file_actions_addclose(&actions, fd);
+#endif
+
+    /* our threads block signals and we ignore some, do not pass that on */
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGHUP);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    ICECAST_LOG_DEBUG("Starting command %s", self->executable);
+    ret = posix_spawn(&pid, self->executable, &actions, &attr, __setup_argv(self, event), env.envp);
+    config_release_config();
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    __env_free(&env);
+
+    if (ret != 0) {
+        ICECAST_LOG_ERROR("Unable to run command %s (%s)", self->executable, strerror(ret));
+        return;
+    }
+
+    if (_children_count < EVENT_EXEC_CHILDREN_MAX) {
+        _children[_children_count++] = pid;
+    } else {
+        ICECAST_LOG_WARN("Too many commands running, %s will not be reaped", self->executable);
+    }
+}
+#else
 static inline void __setup_file_descriptors(ice_config_t *config) {
     int i;
 
@@ -191,7 +347,7 @@ static inline void __setup_empty_script_environment(event_exec_t *self, event_t
     ice_config_t *config = config_get_config();
 
     __setup_file_descriptors(config);
-    __setup_environ(config, self, event);
+    __setup_environ(config, self, event, NULL);
 
     config_release_config();
 }
@@ -231,6 +387,7 @@ static void _run_script (event_exec_t *self, event_t *event) {
     }
 }
 #endif
+#endif
 
 static int event_exec_emit(void *state, event_t *event) {
     event_exec_t *self = state;
@@ -11,19 +11,44 @@
 #endif
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "curl.h"
 #include "event.h"
+#include "stats.h"
 #include "logging.h"
 #define CATMODULE "event_url"
 
 
+/* events held back for the next flush, beyond this new ones are dropped */
+#define EVENT_URL_PENDING_MAX   1024
+/* upper bounds for the max_inflight and batch options */
+#define EVENT_URL_INFLIGHT_MAX  32
+#define EVENT_URL_BATCH_MAX     64
+
+typedef struct event_url_request {
+    CURL *handle;
+    char errormsg[CURL_ERROR_SIZE];
+    char *post;
+} event_url_request_t;
+
 typedef struct event_url {
     char *url;
     char *action;
     char *userpwd;
-    CURL *handle;
-    char errormsg[CURL_ERROR_SIZE];
+
+    /* requests[0] is used alone when max_inflight is 1, otherwise they
+     * all run through multi */
+    event_url_request_t *requests;
+    size_t max_inflight;
+    CURLM *multi;
+
+    /* events per request, sent one per line */
+    size_t batch;
+
+    /* POST bodies of events emitted since the last flush */
+    char **pending;
+    size_t pending_count;
 } event_url_t;
 
 static size_t handle_returned (void *ptr, size_t size, size_t nmemb, void *stream) {
@@ -45,6 +70,12 @@ static int event_url_emit(void *state, event_t *event) {
     time_t duration;
     char post[4096];
 
+    if (self->pending_count >= EVENT_URL_PENDING_MAX) {
+        ICECAST_LOG_WARN("Too many events pending for %s, dropping %s", self->url, event->trigger);
+        stats_event_inc(NULL, "events_dropped");
+        return -1;
+    }
+
     action   = util_url_escape(self->action ? self->action : event->trigger);
     mount    = __escape(event->uri, "");
     role     = __escape(event->client_role, "");
@@ -75,24 +106,129 @@ static int event_url_emit(void *state, event_t *event) {
     free(ip);
     free(agent);
 
+    /* sent on the flush following this batch of events */
+    self->pending[self->pending_count] = strdup(post);
+    if (self->pending[self->pending_count])
+        self->pending_count++;
+
+    return 0;
+}
+
+/* join up to batch pending bodies starting at *next into request's post */
+static void event_url_request_setup(event_url_t *self, event_url_request_t *request, size_t *next) {
+    size_t i, n, len = 0;
+    char *p;
+
+    n = self->pending_count - *next;
+    if (n > self->batch)
+        n = self->batch;
+
+    for (i = 0; i < n; i++)
+        len += strlen(self->pending[*next + i]) + 1;
+
+    request->post = malloc(len);
+    p = request->post;
+    for (i = 0; p && i < n; i++) {
+        size_t l = strlen(self->pending[*next + i]);
+
+        if (i)
+            *p++ = '\n';
+        memcpy(p, self->pending[*next + i], l);
+        p += l;
+    }
+    if (p)
+        *p = 0;
+    *next += n;
+
     if (strchr(self->url, '@') == NULL && self->userpwd) {
-        curl_easy_setopt(self->handle, CURLOPT_USERPWD, self->userpwd);
+        curl_easy_setopt(request->handle, CURLOPT_USERPWD, self->userpwd);
     } else {
-        curl_easy_setopt(self->handle, CURLOPT_USERPWD, "");
+        curl_easy_setopt(request->handle, CURLOPT_USERPWD, "");
     }
 
-    curl_easy_setopt(self->handle, CURLOPT_URL, self->url);
-    curl_easy_setopt(self->handle, CURLOPT_POSTFIELDS, post);
+    curl_easy_setopt(request->handle, CURLOPT_URL, self->url);
+    curl_easy_setopt(request->handle, CURLOPT_POSTFIELDS, request->post ? request->post : "");
+    request->errormsg[0] = 0;
+}
+
+static void event_url_request_done(event_url_t *self, event_url_request_t *request, CURLcode res) {
+    if (res)
+        ICECAST_LOG_WARN("auth to server %s failed with %s", self->url, request->errormsg);
+    free(request->post);
+    request->post = NULL;
+}
+
+static int event_url_flush(void *state) {
+    event_url_t *self = state;
+    size_t next = 0, i;
 
-    if (curl_easy_perform(self->handle))
-        ICECAST_LOG_WARN("auth to server %s failed with %s", self->url, self->errormsg);
+    while (next < self->pending_count) {
+        size_t active = 0;
+        int running = 0, left;
+        CURLMsg *msg;
+
+        if (self->max_inflight == 1) {
+            event_url_request_setup(self, &self->requests[0], &next);
+            event_url_request_done(self, &self->requests[0], curl_easy_perform(self->requests[0].handle));
+            continue;
+        }
+
+        for (i = 0; i < self->max_inflight && next < self->pending_count; i++) {
+            event_url_request_setup(self, &self->requests[i], &next);
+            curl_easy_setopt(self->requests[i].handle, CURLOPT_PRIVATE, &self->requests[i]);
+            curl_multi_add_handle(self->multi, self->requests[i].handle);
+            active++;
+        }
+
+        while (active) {
+            if (curl_multi_perform(self->multi, &running) != CURLM_OK)
+                break;
+            while ((msg = curl_multi_info_read(self->multi, &left))) {
+                event_url_request_t *request;
+                char *priv = NULL;
+
+                if (msg->msg != CURLMSG_DONE)
+                    continue;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+                request = (event_url_request_t *)priv;
+                curl_multi_remove_handle(self->multi, request->handle);
+                event_url_request_done(self, request, msg->data.result);
+                active--;
+            }
+            if (active && running)
+                curl_multi_wait(self->multi, NULL, 0, 1000, NULL);
+        }
+
+        /* only left over if the multi handle itself failed */
+        for (i = 0; active && i < self->max_inflight; i++) {
+            if (!self->requests[i].post)
+                continue;
+            curl_multi_remove_handle(self->multi, self->requests[i].handle);
+            free(self->requests[i].post);
+            self->requests[i].post = NULL;
+            active--;
+        }
+    }
+
+    for (i = 0; i < self->pending_count; i++)
+        free(self->pending[i]);
+    self->pending_count = 0;
 
     return 0;
 }
 
 static void event_url_free(void *state) {
     event_url_t *self = state;
-    icecast_curl_free(self->handle);
+    size_t i;
+
+    for (i = 0; i < self->pending_count; i++)
+        free(self->pending[i]);
+    free(self->pending);
+    for (i = 0; self->requests && i < self->max_inflight; i++)
+        icecast_curl_free(self->requests[i].handle);
+    free(self->requests);
+    if (self->multi)
+        curl_multi_cleanup(self->multi);
     free(self->url);
     free(self->action);
     free(self->userpwd);
@@ -103,6 +239,8 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
     event_url_t *self = calloc(1, sizeof(event_url_t));
     const char *username = NULL;
     const char *password = NULL;
+    long max_inflight = 1, batch = 1;
+    size_t i;
 
     if (!self)
         return -1;
@@ -118,6 +256,8 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
              * <option name="username" value="..." />
              * <option name="password" value="..." />
              * <option name="action" value="..." />
+             * <option name="max_inflight" value="..." />
+             * <option name="batch" value="..." />
              */
             if (strcmp(options->name, "url") == 0) {
                 free(self->url);
@@ -129,26 +269,61 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
             } else if (strcmp(options->name, "password") == 0) {
                 password = options->value;
             } else if (strcmp(options->name, "action") == 0) {
-                free(self->url);
+                free(self->action);
                 self->action = NULL;
                 if (options->value)
                     self->action = strdup(options->value);
+            } else if (strcmp(options->name, "max_inflight") == 0) {
+                max_inflight = options->value ? atol(options->value) : 1;
+            } else if (strcmp(options->name, "batch") == 0) {
+                batch = options->value ? atol(options->value) : 1;
             } else {
                 ICECAST_LOG_ERROR("Unknown <option> tag with name %s.", options->name);
             }
         } while ((options = options->next));
     }
 
-    self->handle = icecast_curl_new(NULL, NULL);
+    if (max_inflight < 1)
+        max_inflight = 1;
+    if (max_inflight > EVENT_URL_INFLIGHT_MAX)
+        max_inflight = EVENT_URL_INFLIGHT_MAX;
+    if (batch < 1)
+        batch = 1;
+    if (batch > EVENT_URL_BATCH_MAX)
+        batch = EVENT_URL_BATCH_MAX;
+    self->max_inflight = max_inflight;
+    self->batch = batch;
+
+    self->pending = calloc(EVENT_URL_PENDING_MAX, sizeof(char *));
+    self->requests = calloc(self->max_inflight, sizeof(event_url_request_t));
 
     /* check if we are in sane state */
-    if (!self->url || !self->handle) {
+    if (!self->url || !self->pending || !self->requests) {
         event_url_free(self);
         return -1;
     }
 
-    curl_easy_setopt(self->handle, CURLOPT_HEADERFUNCTION, handle_returned);
-    curl_easy_setopt(self->handle, CURLOPT_ERRORBUFFER, self->errormsg);
+    for (i = 0; i < self->max_inflight; i++) {
+        event_url_request_t *request = &self->requests[i];
+
+        request->handle = icecast_curl_new(NULL, NULL);
+        if (!request->handle) {
+            event_url_free(self);
+            return -1;
+        }
+        curl_easy_setopt(request->handle, CURLOPT_HEADERFUNCTION, handle_returned);
+        curl_easy_setopt(request->handle, CURLOPT_ERRORBUFFER, request->errormsg);
+    }
+
+    if (self->max_inflight > 1) {
+        self->multi = curl_multi_init();
+        if (!self->multi) {
+            event_url_free(self);
+            return -1;
+        }
+        /* keep a connection per request open to the server */
+        curl_multi_setopt(self->multi, CURLMOPT_MAXCONNECTS, max_inflight);
+    }
 
     if (username && password) {
         size_t len = strlen(username) + strlen(password) + 2;
@@ -162,6 +337,7 @@ int event_get_url(event_registration_t *er, config_options_t *options) {
 
     er->state = self;
     er->emit = event_url_emit;
+    er->flush = event_url_flush;
     er->free = event_url_free;
     return 0;
 }
@@ -32,12 +32,15 @@
 
 #include <vorbis/codec.h>
 
+#include "common/timing/timing.h"
+
 #include "connection.h"
 #include "refbuf.h"
 
 #include "source.h"
 #include "format.h"
 #include "global.h"
+#include "intro.h"
 
 #include "format_ogg.h"
 #include "format_mp3.h"
@@ -103,6 +106,38 @@ int format_get_plugin(format_type_t type, source_t *source)
 }
 
 
+/* put the client on the source queue at refbuf. The queue ring of a source
+ * holds the references itself, so listeners on it only note the sequence.
+ */
+static void format_set_queue (source_t *source, client_t *client, refbuf_t *refbuf)
+{
+    if (source->ring)
+    {
+        client_set_queue (client, NULL);
+        client->refbuf = refbuf;
+        client->queue_seq = refbuf->seq;
+        return;
+    }
+    client_set_queue (client, refbuf);
+}
+
+
+/* move the client on to the next buffer in the queue */
+static void format_next_queue (client_t *client)
+{
+    refbuf_t *next = client->refbuf->next;
+
+    if (client->queue_seq)
+    {
+        client->refbuf = next;
+        client->queue_seq = next->seq;
+        client->pos = 0;
+        return;
+    }
+    client_set_queue (client, next);
+}
+
+
 /* clients need to be start from somewhere in the queue so we will look for
  * a refbuf which has been previously marked as a sync point.
  */
@@ -131,8 +166,23 @@ static void find_client_start(source_t *source, client_t *client)
     {
         if (refbuf->sync_point)
         {
-            client_set_queue (client, refbuf);
-            client->check_buffer = format_advance_queue;
+            refbuf_t *snapshot = NULL, *end = NULL;
+
+            /* joining at the burst, send it in one go if possible */
+            if (client->intro_offset != -1 && source->ring == NULL)
+                snapshot = source_burst_snapshot (source, refbuf, &end);
+            if (snapshot)
+            {
+                client_set_queue (client, NULL);
+                client->refbuf = snapshot;
+                client->burst_end = end;
+                client->check_buffer = format_advance_burst;
+            }
+            else
+            {
+                format_set_queue (source, client, refbuf);
+                client->check_buffer = format_advance_queue;
+            }
             client->write_to_client = source->format->write_buf_to_client;
             client->intro_offset = -1;
             break;
@@ -142,14 +192,44 @@ static void find_client_start(source_t *source, client_t *client)
 }
 
 
-static int get_file_data(FILE *intro, client_t *client)
+/* the next part of the intro for the client, call with the intro lock held */
+static int get_file_data(source_t *source, client_t *client)
 {
     refbuf_t *refbuf = client->refbuf;
     size_t bytes;
 
-    if (intro == NULL || fseek (intro, client->intro_offset, SEEK_SET) < 0)
+    if (source->intro)
+    {
+        refbuf_t *intro;
+
+        /* picks up a changed file, the cache checks it once a second */
+        if (client->intro_offset == 0)
+        {
+            intro = intro_cache_get (source->intro_path);
+            if (intro)
+            {
+                refbuf_release (source->intro);
+                source->intro = intro;
+            }
+        }
+        intro = source->intro;
+        if (client->intro_offset >= (long)intro->len)
+            return 0;
+        /* send from the shared copy, the rest of it in one go */
+        client_set_queue (client, NULL);
+        client->refbuf = refbuf_slice (intro, (unsigned int)client->intro_offset,
+                intro->len - (unsigned int)client->intro_offset);
+        return 1;
+    }
+    if (source->intro_file == NULL || fseek (source->intro_file, client->intro_offset, SEEK_SET) < 0)
         return 0;
-    bytes = fread (refbuf->data, 1, 4096, intro);
+    if (refbuf == NULL || refbuf->_parent)
+    {
+        client_set_queue (client, NULL);
+        refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
+        client->refbuf = refbuf;
+    }
+    bytes = fread (refbuf->data, 1, PER_CLIENT_REFBUF_SIZE, source->intro_file);
     if (bytes == 0)
         return 0;
 
@@ -174,18 +254,20 @@ int format_check_file_buffer (source_t *source, client_t *client)
             find_client_start (source, client);
             return -1;
         }
-        /* source -> file fallback, need a refbuf for data */
-        refbuf = refbuf_new (PER_CLIENT_REFBUF_SIZE);
-        client->refbuf = refbuf;
-        client->pos = refbuf->len;
+        /* source -> file fallback, start on the file */
         client->intro_offset = 0;
     }
-    if (client->pos == refbuf->len)
+    if (refbuf == NULL || client->pos == refbuf->len)
     {
-        if (get_file_data (source->intro_file, client))
+        int have_data;
+
+        thread_mutex_lock (&source->intro_lock);
+        have_data = get_file_data (source, client);
+        thread_mutex_unlock (&source->intro_lock);
+        if (have_data)
         {
             client->pos = 0;
-            client->intro_offset += refbuf->len;
+            client->intro_offset += client->refbuf->len;
         }
         else
         {
@@ -232,10 +314,20 @@ int format_check_http_buffer(source_t *source, client_t *client)
 
     if (client->pos == refbuf->len)
     {
+        int intro;
+
         client->write_to_client = source->format->write_buf_to_client;
         client->check_buffer = format_check_file_buffer;
         client->intro_offset = 0;
         client->pos = refbuf->len = 4096;
+
+        /* the request is done with, only keep what the listener needs */
+        client_compact (client);
+        thread_mutex_lock (&source->intro_lock);
+        intro = source->intro_file != NULL || source->intro != NULL;
+        thread_mutex_unlock (&source->intro_lock);
+        if (intro == 0 && source->client)
+            client_set_queue (client, NULL);
         return -1;
     }
     return 0;
@@ -249,6 +341,23 @@ int format_generic_write_to_client(client_t *client)
     const char *buf = refbuf->data + client->pos;
     unsigned int len = refbuf->len - client->pos;
 
+    /* listeners on the source queue can take several buffers at once */
+    if (client->check_buffer == format_advance_queue && refbuf->next)
+    {
+        struct iovec iov[FORMAT_MAX_IOV];
+        int count = format_gather_queue (client, iov, FORMAT_MAX_IOV, FORMAT_MAX_IOV_BYTES, 0);
+
+        /* only listeners on the ring, which is trimmed whatever the buffers
+         * are still referenced by */
+        if (client->zerocopy && client->queue_seq)
+            ret = client_send_queue_zerocopy (client, iov, count);
+        else
+            ret = client_send_vector (client, iov, count);
+        if (ret > 0)
+            format_consume_queue (client, ret);
+        return ret;
+    }
+
     ret = client_send_bytes(client, buf, len);
 
     if (ret > 0)
@@ -258,6 +367,62 @@ int format_generic_write_to_client(client_t *client)
 }
 
 
+/* Fill in the vector with the queued data following the client position,
+ * up to limit bytes. If same_associated is set then stop at the buffer
+ * where the associated data changes. Returns the number of entries used,
+ * the first is always the remains of the current buffer.
+ */
+int format_gather_queue (client_t *client, struct iovec *iov, int max,
+        size_t limit, int same_associated)
+{
+    refbuf_t *refbuf = client->refbuf;
+    size_t total;
+    int count = 1;
+
+    iov[0].iov_base = refbuf->data + client->pos;
+    iov[0].iov_len = refbuf->len - client->pos;
+    total = iov[0].iov_len;
+
+    while (count < max && total < limit && refbuf->next)
+    {
+        refbuf_t *next = refbuf->next;
+
+        if (same_associated && next->associated != refbuf->associated)
+            break;
+        iov[count].iov_base = next->data;
+        iov[count].iov_len = next->len;
+        total += next->len;
+        count++;
+        refbuf = next;
+    }
+    return count;
+}
+
+
+/* move the client along the queue past the amount of data written from a
+ * vector built by format_gather_queue
+ */
+void format_consume_queue (client_t *client, size_t written)
+{
+    while (written)
+    {
+        refbuf_t *refbuf = client->refbuf;
+        size_t remaining = refbuf->len - client->pos;
+
+        if (written < remaining)
+        {
+            client->pos += written;
+            break;
+        }
+        written -= remaining;
+        client->pos = refbuf->len;
+        if (written == 0 || refbuf->next == NULL)
+            break; /* advanced when checking the buffer */
+        format_next_queue (client);
+    }
+}
+
+
 /* This is the commonly used for source streams, here we just progress to
  * the next buffer in the queue if there is no more left to be written from
  * the existing buffer.
@@ -274,60 +439,47 @@ int format_advance_queue(source_t *source, client_t *client)
 
     /* move to the next buffer if we have finished with the current one */
     if (refbuf->next && client->pos == refbuf->len)
-    {
-        client_set_queue (client, refbuf->next);
-        refbuf = client->refbuf;
-    }
+        format_next_queue (client);
     return 0;
 }
 
 
-/* Prepare headers
- * If any error occurs in this function, return -1
- * Do not send a error to the client using client_send_error
- * here but instead set client->respcode to 500.
- * Else client_send_error will destroy and free the client and all
- * calling functions will use a already freed client struct and
- * cause a segfault!
+/* Used for listeners sent a burst snapshot. Once all of it is written they
+ * carry on from the queue buffer following the last one it contained.
  */
-static int format_prepare_headers (source_t *source, client_t *client)
+int format_advance_burst(source_t *source, client_t *client)
 {
-    size_t remaining;
-    char *ptr;
+    refbuf_t *end = client->burst_end;
+
+    if (client->refbuf == NULL || end == NULL)
+        return -1;
+    if (client->pos < client->refbuf->len)
+        return 0;
+    if (end->next == NULL)
+        return -1;
+    client_set_queue (client, end->next);
+    client->check_buffer = format_advance_queue;
+    return 0;
+}
+
+
+/* write the stream details taken from the source client as icy headers,
+ * returns the length needed. Writes at most size bytes so it can be called
+ * with a size of 0 to get the length first.
+ */
+static size_t format_write_icy_headers (source_t *source, char *out, size_t size)
+{
+    size_t used = 0;
     int bytes;
     int bitrate_filtered = 0;
     avl_node *node;
+    mount_proxy *mountinfo;
+    ice_config_t *config;
 
-    remaining = client->refbuf->len;
-    ptr = client->refbuf->data;
-    client->respcode = 200;
+    config = config_get_config();
+    mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
 
-    bytes = util_http_build_header(ptr, remaining, 0, 0, 200, NULL, source->format->contenttype, NULL, NULL, source, client);
-    if (bytes < 0) {
-        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-        client->respcode = 500;
-        return -1;
-    } else if (((size_t)bytes + (size_t)1024U) >= remaining) { /* we don't know yet how much to follow but want at least 1kB free space */
-        void *new_ptr = realloc(ptr, bytes + 1024);
-        if (new_ptr) {
-            ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
-            client->refbuf->data = ptr = new_ptr;
-            client->refbuf->len = remaining = bytes + 1024;
-            bytes = util_http_build_header(ptr, remaining, 0, 0, 200, NULL, source->format->contenttype, NULL, NULL, source, client);
-            if (bytes == -1 ) {
-                ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-                client->respcode = 500;
-                return -1;
-            }
-        } else {
-            ICECAST_LOG_ERROR("Client buffer reallocation failed. Dropping client.");
-            client->respcode = 500;
-            return -1;
-        }
-    }
-
-    remaining -= bytes;
-    ptr += bytes;
+#define ICY_PRINTF(...) snprintf (out + (used < size ? used : 0), used < size ? size - used : 0, __VA_ARGS__)
 
     /* iterate through source http headers and send to client */
     avl_tree_rlock(source->parser->vars);
@@ -347,13 +499,13 @@ static int format_prepare_headers (source_t *source, client_t *client)
                 brfield = strstr(var->value, "bitrate=");
             if (brfield && sscanf (brfield, "bitrate=%u", &bitrate))
             {
-                bytes = snprintf (ptr, remaining, "icy-br:%u\r\n", bitrate);
+                bytes = ICY_PRINTF ("icy-br:%u\r\n", bitrate);
                 next = 0;
                 bitrate_filtered = 1;
             }
             else
                 /* show ice-audio_info header as well because of relays */
-                bytes = snprintf (ptr, remaining, "%s: %s\r\n", var->name, var->value);
+                bytes = ICY_PRINTF ("%s: %s\r\n", var->name, var->value);
         }
         else
         {
@@ -362,45 +514,122 @@ static int format_prepare_headers (source_t *source, client_t *client)
             {
                 if (!strcasecmp(var->name, "ice-name"))
                 {
-                    ice_config_t *config;
-                    mount_proxy *mountinfo;
-
-                    config = config_get_config();
-                    mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
-
                     if (mountinfo && mountinfo->stream_name)
-                        bytes = snprintf (ptr, remaining, "icy-name:%s\r\n", mountinfo->stream_name);
+                        bytes = ICY_PRINTF ("icy-name:%s\r\n", mountinfo->stream_name);
                     else
-                        bytes = snprintf (ptr, remaining, "icy-name:%s\r\n", var->value);
-
-                    config_release_config();
+                        bytes = ICY_PRINTF ("icy-name:%s\r\n", var->value);
                 }
                 else if (!strncasecmp("ice-", var->name, 4))
                 {
                     if (!strcasecmp("ice-public", var->name))
-                        bytes = snprintf (ptr, remaining, "icy-pub:%s\r\n", var->value);
+                        bytes = ICY_PRINTF ("icy-pub:%s\r\n", var->value);
                     else
                         if (!strcasecmp ("ice-bitrate", var->name))
-                            bytes = snprintf (ptr, remaining, "icy-br:%s\r\n", var->value);
+                            bytes = ICY_PRINTF ("icy-br:%s\r\n", var->value);
                         else
-                            bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
+                            bytes = ICY_PRINTF ("icy%s:%s\r\n",
                                     var->name + 3, var->value);
                 }
                 else
                     if (!strncasecmp("icy-", var->name, 4))
                     {
-                        bytes = snprintf (ptr, remaining, "icy%s:%s\r\n",
+                        bytes = ICY_PRINTF ("icy%s:%s\r\n",
                                 var->name + 3, var->value);
                     }
             }
         }
 
-        remaining -= bytes;
-        ptr += bytes;
+        if (bytes > 0)
+            used += bytes;
         if (next)
             node = avl_get_next(node);
     }
     avl_tree_unlock(source->parser->vars);
+#undef ICY_PRINTF
+
+    config_release_config();
+    return used;
+}
+
+/* drop the cached icy headers, the next listener rebuilds them */
+void format_invalidate_headers (source_t *source)
+{
+    thread_mutex_lock (&source->headers_lock);
+    free (source->icy_headers);
+    source->icy_headers = NULL;
+    source->icy_headers_len = 0;
+    thread_mutex_unlock (&source->headers_lock);
+}
+
+/* Prepare headers
+ * If any error occurs in this function, return -1
+ * Do not send a error to the client using client_send_error
+ * here but instead set client->respcode to 500.
+ * Else client_send_error will destroy and free the client and all
+ * calling functions will use a already freed client struct and
+ * cause a segfault!
+ */
+static int format_prepare_headers (source_t *source, client_t *client)
+{
+    size_t remaining;
+    char *ptr;
+    int bytes;
+    size_t icy_len;
+
+    remaining = client->refbuf->len;
+    ptr = client->refbuf->data;
+    client->respcode = 200;
+
+    /* the icy part only depends on the source client and the mount, so it is
+     * built for the first listener and copied for the rest */
+    thread_mutex_lock (&source->headers_lock);
+    if (source->icy_headers == NULL)
+    {
+        icy_len = format_write_icy_headers (source, NULL, 0);
+        source->icy_headers = malloc (icy_len + 1);
+        if (source->icy_headers)
+        {
+            format_write_icy_headers (source, source->icy_headers, icy_len + 1);
+            source->icy_headers_len = icy_len;
+        }
+    }
+    icy_len = source->icy_headers_len;
+    thread_mutex_unlock (&source->headers_lock);
+
+    bytes = util_http_build_header(ptr, remaining, 0, 0, 200, NULL, source->format->contenttype, NULL, NULL, source, client);
+    if (bytes < 0) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client->respcode = 500;
+        return -1;
+    } else if (((size_t)bytes + icy_len + (size_t)1024U) >= remaining) { /* we don't know yet how much to follow but want at least 1kB free space */
+        if (refbuf_resize(client->refbuf, bytes + icy_len + 1024) == 0) {
+            ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
+            ptr = client->refbuf->data;
+            remaining = client->refbuf->len;
+            bytes = util_http_build_header(ptr, remaining, 0, 0, 200, NULL, source->format->contenttype, NULL, NULL, source, client);
+            if (bytes == -1 ) {
+                ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+                client->respcode = 500;
+                return -1;
+            }
+        } else {
+            ICECAST_LOG_ERROR("Client buffer reallocation failed. Dropping client.");
+            client->respcode = 500;
+            return -1;
+        }
+    }
+
+    remaining -= bytes;
+    ptr += bytes;
+
+    thread_mutex_lock (&source->headers_lock);
+    if (source->icy_headers && source->icy_headers_len < remaining)
+    {
+        memcpy (ptr, source->icy_headers, source->icy_headers_len);
+        remaining -= source->icy_headers_len;
+        ptr += source->icy_headers_len;
+    }
+    thread_mutex_unlock (&source->headers_lock);
 
     bytes = snprintf(ptr, remaining, "\r\n");
     remaining -= bytes;
@@ -417,6 +646,22 @@ static int format_prepare_headers (source_t *source, client_t *client)
     return 0;
 }
 
+/* returns 1 if a pending metadata update can be applied now, in which case
+ * it is taken as applied. Otherwise the update stays pending, so a burst of
+ * updates is applied once with the latest tags when the interval is up */
+int format_metadata_due(format_plugin_t *plugin)
+{
+    uint64_t now;
+
+    if (plugin->metadata_interval == 0)
+        return 1;
+    now = timing_get_time();
+    if (plugin->metadata_applied && now - plugin->metadata_applied < plugin->metadata_interval)
+        return 0;
+    plugin->metadata_applied = now;
+    return 1;
+}
+
 void format_set_vorbiscomment(format_plugin_t *plugin, const char *tag, const char *value) {
     if (vorbis_comment_query_count(&plugin->vc, tag) != 0) {
         /* delete key */
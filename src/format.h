@@ -27,6 +27,10 @@
 struct source_tag;
 struct _mount_proxy;
 
+/* limits for gathering queued data into a single vectored write */
+#define FORMAT_MAX_IOV          16
+#define FORMAT_MAX_IOV_BYTES    20000
+
 typedef enum _format_type_tag
 {
     FORMAT_ERROR, /* No format, source not processable */
@@ -54,9 +58,15 @@ typedef struct _format_plugin_tag
     void (*set_tag)(struct _format_plugin_tag *plugin, const char *tag, const char *value, const char *charset);
     void (*free_plugin)(struct _format_plugin_tag *self);
     void (*apply_settings)(client_t *client, struct _format_plugin_tag *format, struct _mount_proxy *mount);
+    /* the stream headers needed ahead of refbuf to start a file with it,
+     * NULL if there are none or if the format does not have any */
+    refbuf_t *(*get_headers)(struct source_tag *source, refbuf_t *refbuf);
 
     /* meta data */
     vorbis_comment vc;
+    /* least ms between applied metadata updates, 0 for no limit */
+    unsigned int metadata_interval;
+    uint64_t metadata_applied;
 
     /* for internal state management */
     void *_state;
@@ -67,15 +77,20 @@ char *format_get_mimetype(format_type_t type);
 int format_get_plugin(format_type_t type, struct source_tag *source);
 
 int format_generic_write_to_client (client_t *client);
+int format_gather_queue (client_t *client, struct iovec *iov, int max, size_t limit, int same_associated);
+void format_consume_queue (client_t *client, size_t written);
 int format_advance_queue (struct source_tag *source, client_t *client);
+int format_advance_burst (struct source_tag *source, client_t *client);
 int format_check_http_buffer (struct source_tag *source, client_t *client);
 int format_check_file_buffer (struct source_tag *source, client_t *client);
+void format_invalidate_headers (struct source_tag *source);
 
 
 void format_send_general_headers(format_plugin_t *format, 
         struct source_tag *source, client_t *client);
 
 void format_set_vorbiscomment(format_plugin_t *plugin, const char *tag, const char *value);
+int format_metadata_due(format_plugin_t *plugin);
 
 #endif  /* __FORMAT_H__ */
 
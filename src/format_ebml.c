@@ -33,6 +33,7 @@
 #include "stats.h"
 #include "format.h"
 #include "format_ebml.h"
+#include "dumpfile.h"
 
 #define CATMODULE "format-ebml"
 
@@ -51,6 +52,12 @@
  */
 #define EBML_SLICE_SIZE 4096
 
+/* The room actually allocated for the input and staging buffers. Data is
+ * consumed from the front and only moved when the end is reached, chunks
+ * handed out are slices of the staging buffer rather than copies.
+ */
+#define EBML_BUFFER_SIZE (EBML_SLICE_SIZE * 4)
+
 /* A value that no EBML var-int is allowed to take. */
 #define EBML_UNKNOWN ((uint_least64_t) -1)
 
@@ -137,9 +144,13 @@ typedef struct ebml_st {
     ebml_keyframe_status cluster_starts_with_keyframe;
     bool flush_cluster;
 
+    /* unread staged data is position bytes from buffer_start */
+    size_t buffer_start;
     size_t position;
-    unsigned char *buffer;
+    refbuf_t *buffer;
 
+    /* unparsed input is from input_start up to input_position */
+    size_t input_start;
     size_t input_position;
     unsigned char *input_buffer;
 
@@ -172,13 +183,14 @@ static void ebml_free_plugin(format_plugin_t *plugin);
 static refbuf_t *ebml_get_buffer(source_t *source);
 static int ebml_write_buf_to_client(client_t *client);
 static void ebml_write_buf_to_file(source_t *source, refbuf_t *refbuf);
+static refbuf_t *ebml_get_headers(source_t *source, refbuf_t *refbuf);
 static int ebml_create_client_data(source_t *source, client_t *client);
 static void ebml_free_client_data(client_t *client);
 
 static ebml_t *ebml_create();
 static void ebml_destroy(ebml_t *ebml);
 static size_t ebml_read_space(ebml_t *ebml);
-static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type *chunk_type);
+static refbuf_t *ebml_read(ebml_t *ebml, size_t len, ebml_chunk_type *chunk_type);
 static unsigned char *ebml_get_write_buffer(ebml_t *ebml, size_t *bytes);
 static ssize_t ebml_wrote(ebml_t *ebml, size_t len);
 static ssize_t ebml_parse_tag(unsigned char      *buffer,
@@ -205,6 +217,7 @@ int format_ebml_get_plugin(source_t *source)
     plugin->create_client_data = ebml_create_client_data;
     plugin->free_plugin = ebml_free_plugin;
     plugin->write_buf_to_file = ebml_write_buf_to_file;
+    plugin->get_headers = ebml_get_headers;
     plugin->set_tag = NULL;
     plugin->apply_settings = NULL;
 
@@ -297,8 +310,9 @@ static refbuf_t *ebml_get_buffer(source_t *source)
         read_bytes = ebml_read_space(ebml_source_state->ebml);
         if (read_bytes > 0) {
             /* A chunk is available for reading */
-            refbuf = refbuf_new(read_bytes);
-            ebml_read(ebml_source_state->ebml, refbuf->data, read_bytes, &chunk_type);
+            refbuf = ebml_read(ebml_source_state->ebml, read_bytes, &chunk_type);
+            if (refbuf == NULL)
+                continue;
 
             if (ebml_source_state->header == NULL)
             {
@@ -372,10 +386,17 @@ static void ebml_free_client_data (client_t *client)
     client->format_data = NULL;
 }
 
+static refbuf_t *ebml_get_headers (source_t *source, refbuf_t *refbuf)
+{
+    ebml_source_state_t *ebml_source_state = source->format->_state;
+
+    (void)refbuf;
+    return ebml_source_state->header;
+}
+
 static void ebml_write_buf_to_file_fail (source_t *source)
 {
-    ICECAST_LOG_WARN("Write to dump file failed, disabling");
-    fclose (source->dumpfile);
+    dumpfile_close (source->dumpfile);
     source->dumpfile = NULL;
 }
 
@@ -386,15 +407,13 @@ static void ebml_write_buf_to_file (source_t *source, refbuf_t *refbuf)
 
     if ( ! ebml_source_state->file_headers_written)
     {
-        if (fwrite (ebml_source_state->header->data, 1,
-                    ebml_source_state->header->len,
-                    source->dumpfile) != ebml_source_state->header->len)
+        if (dumpfile_write (source->dumpfile, ebml_source_state->header) < 0)
             ebml_write_buf_to_file_fail(source);
         else
             ebml_source_state->file_headers_written = true;
     }
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (source->dumpfile && dumpfile_write (source->dumpfile, refbuf) < 0)
     {
         ebml_write_buf_to_file_fail(source);
     }
@@ -408,7 +427,7 @@ static void ebml_destroy(ebml_t *ebml)
 
     free(ebml->header);
     free(ebml->input_buffer);
-    free(ebml->buffer);
+    refbuf_release(ebml->buffer);
     free(ebml);
 
 }
@@ -421,8 +440,8 @@ static ebml_t *ebml_create()
     ebml->output_state = EBML_STATE_READING_HEADER;
 
     ebml->header = calloc(1, EBML_HEADER_MAX_SIZE);
-    ebml->buffer = calloc(1, EBML_SLICE_SIZE);
-    ebml->input_buffer = calloc(1, EBML_SLICE_SIZE);
+    ebml->buffer = refbuf_new(EBML_BUFFER_SIZE);
+    ebml->input_buffer = calloc(1, EBML_BUFFER_SIZE);
 
     ebml->cluster_start = -1;
 
@@ -487,23 +506,24 @@ static size_t ebml_read_space(ebml_t *ebml)
     return 0;
 }
 
-/* Return a chunk of the EBML/MKV/WebM stream.
+/* Return a chunk of the EBML/MKV/WebM stream, of up to len bytes.
  * The header will be buffered until it can be returned as one chunk.
  * A cluster element's opening tag will always start a new chunk.
  * 
  * chunk_type will be set to indicate if the chunk is the header,
  * the start of a cluster, or continuing the current cluster.
  */
-static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type *chunk_type)
+static refbuf_t *ebml_read(ebml_t *ebml, size_t len, ebml_chunk_type *chunk_type)
 {
 
     size_t read_space;
     size_t to_read;
+    refbuf_t *refbuf = NULL;
 
     *chunk_type = EBML_CHUNK_HEADER;
 
     if (len < 1) {
-        return 0;
+        return NULL;
     }
 
     switch (ebml->output_state) {
@@ -520,7 +540,8 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
                     to_read = read_space;
                 }
 
-                memcpy(buffer, ebml->header, to_read);
+                refbuf = refbuf_new(to_read);
+                memcpy(refbuf->data, ebml->header, to_read);
                 ebml->header_read_position += to_read;
 
                 *chunk_type = EBML_CHUNK_HEADER;
@@ -530,7 +551,7 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
                 }
             } else {
                 /* The header's not ready yet */
-                return 0;
+                return NULL;
             }
 
             break;
@@ -561,7 +582,7 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
             }
 
             if (read_space < 1) {
-                return 0;
+                return NULL;
             }
 
             if (read_space >= len ) {
@@ -570,10 +591,9 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
                 to_read = read_space;
             }
 
-            memcpy(buffer, ebml->buffer, to_read);
-
-            /* Shift unread data down to the start of the buffer */
-            memmove(ebml->buffer, ebml->buffer + to_read, ebml->position - to_read);
+            /* The chunk shares the staging buffer */
+            refbuf = refbuf_slice(ebml->buffer, ebml->buffer_start, to_read);
+            ebml->buffer_start += to_read;
             ebml->position -= to_read;
 
             if (ebml->cluster_start > 0) {
@@ -583,8 +603,30 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
             break;
     }
 
-    return to_read;
+    return refbuf;
+
+}
+
+/* Make room for len more bytes of staged data. If the end of the staging
+ * buffer is reached the unread data goes to a new one, the old one stays
+ * around for as long as chunks refer to it.
+ */
+static void ebml_stage_space(ebml_t *ebml, size_t len)
+{
+    refbuf_t *next;
+
+    if (ebml->buffer_start + ebml->position + len <= EBML_BUFFER_SIZE)
+        return;
 
+    if (refbuf_refcount(ebml->buffer) == 1) {
+        memmove(ebml->buffer->data, ebml->buffer->data + ebml->buffer_start, ebml->position);
+    } else {
+        next = refbuf_new(EBML_BUFFER_SIZE);
+        memcpy(next->data, ebml->buffer->data + ebml->buffer_start, ebml->position);
+        refbuf_release(ebml->buffer);
+        ebml->buffer = next;
+    }
+    ebml->buffer_start = 0;
 }
 
 /* Get pointer & length of the buffer able to accept input.
@@ -594,7 +636,14 @@ static size_t ebml_read(ebml_t *ebml, char *buffer, size_t len, ebml_chunk_type
  */
 static unsigned char *ebml_get_write_buffer(ebml_t *ebml, size_t *bytes)
 {
-    *bytes = EBML_SLICE_SIZE - ebml->input_position;
+    /* keep the same amount of room for reads as there always was, the
+     * little left unparsed is only moved down when that runs out */
+    if (EBML_BUFFER_SIZE - ebml->input_position < EBML_SLICE_SIZE - (ebml->input_position - ebml->input_start)) {
+        memmove(ebml->input_buffer, ebml->input_buffer + ebml->input_start, ebml->input_position - ebml->input_start);
+        ebml->input_position -= ebml->input_start;
+        ebml->input_start = 0;
+    }
+    *bytes = EBML_SLICE_SIZE - (ebml->input_position - ebml->input_start);
     return ebml->input_buffer + ebml->input_position;
 }
 
@@ -603,7 +652,7 @@ static unsigned char *ebml_get_write_buffer(ebml_t *ebml, size_t *bytes)
 static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
 {
     bool processing = true;
-    size_t cursor = 0;
+    size_t cursor = ebml->input_start;
     size_t to_copy;
     unsigned char *end_of_buffer;
 
@@ -809,7 +858,9 @@ static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
                         to_copy = EBML_SLICE_SIZE - ebml->position;
                     }
 
-                    memcpy(ebml->buffer + ebml->position, ebml->input_buffer + cursor, to_copy);
+                    ebml_stage_space(ebml, to_copy);
+                    memcpy(ebml->buffer->data + ebml->buffer_start + ebml->position,
+                            ebml->input_buffer + cursor, to_copy);
                     ebml->position += to_copy;
                 }
                 /* ICECAST_LOG_DEBUG("Copied %i of %hhu", to_copy, ebml->copy_len); */
@@ -838,9 +889,12 @@ static ssize_t ebml_wrote(ebml_t *ebml, size_t len)
 
     }
 
-    /* Shift unprocessed data down to the start of the buffer */
-    memmove(ebml->input_buffer, ebml->input_buffer + cursor, ebml->input_position - cursor);
-    ebml->input_position -= cursor;
+    /* The unprocessed data stays where it is until room is needed */
+    if (cursor == ebml->input_position) {
+        ebml->input_start = ebml->input_position = 0;
+    } else {
+        ebml->input_start = cursor;
+    }
 
     return len;
 
@@ -906,9 +960,9 @@ static ssize_t ebml_parse_var_int(unsigned char *buffer,
                                  unsigned char *buffer_end,
                                  uint_least64_t *out_value)
 {
-    size_t size = 1;
+    size_t size;
     size_t i;
-    unsigned char mask = 0x80;
+    unsigned char mask;
     uint_least64_t value;
     uint_least64_t unknown_marker;
 
@@ -916,25 +970,22 @@ static ssize_t ebml_parse_var_int(unsigned char *buffer,
         return 0;
     }
 
-    /* find the length marker bit in the first byte */
-    value = buffer[0];
-
-    while (mask) {
-        if (value & mask) {
-            value = value & ~mask;
-            unknown_marker = mask - 1;
-            break;
-        }
-        size++;
-        mask = mask >> 1;
-    }
-
     /* catch malformed number (no prefix) */
-    if (mask == 0) {
+    if (buffer[0] == 0) {
         ICECAST_LOG_DEBUG("Corrupt var-int");
         return -1;
     }
 
+    /* the number of leading zeros in the first byte gives the length */
+#if defined(__GNUC__)
+    size = __builtin_clz((unsigned int)buffer[0]) - (sizeof(unsigned int) * 8 - 8) + 1;
+#else
+    for (size = 1; (buffer[0] & (0x80 >> (size - 1))) == 0; size++);
+#endif
+    mask = 0x80 >> (size - 1);
+    value = buffer[0] & ~mask;
+    unknown_marker = mask - 1;
+
     /* catch number bigger than parsing buffer */
     if (buffer + size - 1 >= buffer_end) {
         return 0;
@@ -75,7 +75,7 @@ static refbuf_t *process_flac_page (ogg_state_t *ogg_info, ogg_codec_t *codec, o
             return NULL;
         }
     }
-    refbuf = make_refbuf_with_page (page);
+    refbuf = make_refbuf_with_page (ogg_info, page);
     return refbuf;
 }
 
@@ -40,6 +40,7 @@
 #include "logging.h"
 
 #include "format_mp3.h"
+#include "dumpfile.h"
 
 #define CATMODULE "format-mp3"
 
@@ -48,6 +49,9 @@
  */
 #define ICY_METADATA_INTERVAL 16000
 
+/* blocks read without finding a frame before giving up on frame alignment */
+#define MP3_SYNC_MISSES 8
+
 static void format_mp3_free_plugin(format_plugin_t *self);
 static refbuf_t *mp3_get_filter_meta (source_t *source);
 static refbuf_t *mp3_get_no_meta (source_t *source);
@@ -94,6 +98,11 @@ int format_mp3_get_plugin(source_t *source)
 
     plugin->_state = state;
 
+    if (strncmp (plugin->contenttype, "audio/mpeg", 10) == 0 ||
+            strncmp (plugin->contenttype, "audio/aac", 9) == 0 ||
+            strncmp (plugin->contenttype, "audio/x-aac", 11) == 0)
+        state->frame_check = 1;
+
     /* initial metadata needs to be blank for sending to clients and for
        comparing with new metadata */
     meta = refbuf_new (17);
@@ -300,25 +309,31 @@ static void mp3_set_title(source_t *source)
             else if (url)
                 snprintf (p->data+r, size-r, "StreamUrl='%s';", url);
         }
-        ICECAST_LOG_DEBUG("shoutcast metadata block setup with %s", p->data+1);
-        filter_shoutcast_metadata (source, p->data, size);
+        if (source_mp3->metadata && source_mp3->metadata->len == size &&
+                memcmp (source_mp3->metadata->data, p->data, size) == 0)
+        {
+            /* unchanged, keep the block listeners already have */
+            refbuf_release (p);
+        }
+        else
+        {
+            ICECAST_LOG_DEBUG("shoutcast metadata block setup with %s", p->data+1);
+            filter_shoutcast_metadata (source, p->data, size);
 
-        refbuf_release (source_mp3->metadata);
-        source_mp3->metadata = p;
+            refbuf_release (source_mp3->metadata);
+            source_mp3->metadata = p;
+        }
     }
     thread_mutex_unlock (&source_mp3->url_lock);
 }
 
 
-/* send the appropriate metadata, and return the number of bytes written
- * which is 0 or greater.  Check the client in_metadata value afterwards
- * to see if all metadata has been sent
+/* work out the metadata block to send to the client, taking into account
+ * any part of it that has already been sent
  */
-static int send_stream_metadata (client_t *client, refbuf_t *associated)
+static void get_stream_metadata (client_t *client, refbuf_t *associated,
+        char **metadata, int *meta_len)
 {
-    int ret = 0;
-    char *metadata;
-    int meta_len;
     mp3_client_data *client_mp3 = client->format_data;
 
     /* If there is a change in metadata then send it else
@@ -326,120 +341,143 @@ static int send_stream_metadata (client_t *client, refbuf_t *associated)
      */
     if (associated && associated != client_mp3->associated)
     {
-        metadata = associated->data + client_mp3->metadata_offset;
-        meta_len = associated->len - client_mp3->metadata_offset;
+        *metadata = associated->data + client_mp3->metadata_offset;
+        *meta_len = associated->len - client_mp3->metadata_offset;
     }
     else
     {
         if (associated)
         {
-            metadata = "\0";
-            meta_len = 1;
+            *metadata = "\0";
+            *meta_len = 1;
         }
         else
         {
             char *meta = "\001StreamTitle='';";
-            metadata = meta + client_mp3->metadata_offset;
-            meta_len = 17 - client_mp3->metadata_offset;
+            *metadata = meta + client_mp3->metadata_offset;
+            *meta_len = 17 - client_mp3->metadata_offset;
         }
     }
-    ret = client_send_bytes(client, metadata, meta_len);
+}
+
+
+/* update the client after sent bytes of the metadata block went out.
+ * Check the client in_metadata value afterwards to see if all metadata
+ * has been sent
+ */
+static void stream_metadata_sent (client_t *client, refbuf_t *associated,
+        int sent, int meta_len)
+{
+    mp3_client_data *client_mp3 = client->format_data;
 
-    if (ret == meta_len)
+    if (sent == meta_len)
     {
         client_mp3->associated = associated;
         client_mp3->metadata_offset = 0;
         client_mp3->in_metadata = 0;
         client_mp3->since_meta_block = 0;
-        return ret;
+        return;
     }
-    if (ret > 0)
-        client_mp3->metadata_offset += ret;
-    else
-        ret = 0;
+    client_mp3->metadata_offset += sent;
     client_mp3->in_metadata = 1;
-
-    return ret;
 }
 
 
 /* Handler for writing mp3 data to a client, taking into account whether
- * client has requested shoutcast style metadata updates
+ * client has requested shoutcast style metadata updates. Any mp3 leading
+ * up to the metadata block, the block itself and the mp3 after it go out
+ * in a single vectored write.
  */
 static int format_mp3_write_buf_to_client(client_t *client)
 {
-    int ret, written = 0;
     mp3_client_data *client_mp3 = client->format_data;
     refbuf_t *refbuf = client->refbuf;
     char *buf = refbuf->data + client->pos;
     unsigned int len = refbuf->len - client->pos;
+    unsigned int before = len, after = 0, part;
+    char *metadata = NULL;
+    int meta_len = 0, count = 0, ret, sent;
+    struct iovec iov[3];
 
-    do
+    if (client_mp3->in_metadata)
     {
         /* send any unwritten metadata to the client */
-        if (client_mp3->in_metadata)
-        {
-            refbuf_t *associated = refbuf->associated;
-            ret = send_stream_metadata(client, associated);
+        get_stream_metadata (client, refbuf->associated, &metadata, &meta_len);
+        before = 0;
+        after = len;
+    }
+    else if (client_mp3->interval)
+    {
+        unsigned int remaining = client_mp3->interval -
+            client_mp3->since_meta_block;
 
-            if (client_mp3->in_metadata)
-                break;
-            written += ret;
-        }
-        /* see if we need to send the current metadata to the client */
-        if (client_mp3->interval)
+        /* leading up to sending the metadata block */
+        if (remaining <= len)
         {
-            unsigned int remaining = client_mp3->interval -
-                client_mp3->since_meta_block;
-
-            /* leading up to sending the metadata block */
-            if (remaining <= len)
-            {
-                /* send any mp3 before the metadata block */
-                if (remaining)
-                {
-                    ret = client_send_bytes (client, buf, remaining);
-
-                    if (ret > 0)
-                    {
-                        client_mp3->since_meta_block += ret;
-                        client->pos += ret;
-                    }
-                    if (ret < (int)remaining)
-                        break;
-                    written += ret;
-                }
-                ret = send_stream_metadata (client, refbuf->associated);
-                if (client_mp3->in_metadata)
-                    break;
-                written += ret;
-                buf += remaining;
-                len -= remaining;
-                /* limit how much mp3 we send if using small intervals */
-                if (len > client_mp3->interval)
-                    len = client_mp3->interval;
-            }
+            get_stream_metadata (client, refbuf->associated, &metadata, &meta_len);
+            before = remaining;
+            after = len - remaining;
         }
-        /* write any mp3, maybe after the metadata block */
-        if (len)
-        {
-            ret = client_send_bytes (client, buf, len);
+    }
+    /* limit how much mp3 we send if using small intervals */
+    if (meta_len && after > client_mp3->interval)
+        after = client_mp3->interval;
 
-            if (ret > 0)
-            {
-                client_mp3->since_meta_block += ret;
-                client->pos += ret;
-            }
-            if (ret < (int)len)
-                break;
-            written += ret;
-        }
-        ret = 0;
-    } while (0);
+    if (meta_len == 0)
+    {
+        if (len == 0)
+            return 0;
+        ret = client_send_bytes (client, buf, len);
+        if (ret <= 0)
+            return 0;
+        client_mp3->since_meta_block += ret;
+        client->pos += ret;
+        return ret;
+    }
+
+    if (before)
+    {
+        iov[count].iov_base = buf;
+        iov[count].iov_len = before;
+        count++;
+    }
+    iov[count].iov_base = metadata;
+    iov[count].iov_len = meta_len;
+    count++;
+    if (after)
+    {
+        iov[count].iov_base = buf + before;
+        iov[count].iov_len = after;
+        count++;
+    }
+
+    ret = client_send_vector (client, iov, count);
+    if (ret <= 0)
+    {
+        if (before == 0)
+            client_mp3->in_metadata = 1;
+        return 0;
+    }
+
+    /* account for what was written, mp3 then metadata then mp3 */
+    sent = ret;
+    part = (unsigned int)sent < before ? (unsigned int)sent : before;
+    client_mp3->since_meta_block += part;
+    client->pos += part;
+    sent -= part;
+    if (part < before)
+        return ret;
+
+    stream_metadata_sent (client, refbuf->associated,
+            sent < meta_len ? sent : meta_len, meta_len);
+    if (client_mp3->in_metadata)
+        return ret;
+    sent -= meta_len;
+
+    client_mp3->since_meta_block += sent;
+    client->pos += sent;
 
-    if (ret > 0)
-        written += ret;
-    return written;
+    return ret;
 }
 
 static void format_mp3_free_plugin(format_plugin_t *self)
@@ -507,6 +545,151 @@ static int complete_read(source_t *source)
 }
 
 
+/* return the length of the MPEG audio or ADTS frame starting at data, 0 if
+ * more than len bytes are needed to tell or -1 if it is not a frame header.
+ */
+static int mp3_frame_length (const unsigned char *data, unsigned int len)
+{
+    static const unsigned short bitrates[5][15] = {
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+    };
+    static const unsigned int samplerates[3] = { 44100, 48000, 32000 };
+    unsigned int version, layer, bitrate, samplerate, padding;
+
+    if (len < 2)
+        return 0;
+    if (data[0] != 0xFF || (data[1] & 0xE0) != 0xE0)
+        return -1;
+
+    layer = (data[1] >> 1) & 3;
+    if (layer == 0)
+    {
+        /* ADTS, the 12 bit sync with a zero layer */
+        int frame_len;
+
+        if ((data[1] & 0xF0) != 0xF0)
+            return -1;
+        if (len < 6)
+            return 0;
+        if (((data[2] >> 2) & 0xF) > 12)
+            return -1;
+        frame_len = ((data[3] & 3) << 11) | (data[4] << 3) | (data[5] >> 5);
+        if (frame_len < 7)
+            return -1;
+        return frame_len;
+    }
+    if (len < 3)
+        return 0;
+    version = (data[1] >> 3) & 3;
+    bitrate = data[2] >> 4;
+    samplerate = (data[2] >> 2) & 3;
+    padding = (data[2] >> 1) & 1;
+    if (version == 1 || bitrate == 0 || bitrate == 15 || samplerate == 3)
+        return -1;
+
+    /* layer 3 is 1, layer 1 is 3 */
+    if (version == 3)
+        bitrate = bitrates [3 - layer][bitrate] * 1000;
+    else
+        bitrate = bitrates [layer == 3 ? 3 : 4][bitrate] * 1000;
+    samplerate = samplerates [samplerate];
+    if (version == 2)
+        samplerate /= 2;
+    else if (version == 0)
+        samplerate /= 4;
+
+    if (layer == 3)
+        return (12 * bitrate / samplerate + padding) * 4;
+    if (layer == 1 && version != 3)
+        return 72 * bitrate / samplerate + padding;
+    return 144 * bitrate / samplerate + padding;
+}
+
+
+/* Mark the block as a sync point if it starts on an MPEG audio or ADTS
+ * frame. Any incomplete frame at the end is held back to start the next
+ * block so that new listeners join on a frame boundary. Streams that do
+ * not look like either are left with every block as a sync point.
+ */
+static void mp3_frame_align (mp3_state *source_mp3, refbuf_t *refbuf)
+{
+    unsigned char *data = (unsigned char *)refbuf->data;
+    unsigned int pos = 0, last = 0, len = refbuf->len;
+    int frame_len;
+
+    if (source_mp3->frame_check == 0)
+    {
+        refbuf->sync_point = 1;
+        return;
+    }
+    if (source_mp3->frame_synced)
+        pos = source_mp3->frame_remaining;
+    else
+    {
+        /* look for two frames in a row to avoid false matches */
+        for (; pos < len; pos++)
+        {
+            frame_len = mp3_frame_length (data + pos, len - pos);
+            if (frame_len <= 0)
+                continue;
+            if (pos + frame_len < len &&
+                    mp3_frame_length (data + pos + frame_len, len - pos - frame_len) < 0)
+                continue;
+            break;
+        }
+        if (pos >= len)
+        {
+            if (++source_mp3->frame_misses >= MP3_SYNC_MISSES)
+            {
+                ICECAST_LOG_DEBUG("no frames found, not aligning stream");
+                source_mp3->frame_check = 0;
+            }
+            refbuf->sync_point = 1;
+            return;
+        }
+        source_mp3->frame_synced = 1;
+        source_mp3->frame_misses = 0;
+    }
+    while (pos < len)
+    {
+        frame_len = mp3_frame_length (data + pos, len - pos);
+        if (frame_len < 0)
+        {
+            source_mp3->frame_synced = 0;
+            break;
+        }
+        if (pos)
+            last = pos;
+        if (frame_len == 0)
+            break;
+        if (pos == 0)
+            refbuf->sync_point = 1;
+        pos += frame_len;
+    }
+    if (last)
+    {
+        /* the incomplete frame goes to the start of the next block */
+        unsigned int remaining = len - last;
+
+        source_mp3->read_data = refbuf_new (REFBUF_SIZE);
+        memcpy (source_mp3->read_data->data, data + last, remaining);
+        source_mp3->read_count = remaining;
+        source_mp3->audio_offset = remaining;
+        refbuf->len = last;
+        source_mp3->frame_remaining = 0;
+        return;
+    }
+    if (pos < len)
+        source_mp3->frame_synced = 0;
+    else
+        source_mp3->frame_remaining = pos - len;
+}
+
+
 /* read an mp3 stream which does not have shoutcast style metadata */
 static refbuf_t *mp3_get_no_meta (source_t *source)
 {
@@ -518,15 +701,16 @@ static refbuf_t *mp3_get_no_meta (source_t *source)
 
     refbuf = source_mp3->read_data;
     source_mp3->read_data = NULL;
+    source_mp3->audio_offset = 0;
 
-    if (source_mp3->update_metadata)
+    if (source_mp3->update_metadata && format_metadata_due (source->format))
     {
         mp3_set_title (source);
         source_mp3->update_metadata = 0;
     }
+    mp3_frame_align (source_mp3, refbuf);
     refbuf->associated = source_mp3->metadata;
     refbuf_addref (source_mp3->metadata);
-    refbuf->sync_point = 1;
     return refbuf;
 }
 
@@ -548,16 +732,18 @@ static refbuf_t *mp3_get_filter_meta(source_t *source)
 
     refbuf = source_mp3->read_data;
     source_mp3->read_data = NULL;
-    src = (unsigned char *)refbuf->data;
+    /* skip over any audio held back from the last block */
+    src = (unsigned char *)refbuf->data + source_mp3->audio_offset;
 
-    if (source_mp3->update_metadata)
+    if (source_mp3->update_metadata && format_metadata_due (source->format))
     {
         mp3_set_title (source);
         source_mp3->update_metadata = 0;
     }
     /* fill the buffer with the read data */
-    bytes = source_mp3->read_count;
-    refbuf->len = 0;
+    bytes = source_mp3->read_count - source_mp3->audio_offset;
+    refbuf->len = source_mp3->audio_offset;
+    source_mp3->audio_offset = 0;
     while (bytes > 0)
     {
         unsigned int metadata_remaining;
@@ -645,9 +831,9 @@ static refbuf_t *mp3_get_filter_meta(source_t *source)
         refbuf_release (refbuf);
         return NULL;
     }
+    mp3_frame_align (source_mp3, refbuf);
     refbuf->associated = source_mp3->metadata;
     refbuf_addref (source_mp3->metadata);
-    refbuf->sync_point = 1;
 
     return refbuf;
 }
@@ -719,10 +905,9 @@ static void write_mp3_to_file (struct source_tag *source, refbuf_t *refbuf)
 {
     if (refbuf->len == 0)
         return;
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) < (size_t)refbuf->len)
+    if (dumpfile_write (source->dumpfile, refbuf) < 0)
     {
-        ICECAST_LOG_WARN("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
+        dumpfile_close (source->dumpfile);
         source->dumpfile = NULL;
     }
 }
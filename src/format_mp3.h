@@ -35,6 +35,13 @@ typedef struct {
     int read_count;
     mutex_t url_lock;
 
+    /* for starting listeners on an MPEG audio or ADTS frame */
+    int frame_check;
+    int frame_synced;
+    unsigned frame_remaining;
+    unsigned frame_misses;
+    int audio_offset;
+
     unsigned build_metadata_len;
     unsigned build_metadata_offset;
     char build_metadata[4081];
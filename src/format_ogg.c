@@ -32,6 +32,7 @@
 
 #include "stats.h"
 #include "playlist.h"
+#include "dumpfile.h"
 #include "format.h"
 #include "format_ogg.h"
 #include "format_vorbis.h"
@@ -61,6 +62,7 @@ static int create_ogg_client_data(source_t *source, client_t *client);
 static void free_ogg_client_data(client_t *client);
 
 static void write_ogg_to_file(struct source_tag *source, refbuf_t *refbuf);
+static refbuf_t *ogg_get_headers(struct source_tag *source, refbuf_t *refbuf);
 static refbuf_t *ogg_get_buffer(source_t *source);
 static int write_buf_to_client(client_t *client);
 
@@ -74,7 +76,12 @@ struct ogg_client
 };
 
 
-refbuf_t *make_refbuf_with_page (ogg_page *page)
+/* size of the buffers the stream is read into and the least room left
+ * for a read before moving on to a new one */
+#define OGG_INPUT_SIZE      16384
+#define OGG_READ_MIN        4096
+
+static refbuf_t *copy_page (ogg_page *page)
 {
     refbuf_t *refbuf = refbuf_new (page->header_len + page->body_len);
 
@@ -83,13 +90,64 @@ refbuf_t *make_refbuf_with_page (ogg_page *page)
     return refbuf;
 }
 
+/* a buffer for the page. Pages straight from the incoming stream share
+ * the input buffer, others such as those rebuilt by a codec are copied */
+refbuf_t *make_refbuf_with_page (ogg_state_t *ogg_info, ogg_page *page)
+{
+    refbuf_t *in = ogg_info->in;
+
+    if (in && (char *)page->header >= in->data &&
+            page->header + page->header_len == page->body &&
+            (char *)page->body + page->body_len <= in->data + ogg_info->in_end)
+        return refbuf_slice (in, (char *)page->header - in->data,
+                page->header_len + page->body_len);
+    return copy_page (page);
+}
+
+
+/* drop the joined copy of the header pages after they change, buffers
+ * already queued keep their reference to it */
+static void release_header_block (ogg_state_t *ogg_info)
+{
+    if (ogg_info->header_block)
+        refbuf_release (ogg_info->header_block);
+    ogg_info->header_block = NULL;
+}
+
+
+/* the header pages as one buffer so listeners get them in one write,
+ * only built again when the pages change */
+static refbuf_t *get_header_block (ogg_state_t *ogg_info)
+{
+    refbuf_t *header;
+    unsigned int len = 0;
+    char *data;
+
+    if (ogg_info->header_block || ogg_info->header_pages == NULL)
+        return ogg_info->header_block;
+
+    for (header = ogg_info->header_pages; header; header = header->next)
+        len += header->len;
+    ogg_info->header_block = refbuf_new (len);
+    data = ogg_info->header_block->data;
+    for (header = ogg_info->header_pages; header; header = header->next)
+    {
+        memcpy (data, header->data, header->len);
+        data += header->len;
+    }
+    return ogg_info->header_block;
+}
+
 
 /* routine for taking the provided page (should be a header page) and
  * placing it on the collection of header pages
  */
 void format_ogg_attach_header (ogg_state_t *ogg_info, ogg_page *page)
 {
-    refbuf_t *refbuf = make_refbuf_with_page (page);
+    /* kept for as long as the stream, so don't hold on to the input */
+    refbuf_t *refbuf = copy_page (page);
+
+    release_header_block (ogg_info);
 
     if (ogg_page_bos (page))
     {
@@ -127,6 +185,7 @@ void format_ogg_free_headers(ogg_state_t *ogg_info)
     ogg_info->header_pages = NULL;
     ogg_info->header_pages_tail = NULL;
     ogg_info->bos_end = &ogg_info->header_pages;
+    release_header_block (ogg_info);
 }
 
 
@@ -169,6 +228,7 @@ int format_ogg_get_plugin(source_t *source)
     plugin->get_buffer = ogg_get_buffer;
     plugin->write_buf_to_client = write_buf_to_client;
     plugin->write_buf_to_file = write_ogg_to_file;
+    plugin->get_headers = ogg_get_headers;
     plugin->create_client_data = create_ogg_client_data;
     plugin->free_plugin = format_ogg_free_plugin;
     plugin->set_tag = NULL;
@@ -176,7 +236,6 @@ int format_ogg_get_plugin(source_t *source)
         httpp_setvar (source->parser, "content-type", "application/ogg");
     plugin->contenttype = httpp_getvar (source->parser, "content-type");
 
-    ogg_sync_init (&state->oy);
     vorbis_comment_init(&plugin->vc);
 
     plugin->_state = state;
@@ -195,7 +254,7 @@ static void format_ogg_free_plugin (format_plugin_t *plugin)
     /* free memory associated with this plugin instance */
     free_ogg_codecs (state);
 
-    ogg_sync_clear (&state->oy);
+    refbuf_release (state->in);
 
     free (state);
 
@@ -347,14 +406,11 @@ static void update_comments(source_t *source)
 static refbuf_t *complete_buffer (source_t *source, refbuf_t *refbuf)
 {
     ogg_state_t *ogg_info = source->format->_state;
-    refbuf_t *header = ogg_info->header_pages;
+    refbuf_t *header = get_header_block (ogg_info);
 
-    while (header)
-    {
+    if (header)
         refbuf_addref (header);
-        header = header->next;
-    }
-    refbuf->associated = ogg_info->header_pages;
+    refbuf->associated = header;
 
     if (ogg_info->log_metadata)
     {
@@ -393,6 +449,91 @@ static refbuf_t *process_ogg_page(ogg_state_t *ogg_info, ogg_page *page, format_
 }
 
 
+/* Look for a complete page at the start of the unread input, skipping
+ * anything up to a capture pattern. Returns 1 with the page pointing into
+ * the input buffer, 0 if more data is needed.
+ */
+static int ogg_input_page (ogg_state_t *ogg_info, ogg_page *page)
+{
+    while (1)
+    {
+        unsigned char *data = (unsigned char *)ogg_info->in->data + ogg_info->in_start;
+        unsigned int avail = ogg_info->in_end - ogg_info->in_start;
+        unsigned int header_len, body_len = 0, i;
+        unsigned char checksum[4];
+
+        if (avail < 27)
+            return 0;
+        if (memcmp (data, "OggS", 4) != 0 || data[4] != 0)
+        {
+            unsigned char *next = memchr (data + 1, 'O', avail - 1);
+
+            ogg_info->in_start = next ? (unsigned int)((char *)next - ogg_info->in->data) : ogg_info->in_end;
+            continue;
+        }
+        header_len = 27 + data[26];
+        if (avail < header_len)
+            return 0;
+        for (i = 27; i < header_len; i++)
+            body_len += data[i];
+        if (avail < header_len + body_len)
+            return 0;
+
+        page->header = data;
+        page->header_len = header_len;
+        page->body = data + header_len;
+        page->body_len = body_len;
+
+        /* recalculating the checksum leaves a good page as it was */
+        memcpy (checksum, data + 22, 4);
+        ogg_page_checksum_set (page);
+        if (memcmp (checksum, data + 22, 4) != 0)
+        {
+            memcpy (data + 22, checksum, 4);
+            ogg_info->in_start++;
+            continue;
+        }
+        ogg_info->in_start += header_len + body_len;
+        return 1;
+    }
+}
+
+/* room to read more of the stream into. The unread data is moved to the
+ * front, or to a new buffer if pages still refer to the current one */
+static char *ogg_input_space (ogg_state_t *ogg_info, unsigned int *space)
+{
+    refbuf_t *in = ogg_info->in;
+    unsigned int pending = ogg_info->in_end - ogg_info->in_start;
+
+    if (in == NULL || in->len - ogg_info->in_end < OGG_READ_MIN)
+    {
+        unsigned int size = OGG_INPUT_SIZE;
+
+        if (pending + OGG_READ_MIN > size)
+            size = pending + OGG_READ_MIN;
+        if (in && refbuf_refcount (in) == 1 && in->len >= size)
+        {
+            memmove (in->data, in->data + ogg_info->in_start, pending);
+        }
+        else
+        {
+            refbuf_t *next = refbuf_new (size);
+
+            if (in)
+            {
+                memcpy (next->data, in->data + ogg_info->in_start, pending);
+                refbuf_release (in);
+            }
+            ogg_info->in = in = next;
+        }
+        ogg_info->in_start = 0;
+        ogg_info->in_end = pending;
+    }
+    *space = in->len - ogg_info->in_end;
+    return in->data + ogg_info->in_end;
+}
+
+
 /* main plugin handler for getting a buffer for the queue. In here we
  * just add an incoming page to the codecs and process it until either
  * more data is needed or we prodice a buffer for the queue.
@@ -402,6 +543,7 @@ static refbuf_t *ogg_get_buffer(source_t *source)
     ogg_state_t *ogg_info = source->format->_state;
     format_plugin_t *format = source->format;
     char *data = NULL;
+    unsigned int space;
     int bytes = 0;
 
     while (1)
@@ -422,7 +564,7 @@ static refbuf_t *ogg_get_buffer(source_t *source)
                 ogg_info->current = NULL;
             }
 
-            if (ogg_sync_pageout (&ogg_info->oy, &page) > 0)
+            if (ogg_info->in && ogg_input_page (ogg_info, &page))
             {
                 if (ogg_page_bos (&page))
                 {
@@ -447,16 +589,13 @@ static refbuf_t *ogg_get_buffer(source_t *source)
             break;
         }
         /* we need more data to continue getting pages */
-        data = ogg_sync_buffer (&ogg_info->oy, 4096);
+        data = ogg_input_space (ogg_info, &space);
 
-        bytes = client_read_bytes (source->client, data, 4096);
+        bytes = client_read_bytes (source->client, data, space);
         if (bytes <= 0)
-        {
-            ogg_sync_wrote (&ogg_info->oy, 0);
             return NULL;
-        }
         format->read_bytes += bytes;
-        ogg_sync_wrote (&ogg_info->oy, bytes);
+        ogg_info->in_end += bytes;
     }
 }
 
@@ -485,7 +624,8 @@ static void free_ogg_client_data (client_t *client)
 
 
 /* send out the header pages. These are for all codecs but are
- * in the order for the stream, ie BOS pages first
+ * in the order for the stream, ie BOS pages first, and normally joined
+ * up in one buffer
  */
 static int send_ogg_headers (client_t *client, refbuf_t *headers)
 {
@@ -545,6 +685,21 @@ static int write_buf_to_client(client_t *client)
                 break;
             written += ret;
         }
+        if (refbuf->next && refbuf->next->associated == refbuf->associated)
+        {
+            /* several pages with the same headers, send them in one go */
+            struct iovec iov[FORMAT_MAX_IOV];
+            int count = format_gather_queue (client, iov, FORMAT_MAX_IOV, FORMAT_MAX_IOV_BYTES, 1);
+
+            ret = client_send_vector (client, iov, count);
+            if (ret > 0)
+            {
+                format_consume_queue (client, ret);
+                written += ret;
+            }
+            ret = 0;
+            break;
+        }
         ret = client_send_bytes (client, buf, len);
 
         if (ret > 0)
@@ -567,10 +722,9 @@ static int write_ogg_data (struct source_tag *source, refbuf_t *refbuf)
 {
     int ret = 1;
 
-    if (fwrite (refbuf->data, 1, refbuf->len, source->dumpfile) != refbuf->len)
+    if (dumpfile_write (source->dumpfile, refbuf) < 0)
     {
-        ICECAST_LOG_WARN("Write to dump file failed, disabling");
-        fclose (source->dumpfile);
+        dumpfile_close (source->dumpfile);
         source->dumpfile = NULL;
         ret = 0;
     }
@@ -578,6 +732,14 @@ static int write_ogg_data (struct source_tag *source, refbuf_t *refbuf)
 }
 
 
+/* the header pages are the associated buffer of each page */
+static refbuf_t *ogg_get_headers (struct source_tag *source, refbuf_t *refbuf)
+{
+    (void)source;
+    return refbuf->associated;
+}
+
+
 static void write_ogg_to_file (struct source_tag *source, refbuf_t *refbuf)
 {
     ogg_state_t *ogg_info = source->format->_state;
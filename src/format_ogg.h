@@ -25,9 +25,12 @@
 typedef struct ogg_state_tag
 {
     char *mount;
-    ogg_sync_state oy;
     int error;
 
+    /* incoming stream data, pages are sliced out of it as they complete */
+    refbuf_t *in;
+    unsigned int in_start, in_end;
+
     int codec_count;
     struct ogg_codec_tag *codecs;
     int log_metadata;
@@ -35,6 +38,9 @@ typedef struct ogg_state_tag
     refbuf_t *header_pages;
     refbuf_t *header_pages_tail;
     refbuf_t **bos_end;
+    /* the header pages joined in one buffer for listeners, NULL when the
+     * pages have changed since */
+    refbuf_t *header_block;
     int bos_completed;
     long bitrate;
     struct ogg_codec_tag *current;
@@ -60,7 +66,7 @@ typedef struct ogg_codec_tag
 } ogg_codec_t;
 
 
-refbuf_t *make_refbuf_with_page (ogg_page *page);
+refbuf_t *make_refbuf_with_page (ogg_state_t *ogg_info, ogg_page *page);
 void format_ogg_attach_header (ogg_state_t *ogg_info, ogg_page *page);
 void format_ogg_free_headers (ogg_state_t *ogg_info);
 int format_ogg_get_plugin (source_t *source);
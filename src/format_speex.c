@@ -56,7 +56,7 @@ static refbuf_t *process_speex_page (ogg_state_t *ogg_info,
         format_ogg_attach_header (ogg_info, page);
         return NULL;
     }
-    refbuf = make_refbuf_with_page (page);
+    refbuf = make_refbuf_with_page (ogg_info, page);
     return refbuf;
 }
 
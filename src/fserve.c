@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -25,9 +26,15 @@
 #ifdef HAVE_POLL
 #include <sys/poll.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
+#include <fcntl.h>
 #ifndef _WIN32
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #define SCN_OFF_T SCNdMAX
@@ -49,10 +56,13 @@
 
 #include "connection.h"
 #include "global.h"
+#include "affinity.h"
+#include "trace.h"
 #include "refbuf.h"
 #include "client.h"
 #include "stats.h"
 #include "format.h"
+#include "sendbatch.h"
 #include "logging.h"
 #include "cfgfile.h"
 #include "util.h"
@@ -65,24 +75,64 @@
 #define CATMODULE "fserve"
 
 #define BUFSIZE 4096
+/* most sent from the file in one go when the kernel does the copying */
+#define SENDFILE_CHUNK 65536
 
 static volatile int __inited = 0;
 
-static fserve_t *active_list = NULL;
-static fserve_t *pending_list = NULL;
-
 static spin_t pending_lock;
 static avl_tree *mimetypes = NULL;
 
-static volatile int run_fserv = 0;
-static unsigned int fserve_clients;
-static int client_tree_changed = 0;
+/* where epoll is available the clients stay registered with it while
+ * active and only those reported writable are looked at */
+#define FSERVE_EVENTS_MAX 128
 
+/* Each file serving thread has its own set of clients, so a slow disk
+ * read only holds up the clients on that thread. New clients go to the
+ * thread with the fewest. The pending lists and load counts are protected
+ * by pending_lock, the rest belongs to the thread.
+ */
+typedef struct fserve_worker_tag {
+    fserve_t *active_list;
+    fserve_t *pending_list;
+    volatile int running;
+    thread_type *thread;    /* joined once it has stopped */
+    unsigned int clients;
+    unsigned int load;      /* active and pending clients */
+    int tree_changed;
+    int poll_fd;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[FSERVE_EVENTS_MAX];
+    int event_count;
+#endif
+    /* writes from memory of the ready clients, submitted together */
+    send_batch_t *batch;
 #ifdef HAVE_POLL
-static struct pollfd *ufds = NULL;
+    struct pollfd *ufds;
 #else
-static fd_set fds;
-static sock_t fd_max = SOCK_ERROR;
+    fd_set fds;
+    sock_t fd_max;
+#endif
+} fserve_worker_t;
+
+static fserve_worker_t *fserve_workers;
+static unsigned int fserve_worker_count;
+static unsigned int fserve_next_worker;
+static int fserve_stopping;
+
+#ifdef HAVE_PREADV2
+/* Reads that would wait on the disk are done by their own threads so the
+ * file serving threads only ever send. A client whose next chunk is not
+ * in memory is taken off its thread, read for here and handed back.
+ */
+static pthread_mutex_t fserve_read_lock;
+static pthread_cond_t fserve_read_cond;
+static fserve_t *fserve_read_list, **fserve_read_tail = &fserve_read_list;
+static int fserve_read_running;
+static thread_type **fserve_readers;
+static unsigned int fserve_reader_count;
+
+static void *fserve_reader_function(void *arg);
 #endif
 
 typedef struct {
@@ -93,15 +143,344 @@ typedef struct {
 static void fserve_client_destroy(fserve_t *fclient);
 static int _delete_mapping(void *mapping);
 static void *fserv_thread_function(void *arg);
+static int fserve_add_file_client (client_t *client, fserve_file_t *file, off_t offset);
+
+/* Recently served files are kept open along with their details, so hot
+ * files are not looked up and opened again for each request. An entry is
+ * checked against the file at most once a second and dropped when the
+ * file has changed, or when the cache is full, least recently used first.
+ * The file stays open until the last client sending it is done with it.
+ */
+#define FSERVE_CACHE_CHECK  1
+/* cached files up to this size are also held in memory, shared by all the
+ * clients they are sent to */
+#define FSERVE_CACHE_SMALL  65536
+
+struct fserve_file_tag {
+    char *path;
+    int fd;
+    struct stat st;
+    char *type;
+    refbuf_t *content;
+    /* which of fserve_encodings have a precompressed copy alongside */
+    unsigned int encodings;
+    time_t checked;
+    /* these are protected by fserve_cache_lock */
+    unsigned int refcount;
+    int cached;
+    struct fserve_file_tag *lru_next, *lru_prev;
+};
+
+/* precompressed copies looked for next to a file, in order of preference */
+static const struct {
+    const char *coding;
+    const char *ext;
+} fserve_encodings[] = {
+    { "br",     "br" },
+    { "gzip",   "gz" }
+};
+#define FSERVE_ENCODINGS (sizeof(fserve_encodings) / sizeof(fserve_encodings[0]))
+
+static mutex_t fserve_cache_lock;
+static avl_tree *fserve_cache;
+static fserve_file_t *fserve_cache_head, *fserve_cache_tail;
+static unsigned int fserve_cache_count, fserve_cache_max;
+
+static int _compare_files(void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp(((fserve_file_t *)a)->path, ((fserve_file_t *)b)->path);
+}
+
+static void fserve_file_free(fserve_file_t *file)
+{
+    close(file->fd);
+    refbuf_release(file->content);
+    free(file->path);
+    free(file->type);
+    free(file);
+}
+
+/* drop the cached reference, returns the references left. Call with the
+ * cache lock held */
+static unsigned int fserve_cache_unlink(fserve_file_t *file)
+{
+    if (file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        fserve_cache_head = file->lru_next;
+    if (file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        fserve_cache_tail = file->lru_prev;
+    file->lru_next = file->lru_prev = NULL;
+    avl_delete(fserve_cache, file, NULL);
+    file->cached = 0;
+    fserve_cache_count--;
+    return --file->refcount;
+}
+
+/* move to the front of the lru list, call with the cache lock held */
+static void fserve_cache_touch(fserve_file_t *file)
+{
+    if (fserve_cache_head == file)
+        return;
+    if (file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    if (file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else if (fserve_cache_tail == file)
+        fserve_cache_tail = file->lru_prev;
+    file->lru_prev = NULL;
+    file->lru_next = fserve_cache_head;
+    if (fserve_cache_head)
+        fserve_cache_head->lru_prev = file;
+    fserve_cache_head = file;
+    if (fserve_cache_tail == NULL)
+        fserve_cache_tail = file;
+}
+
+static void fserve_file_release(fserve_file_t *file)
+{
+    unsigned int refcount;
+
+    thread_mutex_lock(&fserve_cache_lock);
+    refcount = --file->refcount;
+    thread_mutex_unlock(&fserve_cache_lock);
+    if (refcount == 0)
+        fserve_file_free(file);
+}
+
+/* empty the cache, files still being sent stay open until they finish */
+static void fserve_cache_flush(void)
+{
+    fserve_file_t *gone = NULL;
+
+    thread_mutex_lock(&fserve_cache_lock);
+    while (fserve_cache_head) {
+        fserve_file_t *file = fserve_cache_head;
+
+        if (fserve_cache_unlink(file) == 0) {
+            file->lru_next = gone;
+            gone = file;
+        }
+    }
+    thread_mutex_unlock(&fserve_cache_lock);
+    while (gone) {
+        fserve_file_t *file = gone;
+
+        gone = file->lru_next;
+        fserve_file_free(file);
+    }
+}
+
+/* a referenced cache entry for the file if there is one still matching it */
+static fserve_file_t *fserve_file_get(const char *path)
+{
+    fserve_file_t key, *file = NULL;
+    void *result;
+    time_t now;
+
+    if (fserve_cache_max == 0)
+        return NULL;
+
+    key.path = (char *)path;
+    thread_mutex_lock(&fserve_cache_lock);
+    if (avl_get_by_key(fserve_cache, &key, &result) == 0) {
+        file = result;
+        file->refcount++;
+        fserve_cache_touch(file);
+    }
+    thread_mutex_unlock(&fserve_cache_lock);
+
+    now = time(NULL);
+    if (file && now - file->checked >= FSERVE_CACHE_CHECK) {
+        struct stat st;
+
+        if (stat(path, &st) != 0 || st.st_mtime != file->st.st_mtime ||
+                st.st_size != file->st.st_size || st.st_ino != file->st.st_ino) {
+            thread_mutex_lock(&fserve_cache_lock);
+            if (file->cached)
+                fserve_cache_unlink(file);
+            thread_mutex_unlock(&fserve_cache_lock);
+            fserve_file_release(file);
+            file = NULL;
+        } else {
+            file->checked = now;
+        }
+    }
+    stats_event_inc(NULL, file ? "file_cache_hits" : "file_cache_misses");
+    return file;
+}
+
+/* does the Accept-Encoding header allow the coding */
+static int fserve_accepts_encoding(const char *header, const char *coding)
+{
+    size_t len = strlen(coding);
+
+    while (header && *header) {
+        while (*header == ' ' || *header == '\t' || *header == ',')
+            header++;
+        if (strncasecmp(header, coding, len) == 0 &&
+                (header[len] == 0 || header[len] == ',' || header[len] == ';' || header[len] == ' ')) {
+            const char *q = header + len;
+
+            while (*q == ' ')
+                q++;
+            /* anything but an explicit q=0 will do */
+            if (*q == ';') {
+                q = strchr(q, '=');
+                if (q && strtod(q + 1, NULL) == 0.0)
+                    return 0;
+            }
+            return 1;
+        }
+        header = strchr(header, ',');
+    }
+    return 0;
+}
+
+/* open a regular file and add it to the cache, a reference is returned */
+static fserve_file_t *fserve_file_open(const char *path)
+{
+    fserve_file_t *file, *gone = NULL;
+    void *result;
+
+    file = calloc(1, sizeof(fserve_file_t));
+    if (file == NULL)
+        return NULL;
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0) {
+        free(file);
+        return NULL;
+    }
+    if (fstat(file->fd, &file->st) != 0 || S_ISREG(file->st.st_mode) == 0) {
+        close(file->fd);
+        free(file);
+        return NULL;
+    }
+#ifdef HAVE_POSIX_FADVISE
+    /* files are read from start to end so get the kernel reading ahead,
+     * this keeps the file serving threads off the disk mostly */
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    file->path = strdup(path);
+    file->type = fserve_content_type(path);
+    if (fserve_cache_max) {
+        const char *ext = util_get_extension(path);
+        int is_copy = 0;
+        size_t i;
+
+        for (i = 0; i < FSERVE_ENCODINGS; i++)
+            if (strcmp(ext, fserve_encodings[i].ext) == 0)
+                is_copy = 1;
+        /* look for precompressed copies at least as new as the file, but
+         * not for those of a copy */
+        for (i = 0; i < FSERVE_ENCODINGS && !is_copy; i++) {
+            char sibling[PATH_MAX];
+            struct stat st;
+
+            if (snprintf(sibling, sizeof(sibling), "%s.%s", path, fserve_encodings[i].ext) < (int)sizeof(sibling) &&
+                    stat(sibling, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= file->st.st_mtime)
+                file->encodings |= 1U << i;
+        }
+    }
+    file->checked = time(NULL);
+    file->refcount = 1;
+
+    if (fserve_cache_max == 0)
+        return file;
+
+    if (file->st.st_size > 0 && file->st.st_size <= FSERVE_CACHE_SMALL) {
+        file->content = refbuf_new((unsigned int)file->st.st_size);
+        if (pread(file->fd, file->content->data, file->content->len, 0) != (ssize_t)file->content->len) {
+            refbuf_release(file->content);
+            file->content = NULL;
+        }
+    }
+
+    thread_mutex_lock(&fserve_cache_lock);
+    /* replace any entry someone else has just added */
+    if (avl_get_by_key(fserve_cache, file, &result) == 0) {
+        fserve_file_t *old = result;
+
+        if (fserve_cache_unlink(old) == 0) {
+            old->lru_next = gone;
+            gone = old;
+        }
+    }
+    avl_insert(fserve_cache, file);
+    file->refcount++;
+    file->cached = 1;
+    fserve_cache_count++;
+    fserve_cache_touch(file);
+    while (fserve_cache_count > fserve_cache_max && fserve_cache_tail) {
+        fserve_file_t *old = fserve_cache_tail;
+
+        if (fserve_cache_unlink(old) == 0) {
+            old->lru_next = gone;
+            gone = old;
+        }
+    }
+    thread_mutex_unlock(&fserve_cache_lock);
+
+    while (gone) {
+        fserve_file_t *old = gone;
+
+        gone = old->lru_next;
+        fserve_file_free(old);
+    }
+    return file;
+}
 
 void fserve_initialize(void)
 {
     ice_config_t *config = config_get_config();
+    unsigned int i;
 
     mimetypes = NULL;
-    active_list = NULL;
-    pending_list = NULL;
     thread_spin_create (&pending_lock);
+    thread_mutex_create (&fserve_cache_lock);
+    fserve_cache = avl_tree_new(_compare_files, NULL);
+    fserve_cache_max = config->fileserve_cache > 0 ? config->fileserve_cache : 0;
+
+    fserve_worker_count = config->fileserve_threads > 0 ? config->fileserve_threads : 1;
+    fserve_workers = calloc (fserve_worker_count, sizeof (fserve_worker_t));
+    if (fserve_workers == NULL)
+        abort();
+    for (i = 0; i < fserve_worker_count; i++)
+    {
+        fserve_worker_t *worker = &fserve_workers[i];
+
+        worker->poll_fd = -1;
+#ifdef HAVE_SYS_EPOLL_H
+        worker->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->poll_fd < 0)
+            ICECAST_LOG_WARN("Unable to create epoll set, polling file serving clients");
+#endif
+#ifndef HAVE_POLL
+        worker->fd_max = SOCK_ERROR;
+#endif
+        if (config->fileserve_io_uring)
+            worker->batch = send_batch_new ();
+    }
+
+    fserve_stopping = 0;
+#ifdef HAVE_PREADV2
+    pthread_mutex_init(&fserve_read_lock, NULL);
+    pthread_cond_init(&fserve_read_cond, NULL);
+    fserve_read_running = 1;
+    fserve_readers = calloc(fserve_worker_count, sizeof(thread_type *));
+    for (i = 0; fserve_readers && i < fserve_worker_count; i++)
+    {
+        fserve_readers[fserve_reader_count] = thread_create("File Reading Thread",
+                fserve_reader_function, NULL, THREAD_ATTACHED);
+        if (fserve_readers[fserve_reader_count])
+            fserve_reader_count++;
+    }
+    if (fserve_reader_count == 0)
+        ICECAST_LOG_WARN("No file reading threads, files are read while serving");
+#endif
 
     fserve_recheck_mime_types (config);
     config_release_config();
@@ -109,74 +488,157 @@ void fserve_initialize(void)
     __inited = 1;
 
     stats_event (NULL, "file_connections", "0");
-    ICECAST_LOG_INFO("file serving started");
+    ICECAST_LOG_INFO("file serving started, %u thread%s", fserve_worker_count,
+            fserve_worker_count == 1 ? "" : "s");
 }
 
 void fserve_shutdown(void)
 {
+    unsigned int i;
+
     if (!__inited)
         return;
 
+    /* the threads use the workers until they have gone, so stop them all
+     * before anything is freed. Clients handed back meanwhile are left on
+     * the pending lists */
     thread_spin_lock (&pending_lock);
-    run_fserv = 0;
-    while (pending_list)
+    fserve_stopping = 1;
+    for (i = 0; i < fserve_worker_count; i++)
+        fserve_workers[i].running = 0;
+    thread_spin_unlock (&pending_lock);
+    for (i = 0; i < fserve_worker_count; i++)
     {
-        fserve_t *to_go = (fserve_t *)pending_list;
-        pending_list = to_go->next;
-
-        fserve_client_destroy (to_go);
+        if (fserve_workers[i].thread)
+            thread_join (fserve_workers[i].thread);
+        fserve_workers[i].thread = NULL;
     }
-    while (active_list)
+#ifdef HAVE_PREADV2
+    pthread_mutex_lock (&fserve_read_lock);
+    fserve_read_running = 0;
+    pthread_cond_broadcast (&fserve_read_cond);
+    pthread_mutex_unlock (&fserve_read_lock);
+    for (i = 0; i < fserve_reader_count; i++)
+        thread_join (fserve_readers[i]);
+    free (fserve_readers);
+    fserve_readers = NULL;
+    fserve_reader_count = 0;
+    while (fserve_read_list)
     {
-        fserve_t *to_go = active_list;
-        active_list = to_go->next;
+        fserve_t *to_go = fserve_read_list;
+        fserve_read_list = to_go->next;
         fserve_client_destroy (to_go);
     }
+    fserve_read_tail = &fserve_read_list;
+    pthread_cond_destroy (&fserve_read_cond);
+    pthread_mutex_destroy (&fserve_read_lock);
+#endif
+
+    thread_spin_lock (&pending_lock);
+    for (i = 0; i < fserve_worker_count; i++)
+    {
+        fserve_worker_t *worker = &fserve_workers[i];
+
+        while (worker->pending_list)
+        {
+            fserve_t *to_go = worker->pending_list;
+            worker->pending_list = to_go->next;
+
+            fserve_client_destroy (to_go);
+        }
+        while (worker->active_list)
+        {
+            fserve_t *to_go = worker->active_list;
+            worker->active_list = to_go->next;
+            fserve_client_destroy (to_go);
+        }
+#ifdef HAVE_SYS_EPOLL_H
+        if (worker->poll_fd >= 0)
+            close(worker->poll_fd);
+#endif
+#ifdef HAVE_POLL
+        free (worker->ufds);
+#endif
+        send_batch_free (worker->batch);
+    }
+    free (fserve_workers);
+    fserve_workers = NULL;
+    fserve_worker_count = 0;
 
     if (mimetypes)
         avl_tree_free (mimetypes, _delete_mapping);
 
     thread_spin_unlock (&pending_lock);
     thread_spin_destroy (&pending_lock);
+
+    fserve_cache_flush();
+    avl_tree_free (fserve_cache, NULL);
+    fserve_cache = NULL;
+    thread_mutex_destroy (&fserve_cache_lock);
     ICECAST_LOG_INFO("file serving stopped");
 }
 
+/* the thread has nothing left to do, let it go unless a client has just
+ * been handed to it */
+static int fserve_worker_idle (fserve_worker_t *worker)
+{
+    int ret = -1;
+
+    thread_spin_lock (&pending_lock);
+    if (worker->pending_list)
+        ret = 0;
+    else
+        worker->running = 0;
+    thread_spin_unlock (&pending_lock);
+    return ret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* wait on the registered clients, the ready ones are left in the events */
+static int fserve_client_waiting_epoll (fserve_worker_t *worker)
+{
+    if (worker->clients == 0)
+        return fserve_worker_idle (worker);
+    worker->event_count = epoll_wait(worker->poll_fd, worker->events, FSERVE_EVENTS_MAX, 200);
+    if (worker->event_count < 0)
+        worker->event_count = 0;
+    return worker->event_count > 0;
+}
+#endif
+
 #ifdef HAVE_POLL
-int fserve_client_waiting (void)
+static int fserve_client_waiting (fserve_worker_t *worker)
 {
     fserve_t *fclient;
     unsigned int i = 0;
 
     /* only rebuild ufds if there are clients added/removed */
-    if (client_tree_changed) {
-        struct pollfd *ufds_new = realloc(ufds, fserve_clients * sizeof(struct pollfd));
+    if (worker->tree_changed) {
+        struct pollfd *ufds_new = realloc(worker->ufds, worker->clients * sizeof(struct pollfd));
         /* REVIEW: If we can not allocate new ufds, keep old ones for now. */
-        if (ufds_new || fserve_clients == 0) {
-            ufds = ufds_new;
-            client_tree_changed = 0;
-            fclient = active_list;
+        if (ufds_new || worker->clients == 0) {
+            worker->ufds = ufds_new;
+            worker->tree_changed = 0;
+            fclient = worker->active_list;
             while (fclient)
             {
-                ufds[i].fd = fclient->client->con->sock;
-                ufds[i].events = POLLOUT;
-                ufds[i].revents = 0;
+                worker->ufds[i].fd = fclient->client->con->sock;
+                worker->ufds[i].events = POLLOUT;
+                worker->ufds[i].revents = 0;
                 fclient = fclient->next;
                 i++;
             }
         }
     }
 
-    if (!ufds) {
-        thread_spin_lock (&pending_lock);
-        run_fserv = 0;
-        thread_spin_unlock (&pending_lock);
-        return -1;
-    } else if (poll(ufds, fserve_clients, 200) > 0) {
+    if (!worker->ufds) {
+        return fserve_worker_idle (worker);
+    } else if (poll(worker->ufds, worker->clients, 200) > 0) {
         /* mark any clients that are ready */
-        fclient = active_list;
-        for (i=0; i<fserve_clients; i++)
+        fclient = worker->active_list;
+        for (i=0; i<worker->clients; i++)
         {
-            if (ufds[i].revents & (POLLOUT|POLLHUP|POLLERR))
+            if (worker->ufds[i].revents & (POLLOUT|POLLHUP|POLLERR))
             fclient->ready = 1;
             fclient = fclient->next;
         }
@@ -186,31 +648,28 @@ int fserve_client_waiting (void)
     return 0;
 }
 #else
-int fserve_client_waiting(void)
+static int fserve_client_waiting (fserve_worker_t *worker)
 {
     fserve_t *fclient;
     fd_set realfds;
 
     /* only rebuild fds if there are clients added/removed */
-    if (client_tree_changed) {
-        client_tree_changed = 0;
-        FD_ZERO(&fds);
-        fd_max = SOCK_ERROR;
-        fclient = active_list;
+    if (worker->tree_changed) {
+        worker->tree_changed = 0;
+        FD_ZERO(&worker->fds);
+        worker->fd_max = SOCK_ERROR;
+        fclient = worker->active_list;
         while (fclient) {
-            FD_SET(fclient->client->con->sock, &fds);
-            if (fclient->client->con->sock > fd_max || fd_max == SOCK_ERROR)
-                fd_max = fclient->client->con->sock;
+            FD_SET(fclient->client->con->sock, &worker->fds);
+            if (fclient->client->con->sock > worker->fd_max || worker->fd_max == SOCK_ERROR)
+                worker->fd_max = fclient->client->con->sock;
             fclient = fclient->next;
         }
     }
     /* hack for windows, select needs at least 1 descriptor */
-    if (fd_max == SOCK_ERROR)
+    if (worker->fd_max == SOCK_ERROR)
     {
-        thread_spin_lock (&pending_lock);
-        run_fserv = 0;
-        thread_spin_unlock (&pending_lock);
-        return -1;
+        return fserve_worker_idle (worker);
     }
     else
     {
@@ -219,11 +678,11 @@ int fserve_client_waiting(void)
         tv.tv_usec = 200000;
         /* make a duplicate of the set so we do not have to rebuild it
          * each time around */
-        memcpy(&realfds, &fds, sizeof(fd_set));
-        if(select(fd_max+1, NULL, &realfds, NULL, &tv) > 0)
+        memcpy(&realfds, &worker->fds, sizeof(fd_set));
+        if(select(worker->fd_max+1, NULL, &realfds, NULL, &tv) > 0)
         {
             /* mark any clients that are ready */
-            fclient = active_list;
+            fclient = worker->active_list;
             while (fclient)
             {
                 if (FD_ISSET (fclient->client->con->sock, &realfds))
@@ -237,113 +696,414 @@ int fserve_client_waiting(void)
 }
 #endif
 
-static int wait_for_fds(void)
+static int wait_for_fds(fserve_worker_t *worker)
 {
-    fserve_t *fclient;
+    fserve_t *fclient, *failed = NULL;
     int ret;
 
-    while (run_fserv)
+    while (worker->running)
     {
         /* add any new clients here */
-        if (pending_list)
+        if (worker->pending_list)
         {
             thread_spin_lock (&pending_lock);
 
-            fclient = (fserve_t*)pending_list;
+            fclient = worker->pending_list;
             while (fclient)
             {
                 fserve_t *to_move = fclient;
                 fclient = fclient->next;
-                to_move->next = active_list;
-                active_list = to_move;
-                client_tree_changed = 1;
-                fserve_clients++;
+#ifdef HAVE_SYS_EPOLL_H
+                if (worker->poll_fd >= 0) {
+                    struct epoll_event event;
+
+                    memset(&event, 0, sizeof(event));
+                    event.events = EPOLLOUT;
+                    event.data.ptr = to_move;
+                    if (epoll_ctl(worker->poll_fd, EPOLL_CTL_ADD, to_move->client->con->sock, &event) < 0) {
+                        ICECAST_LOG_WARN("Unable to wait on file serving client, dropping");
+                        worker->load--;
+                        to_move->next = failed;
+                        failed = to_move;
+                        continue;
+                    }
+                }
+#endif
+                to_move->next = worker->active_list;
+                to_move->prev = &worker->active_list;
+                if (worker->active_list)
+                    worker->active_list->prev = &to_move->next;
+                worker->active_list = to_move;
+                worker->tree_changed = 1;
+                worker->clients++;
             }
-            pending_list = NULL;
+            worker->pending_list = NULL;
             thread_spin_unlock(&pending_lock);
+            while (failed)
+            {
+                fserve_t *to_go = failed;
+                failed = to_go->next;
+                fserve_client_destroy (to_go);
+            }
         }
         /* drop out of here if someone is ready */
-        ret = fserve_client_waiting();
+#ifdef HAVE_SYS_EPOLL_H
+        if (worker->poll_fd >= 0)
+            ret = fserve_client_waiting_epoll (worker);
+        else
+#endif
+        ret = fserve_client_waiting (worker);
         if (ret)
             return ret;
     }
     return -1;
 }
 
-static void *fserv_thread_function(void *arg)
+/* take a client off the active list and finish with it */
+static void fserve_remove_active(fserve_worker_t *worker, fserve_t *fclient)
+{
+    if (fclient->next)
+        fclient->next->prev = fclient->prev;
+    *fclient->prev = fclient->next;
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->poll_fd >= 0)
+        epoll_ctl(worker->poll_fd, EPOLL_CTL_DEL, fclient->client->con->sock, NULL);
+#endif
+    worker->clients--;
+    worker->tree_changed = 1;
+    thread_spin_lock (&pending_lock);
+    worker->load--;
+    thread_spin_unlock (&pending_lock);
+    fserve_client_destroy (fclient);
+}
+
+#ifdef HAVE_PREADV2
+/* read only what is already in memory, -2 if the disk would be waited on */
+static ssize_t fserve_pread_nowait(int fd, void *buf, size_t len, off_t offset)
+{
+    struct iovec iov;
+    ssize_t got;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    got = preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+    if (got < 0 && errno == EAGAIN)
+        return -2;
+    if (got < 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+        return pread(fd, buf, len, offset);
+    return got;
+}
+
+/* would sending the next chunk from the kernel wait on the disk, the
+ * first and last pages of it are checked */
+static int fserve_sendfile_would_block(fserve_t *fclient)
+{
+    char probe;
+
+    if (fserve_reader_count == 0)
+        return 0;
+    if (fserve_pread_nowait(fclient->cached->fd, &probe, 1, fclient->offset) == -2 ||
+            fserve_pread_nowait(fclient->cached->fd, &probe, 1, fclient->offset + SENDFILE_CHUNK - 1) == -2)
+        return 1;
+    return 0;
+}
+
+/* take a client off the active list and have the next chunk read for it,
+ * it remains part of the load of the worker it comes back to */
+static void fserve_park_active(fserve_worker_t *worker, fserve_t *fclient)
+{
+    if (fclient->next)
+        fclient->next->prev = fclient->prev;
+    *fclient->prev = fclient->next;
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->poll_fd >= 0)
+        epoll_ctl(worker->poll_fd, EPOLL_CTL_DEL, fclient->client->con->sock, NULL);
+#endif
+    worker->clients--;
+    worker->tree_changed = 1;
+    fclient->worker = worker;
+    fclient->next = NULL;
+    pthread_mutex_lock (&fserve_read_lock);
+    *fserve_read_tail = fclient;
+    fserve_read_tail = &fclient->next;
+    pthread_cond_signal (&fserve_read_cond);
+    pthread_mutex_unlock (&fserve_read_lock);
+}
+#endif
+
+/* finish with a client that fserve_client_send has returned */
+static void fserve_client_sent(fserve_worker_t *worker, fserve_t *fclient, int ret)
+{
+    if (ret < 0)
+        fserve_remove_active (worker, fclient);
+#ifdef HAVE_PREADV2
+    else if (ret > 0)
+        fserve_park_active (worker, fclient);
+#endif
+}
+
+/* send what can be sent to a client that is ready, returns -1 once it is
+ * done with, either finished or failed, 1 if the file has to be read first
+ * without holding up the other clients */
+static int fserve_client_send(fserve_t *fclient)
 {
-    fserve_t *fclient, **trail;
+    client_t *client = fclient->client;
+    refbuf_t *refbuf = client->refbuf;
     size_t bytes;
+    int sent;
 
-    (void)arg;
+    if (client->pos == refbuf->len)
+    {
+        /* Grab a new chunk */
+        bytes = 0;
+        if (fclient->cached)
+        {
+            ssize_t got;
 
+            /* once the headers are out, plain connections are sent the
+             * file contents without reading them in here */
+            if (refbuf->next == NULL && connection_can_sendfile(client->con))
+            {
+#ifdef HAVE_PREADV2
+                if (fserve_sendfile_would_block (fclient))
+                    return 1;
+#endif
+                if (connection_sendfile(client->con, fclient->cached->fd,
+                            &fclient->offset, SENDFILE_CHUNK) == 0 || client->con->error)
+                    return -1;
+                return 0;
+            }
+#ifdef HAVE_PREADV2
+            if (fserve_reader_count)
+            {
+                got = fserve_pread_nowait (fclient->cached->fd, refbuf->data, BUFSIZE, fclient->offset);
+                if (got == -2)
+                    return 1;
+            }
+            else
+#endif
+            got = pread (fclient->cached->fd, refbuf->data, BUFSIZE, fclient->offset);
+            if (got > 0)
+            {
+                bytes = got;
+                fclient->offset += got;
+            }
+        }
+        else if (fclient->file)
+            bytes = fread (refbuf->data, 1, BUFSIZE, fclient->file);
+        if (bytes == 0)
+        {
+            if (refbuf->next == NULL)
+                return -1;
+            /* the next one may be shared, so leave it as it is */
+            refbuf = refbuf->next;
+            client->refbuf->next = NULL;
+            refbuf_release (client->refbuf);
+            client->refbuf = refbuf;
+        }
+        else
+            refbuf->len = (unsigned int)bytes;
+        client->pos = 0;
+    }
+
+    /* Now try and send current chunk. */
+    sent = format_generic_write_to_client (client);
+    if (sent > 0)
+        ICECAST_TRACE2 (fserve_send, client->con->id, sent);
+
+    if (client->con->error)
+        return -1;
+    return 0;
+}
+
+/* queue the write of what is left of the buffer onto the batch, only for
+ * data already in memory going out over a plain or kernel TLS socket.
+ * Returns 0 if queued, -1 if fserve_client_send is to deal with it */
+static int fserve_batch_add(fserve_worker_t *worker, fserve_t *fclient)
+{
+    client_t *client = fclient->client;
+    refbuf_t *refbuf = client->refbuf;
+    send_batch_entry_t *entry;
+
+    if (worker->batch == NULL || client->pos >= refbuf->len || client->con->error)
+        return -1;
+#ifdef HAVE_OPENSSL
+    if (client->con->ssl && client->con->ktls == 0)
+        return -1;
+#endif
+    entry = send_batch_add (worker->batch, client, 1);
+    if (entry == NULL)
+        return -1;
+    entry->iov[0].iov_base = refbuf->data + client->pos;
+    entry->iov[0].iov_len = refbuf->len - client->pos;
+    return 0;
+}
+
+/* submit the batched writes and apply the results, the clients are handled
+ * again when their sockets are next writable */
+static void fserve_batch_complete(fserve_worker_t *worker)
+{
+    unsigned int i, count;
+
+    if (worker->batch == NULL)
+        return;
+    count = send_batch_submit (worker->batch);
+    for (i = 0; i < count; i++)
+    {
+        send_batch_entry_t *entry = send_batch_entry (worker->batch, i);
+        client_t *client = entry->client;
+
+        if (entry->result > 0)
+        {
+            ICECAST_TRACE2 (fserve_send, client->con->id, entry->result);
+            client->con->sent_bytes += entry->result;
+            client->pos += entry->result;
+        }
+        else if (entry->result != -EAGAIN && entry->result != -EINTR)
+        {
+            client->con->error = 1;
+            ICECAST_LOG_DEBUG("Client connection died");
+        }
+    }
+    send_batch_reset (worker->batch);
+}
+
+static void *fserv_thread_function(void *arg)
+{
+    fserve_worker_t *worker = arg;
+    fserve_t *fclient;
+    uint64_t loop_start;
+
+    affinity_apply(AFFINITY_FILESERVE);
     while (1)
     {
-        if (wait_for_fds() < 0)
+        if (wait_for_fds(worker) < 0)
             break;
 
-        fclient = active_list;
-        trail = &active_list;
+        loop_start = stats_time_us();
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (worker->poll_fd >= 0)
+        {
+            int i;
 
+            for (i = 0; i < worker->event_count; i++)
+            {
+                fclient = worker->events[i].data.ptr;
+                if (fserve_batch_add (worker, fclient) == 0)
+                    continue;
+                fserve_client_sent (worker, fclient, fserve_client_send (fclient));
+            }
+            worker->event_count = 0;
+            fserve_batch_complete (worker);
+            stats_histogram_record_global (STATS_HISTOGRAM_FSERVE_LOOP,
+                    stats_time_us() - loop_start);
+            continue;
+        }
+#endif
+        fclient = worker->active_list;
         while (fclient)
         {
+            fserve_t *next = fclient->next;
+
             /* process this client, if it is ready */
             if (fclient->ready)
             {
-                client_t *client = fclient->client;
-                refbuf_t *refbuf = client->refbuf;
                 fclient->ready = 0;
-                if (client->pos == refbuf->len)
-                {
-                    /* Grab a new chunk */
-                    if (fclient->file)
-                        bytes = fread (refbuf->data, 1, BUFSIZE, fclient->file);
-                    else
-                        bytes = 0;
-                    if (bytes == 0)
-                    {
-                        if (refbuf->next == NULL)
-                        {
-                            fserve_t *to_go = fclient;
-                            fclient = fclient->next;
-                            *trail = fclient;
-                            fserve_client_destroy (to_go);
-                            fserve_clients--;
-                            client_tree_changed = 1;
-                            continue;
-                        }
-                        refbuf = refbuf->next;
-                        client->refbuf->next = NULL;
-                        refbuf_release (client->refbuf);
-                        client->refbuf = refbuf;
-                        bytes = refbuf->len;
-                    }
-                    refbuf->len = (unsigned int)bytes;
-                    client->pos = 0;
-                }
-
-                /* Now try and send current chunk. */
-                format_generic_write_to_client (client);
-
-                if (client->con->error)
-                {
-                    fserve_t *to_go = fclient;
-                    fclient = fclient->next;
-                    *trail = fclient;
-                    fserve_clients--;
-                    fserve_client_destroy (to_go);
-                    client_tree_changed = 1;
-                    continue;
-                }
+                fserve_client_sent (worker, fclient, fserve_client_send (fclient));
             }
-            trail = &fclient->next;
-            fclient = fclient->next;
+            fclient = next;
         }
+        stats_histogram_record_global (STATS_HISTOGRAM_FSERVE_LOOP,
+                stats_time_us() - loop_start);
     }
     ICECAST_LOG_DEBUG("fserve handler exit");
     return NULL;
 }
 
+
+/* put a client on a worker, under pending_lock, starting the thread if it
+ * has stopped. A thread that has finished is returned for joining once the
+ * lock is dropped */
+static thread_type *fserve_worker_queue (fserve_worker_t *worker, fserve_t *fclient)
+{
+    thread_type *finished = NULL;
+
+    fclient->next = worker->pending_list;
+    worker->pending_list = fclient;
+    if (worker->running == 0 && fserve_stopping == 0)
+    {
+        finished = worker->thread;
+        worker->running = 1;
+        ICECAST_LOG_DEBUG("fserve handler waking up");
+        worker->thread = thread_create("File Serving Thread", fserv_thread_function, worker, THREAD_ATTACHED);
+    }
+    return finished;
+}
+
+
+#ifdef HAVE_PREADV2
+/* the blocking read for a parked client, for sendfile the chunk is only
+ * brought into memory */
+static void fserve_read_blocking (fserve_t *fclient, char *scratch)
+{
+    client_t *client = fclient->client;
+    refbuf_t *refbuf = client->refbuf;
+    ssize_t got;
+
+    if (refbuf->next == NULL && connection_can_sendfile(client->con))
+    {
+        if (scratch && pread (fclient->cached->fd, scratch, SENDFILE_CHUNK, fclient->offset) < 0)
+            ICECAST_LOG_DEBUG("read ahead failed on %s", fclient->cached->path);
+        return;
+    }
+    got = pread (fclient->cached->fd, refbuf->data, BUFSIZE, fclient->offset);
+    if (got > 0)
+    {
+        refbuf->len = (unsigned int)got;
+        fclient->offset += got;
+        client->pos = 0;
+    }
+}
+
+static void *fserve_reader_function(void *arg)
+{
+    char *scratch = malloc (SENDFILE_CHUNK);
+
+    (void)arg;
+    pthread_mutex_lock (&fserve_read_lock);
+    while (1)
+    {
+        fserve_t *fclient;
+        thread_type *finished;
+
+        if (fserve_read_running && fserve_read_list == NULL)
+            config_drop_pin ();
+        while (fserve_read_running && fserve_read_list == NULL)
+            pthread_cond_wait (&fserve_read_cond, &fserve_read_lock);
+        if (fserve_read_running == 0)
+            break;
+        fclient = fserve_read_list;
+        fserve_read_list = fclient->next;
+        if (fserve_read_list == NULL)
+            fserve_read_tail = &fserve_read_list;
+        pthread_mutex_unlock (&fserve_read_lock);
+
+        fserve_read_blocking (fclient, scratch);
+
+        thread_spin_lock (&pending_lock);
+        finished = fserve_worker_queue (fclient->worker, fclient);
+        thread_spin_unlock (&pending_lock);
+        if (finished)
+            thread_join (finished);
+        pthread_mutex_lock (&fserve_read_lock);
+    }
+    pthread_mutex_unlock (&fserve_read_lock);
+    free (scratch);
+    return NULL;
+}
+#endif
+
 /* string returned needs to be free'd */
 char *fserve_content_type(const char *path)
 {
@@ -391,6 +1151,8 @@ static void fserve_client_destroy(fserve_t *fclient)
     {
         if (fclient->file)
             fclose (fclient->file);
+        if (fclient->cached)
+            fserve_file_release (fclient->cached);
 
         if (fclient->callback)
             fclient->callback (fclient->client, fclient->arg);
@@ -419,7 +1181,9 @@ int fserve_client_create (client_t *httpclient, const char *path)
     const char * xslt_playlist_requested = NULL;
     int xslt_playlist_file_available = 1;
     ice_config_t *config;
-    FILE *file;
+    fserve_file_t *file, *encoded = NULL;
+    const char *encoding = NULL;
+    char extra[80];
 
     fullpath = util_get_path_from_normalised_uri (path);
     ICECAST_LOG_INFO("checking for file %H (%H)", path, fullpath);
@@ -433,8 +1197,11 @@ int fserve_client_create (client_t *httpclient, const char *path)
     if (strcmp (util_get_extension (fullpath), "vclt") == 0)
         xslt_playlist_requested = "vclt.xsl";
 
-    /* check for the actual file */
-    if (stat (fullpath, &file_buf) != 0)
+    /* check for the actual file, unless it is known already */
+    file = fserve_file_get (fullpath);
+    if (file)
+        file_buf = file->st;
+    else if (stat (fullpath, &file_buf) != 0)
     {
         /* the m3u can be generated, but send an m3u file if available */
         if (m3u_requested == 0 && xslt_playlist_requested == NULL)
@@ -519,6 +1286,8 @@ int fserve_client_create (client_t *httpclient, const char *path)
         ICECAST_LOG_DEBUG("on demand file \"%H\" refused. Serving static files has been disabled in the config", fullpath);
         client_send_error(httpclient, 404, 0, "The file you requested could not be found");
         config_release_config();
+        if (file)
+            fserve_file_release (file);
         free(fullpath);
         return -1;
     }
@@ -532,7 +1301,8 @@ int fserve_client_create (client_t *httpclient, const char *path)
         return -1;
     }
 
-    file = fopen (fullpath, "rb");
+    if (file == NULL)
+        file = fserve_file_open (fullpath);
     if (file == NULL)
     {
         ICECAST_LOG_WARN("Problem accessing file \"%H\"", fullpath);
@@ -540,10 +1310,35 @@ int fserve_client_create (client_t *httpclient, const char *path)
         free (fullpath);
         return -1;
     }
-    free (fullpath);
 
-    content_length = file_buf.st_size;
     range = httpp_getvar (httpclient->parser, "range");
+    if (file->encodings && range == NULL)
+    {
+        const char *accept = httpp_getvar (httpclient->parser, "accept-encoding");
+        size_t i;
+
+        /* send a precompressed copy if the client takes it */
+        for (i = 0; i < FSERVE_ENCODINGS && encoded == NULL; i++)
+        {
+            char sibling[PATH_MAX];
+
+            if ((file->encodings & (1U << i)) == 0 ||
+                    fserve_accepts_encoding (accept, fserve_encodings[i].coding) == 0)
+                continue;
+            snprintf (sibling, sizeof (sibling), "%s.%s", fullpath, fserve_encodings[i].ext);
+            encoded = fserve_file_get (sibling);
+            if (encoded == NULL)
+                encoded = fserve_file_open (sibling);
+            if (encoded)
+                encoding = fserve_encodings[i].coding;
+        }
+    }
+    free (fullpath);
+
+    snprintf (extra, sizeof (extra), "%s%s%s%s",
+            encoding ? "Content-Encoding: " : "", encoding ? encoding : "",
+            encoding ? "\r\n" : "", file->encodings ? "Vary: Accept-Encoding\r\n" : "");
+    content_length = encoded ? encoded->st.st_size : file->st.st_size;
 
     /* full http range handling is currently not done but we deal with the common case */
     if (range != NULL) {
@@ -560,44 +1355,38 @@ int fserve_client_create (client_t *httpclient, const char *path)
             rangeproblem = 1;
         }
         if (!rangeproblem) {
-            ret = fseeko (file, rangenumber, SEEK_SET);
-            if (ret != -1) {
-                new_content_len = content_length - rangenumber;
-                if (new_content_len < 0) {
-                    rangeproblem = 1;
-                }
-            }
-            else {
+            new_content_len = content_length - rangenumber;
+            if (new_content_len < 0) {
                 rangeproblem = 1;
             }
             if (!rangeproblem) {
                 off_t endpos = rangenumber+new_content_len-1;
-                char *type;
 
                 if (endpos < 0) {
                     endpos = 0;
                 }
                 httpclient->respcode = 206;
-                type = fserve_content_type (path);
+                client_keepalive (httpclient);
                 bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
                                                 0, 206, NULL,
-                                                type, NULL,
+                                                file->type, NULL,
                                                 NULL, NULL, httpclient);
                 if (bytes == -1 || bytes >= (BUFSIZE - 512)) { /* we want at least 512 bytes left */
                     ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
                     client_send_error(httpclient, 500, 0, "Header generation failed.");
+                    fserve_file_release (file);
                     return -1;
                 }
                 bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
-                    "Accept-Ranges: bytes\r\n"
+                    "Accept-Ranges: bytes\r\n%s"
                     "Content-Length: %" PRI_OFF_T "\r\n"
                     "Content-Range: bytes %" PRI_OFF_T \
                     "-%" PRI_OFF_T "/%" PRI_OFF_T "\r\n\r\n",
+                    extra,
                     new_content_len,
                     rangenumber,
                     endpos,
                     content_length);
-                free (type);
             }
             else {
                 goto fail;
@@ -608,34 +1397,51 @@ int fserve_client_create (client_t *httpclient, const char *path)
         }
     }
     else {
-        char *type = fserve_content_type(path);
         httpclient->respcode = 200;
+        client_keepalive (httpclient);
         bytes = util_http_build_header (httpclient->refbuf->data, BUFSIZE, 0,
                                         0, 200, NULL,
-                                        type, NULL,
+                                        file->type, NULL,
                                         NULL, NULL, httpclient);
         if (bytes == -1 || bytes >= (BUFSIZE - 512)) { /* we want at least 512 bytes left */
             ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
             client_send_error(httpclient, 500, 0, "Header generation failed.");
-            fclose(file);
+            fserve_file_release (file);
+            if (encoded)
+                fserve_file_release (encoded);
             return -1;
         }
         bytes += snprintf (httpclient->refbuf->data + bytes, BUFSIZE - bytes,
-            "Accept-Ranges: bytes\r\n"
+            "Accept-Ranges: bytes\r\n%s"
             "Content-Length: %" PRI_OFF_T "\r\n\r\n",
+            extra,
             content_length);
-        free (type);
+        /* the type was from the file itself, now send the copy */
+        if (encoded)
+        {
+            fserve_file_release (file);
+            file = encoded;
+        }
     }
     httpclient->refbuf->len = bytes;
     httpclient->pos = 0;
 
     stats_event_inc (NULL, "file_connections");
-    fserve_add_client (httpclient, file);
+    if (file->content && rangenumber == 0)
+    {
+        /* a small file is sent from the copy in memory */
+        refbuf_addref (file->content);
+        httpclient->refbuf->next = file->content;
+        fserve_file_release (file);
+        fserve_add_client (httpclient, NULL);
+    }
+    else
+        fserve_add_file_client (httpclient, file, rangenumber);
 
     return 0;
 
 fail:
-    fclose (file);
+    fserve_file_release (file);
     httpclient->respcode = 416;
     sock_write (httpclient->con->sock,
             "HTTP/1.0 416 Request Range Not Satisfiable\r\n\r\n");
@@ -649,16 +1455,57 @@ fail:
  */
 static void fserve_add_pending (fserve_t *fclient)
 {
+    fserve_worker_t *worker;
+    unsigned int i;
+
+    thread_type *finished;
+
     thread_spin_lock (&pending_lock);
-    fclient->next = (fserve_t *)pending_list;
-    pending_list = fclient;
-    if (run_fserv == 0)
+    if (fserve_worker_count == 0 || fserve_stopping)
     {
-        run_fserv = 1;
-        ICECAST_LOG_DEBUG("fserve handler waking up");
-        thread_create("File Serving Thread", fserv_thread_function, NULL, THREAD_DETACHED);
+        thread_spin_unlock (&pending_lock);
+        fserve_client_destroy (fclient);
+        return;
+    }
+    /* the least loaded thread, starting the search from the one after the
+     * last used so ties are shared out */
+    worker = &fserve_workers[fserve_next_worker % fserve_worker_count];
+    for (i = 1; i < fserve_worker_count && worker->load; i++)
+    {
+        fserve_worker_t *next = &fserve_workers[(fserve_next_worker + i) % fserve_worker_count];
+        if (next->load < worker->load)
+            worker = next;
     }
+    fserve_next_worker = (worker - fserve_workers) + 1;
+
+    worker->load++;
+    finished = fserve_worker_queue (worker, fclient);
     thread_spin_unlock (&pending_lock);
+    if (finished)
+        thread_join (finished);
+}
+
+
+/* as fserve_add_client, but sending an open file from the cache starting
+ * at offset. The file reference is passed on */
+static int fserve_add_file_client (client_t *client, fserve_file_t *file, off_t offset)
+{
+    fserve_t *fclient = calloc (1, sizeof(fserve_t));
+
+    ICECAST_LOG_DEBUG("Adding client to file serving engine");
+    if (fclient == NULL)
+    {
+        fserve_file_release (file);
+        client_send_error(client, 404, 0, "memory exhausted");
+        return -1;
+    }
+    fclient->cached = file;
+    fclient->offset = offset;
+    fclient->client = client;
+    fclient->ready = 0;
+    fserve_add_pending (fclient);
+
+    return 0;
 }
 
 
@@ -707,6 +1554,46 @@ void fserve_add_client_callback (client_t *client, fserve_callback_t callback, v
 }
 
 
+/* as fserve_add_client_callback, but the file is sent from offset after
+ * the buffer contents. The file is not cached as it may still be growing.
+ * Returns -1 if the file cannot be opened, the client is left alone then
+ */
+int fserve_add_file_callback (client_t *client, const char *path, off_t offset,
+        fserve_callback_t callback, void *arg)
+{
+    fserve_file_t *file = calloc (1, sizeof(fserve_file_t));
+    fserve_t *fclient;
+
+    if (file == NULL)
+        return -1;
+    file->fd = open (path, O_RDONLY);
+    if (file->fd < 0)
+    {
+        free (file);
+        return -1;
+    }
+    file->path = strdup (path);
+    file->refcount = 1;
+
+    fclient = calloc (1, sizeof(fserve_t));
+    if (fclient == NULL)
+    {
+        fserve_file_free (file);
+        return -1;
+    }
+    ICECAST_LOG_DEBUG("Adding client to file serving engine");
+    fclient->cached = file;
+    fclient->offset = offset;
+    fclient->client = client;
+    fclient->ready = 0;
+    fclient->callback = callback;
+    fclient->arg = arg;
+
+    fserve_add_pending(fclient);
+    return 0;
+}
+
+
 static int _delete_mapping(void *mapping) {
     mime_type *map = mapping;
     free(map->ext);
@@ -791,5 +1678,9 @@ void fserve_recheck_mime_types(ice_config_t *config)
         avl_tree_free (mimetypes, _delete_mapping);
     mimetypes = new_mimetypes;
     thread_spin_unlock (&pending_lock);
+
+    /* cached files have their type from the old mappings */
+    if (fserve_cache)
+        fserve_cache_flush();
 }
 
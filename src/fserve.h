@@ -18,15 +18,24 @@
 
 typedef void (*fserve_callback_t)(client_t *, void *);
 
+typedef struct fserve_file_tag fserve_file_t;
+
 typedef struct _fserve_t
 {
     client_t *client;
 
     FILE *file;
+    /* or an open file shared through the cache, sent from offset */
+    struct fserve_file_tag *cached;
+    off_t offset;
     int ready;
     void (*callback)(client_t *, void *);
     void *arg;
+    /* the file serving thread it is handed back to after a read */
+    struct fserve_worker_tag *worker;
     struct _fserve_t *next;
+    /* the pointer to this one on the active list */
+    struct _fserve_t **prev;
 } fserve_t;
 
 void fserve_initialize(void);
@@ -34,6 +43,8 @@ void fserve_shutdown(void);
 int fserve_client_create(client_t *httpclient, const char *path);
 int fserve_add_client (client_t *client, FILE *file);
 void fserve_add_client_callback (client_t *client, fserve_callback_t callback, void *arg);
+int fserve_add_file_callback (client_t *client, const char *path, off_t offset,
+        fserve_callback_t callback, void *arg);
 char *fserve_content_type (const char *path);
 void fserve_recheck_mime_types (ice_config_t *config);
 
@@ -32,6 +32,9 @@
 ice_global_t global;
 
 static mutex_t _global_mutex;
+#ifndef HAVE_STDATOMIC_H
+static spin_t _count_lock;
+#endif
 
 void global_initialize(void)
 {
@@ -39,8 +42,16 @@ void global_initialize(void)
     global.relays = NULL;
     global.master_relays = NULL;
     global.running = 0;
+#ifdef HAVE_STDATOMIC_H
+    atomic_init(&global.clients, 0);
+    atomic_init(&global.sources, 0);
+    atomic_init(&global.queue_bytes, 0);
+#else
     global.clients = 0;
     global.sources = 0;
+    global.queue_bytes = 0;
+    thread_spin_create(&_count_lock);
+#endif
     global.source_tree = avl_tree_new(source_compare_sources, NULL);
     thread_mutex_create(&_global_mutex);
 }
@@ -48,6 +59,9 @@ void global_initialize(void)
 void global_shutdown(void)
 {
     thread_mutex_destroy(&_global_mutex);
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy(&_count_lock);
+#endif
     avl_tree_free(global.source_tree, NULL);
 }
 
@@ -60,3 +74,105 @@ void global_unlock(void)
 {
     thread_mutex_unlock(&_global_mutex);
 }
+
+/* returns the count after adding delta */
+static int _count_add(global_count_t *count, int delta)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_fetch_add_explicit(count, delta, memory_order_relaxed) + delta;
+#else
+    int ret;
+
+    thread_spin_lock(&_count_lock);
+    ret = (*count += delta);
+    thread_spin_unlock(&_count_lock);
+    return ret;
+#endif
+}
+
+static int _count_get(global_count_t *count)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_load_explicit(count, memory_order_relaxed);
+#else
+    int ret;
+
+    thread_spin_lock(&_count_lock);
+    ret = *count;
+    thread_spin_unlock(&_count_lock);
+    return ret;
+#endif
+}
+
+int global_clients(void)
+{
+    return _count_get(&global.clients);
+}
+
+int global_clients_add(int delta)
+{
+    return _count_add(&global.clients, delta);
+}
+
+int global_sources(void)
+{
+    return _count_get(&global.sources);
+}
+
+int global_sources_add(int delta)
+{
+    return _count_add(&global.sources, delta);
+}
+
+/* take a source slot if fewer than limit are in use. Returns the new count,
+ * or -1 if the limit has been reached */
+int global_sources_reserve(int limit)
+{
+#ifdef HAVE_STDATOMIC_H
+    int count = atomic_load_explicit(&global.sources, memory_order_relaxed);
+
+    do {
+        if (count >= limit)
+            return -1;
+    } while (atomic_compare_exchange_weak_explicit(&global.sources, &count, count + 1,
+                memory_order_relaxed, memory_order_relaxed) == 0);
+    return count + 1;
+#else
+    int ret = -1;
+
+    thread_spin_lock(&_count_lock);
+    if (global.sources < limit)
+        ret = ++global.sources;
+    thread_spin_unlock(&_count_lock);
+    return ret;
+#endif
+}
+
+long global_queue_bytes(void)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_load_explicit(&global.queue_bytes, memory_order_relaxed);
+#else
+    long ret;
+
+    thread_spin_lock(&_count_lock);
+    ret = global.queue_bytes;
+    thread_spin_unlock(&_count_lock);
+    return ret;
+#endif
+}
+
+/* returns the total after adding delta */
+long global_queue_bytes_add(long delta)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_fetch_add_explicit(&global.queue_bytes, delta, memory_order_relaxed) + delta;
+#else
+    long ret;
+
+    thread_spin_lock(&_count_lock);
+    ret = (global.queue_bytes += delta);
+    thread_spin_unlock(&_count_lock);
+    return ret;
+#endif
+}
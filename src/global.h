@@ -24,6 +24,17 @@
 #include "slave.h"
 #include "common/net/sock.h"
 
+/* the client and source counts are changed on every connect and disconnect
+ * so they are kept apart from the global lock */
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+typedef atomic_int global_count_t;
+typedef atomic_long global_bytes_t;
+#else
+typedef int global_count_t;
+typedef long global_bytes_t;
+#endif
+
 typedef struct ice_global_tag
 {
     sock_t *serversock;
@@ -31,8 +42,11 @@ typedef struct ice_global_tag
 
     int running;
 
-    int sources;
-    int clients;
+    /* use the global_clients/global_sources functions for these */
+    global_count_t sources;
+    global_count_t clients;
+    /* stream data queued over all sources, see global_queue_bytes */
+    global_bytes_t queue_bytes;
     int schedule_config_reread;
 
     avl_tree *source_tree;
@@ -51,4 +65,12 @@ void global_shutdown(void);
 void global_lock(void);
 void global_unlock(void);
 
+int global_clients(void);
+int global_clients_add(int delta);
+int global_sources(void);
+int global_sources_add(int delta);
+int global_sources_reserve(int limit);
+long global_queue_bytes(void);
+long global_queue_bytes_add(long delta);
+
 #endif  /* __GLOBAL_H__ */
@@ -0,0 +1,444 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* hls.c
+ **
+ ** live HLS output. The stream queued by the source is cut into segments
+ ** on the sync points the format marks, each held in memory as a single
+ ** buffer along with a ring of the most recent ones. The playlist is
+ ** rebuilt as each segment completes. Both are sent by the file serving
+ ** threads with cache headers, so a CDN in front can take the listeners.
+ **
+ ** A mount /live.aac has its playlist at /live.aac.m3u8 and segments at
+ ** /live.aac.<sequence>.aac
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
+#include "common/timing/timing.h"
+
+#include "hls.h"
+#include "source.h"
+#include "format.h"
+#include "fserve.h"
+#include "connection.h"
+#include "slave.h"
+#include "stats.h"
+#include "util.h"
+#include "logging.h"
+
+#define CATMODULE "hls"
+
+/* segments kept beyond the playlist for players still fetching them */
+#define HLS_SEGMENTS_EXTRA  3
+
+typedef struct hls_segment_tag
+{
+    refbuf_t *data;
+    uint64_t sequence;
+    unsigned int duration;
+} hls_segment_t;
+
+struct hls_tag
+{
+    mutex_t lock;
+    unsigned int refcount;
+    /* the last part of the mount, segments are named after it */
+    char *name;
+    const char *ext;
+    char *contenttype;
+    unsigned int segment_ms;
+    unsigned int segments;
+
+    /* the segment being put together, only used by the source thread */
+    refbuf_t **parts;
+    unsigned int part_count, part_max;
+    size_t length;
+    uint64_t start;
+
+    /* completed segments oldest first and the playlist of them, under
+     * the lock */
+    hls_segment_t *ring;
+    unsigned int max, first, count;
+    uint64_t sequence;
+    refbuf_t *playlist;
+};
+
+
+static void hls_addref (hls_t *hls)
+{
+    thread_mutex_lock (&hls->lock);
+    hls->refcount++;
+    thread_mutex_unlock (&hls->lock);
+}
+
+
+static void hls_release (hls_t *hls)
+{
+    unsigned int refcount, i;
+
+    thread_mutex_lock (&hls->lock);
+    refcount = --hls->refcount;
+    thread_mutex_unlock (&hls->lock);
+    if (refcount)
+        return;
+    for (i = 0; i < hls->part_count; i++)
+        refbuf_release (hls->parts [i]);
+    for (i = 0; i < hls->count; i++)
+        refbuf_release (hls->ring [(hls->first + i) % hls->max].data);
+    if (hls->playlist)
+        refbuf_release (hls->playlist);
+    thread_mutex_destroy (&hls->lock);
+    free (hls->parts);
+    free (hls->ring);
+    free (hls->name);
+    free (hls->contenttype);
+    free (hls);
+}
+
+
+/* packed audio segments are expected to have the usual extension */
+static const char *hls_extension (const char *contenttype)
+{
+    if (strcmp (contenttype, "audio/mpeg") == 0)
+        return "mp3";
+    if (strncmp (contenttype, "audio/aac", 9) == 0 || strcmp (contenttype, "audio/x-aac") == 0)
+        return "aac";
+    if (strcmp (contenttype, "video/MP2T") == 0)
+        return "ts";
+    return "seg";
+}
+
+
+hls_t *hls_start (const char *mount, const char *contenttype,
+        unsigned int segment, unsigned int segments)
+{
+    hls_t *hls = calloc (1, sizeof (hls_t));
+    const char *name = strrchr (mount, '/');
+
+    if (hls == NULL)
+        return NULL;
+    if (segment == 0)
+        segment = HLS_SEGMENT_DEFAULT;
+    if (segments == 0)
+        segments = HLS_SEGMENTS_DEFAULT;
+    hls->segment_ms = segment * 1000;
+    hls->segments = segments;
+    hls->max = segments + HLS_SEGMENTS_EXTRA;
+    hls->ring = calloc (hls->max, sizeof (hls_segment_t));
+    hls->name = strdup (name ? name + 1 : mount);
+    hls->contenttype = strdup (contenttype);
+    if (hls->ring == NULL || hls->name == NULL || hls->contenttype == NULL)
+    {
+        free (hls->ring);
+        free (hls->name);
+        free (hls->contenttype);
+        free (hls);
+        return NULL;
+    }
+    hls->ext = hls_extension (contenttype);
+    hls->refcount = 1;
+    thread_mutex_create (&hls->lock);
+    ICECAST_LOG_INFO("HLS output for %s, %u second segments", mount, segment);
+    return hls;
+}
+
+
+/* build the playlist of the most recent segments, call with the lock held */
+static void hls_build_playlist (hls_t *hls)
+{
+    unsigned int i, listed = hls->count < hls->segments ? hls->count : hls->segments;
+    unsigned int from = hls->count - listed, target = 0;
+    size_t len = 128 + listed * (strlen (hls->name) + 64);
+    refbuf_t *playlist = refbuf_new (len);
+    int pos;
+
+    for (i = from; i < hls->count; i++)
+    {
+        unsigned int duration = hls->ring [(hls->first + i) % hls->max].duration;
+
+        if ((duration + 999) / 1000 > target)
+            target = (duration + 999) / 1000;
+    }
+    pos = snprintf (playlist->data, len, "#EXTM3U\n#EXT-X-VERSION:3\n"
+            "#EXT-X-TARGETDURATION:%u\n#EXT-X-MEDIA-SEQUENCE:%" PRIu64 "\n",
+            target, hls->ring [(hls->first + from) % hls->max].sequence);
+    for (i = from; i < hls->count && pos > 0 && (size_t)pos < len; i++)
+    {
+        hls_segment_t *segment = &hls->ring [(hls->first + i) % hls->max];
+
+        pos += snprintf (playlist->data + pos, len - pos, "#EXTINF:%u.%03u,\n%s.%" PRIu64 ".%s\n",
+                segment->duration / 1000, segment->duration % 1000,
+                hls->name, segment->sequence, hls->ext);
+    }
+    playlist->len = (pos > 0 && (size_t)pos < len) ? (unsigned int)pos : 0;
+    if (hls->playlist)
+        refbuf_release (hls->playlist);
+    hls->playlist = playlist;
+}
+
+
+/* the parts so far make up a segment, add it to the ring */
+static void hls_complete_segment (hls_t *hls, uint64_t now)
+{
+    refbuf_t *data = refbuf_new (hls->length), *expired = NULL;
+    unsigned int i, pos = 0;
+    hls_segment_t *segment;
+
+    for (i = 0; i < hls->part_count; i++)
+    {
+        memcpy (data->data + pos, hls->parts [i]->data, hls->parts [i]->len);
+        pos += hls->parts [i]->len;
+        refbuf_release (hls->parts [i]);
+    }
+    hls->part_count = 0;
+    hls->length = 0;
+
+    thread_mutex_lock (&hls->lock);
+    if (hls->count == hls->max)
+    {
+        expired = hls->ring [hls->first].data;
+        hls->first = (hls->first + 1) % hls->max;
+        hls->count--;
+    }
+    segment = &hls->ring [(hls->first + hls->count) % hls->max];
+    segment->data = data;
+    segment->sequence = hls->sequence++;
+    segment->duration = (unsigned int)(now - hls->start);
+    hls->count++;
+    hls_build_playlist (hls);
+    thread_mutex_unlock (&hls->lock);
+
+    if (expired)
+        refbuf_release (expired);
+}
+
+
+static void hls_add_part (hls_t *hls, refbuf_t *refbuf)
+{
+    if (refbuf->len == 0)
+        return;
+    if (hls->part_count == hls->part_max)
+    {
+        unsigned int max = hls->part_max ? hls->part_max * 2 : 64;
+        refbuf_t **parts = realloc (hls->parts, max * sizeof (refbuf_t *));
+
+        if (parts == NULL)
+            return;
+        hls->parts = parts;
+        hls->part_max = max;
+    }
+    refbuf_addref (refbuf);
+    hls->parts [hls->part_count++] = refbuf;
+    hls->length += refbuf->len;
+}
+
+
+/* add the buffer queued by the source, the segment so far is completed on
+ * the first sync point after the segment length */
+void hls_write (hls_t *hls, struct source_tag *source, refbuf_t *refbuf)
+{
+    if (refbuf->sync_point)
+    {
+        uint64_t now = timing_get_time();
+
+        if (hls->start && now - hls->start < hls->segment_ms)
+        {
+            hls_add_part (hls, refbuf);
+            return;
+        }
+        if (hls->start && hls->length)
+            hls_complete_segment (hls, now);
+        hls->start = now;
+        if (source->format->get_headers)
+        {
+            refbuf_t *headers = source->format->get_headers (source, refbuf);
+
+            if (headers)
+                hls_add_part (hls, headers);
+        }
+    }
+    /* nothing is kept until the first sync point */
+    if (hls->start)
+        hls_add_part (hls, refbuf);
+}
+
+
+void hls_stop (hls_t *hls)
+{
+    if (hls)
+        hls_release (hls);
+}
+
+
+/* send the buffer with headers allowing it to be cached for max_age */
+static void hls_send (client_t *client, refbuf_t *content, const char *contenttype, unsigned int max_age)
+{
+    ssize_t bytes;
+
+    client->respcode = 200;
+    bytes = util_http_build_header (client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+            1, 200, NULL, contenttype, NULL, NULL, NULL, client);
+    if (bytes > 0)
+        bytes += snprintf (client->refbuf->data + bytes, PER_CLIENT_REFBUF_SIZE - bytes,
+                "Cache-Control: max-age=%u\r\nContent-Length: %u\r\n\r\n",
+                max_age, content->len);
+    if (bytes <= 0 || bytes >= PER_CLIENT_REFBUF_SIZE)
+    {
+        refbuf_release (content);
+        client_send_error (client, 500, 0, "Header generation failed.");
+        return;
+    }
+    client->refbuf->len = bytes;
+    client->pos = 0;
+    client->refbuf->next = content;
+    fserve_add_client (client, NULL);
+}
+
+
+/* the mount a playlist (<mount>.m3u8) or segment (<mount>.<sequence>.<ext>)
+ * uri is for, NULL if it is neither */
+static char *hls_parse_uri (const char *uri, uint64_t *sequence, int *playlist)
+{
+    size_t len = strlen (uri);
+    char *mount, *dot;
+
+    *sequence = 0;
+    *playlist = 0;
+    if (len > 5 && strcmp (uri + len - 5, ".m3u8") == 0)
+    {
+        *playlist = 1;
+        return strndup (uri, len - 5);
+    }
+    mount = strdup (uri);
+    if (mount == NULL || (dot = strrchr (mount, '.')) == NULL)
+    {
+        free (mount);
+        return NULL;
+    }
+    *dot = 0;
+    dot = strrchr (mount, '.');
+    if (dot == NULL || dot[1] == 0 || strspn (dot + 1, "0123456789") != strlen (dot + 1))
+    {
+        free (mount);
+        return NULL;
+    }
+    *sequence = strtoull (dot + 1, NULL, 10);
+    *dot = 0;
+    return mount;
+}
+
+
+/* the mount the uri would be HLS output of, so the request is authenticated
+ * as one for that mount. The caller frees it */
+char *hls_mount_name (const char *uri)
+{
+    uint64_t sequence;
+    int playlist;
+
+    return hls_parse_uri (uri, &sequence, &playlist);
+}
+
+
+/* look for the HLS output of a mount the uri is the playlist or a segment
+ * of. Returns 0 if the client was handled. Call with the source tree
+ * locked */
+int hls_handle_request (client_t *client, const char *uri)
+{
+    char *mount;
+    uint64_t sequence;
+    int playlist;
+    source_t *source;
+    hls_t *hls = NULL;
+    refbuf_t *content = NULL;
+    unsigned int i, max_age;
+
+    mount = hls_parse_uri (uri, &sequence, &playlist);
+    if (mount == NULL)
+        return -1;
+    source = source_find_mount_raw (mount);
+    free (mount);
+    if (source)
+    {
+        thread_mutex_lock (&source->lock);
+        hls = source->hls;
+        if (hls)
+            hls_addref (hls);
+        thread_mutex_unlock (&source->lock);
+    }
+    if (hls == NULL)
+        return -1;
+
+    /* a player starts from the playlist, so that is where it gets the
+     * checks a listener joining the stream would */
+    if (playlist)
+    {
+        if (connection_rate_take (&source->listener_rate) == 0)
+        {
+            stats_event_inc (NULL, "connections_rejected");
+            client_send_error (client, 503, 1, "Too many new listeners, try again later");
+            hls_release (hls);
+            return 0;
+        }
+        if (slave_redirect_client (source, client, uri) == 0)
+        {
+            hls_release (hls);
+            return 0;
+        }
+        if (source->max_listeners != -1 && source->listeners >= (unsigned long)source->max_listeners)
+        {
+            client_send_error (client, 403, 1, "Too many listeners on this mountpoint");
+            hls_release (hls);
+            return 0;
+        }
+    }
+
+    thread_mutex_lock (&hls->lock);
+    /* a playlist is good for a fraction of a segment, segments stay the same */
+    max_age = hls->segment_ms / 2000;
+    if (playlist)
+        content = hls->playlist;
+    else
+    {
+        max_age = hls->segment_ms / 1000 * hls->max;
+        for (i = 0; i < hls->count; i++)
+        {
+            hls_segment_t *segment = &hls->ring [(hls->first + i) % hls->max];
+
+            if (segment->sequence == sequence)
+            {
+                content = segment->data;
+                break;
+            }
+        }
+    }
+    if (content)
+        refbuf_addref (content);
+    thread_mutex_unlock (&hls->lock);
+
+    if (content)
+        hls_send (client, content, playlist ? "application/vnd.apple.mpegurl" : hls->contenttype, max_age);
+    else
+        client_send_error (client, 404, 0, playlist ? "Playlist not ready yet" : "Segment not available");
+    hls_release (hls);
+    return 0;
+}
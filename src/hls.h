@@ -0,0 +1,38 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* hls.h
+**
+** live HLS playlists and segments of a stream
+**
+*/
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include "refbuf.h"
+#include "client.h"
+
+/* seconds in a segment and segments listed by default */
+#define HLS_SEGMENT_DEFAULT     6
+#define HLS_SEGMENTS_DEFAULT    6
+
+struct source_tag;
+typedef struct hls_tag hls_t;
+
+hls_t *hls_start (const char *mount, const char *contenttype,
+        unsigned int segment, unsigned int segments);
+void hls_write (hls_t *hls, struct source_tag *source, refbuf_t *refbuf);
+void hls_stop (hls_t *hls);
+char *hls_mount_name (const char *uri);
+int hls_handle_request (client_t *client, const char *uri);
+
+#endif  /* __HLS_H__ */
@@ -0,0 +1,217 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* intro.c
+ **
+ ** intro and fallback files are read once into a refbuf kept here by path,
+ ** so mounts sharing a jingle share the one copy and listeners are sent
+ ** slices of it rather than reading the file each. A copy is checked
+ ** against the file at most once a second and read again when it changes.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "common/avl/avl.h"
+
+#include "intro.h"
+
+#define CATMODULE "intro"
+
+#include "logging.h"
+
+/* files larger than this are read by each mount as before */
+#define INTRO_CACHE_MAX     (8*1024*1024)
+#define INTRO_CACHE_CHECK   1
+
+typedef struct intro_file_tag
+{
+    char *path;
+    refbuf_t *content;
+    time_t mtime;
+    off_t size;
+    ino_t ino;
+    time_t checked;
+} intro_file_t;
+
+static mutex_t intro_cache_lock;
+static avl_tree *intro_cache;
+
+
+static int _compare_intros (void *arg, void *a, void *b)
+{
+    (void)arg;
+    return strcmp (((intro_file_t *)a)->path, ((intro_file_t *)b)->path);
+}
+
+static int _free_intro (void *key)
+{
+    intro_file_t *intro = key;
+
+    refbuf_release (intro->content);
+    free (intro->path);
+    free (intro);
+    return 1;
+}
+
+
+void intro_cache_initialize (void)
+{
+    thread_mutex_create (&intro_cache_lock);
+    intro_cache = avl_tree_new (_compare_intros, NULL);
+}
+
+
+void intro_cache_shutdown (void)
+{
+    /* copies still used by a source stay until it releases them */
+    avl_tree_free (intro_cache, _free_intro);
+    intro_cache = NULL;
+    thread_mutex_destroy (&intro_cache_lock);
+}
+
+
+/* read the whole file into a new refbuf, NULL if not possible */
+static refbuf_t *intro_read (const char *path, struct stat *st)
+{
+    refbuf_t *content;
+    size_t done = 0;
+    int fd = open (path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat (fd, st) != 0 || S_ISREG (st->st_mode) == 0 ||
+            st->st_size <= 0 || st->st_size > INTRO_CACHE_MAX)
+    {
+        close (fd);
+        return NULL;
+    }
+    content = refbuf_new ((unsigned int)st->st_size);
+    while (done < content->len)
+    {
+        ssize_t bytes = read (fd, content->data + done, content->len - done);
+
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        done += bytes;
+    }
+    close (fd);
+    if (done < content->len)
+    {
+        ICECAST_LOG_WARN("Short read of \"%s\"", path);
+        refbuf_release (content);
+        return NULL;
+    }
+    return content;
+}
+
+
+/* drop copies no source is using any more, call with the cache lock held */
+static void intro_cache_prune (void)
+{
+    avl_node *node = avl_get_first (intro_cache);
+
+    while (node)
+    {
+        intro_file_t *intro = node->key;
+
+        node = avl_get_next (node);
+        if (refbuf_refcount (intro->content) == 1)
+        {
+            avl_delete (intro_cache, intro, _free_intro);
+            /* the tree may have been rebalanced */
+            node = avl_get_first (intro_cache);
+        }
+    }
+}
+
+
+refbuf_t *intro_cache_get (const char *path)
+{
+    intro_file_t key, *intro = NULL;
+    refbuf_t *content = NULL;
+    void *result;
+    time_t now = time (NULL);
+    struct stat st;
+
+    if (path == NULL || intro_cache == NULL)
+        return NULL;
+
+    key.path = (char *)path;
+    thread_mutex_lock (&intro_cache_lock);
+    if (avl_get_by_key (intro_cache, &key, &result) == 0)
+    {
+        intro = result;
+        if (now - intro->checked < INTRO_CACHE_CHECK)
+            content = intro->content;
+        else if (stat (path, &st) == 0 && st.st_mtime == intro->mtime &&
+                st.st_size == intro->size && st.st_ino == intro->ino)
+        {
+            intro->checked = now;
+            content = intro->content;
+        }
+    }
+    if (content == NULL)
+    {
+        /* new or changed, sources using an old copy keep it until done */
+        content = intro_read (path, &st);
+        if (intro)
+        {
+            if (content)
+            {
+                refbuf_release (intro->content);
+                intro->content = content;
+                intro->mtime = st.st_mtime;
+                intro->size = st.st_size;
+                intro->ino = st.st_ino;
+                intro->checked = now;
+                ICECAST_LOG_INFO("Reloaded \"%s\"", path);
+            }
+            else
+                avl_delete (intro_cache, intro, _free_intro);
+        }
+        else if (content)
+        {
+            intro_cache_prune ();
+            intro = calloc (1, sizeof (intro_file_t));
+            intro->path = strdup (path);
+            intro->content = content;
+            intro->mtime = st.st_mtime;
+            intro->size = st.st_size;
+            intro->ino = st.st_ino;
+            intro->checked = now;
+            avl_insert (intro_cache, intro);
+            ICECAST_LOG_DEBUG("Loaded \"%s\", %u bytes", path, content->len);
+        }
+    }
+    if (content)
+        refbuf_addref (content);
+    thread_mutex_unlock (&intro_cache_lock);
+    return content;
+}
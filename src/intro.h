@@ -0,0 +1,31 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* intro.h
+**
+** shared in-memory copies of intro and fallback files
+**
+*/
+#ifndef __INTRO_H__
+#define __INTRO_H__
+
+#include "refbuf.h"
+
+void intro_cache_initialize(void);
+void intro_cache_shutdown(void);
+
+/* the whole of the file at path in a refbuf shared by every mount and
+ * client using it, a reference is returned for the caller to release.
+ * NULL if the file cannot be read or is too large to hold in memory */
+refbuf_t *intro_cache_get(const char *path);
+
+#endif  /* __INTRO_H__ */
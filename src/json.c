@@ -0,0 +1,467 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* json.c
+ **
+ ** JSON rendering of the stats document. This follows the rules of
+ ** web/xml2json.xslt with the nodes hidden by web/status-json.xsl, so the
+ ** output is the same as that stylesheet gives, without running libxslt.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libxml/tree.h>
+
+#include "json.h"
+#include "stats.h"
+#include "util.h"
+#include "fserve.h"
+#include "cfgfile.h"
+
+#define CATMODULE "json"
+
+#include "logging.h"
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+} json_buffer_t;
+
+
+static void json_append (json_buffer_t *buf, const char *data, size_t len)
+{
+    if (buf->failed)
+        return;
+    if (buf->len + len > buf->size)
+    {
+        size_t size = buf->size ? buf->size : 4096;
+        char *data;
+
+        while (size < buf->len + len)
+            size *= 2;
+        data = realloc (buf->data, size);
+        if (data == NULL)
+        {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = data;
+        buf->size = size;
+    }
+    memcpy (buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+static void json_puts (json_buffer_t *buf, const char *str)
+{
+    json_append (buf, str, strlen (str));
+}
+
+
+static int json_is_blank (int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+/* whitespace only text is removed by xsl:strip-space */
+static int json_is_stripped (xmlNodePtr node)
+{
+    const xmlChar *p;
+
+    if (node->type != XML_TEXT_NODE && node->type != XML_CDATA_SECTION_NODE)
+        return 0;
+    for (p = node->content; p && *p; p++)
+        if (json_is_blank (*p) == 0)
+            return 0;
+    return 1;
+}
+
+
+static int json_is_element (xmlNodePtr node)
+{
+    return node->type == XML_ELEMENT_NODE;
+}
+
+
+static xmlNodePtr json_next (xmlNodePtr node, int (*match)(xmlNodePtr))
+{
+    for (node = node->next; node; node = node->next)
+        if (match (node))
+            return node;
+    return NULL;
+}
+
+
+static xmlNodePtr json_prev (xmlNodePtr node, int (*match)(xmlNodePtr))
+{
+    for (node = node->prev; node; node = node->prev)
+        if (match (node))
+            return node;
+    return NULL;
+}
+
+
+static int json_is_node (xmlNodePtr node)
+{
+    return json_is_stripped (node) == 0;
+}
+
+
+static int json_has_children (xmlNodePtr node)
+{
+    xmlNodePtr child;
+
+    for (child = node->children; child; child = child->next)
+        if (json_is_node (child))
+            return 1;
+    return 0;
+}
+
+
+static int json_name_is (xmlNodePtr node, const char *name)
+{
+    return node && json_is_element (node) && xmlStrcmp (node->name, XMLSTR(name)) == 0;
+}
+
+
+/* the nodes status-json.xsl leaves out */
+static int json_is_hidden (xmlNodePtr node)
+{
+    static const char *source_hidden[] = { "max_listeners", "public", "source_ip",
+        "slow_listeners", "user_agent", "listener", NULL };
+    static const char *global_hidden[] = { "sources", "clients", "stats", "listeners", NULL };
+    xmlNodePtr parent = node->parent;
+    const char *name = (const char *)node->name;
+    int i;
+
+    if (strstr (name, "connections"))
+        return 1;
+    if (json_name_is (parent, "source") && json_name_is (parent->parent, "icestats"))
+    {
+        if (strstr (name, "total_bytes"))
+            return 1;
+        for (i = 0; source_hidden[i]; i++)
+            if (strcmp (name, source_hidden[i]) == 0)
+                return 1;
+    }
+    if (json_name_is (parent, "icestats"))
+        for (i = 0; global_hidden[i]; i++)
+            if (strcmp (name, global_hidden[i]) == 0)
+                return 1;
+    return 0;
+}
+
+
+/* as XPath number(), only whether it is NaN is needed */
+static int json_is_number (const char *s)
+{
+    int digits = 0;
+
+    while (json_is_blank (*s))
+        s++;
+    if (*s == '-')
+        s++;
+    if (*s != '.' && (*s < '0' || *s > '9'))
+        return 0;
+    while (*s >= '0' && *s <= '9')
+        s++, digits++;
+    if (*s == '.')
+    {
+        s++;
+        if ((*s < '0' || *s > '9') && digits == 0)
+            return 0;
+        while (*s >= '0' && *s <= '9')
+            s++;
+    }
+    if (*s == 'e' || *s == 'E')
+    {
+        s++;
+        if (*s == '-' || *s == '+')
+            s++;
+        while (*s >= '0' && *s <= '9')
+            s++;
+    }
+    while (json_is_blank (*s))
+        s++;
+    return *s == '\0';
+}
+
+
+/* the number template of xml2json.xslt, numbers with leading zeros and
+ * a trailing minus are left as strings */
+static int json_number (json_buffer_t *buf, const char *s)
+{
+    size_t len = strlen (s), end = len;
+
+    if (json_is_number (s) == 0)
+        return 0;
+    if (s[0] == '0' && strcmp (s, "0") != 0 && strncmp (s, "0.", 2) != 0)
+        return 0;
+    if (strncmp (s, "-0", 2) == 0 && strcmp (s, "-0") != 0 && strncmp (s, "-0.", 3) != 0)
+        return 0;
+    while (end && json_is_blank (s[end-1]))
+        end--;
+    if (end && s[end-1] == '-')
+        return 0;
+
+    if (s[0] == '.')
+    {
+        json_puts (buf, "0");
+        json_puts (buf, s);
+    }
+    else if (strncmp (s, "-.", 2) == 0)
+    {
+        json_puts (buf, "-0.");
+        json_puts (buf, s + 2);
+    }
+    else if (len && s[len-1] == '.')
+    {
+        json_puts (buf, s);
+        json_puts (buf, "0");
+    }
+    else
+        json_puts (buf, s);
+    return 1;
+}
+
+
+/* translate(., 'TRUE', 'true') = 'true' */
+static int json_is_word (const char *s, const char *word)
+{
+    for (; *word; s++, word++)
+        if (*s != *word && *s != *word - 'a' + 'A')
+            return 0;
+    return *s == '\0';
+}
+
+
+static void json_string (json_buffer_t *buf, const char *s)
+{
+    const char *start = s;
+
+    json_puts (buf, "\"");
+    for (; *s; s++)
+    {
+        const char *escape = NULL;
+
+        switch (*s)
+        {
+            case '\\': escape = "\\\\"; break;
+            case '"': escape = "\\\""; break;
+            case '\t': escape = "\\t"; break;
+            case '\n': escape = "\\n"; break;
+            case '\r': escape = "\\r"; break;
+        }
+        if (escape)
+        {
+            json_append (buf, start, s - start);
+            json_puts (buf, escape);
+            start = s + 1;
+        }
+    }
+    json_append (buf, start, s - start);
+    json_puts (buf, "\"");
+}
+
+
+static void json_text (json_buffer_t *buf, xmlNodePtr node)
+{
+    const char *s = node->content ? (const char *)node->content : "";
+
+    /* text next to other nodes is dropped */
+    if (json_prev (node, json_is_node) || json_next (node, json_is_node))
+        return;
+    if (json_number (buf, s))
+        return;
+    if (json_is_word (s, "true"))
+        json_puts (buf, "true");
+    else if (json_is_word (s, "false"))
+        json_puts (buf, "false");
+    else
+        json_string (buf, s);
+}
+
+
+static void json_element (json_buffer_t *buf, xmlNodePtr node);
+
+static void json_children (json_buffer_t *buf, xmlNodePtr node)
+{
+    xmlNodePtr child;
+
+    for (child = node->children; child; child = child->next)
+    {
+        if (json_is_stripped (child))
+            continue;
+        if (child->type == XML_TEXT_NODE || child->type == XML_CDATA_SECTION_NODE)
+            json_text (buf, child);
+        else if (json_is_element (child))
+        {
+            if (json_is_hidden (child))
+            {
+                /* status-json.xsl closes the object for a hidden last node */
+                if (json_next (child, json_is_element) == NULL)
+                    json_puts (buf, "\"dummy\":null}");
+            }
+            else
+                json_element (buf, child);
+        }
+    }
+}
+
+
+static void json_value (json_buffer_t *buf, xmlNodePtr node)
+{
+    if (json_has_children (node))
+        json_children (buf, node);
+    else
+        json_puts (buf, "null");
+}
+
+
+static void json_array (json_buffer_t *buf, xmlNodePtr node)
+{
+    xmlNodePtr sibling;
+    int first = 1;
+
+    json_puts (buf, "[");
+    for (sibling = node->parent->children; sibling; sibling = sibling->next)
+    {
+        if (json_is_element (sibling) == 0 || xmlStrcmp (sibling->name, node->name))
+            continue;
+        if (first == 0)
+            json_puts (buf, ",");
+        first = 0;
+        json_value (buf, sibling);
+    }
+    json_puts (buf, "]");
+}
+
+
+/* the objects and arrays template of xml2json.xslt */
+static void json_element (json_buffer_t *buf, xmlNodePtr node)
+{
+    xmlNodePtr sibling, last = NULL;
+    unsigned int same = 0, count = 0;
+
+    for (sibling = node->parent->children; sibling; sibling = sibling->next)
+    {
+        if (json_is_element (sibling) == 0)
+            continue;
+        count++;
+        if (xmlStrcmp (sibling->name, node->name) == 0)
+        {
+            same++;
+            last = sibling;
+        }
+    }
+
+    if (same > 1 && same == count)
+    {
+        if (node == last)
+            json_array (buf, node);
+        return;
+    }
+    if (json_prev (node, json_is_element) == NULL)
+        json_puts (buf, "{");
+    if (same > 1)
+    {
+        if (node == last)
+        {
+            json_string (buf, (const char *)node->name);
+            json_puts (buf, ":");
+            json_array (buf, node);
+            if (json_next (node, json_is_element))
+                json_puts (buf, ",");
+        }
+    }
+    else
+    {
+        json_string (buf, (const char *)node->name);
+        json_puts (buf, ":");
+        json_value (buf, node);
+        if (json_next (node, json_is_element))
+            json_puts (buf, ",");
+    }
+    if (json_next (node, json_is_element) == NULL)
+        json_puts (buf, "}");
+}
+
+
+/* the stats document as status-json.xsl renders it */
+refbuf_t *json_render_status (xmlDocPtr doc)
+{
+    json_buffer_t buf = { NULL, 0, 0, 0 };
+    xmlNodePtr node;
+    refbuf_t *json;
+
+    for (node = doc->children; node; node = node->next)
+    {
+        if (json_is_element (node))
+            json_element (&buf, node);
+    }
+    if (buf.failed)
+    {
+        free (buf.data);
+        return NULL;
+    }
+    json = refbuf_new (buf.len + 1);
+    if (buf.len)
+        memcpy (json->data, buf.data, buf.len);
+    json->data[buf.len] = '\0';
+    json->len = buf.len;
+    free (buf.data);
+    return json;
+}
+
+
+void json_send_status (client_t *client)
+{
+    const char *mount = httpp_get_query_param (client->parser, "mount");
+    xmlDocPtr doc = stats_get_xml (0, mount, client->mode);
+    refbuf_t *json = json_render_status (doc);
+    ssize_t ret;
+
+    xmlFreeDoc (doc);
+    if (json == NULL)
+    {
+        client_send_error (client, 500, 0, "Could not render status.");
+        return;
+    }
+    ret = util_http_build_header (client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+            0, 200, NULL, "application/json", "UTF-8", NULL, NULL, client);
+    if (ret == -1 || ret + 64 > PER_CLIENT_REFBUF_SIZE)
+    {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error (client, 500, 0, "Header generation failed.");
+        refbuf_release (json);
+        return;
+    }
+    snprintf (client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret,
+            "Content-Length: %u\r\n\r\n", json->len);
+    client->refbuf->len = strlen (client->refbuf->data);
+    client->respcode = 200;
+    if (json->len)
+        client->refbuf->next = refbuf_slice (json, 0, json->len);
+    refbuf_release (json);
+    fserve_add_client (client, NULL);
+}
@@ -0,0 +1,29 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* json.h
+**
+** JSON rendering of the stats, matching web/status-json.xsl
+**
+*/
+#ifndef __JSON_H__
+#define __JSON_H__
+
+#include <libxml/tree.h>
+
+#include "refbuf.h"
+#include "client.h"
+
+refbuf_t *json_render_status (xmlDocPtr doc);
+void json_send_status (client_t *client);
+
+#endif  /* __JSON_H__ */
@@ -0,0 +1,286 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* listeners.c
+ **
+ ** dense list of clients with lookup by connection id, used for the
+ ** listeners of a source
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "listeners.h"
+
+#define CATMODULE "listeners"
+
+#include "logging.h"
+
+#define LISTENER_LIST_MIN   16
+
+static unsigned long listener_hash (listener_list_t *list, unsigned long id)
+{
+    /* ids are handed out sequentially, spread them over the table */
+    return (id * 2654435761UL) & list->slot_mask;
+}
+
+
+/* return the slot holding id, or the free slot it would go into */
+static listener_slot_t *listener_slot (listener_list_t *list, unsigned long id)
+{
+    unsigned long i = listener_hash (list, id);
+
+    while (list->slots[i].pos && list->slots[i].id != id)
+        i = (i + 1) & list->slot_mask;
+    return &list->slots[i];
+}
+
+
+/* resize the client array and rebuild the id table to match */
+static int listener_list_grow (listener_list_t *list)
+{
+    unsigned long size = list->size ? list->size * 2 : LISTENER_LIST_MIN;
+    client_t **clients;
+    listener_slot_t *slots;
+    unsigned long i;
+
+    clients = realloc (list->clients, size * sizeof (client_t *));
+    if (clients == NULL)
+        return -1;
+    list->clients = clients;
+
+    /* keep the table at most half full */
+    slots = calloc (size * 2, sizeof (listener_slot_t));
+    if (slots == NULL)
+        return -1;
+    free (list->slots);
+    list->slots = slots;
+    list->slot_mask = size * 2 - 1;
+    list->size = size;
+
+    for (i = 0; i < list->count; i++)
+    {
+        listener_slot_t *slot = listener_slot (list, list->clients[i]->con->id);
+        slot->id = list->clients[i]->con->id;
+        slot->pos = i + 1;
+    }
+    return 0;
+}
+
+
+/* take the slot out of the table, moving up any entries further along
+ * the probe sequence so that lookups do not stop short */
+static void listener_slot_release (listener_list_t *list, listener_slot_t *slot)
+{
+    unsigned long i = slot - list->slots, j = i;
+
+    list->slots[i].pos = 0;
+    while (1)
+    {
+        unsigned long k;
+
+        j = (j + 1) & list->slot_mask;
+        if (list->slots[j].pos == 0)
+            break;
+        k = listener_hash (list, list->slots[j].id);
+        /* leave it if its home is cyclically in (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        list->slots[i] = list->slots[j];
+        list->slots[j].pos = 0;
+        i = j;
+    }
+}
+
+
+void listener_list_init (listener_list_t *list)
+{
+    memset (list, 0, sizeof (listener_list_t));
+    thread_rwlock_create (&list->lock);
+}
+
+
+void listener_list_free (listener_list_t *list, int (*free_client)(void *))
+{
+    listener_list_clear (list, free_client);
+    free (list->clients);
+    free (list->slots);
+    list->clients = NULL;
+    list->slots = NULL;
+    list->size = 0;
+    thread_rwlock_destroy (&list->lock);
+}
+
+
+/* add client to the end of the list, the list must be write locked.
+ * Returns 0 on success, -1 if memory could not be allocated
+ */
+int listener_list_add (listener_list_t *list, client_t *client)
+{
+    listener_slot_t *slot;
+
+    if (list->count == list->size && listener_list_grow (list) < 0)
+    {
+        ICECAST_LOG_ERROR("unable to grow listener list to %lu", list->count + 1);
+        return -1;
+    }
+    slot = listener_slot (list, client->con->id);
+    slot->id = client->con->id;
+    slot->pos = list->count + 1;
+    list->clients[list->count++] = client;
+    return 0;
+}
+
+
+/* remove the client at index, the last client takes its place. Returns
+ * the removed client, the list must be write locked.
+ */
+client_t *listener_list_remove (listener_list_t *list, unsigned long index)
+{
+    client_t *client = list->clients[index];
+
+    listener_slot_release (list, listener_slot (list, client->con->id));
+    list->count--;
+    if (index != list->count)
+    {
+        client_t *last = list->clients[list->count];
+
+        list->clients[index] = last;
+        listener_slot (list, last->con->id)->pos = index + 1;
+    }
+    return client;
+}
+
+
+/* return the array index of the client with connection id, or -1 */
+long listener_list_index (listener_list_t *list, unsigned long id)
+{
+    if (list->count == 0)
+        return -1;
+    return (long)listener_slot (list, id)->pos - 1;
+}
+
+
+client_t *listener_list_find (listener_list_t *list, unsigned long id)
+{
+    long index = listener_list_index (list, id);
+
+    if (index < 0)
+        return NULL;
+    return list->clients[index];
+}
+
+
+/* drop all clients from the list, passing each to free_client if given */
+void listener_list_clear (listener_list_t *list, int (*free_client)(void *))
+{
+    unsigned long i;
+
+    if (free_client)
+        for (i = 0; i < list->count; i++)
+            free_client (list->clients[i]);
+    list->count = 0;
+    if (list->slots)
+        memset (list->slots, 0, (list->slot_mask + 1) * sizeof (listener_slot_t));
+}
+
+
+void listener_queue_init (listener_queue_t *queue)
+{
+#ifdef HAVE_STDATOMIC_H
+    atomic_init (&queue->head, NULL);
+#else
+    thread_spin_create (&queue->lock);
+    queue->head = NULL;
+#endif
+}
+
+
+void listener_queue_destroy (listener_queue_t *queue)
+{
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy (&queue->lock);
+#endif
+}
+
+
+/* add client to the queue, safe to call from any thread */
+void listener_queue_push (listener_queue_t *queue, client_t *client)
+{
+#ifdef HAVE_STDATOMIC_H
+    client_t *head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+
+    do
+    {
+        client->next_pending = head;
+    } while (atomic_compare_exchange_weak_explicit (&queue->head, &head, client,
+                memory_order_release, memory_order_relaxed) == 0);
+#else
+    thread_spin_lock (&queue->lock);
+    client->next_pending = queue->head;
+    queue->head = client;
+    thread_spin_unlock (&queue->lock);
+#endif
+}
+
+
+/* add a chain of clients linked by next_pending from head to tail in one go.
+ * The chain is newest first, as if each had been pushed in turn */
+void listener_queue_push_chain (listener_queue_t *queue, client_t *head, client_t *tail)
+{
+#ifdef HAVE_STDATOMIC_H
+    client_t *old = atomic_load_explicit (&queue->head, memory_order_relaxed);
+
+    do
+    {
+        tail->next_pending = old;
+    } while (atomic_compare_exchange_weak_explicit (&queue->head, &old, head,
+                memory_order_release, memory_order_relaxed) == 0);
+#else
+    thread_spin_lock (&queue->lock);
+    tail->next_pending = queue->head;
+    queue->head = head;
+    thread_spin_unlock (&queue->lock);
+#endif
+}
+
+
+/* take every client off the queue, returned in the order they were added
+ * and linked by next_pending */
+client_t *listener_queue_take (listener_queue_t *queue)
+{
+    client_t *client, *list = NULL;
+
+#ifdef HAVE_STDATOMIC_H
+    client = atomic_exchange_explicit (&queue->head, NULL, memory_order_acquire);
+#else
+    thread_spin_lock (&queue->lock);
+    client = queue->head;
+    queue->head = NULL;
+    thread_spin_unlock (&queue->lock);
+#endif
+    /* pushed newest first, so reverse it */
+    while (client)
+    {
+        client_t *next = client->next_pending;
+
+        client->next_pending = list;
+        list = client;
+        client = next;
+    }
+    return list;
+}
@@ -0,0 +1,81 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* listeners.h
+**
+** dense list of clients with lookup by connection id
+**
+*/
+#ifndef __LISTENERS_H__
+#define __LISTENERS_H__
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+
+#include "common/thread/thread.h"
+#include "client.h"
+
+typedef struct listener_slot_tag
+{
+    unsigned long id;
+    unsigned long pos;      /* index into clients + 1, 0 when unused */
+} listener_slot_t;
+
+/* The clients are kept in an array in no particular order, removal swaps
+ * the last entry into the gap. Callers walking the array while removing
+ * entries must not advance past a removed index.
+ */
+typedef struct listener_list_tag
+{
+    rwlock_t lock;
+    client_t **clients;
+    unsigned long count;
+    unsigned long size;
+
+    /* connection id to array position, open addressing */
+    listener_slot_t *slots;
+    unsigned long slot_mask;
+} listener_list_t;
+
+/* Queue of clients waiting to join a source. Any thread can add to it
+ * without blocking, the clients are taken off all at once.
+ */
+typedef struct listener_queue_tag
+{
+#ifdef HAVE_STDATOMIC_H
+    _Atomic(client_t *) head;
+#else
+    spin_t lock;
+    client_t *head;
+#endif
+} listener_queue_t;
+
+#define listener_list_rlock(L)      thread_rwlock_rlock(&(L)->lock)
+#define listener_list_wlock(L)      thread_rwlock_wlock(&(L)->lock)
+#define listener_list_unlock(L)     thread_rwlock_unlock(&(L)->lock)
+
+void listener_list_init (listener_list_t *list);
+void listener_list_free (listener_list_t *list, int (*free_client)(void *));
+int listener_list_add (listener_list_t *list, client_t *client);
+client_t *listener_list_remove (listener_list_t *list, unsigned long index);
+long listener_list_index (listener_list_t *list, unsigned long id);
+client_t *listener_list_find (listener_list_t *list, unsigned long id);
+void listener_list_clear (listener_list_t *list, int (*free_client)(void *));
+
+void listener_queue_init (listener_queue_t *queue);
+void listener_queue_destroy (listener_queue_t *queue);
+void listener_queue_push (listener_queue_t *queue, client_t *client);
+void listener_queue_push_chain (listener_queue_t *queue, client_t *head, client_t *tail);
+client_t *listener_queue_take (listener_queue_t *queue);
+
+#endif  /* __LISTENERS_H__ */
@@ -16,8 +16,12 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
 
 #include "common/thread/thread.h"
 #include "common/httpp/httpp.h"
@@ -36,11 +40,409 @@
 #define vsnprintf _vsnprintf
 #endif
 
+#define CATMODULE "logging"
+
 /* the global log descriptors */
 int errorlog = 0;
 int accesslog = 0;
 int playlistlog = 0;
 
+/* Access and playlist lines are queued by the threads producing them and
+ * written by the log writer thread, so finishing a client does not wait
+ * for the log lock or the write. The arguments are copied as given, the
+ * writer formats them with the same log_write_direct() call as before.
+ * Without a running writer lines are written directly.
+ */
+#define LOGGING_QUEUE_MAX   65536   /* lines beyond this are dropped */
+
+typedef enum {
+    LOGGING_RECORD_ACCESS,
+    LOGGING_RECORD_PLAYLIST
+} logging_record_type_t;
+
+enum {
+    LOGGING_FIELD_IP,
+    LOGGING_FIELD_USERNAME,
+    LOGGING_FIELD_DATE,
+    LOGGING_FIELD_REQ_TYPE,
+    LOGGING_FIELD_URI,
+    LOGGING_FIELD_PROTOCOL,
+    LOGGING_FIELD_VERSION,
+    LOGGING_FIELD_REFERRER,
+    LOGGING_FIELD_USER_AGENT,
+    LOGGING_FIELD_ROLE,
+    LOGGING_FIELD_MAX
+};
+/* the playlist line reuses the first fields */
+#define LOGGING_FIELD_MOUNT     LOGGING_FIELD_IP
+#define LOGGING_FIELD_METADATA  LOGGING_FIELD_USERNAME
+
+typedef struct logging_record_tag {
+    struct logging_record_tag *next;
+    logging_record_type_t type;
+    time_t time;
+    int respcode;
+    long listeners;
+    unsigned long long sent_bytes;
+    unsigned long long stayed;
+    const char *field[LOGGING_FIELD_MAX]; /* into data, NULL stays NULL */
+    char data[];
+} logging_record_t;
+
+/* longest line common/log writes, longer lines are cut */
+#define LOGGING_LINE_MAX    1024
+
+static access_log_format _access_log_format = ACCESS_LOG_FORMAT_COMBINED;
+static int _writer_running = 0;
+static thread_type *_writer_thread;
+static cond_t _writer_cond;
+
+#ifdef HAVE_STDATOMIC_H
+static _Atomic(logging_record_t *) _records;
+static atomic_size_t _records_pending;
+static atomic_ulong _records_dropped;
+#else
+static logging_record_t *_records;
+static size_t _records_pending;
+static unsigned long _records_dropped;
+static spin_t _records_lock;
+#endif
+
+static logging_record_t *_record_new(logging_record_type_t type, const char **field, size_t count)
+{
+    logging_record_t *record;
+    size_t i, len = 0;
+    char *p;
+
+    for (i = 0; i < count; i++)
+        if (field[i])
+            len += strlen(field[i]) + 1;
+
+    record = calloc(1, sizeof(logging_record_t) + len);
+    if (record == NULL)
+        return NULL;
+    record->type = type;
+    p = record->data;
+    for (i = 0; i < count; i++) {
+        if (field[i]) {
+            size_t l = strlen(field[i]) + 1;
+
+            memcpy(p, field[i], l);
+            record->field[i] = p;
+            p += l;
+        }
+    }
+    return record;
+}
+
+/* returns -1 if the line was dropped */
+static int _record_queue(logging_record_t *record)
+{
+    logging_record_t *head;
+
+#ifdef HAVE_STDATOMIC_H
+    if (atomic_fetch_add_explicit(&_records_pending, 1, memory_order_relaxed) >= LOGGING_QUEUE_MAX) {
+        atomic_fetch_sub_explicit(&_records_pending, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&_records_dropped, 1, memory_order_relaxed);
+        free(record);
+        return -1;
+    }
+    head = atomic_load_explicit(&_records, memory_order_relaxed);
+    do {
+        record->next = head;
+    } while (atomic_compare_exchange_weak_explicit(&_records, &head, record,
+                memory_order_release, memory_order_relaxed) == 0);
+#else
+    thread_spin_lock(&_records_lock);
+    if (_records_pending >= LOGGING_QUEUE_MAX) {
+        _records_dropped++;
+        thread_spin_unlock(&_records_lock);
+        free(record);
+        return -1;
+    }
+    _records_pending++;
+    head = _records;
+    record->next = head;
+    _records = record;
+    thread_spin_unlock(&_records_lock);
+#endif
+    /* only the first line of a batch needs to wake the writer */
+    if (head == NULL)
+        thread_cond_signal(&_writer_cond);
+    return 0;
+}
+
+/* take all queued lines, returned oldest first */
+static logging_record_t *_record_take(size_t *count)
+{
+    logging_record_t *record, *list = NULL;
+    size_t n = 0;
+
+#ifdef HAVE_STDATOMIC_H
+    record = atomic_exchange_explicit(&_records, NULL, memory_order_acquire);
+#else
+    thread_spin_lock(&_records_lock);
+    record = _records;
+    _records = NULL;
+    thread_spin_unlock(&_records_lock);
+#endif
+    while (record) {
+        logging_record_t *next = record->next;
+
+        record->next = list;
+        list = record;
+        record = next;
+        n++;
+    }
+#ifdef HAVE_STDATOMIC_H
+    atomic_fetch_sub_explicit(&_records_pending, n, memory_order_relaxed);
+#else
+    thread_spin_lock(&_records_lock);
+    _records_pending -= n;
+    thread_spin_unlock(&_records_lock);
+#endif
+    *count = n;
+    return list;
+}
+
+static unsigned long _record_take_dropped(void)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_exchange_explicit(&_records_dropped, 0, memory_order_relaxed);
+#else
+    unsigned long dropped;
+
+    thread_spin_lock(&_records_lock);
+    dropped = _records_dropped;
+    _records_dropped = 0;
+    thread_spin_unlock(&_records_lock);
+    return dropped;
+#endif
+}
+
+static inline const char *_field_or_dash(const char *value)
+{
+    return value ? value : "-";
+}
+
+/* append a "name":value pair, values that do not fit are cut so the
+ * line always stays a complete object. Room is kept for the closing brace.
+ */
+static void _json_append(char *line, size_t *pos, const char *name, const char *value, int quote)
+{
+    size_t limit = LOGGING_LINE_MAX - 2;
+    size_t p = *pos;
+    int len;
+
+    len = snprintf(line + p, limit - p, "%s\"%s\":%s", p > 1 ? "," : "", name, value == NULL ? "null" : (quote ? "\"" : ""));
+    if (len < 0 || (size_t)len >= limit - p)
+        return;
+    p += len;
+
+    if (value == NULL) {
+        *pos = p;
+        return;
+    }
+
+    /* keep room for the closing quote */
+    if (quote)
+        limit--;
+    for (; *value; value++) {
+        unsigned char c = *value;
+        char esc[7];
+        size_t esclen;
+
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            esclen = 2;
+        } else if (c < 0x20 || c == 0x7f) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            esclen = 6;
+        } else {
+            esc[0] = c;
+            esclen = 1;
+        }
+        if (p + esclen > limit)
+            break;
+        memcpy(line + p, esc, esclen);
+        p += esclen;
+    }
+    if (quote)
+        line[p++] = '"';
+    *pos = p;
+}
+
+static void _record_write_json(logging_record_t *record)
+{
+    const char **field = record->field;
+    char line[LOGGING_LINE_MAX];
+    char number[32];
+    char *mount = NULL;
+    size_t pos = 0;
+
+    if (field[LOGGING_FIELD_URI]) {
+        size_t len = strcspn(field[LOGGING_FIELD_URI], "?");
+
+        /* the uri is ours, cut the query in place */
+        mount = (char *)field[LOGGING_FIELD_URI] + len;
+        if (*mount == '\0')
+            mount = NULL;
+        else
+            *mount = '\0';
+    }
+
+    line[pos++] = '{';
+    snprintf(number, sizeof(number), "%lld", (long long int)record->time);
+    _json_append(line, &pos, "time", number, 0);
+    snprintf(number, sizeof(number), "%d", record->respcode);
+    _json_append(line, &pos, "status", number, 0);
+    snprintf(number, sizeof(number), "%llu", record->sent_bytes);
+    _json_append(line, &pos, "bytes", number, 0);
+    snprintf(number, sizeof(number), "%llu", record->stayed);
+    _json_append(line, &pos, "duration", number, 0);
+    _json_append(line, &pos, "ip", field[LOGGING_FIELD_IP], 1);
+    _json_append(line, &pos, "method", field[LOGGING_FIELD_REQ_TYPE], 1);
+    _json_append(line, &pos, "mount", field[LOGGING_FIELD_URI], 1);
+    if (mount)
+        _json_append(line, &pos, "query", mount + 1, 1);
+    _json_append(line, &pos, "username", field[LOGGING_FIELD_USERNAME], 1);
+    _json_append(line, &pos, "role", field[LOGGING_FIELD_ROLE], 1);
+    _json_append(line, &pos, "user_agent", field[LOGGING_FIELD_USER_AGENT], 1);
+    _json_append(line, &pos, "referrer", field[LOGGING_FIELD_REFERRER], 1);
+    line[pos++] = '}';
+    line[pos] = '\0';
+
+    log_write_direct (accesslog, "%s", line);
+}
+
+static void _record_write(logging_record_t *record)
+{
+    const char **field = record->field;
+
+    switch (record->type) {
+        case LOGGING_RECORD_ACCESS:
+            if (_access_log_format == ACCESS_LOG_FORMAT_JSON) {
+                _record_write_json(record);
+                break;
+            }
+            log_write_direct (accesslog,
+                    "%s - %H [%s] \"%H %H %H/%H\" %d %llu \"% H\" \"% H\" %llu",
+                    field[LOGGING_FIELD_IP],
+                    _field_or_dash(field[LOGGING_FIELD_USERNAME]),
+                    field[LOGGING_FIELD_DATE],
+                    field[LOGGING_FIELD_REQ_TYPE],
+                    field[LOGGING_FIELD_URI],
+                    field[LOGGING_FIELD_PROTOCOL],
+                    field[LOGGING_FIELD_VERSION],
+                    record->respcode,
+                    record->sent_bytes,
+                    _field_or_dash(field[LOGGING_FIELD_REFERRER]),
+                    _field_or_dash(field[LOGGING_FIELD_USER_AGENT]),
+                    record->stayed);
+        break;
+        case LOGGING_RECORD_PLAYLIST:
+            /* This format MAY CHANGE OVER TIME.  We are looking into finding a good
+               standard format for this, if you have any ideas, please let us know */
+            log_write_direct (playlistlog, "%s|%s|%ld|%s",
+                    field[LOGGING_FIELD_DATE],
+                    field[LOGGING_FIELD_MOUNT],
+                    record->listeners,
+                    field[LOGGING_FIELD_METADATA]);
+        break;
+    }
+}
+
+/* hand the record to the writer, or write it here if there is none */
+static void _record_submit(logging_record_t *record)
+{
+    if (record == NULL)
+        return;
+    if (_writer_running) {
+        _record_queue(record);
+        return;
+    }
+    _record_write(record);
+    free(record);
+}
+
+static void _writer_drain(void)
+{
+    logging_record_t *record;
+    unsigned long dropped;
+    size_t count;
+
+    while ((record = _record_take(&count))) {
+        while (record) {
+            logging_record_t *next = record->next;
+
+            _record_write(record);
+            free(record);
+            record = next;
+        }
+    }
+
+    dropped = _record_take_dropped();
+    if (dropped)
+        ICECAST_LOG_WARN("%lu access or playlist log lines dropped, the log writer fell behind", dropped);
+}
+
+static void *_writer_thread_main(void *arg)
+{
+    (void)arg;
+
+    while (_writer_running) {
+        _writer_drain();
+        /* woken by the first line queued, a missed wakeup only delays */
+        thread_cond_timedwait(&_writer_cond, 1000);
+    }
+    /* whatever was queued before we were stopped */
+    _writer_drain();
+    return NULL;
+}
+
+void logging_initialize(void)
+{
+    ice_config_t *config = config_get_config();
+
+    _access_log_format = config->access_log_format;
+    config_release_config();
+
+#ifdef HAVE_STDATOMIC_H
+    atomic_init(&_records, NULL);
+    atomic_init(&_records_pending, 0);
+    atomic_init(&_records_dropped, 0);
+#else
+    _records = NULL;
+    _records_pending = 0;
+    _records_dropped = 0;
+    thread_spin_create(&_records_lock);
+#endif
+    thread_cond_create(&_writer_cond);
+    _writer_running = 1;
+    _writer_thread = thread_create("Log Writer", _writer_thread_main, NULL, THREAD_ATTACHED);
+    if (_writer_thread == NULL)
+        _writer_running = 0;
+}
+
+void logging_shutdown(void)
+{
+    if (!_writer_running)
+        return;
+
+    _writer_running = 0;
+    thread_cond_signal(&_writer_cond);
+    thread_join(_writer_thread);
+    _writer_thread = NULL;
+
+    /* lines queued while the writer was exiting */
+    _writer_drain();
+    thread_cond_destroy(&_writer_cond);
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy(&_records_lock);
+#endif
+}
+
 #ifdef _WIN32
 /* Since strftime's %z option on win32 is different, we need
  to go through a few loops to get the same info as %z */
@@ -126,7 +528,8 @@ void logging_access(client_t *client)
     struct tm thetime;
     time_t now;
     time_t stayed;
-    const char *referrer, *user_agent, *username;
+    const char *field[LOGGING_FIELD_MAX];
+    logging_record_t *record;
 
     now = time(NULL);
 
@@ -141,33 +544,25 @@ void logging_access(client_t *client)
 
     stayed = now - client->con->con_time;
 
-    if (client->username == NULL)
-        username = "-";
-    else
-        username = client->username;
-
-    referrer = httpp_getvar (client->parser, "referer");
-    if (referrer == NULL)
-        referrer = "-";
-
-    user_agent = httpp_getvar (client->parser, "user-agent");
-    if (user_agent == NULL)
-        user_agent = "-";
-
-    log_write_direct (accesslog,
-            "%s - %H [%s] \"%H %H %H/%H\" %d %llu \"% H\" \"% H\" %llu",
-            client->con->ip,
-            username,
-            datebuf,
-            httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE),
-            httpp_getvar (client->parser, HTTPP_VAR_URI),
-            httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL),
-            httpp_getvar (client->parser, HTTPP_VAR_VERSION),
-            client->respcode,
-            (long long unsigned int)client->con->sent_bytes,
-            referrer,
-            user_agent,
-            (long long unsigned int)stayed);
+    field[LOGGING_FIELD_IP]         = client->con->ip;
+    field[LOGGING_FIELD_USERNAME]   = client->username;
+    field[LOGGING_FIELD_DATE]       = datebuf;
+    field[LOGGING_FIELD_REQ_TYPE]   = httpp_getvar (client->parser, HTTPP_VAR_REQ_TYPE);
+    field[LOGGING_FIELD_URI]        = httpp_getvar (client->parser, HTTPP_VAR_URI);
+    field[LOGGING_FIELD_PROTOCOL]   = httpp_getvar (client->parser, HTTPP_VAR_PROTOCOL);
+    field[LOGGING_FIELD_VERSION]    = httpp_getvar (client->parser, HTTPP_VAR_VERSION);
+    field[LOGGING_FIELD_REFERRER]   = httpp_getvar (client->parser, "referer");
+    field[LOGGING_FIELD_USER_AGENT] = httpp_getvar (client->parser, "user-agent");
+    field[LOGGING_FIELD_ROLE]       = client->role;
+
+    record = _record_new(LOGGING_RECORD_ACCESS, field, LOGGING_FIELD_MAX);
+    if (record == NULL)
+        return;
+    record->time = now;
+    record->respcode = client->respcode;
+    record->sent_bytes = (long long unsigned int)client->con->sent_bytes;
+    record->stayed = (long long unsigned int)stayed;
+    _record_submit(record);
 }
 /* This function will provide a log of metadata for each
    mountpoint.  The metadata *must* be in UTF-8, and thus
@@ -177,6 +572,8 @@ void logging_playlist(const char *mount, const char *metadata, long listeners)
     char datebuf[128];
     struct tm thetime;
     time_t now;
+    const char *field[LOGGING_FIELD_MAX];
+    logging_record_t *record;
 
     if (playlistlog == -1) {
         return;
@@ -192,13 +589,16 @@ void logging_playlist(const char *mount, const char *metadata, long listeners)
 #else
     strftime (datebuf, sizeof(datebuf), LOGGING_FORMAT_CLF, &thetime);
 #endif
-    /* This format MAY CHANGE OVER TIME.  We are looking into finding a good
-       standard format for this, if you have any ideas, please let us know */
-    log_write_direct (playlistlog, "%s|%s|%ld|%s",
-             datebuf,
-             mount,
-             listeners,
-             metadata);
+
+    field[LOGGING_FIELD_MOUNT]    = mount;
+    field[LOGGING_FIELD_METADATA] = metadata;
+    field[LOGGING_FIELD_DATE]     = datebuf;
+
+    record = _record_new(LOGGING_RECORD_PLAYLIST, field, LOGGING_FIELD_DATE + 1);
+    if (record == NULL)
+        return;
+    record->listeners = listeners;
+    _record_submit(record);
 }
 
 
@@ -219,6 +619,8 @@ void log_parse_failure (void *ctx, const char *fmt, ...)
 
 void restart_logging (ice_config_t *config)
 {
+    _access_log_format = config->access_log_format;
+
     if (strcmp (config->error_log, "-"))
     {
         char fn_error[FILENAME_MAX];
@@ -79,6 +79,10 @@ extern int playlistlog;
 
 #define LOGGING_FORMAT_CLF "%d/%b/%Y:%H:%M:%S %z"
 
+/* start and stop the thread writing access and playlist lines */
+void logging_initialize(void);
+void logging_shutdown(void);
+
 void logging_access(client_t *client);
 void logging_playlist(const char *mount, const char *metadata, long listeners);
 void restart_logging (ice_config_t *config);
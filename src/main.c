@@ -68,6 +68,8 @@
 #include "compat.h"
 #include "connection.h"
 #include "refbuf.h"
+#include "objpool.h"
+#include "intro.h"
 #include "client.h"
 #include "slave.h"
 #include "stats.h"
@@ -125,7 +127,10 @@ void initialize_subsystems(void)
     config_initialize();
     connection_initialize();
     global_initialize();
+    source_routes_initialize();
     refbuf_initialize();
+    objpool_initialize();
+    intro_cache_initialize();
 
     xslt_initialize();
 #ifdef HAVE_CURL
@@ -137,12 +142,16 @@ void shutdown_subsystems(void)
 {
     event_shutdown();
     fserve_shutdown();
-    refbuf_shutdown();
     slave_shutdown();
     auth_shutdown();
     yp_shutdown();
     stats_shutdown();
+    logging_shutdown();
+    intro_cache_shutdown();
+    refbuf_shutdown();
+    objpool_shutdown();
 
+    source_routes_shutdown();
     global_shutdown();
     connection_shutdown();
     config_shutdown();
@@ -578,6 +587,7 @@ int main(int argc, char **argv)
         shutdown_subsystems();
         return 1;
     }
+    logging_initialize();
 
     ICECAST_LOG_INFO("%s server started", ICECAST_VERSION_STRING);
     __log_system_name();
@@ -18,13 +18,39 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
 
 #include "matchfile.h"
 #include "logging.h"
 #include "util.h" /* for MAX_LINE_LEN and get_line() */
+#include "common/thread/thread.h"
 #include "common/avl/avl.h"
 #define CATMODULE "matchfile"
 
+/* Lines that are an address or a CIDR range (address/prefix length) go
+ * into a path compressed binary trie per address family, everything else
+ * is matched as an exact string.
+ */
+typedef struct matchfile_trie_tag {
+    unsigned char key[16];      /* bits past the prefix are zero */
+    unsigned int bits;
+    int listed;                 /* a listed prefix ends here */
+    struct matchfile_trie_tag *child[2];
+} matchfile_trie_t;
+
+typedef struct {
+    avl_tree *strings;
+    matchfile_trie_t *inet;     /* IPv4, 32 bit keys */
+    matchfile_trie_t *inet6;    /* IPv6, 128 bit keys */
+} matchfile_data_t;
+
 struct matchfile_tag {
     /* reference counter */
     size_t refcount;
@@ -32,9 +58,12 @@ struct matchfile_tag {
     /* filename of input file */
     char *filename;
 
+    mutex_t recheck_lock;   /* protects file_recheck and file_mtime */
     time_t file_recheck;
     time_t file_mtime;
-    avl_tree *contents;
+
+    rwlock_t lock;          /* protects contents, swapped on reload */
+    matchfile_data_t *contents;
 };
 
 static int __func_free(void *x) {
@@ -47,50 +76,256 @@ static int __func_compare (void *arg, void *a, void *b) {
     return strcmp(b, a);
 }
 
-static void __func_recheck(matchfile_t *file) {
-    time_t now = time(NULL);
-    struct stat file_stat;
-    FILE *input = NULL;
-    avl_tree *new_contents;
-    char line[MAX_LINE_LEN];
+static inline int __trie_bit(const unsigned char *key, unsigned int bit) {
+    return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
 
-    if (now < file->file_recheck)
-        return;
+/* number of leading bits a and b have in common, up to max */
+static unsigned int __trie_common(const unsigned char *a, const unsigned char *b, unsigned int max) {
+    unsigned int bit = 0;
 
-    file->file_recheck = now + 10;
+    while (bit + 8 <= max && a[bit >> 3] == b[bit >> 3])
+        bit += 8;
+    while (bit < max && __trie_bit(a, bit) == __trie_bit(b, bit))
+        bit++;
+    return bit;
+}
 
-    if (stat(file->filename, &file_stat) < 0) {
-        ICECAST_LOG_WARN("failed to check status of \"%s\": %s", file->filename, strerror(errno));
+static matchfile_trie_t *__trie_node(const unsigned char *key, unsigned int bits, int listed) {
+    matchfile_trie_t *node = calloc(1, sizeof(matchfile_trie_t));
+    unsigned int i;
+
+    if (!node)
+        return NULL;
+
+    memcpy(node->key, key, (bits + 7) / 8);
+    if (bits & 7)
+        node->key[bits >> 3] &= 0xFF << (8 - (bits & 7));
+    for (i = (bits + 7) / 8; i < sizeof(node->key); i++)
+        node->key[i] = 0;
+    node->bits = bits;
+    node->listed = listed;
+    return node;
+}
+
+static void __trie_insert(matchfile_trie_t **link, const unsigned char *key, unsigned int bits) {
+    matchfile_trie_t *node, *mid, *leaf;
+    unsigned int common;
+
+    while ((node = *link)) {
+        common = __trie_common(node->key, key, node->bits < bits ? node->bits : bits);
+        if (common < node->bits) {
+            /* split, the new key or their common prefix goes above node */
+            if (common == bits) {
+                mid = __trie_node(key, bits, 1);
+                if (!mid)
+                    return;
+                mid->child[__trie_bit(node->key, bits)] = node;
+                *link = mid;
+                return;
+            }
+            mid = __trie_node(key, common, 0);
+            leaf = __trie_node(key, bits, 1);
+            if (!mid || !leaf) {
+                free(mid);
+                free(leaf);
+                return;
+            }
+            mid->child[__trie_bit(node->key, common)] = node;
+            mid->child[__trie_bit(key, common)] = leaf;
+            *link = mid;
+            return;
+        }
+        if (node->bits == bits) {
+            node->listed = 1;
+            return;
+        }
+        /* already covered by a shorter listed prefix */
+        if (node->listed)
+            return;
+        link = &node->child[__trie_bit(key, node->bits)];
+    }
+    *link = __trie_node(key, bits, 1);
+}
+
+/* returns 1 if any listed prefix covers key, walks at most bits levels */
+static int __trie_match(const matchfile_trie_t *node, const unsigned char *key, unsigned int bits) {
+    while (node) {
+        if (node->bits > bits || __trie_common(node->key, key, node->bits) < node->bits)
+            return 0;
+        if (node->listed)
+            return 1;
+        if (node->bits == bits)
+            return 0;
+        node = node->child[__trie_bit(key, node->bits)];
+    }
+    return 0;
+}
+
+static void __trie_free(matchfile_trie_t *node) {
+    if (!node)
         return;
+    __trie_free(node->child[0]);
+    __trie_free(node->child[1]);
+    free(node);
+}
+
+/* parse an address with an optional /prefix, IPv4 mapped IPv6 addresses are
+ * turned into IPv4 as the accept path does. Returns the family or -1.
+ */
+static int __parse_address(const char *str, unsigned char *key, unsigned int *bits, int allow_prefix) {
+    char buf[INET6_ADDRSTRLEN + 5];
+    char *slash;
+    long prefix = -1;
+    int family;
+
+    if (strlen(str) >= sizeof(buf))
+        return -1;
+    strcpy(buf, str);
+
+    slash = strchr(buf, '/');
+    if (slash) {
+        char *end;
+
+        if (!allow_prefix)
+            return -1;
+        *slash = 0;
+        prefix = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end || prefix < 0)
+            return -1;
     }
 
-    if (file_stat.st_mtime == file->file_mtime)
-        return; /* common case, no update to file */
+    if (inet_pton(AF_INET, buf, key) == 1) {
+        family = AF_INET;
+        *bits = 32;
+    } else if (inet_pton(AF_INET6, buf, key) == 1) {
+        static const unsigned char mapped[12] = {0,0,0,0,0,0,0,0,0,0,0xFF,0xFF};
+
+        family = AF_INET6;
+        *bits = 128;
+        if (memcmp(key, mapped, sizeof(mapped)) == 0 && (prefix < 0 || prefix >= 96)) {
+            memmove(key, key + 12, 4);
+            family = AF_INET;
+            *bits = 32;
+            if (prefix >= 0)
+                prefix -= 96;
+        }
+    } else {
+        return -1;
+    }
 
-    file->file_mtime = file_stat.st_mtime;
+    if (prefix > (long)*bits)
+        return -1;
+    if (prefix >= 0)
+        *bits = prefix;
 
-    input = fopen(file->filename, "r");
-    if (!input) {
-        ICECAST_LOG_WARN("Failed to open file \"%s\": %s", file->filename, strerror(errno));
+    return family;
+}
+
+static void __data_free(matchfile_data_t *data) {
+    if (!data)
         return;
+    if (data->strings)
+        avl_tree_free(data->strings, __func_free);
+    __trie_free(data->inet);
+    __trie_free(data->inet6);
+    free(data);
+}
+
+/* an address or range goes into the trie for its family, anything else is
+ * kept as a string */
+static void __data_add(matchfile_data_t *data, const char *line) {
+    unsigned char key[16];
+    unsigned int bits;
+    char *str;
+
+    switch (__parse_address(line, key, &bits, 1)) {
+        case AF_INET:
+            __trie_insert(&data->inet, key, bits);
+            break;
+        case AF_INET6:
+            __trie_insert(&data->inet6, key, bits);
+            break;
+        default:
+            str = strdup(line);
+            if (str)
+                avl_insert(data->strings, str);
+            break;
     }
+}
+
+static matchfile_data_t *__data_load(const char *filename) {
+    FILE *input = NULL;
+    matchfile_data_t *data;
+    char line[MAX_LINE_LEN];
 
-    new_contents = avl_tree_new(__func_compare, NULL);
+    input = fopen(filename, "r");
+    if (!input) {
+        ICECAST_LOG_WARN("Failed to open file \"%s\": %s", filename, strerror(errno));
+        return NULL;
+    }
 
-    while (get_line(input, line, MAX_LINE_LEN)) {
-        char *str;
+    data = calloc(1, sizeof(matchfile_data_t));
+    if (!data) {
+        fclose(input);
+        return NULL;
+    }
+    data->strings = avl_tree_new(__func_compare, NULL);
 
+    while (get_line(input, line, MAX_LINE_LEN)) {
         if(!line[0] || line[0] == '#')
             continue;
-        str = strdup(line);
-        if (str)
-            avl_insert(new_contents, str);
+
+        __data_add(data, line);
     }
 
     fclose(input);
 
-    if (file->contents) avl_tree_free(file->contents, __func_free);
+    return data;
+}
+
+static void __func_recheck(matchfile_t *file) {
+    time_t now = time(NULL);
+    struct stat file_stat;
+    matchfile_data_t *new_contents, *old_contents;
+
+    /* a list given directly has nothing to reload */
+    if (!file->filename)
+        return;
+
+    /* only one caller reloads, the others carry on with the old contents */
+    thread_mutex_lock(&file->recheck_lock);
+    if (now < file->file_recheck) {
+        thread_mutex_unlock(&file->recheck_lock);
+        return;
+    }
+
+    file->file_recheck = now + 10;
+
+    if (stat(file->filename, &file_stat) < 0) {
+        thread_mutex_unlock(&file->recheck_lock);
+        ICECAST_LOG_WARN("failed to check status of \"%s\": %s", file->filename, strerror(errno));
+        return;
+    }
+
+    if (file_stat.st_mtime == file->file_mtime) {
+        thread_mutex_unlock(&file->recheck_lock);
+        return; /* common case, no update to file */
+    }
+
+    file->file_mtime = file_stat.st_mtime;
+    thread_mutex_unlock(&file->recheck_lock);
+
+    new_contents = __data_load(file->filename);
+    if (!new_contents)
+        return;
+
+    thread_rwlock_wlock(&file->lock);
+    old_contents = file->contents;
     file->contents = new_contents;
+    thread_rwlock_unlock(&file->lock);
+
+    __data_free(old_contents);
 }
 
 matchfile_t *matchfile_new(const char *filename) {
@@ -107,6 +342,8 @@ matchfile_t *matchfile_new(const char *filename) {
     ret->filename     = strdup(filename);
     ret->file_mtime   = 0;
     ret->file_recheck = 0;
+    thread_mutex_create(&ret->recheck_lock);
+    thread_rwlock_create(&ret->lock);
 
     if (!ret->filename) {
         matchfile_release(ret);
@@ -119,6 +356,44 @@ matchfile_t *matchfile_new(const char *filename) {
     return ret;
 }
 
+/* as matchfile_new, but with the entries separated by commas or spaces in
+ * list instead of lines of a file */
+matchfile_t *matchfile_new_list(const char *list) {
+    matchfile_t *ret;
+    char *copy, *entry, *next;
+
+    if (!list)
+        return NULL;
+
+    ret = calloc(1, sizeof(matchfile_t));
+    if (!ret)
+        return NULL;
+
+    ret->refcount = 1;
+    thread_mutex_create(&ret->recheck_lock);
+    thread_rwlock_create(&ret->lock);
+
+    copy = strdup(list);
+    ret->contents = calloc(1, sizeof(matchfile_data_t));
+    if (!copy || !ret->contents) {
+        free(copy);
+        matchfile_release(ret);
+        return NULL;
+    }
+    ret->contents->strings = avl_tree_new(__func_compare, NULL);
+
+    for (entry = copy; entry; entry = next) {
+        next = strpbrk(entry, ", ");
+        if (next)
+            *next++ = 0;
+        if (*entry)
+            __data_add(ret->contents, entry);
+    }
+    free(copy);
+
+    return ret;
+}
+
 int          matchfile_addref(matchfile_t *file) {
     if (!file)
         return -1;
@@ -137,8 +412,9 @@ int          matchfile_release(matchfile_t *file) {
     if (file->refcount)
         return 0;
 
-    if (file->contents)
-        avl_tree_free(file->contents, __func_free);
+    __data_free(file->contents);
+    thread_rwlock_destroy(&file->lock);
+    thread_mutex_destroy(&file->recheck_lock);
     free(file->filename);
     free(file);
 
@@ -147,7 +423,10 @@ int          matchfile_release(matchfile_t *file) {
 
 /* we are not const char *key because of avl_get_by_key()... */
 int          matchfile_match(matchfile_t *file, const char *key) {
+    unsigned char addr[16];
+    unsigned int bits;
     void *result;
+    int ret = 0;
 
     if (!file)
         return -1;
@@ -155,10 +434,23 @@ int          matchfile_match(matchfile_t *file, const char *key) {
     /* reload database if needed */
     __func_recheck(file);
 
-    if (!file->contents)
-        return 0;
+    thread_rwlock_rlock(&file->lock);
+    if (file->contents) {
+        switch (__parse_address(key, addr, &bits, 0)) {
+            case AF_INET:
+                ret = __trie_match(file->contents->inet, addr, bits);
+                break;
+            case AF_INET6:
+                ret = __trie_match(file->contents->inet6, addr, bits);
+                break;
+            default:
+                ret = avl_get_by_key(file->contents->strings, (void*)key, &result) == 0 ? 1 : 0;
+                break;
+        }
+    }
+    thread_rwlock_unlock(&file->lock);
 
-    return avl_get_by_key(file->contents, (void*)key, &result) == 0 ? 1 : 0;
+    return ret;
 }
 
 int          matchfile_match_allow_deny(matchfile_t *allow, matchfile_t *deny, const char *key) {
@@ -13,6 +13,7 @@ struct matchfile_tag;
 typedef struct matchfile_tag matchfile_t;
 
 matchfile_t *matchfile_new(const char *filename);
+matchfile_t *matchfile_new_list(const char *list);
 int          matchfile_addref(matchfile_t *file);
 int          matchfile_release(matchfile_t *file);
 int          matchfile_match(matchfile_t *file, const char *key);
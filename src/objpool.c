@@ -0,0 +1,308 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* objpool.c
+ **
+ ** free lists for client_t, connection_t and the other objects made for
+ ** every request. Released objects go on a short list for the releasing
+ ** thread and then on a shared list for the type, as refbufs do, so that
+ ** reconnect storms do not churn the allocator.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+
+#include "common/thread/thread.h"
+
+#include "objpool.h"
+#include "stats.h"
+
+#define CATMODULE "objpool"
+
+#include "logging.h"
+
+#define OBJPOOL_CACHE_MAX   32      /* per thread, for each type */
+#define OBJPOOL_POOL_MAX    1024    /* shared, for each type */
+
+/* a free object holds the link to the next one in its first bytes */
+#define OBJPOOL_NEXT(O)     (*(void **)(O))
+
+#ifdef HAVE_STDATOMIC_H
+typedef atomic_ulong objpool_count_t;
+#define OBJPOOL_ADD(C,V)    atomic_fetch_add_explicit (&(C), (V), memory_order_relaxed)
+#define OBJPOOL_SUB(C,V)    atomic_fetch_sub_explicit (&(C), (V), memory_order_relaxed)
+#define OBJPOOL_GET(C)      atomic_load_explicit (&(C), memory_order_relaxed)
+#else
+typedef unsigned long objpool_count_t;
+static spin_t objpool_count_lock;
+#define OBJPOOL_ADD(C,V)    do { thread_spin_lock (&objpool_count_lock); (C) += (V); thread_spin_unlock (&objpool_count_lock); } while (0)
+#define OBJPOOL_SUB(C,V)    do { thread_spin_lock (&objpool_count_lock); (C) -= (V); thread_spin_unlock (&objpool_count_lock); } while (0)
+#define OBJPOOL_GET(C)      (C)
+#endif
+
+typedef struct objpool_tag
+{
+    const char *name;
+    spin_t lock;
+    void *free;
+    unsigned int count;
+
+    /* objects handed out, and kept on any free list */
+    objpool_count_t live;
+    objpool_count_t pooled;
+
+    /* last values given to the stats */
+    unsigned long published_live;
+    unsigned long published_pooled;
+} objpool_t;
+
+typedef struct objpool_cache_tag
+{
+    void *free [OBJPOOL_TYPES];
+    unsigned int count [OBJPOOL_TYPES];
+} objpool_cache_t;
+
+static objpool_t objpools [OBJPOOL_TYPES] = {
+    { .name = "client" },
+    { .name = "connection" },
+    { .name = "client_queue" },
+    { .name = "auth_client" }
+};
+static pthread_key_t objpool_cache_key;
+static int objpool_pooling = 0;
+
+
+/* hand an object to the shared pool, or back to the allocator if full */
+static void objpool_put (objpool_type type, void *obj)
+{
+    objpool_t *p = &objpools [type];
+
+    thread_spin_lock (&p->lock);
+    if (p->count < OBJPOOL_POOL_MAX)
+    {
+        OBJPOOL_NEXT (obj) = p->free;
+        p->free = obj;
+        p->count++;
+        obj = NULL;
+    }
+    thread_spin_unlock (&p->lock);
+    if (obj)
+    {
+        OBJPOOL_SUB (p->pooled, 1);
+        free (obj);
+    }
+}
+
+
+/* thread exit, pass any cached objects on to the shared pools */
+static void objpool_cache_release (void *arg)
+{
+    objpool_cache_t *cache = arg;
+    unsigned int type;
+
+    for (type = 0; type < OBJPOOL_TYPES; type++)
+    {
+        while (cache->free [type])
+        {
+            void *obj = cache->free [type];
+
+            cache->free [type] = OBJPOOL_NEXT (obj);
+            if (objpool_pooling)
+                objpool_put (type, obj);
+            else
+            {
+                OBJPOOL_SUB (objpools [type].pooled, 1);
+                free (obj);
+            }
+        }
+    }
+    free (cache);
+}
+
+
+static objpool_cache_t *objpool_get_cache (void)
+{
+    objpool_cache_t *cache = pthread_getspecific (objpool_cache_key);
+
+    if (cache == NULL)
+    {
+        cache = calloc (1, sizeof (objpool_cache_t));
+        if (cache && pthread_setspecific (objpool_cache_key, cache) != 0)
+        {
+            free (cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+
+void objpool_initialize (void)
+{
+    unsigned int type;
+
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_create (&objpool_count_lock);
+#endif
+    for (type = 0; type < OBJPOOL_TYPES; type++)
+        thread_spin_create (&objpools [type].lock);
+    if (pthread_key_create (&objpool_cache_key, objpool_cache_release) == 0)
+        objpool_pooling = 1;
+}
+
+
+void objpool_shutdown (void)
+{
+    unsigned int type;
+
+    if (objpool_pooling)
+    {
+        objpool_cache_t *cache = pthread_getspecific (objpool_cache_key);
+
+        objpool_pooling = 0;
+        if (cache)
+        {
+            pthread_setspecific (objpool_cache_key, NULL);
+            objpool_cache_release (cache);
+        }
+        pthread_key_delete (objpool_cache_key);
+    }
+    for (type = 0; type < OBJPOOL_TYPES; type++)
+    {
+        objpool_t *p = &objpools [type];
+
+        while (p->free)
+        {
+            void *obj = p->free;
+
+            p->free = OBJPOOL_NEXT (obj);
+            OBJPOOL_SUB (p->pooled, 1);
+            free (obj);
+        }
+        p->count = 0;
+        if (OBJPOOL_GET (p->live))
+            ICECAST_LOG_DEBUG("%lu %s objects still in use at shutdown",
+                    (unsigned long)OBJPOOL_GET (p->live), p->name);
+        thread_spin_destroy (&p->lock);
+    }
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy (&objpool_count_lock);
+#endif
+}
+
+
+void *objpool_alloc (objpool_type type, size_t size)
+{
+    objpool_t *p = &objpools [type];
+    void *obj = NULL;
+
+    if (objpool_pooling)
+    {
+        objpool_cache_t *cache = objpool_get_cache ();
+
+        if (cache && cache->free [type])
+        {
+            obj = cache->free [type];
+            cache->free [type] = OBJPOOL_NEXT (obj);
+            cache->count [type]--;
+        }
+        else
+        {
+            thread_spin_lock (&p->lock);
+            obj = p->free;
+            if (obj)
+            {
+                p->free = OBJPOOL_NEXT (obj);
+                p->count--;
+            }
+            thread_spin_unlock (&p->lock);
+        }
+    }
+    if (obj)
+    {
+        OBJPOOL_SUB (p->pooled, 1);
+        memset (obj, 0, size);
+    }
+    else
+    {
+        obj = calloc (1, size < sizeof (void *) ? sizeof (void *) : size);
+        if (obj == NULL)
+            abort();
+    }
+    OBJPOOL_ADD (p->live, 1);
+    return obj;
+}
+
+
+void objpool_free (objpool_type type, void *obj)
+{
+    objpool_t *p = &objpools [type];
+
+    if (obj == NULL)
+        return;
+    OBJPOOL_SUB (p->live, 1);
+    if (objpool_pooling)
+    {
+        objpool_cache_t *cache = objpool_get_cache ();
+
+        OBJPOOL_ADD (p->pooled, 1);
+        if (cache && cache->count [type] < OBJPOOL_CACHE_MAX)
+        {
+            OBJPOOL_NEXT (obj) = cache->free [type];
+            cache->free [type] = obj;
+            cache->count [type]++;
+            return;
+        }
+        objpool_put (type, obj);
+        return;
+    }
+    free (obj);
+}
+
+
+/* called from the stats thread, only changed counts are sent on */
+void objpool_stats (void)
+{
+    unsigned int type;
+
+    for (type = 0; type < OBJPOOL_TYPES; type++)
+    {
+        objpool_t *p = &objpools [type];
+        unsigned long live = OBJPOOL_GET (p->live);
+        unsigned long pooled = OBJPOOL_GET (p->pooled);
+        char name [40];
+
+        if (live != p->published_live)
+        {
+            snprintf (name, sizeof (name), "pool_%s_live", p->name);
+            stats_event_args (NULL, name, "%lu", live);
+            p->published_live = live;
+        }
+        if (pooled != p->published_pooled)
+        {
+            snprintf (name, sizeof (name), "pool_%s_pooled", p->name);
+            stats_event_args (NULL, name, "%lu", pooled);
+            p->published_pooled = pooled;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* objpool.h
+**
+** free lists for the fixed size objects created per connection
+**
+*/
+#ifndef __OBJPOOL_H__
+#define __OBJPOOL_H__
+
+#include <stddef.h>
+
+typedef enum _objpool_type_tag {
+    OBJPOOL_CLIENT = 0,
+    OBJPOOL_CONNECTION,
+    OBJPOOL_CLIENT_QUEUE,
+    OBJPOOL_AUTH_CLIENT,
+    OBJPOOL_TYPES
+} objpool_type;
+
+void objpool_initialize(void);
+void objpool_shutdown(void);
+
+/* returns a zero filled object of the given type, size must always be the
+ * same for a type. Aborts if out of memory, like refbuf_new() */
+void *objpool_alloc(objpool_type type, size_t size);
+void objpool_free(objpool_type type, void *obj);
+
+/* update the pool_<type>_live and pool_<type>_pooled global stats */
+void objpool_stats(void);
+
+#endif  /* __OBJPOOL_H__ */
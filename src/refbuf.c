@@ -22,6 +22,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+
+#include "common/thread/thread.h"
 
 #include "refbuf.h"
 
@@ -29,69 +32,440 @@
 
 #include "logging.h"
 
+/* queue buffers can be shared by several sender threads of a source, so
+ * reference counting has to be atomic, or serialised where C11 atomics are
+ * not available */
+#ifndef HAVE_STDATOMIC_H
+static spin_t refbuf_count_lock;
+#endif
+
+#ifdef REFBUF_DEBUG
+/* written into released buffers so later use of them can be caught */
+#define REFBUF_FREED    0xdeadbeefU
+
+static spin_t refbuf_debug_lock;
+static unsigned long refbuf_live;
+#endif
+
+/* Buffers are allocated with the payload following the header. Released
+ * buffers are kept on free lists per payload size, first on a short list
+ * for the releasing thread and then on a shared list for each size, so that
+ * the constant churn of stream data does not go back to the allocator.
+ */
+#define REFBUF_POOLS        6
+#define REFBUF_CACHE_MAX    16      /* per thread, for each pool */
+#define REFBUF_POOL_MAX     256     /* shared, for each pool */
+
+#define REFBUF_PAYLOAD(R)   ((char *)((R) + 1))
+
+/* the first pool is of headers only, for slices and buffers whose data is
+ * allocated separately */
+static const unsigned int refbuf_pool_size [REFBUF_POOLS] = { 0, 256, 1024, 4096, 16384, 65536 };
+
+typedef struct refbuf_pool_tag
+{
+    spin_t lock;
+    refbuf_t *free;
+    unsigned int count;
+} refbuf_pool_t;
+
+typedef struct refbuf_cache_tag
+{
+    refbuf_t *free [REFBUF_POOLS];
+    unsigned int count [REFBUF_POOLS];
+} refbuf_cache_t;
+
+static refbuf_pool_t refbuf_pools [REFBUF_POOLS];
+static pthread_key_t refbuf_cache_key;
+static int refbuf_pooling = 0;
+
+
+/* find the pool for a payload of size, REFBUF_POOLS if it is too large */
+static unsigned int refbuf_pool (unsigned int size)
+{
+    unsigned int pool = 0;
+
+    while (pool < REFBUF_POOLS && refbuf_pool_size [pool] < size)
+        pool++;
+    return pool;
+}
+
+
+/* hand a buffer to the shared pool, or back to the allocator if full */
+static void refbuf_pool_put (unsigned int pool, refbuf_t *refbuf)
+{
+    refbuf_pool_t *p = &refbuf_pools [pool];
+
+    thread_spin_lock (&p->lock);
+    if (p->count < REFBUF_POOL_MAX)
+    {
+        refbuf->next = p->free;
+        p->free = refbuf;
+        p->count++;
+        refbuf = NULL;
+    }
+    thread_spin_unlock (&p->lock);
+    free (refbuf);
+}
+
+
+/* thread exit, pass any cached buffers on to the shared pools */
+static void refbuf_cache_release (void *arg)
+{
+    refbuf_cache_t *cache = arg;
+    unsigned int pool;
+
+    for (pool = 0; pool < REFBUF_POOLS; pool++)
+    {
+        while (cache->free [pool])
+        {
+            refbuf_t *refbuf = cache->free [pool];
+
+            cache->free [pool] = refbuf->next;
+            if (refbuf_pooling)
+                refbuf_pool_put (pool, refbuf);
+            else
+                free (refbuf);
+        }
+    }
+    free (cache);
+}
+
+
+static refbuf_cache_t *refbuf_get_cache (void)
+{
+    refbuf_cache_t *cache = pthread_getspecific (refbuf_cache_key);
+
+    if (cache == NULL)
+    {
+        cache = calloc (1, sizeof (refbuf_cache_t));
+        if (cache && pthread_setspecific (refbuf_cache_key, cache) != 0)
+        {
+            free (cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+
+static refbuf_t *refbuf_alloc (unsigned int size)
+{
+    unsigned int pool = refbuf_pool (size);
+    refbuf_t *refbuf = NULL;
+
+    if (pool < REFBUF_POOLS)
+    {
+        size = refbuf_pool_size [pool];
+        if (refbuf_pooling)
+        {
+            refbuf_cache_t *cache = refbuf_get_cache ();
+
+            if (cache && cache->free [pool])
+            {
+                refbuf = cache->free [pool];
+                cache->free [pool] = refbuf->next;
+                cache->count [pool]--;
+            }
+            else
+            {
+                refbuf_pool_t *p = &refbuf_pools [pool];
+
+                thread_spin_lock (&p->lock);
+                refbuf = p->free;
+                if (refbuf)
+                {
+                    p->free = refbuf->next;
+                    p->count--;
+                }
+                thread_spin_unlock (&p->lock);
+            }
+        }
+    }
+    if (refbuf == NULL)
+    {
+        refbuf = malloc (sizeof (refbuf_t) + size);
+        if (refbuf == NULL)
+            abort();
+        refbuf->_size = size;
+    }
+    return refbuf;
+}
+
+
+static void refbuf_free (refbuf_t *self)
+{
+    unsigned int pool = refbuf_pool (self->_size);
+
+    if (self->data != REFBUF_PAYLOAD (self))
+        free (self->data);
+    if (pool < REFBUF_POOLS && refbuf_pooling)
+    {
+        refbuf_cache_t *cache = refbuf_get_cache ();
+
+        if (cache && cache->count [pool] < REFBUF_CACHE_MAX)
+        {
+            self->next = cache->free [pool];
+            cache->free [pool] = self;
+            cache->count [pool]++;
+            return;
+        }
+        refbuf_pool_put (pool, self);
+        return;
+    }
+    free (self);
+}
+
 
 void refbuf_initialize(void)
 {
+    unsigned int pool;
+
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_create(&refbuf_count_lock);
+#endif
+#ifdef REFBUF_DEBUG
+    thread_spin_create(&refbuf_debug_lock);
+    refbuf_live = 0;
+#endif
+    for (pool = 0; pool < REFBUF_POOLS; pool++)
+        thread_spin_create (&refbuf_pools [pool].lock);
+    if (pthread_key_create (&refbuf_cache_key, refbuf_cache_release) == 0)
+        refbuf_pooling = 1;
 }
 
 void refbuf_shutdown(void)
 {
+    unsigned int pool;
+
+    if (refbuf_pooling)
+    {
+        refbuf_cache_t *cache = pthread_getspecific (refbuf_cache_key);
+
+        refbuf_pooling = 0;
+        if (cache)
+        {
+            pthread_setspecific (refbuf_cache_key, NULL);
+            refbuf_cache_release (cache);
+        }
+        pthread_key_delete (refbuf_cache_key);
+    }
+    for (pool = 0; pool < REFBUF_POOLS; pool++)
+    {
+        refbuf_pool_t *p = &refbuf_pools [pool];
+
+        while (p->free)
+        {
+            refbuf_t *refbuf = p->free;
+
+            p->free = refbuf->next;
+            free (refbuf);
+        }
+        p->count = 0;
+        thread_spin_destroy (&p->lock);
+    }
+#ifdef REFBUF_DEBUG
+    if (refbuf_live)
+        ICECAST_LOG_WARN("%lu refbufs still referenced at shutdown", refbuf_live);
+    thread_spin_destroy(&refbuf_debug_lock);
+#endif
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy(&refbuf_count_lock);
+#endif
 }
 
 refbuf_t *refbuf_new (unsigned int size)
 {
-    refbuf_t *refbuf;
+    refbuf_t *refbuf = refbuf_alloc (size);
 
-    refbuf = (refbuf_t *)malloc(sizeof(refbuf_t));
-    if (refbuf == NULL)
-        abort();
     refbuf->data = NULL;
     if (size)
-    {
-        refbuf->data = malloc (size);
-        if (refbuf->data == NULL)
-            abort();
-    }
+        refbuf->data = REFBUF_PAYLOAD (refbuf);
     refbuf->len = size;
     refbuf->sync_point = 0;
+    refbuf->seq = 0;
+    refbuf->arrival = 0;
+#ifdef HAVE_STDATOMIC_H
+    atomic_init (&refbuf->_count, 1);
+#else
     refbuf->_count = 1;
+#endif
     refbuf->next = NULL;
     refbuf->associated = NULL;
+    refbuf->_parent = NULL;
+#ifdef REFBUF_DEBUG
+    thread_spin_lock (&refbuf_debug_lock);
+    refbuf_live++;
+    thread_spin_unlock (&refbuf_debug_lock);
+#endif
 
     return refbuf;
 }
 
+/* a buffer for len bytes of another from offset, sharing its data rather
+ * than copying it. The other is kept until the slice is released */
+refbuf_t *refbuf_slice (refbuf_t *parent, unsigned int offset, unsigned int len)
+{
+    refbuf_t *refbuf = refbuf_new (0);
+
+    refbuf_addref (parent);
+    refbuf->_parent = parent;
+    refbuf->data = parent->data + offset;
+    refbuf->len = len;
+    return refbuf;
+}
+
+/* change the payload to size bytes, keeping the current contents up to
+ * the smaller of the two lengths. Returns 0 on success, -1 if memory could
+ * not be allocated, in which case the buffer is unchanged */
+int refbuf_resize (refbuf_t *self, unsigned int size)
+{
+    char *data;
+
+    if (self->_parent)
+    {
+        /* a slice gets a copy of its own */
+        data = malloc (size);
+        if (data == NULL)
+            return -1;
+        memcpy (data, self->data, self->len < size ? self->len : size);
+        refbuf_release (self->_parent);
+        self->_parent = NULL;
+    }
+    else if (self->data == REFBUF_PAYLOAD (self))
+    {
+        if (size <= self->_size)
+        {
+            self->len = size;
+            return 0;
+        }
+        data = malloc (size);
+        if (data == NULL)
+            return -1;
+        memcpy (data, self->data, self->len < size ? self->len : size);
+    }
+    else
+    {
+        data = realloc (self->data, size);
+        if (data == NULL)
+            return -1;
+    }
+    self->data = data;
+    self->len = size;
+    return 0;
+}
+
+#ifdef REFBUF_DEBUG
+/* catch references taken or dropped on a buffer which has already gone */
+static void refbuf_check (refbuf_t *self, unsigned int count, const char *action)
+{
+    if (count == 0 || count == REFBUF_FREED)
+    {
+        ICECAST_LOG_ERROR("refbuf %p %s with count %u", self, action, count);
+        abort();
+    }
+}
+#endif
+
 void refbuf_addref(refbuf_t *self)
 {
-    self->_count++;
+    unsigned int count;
+
+#ifdef HAVE_STDATOMIC_H
+    count = atomic_fetch_add_explicit (&self->_count, 1, memory_order_relaxed);
+#else
+    thread_spin_lock(&refbuf_count_lock);
+    count = self->_count++;
+    thread_spin_unlock(&refbuf_count_lock);
+#endif
+#ifdef REFBUF_DEBUG
+    refbuf_check (self, count, "referenced");
+#endif
+    (void)count;
 }
 
+/* drop a reference, returning the number left. When none are left the
+ * caller is responsible for the buffer */
+static unsigned int refbuf_unref (refbuf_t *self)
+{
+    unsigned int count;
+
+#ifdef HAVE_STDATOMIC_H
+    count = atomic_fetch_sub_explicit (&self->_count, 1, memory_order_release);
+    if (count == 1)
+        atomic_thread_fence (memory_order_acquire);
+#else
+    thread_spin_lock(&refbuf_count_lock);
+    count = self->_count--;
+    thread_spin_unlock(&refbuf_count_lock);
+#endif
+#ifdef REFBUF_DEBUG
+    refbuf_check (self, count, "released");
+#endif
+    return count - 1;
+}
+
+unsigned int refbuf_refcount(refbuf_t *self)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_load_explicit (&self->_count, memory_order_acquire);
+#else
+    unsigned int count;
+
+    thread_spin_lock(&refbuf_count_lock);
+    count = self->_count;
+    thread_spin_unlock(&refbuf_count_lock);
+    return count;
+#endif
+}
+
+static void refbuf_destroy (refbuf_t *self);
+
+/* the associated chain is linked by next, each one is only unlinked by
+ * whoever drops the last reference to it */
 static void refbuf_release_associated (refbuf_t *ref)
 {
-    if (ref == NULL)
-        return;
     while (ref)
     {
         refbuf_t *to_go = ref;
+
         ref = to_go->next;
-        if ( to_go->_count == 1 )
+        if (refbuf_unref (to_go) == 0)
+        {
             to_go->next = NULL;
-        refbuf_release (to_go);
+            refbuf_destroy (to_go);
+        }
     }
 }
 
-void refbuf_release(refbuf_t *self)
+static void refbuf_destroy (refbuf_t *self)
 {
-    if (self == NULL)
-        return;
-    self->_count--;
-    if (self->_count == 0)
+    refbuf_release_associated (self->associated);
+    if (self->_parent)
     {
-        refbuf_release_associated (self->associated);
-        if (self->next)
-            ICECAST_LOG_ERROR("next not null");
-        free(self->data);
-        free(self);
+        refbuf_release (self->_parent);
+        self->_parent = NULL;
+        self->data = NULL;
     }
+    if (self->next)
+        ICECAST_LOG_ERROR("next not null");
+#ifdef REFBUF_DEBUG
+#ifdef HAVE_STDATOMIC_H
+    atomic_store (&self->_count, REFBUF_FREED);
+#else
+    self->_count = REFBUF_FREED;
+#endif
+    thread_spin_lock (&refbuf_debug_lock);
+    refbuf_live--;
+    thread_spin_unlock (&refbuf_debug_lock);
+#endif
+    refbuf_free (self);
 }
 
+void refbuf_release(refbuf_t *self)
+{
+    if (self == NULL)
+        return;
+    if (refbuf_unref (self) == 0)
+        refbuf_destroy (self);
+}
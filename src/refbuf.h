@@ -18,23 +18,48 @@
 #ifndef __REFBUF_H__
 #define __REFBUF_H__
 
+#include "compat.h"
+
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+typedef atomic_uint refbuf_count_t;
+#else
+typedef unsigned int refbuf_count_t;
+#endif
+
 typedef struct _refbuf_tag
 {
     unsigned int len;
-    unsigned int _count;
+    refbuf_count_t _count;
     char *data;
     struct _refbuf_tag *associated;
     struct _refbuf_tag *next;
     int sync_point;
 
+    /* monotonic time in ms the source read it, for bursts by duration and
+     * delivery times */
+    uint64_t arrival;
+
+    /* sequence number when on a source queue ring, 0 otherwise */
+    uint64_t seq;
+
+    /* room for the payload allocated along with the header */
+    unsigned int _size;
+
+    /* the buffer holding the data if this is a slice of another */
+    struct _refbuf_tag *_parent;
+
 } refbuf_t;
 
 void refbuf_initialize(void);
 void refbuf_shutdown(void);
 
 refbuf_t *refbuf_new(unsigned int size);
+refbuf_t *refbuf_slice(refbuf_t *parent, unsigned int offset, unsigned int len);
+int refbuf_resize(refbuf_t *self, unsigned int size);
 void refbuf_addref(refbuf_t *self);
 void refbuf_release(refbuf_t *self);
+unsigned int refbuf_refcount(refbuf_t *self);
 
 #define PER_CLIENT_REFBUF_SIZE  4096
 
@@ -0,0 +1,155 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* sendbatch.c
+ **
+ ** batches of listener writes. The writes for many listeners are queued up
+ ** and handed to the kernel in one io_uring submission, the results are
+ ** then picked up in one go. Only available when built with liburing, a
+ ** batch cannot be created otherwise.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "sendbatch.h"
+#include "connection.h"
+#include "logging.h"
+
+#define CATMODULE "sendbatch"
+
+struct send_batch_tag
+{
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    unsigned int count;
+    send_batch_entry_t entries[SEND_BATCH_MAX];
+};
+
+
+/* create a batch, NULL if io_uring is not available */
+send_batch_t *send_batch_new (void)
+{
+#ifdef HAVE_LIBURING
+    send_batch_t *batch = calloc (1, sizeof (send_batch_t));
+    int ret;
+
+    if (batch == NULL)
+        return NULL;
+    ret = io_uring_queue_init (SEND_BATCH_MAX, &batch->ring, 0);
+    if (ret < 0)
+    {
+        ICECAST_LOG_WARN("Unable to set up io_uring: %s", strerror (-ret));
+        free (batch);
+        return NULL;
+    }
+    return batch;
+#else
+    ICECAST_LOG_WARN("io_uring support not built in");
+    return NULL;
+#endif
+}
+
+
+void send_batch_free (send_batch_t *batch)
+{
+    if (batch == NULL)
+        return;
+#ifdef HAVE_LIBURING
+    io_uring_queue_exit (&batch->ring);
+#endif
+    free (batch);
+}
+
+
+/* reserve the next entry for client, the caller fills in iov_count
+ * entries of the vector. NULL if the batch is full */
+send_batch_entry_t *send_batch_add (send_batch_t *batch, client_t *client, unsigned int iov_count)
+{
+    send_batch_entry_t *entry;
+
+    if (batch->count >= SEND_BATCH_MAX || iov_count > FORMAT_MAX_IOV)
+        return NULL;
+    entry = &batch->entries[batch->count++];
+    entry->client = client;
+    memset (&entry->msg, 0, sizeof (entry->msg));
+    entry->msg.msg_iov = entry->iov;
+    entry->msg.msg_iovlen = iov_count;
+    entry->result = -EAGAIN;
+    return entry;
+}
+
+
+/* hand every queued write to the kernel and wait for all of them to
+ * complete. The sockets are non-blocking so none should wait on the
+ * network. Returns the number of entries in the batch.
+ */
+unsigned int send_batch_submit (send_batch_t *batch)
+{
+#ifdef HAVE_LIBURING
+    unsigned int i, done = 0;
+    int ret;
+
+    for (i = 0; i < batch->count; i++)
+    {
+        send_batch_entry_t *entry = &batch->entries[i];
+        struct io_uring_sqe *sqe = io_uring_get_sqe (&batch->ring);
+
+        if (sqe == NULL)
+            break;
+        io_uring_prep_sendmsg (sqe, entry->client->con->sock, &entry->msg, MSG_NOSIGNAL);
+        io_uring_sqe_set_data (sqe, entry);
+    }
+    ret = io_uring_submit_and_wait (&batch->ring, i);
+    if (ret < 0)
+    {
+        ICECAST_LOG_WARN("io_uring submit failed: %s", strerror (-ret));
+        return batch->count;
+    }
+    while (done < (unsigned int)ret)
+    {
+        struct io_uring_cqe *cqe;
+        send_batch_entry_t *entry;
+
+        if (io_uring_wait_cqe (&batch->ring, &cqe) < 0)
+            break;
+        entry = io_uring_cqe_get_data (cqe);
+        entry->result = cqe->res;
+        io_uring_cqe_seen (&batch->ring, cqe);
+        done++;
+    }
+#endif
+    return batch->count;
+}
+
+
+send_batch_entry_t *send_batch_entry (send_batch_t *batch, unsigned int index)
+{
+    return &batch->entries[index];
+}
+
+
+void send_batch_reset (send_batch_t *batch)
+{
+    batch->count = 0;
+}
@@ -0,0 +1,50 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* sendbatch.h
+**
+** batches of listener writes submitted together through io_uring
+**
+*/
+#ifndef __SENDBATCH_H__
+#define __SENDBATCH_H__
+
+#include <sys/types.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "client.h"
+#include "format.h"
+
+#define SEND_BATCH_MAX          64
+
+typedef struct send_batch_entry_tag
+{
+    client_t *client;
+    struct iovec iov[FORMAT_MAX_IOV];
+    struct msghdr msg;
+    /* bytes written or a negative errno once submitted */
+    int result;
+} send_batch_entry_t;
+
+typedef struct send_batch_tag send_batch_t;
+
+send_batch_t *send_batch_new (void);
+void send_batch_free (send_batch_t *batch);
+send_batch_entry_t *send_batch_add (send_batch_t *batch, client_t *client, unsigned int iov_count);
+unsigned int send_batch_submit (send_batch_t *batch);
+send_batch_entry_t *send_batch_entry (send_batch_t *batch, unsigned int index);
+void send_batch_reset (send_batch_t *batch);
+
+#endif  /* __SENDBATCH_H__ */
@@ -26,10 +26,29 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#ifdef HAVE_POLL
+#include <sys/poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#include <fcntl.h>
+#include <strings.h>
+#else
+#include <process.h>
+#define strncasecmp strnicmp
+#define getpid _getpid
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifndef _WIN32
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netdb.h>
 #else
 #include <winsock2.h>
 #endif
@@ -41,9 +60,11 @@
 #include "common/avl/avl.h"
 #include "common/net/sock.h"
 #include "common/httpp/httpp.h"
+#include "common/timing/timing.h"
 
 #include "cfgfile.h"
 #include "global.h"
+#include "affinity.h"
 #include "util.h"
 #include "connection.h"
 #include "refbuf.h"
@@ -52,17 +73,97 @@
 #include "logging.h"
 #include "source.h"
 #include "format.h"
+#include "fserve.h"
 
 #define CATMODULE "slave"
 
 static void *_slave_thread(void *arg);
 static thread_type *_slave_thread_id;
 static int slave_running = 0;
+
+static void relay_pools_start (void);
+static void relay_pools_stop (void);
+static void relay_pool_add (relay_server *relay);
+static void relay_pool_wait (relay_server *relay);
+static int  relay_parked_step (relay_server *relay, uint64_t now, int readable);
 static volatile int update_settings = 0;
 static volatile int update_all_mounts = 0;
+static config_reload_diff_t *update_mounts = NULL; // mounts a reload changed
 static volatile unsigned int max_interval = 0;
 static mutex_t _slave_mutex; // protects update_settings, update_all_mounts, max_interval
 
+/* entity tag of the last stream list applied from the master, only used
+ * by the slave thread */
+static char master_etag[40];
+static char master_etag_host[256];
+
+/* slaves that report their load when fetching the stream list, listeners
+ * can be sent to these when this server is busy */
+typedef struct redirect_host_tag
+{
+    char *ip;
+    char *server;
+    int port;
+    int clients;
+    int limit;
+    time_t expires;
+    struct redirect_host_tag *next;
+} redirect_host;
+
+static redirect_host *redirect_hosts;
+static mutex_t _redirect_mutex; // protects redirect_hosts
+
+#define RELAY_CONNECT_TIMEOUT   10
+/* connection attempts the connector works on at once, the rest wait */
+#define RELAY_CONNECT_MAX       16
+/* first retry delay of a failing relay, doubled on each failure */
+#define RELAY_BACKOFF_MIN       2
+
+typedef enum {
+    RELAY_CONNECT_NEW,
+    RELAY_CONNECT_CONNECTING,
+    RELAY_CONNECT_SENDING,
+    RELAY_CONNECT_READING,
+    RELAY_CONNECT_DONE
+} relay_connect_state;
+
+/* a relay connection attempt in the hands of the connector thread */
+typedef struct relay_connect_tag
+{
+    relay_connect_state state;
+    int cancelled;
+    char *localmount;
+    char *server;
+    char *mount;
+    char *bind;         /* local address to connect from, kept over redirects */
+    int port;
+    int redirects;
+    int mp3metadata;
+    char *server_id;
+    char *auth_header;
+    sock_t sock;
+    char *request;
+    unsigned request_len;
+    unsigned request_sent;
+    char header[4096];
+    unsigned header_len;
+    time_t deadline;
+    client_t *client;
+    struct relay_connect_tag *next;
+} relay_connect_t;
+
+static void *_relay_connect_thread(void *arg);
+static thread_type *_connect_thread_id;
+static volatile int _connect_running = 0;
+static relay_connect_t *_connect_list;
+static mutex_t _connect_mutex; // protects _connect_list and the state of its entries
+
+/* idle warm relays handed to the connector, and the hand overs of a relay
+ * between the threads that run it */
+static pthread_mutex_t _park_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _park_cond = PTHREAD_COND_INITIALIZER;
+static relay_server *_parked;
+
 relay_server *relay_free (relay_server *relay)
 {
     relay_server *next = relay->next;
@@ -97,6 +198,7 @@ relay_server *relay_copy (relay_server *r)
         copy->port = r->port;
         copy->mp3metadata = r->mp3metadata;
         copy->on_demand = r->on_demand;
+        copy->on_demand_warm = r->on_demand_warm;
     }
     return copy;
 }
@@ -115,6 +217,27 @@ void slave_update_all_mounts(void)
 }
 
 
+/* After a reload that only changed some mounts, recheck the relays and
+ * update just the sources on those mounts. Takes over diff.
+ */
+void slave_update_changed_mounts(config_reload_diff_t *diff)
+{
+    thread_mutex_lock(&_slave_mutex);
+    max_interval = 0;
+    update_settings = 1;
+    if (update_mounts || update_all_mounts) {
+        /* still pending from before, simpler to do everything */
+        config_reload_diff_free(update_mounts);
+        config_reload_diff_free(diff);
+        update_mounts = NULL;
+        update_all_mounts = 1;
+    } else {
+        update_mounts = diff;
+    }
+    thread_mutex_unlock(&_slave_mutex);
+}
+
+
 /* Request slave thread to check the relay list for changes and to
  * update the stats for the current streams.
  */
@@ -126,6 +249,131 @@ void slave_rebuild_mounts(void)
 }
 
 
+static void redirect_host_free (redirect_host *host)
+{
+    free (host->ip);
+    free (host->server);
+    free (host);
+}
+
+
+/* record the load reported by a slave, the entry lapses if the slave stops
+ * polling for a few intervals
+ */
+void slave_redirect_update (const char *ip, const char *server, int port,
+        int clients, int limit, int interval)
+{
+    redirect_host *host;
+
+    if (server == NULL || port <= 0 || limit <= 0)
+        return;
+    if (interval <= 0)
+        interval = 120;
+
+    thread_mutex_lock (&_redirect_mutex);
+    for (host = redirect_hosts; host; host = host->next)
+        if (host->port == port && strcmp (host->server, server) == 0)
+            break;
+    if (host == NULL)
+    {
+        host = calloc (1, sizeof (redirect_host));
+        if (host == NULL)
+        {
+            thread_mutex_unlock (&_redirect_mutex);
+            return;
+        }
+        ICECAST_LOG_INFO("slave %s:%d (%s) available for redirects", server, port, ip);
+        host->server = strdup (server);
+        host->port = port;
+        host->next = redirect_hosts;
+        redirect_hosts = host;
+    }
+    free (host->ip);
+    host->ip = strdup (ip);
+    host->clients = clients;
+    host->limit = limit;
+    host->expires = time (NULL) + 3 * interval + 10;
+    thread_mutex_unlock (&_redirect_mutex);
+}
+
+
+/* send a listener for the source to the least loaded slave when this server
+ * has reached its redirect threshold or the mount is full, asking for path
+ * there. Returns 0 if the client has been redirected, -1 if it should be
+ * handled here.
+ */
+int slave_redirect_client (source_t *source, client_t *client, const char *path)
+{
+    redirect_host *host, **trail, *best = NULL;
+    ice_config_t *config;
+    int threshold, clients;
+    char location[512];
+    time_t now = time (NULL);
+    ssize_t ret;
+
+    if (redirect_hosts == NULL)
+        return -1;
+    config = config_get_config ();
+    threshold = config->redirect_threshold;
+    config_release_config ();
+    if (threshold <= 0)
+        return -1;
+
+    clients = global_clients ();
+    if (clients <= threshold && (source->max_listeners == -1 ||
+                source->listeners < (unsigned long)source->max_listeners))
+        return -1;
+
+    thread_mutex_lock (&_redirect_mutex);
+    trail = &redirect_hosts;
+    while ((host = *trail))
+    {
+        if (host->expires < now)
+        {
+            ICECAST_LOG_INFO("slave %s:%d no longer available for redirects",
+                    host->server, host->port);
+            *trail = host->next;
+            redirect_host_free (host);
+            continue;
+        }
+        /* a slave relaying from us must not be sent away */
+        if (strcmp (host->ip, client->con->ip) == 0)
+        {
+            best = NULL;
+            break;
+        }
+        if (host->clients < host->limit && (best == NULL ||
+                    (double)host->clients / host->limit < (double)best->clients / best->limit))
+            best = host;
+        trail = &host->next;
+    }
+    if (best)
+    {
+        snprintf (location, sizeof (location), "http://%s:%d%s", best->server,
+                best->port, path);
+        best->clients++; /* until it reports again */
+    }
+    thread_mutex_unlock (&_redirect_mutex);
+    if (best == NULL)
+        return -1;
+
+    ret = util_http_build_header (client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+            0, 302, NULL, NULL, NULL, NULL, NULL, client);
+    if (ret == -1 || ret >= PER_CLIENT_REFBUF_SIZE)
+        return -1;
+    ret += snprintf (client->refbuf->data + ret, PER_CLIENT_REFBUF_SIZE - ret,
+            "Location: %s\r\n\r\n", location);
+    if (ret >= PER_CLIENT_REFBUF_SIZE)
+        return -1;
+    ICECAST_LOG_INFO("redirecting listener on %s to %s", source->mount, location);
+    stats_event_inc (NULL, "listener_redirects");
+    client->refbuf->len = ret;
+    client->respcode = 302;
+    fserve_add_client (client, NULL);
+    return 0;
+}
+
+
 void slave_initialize(void)
 {
     if (slave_running)
@@ -133,7 +381,14 @@ void slave_initialize(void)
 
     slave_running = 1;
     max_interval = 0;
+    /* each slave should pick different retry delays */
+    srand ((unsigned int)time (NULL) ^ (unsigned int)getpid ());
     thread_mutex_create (&_slave_mutex);
+    thread_mutex_create (&_connect_mutex);
+    thread_mutex_create (&_redirect_mutex);
+    _connect_running = 1;
+    relay_pools_start ();
+    _connect_thread_id = thread_create("Relay Connector", _relay_connect_thread, NULL, THREAD_ATTACHED);
     _slave_thread_id = thread_create("Slave Thread", _slave_thread, NULL, THREAD_ATTACHED);
 }
 
@@ -145,216 +400,652 @@ void slave_shutdown(void)
     slave_running = 0;
     ICECAST_LOG_DEBUG("waiting for slave thread");
     thread_join (_slave_thread_id);
+    _connect_running = 0;
+    thread_join (_connect_thread_id);
+    relay_pools_stop ();
+    config_reload_diff_free (update_mounts);
+    update_mounts = NULL;
+
+    thread_mutex_lock (&_redirect_mutex);
+    while (redirect_hosts)
+    {
+        redirect_host *host = redirect_hosts;
+        redirect_hosts = host->next;
+        redirect_host_free (host);
+    }
+    thread_mutex_unlock (&_redirect_mutex);
 }
 
 
-/* Actually open the connection and do some http parsing, handle any 302
- * responses within here.
+/* Relay connections are set up by a single connector thread. Each attempt
+ * is a small state machine driven by poll, so relays that are connecting,
+ * waiting on a slow server or failing do not need a thread of their own.
+ * Attempts are handed back to the slave thread through check_relay_stream,
+ * which starts the relay thread once a client has been created.
  */
-static client_t *open_relay_connection (relay_server *relay)
+static void relay_connect_free (relay_connect_t *c)
 {
-    int redirects = 0;
-    char *server_id = NULL;
+    if (c->sock != SOCK_ERROR)
+        sock_close (c->sock);
+    if (c->client)
+        client_destroy (c->client);
+    free (c->localmount);
+    free (c->server);
+    free (c->mount);
+    free (c->bind);
+    free (c->server_id);
+    free (c->auth_header);
+    free (c->request);
+    free (c);
+}
+
+
+/* queue a new connection attempt for the relay, called with the relay lock */
+static relay_connect_t *relay_connect_start (relay_server *relay)
+{
+    relay_connect_t *c = calloc (1, sizeof (relay_connect_t));
     ice_config_t *config;
-    http_parser_t *parser = NULL;
-    connection_t *con=NULL;
-    char *server = strdup (relay->server);
-    char *mount = strdup (relay->mount);
-    int port = relay->port;
-    char *auth_header;
-    char header[4096];
+
+    if (c == NULL)
+        return NULL;
+    c->state = RELAY_CONNECT_NEW;
+    c->sock = SOCK_ERROR;
+    c->localmount = strdup (relay->localmount);
+    c->server = strdup (relay->server);
+    c->mount = strdup (relay->mount);
+    c->bind = relay->bind ? strdup (relay->bind) : NULL;
+    c->port = relay->port;
+    c->mp3metadata = relay->mp3metadata;
 
     config = config_get_config ();
-    server_id = strdup (config->server_id);
+    c->server_id = strdup (config->server_id);
     config_release_config ();
 
     /* build any authentication header before connecting */
     if (relay->username && relay->password)
     {
-        char *esc_authorisation;
+        char *esc_authorisation, *auth;
         unsigned len = strlen(relay->username) + strlen(relay->password) + 2;
 
-        auth_header = malloc (len);
-        snprintf (auth_header, len, "%s:%s", relay->username, relay->password);
-        esc_authorisation = util_base64_encode(auth_header, len);
-        free(auth_header);
+        auth = malloc (len);
+        snprintf (auth, len, "%s:%s", relay->username, relay->password);
+        esc_authorisation = util_base64_encode(auth, len);
+        free(auth);
         len = strlen (esc_authorisation) + 24;
-        auth_header = malloc (len);
-        snprintf (auth_header, len,
+        c->auth_header = malloc (len);
+        snprintf (c->auth_header, len,
                 "Authorization: Basic %s\r\n", esc_authorisation);
         free(esc_authorisation);
     }
     else
-        auth_header = strdup ("");
+        c->auth_header = strdup ("");
+
+    thread_mutex_lock (&_connect_mutex);
+    c->next = _connect_list;
+    _connect_list = c;
+    thread_mutex_unlock (&_connect_mutex);
+
+    return c;
+}
+
 
-    while (redirects < 10)
+/* collect the outcome of a connection attempt. Returns 1 if the attempt is
+ * still in progress, 0 if it has finished, in which case the client is
+ * returned (NULL on failure) and the attempt is released.
+ */
+static int relay_connect_result (relay_connect_t *c, client_t **client)
+{
+    relay_connect_t **trail;
+
+    thread_mutex_lock (&_connect_mutex);
+    if (c->state != RELAY_CONNECT_DONE)
     {
-        sock_t streamsock;
+        thread_mutex_unlock (&_connect_mutex);
+        return 1;
+    }
+    trail = &_connect_list;
+    while (*trail && *trail != c)
+        trail = &(*trail)->next;
+    if (*trail)
+        *trail = c->next;
+    thread_mutex_unlock (&_connect_mutex);
+
+    *client = c->client;
+    c->client = NULL;
+    relay_connect_free (c);
+    return 0;
+}
 
-        ICECAST_LOG_INFO("connecting to %s:%d", server, port);
 
-        streamsock = sock_connect_wto_bind (server, port, relay->bind, 10);
-        if (streamsock == SOCK_ERROR)
-        {
-            ICECAST_LOG_WARN("Failed to connect to %s:%d", server, port);
-            break;
-        }
-        con = connection_create (streamsock, -1, strdup (server));
+/* abandon a connection attempt, the connector drops it if it is still
+ * working on it
+ */
+static void relay_connect_cancel (relay_connect_t *c)
+{
+    client_t *client;
 
-        /* At this point we may not know if we are relaying an mp3 or vorbis
-         * stream, but only send the icy-metadata header if the relay details
-         * state so (the typical case).  It's harmless in the vorbis case. If
-         * we don't send in this header then relay will not have mp3 metadata.
-         */
-        sock_write(streamsock, "GET %s HTTP/1.0\r\n"
-                "User-Agent: %s\r\n"
-                "Host: %s\r\n"
-                "%s"
-                "%s"
-                "\r\n",
-                mount,
-                server_id,
-                server,
-                relay->mp3metadata?"Icy-MetaData: 1\r\n":"",
-                auth_header);
-        memset (header, 0, sizeof(header));
-        if (util_read_header (con->sock, header, 4096, READ_ENTIRE_HEADER) == 0)
-        {
-            ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", relay->localmount, server, port, mount);
-            break;
-        }
-        parser = httpp_create_parser();
-        httpp_initialize (parser, NULL);
-        if (! httpp_parse_response (parser, header, strlen(header), relay->localmount))
+    thread_mutex_lock (&_connect_mutex);
+    if (c->state != RELAY_CONNECT_DONE)
+    {
+        c->cancelled = 1;
+        thread_mutex_unlock (&_connect_mutex);
+        return;
+    }
+    thread_mutex_unlock (&_connect_mutex);
+    if (relay_connect_result (c, &client) == 0 && client)
+        client_destroy (client);
+}
+
+
+static void relay_connect_done (relay_connect_t *c, client_t *client)
+{
+    if (client == NULL && c->sock != SOCK_ERROR)
+    {
+        sock_close (c->sock);
+        c->sock = SOCK_ERROR;
+    }
+    thread_mutex_lock (&_connect_mutex);
+    c->client = client;
+    c->state = RELAY_CONNECT_DONE;
+    thread_mutex_unlock (&_connect_mutex);
+}
+
+
+/* start a non-blocking connect from the relay's bind address, for hosts
+ * with more than one interface. Only addresses of the same family as the
+ * bind address are tried */
+static sock_t relay_connect_bound (relay_connect_t *c)
+{
+    struct addrinfo hints, *res, *ai, *local;
+    char service[10];
+    sock_t sock = SOCK_ERROR;
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    snprintf (service, sizeof (service), "%d", c->port);
+    if (getaddrinfo (c->server, service, &hints, &res) != 0)
+        return SOCK_ERROR;
+
+    for (ai = res; ai && sock == SOCK_ERROR; ai = ai->ai_next)
+    {
+        hints.ai_family = ai->ai_family;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo (c->bind, NULL, &hints, &local) != 0)
+            continue;
+        sock = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock != SOCK_ERROR)
         {
-            ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", relay->localmount,
-                    server, port, mount);
-            break;
+            if (bind (sock, local->ai_addr, local->ai_addrlen) < 0)
+            {
+                ICECAST_LOG_WARN("Failed to bind to %s for %s:%d", c->bind, c->server, c->port);
+                sock_close (sock);
+                sock = SOCK_ERROR;
+            }
+            else
+            {
+                sock_set_blocking (sock, 0);
+                if (connect (sock, ai->ai_addr, ai->ai_addrlen) < 0 &&
+                        !sock_recoverable (sock_error ()))
+                {
+                    sock_close (sock);
+                    sock = SOCK_ERROR;
+                }
+            }
         }
-        if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
-        {
-            /* better retry the connection again but with different details */
-            const char *uri, *mountpoint;
-            int len;
+        freeaddrinfo (local);
+    }
+    freeaddrinfo (res);
+    return sock;
+}
 
-            uri = httpp_getvar (parser, "location");
-            ICECAST_LOG_INFO("redirect received %s", uri);
-            if (strncmp (uri, "http://", 7) != 0)
-                break;
-            uri += 7;
-            mountpoint = strchr (uri, '/');
-            free (mount);
-            if (mountpoint)
-                mount = strdup (mountpoint);
-            else
-                mount = strdup ("/");
-
-            len = strcspn (uri, ":/");
-            port = 80;
-            if (uri [len] == ':')
-                port = atoi (uri+len+1);
-            free (server);
-            server = calloc (1, len+1);
-            strncpy (server, uri, len);
-            connection_close (con);
+
+static int relay_connect_begin (relay_connect_t *c)
+{
+    unsigned len;
+
+    ICECAST_LOG_INFO("connecting to %s:%d", c->server, c->port);
+
+    if (c->bind)
+        c->sock = relay_connect_bound (c);
+    else
+        c->sock = sock_connect_non_blocking (c->server, c->port);
+    if (c->sock == SOCK_ERROR)
+    {
+        ICECAST_LOG_WARN("Failed to connect to %s:%d", c->server, c->port);
+        return -1;
+    }
+
+    /* At this point we may not know if we are relaying an mp3 or vorbis
+     * stream, but only send the icy-metadata header if the relay details
+     * state so (the typical case).  It's harmless in the vorbis case. If
+     * we don't send in this header then relay will not have mp3 metadata.
+     */
+    len = strlen (c->mount) + strlen (c->server_id) + strlen (c->server) +
+        strlen (c->auth_header) + 80;
+    free (c->request);
+    c->request = malloc (len);
+    snprintf (c->request, len, "GET %s HTTP/1.0\r\n"
+            "User-Agent: %s\r\n"
+            "Host: %s\r\n"
+            "%s"
+            "%s"
+            "\r\n",
+            c->mount,
+            c->server_id,
+            c->server,
+            c->mp3metadata?"Icy-MetaData: 1\r\n":"",
+            c->auth_header);
+    c->request_len = strlen (c->request);
+    c->request_sent = 0;
+    c->header_len = 0;
+    c->state = RELAY_CONNECT_CONNECTING;
+    c->deadline = time (NULL) + RELAY_CONNECT_TIMEOUT;
+    return 0;
+}
+
+
+/* the response headers are complete, either follow a redirect or make
+ * the relay client. Returns 1 if the attempt continues, 0 when done
+ */
+static int relay_connect_response (relay_connect_t *c)
+{
+    http_parser_t *parser;
+    connection_t *con;
+    client_t *client = NULL;
+    unsigned i, len = 0;
+
+    /* drop the CRs, as util_read_header does */
+    for (i = 0; i < c->header_len; i++)
+        if (c->header[i] != '\r')
+            c->header[len++] = c->header[i];
+    c->header[len] = '\0';
+
+    parser = httpp_create_parser();
+    httpp_initialize (parser, NULL);
+    if (! httpp_parse_response (parser, c->header, len, c->localmount))
+    {
+        ICECAST_LOG_ERROR("Error parsing relay request for %s (%s:%d%s)", c->localmount,
+                c->server, c->port, c->mount);
+        httpp_destroy (parser);
+        return 0;
+    }
+    if (strcmp (httpp_getvar (parser, HTTPP_VAR_ERROR_CODE), "302") == 0)
+    {
+        /* better retry the connection again but with different details */
+        const char *uri, *mountpoint;
+
+        uri = httpp_getvar (parser, "location");
+        ICECAST_LOG_INFO("redirect received %s", uri);
+        if (++c->redirects >= 10 || strncmp (uri, "http://", 7) != 0)
+        {
             httpp_destroy (parser);
-            con = NULL;
-            parser = NULL;
+            return 0;
         }
+        uri += 7;
+        mountpoint = strchr (uri, '/');
+        free (c->mount);
+        if (mountpoint)
+            c->mount = strdup (mountpoint);
         else
-        {
-            client_t *client = NULL;
+            c->mount = strdup ("/");
+
+        len = strcspn (uri, ":/");
+        c->port = 80;
+        if (uri [len] == ':')
+            c->port = atoi (uri+len+1);
+        free (c->server);
+        c->server = calloc (1, len+1);
+        strncpy (c->server, uri, len);
+        httpp_destroy (parser);
+        sock_close (c->sock);
+        c->sock = SOCK_ERROR;
+        return relay_connect_begin (c) == 0;
+    }
+    if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+    {
+        ICECAST_LOG_ERROR("Error from relay request: %s (%s)", c->localmount,
+                httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
+        httpp_destroy (parser);
+        return 0;
+    }
+    con = connection_create (c->sock, -1, strdup (c->server));
+    c->sock = SOCK_ERROR;
+    if (client_create (&client, con, parser) < 0)
+    {
+        client_destroy (client);
+        return 0;
+    }
+    client_set_queue (client, NULL);
+    relay_connect_done (c, client);
+    return 1;
+}
 
-            if (httpp_getvar (parser, HTTPP_VAR_ERROR_MESSAGE))
+
+/* find the end of the headers in the newly peeked data, returns the length
+ * of the header block or 0 if it is not complete yet
+ */
+static unsigned relay_header_end (const char *header, unsigned from, unsigned to)
+{
+    unsigned i = from > 2 ? from - 2 : 0;
+
+    for (; i < to; i++)
+    {
+        if (header[i] != '\n')
+            continue;
+        if (i+1 < to && header[i+1] == '\n')
+            return i+2;
+        if (i+2 < to && header[i+1] == '\r' && header[i+2] == '\n')
+            return i+3;
+    }
+    return 0;
+}
+
+
+/* move the attempt on after poll reports activity on its socket. Returns
+ * -1 on failure, 0 otherwise
+ */
+static int relay_connect_process (relay_connect_t *c)
+{
+    int ret;
+
+    switch (c->state)
+    {
+        case RELAY_CONNECT_CONNECTING:
+            ret = sock_connected (c->sock, 0);
+            if (ret == 0 || ret == SOCK_TIMEOUT)
+                return 0;
+            if (ret != 1)
             {
-                ICECAST_LOG_ERROR("Error from relay request: %s (%s)", relay->localmount,
-                        httpp_getvar(parser, HTTPP_VAR_ERROR_MESSAGE));
-                break;
+                ICECAST_LOG_WARN("Failed to connect to %s:%d", c->server, c->port);
+                return -1;
             }
-            global_lock ();
-            if (client_create (&client, con, parser) < 0)
+            c->state = RELAY_CONNECT_SENDING;
+            /* fall through */
+        case RELAY_CONNECT_SENDING:
+            ret = sock_write_bytes (c->sock, c->request + c->request_sent,
+                    c->request_len - c->request_sent);
+            if (ret < 0)
+                return sock_recoverable (sock_error()) ? 0 : -1;
+            c->request_sent += ret;
+            if (c->request_sent < c->request_len)
+                return 0;
+            c->state = RELAY_CONNECT_READING;
+            return 0;
+        case RELAY_CONNECT_READING:
             {
-                global_unlock ();
-                /* make sure only the client_destory frees these */
-                con = NULL;
-                parser = NULL;
-                client_destroy (client);
-                break;
+                unsigned end, take;
+
+                /* peek so that no stream data is read along with the headers */
+                ret = recv (c->sock, c->header + c->header_len,
+                        sizeof (c->header) - 1 - c->header_len, MSG_PEEK);
+                if (ret < 0 && sock_recoverable (sock_error()))
+                    return 0;
+                if (ret <= 0)
+                    break;
+                end = relay_header_end (c->header, c->header_len, c->header_len + ret);
+                take = end ? end - c->header_len : (unsigned)ret;
+                if (recv (c->sock, c->header + c->header_len, take, 0) != (int)take)
+                    break;
+                c->header_len += take;
+                if (end)
+                    return relay_connect_response (c) ? 0 : -1;
+                if (c->header_len >= sizeof (c->header) - 1)
+                    break;
+                return 0;
             }
-            global_unlock ();
-            sock_set_blocking (streamsock, 0);
-            client_set_queue (client, NULL);
-            free (server);
-            free (mount);
-            free (server_id);
-            free (auth_header);
-
-            return client;
-        }
-        redirects++;
-    }
-    /* failed, better clean up */
-    free (server);
-    free (mount);
-    free (server_id);
-    free (auth_header);
-    if (con)
-        connection_close (con);
-    if (parser)
-        httpp_destroy (parser);
-    return NULL;
+        default:
+            return -1;
+    }
+    ICECAST_LOG_ERROR("Header read failed for %s (%s:%d%s)", c->localmount, c->server,
+            c->port, c->mount);
+    return -1;
 }
 
 
-/* This does the actual connection for a relay. A thread is
- * started off if a connection can be acquired
- */
-static void *start_relay_stream (void *arg)
+static void *_relay_connect_thread (void *arg)
 {
-    relay_server *relay = arg;
-    source_t *src = relay->source;
-    client_t *client;
+    relay_connect_t **active = NULL;
+#ifdef HAVE_POLL
+    struct pollfd *ufds = NULL;
+#endif
+    unsigned allocated = 0, idle_count = 0;
+    relay_server *idle = NULL;
 
-    ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", relay->localmount);
-    do
+    (void)arg;
+
+    ICECAST_LOG_DEBUG("relay connector started");
+    while (_connect_running)
     {
-        client = open_relay_connection (relay);
+        relay_connect_t *c, **trail;
+        relay_server *relay, **idle_trail;
+        unsigned count = 0, i, polled = 0, connecting = 0;
+        int ready = 0, wait = 200;
+        time_t now;
+        uint64_t now_ms;
+#ifndef HAVE_POLL
+        fd_set rfds, wfds;
+        struct timeval tv;
+        sock_t max_fd = 0;
+#endif
 
-        if (client == NULL)
-            continue;
+        /* pick up the attempts in progress, dropping any cancelled */
+        thread_mutex_lock (&_connect_mutex);
+        trail = &_connect_list;
+        while ((c = *trail))
+        {
+            if (c->cancelled)
+            {
+                *trail = c->next;
+                relay_connect_free (c);
+                continue;
+            }
+            if (c->state != RELAY_CONNECT_DONE)
+            {
+                if (count == allocated)
+                {
+                    allocated += 8;
+                    active = realloc (active, allocated * sizeof (relay_connect_t *));
+#ifdef HAVE_POLL
+                    ufds = realloc (ufds, allocated * sizeof (struct pollfd));
+#endif
+                }
+                active [count++] = c;
+            }
+            trail = &c->next;
+        }
+        thread_mutex_unlock (&_connect_mutex);
 
-        src->client = client;
-        src->parser = client->parser;
-        src->con = client->con;
+        /* and the idle relays parked since */
+        pthread_mutex_lock (&_park_lock);
+        while ((relay = _parked))
+        {
+            _parked = relay->park_next;
+            relay->park_next = idle;
+            idle = relay;
+            idle_count++;
+        }
+        pthread_mutex_unlock (&_park_lock);
+        if (count + idle_count > allocated)
+        {
+            allocated = count + idle_count + 8;
+            active = realloc (active, allocated * sizeof (relay_connect_t *));
+#ifdef HAVE_POLL
+            ufds = realloc (ufds, allocated * sizeof (struct pollfd));
+#endif
+        }
 
-        if (connection_complete_source (src, 0) < 0)
+        /* start off new attempts and time out stuck ones */
+        now = time (NULL);
+#ifndef HAVE_POLL
+        FD_ZERO (&rfds);
+        FD_ZERO (&wfds);
+#endif
+        for (i = 0; i < count; i++)
+            if (active [i]->state != RELAY_CONNECT_NEW)
+                connecting++;
+        for (i = 0; i < count; i++)
         {
-            ICECAST_LOG_INFO("Failed to complete source initialisation");
-            client_destroy (client);
-            src->client = NULL;
+            c = active [i];
+            if (c->state == RELAY_CONNECT_NEW)
+            {
+                if (connecting >= RELAY_CONNECT_MAX)
+                    continue;
+                connecting++;
+                if (relay_connect_begin (c) < 0)
+                {
+                    relay_connect_done (c, NULL);
+                    continue;
+                }
+            }
+            if (c->deadline < now)
+            {
+                ICECAST_LOG_WARN("Timed out connecting relay %s to %s:%d", c->localmount,
+                        c->server, c->port);
+                relay_connect_done (c, NULL);
+                continue;
+            }
+            active [polled] = c;
+#ifdef HAVE_POLL
+            ufds [polled].fd = c->sock;
+            ufds [polled].events = c->state == RELAY_CONNECT_READING ? POLLIN : POLLOUT;
+            ufds [polled].revents = 0;
+#else
+            FD_SET (c->sock, c->state == RELAY_CONNECT_READING ? &rfds : &wfds);
+            if (c->sock > max_fd)
+                max_fd = c->sock;
+#endif
+            polled++;
+        }
+        /* the parked relays follow the connection attempts */
+        now_ms = timing_get_time ();
+        for (relay = idle, i = polled; relay; relay = relay->park_next, i++)
+        {
+            int fd = source_step_fd (relay->source);
+
+            if (relay->park_due <= now_ms)
+                wait = 0;
+            else if (relay->park_due - now_ms < (uint64_t)wait)
+                wait = (int)(relay->park_due - now_ms);
+#ifdef HAVE_POLL
+            ufds [i].fd = fd;
+            ufds [i].events = POLLIN;
+            ufds [i].revents = 0;
+#else
+            if (fd >= 0)
+            {
+                FD_SET (fd, &rfds);
+                if (fd > max_fd)
+                    max_fd = fd;
+            }
+#endif
+        }
+        if (polled == 0 && idle == NULL)
+        {
+            thread_sleep (200000);
             continue;
         }
-        stats_event_inc(NULL, "source_relay_connections");
-        stats_event (relay->localmount, "source_ip", client->con->ip);
-
-        source_main (relay->source);
+#ifdef HAVE_POLL
+        ready = poll (ufds, polled + idle_count, wait);
+#else
+        tv.tv_sec = 0;
+        tv.tv_usec = wait * 1000;
+        ready = select (max_fd + 1, &rfds, &wfds, NULL, &tv);
+#endif
+        for (i = 0; ready > 0 && i < polled; i++)
+        {
+            c = active [i];
+#ifdef HAVE_POLL
+            if (ufds [i].revents == 0)
+                continue;
+#else
+            if (FD_ISSET (c->sock, &rfds) == 0 && FD_ISSET (c->sock, &wfds) == 0)
+                continue;
+#endif
+            if (relay_connect_process (c) < 0)
+                relay_connect_done (c, NULL);
+        }
 
-        if (relay->on_demand == 0)
+        now_ms = timing_get_time ();
+        idle_trail = &idle;
+        i = polled;
+        while ((relay = *idle_trail))
         {
-            /* only keep refreshing YP entries for inactive on-demand relays */
-            yp_remove (relay->localmount);
-            relay->source->yp_public = -1;
-            relay->start = time(NULL) + 10; /* prevent busy looping if failing */
-            slave_update_all_mounts();
+            int readable = 0;
+
+#ifdef HAVE_POLL
+            readable = ready > 0 && ufds [i].revents;
+#else
+            if (ready > 0 && source_step_fd (relay->source) >= 0)
+                readable = FD_ISSET (source_step_fd (relay->source), &rfds);
+#endif
+            i++;
+            if (relay_parked_step (relay, now_ms, readable) == 0)
+            {
+                idle_trail = &relay->park_next;
+                continue;
+            }
+            *idle_trail = relay->park_next;
+            idle_count--;
         }
+    }
 
-        /* we've finished, now get cleaned up */
-        relay->cleanup = 1;
-        slave_rebuild_mounts();
+    /* the relays are stopped before the connector, but do not leave any
+     * parked ones half way */
+    while (idle)
+    {
+        relay_server *relay = idle;
 
-        return NULL;
-    } while (0); /* TODO allow looping through multiple servers */
+        idle = relay->park_next;
+        relay->source->running = 0;
+        relay_parked_step (relay, 0, 0);
+    }
+
+    /* nothing will collect these now */
+    thread_mutex_lock (&_connect_mutex);
+    while (_connect_list)
+    {
+        relay_connect_t *c = _connect_list;
+        _connect_list = c->next;
+        relay_connect_free (c);
+    }
+    thread_mutex_unlock (&_connect_mutex);
+    free (active);
+#ifdef HAVE_POLL
+    free (ufds);
+#endif
+    ICECAST_LOG_DEBUG("relay connector shutdown complete");
+    return NULL;
+}
 
+
+/* when a failed relay should be tried again. The delay doubles with each
+ * failure up to the master update interval, and is jittered so that relays
+ * which failed together, say on a master restart, do not retry in step.
+ * Called with the relay lock held.
+ */
+static time_t relay_retry_time (relay_server *relay)
+{
+    unsigned int delay = RELAY_BACKOFF_MIN, limit = max_interval;
+
+    if (limit < RELAY_BACKOFF_MIN)
+        limit = RELAY_BACKOFF_MIN;
+    if (relay->failures < 16)
+        delay <<= relay->failures;
+    else
+        delay = limit;
+    if (delay > limit)
+        delay = limit;
+    relay->failures++;
+
+    return time(NULL) + delay/2 + rand() % (delay/2 + 1);
+}
+
+
+/* move the listeners of a failed relay to any fallback and release the source */
+static void relay_failed (relay_server *relay)
+{
     if (relay->source->fallback_mount)
     {
         source_t *fallback_source;
@@ -370,12 +1061,164 @@ static void *start_relay_stream (void *arg)
     }
 
     source_clear_source(relay->source);
+}
+
+
+/* Complete the source of a relay the connector has acquired a connection
+ * for, the client is already attached to the source. Returns -1 if the
+ * stream cannot be used.
+ */
+static int relay_stream_begin (relay_server *relay)
+{
+    source_t *src = relay->source;
+    client_t *client = src->client;
+
+    ICECAST_LOG_INFO("Starting relayed source at mountpoint \"%s\"", relay->localmount);
+    if (connection_complete_source (src, 0) < 0)
+    {
+        ICECAST_LOG_INFO("Failed to complete source initialisation");
+        client_destroy (client);
+        src->client = NULL;
+        return -1;
+    }
+    relay->failures = 0;
+    stats_event_inc(NULL, "source_relay_connections");
+    stats_event (relay->localmount, "source_ip", client->con->ip);
+    return 0;
+}
+
+
+/* the relay source has stopped, leave it for the slave thread to clean up */
+static void relay_stream_finished (relay_server *relay)
+{
+    if (relay->on_demand == 0)
+    {
+        /* only keep refreshing YP entries for inactive on-demand relays */
+        yp_remove (relay->localmount);
+        relay->source->yp_public = -1;
+        relay->start = time(NULL) + 10; /* prevent busy looping if failing */
+        slave_update_all_mounts();
+    }
+
+    /* we've finished, now get cleaned up */
+    relay->cleanup = 1;
+    slave_rebuild_mounts();
+    pthread_mutex_lock (&_park_lock);
+    relay->streaming = 0;
+    pthread_cond_broadcast (&_park_cond);
+    pthread_mutex_unlock (&_park_lock);
+}
+
+
+/* A warm on-demand relay without listeners only has to keep its burst
+ * data rolling, so rather than hold a thread of its own or a place in a
+ * pool it is parked with the connector, which steps it along with the
+ * connection attempts. It is handed back as soon as it has a listener.
+ */
+static int relay_stream_idle (relay_server *relay)
+{
+    source_t *src = relay->source;
+
+    return relay->on_demand && src->on_demand_warm && src->running &&
+        src->listeners == 0 && global.running == ICECAST_RUNNING;
+}
+
+
+/* hand the relay over to the connector, next is the ms until its step */
+static void relay_park (relay_server *relay, int next)
+{
+    ICECAST_LOG_DEBUG("parking idle relay \"%s\"", relay->localmount);
+    pthread_mutex_lock (&_park_lock);
+    relay->park_due = timing_get_time () + next;
+    relay->park_next = _parked;
+    _parked = relay;
+    pthread_mutex_unlock (&_park_lock);
+}
+
+
+/* wait for whichever thread has the relay to be finished with it, the
+ * source has been told to stop or has stopped */
+static void relay_stream_wait (relay_server *relay)
+{
+    thread_type *thread;
+
+    pthread_mutex_lock (&_park_lock);
+    while (relay->streaming)
+        pthread_cond_wait (&_park_cond, &_park_lock);
+    thread = relay->thread;
+    relay->thread = NULL;
+    pthread_mutex_unlock (&_park_lock);
+    if (thread)
+    {
+        ICECAST_LOG_DEBUG("waiting for relay thread for \"%s\"", relay->localmount);
+        thread_join (thread);
+    }
+    relay_pool_wait (relay);
+}
+
+
+/* run the source from this thread until it stops or goes idle */
+static void relay_stream_run (relay_server *relay)
+{
+    source_t *src = relay->source;
+    int next;
+
+    if (src->stepped == 0)
+        source_step_start (src);
+    while ((next = source_step (src)) >= 0)
+    {
+        int fd;
+
+        if (relay_stream_idle (relay))
+        {
+            relay_park (relay, next);
+            return;
+        }
+        if (next == 0)
+            continue;
+        fd = source_step_fd (src);
+        if (fd >= 0)
+            util_timed_wait_for_fd (fd, next);
+        else
+            thread_sleep (next * 1000);
+    }
+    relay_stream_finished (relay);
+}
+
+
+static void *resume_relay_stream (void *arg)
+{
+    affinity_apply (AFFINITY_RELAY);
+    relay_stream_run (arg);
+    return NULL;
+}
+
+
+/* This runs the relay in a thread of its own once the connector has
+ * acquired a connection.
+ */
+static void *start_relay_stream (void *arg)
+{
+    relay_server *relay = arg;
+
+    affinity_apply (AFFINITY_RELAY);
+    if (relay_stream_begin (relay) == 0)
+    {
+        relay_stream_run (relay);
+        return NULL;
+    }
+
+    relay_failed (relay);
+    pthread_mutex_lock (&_park_lock);
+    relay->streaming = 0;
+    pthread_cond_broadcast (&_park_cond);
+    pthread_mutex_unlock (&_park_lock);
 
     /* cleanup relay, but prevent this relay from starting up again too soon */
     thread_mutex_lock(&_slave_mutex);
     thread_mutex_lock(&(config_locks()->relay_lock));
     relay->source->on_demand = 0;
-    relay->start = time(NULL) + max_interval;
+    relay->start = relay_retry_time (relay);
     relay->cleanup = 1;
     thread_mutex_unlock(&(config_locks()->relay_lock));
     thread_mutex_unlock(&_slave_mutex);
@@ -384,6 +1227,322 @@ static void *start_relay_stream (void *arg)
 }
 
 
+/* With <relay-threads> set, active relays are run by a few pool threads
+ * between them instead of a thread each. A pool thread waits on the
+ * sockets of all its relays with epoll, and runs a step of a relay when it
+ * has data to read or listeners to write to, or when its timer is due. New
+ * relays go to the pool with the fewest.
+ */
+#define RELAY_POOL_EVENTS   64
+
+typedef struct relay_pool_tag
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;   /* a relay has been finished with */
+    relay_server *pending;      /* handed over, under the lock */
+    unsigned int count;         /* relays on it, under the lock */
+    int running;
+    relay_server *relays;       /* belong to the thread */
+    int poll_fd;
+    int wake[2];
+    thread_type *thread;
+} relay_pool_t;
+
+static relay_pool_t *_relay_pools;
+static unsigned int _relay_pool_count;
+
+
+#ifdef HAVE_SYS_EPOLL_H
+/* take on a relay handed to the pool, its source is started here */
+static void relay_pool_adopt (relay_pool_t *pool, relay_server *relay)
+{
+    struct epoll_event event;
+
+    if (relay->source->stepped == 0)
+        source_step_start (relay->source);
+    relay->pool_fd = source_step_fd (relay->source);
+    relay->pool_due = 0;
+    if (relay->pool_fd >= 0)
+    {
+        memset (&event, 0, sizeof (event));
+        event.events = EPOLLIN;
+        event.data.ptr = relay;
+        if (epoll_ctl (pool->poll_fd, EPOLL_CTL_ADD, relay->pool_fd, &event) < 0)
+        {
+            ICECAST_LOG_WARN("Unable to wait on relay \"%s\", running it on a timer", relay->localmount);
+            relay->pool_fd = -1;
+        }
+    }
+    relay->pool_next = pool->relays;
+    pool->relays = relay;
+}
+
+
+/* the source of the relay has stopped, after this the relay is not ours */
+static void relay_pool_finish (relay_pool_t *pool, relay_server *relay)
+{
+    relay_stream_finished (relay);
+    pthread_mutex_lock (&pool->lock);
+    pool->count--;
+    relay->pool_done = 1;
+    pthread_cond_broadcast (&pool->done_cond);
+    pthread_mutex_unlock (&pool->lock);
+}
+
+
+static void *relay_pool_thread (void *arg)
+{
+    relay_pool_t *pool = arg;
+    struct epoll_event events[RELAY_POOL_EVENTS];
+
+    affinity_apply (AFFINITY_RELAY);
+    while (1)
+    {
+        relay_server *relay, **trail;
+        uint64_t now;
+        int i, count, wait = 250;
+        char buf[16];
+
+        pthread_mutex_lock (&pool->lock);
+        if (pool->running == 0 && pool->relays == NULL && pool->pending == NULL)
+        {
+            pthread_mutex_unlock (&pool->lock);
+            break;
+        }
+        relay = pool->pending;
+        pool->pending = NULL;
+        pthread_mutex_unlock (&pool->lock);
+        while (relay)
+        {
+            relay_server *next = relay->pool_next;
+
+            relay_pool_adopt (pool, relay);
+            relay = next;
+        }
+
+        now = timing_get_time ();
+        for (relay = pool->relays; relay && wait; relay = relay->pool_next)
+        {
+            if (relay->pool_due <= now)
+                wait = 0;
+            else if (relay->pool_due - now < (uint64_t)wait)
+                wait = (int)(relay->pool_due - now);
+        }
+        count = epoll_wait (pool->poll_fd, events, RELAY_POOL_EVENTS, wait);
+        for (i = 0; i < count; i++)
+        {
+            relay = events[i].data.ptr;
+            if (relay)
+                relay->pool_due = 0;
+            else
+                while (read (pool->wake[0], buf, sizeof (buf)) > 0)
+                    ;
+        }
+
+        now = timing_get_time ();
+        trail = &pool->relays;
+        while ((relay = *trail))
+        {
+            int next;
+
+            if (relay->pool_due > now)
+            {
+                trail = &relay->pool_next;
+                continue;
+            }
+            /* the descriptors go with the shutdown, so stop waiting first */
+            if (relay->pool_fd >= 0 && (relay->source->running == 0 || global.running != ICECAST_RUNNING))
+            {
+                epoll_ctl (pool->poll_fd, EPOLL_CTL_DEL, relay->pool_fd, NULL);
+                relay->pool_fd = -1;
+            }
+            next = source_step (relay->source);
+            if (next < 0)
+            {
+                *trail = relay->pool_next;
+                if (relay->pool_fd >= 0)
+                    epoll_ctl (pool->poll_fd, EPOLL_CTL_DEL, relay->pool_fd, NULL);
+                relay_pool_finish (pool, relay);
+                continue;
+            }
+            if (relay_stream_idle (relay))
+            {
+                /* nothing to send, the connector can keep it going */
+                *trail = relay->pool_next;
+                if (relay->pool_fd >= 0)
+                    epoll_ctl (pool->poll_fd, EPOLL_CTL_DEL, relay->pool_fd, NULL);
+                pthread_mutex_lock (&pool->lock);
+                pool->count--;
+                pthread_mutex_unlock (&pool->lock);
+                relay->pool = NULL;
+                relay_park (relay, next);
+                continue;
+            }
+            relay->pool_due = now + next;
+            trail = &relay->pool_next;
+        }
+    }
+    return NULL;
+}
+#endif
+
+
+static void relay_pools_start (void)
+{
+    ice_config_t *config = config_get_config ();
+    unsigned int i, count = config->relay_threads > 0 ? config->relay_threads : 0;
+
+    config_release_config ();
+    _relay_pool_count = 0;
+    if (count == 0)
+        return;
+#ifdef HAVE_SYS_EPOLL_H
+    _relay_pools = calloc (count, sizeof (relay_pool_t));
+    if (_relay_pools == NULL)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        relay_pool_t *pool = &_relay_pools[i];
+        struct epoll_event event;
+
+        pthread_mutex_init (&pool->lock, NULL);
+        pthread_cond_init (&pool->done_cond, NULL);
+        pool->running = 1;
+        pool->wake[0] = pool->wake[1] = -1;
+        pool->poll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        memset (&event, 0, sizeof (event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (pool->poll_fd < 0 || pipe (pool->wake) < 0 ||
+                fcntl (pool->wake[0], F_SETFL, O_NONBLOCK) < 0 ||
+                fcntl (pool->wake[1], F_SETFL, O_NONBLOCK) < 0 ||
+                epoll_ctl (pool->poll_fd, EPOLL_CTL_ADD, pool->wake[0], &event) < 0)
+        {
+            ICECAST_LOG_WARN("Unable to set up relay thread pool, relays run in threads of their own");
+            _relay_pool_count = i + 1;
+            relay_pools_stop ();
+            return;
+        }
+        pool->thread = thread_create ("Relay Pool Thread", relay_pool_thread, pool, THREAD_ATTACHED);
+    }
+    _relay_pool_count = count;
+    ICECAST_LOG_INFO("relays run by %u pool thread%s", count, count == 1 ? "" : "s");
+#else
+    (void)i;
+    ICECAST_LOG_WARN("relay-threads needs epoll, relays run in threads of their own");
+#endif
+}
+
+
+/* the relays have all been stopped by now */
+static void relay_pools_stop (void)
+{
+    unsigned int i;
+
+    for (i = 0; i < _relay_pool_count; i++)
+    {
+        relay_pool_t *pool = &_relay_pools[i];
+
+        pthread_mutex_lock (&pool->lock);
+        pool->running = 0;
+        pthread_mutex_unlock (&pool->lock);
+        if (pool->wake[1] >= 0 && write (pool->wake[1], "", 1) < 0)
+            ICECAST_LOG_DEBUG("unable to wake relay pool thread");
+        if (pool->thread)
+            thread_join (pool->thread);
+        if (pool->poll_fd >= 0)
+            close (pool->poll_fd);
+        if (pool->wake[0] >= 0)
+            close (pool->wake[0]);
+        if (pool->wake[1] >= 0)
+            close (pool->wake[1]);
+        pthread_cond_destroy (&pool->done_cond);
+        pthread_mutex_destroy (&pool->lock);
+    }
+    free (_relay_pools);
+    _relay_pools = NULL;
+    _relay_pool_count = 0;
+}
+
+
+/* hand a relay with a completed source to the pool with the fewest */
+static void relay_pool_add (relay_server *relay)
+{
+    relay_pool_t *pool = &_relay_pools[0];
+    unsigned int i;
+
+    for (i = 1; i < _relay_pool_count; i++)
+        if (_relay_pools[i].count < pool->count)
+            pool = &_relay_pools[i];
+    pthread_mutex_lock (&pool->lock);
+    relay->pool = pool;
+    relay->pool_done = 0;
+    relay->pool_next = pool->pending;
+    pool->pending = relay;
+    pool->count++;
+    pthread_mutex_unlock (&pool->lock);
+    if (write (pool->wake[1], "", 1) < 0)
+        ICECAST_LOG_DEBUG("unable to wake relay pool thread");
+}
+
+
+/* wait for a pool thread to be finished with the relay, the source has
+ * been told to stop or has stopped */
+static void relay_pool_wait (relay_server *relay)
+{
+    relay_pool_t *pool = relay->pool;
+
+    if (pool == NULL)
+        return;
+    ICECAST_LOG_DEBUG("waiting for relay pool on \"%s\"", relay->localmount);
+    pthread_mutex_lock (&pool->lock);
+    while (relay->pool_done == 0)
+        pthread_cond_wait (&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock (&pool->lock);
+    relay->pool = NULL;
+}
+
+
+/* Step a relay parked with the connector if it has data or it is due.
+ * Returns 0 if it stays parked, otherwise it has been handed back to a
+ * thread or the stream has finished.
+ */
+static int relay_parked_step (relay_server *relay, uint64_t now, int readable)
+{
+    thread_type *previous = NULL;
+    int next;
+
+    if (readable == 0 && relay->park_due > now)
+        return 0;
+    next = source_step (relay->source);
+    if (next < 0)
+    {
+        relay_stream_finished (relay);
+        return -1;
+    }
+    if (relay_stream_idle (relay))
+    {
+        relay->park_due = now + next;
+        return 0;
+    }
+    ICECAST_LOG_DEBUG("resuming relay \"%s\" for its listeners", relay->localmount);
+    pthread_mutex_lock (&_park_lock);
+    if (_relay_pool_count)
+        relay_pool_add (relay);
+    else
+    {
+        /* the thread which parked it has returned by now */
+        previous = relay->thread;
+        relay->thread = thread_create ("Relay Thread", resume_relay_stream,
+                relay, THREAD_ATTACHED);
+    }
+    pthread_mutex_unlock (&_park_lock);
+    if (previous)
+        thread_join (previous);
+    return 1;
+}
+
+
 /* wrapper for starting the provided relay stream */
 static void check_relay_stream (relay_server *relay)
 {
@@ -405,6 +1564,7 @@ static void check_relay_stream (relay_server *relay)
                 ice_config_t *config = config_get_config ();
                 mount_proxy *mountinfo = config_find_mount (config, relay->localmount, MOUNT_TYPE_NORMAL);
                 relay->source->on_demand = relay->on_demand;
+                source_routes_changed ();
                 if (mountinfo == NULL)
                     source_update_settings (config, relay->source, mountinfo);
                 config_release_config ();
@@ -432,6 +1592,7 @@ static void check_relay_stream (relay_server *relay)
         if (relay->on_demand && source->on_demand_req == 0)
         {
             relay->source->on_demand = relay->on_demand;
+            source_routes_changed ();
 
             if (source->fallback_mount && source->fallback_override)
             {
@@ -445,26 +1606,64 @@ static void check_relay_stream (relay_server *relay)
                 }
                 avl_tree_unlock (global.source_tree);
             }
-            if (source->on_demand_req == 0)
+            /* a warm relay connects ahead of its first listener */
+            if (source->on_demand_req == 0 && relay->on_demand_warm == 0)
                 break;
         }
 
+        source->on_demand_warm = relay->on_demand ? relay->on_demand_warm : 0;
         relay->start = time(NULL) + 5;
         relay->running = 1;
-        relay->thread = thread_create ("Relay Thread", start_relay_stream,
-                relay, THREAD_ATTACHED);
+        relay->connect = relay_connect_start (relay);
+        if (relay->connect == NULL)
+            relay->cleanup = 1;
         return;
 
     } while (0);
-    /* the relay thread may of shut down itself */
-    if (relay->cleanup)
+    /* the connector may have finished with this relay */
+    if (relay->connect)
     {
-        if (relay->thread)
+        client_t *client;
+
+        if (relay_connect_result (relay->connect, &client) == 0)
         {
-            ICECAST_LOG_DEBUG("waiting for relay thread for \"%s\"", relay->localmount);
-            thread_join (relay->thread);
-            relay->thread = NULL;
+            relay->connect = NULL;
+            if (client)
+            {
+                relay->source->client = client;
+                relay->source->parser = client->parser;
+                relay->source->con = client->con;
+                if (_relay_pool_count == 0)
+                {
+                    pthread_mutex_lock (&_park_lock);
+                    relay->streaming = 1;
+                    relay->thread = thread_create ("Relay Thread", start_relay_stream,
+                            relay, THREAD_ATTACHED);
+                    pthread_mutex_unlock (&_park_lock);
+                }
+                else if (relay_stream_begin (relay) == 0)
+                {
+                    relay->streaming = 1;
+                    relay_pool_add (relay);
+                }
+                else
+                    client = NULL;
+            }
+            if (client == NULL)
+            {
+                relay_failed (relay);
+                /* max_interval is only a hint for the retry, it is read
+                 * without _slave_mutex as the relay lock is already held */
+                relay->source->on_demand = 0;
+                relay->start = relay_retry_time (relay);
+                relay->cleanup = 1;
+            }
         }
+    }
+    /* the relay thread may of shut down itself */
+    if (relay->cleanup)
+    {
+        relay_stream_wait (relay);
         relay->cleanup = 0;
         relay->running = 0;
 
@@ -497,6 +1696,8 @@ static int relay_has_changed (relay_server *new, relay_server *old)
             break;
         if (new->on_demand != old->on_demand)
             old->on_demand = new->on_demand;
+        if (new->on_demand_warm != old->on_demand_warm)
+            old->on_demand_warm = new->on_demand_warm;
         return 0;
     } while (0);
     return 1;
@@ -579,7 +1780,9 @@ static void relay_check_streams (relay_server *to_start,
                 ICECAST_LOG_DEBUG("source shutdown request on \"%s\"", to_free->localmount);
                 to_free->running = 0;
                 to_free->source->running = 0;
-                thread_join (to_free->thread);
+                if (to_free->connect)
+                    relay_connect_cancel (to_free->connect);
+                relay_stream_wait (to_free);
             }
             else
                 stats_event (to_free->localmount, NULL, NULL);
@@ -608,6 +1811,9 @@ static int update_from_master(ice_config_t *config)
     do
     {
         char *authheader, *data;
+        char etag_header[60] = "";
+        char etag[sizeof (master_etag)] = "";
+        char report[320] = "";
         relay_server *new_relays = NULL, *cleanup_relays;
         int len, count = 1;
         int on_demand;
@@ -624,8 +1830,30 @@ static int update_from_master(ice_config_t *config)
         if (password == NULL || master == NULL || port == 0)
             break;
         on_demand = config->on_demand;
+
+        /* tell the master where listeners can be sent and how busy we are */
+        if (config->hostname && strcmp (config->hostname, "localhost") != 0 && config->port > 0)
+        {
+            int clients;
+
+            clients = global_clients ();
+            snprintf (report, sizeof (report), "?rserverip=%s&rport=%d&clients=%d&limit=%d&interval=%d",
+                    config->hostname, config->port, clients, config->client_limit,
+                    config->master_update_interval);
+        }
         ret = 1;
         config_release_config();
+
+        /* only ask for a changed list from the master that sent ours */
+        snprintf (buf, sizeof (buf), "%s:%d", master, port);
+        if (strcmp (buf, master_etag_host) != 0)
+        {
+            snprintf (master_etag_host, sizeof (master_etag_host), "%s", buf);
+            master_etag[0] = '\0';
+        }
+        if (master_etag[0])
+            snprintf (etag_header, sizeof (etag_header), "If-None-Match: %s\r\n", master_etag);
+
         mastersock = sock_connect_wto(master, port, 10);
 
         if (mastersock == SOCK_ERROR)
@@ -639,14 +1867,27 @@ static int update_from_master(ice_config_t *config)
         snprintf (authheader, len, "%s:%s", username, password);
         data = util_base64_encode(authheader, len);
         sock_write (mastersock,
-                "GET /admin/streamlist.txt HTTP/1.0\r\n"
+                "GET /admin/streamlist.txt%s HTTP/1.0\r\n"
                 "Authorization: Basic %s\r\n"
-                "\r\n", data);
+                "%s"
+                "\r\n", report, data, etag_header);
         free(authheader);
         free(data);
 
-        if (sock_read_line(mastersock, buf, sizeof(buf)) == 0 ||
-                strncmp (buf, "HTTP/1.0 200", 12) != 0)
+        if (sock_read_line(mastersock, buf, sizeof(buf)) == 0)
+        {
+            sock_close (mastersock);
+            ICECAST_LOG_WARN("Master rejected streamlist request");
+            break;
+        }
+        if (strncmp (buf, "HTTP/1.0 304", 12) == 0)
+        {
+            /* nothing changed, the current relays stay as they are */
+            sock_close (mastersock);
+            ICECAST_LOG_DEBUG("stream list from master unchanged");
+            break;
+        }
+        if (strncmp (buf, "HTTP/1.0 200", 12) != 0)
         {
             sock_close (mastersock);
             ICECAST_LOG_WARN("Master rejected streamlist request");
@@ -657,6 +1898,13 @@ static int update_from_master(ice_config_t *config)
         {
             if (!strlen(buf))
                 break;
+            if (strncasecmp (buf, "etag:", 5) == 0)
+            {
+                const char *value = buf + 5;
+                while (*value == ' ')
+                    value++;
+                snprintf (etag, sizeof (etag), "%s", value);
+            }
         }
         while (sock_read_line(mastersock, buf, sizeof(buf)))
         {
@@ -705,6 +1953,7 @@ static int update_from_master(ice_config_t *config)
         relay_check_streams (NULL, new_relays, 0);
 
         thread_mutex_unlock (&(config_locks()->relay_lock));
+        memcpy (master_etag, etag, sizeof (master_etag));
 
     } while(0);
 
@@ -749,9 +1998,13 @@ static void *_slave_thread(void *arg)
         }
         global_unlock();
 
+        /* clear old configs that readers have let go of since */
+        config_drop_pin();
+        config_reclaim();
         thread_sleep(1000000);
         if (slave_running == 0)
             break;
+        client_zerocopy_linger_check (0);
 
         ++interval;
 
@@ -791,7 +2044,12 @@ static void *_slave_thread(void *arg)
         thread_mutex_lock(&_slave_mutex);
         if (update_settings)
         {
-            source_recheck_mounts (update_all_mounts);
+            if (update_mounts && !update_all_mounts)
+                source_recheck_changed_mounts (update_mounts);
+            else
+                source_recheck_mounts (update_all_mounts);
+            config_reload_diff_free (update_mounts);
+            update_mounts = NULL;
             update_settings = 0;
             update_all_mounts = 0;
         }
@@ -800,6 +2058,7 @@ static void *_slave_thread(void *arg)
     ICECAST_LOG_INFO("shutting down current relays");
     relay_check_streams (NULL, global.relays, 0);
     relay_check_streams (NULL, global.master_relays, 0);
+    client_zerocopy_linger_check (1);
 
     ICECAST_LOG_INFO("Slave thread shutdown complete");
 
@@ -15,6 +15,9 @@
 
 #include "common/thread/thread.h"
 
+struct _client_tag;
+struct config_reload_diff_tag;
+
 typedef struct _relay_server {
     char *server;
     int port;
@@ -26,18 +29,35 @@ typedef struct _relay_server {
     struct source_tag *source;
     int mp3metadata;
     int on_demand;
+    int on_demand_warm;
     int running;
     int cleanup;
+    unsigned int failures;
     time_t start;
     thread_type *thread;
+    struct relay_connect_tag *connect;
+    /* the pool thread running it instead of a thread of its own */
+    struct relay_pool_tag *pool;
+    struct _relay_server *pool_next;
+    uint64_t pool_due;
+    int pool_fd;
+    int pool_done;
+    /* set while a thread, a pool or the connector runs the source */
+    int streaming;
+    /* parked with the connector while a warm relay has no listeners */
+    struct _relay_server *park_next;
+    uint64_t park_due;
     struct _relay_server *next;
 } relay_server;
 
-
 void slave_initialize(void);
 void slave_shutdown(void);
 void slave_update_all_mounts (void);
 void slave_rebuild_mounts (void);
+void slave_update_changed_mounts (struct config_reload_diff_tag *diff);
+void slave_redirect_update (const char *ip, const char *server, int port,
+        int clients, int limit, int interval);
+int  slave_redirect_client (struct source_tag *source, struct _client_tag *client, const char *path);
 relay_server *relay_free (relay_server *relay);
 
 #endif  /* __SLAVE_H__ */
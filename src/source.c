@@ -22,6 +22,14 @@
 #include <sys/types.h>
 #include <ogg/ogg.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 /* REVIEW: Are all those includes needed? */
 #ifndef _WIN32
@@ -43,6 +51,7 @@
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
+#include "common/timing/timing.h"
 
 #include "connection.h"
 #include "global.h"
@@ -53,10 +62,18 @@
 #include "cfgfile.h"
 #include "util.h"
 #include "source.h"
+#include "sendbatch.h"
+#include "intro.h"
+#include "affinity.h"
+#include "trace.h"
 #include "format.h"
 #include "fserve.h"
+#include "dumpfile.h"
+#include "timeshift.h"
+#include "hls.h"
 #include "auth.h"
 #include "event.h"
+#include "matchfile.h"
 #include "compat.h"
 
 #undef CATMODULE
@@ -66,11 +83,94 @@
 
 mutex_t move_clients_mutex;
 
-/* avl tree helper */
-static int _compare_clients(void *compare_arg, void *a, void *b);
+/* the sources in global.source_tree by mount, for lookups without a tree
+ * walk. Changed along with the tree, under its write lock */
+static source_t **source_hash;
+static size_t source_hash_size;
+static size_t source_hash_count;
+
+/* longest wait in ms for the source in low latency mode, so listeners
+ * waiting for socket space are not left for long without listener events */
+#define SOURCE_LOW_LATENCY_WAIT 20
+
+/* socket limits used by low latency mounts unless set for the mount */
+#define SOURCE_LOW_LATENCY_SNDBUF   16384
+#define SOURCE_LOW_LATENCY_LOWAT    4096
+
+/* queue kept beyond the burst however tight the memory budget */
+#define SOURCE_BUDGET_MIN_QUEUE 65536
+
+/* source_find_mount() results, a fixed table indexed by the mount hash.
+ * An entry is good while the generation is unchanged, which is bumped when
+ * a source may have become usable, a source is added or removed, or the
+ * config is reloaded. A source going down needs no bump as the cached
+ * source is checked to be still running before it is used.
+ */
+#define SOURCE_ROUTE_SLOTS  256
+#define SOURCE_ROUTE_MOUNT  96
+
+typedef struct source_route_tag
+{
+    uint32_t hash;
+    unsigned int generation;
+    source_t *source;
+    char mount [SOURCE_ROUTE_MOUNT];
+} source_route_t;
+
+static source_route_t source_routes [SOURCE_ROUTE_SLOTS];
+static spin_t source_routes_lock;
+#ifdef HAVE_STDATOMIC_H
+static atomic_uint source_routes_generation;
+#else
+static unsigned int source_routes_generation;
+#endif
+
+/* A sender pool splits the listener fan-out of a source over several
+ * threads. The source thread still reads and queues the stream data, then
+ * starts a pass in which every sender (the source thread included) writes
+ * to its share of the listeners. The client list stays write locked by the
+ * source thread for the whole pass so the senders can walk it safely.
+ */
+typedef struct source_sender_tag
+{
+    struct source_sender_pool_tag *pool;
+    unsigned int index;
+    thread_type *thread;
+    send_batch_t *batch;
+} source_sender_t;
+
+/* a pass is started by bumping generation and signalling start_cond, each
+ * sender reports its share done under the lock and the last signals
+ * done_cond. The conditions share the lock so no wakeup is lost */
+typedef struct source_sender_pool_tag
+{
+    source_t *source;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    int running;
+    unsigned int generation;
+    unsigned int pending;
+    int remove_from_q;
+    uint64_t sent_bytes;
+    /* set if any sender left listeners with more to send */
+    int short_delay;
+    unsigned int count;
+    source_sender_t *senders;
+} source_sender_pool_t;
+
 static int _free_client(void *key);
 static void _parse_audio_info (source_t *source, const char *s);
 static void source_shutdown (source_t *source);
+static void source_senders_start (source_t *source);
+static void source_senders_stop (source_t *source);
+static void source_listener_events_start (source_t *source);
+static void source_listener_events_stop (source_t *source);
+static void source_ring_start (source_t *source);
+static void source_ring_stop (source_t *source);
+static void source_burst_advance (source_t *source);
+static void source_hash_insert (source_t *source);
+static void source_hash_remove (source_t *source);
 
 /* Allocate a new source with the stated mountpoint, if one already
  * exists with that mountpoint in the global source tree then return
@@ -98,16 +198,23 @@ source_t *source_reserve (const char *mount)
         if (src == NULL)
             break;
 
-        src->client_tree = avl_tree_new(_compare_clients, NULL);
-        src->pending_tree = avl_tree_new(_compare_clients, NULL);
+        listener_list_init (&src->client_list);
+        listener_queue_init (&src->pending);
         src->history = playlist_new(4 /* DOCUMENT: default is max_tracks=4. */);
 
         /* make duplicates for strings or similar */
         src->mount = strdup(mount);
         src->max_listeners = -1;
         thread_mutex_create(&src->lock);
+        thread_mutex_create(&src->intro_lock);
+        thread_mutex_create(&src->burst_lock);
+        thread_mutex_create(&src->headers_lock);
+        connection_rate_init(&src->listener_rate);
+        src->listener_poll_fd = -1;
 
         avl_insert(global.source_tree, src);
+        source_hash_insert(src);
+        source_routes_changed();
 
     } while (0);
 
@@ -116,29 +223,98 @@ source_t *source_reserve (const char *mount)
 }
 
 
+static uint32_t source_hash_mount (const char *mount)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*mount)
+    {
+        hash ^= (unsigned char)*mount++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+
+/* add to the mount hash, growing it as needed. Source tree write lock */
+static void source_hash_insert (source_t *source)
+{
+    size_t slot;
+
+    if (source_hash_count >= source_hash_size)
+    {
+        size_t size = source_hash_size ? source_hash_size * 2 : 64, i;
+        source_t **table = calloc (size, sizeof (source_t *));
+
+        if (table == NULL)
+            abort();
+        for (i = 0; i < source_hash_size; i++)
+        {
+            while (source_hash [i])
+            {
+                source_t *next = source_hash [i]->hash_next;
+
+                slot = source_hash [i]->hash & (size - 1);
+                source_hash [i]->hash_next = table [slot];
+                table [slot] = source_hash [i];
+                source_hash [i] = next;
+            }
+        }
+        free (source_hash);
+        source_hash = table;
+        source_hash_size = size;
+    }
+    source->hash = source_hash_mount (source->mount);
+    slot = source->hash & (source_hash_size - 1);
+    source->hash_next = source_hash [slot];
+    source_hash [slot] = source;
+    source_hash_count++;
+}
+
+
+static void source_hash_remove (source_t *source)
+{
+    source_t **prev;
+
+    if (source_hash == NULL)
+        return;
+    prev = &source_hash [source->hash & (source_hash_size - 1)];
+    while (*prev)
+    {
+        if (*prev == source)
+        {
+            *prev = source->hash_next;
+            source->hash_next = NULL;
+            source_hash_count--;
+            break;
+        }
+        prev = &(*prev)->hash_next;
+    }
+    if (source_hash_count == 0)
+    {
+        free (source_hash);
+        source_hash = NULL;
+        source_hash_size = 0;
+    }
+}
+
+
 /* Find a mount with this raw name - ignoring fallbacks. You should have the
  * global source tree locked to call this.
  */
 source_t *source_find_mount_raw(const char *mount)
 {
     source_t *source;
-    avl_node *node;
-    int cmp;
+    uint32_t hash;
 
-    if (!mount) {
+    if (!mount || source_hash == NULL) {
         return NULL;
     }
-    /* get the root node */
-    node = global.source_tree->root->right;
 
-    while (node) {
-        source = (source_t *) node->key;
-        cmp = strcmp(mount, source->mount);
-        if (cmp < 0)
-            node = node->left;
-        else if (cmp > 0)
-            node = node->right;
-        else
+    hash = source_hash_mount (mount);
+    for (source = source_hash [hash & (source_hash_size - 1)]; source; source = source->hash_next)
+    {
+        if (source->hash == hash && strcmp (mount, source->mount) == 0)
             return source;
     }
 
@@ -147,6 +323,51 @@ source_t *source_find_mount_raw(const char *mount)
 }
 
 
+void source_routes_initialize (void)
+{
+    thread_spin_create (&source_routes_lock);
+#ifdef HAVE_STDATOMIC_H
+    atomic_init (&source_routes_generation, 1);
+#else
+    source_routes_generation = 1;
+#endif
+}
+
+
+void source_routes_shutdown (void)
+{
+    thread_spin_destroy (&source_routes_lock);
+}
+
+
+/* forget all cached source_find_mount() results */
+void source_routes_changed (void)
+{
+#ifdef HAVE_STDATOMIC_H
+    atomic_fetch_add_explicit (&source_routes_generation, 1, memory_order_release);
+#else
+    thread_spin_lock (&source_routes_lock);
+    source_routes_generation++;
+    thread_spin_unlock (&source_routes_lock);
+#endif
+}
+
+
+static unsigned int source_routes_current (void)
+{
+#ifdef HAVE_STDATOMIC_H
+    return atomic_load_explicit (&source_routes_generation, memory_order_acquire);
+#else
+    unsigned int generation;
+
+    thread_spin_lock (&source_routes_lock);
+    generation = source_routes_generation;
+    thread_spin_unlock (&source_routes_lock);
+    return generation;
+#endif
+}
+
+
 /* Search for mount, if the mount is there but not currently running then
  * check the fallback, and so on.  Must have a global source lock to call
  * this function.
@@ -157,6 +378,35 @@ source_t *source_find_mount(const char *mount)
     ice_config_t *config;
     mount_proxy *mountinfo;
     int depth = 0;
+    const char *name = mount;
+    unsigned int generation;
+    source_route_t *route = NULL;
+    uint32_t hash = 0;
+
+    if (mount == NULL)
+        return NULL;
+
+    /* taken before resolving so a change during it is not lost */
+    generation = source_routes_current ();
+    if (strlen (mount) < SOURCE_ROUTE_MOUNT)
+    {
+        int found = 0;
+
+        hash = source_hash_mount (mount);
+        route = &source_routes [hash % SOURCE_ROUTE_SLOTS];
+        thread_spin_lock (&source_routes_lock);
+        if (route->generation == generation && route->hash == hash &&
+                strcmp (route->mount, mount) == 0)
+        {
+            source = route->source;
+            if (source == NULL || source->running || source->on_demand)
+                found = 1;
+        }
+        thread_spin_unlock (&source_routes_lock);
+        if (found)
+            return source;
+        source = NULL;
+    }
 
     config = config_get_config();
     while (mount && depth < MAX_FALLBACK_DEPTH)
@@ -182,6 +432,16 @@ source_t *source_find_mount(const char *mount)
     }
 
     config_release_config();
+
+    if (route)
+    {
+        thread_spin_lock (&source_routes_lock);
+        route->generation = generation;
+        route->hash = hash;
+        route->source = source;
+        strcpy (route->mount, name);
+        thread_spin_unlock (&source_routes_lock);
+    }
     return source;
 }
 
@@ -197,13 +457,115 @@ int source_compare_sources(void *arg, void *a, void *b)
 }
 
 
+/* forget the position of a listener on the queue ring, the ring holds
+ * the reference so there is nothing to release */
+static void source_ring_detach (client_t *client)
+{
+    if (client->queue_seq == 0)
+        return;
+    client->refbuf = NULL;
+    client->pos = 0;
+    client->queue_seq = 0;
+}
+
+
+/* drop the burst snapshot, called when the burst point moves */
+static void source_burst_invalidate (source_t *source)
+{
+    refbuf_t *snapshot;
+
+    thread_mutex_lock (&source->burst_lock);
+    snapshot = source->burst_snapshot;
+    source->burst_snapshot = NULL;
+    source->burst_snapshot_start = NULL;
+    source->burst_snapshot_end = NULL;
+    thread_mutex_unlock (&source->burst_lock);
+    refbuf_release (snapshot);
+}
+
+
+/* Return a buffer holding a copy of the queued data from start onwards,
+ * for a joining listener to be sent in large writes rather than one
+ * buffer at a time. The copy stops where the associated data changes and
+ * end is set to the last queue buffer it contains. A reference is taken on
+ * both for the caller. NULL if a copy is not worth it.
+ */
+refbuf_t *source_burst_snapshot (source_t *source, refbuf_t *start, refbuf_t **end)
+{
+    refbuf_t *snapshot, *refbuf, *last = start;
+    unsigned int len = start->len, count = 1;
+
+    thread_mutex_lock (&source->burst_lock);
+    if (source->burst_snapshot == NULL || source->burst_snapshot_start != start)
+    {
+        refbuf_release (source->burst_snapshot);
+        source->burst_snapshot = NULL;
+
+        for (refbuf = start->next; refbuf; refbuf = refbuf->next)
+        {
+            if (refbuf->associated != start->associated)
+                break;
+            len += refbuf->len;
+            last = refbuf;
+            count++;
+        }
+        if (count > 2)
+        {
+            char *data;
+
+            snapshot = refbuf_new (len);
+            data = snapshot->data;
+            for (refbuf = start; ; refbuf = refbuf->next)
+            {
+                memcpy (data, refbuf->data, refbuf->len);
+                data += refbuf->len;
+                if (refbuf == last)
+                    break;
+            }
+            snapshot->sync_point = 1;
+            snapshot->associated = start->associated;
+            for (refbuf = snapshot->associated; refbuf; refbuf = refbuf->next)
+                refbuf_addref (refbuf);
+            source->burst_snapshot = snapshot;
+            source->burst_snapshot_start = start;
+            source->burst_snapshot_end = last;
+        }
+    }
+    snapshot = source->burst_snapshot;
+    if (snapshot)
+    {
+        refbuf_addref (snapshot);
+        refbuf_addref (source->burst_snapshot_end);
+        *end = source->burst_snapshot_end;
+    }
+    thread_mutex_unlock (&source->burst_lock);
+    return snapshot;
+}
+
+
+/* drop any clients still waiting to join the source */
+static void source_free_pending (source_t *source)
+{
+    client_t *client = listener_queue_take (&source->pending);
+
+    while (client)
+    {
+        client_t *next = client->next_pending;
+
+        _free_client (client);
+        client = next;
+    }
+}
+
+
 void source_clear_source (source_t *source)
 {
+    unsigned long i;
     int c;
 
     ICECAST_LOG_DEBUG("clearing source \"%s\"", source->mount);
 
-    avl_tree_wlock (source->pending_tree);
+    listener_list_wlock (&source->client_list);
     client_destroy(source->client);
     source->client = NULL;
     source->parser = NULL;
@@ -216,61 +578,94 @@ void source_clear_source (source_t *source)
     if (source->dumpfile)
     {
         ICECAST_LOG_INFO("Closing dumpfile for %s", source->mount);
-        fclose (source->dumpfile);
+        dumpfile_close (source->dumpfile);
         source->dumpfile = NULL;
     }
+    if (source->timeshift)
+    {
+        timeshift_t *ts = source->timeshift;
+
+        thread_mutex_lock (&source->lock);
+        source->timeshift = NULL;
+        thread_mutex_unlock (&source->lock);
+        timeshift_stop (ts);
+    }
+    if (source->hls)
+    {
+        hls_t *hls = source->hls;
+
+        thread_mutex_lock (&source->lock);
+        source->hls = NULL;
+        thread_mutex_unlock (&source->lock);
+        hls_stop (hls);
+    }
 
     /* lets kick off any clients that are left on here */
-    avl_tree_wlock (source->client_tree);
     c=0;
-    while (1)
+    for (i = 0; i < source->client_list.count; i++)
     {
-        avl_node *node = avl_get_first (source->client_tree);
-        if (node)
-        {
-            client_t *client = node->key;
-            if (client->respcode == 200)
-                c++; /* only count clients that have had some processing */
-            avl_delete (source->client_tree, client, _free_client);
-            continue;
-        }
-        break;
+        if (source->client_list.clients[i]->respcode == 200)
+            c++; /* only count clients that have had some processing */
+        source_ring_detach (source->client_list.clients[i]);
     }
+    listener_list_clear (&source->client_list, _free_client);
     if (c)
     {
         stats_event_sub (NULL, "listeners", source->listeners);
         ICECAST_LOG_INFO("%d active listeners on %s released", c, source->mount);
     }
-    avl_tree_unlock (source->client_tree);
 
-    while (avl_get_first (source->pending_tree))
-    {
-        avl_delete (source->pending_tree,
-                avl_get_first(source->pending_tree)->key, _free_client);
-    }
+    source_free_pending (source);
 
     if (source->format && source->format->free_plugin)
         source->format->free_plugin (source->format);
     source->format = NULL;
 
     /* Lets clear out the source queue too */
+    if (source->ring)
+    {
+        /* the burst holds a reference from the burst point on, references
+         * held elsewhere, such as for zero copy sends, keep the buffer */
+        while (source->burst_point)
+            source_burst_advance (source);
+    }
     while (source->stream_data)
     {
         refbuf_t *p = source->stream_data;
         source->stream_data = p->next;
         p->next = NULL;
         /* can be referenced by burst handler as well */
-        while (p->_count > 1)
+        while (source->ring == NULL && refbuf_refcount (p) > 1)
             refbuf_release (p);
         refbuf_release (p);
     }
     source->stream_data_tail = NULL;
+    source_ring_stop (source);
+    global_queue_bytes_add (-(long)source->queue_size);
 
+    source_burst_invalidate (source);
+    format_invalidate_headers (source);
     source->burst_point = NULL;
+    source->burst_sync = NULL;
     source->burst_size = 0;
+    source->burst_duration = 0;
     source->burst_offset = 0;
+    source->sender_threads = 0;
+    source->listener_events = 0;
+    source->queue_ring = 0;
+    source->slow_listener_action = SLOW_LISTENER_DISCONNECT;
+    source->zerocopy = 0;
+    source->low_latency = 0;
+    source->latency_count = 0;
+    source->latency_sum = 0;
+    source->io_uring = 0;
+    source->so_sndbuf = 0;
+    source->so_notsent_lowat = 0;
     source->queue_size = 0;
     source->queue_size_limit = 0;
+    source->queue_size_max = 0;
+    source->budget_checked = 0;
+    source->published_queue_size = 0;
     source->listeners = 0;
     source->max_listeners = -1;
     source->prev_listeners = 0;
@@ -294,9 +689,13 @@ void source_clear_source (source_t *source)
         fclose (source->intro_file);
         source->intro_file = NULL;
     }
+    refbuf_release (source->intro);
+    source->intro = NULL;
+    free (source->intro_path);
+    source->intro_path = NULL;
 
     source->on_demand_req = 0;
-    avl_tree_unlock (source->pending_tree);
+    listener_list_unlock (&source->client_list);
 }
 
 
@@ -306,14 +705,22 @@ void source_free_source (source_t *source)
     ICECAST_LOG_DEBUG("freeing source \"%s\"", source->mount);
     avl_tree_wlock (global.source_tree);
     avl_delete (global.source_tree, source, NULL);
+    source_hash_remove (source);
+    source_routes_changed ();
     avl_tree_unlock (global.source_tree);
 
-    avl_tree_free(source->pending_tree, _free_client);
-    avl_tree_free(source->client_tree, _free_client);
+    source_free_pending (source);
+    listener_queue_destroy (&source->pending);
+    listener_list_free (&source->client_list, _free_client);
 
     /* make sure all YP entries have gone */
     yp_remove (source->mount);
 
+    thread_mutex_destroy(&source->intro_lock);
+    thread_mutex_destroy(&source->burst_lock);
+    thread_mutex_destroy(&source->headers_lock);
+    thread_mutex_destroy(&source->lock);
+    connection_rate_destroy(&source->listener_rate);
     free (source->mount);
     free (source);
 
@@ -323,22 +730,76 @@ void source_free_source (source_t *source)
 
 client_t *source_find_client(source_t *source, int id)
 {
-    client_t fakeclient;
-    void *result;
-    connection_t fakecon;
+    client_t *client;
+
+    listener_list_rlock (&source->client_list);
+    client = listener_list_find (&source->client_list, id);
+    listener_list_unlock (&source->client_list);
+
+    return client;
+}
+
+
+/* a chain of clients being moved, linked by next_pending newest first so
+ * it can go on a pending queue with one push */
+typedef struct source_move_tag
+{
+    client_t *head;
+    client_t *tail;
+    unsigned long count;
+} source_move_t;
+
 
-    fakeclient.con = &fakecon;
-    fakeclient.con->id = id;
+/* take a client of source off its queue position and add it to the move.
+ * The source client list must be write locked, as the refbufs released
+ * here can otherwise be dropped by source_clear_source at the same time.
+ */
+static void source_move_client (source_t *source, source_move_t *move, client_t *client)
+{
+    source_ring_detach (client);
 
-    avl_tree_rlock(source->client_tree);
-    if(avl_get_by_key(source->client_tree, &fakeclient, &result) == 0)
+    /* when switching a client to a different queue, be wary of the
+     * refbuf it's referring to, if it's http headers then we need
+     * to write them so don't release it.
+     */
+    if (client->check_buffer != format_check_http_buffer)
     {
-        avl_tree_unlock(source->client_tree);
-        return result;
+        client_set_queue (client, NULL);
+        client->check_buffer = format_check_file_buffer;
+        if (source->con == NULL)
+            client->intro_offset = -1;
     }
+    client->next_pending = move->head;
+    move->head = client;
+    if (move->tail == NULL)
+        move->tail = client;
+    move->count++;
+}
 
-    avl_tree_unlock(source->client_tree);
-    return NULL;
+
+/* hand the moved clients to the pending queue of dest, or back to source
+ * if dest can no longer take them. Returns the number moved */
+static unsigned long source_move_finish (source_t *source, source_t *dest, source_move_t *move)
+{
+    if (move->head == NULL)
+        return 0;
+
+    listener_list_wlock (&dest->client_list);
+    if (dest->running == 0 && dest->on_demand == 0)
+    {
+        listener_list_unlock (&dest->client_list);
+        ICECAST_LOG_WARN("destination mount %s stopped, returning %lu listeners to %s",
+                dest->mount, move->count, source->mount);
+        listener_queue_push_chain (&source->pending, move->head, move->tail);
+        return 0;
+    }
+    listener_queue_push_chain (&dest->pending, move->head, move->tail);
+
+    /* see if we need to wake up an on-demand relay */
+    if (dest->running == 0 && dest->on_demand)
+        dest->on_demand_req = 1;
+    listener_list_unlock (&dest->client_list);
+    return move->count;
 }
 
 
@@ -346,10 +807,14 @@ client_t *source_find_client(source_t *source, int id)
  * and that the stream format is the same.
  * The only lock that should be held when this is called is the
  * source tree lock
+ *
+ * The clients are taken off source under its lock and then given to dest
+ * with a single push, dest is only locked to check it is still running.
  */
 void source_move_clients(source_t *source, source_t *dest)
 {
-    unsigned long count = 0;
+    source_move_t move = { NULL, NULL, 0 };
+
     if (strcmp (source->mount, dest->mount) == 0)
     {
         ICECAST_LOG_WARN("src and dst are the same \"%s\", skipping", source->mount);
@@ -359,12 +824,9 @@ void source_move_clients(source_t *source, source_t *dest)
     thread_mutex_lock (&move_clients_mutex);
 
     /* if the destination is not running then we can't move clients */
-
-    avl_tree_wlock (dest->pending_tree);
     if (dest->running == 0 && dest->on_demand == 0)
     {
         ICECAST_LOG_WARN("destination mount %s not running, unable to move clients ", dest->mount);
-        avl_tree_unlock (dest->pending_tree);
         thread_mutex_unlock (&move_clients_mutex);
         return;
     }
@@ -372,11 +834,9 @@ void source_move_clients(source_t *source, source_t *dest)
     do
     {
         client_t *client;
+        unsigned long i;
 
-        /* we need to move the client and pending trees - we must take the
-         * locks in this order to avoid deadlocks */
-        avl_tree_wlock(source->pending_tree);
-        avl_tree_wlock(source->client_tree);
+        listener_list_wlock (&source->client_list);
 
         if (source->on_demand == 0 && source->format == NULL)
         {
@@ -392,72 +852,195 @@ void source_move_clients(source_t *source, source_t *dest)
             }
         }
 
-        while (1)
+        client = listener_queue_take (&source->pending);
+        while (client)
         {
-            avl_node *node = avl_get_first (source->pending_tree);
-            if (node == NULL)
-                break;
-            client = (client_t *)(node->key);
-            avl_delete (source->pending_tree, client, NULL);
+            client_t *next = client->next_pending;
 
-            /* when switching a client to a different queue, be wary of the
-             * refbuf it's referring to, if it's http headers then we need
-             * to write them so don't release it.
-             */
-            if (client->check_buffer != format_check_http_buffer)
-            {
-                client_set_queue (client, NULL);
-                client->check_buffer = format_check_file_buffer;
-                if (source->con == NULL)
-                    client->intro_offset = -1;
-            }
-
-            avl_insert (dest->pending_tree, (void *)client);
-            count++;
+            source_move_client (source, &move, client);
+            client = next;
         }
 
-        while (1)
-        {
-            avl_node *node = avl_get_first (source->client_tree);
-            if (node == NULL)
-                break;
-
-            client = (client_t *)(node->key);
-            avl_delete (source->client_tree, client, NULL);
-
-            /* when switching a client to a different queue, be wary of the
-             * refbuf it's referring to, if it's http headers then we need
-             * to write them so don't release it.
-             */
-            if (client->check_buffer != format_check_http_buffer)
-            {
-                client_set_queue (client, NULL);
-                client->check_buffer = format_check_file_buffer;
-                if (source->con == NULL)
-                    client->intro_offset = -1;
-            }
-            avl_insert (dest->pending_tree, (void *)client);
-            count++;
-        }
-        ICECAST_LOG_INFO("passing %lu listeners to \"%s\"", count, dest->mount);
+        for (i = 0; i < source->client_list.count; i++)
+            source_move_client (source, &move, source->client_list.clients[i]);
+        listener_list_clear (&source->client_list, NULL);
+        ICECAST_LOG_INFO("passing %lu listeners to \"%s\"", move.count, dest->mount);
 
         source->listeners = 0;
         stats_event (source->mount, "listeners", "0");
 
     } while (0);
 
-    avl_tree_unlock (source->pending_tree);
-    avl_tree_unlock (source->client_tree);
-
-    /* see if we need to wake up an on-demand relay */
-    if (dest->running == 0 && dest->on_demand && count)
-        dest->on_demand_req = 1;
+    listener_list_unlock (&source->client_list);
 
-    avl_tree_unlock (dest->pending_tree);
+    source_move_finish (source, dest, &move);
     thread_mutex_unlock (&move_clients_mutex);
 }
 
 
+/* Hand a listener filter to the source thread, which applies it between
+ * cycles and reports through filter->done. Returns 0 once queued, or -1 if
+ * the source is not running or already has a filter waiting, in which case
+ * the filter stays with the caller.
+ */
+int source_filter_listeners (source_t *source, source_filter_t *filter)
+{
+    thread_mutex_lock (&source->lock);
+    if (source->filter || source->running == 0)
+    {
+        thread_mutex_unlock (&source->lock);
+        return -1;
+    }
+    source->filter = filter;
+    thread_mutex_unlock (&source->lock);
+    return 0;
+}
+
+
+/* The listener event handling uses an epoll set containing the source
+ * socket and every listener socket which has returned a short write. The
+ * listener registrations are one-shot, so a listener is only reported once
+ * per registration. Listeners are identified by connection id as clients
+ * may have gone by the time their socket is reported.
+ */
+#define SOURCE_EVENT_ID ((uint64_t)-1)
+
+static void source_listener_events_start (source_t *source)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+
+    if (source->listener_events == 0 || source->con == NULL)
+        return;
+
+    source->listener_poll_fd = epoll_create (SOURCE_READY_MAX);
+    if (source->listener_poll_fd < 0)
+    {
+        ICECAST_LOG_WARN("Unable to create listener event set for %s, using polling", source->mount);
+        return;
+    }
+    memset (&event, 0, sizeof (event));
+    event.events = EPOLLIN;
+    event.data.u64 = SOURCE_EVENT_ID;
+    if (epoll_ctl (source->listener_poll_fd, EPOLL_CTL_ADD, source->con->sock, &event) < 0)
+    {
+        ICECAST_LOG_WARN("Unable to add source socket to event set for %s, using polling", source->mount);
+        close (source->listener_poll_fd);
+        source->listener_poll_fd = -1;
+        return;
+    }
+    ICECAST_LOG_DEBUG("listener events enabled for %s", source->mount);
+#else
+    if (source->listener_events)
+        ICECAST_LOG_WARN("listener events are not supported on this platform, using polling for %s", source->mount);
+#endif
+}
+
+
+static void source_listener_events_stop (source_t *source)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (source->listener_poll_fd >= 0)
+        close (source->listener_poll_fd);
+#endif
+    source->listener_poll_fd = -1;
+    source->listeners_ready = 0;
+}
+
+
+/* ask to be told when this listener can take more data */
+static void source_listener_wait_writable (source_t *source, client_t *client)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event event;
+
+    memset (&event, 0, sizeof (event));
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.u64 = client->con->id;
+    if (epoll_ctl (source->listener_poll_fd, EPOLL_CTL_MOD, client->con->sock, &event) == 0 ||
+            (errno == ENOENT &&
+             epoll_ctl (source->listener_poll_fd, EPOLL_CTL_ADD, client->con->sock, &event) == 0))
+        client->wait_writable = 1;
+#endif
+}
+
+
+/* the listeners reported as writable can be sent to again */
+static void source_listeners_writable (source_t *source)
+{
+    unsigned int i;
+
+    for (i = 0; i < source->listeners_ready; i++)
+    {
+        client_t *client = listener_list_find (&source->client_list, source->listener_ready_id[i]);
+
+        if (client)
+            client->wait_writable = 0;
+    }
+}
+
+
+/* milliseconds on a clock which is not stepped, for the age of buffers */
+static uint64_t source_clock_ms (void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    return timing_get_time ();
+}
+
+
+/* a listener has been sent all of refbuf, record how old it was as the
+ * delivery time for the mount and as how far behind the listener is */
+static void source_delivered (source_t *source, client_t *client, refbuf_t *refbuf)
+{
+    uint64_t age;
+
+    if (refbuf->arrival == 0)
+        return;
+    age = source_clock_ms () - refbuf->arrival;
+    client->lag_ms = (unsigned int)age;
+    stats_histogram_record (source->counters, STATS_HISTOGRAM_DELIVERY, age * 1000);
+}
+
+
+/* same return values as util_timed_wait_for_fd for the source socket, any
+ * writable listener found is recorded for servicing and reported as a
+ * timeout.
+ */
+static int source_wait_for_events (source_t *source, int delay)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event events[SOURCE_READY_MAX];
+    int ret, i, source_ready = 0;
+    int room = SOURCE_READY_MAX - source->listeners_ready;
+
+    /* only take as many events as can be recorded, a listener reported
+     * writable has used up its one shot and would never be sent to again
+     * if dropped. The rest stay with the kernel for the next call */
+    if (room <= 0)
+        return 0;
+    ret = epoll_wait (source->listener_poll_fd, events, room, delay);
+    if (ret <= 0)
+        return ret;
+
+    for (i = 0; i < ret; i++)
+    {
+        if (events[i].data.u64 == SOURCE_EVENT_ID)
+            source_ready = 1;
+        else
+            source->listener_ready_id[source->listeners_ready++] = (unsigned long)events[i].data.u64;
+    }
+    return source_ready;
+#else
+    return util_timed_wait_for_fd (source->con->sock, delay);
+#endif
+}
+
+
 /* get some data from the source. The stream data is placed in a refbuf
  * and sent back, however NULL is also valid as in the case of a short
  * timeout and there's no data pending.
@@ -465,16 +1048,19 @@ void source_move_clients(source_t *source, source_t *dest)
 static refbuf_t *get_next_buffer (source_t *source)
 {
     refbuf_t *refbuf = NULL;
-    int delay = 250;
+    int delay = source->low_latency ? SOURCE_LOW_LATENCY_WAIT : 250;
 
-    if (source->short_delay)
+    /* a stepped source is only run once there is something to do */
+    if (source->short_delay || source->stepped)
         delay = 0;
     while (global.running == ICECAST_RUNNING && source->running)
     {
         int fds = 0;
         time_t current = time (NULL);
 
-        if (source->client)
+        if (source->client && source->listener_poll_fd >= 0)
+            fds = source_wait_for_events (source, delay);
+        else if (source->client)
             fds = util_timed_wait_for_fd (source->con->sock, delay);
         else
         {
@@ -484,11 +1070,11 @@ static refbuf_t *get_next_buffer (source_t *source)
 
         if (current >= source->client_stats_update)
         {
-            stats_event_args (source->mount, "total_bytes_read",
-                    "%"PRIu64, source->format->read_bytes);
-            stats_event_args (source->mount, "total_bytes_sent",
-                    "%"PRIu64, source->format->sent_bytes);
-            source->client_stats_update = current + 5;
+            stats_counter_set (source->counters, STATS_COUNTER_BYTES_READ,
+                    source->format->read_bytes);
+            stats_counter_set (source->counters, STATS_COUNTER_BYTES_SENT,
+                    source->format->sent_bytes);
+            source->client_stats_update = current;
         }
         if (fds < 0)
         {
@@ -524,69 +1110,895 @@ static refbuf_t *get_next_buffer (source_t *source)
             source->running = 0;
             continue;
         }
-        if (refbuf)
-            break;
+        if (refbuf)
+        {
+            /* aged from here to the listener writes */
+            refbuf->arrival = source_clock_ms ();
+            ICECAST_TRACE2 (source_read, source->mount, refbuf->len);
+            break;
+        }
+    }
+
+    return refbuf;
+}
+
+
+/* how far a listener on the queue ring is behind the newest data, in bytes */
+static uint64_t source_ring_lag (source_t *source, client_t *client)
+{
+    source_ring_t *ring = source->ring;
+
+    return ring->tail_offset -
+        (ring->offsets [client->queue_seq & ring->mask] + client->pos);
+}
+
+
+/* find a sync point for a lagging listener to carry on from, as set by the
+ * mount policy. NULL if there is none */
+static refbuf_t *source_skip_point (source_t *source)
+{
+    refbuf_t *refbuf, *found = NULL;
+
+    if (source->ring && source->slow_listener_action == SLOW_LISTENER_SKIP_LATEST)
+    {
+        source_ring_t *ring = source->ring;
+        uint64_t seq;
+
+        /* the ring can be walked back from the newest */
+        for (seq = ring->tail; seq-- > ring->head; )
+        {
+            refbuf = ring->entries [seq & ring->mask];
+            if (refbuf->sync_point)
+                return refbuf;
+        }
+        return NULL;
+    }
+    for (refbuf = source->burst_point; refbuf; refbuf = refbuf->next)
+    {
+        if (refbuf->sync_point == 0)
+            continue;
+        found = refbuf;
+        if (source->slow_listener_action == SLOW_LISTENER_SKIP_BURST)
+            break;
+    }
+    return found;
+}
+
+
+/* move a lagging listener forward to a sync point, returns 0 on success or
+ * -1 if it cannot be moved on. A listener on the ring may refer to a buffer
+ * which has gone so only its sequence is looked at.
+ */
+static int source_skip_listener (source_t *source, client_t *client)
+{
+    refbuf_t *refbuf;
+
+    if (source->slow_listener_action == SLOW_LISTENER_DISCONNECT)
+        return -1;
+    refbuf = source_skip_point (source);
+    if (refbuf == NULL)
+        return -1;
+    if (client->queue_seq)
+    {
+        if (refbuf->seq <= client->queue_seq)
+            return -1;
+        client->refbuf = refbuf;
+        client->queue_seq = refbuf->seq;
+        client->pos = 0;
+    }
+    else
+    {
+        refbuf_t *from = client->burst_end ? client->burst_end : client->refbuf;
+        refbuf_t *check;
+
+        /* only ever move forward */
+        for (check = from; check && check != refbuf; check = check->next)
+            ;
+        if (check == NULL || refbuf == from)
+            return -1;
+        client_set_queue (client, refbuf);
+        client->check_buffer = format_advance_queue;
+    }
+    return 0;
+}
+
+
+static void source_listener_lagging (source_t *source, client_t *client)
+{
+    if (source_skip_listener (source, client) == 0)
+    {
+        ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, skipping ahead",
+                client->con->id, client->con->ip);
+        stats_counter_add (source->counters, STATS_COUNTER_SLOW_LISTENER_SKIPS, 1);
+        return;
+    }
+    ICECAST_TRACE2 (slow_listener, source->mount, client->con->id);
+    source_ring_detach (client);
+    ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, removing",
+            client->con->id, client->con->ip);
+    stats_counter_add (source->counters, STATS_COUNTER_SLOW_LISTENERS, 1);
+    client->con->error = 1;
+}
+
+
+/* check whether the listener has fallen off the end of the queue */
+static void source_check_lagging (source_t *source, client_t *client, int deletion_expected)
+{
+    if (client->queue_seq)
+    {
+        /* on the ring the lag is known, the queue is trimmed to the limit */
+        uint64_t lag = source_ring_lag (source, client);
+
+        stats_histogram_record (source->counters, STATS_HISTOGRAM_LISTENER_LAG, lag);
+        if (lag > source->queue_size_limit)
+            source_listener_lagging (source, client);
+    }
+    /* the refbuf referenced at head (last in queue) may be marked for deletion
+     * if so, check to see if this client is still referring to it */
+    else if (deletion_expected && client->refbuf &&
+            (client->refbuf == source->stream_data || client->burst_end == source->stream_data))
+        source_listener_lagging (source, client);
+}
+
+
+/* general send routine per listener.  The deletion_expected tells us whether
+ * the last in the queue is about to disappear, so if this client is still
+ * referring to it after writing then drop the client as it's fallen too far
+ * behind. Returns the number of bytes written.
+ */
+static int send_to_listener (source_t *source, client_t *client, int deletion_expected, int *short_delay)
+{
+    int bytes;
+    int loop = 10;   /* max number of iterations in one go */
+    int total_written = 0;
+
+    /* buffers held by zero copy sends go back as soon as they are done */
+    client_zerocopy_reap (client);
+
+    /* a listener on the ring which is older than the ring may refer to a
+     * buffer which has gone, so it must not be touched */
+    if (client->queue_seq && client->queue_seq < source->ring->head)
+    {
+        source_listener_lagging (source, client);
+        if (client->con->error)
+            return 0;
+    }
+
+    /* the socket has no room, so leave the data on the shared queue until
+     * it is reported as writable */
+    if (client->wait_writable)
+    {
+        source_check_lagging (source, client, deletion_expected);
+        return 0;
+    }
+
+    while (1)
+    {
+        /* check for limited listener time */
+        if (client->con->discon_time)
+            if (time(NULL) >= client->con->discon_time)
+            {
+                ICECAST_LOG_INFO("time limit reached for client #%lu", client->con->id);
+                client->con->error = 1;
+            }
+
+        /* jump out if client connection has died */
+        if (client->con->error)
+            break;
+
+        /* lets not send too much to one client in one go, but don't
+           sleep for too long if more data can be sent */
+        if (total_written > 20000 || loop == 0)
+        {
+            if (client->check_buffer != format_check_file_buffer)
+                *short_delay = 1;
+            break;
+        }
+
+        loop--;
+
+        if (client->check_buffer(source, client) < 0)
+            break;
+
+        bytes = client->write_to_client(client);
+        if (bytes <= 0)
+        {
+            /* socket is full, get told when it drains */
+            if (client->con->error == 0 && source->listener_poll_fd >= 0)
+                source_listener_wait_writable (source, client);
+            break; /* can't write any more */
+        }
+        ICECAST_TRACE3 (listener_send, source->mount, client->con->id, bytes);
+        if (client->refbuf && client->pos == client->refbuf->len)
+            source_delivered (source, client, client->refbuf);
+
+        stats_histogram_record (source->counters, STATS_HISTOGRAM_WRITE_SIZE, bytes);
+        total_written += bytes;
+    }
+
+    source_check_lagging (source, client, deletion_expected);
+    return total_written;
+}
+
+
+/* Apply the results of the writes in the batch and empty it. Returns the
+ * number of bytes written.
+ */
+static uint64_t send_batch_complete (source_t *source, send_batch_t *batch, int deletion_expected)
+{
+    unsigned int i, count = send_batch_submit (batch);
+    uint64_t total_written = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        send_batch_entry_t *entry = send_batch_entry (batch, i);
+        client_t *client = entry->client;
+
+        if (entry->result > 0)
+        {
+            refbuf_t *first = client->refbuf;
+
+            stats_histogram_record (source->counters, STATS_HISTOGRAM_WRITE_SIZE, entry->result);
+            ICECAST_TRACE3 (listener_send, source->mount, client->con->id, entry->result);
+            client->con->sent_bytes += entry->result;
+            if (first && (unsigned int)entry->result >= first->len - client->pos)
+                source_delivered (source, client, first);
+            format_consume_queue (client, entry->result);
+            total_written += entry->result;
+        }
+        else if (entry->result == -EAGAIN || entry->result == -EINTR)
+        {
+            if (source->listener_poll_fd >= 0)
+                source_listener_wait_writable (source, client);
+        }
+        else
+        {
+            client->con->error = 1;
+            ICECAST_LOG_DEBUG("Client connection died");
+        }
+        source_check_lagging (source, client, deletion_expected);
+    }
+    send_batch_reset (batch);
+    return total_written;
+}
+
+
+/* Queue the next write for a listener which is streaming from the queue
+ * onto the batch, submitting the batch first if it is full, in which case
+ * the bytes written are added to written. Anything else, such as listeners
+ * still getting headers or an intro file, is left for send_to_listener and
+ * -1 returned.
+ */
+static int send_batch_listener (source_t *source, send_batch_t *batch,
+        client_t *client, int deletion_expected, uint64_t *written)
+{
+    send_batch_entry_t *entry;
+    struct iovec iov[FORMAT_MAX_IOV];
+    int count;
+
+    if (client->check_buffer != format_advance_queue ||
+            client->write_to_client != format_generic_write_to_client ||
+            client->zerocopy || client->wait_writable || client->con->error ||
+            client->con->discon_time ||
+            (client->queue_seq && client->queue_seq < source->ring->head))
+        return -1;
+#ifdef HAVE_OPENSSL
+    if (client->con->ssl && client->con->ktls == 0)
+        return -1;
+#endif
+
+    if (client->check_buffer (source, client) < 0)
+    {
+        source_check_lagging (source, client, deletion_expected);
+        return 0;
+    }
+    count = format_gather_queue (client, iov, FORMAT_MAX_IOV, FORMAT_MAX_IOV_BYTES, 0);
+    entry = send_batch_add (batch, client, count);
+    if (entry == NULL)
+    {
+        *written += send_batch_complete (source, batch, deletion_expected);
+        entry = send_batch_add (batch, client, count);
+        if (entry == NULL)
+            return -1;
+    }
+    memcpy (entry->iov, iov, count * sizeof (struct iovec));
+    return 0;
+}
+
+
+/* send to the listeners of the source which fall into the given share of
+ * the client list, returns the number of bytes written.
+ */
+static uint64_t send_to_listeners (source_t *source, send_batch_t *batch,
+        unsigned int index, unsigned int count, int deletion_expected, int *short_delay)
+{
+    listener_list_t *list = &source->client_list;
+    unsigned long i = list->count * index / count;
+    unsigned long end = list->count * (index + 1) / count;
+    uint64_t total_written = 0;
+
+    for (; i < end; i++)
+    {
+        client_t *client = list->clients[i];
+
+        if (batch && send_batch_listener (source, batch, client, deletion_expected, &total_written) == 0)
+            continue;
+        total_written += send_to_listener(source, client, deletion_expected, short_delay);
+    }
+    if (batch)
+        total_written += send_batch_complete (source, batch, deletion_expected);
+    return total_written;
+}
+
+
+/* drop the listener at index from the client list, which must be write
+ * locked. The last listener in the list takes its place */
+static void source_remove_listener (source_t *source, unsigned long index)
+{
+    client_t *client = listener_list_remove (&source->client_list, index);
+
+    ICECAST_TRACE2 (listener_remove, source->mount, client->con->id);
+    source_ring_detach (client);
+    if (client->respcode == 200)
+        stats_event_dec(NULL, "listeners");
+    _free_client (client);
+    source->listeners--;
+    ICECAST_LOG_DEBUG("Client removed");
+}
+
+
+static int source_filter_match (source_filter_t *filter, client_t *client, time_t now)
+{
+    const char *agent;
+    time_t connected = now - client->con->con_time;
+
+    if (filter->ips && matchfile_match (filter->ips, client->con->ip) <= 0)
+        return 0;
+    if (filter->useragent)
+    {
+        agent = httpp_getvar (client->parser, "user-agent");
+        if (agent == NULL || strstr (agent, filter->useragent) == NULL)
+            return 0;
+    }
+    if (filter->min_connected && connected < filter->min_connected)
+        return 0;
+    if (filter->max_connected && connected > filter->max_connected)
+        return 0;
+    return 1;
+}
+
+
+/* run a filter queued by source_filter_listeners in one pass over the
+ * listeners, called between cycles with no locks held */
+static void source_run_filter (source_t *source)
+{
+    source_filter_t *filter;
+    source_t *dest;
+    source_move_t move = { NULL, NULL, 0 };
+    unsigned long i, matched = 0, count = 0;
+    int usable = 1;
+    time_t now = time (NULL);
+
+    thread_mutex_lock (&source->lock);
+    filter = source->filter;
+    source->filter = NULL;
+    thread_mutex_unlock (&source->lock);
+    if (filter == NULL)
+        return;
+
+    dest = NULL;
+    if (filter->dest_mount)
+    {
+        /* the tree lock keeps the destination around, taken in the same
+         * order as for source_move_clients */
+        avl_tree_rlock (global.source_tree);
+        dest = source_find_mount (filter->dest_mount);
+        if (dest == NULL || dest == source)
+        {
+            avl_tree_unlock (global.source_tree);
+            ICECAST_LOG_WARN("no destination %s to move listeners to", filter->dest_mount);
+            filter->done (filter, source->mount, -1);
+            return;
+        }
+        thread_mutex_lock (&move_clients_mutex);
+        if ((dest->running == 0 && dest->on_demand == 0) ||
+                (source->format && dest->format && source->format->type != dest->format->type))
+        {
+            ICECAST_LOG_WARN("unable to move listeners from %s to %s", source->mount, dest->mount);
+            thread_mutex_unlock (&move_clients_mutex);
+            avl_tree_unlock (global.source_tree);
+            dest = NULL;
+            usable = 0;
+        }
+    }
+
+    if (usable)
+    {
+        listener_list_wlock (&source->client_list);
+        i = 0;
+        while (i < source->client_list.count)
+        {
+            client_t *client = source->client_list.clients[i];
+
+            if (source_filter_match (filter, client, now) == 0)
+            {
+                i++;
+                continue;
+            }
+            /* act on an even spread of the given share of the matches */
+            matched++;
+            if ((matched * filter->percent) / 100 == ((matched - 1) * filter->percent) / 100)
+            {
+                i++;
+                continue;
+            }
+            count++;
+            if (dest)
+            {
+                /* the last listener takes its place, so stay on the index */
+                client = listener_list_remove (&source->client_list, i);
+                source_move_client (source, &move, client);
+                source->listeners--;
+            }
+            else
+                source_remove_listener (source, i);
+        }
+        listener_list_unlock (&source->client_list);
+        ICECAST_LOG_INFO("listener filter on %s %s %lu of %lu matching listeners", source->mount,
+                dest ? "moved" : "dropped", count, matched);
+    }
+    if (dest)
+    {
+        source_move_finish (source, dest, &move);
+        thread_mutex_unlock (&move_clients_mutex);
+        avl_tree_unlock (global.source_tree);
+    }
+
+    filter->done (filter, source->mount, usable ? (long)count : -1);
+}
+
+
+/* move the clients waiting on the pending queue into the client list,
+ * which must be write locked. Returns the number of clients added.
+ */
+static unsigned long source_add_pending (source_t *source)
+{
+    client_t *client = listener_queue_take (&source->pending);
+    unsigned long added = 0;
+
+    while (client)
+    {
+        client_t *next = client->next_pending;
+
+        client->next_pending = NULL;
+        if(source->max_listeners != -1 &&
+                source->listeners >= (unsigned long)source->max_listeners)
+        {
+            /* The common case is caught in the main connection handler,
+             * this deals with rarer cases (mostly concerning fallbacks)
+             * and doesn't give the listening client any information about
+             * why they were disconnected
+             */
+            _free_client (client);
+
+            ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
+                    "mountpoint (%s).", source->mount);
+        }
+        else if (listener_list_add (&source->client_list, client) < 0)
+            _free_client (client);
+        else
+        {
+            client->wait_writable = 0;
+            connection_set_send_limits (client->con, source->so_sndbuf, source->so_notsent_lowat);
+            if (source->low_latency)
+                connection_set_low_delay (client->con);
+            if (source->zerocopy && client->zerocopy == NULL &&
+                    client_enable_zerocopy (client) < 0)
+                ICECAST_LOG_DEBUG("zero copy sends not available for client %lu", client->con->id);
+            source->listeners++;
+            added++;
+            ICECAST_TRACE2 (listener_add, source->mount, client->con->id);
+            ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
+            stats_counter_add(source->counters, STATS_COUNTER_CONNECTIONS, 1);
+        }
+        client = next;
+    }
+    return added;
+}
+
+
+/* send to the listeners reported as writable, this happens between reads
+ * from the source so the client list must be write locked.
+ */
+static void send_to_ready_listeners (source_t *source, int deletion_expected)
+{
+    unsigned int i;
+
+    for (i = 0; i < source->listeners_ready; i++)
+    {
+        long index = listener_list_index (&source->client_list, source->listener_ready_id[i]);
+        client_t *client;
+
+        if (index < 0)
+            continue; /* already gone */
+        client = source->client_list.clients[index];
+        client->wait_writable = 0;
+        source->format->sent_bytes += send_to_listener (source, client, deletion_expected, &source->short_delay);
+        if (client->con->error)
+            source_remove_listener (source, index);
+    }
+}
+
+
+static void *source_sender_thread (void *arg)
+{
+    source_sender_t *sender = arg;
+    source_sender_pool_t *pool = sender->pool;
+    unsigned int generation = 0;
+
+    affinity_apply (AFFINITY_SENDER);
+    pthread_mutex_lock (&pool->lock);
+    while (1)
+    {
+        uint64_t written;
+        int remove_from_q, short_delay = 0;
+
+        while (pool->running && pool->generation == generation)
+            pthread_cond_wait (&pool->start_cond, &pool->lock);
+        if (pool->running == 0)
+            break;
+        generation = pool->generation;
+        remove_from_q = pool->remove_from_q;
+        pthread_mutex_unlock (&pool->lock);
+
+        written = send_to_listeners (pool->source, sender->batch, sender->index, pool->count,
+                remove_from_q, &short_delay);
+
+        pthread_mutex_lock (&pool->lock);
+        pool->sent_bytes += written;
+        if (short_delay)
+            pool->short_delay = 1;
+        if (--pool->pending == 0)
+            pthread_cond_signal (&pool->done_cond);
+    }
+    pthread_mutex_unlock (&pool->lock);
+
+    return NULL;
+}
+
+
+/* run a single pass over all listeners, sharing the work between the
+ * sender threads. The client list must be write locked by the caller.
+ */
+static void source_senders_run (source_t *source, int remove_from_q)
+{
+    source_sender_pool_t *pool = source->sender_pool;
+    uint64_t written;
+
+    pthread_mutex_lock (&pool->lock);
+    pool->generation++;
+    pool->pending = pool->count - 1;
+    pool->remove_from_q = remove_from_q;
+    pool->sent_bytes = 0;
+    pool->short_delay = 0;
+    pthread_cond_broadcast (&pool->start_cond);
+    pthread_mutex_unlock (&pool->lock);
+
+    /* the source thread handles the first share itself */
+    written = send_to_listeners (source, source->send_batch, 0, pool->count, remove_from_q,
+            &source->short_delay);
+
+    pthread_mutex_lock (&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait (&pool->done_cond, &pool->lock);
+    written += pool->sent_bytes;
+    if (pool->short_delay)
+        source->short_delay = 1;
+    pthread_mutex_unlock (&pool->lock);
+
+    source->format->sent_bytes += written;
+}
+
+
+static void source_senders_start (source_t *source)
+{
+    source_sender_pool_t *pool;
+    unsigned int i;
+
+    if (source->sender_threads < 2)
+        return;
+
+    pool = calloc (1, sizeof (source_sender_pool_t));
+    if (pool == NULL)
+        return;
+    pool->senders = calloc (source->sender_threads, sizeof (source_sender_t));
+    if (pool->senders == NULL)
+    {
+        free (pool);
+        return;
+    }
+    pthread_mutex_init (&pool->lock, NULL);
+    pthread_cond_init (&pool->start_cond, NULL);
+    pthread_cond_init (&pool->done_cond, NULL);
+    pool->source = source;
+    pool->running = 1;
+
+    /* sender 0 is the source thread itself */
+    for (i = 1; i < source->sender_threads; i++)
+    {
+        pool->senders[i].pool = pool;
+        pool->senders[i].index = i;
+        if (source->send_batch)
+            pool->senders[i].batch = send_batch_new ();
+        pool->senders[i].thread = thread_create ("Source Sender Thread",
+                source_sender_thread, &pool->senders[i], THREAD_ATTACHED);
+        if (pool->senders[i].thread == NULL)
+        {
+            ICECAST_LOG_WARN("only %u of %u sender threads started for %s", i,
+                    source->sender_threads, source->mount);
+            send_batch_free (pool->senders[i].batch);
+            pool->senders[i].batch = NULL;
+            break;
+        }
+    }
+    /* the shares are split over the senders which did start, none of them
+     * looks at the count before the first pass */
+    pthread_mutex_lock (&pool->lock);
+    pool->count = i;
+    pthread_mutex_unlock (&pool->lock);
+    source->sender_pool = pool;
+    if (pool->count < 2)
+    {
+        /* nothing to share with, send from the source thread alone */
+        source_senders_stop (source);
+        return;
+    }
+    ICECAST_LOG_INFO("using %u sender threads for %s", pool->count, source->mount);
+}
+
+
+static void source_senders_stop (source_t *source)
+{
+    source_sender_pool_t *pool = source->sender_pool;
+    unsigned int i;
+
+    if (pool == NULL)
+        return;
+    source->sender_pool = NULL;
+
+    pthread_mutex_lock (&pool->lock);
+    pool->running = 0;
+    pthread_cond_broadcast (&pool->start_cond);
+    pthread_mutex_unlock (&pool->lock);
+
+    for (i = 1; i < pool->count; i++)
+    {
+        thread_join (pool->senders[i].thread);
+        send_batch_free (pool->senders[i].batch);
+    }
+
+    pthread_cond_destroy (&pool->done_cond);
+    pthread_cond_destroy (&pool->start_cond);
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->senders);
+    free (pool);
+}
+
+
+/* The queue ring is sized from the queue size limit. If it fills up before
+ * the limit is reached then the oldest data is dropped early.
+ */
+static void source_ring_start (source_t *source)
+{
+    source_ring_t *ring;
+    unsigned long size = 64;
+
+    if (source->queue_ring == 0)
+        return;
+    while (size < source->queue_size_limit / 256 + 64 && size < (1UL << 20))
+        size <<= 1;
+
+    ring = calloc (1, sizeof (source_ring_t));
+    if (ring)
+    {
+        ring->entries = calloc (size, sizeof (refbuf_t *));
+        ring->offsets = calloc (size, sizeof (uint64_t));
+    }
+    if (ring == NULL || ring->entries == NULL || ring->offsets == NULL)
+    {
+        ICECAST_LOG_WARN("unable to allocate queue ring for %s", source->mount);
+        if (ring)
+        {
+            free (ring->entries);
+            free (ring->offsets);
+            free (ring);
+        }
+        return;
     }
+    ring->mask = size - 1;
+    ring->head = ring->tail = 1;
+    source->ring = ring;
+    ICECAST_LOG_DEBUG("queue ring of %lu entries for %s", size, source->mount);
+}
 
-    return refbuf;
+
+static void source_ring_stop (source_t *source)
+{
+    source_ring_t *ring = source->ring;
+
+    if (ring == NULL)
+        return;
+    source->ring = NULL;
+    free (ring->entries);
+    free (ring->offsets);
+    free (ring);
 }
 
 
-/* general send routine per listener.  The deletion_expected tells us whether
- * the last in the queue is about to disappear, so if this client is still
- * referring to it after writing then drop the client as it's fallen too far
- * behind
+/* move the burst point on by one buffer, keeping track of the next sync
+ * point after it */
+static void source_burst_advance (source_t *source)
+{
+    refbuf_t *to_release = source->burst_point;
+
+    source->burst_point = to_release->next;
+    source->burst_offset -= to_release->len;
+    refbuf_release (to_release);
+    if (source->burst_point && source->burst_sync == source->burst_point)
+    {
+        refbuf_t *sync = source->burst_point->next;
+
+        while (sync && sync->sync_point == 0)
+            sync = sync->next;
+        source->burst_sync = sync;
+    }
+}
+
+
+/* with a burst duration, the burst point goes to the newest sync point
+ * which is at least that old, so a burst covers the duration and starts
+ * where a player can decode from */
+static void source_burst_trim_duration (source_t *source, uint64_t now)
+{
+    refbuf_t *sync;
+
+    while ((sync = source->burst_sync) && now - sync->arrival >= source->burst_duration)
+    {
+        while (source->burst_point != sync)
+            source_burst_advance (source);
+        if (source->burst_snapshot)
+            source_burst_invalidate (source);
+    }
+}
+
+
+/* change the bytes queued on the source and over all sources */
+static void source_queue_account (source_t *source, long delta)
+{
+    source->queue_size += delta;
+    global_queue_bytes_add (delta);
+}
+
+
+/* publish the mean delivery time of the last second, from arriving off
+ * the source to being written in full to a listener */
+static void source_report_latency (source_t *source)
+{
+    uint64_t sum, count = stats_histogram_totals (source->counters, STATS_HISTOGRAM_DELIVERY, &sum);
+
+    if (count > source->latency_count)
+        stats_event_args (source->mount, "latency_ms", "%.1f",
+                (double)(sum - source->latency_sum) / (count - source->latency_count) / 1000.0);
+    source->latency_count = count;
+    source->latency_sum = sum;
+}
+
+
+/* once a second, see whether the queues fit the memory budget. While over
+ * it, mounts with no more than the average number of listeners halve their
+ * queue limit, down to a little over the burst. Limits grow back towards
+ * the configured size once there is room again.
  */
-static void send_to_listener (source_t *source, client_t *client, int deletion_expected)
+static void source_check_budget (source_t *source)
 {
-    int bytes;
-    int loop = 10;   /* max number of iterations in one go */
-    int total_written = 0;
+    ice_config_t *config = config_get_config ();
+    unsigned long budget = config->memory_budget;
+    unsigned int limit = source->queue_size_limit;
+    unsigned int floor;
+    long total;
 
-    while (1)
+    config_release_config ();
+    thread_mutex_lock (&source->lock);
+    source->budget_checked = source->last_read;
+
+    if (source->queue_size != source->published_queue_size)
     {
-        /* check for limited listener time */
-        if (client->con->discon_time)
-            if (time(NULL) >= client->con->discon_time)
-            {
-                ICECAST_LOG_INFO("time limit reached for client #%lu", client->con->id);
-                client->con->error = 1;
-            }
+        stats_event_args (source->mount, "queue_bytes", "%u", source->queue_size);
+        source->published_queue_size = source->queue_size;
+    }
 
-        /* jump out if client connection has died */
-        if (client->con->error)
-            break;
+    floor = source->burst_size + SOURCE_BUDGET_MIN_QUEUE;
+    if (floor > source->queue_size_max)
+        floor = source->queue_size_max;
+    total = global_queue_bytes ();
 
-        /* lets not send too much to one client in one go, but don't
-           sleep for too long if more data can be sent */
-        if (total_written > 20000 || loop == 0)
-        {
-            if (client->check_buffer != format_check_file_buffer)
-                source->short_delay = 1;
-            break;
-        }
+    if (budget && (unsigned long)total > budget)
+    {
+        int sources = global_sources ();
+        unsigned long average = sources > 0 ? (unsigned long)global_clients () / sources : 0;
 
-        loop--;
+        if (source->listeners <= average && limit > floor)
+            limit = limit / 2 > floor ? limit / 2 : floor;
+    }
+    else if (limit < source->queue_size_max &&
+            (budget == 0 || (unsigned long)total + limit < budget - budget / 8))
+    {
+        limit = limit > source->queue_size_max / 2 ? source->queue_size_max : limit * 2;
+    }
 
-        if (client->check_buffer(source, client) < 0)
-            break;
+    if (limit != source->queue_size_limit)
+    {
+        ICECAST_LOG_INFO("queue limit on %s now %u, %ld bytes queued over all sources",
+                source->mount, limit, total);
+        source->queue_size_limit = limit;
+        stats_event_args (source->mount, "queue_limit", "%u", limit);
+    }
+    thread_mutex_unlock (&source->lock);
+}
 
-        bytes = client->write_to_client(client);
-        if (bytes <= 0)
-            break; /* can't write any more */
 
-        total_written += bytes;
+/* drop the oldest buffer on the queue ring */
+static void source_ring_drop (source_t *source)
+{
+    source_ring_t *ring = source->ring;
+    refbuf_t *to_go = source->stream_data;
+
+    if (to_go == NULL)
+        return;
+    if (source->burst_point == to_go)
+    {
+        /* ring is smaller than the burst, so move it on */
+        source_burst_advance (source);
     }
-    source->format->sent_bytes += total_written;
+    source->stream_data = to_go->next;
+    if (source->stream_data == NULL)
+        source->stream_data_tail = NULL;
+    source_queue_account (source, -(long)to_go->len);
+    ring->entries [ring->head & ring->mask] = NULL;
+    ring->head++;
+    to_go->next = NULL;
+    refbuf_release (to_go);
+}
 
-    /* the refbuf referenced at head (last in queue) may be marked for deletion
-     * if so, check to see if this client is still referring to it */
-    if (deletion_expected && client->refbuf && client->refbuf == source->stream_data)
+
+/* add a new buffer to the queue ring, before it is linked onto the queue */
+static void source_ring_append (source_t *source, refbuf_t *refbuf)
+{
+    source_ring_t *ring = source->ring;
+
+    if (ring->tail - ring->head > ring->mask)
+        source_ring_drop (source);
+    refbuf->seq = ring->tail;
+    ring->entries [ring->tail & ring->mask] = refbuf;
+    ring->offsets [ring->tail & ring->mask] = ring->tail_offset;
+    ring->tail_offset += refbuf->len;
+    ring->tail++;
+}
+
+
+/* drop buffers older than min_seq, the oldest any listener refers to, and
+ * any over the queue size limit. The burst data is always kept.
+ */
+static void source_ring_trim (source_t *source, uint64_t min_seq)
+{
+    source_ring_t *ring = source->ring;
+
+    while (source->stream_data && source->stream_data->next &&
+            source->stream_data != source->burst_point)
     {
-        ICECAST_LOG_INFO("Client %lu (%s) has fallen too far behind, removing",
-                client->con->id, client->con->ip);
-        stats_event_inc (source->mount, "slow_listeners");
-        client->con->error = 1;
+        if (ring->head >= min_seq && source->queue_size <= source->queue_size_limit)
+            break;
+        source_ring_drop (source);
     }
 }
 
@@ -594,7 +2006,7 @@ static void send_to_listener (source_t *source, client_t *client, int deletion_e
 /* Open the file for stream dumping.
  * This function should do all processing of the filename.
  */
-static FILE * source_open_dumpfile(const char * filename) {
+static dumpfile_t *source_open_dumpfile(source_t *source, const char * filename) {
 #ifndef _WIN32
     /* some of the below functions seems not to be standard winapi functions */
     char buffer[PATH_MAX];
@@ -611,7 +2023,8 @@ static FILE * source_open_dumpfile(const char * filename) {
     filename = buffer;
 #endif
 
-    return fopen (filename, "ab");
+    return dumpfile_open (filename, source->dumpfile_queue_size,
+            source->dumpfile_overflow, source->dumpfile_preallocate);
 }
 
 /* Perform any initialisation just before the stream data is processed, the header
@@ -620,6 +2033,7 @@ static FILE * source_open_dumpfile(const char * filename) {
 static void source_init (source_t *source)
 {
     ice_config_t *config = config_get_config();
+    mount_proxy *mountinfo;
     char *listenurl;
     const char *str;
     int listen_url_size;
@@ -631,6 +2045,26 @@ static void source_init (source_t *source)
     listenurl = malloc (listen_url_size);
     snprintf (listenurl, listen_url_size, "http://%s:%d%s",
             config->hostname, config->port, source->mount);
+
+    mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
+    if (mountinfo && mountinfo->timeshift)
+    {
+        timeshift_t *ts = timeshift_start (source->mount, mountinfo->timeshift,
+                mountinfo->timeshift_segment, mountinfo->timeshift_duration);
+
+        thread_mutex_lock (&source->lock);
+        source->timeshift = ts;
+        thread_mutex_unlock (&source->lock);
+    }
+    if (mountinfo && mountinfo->hls && source->format)
+    {
+        hls_t *hls = hls_start (source->mount, source->format->contenttype,
+                mountinfo->hls_segment, mountinfo->hls_segments);
+
+        thread_mutex_lock (&source->lock);
+        source->hls = hls;
+        thread_mutex_unlock (&source->lock);
+    }
     config_release_config();
 
     str = httpp_getvar(source->parser, "ice-audio-info");
@@ -647,7 +2081,7 @@ static void source_init (source_t *source)
 
     if (source->dumpfilename != NULL)
     {
-        source->dumpfile = source_open_dumpfile (source->dumpfilename);
+        source->dumpfile = source_open_dumpfile (source, source->dumpfilename);
         if (source->dumpfile == NULL)
         {
             ICECAST_LOG_WARN("Cannot open dump file \"%s\" for appending: %s, disabling.",
@@ -662,15 +2096,24 @@ static void source_init (source_t *source)
     source->listeners = 0;
     stats_event_inc (NULL, "source_total_connections");
     stats_event (source->mount, "slow_listeners", "0");
+    stats_event (source->mount, "slow_listener_skips", "0");
+    source->counters = stats_counters_register (source->mount);
     stats_event_args (source->mount, "listeners", "%lu", source->listeners);
     stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
     stats_event_time (source->mount, "stream_start");
     stats_event_time_iso8601 (source->mount, "stream_start_iso8601");
 
+    source_ring_start (source);
+    if (source->io_uring)
+        source->send_batch = send_batch_new ();
+    source_senders_start (source);
+    source_listener_events_start (source);
+
     ICECAST_LOG_DEBUG("Source creation complete");
     source->last_read = time (NULL);
     source->prev_listeners = -1;
     source->running = 1;
+    source_routes_changed ();
 
     event_emit_clientevent("source-connect", source->client, source->mount);
 
@@ -696,179 +2139,250 @@ static void source_init (source_t *source)
 }
 
 
-void source_main (source_t *source)
+/* one pass of the source, read what there is then send to the listeners */
+static void source_cycle (source_t *source)
 {
     refbuf_t *refbuf;
     client_t *client;
-    avl_node *client_node;
-
-    source_init (source);
+    unsigned long i;
+    unsigned int burst_limit;
+    int remove_from_q;
+    uint64_t min_seq = 0, cycle_start, now_us;
 
-    while (global.running == ICECAST_RUNNING && source->running) {
-        int remove_from_q;
+    cycle_start = stats_time_us();
+    refbuf = get_next_buffer (source);
+    now_us = stats_time_us();
+    stats_histogram_record (source->counters, STATS_HISTOGRAM_READ_WAIT, now_us - cycle_start);
+    cycle_start = now_us;
 
-        refbuf = get_next_buffer (source);
+    remove_from_q = 0;
+    source->short_delay = 0;
 
-        remove_from_q = 0;
-        source->short_delay = 0;
+    if (refbuf)
+    {
+        if (source->ring)
+            source_ring_append (source, refbuf);
 
-        if (refbuf)
+        /* append buffer to the in-flight data queue,  */
+        if (source->stream_data == NULL)
         {
-            /* append buffer to the in-flight data queue,  */
-            if (source->stream_data == NULL)
-            {
-                source->stream_data = refbuf;
-                source->burst_point = refbuf;
-            }
-            if (source->stream_data_tail)
-                source->stream_data_tail->next = refbuf;
-            source->stream_data_tail = refbuf;
-            source->queue_size += refbuf->len;
-            /* new buffer is referenced for burst */
-            refbuf_addref(refbuf);
-
-            /* new data on queue, so check the burst point */
-            source->burst_offset += refbuf->len;
-            while (source->burst_offset > source->burst_size)
+            source->stream_data = refbuf;
+            source->burst_point = refbuf;
+        }
+        if (source->stream_data_tail)
+            source->stream_data_tail->next = refbuf;
+        source->stream_data_tail = refbuf;
+        source_queue_account (source, refbuf->len);
+        ICECAST_TRACE3 (refbuf_append, source->mount, refbuf->len, source->queue_size);
+        /* new buffer is referenced for burst */
+        refbuf_addref(refbuf);
+        if (refbuf->sync_point && source->burst_sync == NULL && refbuf != source->burst_point)
+            source->burst_sync = refbuf;
+
+        /* new data on queue, so check the burst point */
+        source->burst_offset += refbuf->len;
+        burst_limit = source->burst_size;
+        if (source->burst_duration)
+        {
+            source_burst_trim_duration (source, refbuf->arrival);
+            /* still bound the memory if sync points are far apart */
+            burst_limit = source->queue_size_limit / 2;
+        }
+        while (source->burst_offset > burst_limit)
+        {
+            refbuf_t *to_release = source->burst_point;
+
+            if (to_release->next)
             {
-                refbuf_t *to_release = source->burst_point;
-
-                if (to_release->next)
-                {
-                    source->burst_point = to_release->next;
-                    source->burst_offset -= to_release->len;
-                    refbuf_release(to_release);
-                    continue;
-                }
-                break;
+                source_burst_advance (source);
+                if (source->burst_snapshot)
+                    source_burst_invalidate (source);
+                continue;
             }
-
-            /* save stream to file */
-            if (source->dumpfile && source->format->write_buf_to_file)
-                source->format->write_buf_to_file(source, refbuf);
+            break;
         }
-        /* lets see if we have too much data in the queue, but don't remove it until later */
-        thread_mutex_lock(&source->lock);
-        if (source->queue_size > source->queue_size_limit)
-            remove_from_q = 1;
-        thread_mutex_unlock(&source->lock);
 
-        /* acquire write lock on pending_tree */
-        avl_tree_wlock(source->pending_tree);
+        /* save stream to file */
+        if (source->dumpfile && source->format->write_buf_to_file)
+            source->format->write_buf_to_file(source, refbuf);
+        if (source->timeshift)
+            timeshift_write (source->timeshift, source, refbuf);
+        if (source->hls)
+            hls_write (source->hls, source, refbuf);
+    }
+    /* lets see if we have too much data in the queue, but don't remove it until later */
+    thread_mutex_lock(&source->lock);
+    if (source->queue_size > source->queue_size_limit)
+        remove_from_q = 1;
+    thread_mutex_unlock(&source->lock);
 
-        /* acquire write lock on client_tree */
-        avl_tree_wlock(source->client_tree);
+    /* acquire write lock on client_list */
+    listener_list_wlock (&source->client_list);
 
-        client_node = avl_get_first(source->client_tree);
-        while (client_node) {
-            client = (client_t *) client_node->key;
+    /* pick up the clients which joined since the last pass */
+    if (source_add_pending (source) == 0 && refbuf == NULL && source->listeners_ready)
+    {
+        /* only woken up by listener sockets, leave the others alone */
+        send_to_ready_listeners(source, remove_from_q);
+        if (source->ring)
+            min_seq = source->ring->head;
+    }
+    else
+    {
+        if (source->ring)
+            min_seq = source->ring->tail;
+        source_listeners_writable (source);
+        if (source->sender_pool)
+            source_senders_run(source, remove_from_q);
+        else if (source->send_batch)
+            source->format->sent_bytes += send_to_listeners (source,
+                    source->send_batch, 0, 1, remove_from_q, &source->short_delay);
+
+        /* a removed listener is replaced by the last one in the list,
+         * so stay on the same index */
+        i = 0;
+        while (i < source->client_list.count)
+        {
+            client = source->client_list.clients[i];
 
-            send_to_listener(source, client, remove_from_q);
+            if (source->sender_pool == NULL && source->send_batch == NULL)
+                source->format->sent_bytes += send_to_listener(source, client, remove_from_q, &source->short_delay);
 
             if (client->con->error) {
-                client_node = avl_get_next(client_node);
-                if (client->respcode == 200)
-                    stats_event_dec(NULL, "listeners");
-                avl_delete(source->client_tree, (void *) client, _free_client);
-                source->listeners--;
-                ICECAST_LOG_DEBUG("Client removed");
+                source_remove_listener(source, i);
                 continue;
             }
-            client_node = avl_get_next(client_node);
+            if (client->queue_seq && client->queue_seq < min_seq)
+                min_seq = client->queue_seq;
+            i++;
+        }
+    }
+    source->listeners_ready = 0;
+    stats_histogram_record (source->counters, STATS_HISTOGRAM_FANOUT,
+            stats_time_us() - cycle_start);
+
+    /* update the stats if need be */
+    if (source->listeners != source->prev_listeners)
+    {
+        source->prev_listeners = source->listeners;
+        ICECAST_LOG_INFO("listener count on %s now %lu", source->mount, source->listeners);
+        if (source->listeners > source->peak_listeners)
+        {
+            source->peak_listeners = source->listeners;
+            stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
         }
+        stats_event_args (source->mount, "listeners", "%lu", source->listeners);
+        if (source->listeners == 0 && source->on_demand && source->on_demand_warm == 0)
+            source->running = 0;
+    }
+    if (source->last_read != source->budget_checked)
+    {
+        source_report_latency (source);
+        source_check_budget (source);
+    }
 
-        /** add pending clients **/
-        client_node = avl_get_first(source->pending_tree);
-        while (client_node) {
+    /* lets reduce the queue, any lagging clients should of been
+     * terminated by now
+     */
+    if (source->ring)
+        source_ring_trim (source, min_seq);
+    else if (source->stream_data)
+    {
+        /* normal unreferenced queue data will have a refcount 1, but
+         * burst queue data will be at least 2, active clients will also
+         * increase refcount */
+        while (refbuf_refcount (source->stream_data) == 1)
+        {
+            refbuf_t *to_go = source->stream_data;
 
-            if(source->max_listeners != -1 &&
-                    source->listeners >= (unsigned long)source->max_listeners)
+            if (to_go->next == NULL || source->burst_point == to_go)
             {
-                /* The common case is caught in the main connection handler,
-                 * this deals with rarer cases (mostly concerning fallbacks)
-                 * and doesn't give the listening client any information about
-                 * why they were disconnected
-                 */
-                client = (client_t *)client_node->key;
-                client_node = avl_get_next(client_node);
-                avl_delete(source->pending_tree, (void *)client, _free_client);
-
-                ICECAST_LOG_INFO("Client deleted, exceeding maximum listeners for this "
-                        "mountpoint (%s).", source->mount);
-                continue;
+                /* this should not happen */
+                ICECAST_LOG_ERROR("queue state is unexpected");
+                source->running = 0;
+                break;
             }
+            source->stream_data = to_go->next;
+            source_queue_account (source, -(long)to_go->len);
+            to_go->next = NULL;
+            refbuf_release (to_go);
+        }
+    }
 
-            /* Otherwise, the client is accepted, add it */
-            avl_insert(source->client_tree, client_node->key);
+    /* release write lock on client_list */
+    listener_list_unlock (&source->client_list);
 
-            source->listeners++;
-            ICECAST_LOG_DEBUG("Client added for mountpoint (%s)", source->mount);
-            stats_event_inc(source->mount, "connections");
+    if (source->filter)
+        source_run_filter (source);
+}
 
-            client_node = avl_get_next(client_node);
-        }
 
-        /** clear pending tree **/
-        while (avl_get_first(source->pending_tree)) {
-            avl_delete(source->pending_tree,
-                    avl_get_first(source->pending_tree)->key,
-                    source_remove_client);
-        }
+void source_main (source_t *source)
+{
+    source_init (source);
 
-        /* release write lock on pending_tree */
-        avl_tree_unlock(source->pending_tree);
+    while (global.running == ICECAST_RUNNING && source->running)
+        source_cycle (source);
+    source_shutdown (source);
+}
 
-        /* update the stats if need be */
-        if (source->listeners != source->prev_listeners)
-        {
-            source->prev_listeners = source->listeners;
-            ICECAST_LOG_INFO("listener count on %s now %lu", source->mount, source->listeners);
-            if (source->listeners > source->peak_listeners)
-            {
-                source->peak_listeners = source->listeners;
-                stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
-            }
-            stats_event_args (source->mount, "listeners", "%lu", source->listeners);
-            if (source->listeners == 0 && source->on_demand)
-                source->running = 0;
-        }
 
-        /* lets reduce the queue, any lagging clients should of been
-         * terminated by now
-         */
-        if (source->stream_data)
-        {
-            /* normal unreferenced queue data will have a refcount 1, but
-             * burst queue data will be at least 2, active clients will also
-             * increase refcount */
-            while (source->stream_data->_count == 1)
-            {
-                refbuf_t *to_go = source->stream_data;
+/* For sources run by a thread serving several, such as the relay pool.
+ * The caller waits on source_step_fd and calls source_step when it is
+ * readable or the time returned by the last call has passed. Reads then
+ * never wait.
+ */
+void source_step_start (source_t *source)
+{
+    source->stepped = 1;
+    source_init (source);
+}
+
+
+/* the descriptor to wait on for the next step, the listener event set if
+ * there is one as that includes the source socket */
+int source_step_fd (source_t *source)
+{
+    if (source->listener_poll_fd >= 0)
+        return source->listener_poll_fd;
+    return source->con ? source->con->sock : -1;
+}
 
-                if (to_go->next == NULL || source->burst_point == to_go)
-                {
-                    /* this should not happen */
-                    ICECAST_LOG_ERROR("queue state is unexpected");
-                    source->running = 0;
-                    break;
-                }
-                source->stream_data = to_go->next;
-                source->queue_size -= to_go->len;
-                to_go->next = NULL;
-                refbuf_release (to_go);
-            }
-        }
 
-        /* release write lock on client_tree */
-        avl_tree_unlock(source->client_tree);
+/* Run one cycle of the source. Returns the ms until it is to be run again
+ * if nothing wakes it, or -1 once it has stopped and been shut down.
+ */
+int source_step (source_t *source)
+{
+    if (global.running != ICECAST_RUNNING || source->running == 0)
+    {
+        source_shutdown (source);
+        source->stepped = 0;
+        return -1;
     }
-    source_shutdown (source);
+    source_cycle (source);
+    if (source->short_delay)
+        return 0;
+    return source->low_latency ? SOURCE_LOW_LATENCY_WAIT : 250;
 }
 
 
 static void source_shutdown (source_t *source)
 {
+    source_filter_t *filter;
+
+    thread_mutex_lock (&source->lock);
     source->running = 0;
+    /* a filter still waiting is not going to be run */
+    filter = source->filter;
+    source->filter = NULL;
+    thread_mutex_unlock (&source->lock);
+    if (filter)
+        filter->done (filter, source->mount, -1);
+    source_senders_stop (source);
+    send_batch_free (source->send_batch);
+    source->send_batch = NULL;
+    source_listener_events_stop (source);
     ICECAST_LOG_INFO("Source from %s at \"%s\" exiting", source->con->ip, source->mount);
 
     event_emit_clientevent("source-disconnect", source->client, source->mount);
@@ -890,6 +2404,8 @@ static void source_shutdown (source_t *source)
     }
 
     /* delete this sources stats */
+    stats_counters_release (source->counters);
+    source->counters = NULL;
     stats_event(source->mount, NULL, NULL);
 
     if (source->client && source->parser) {
@@ -921,37 +2437,13 @@ static void source_shutdown (source_t *source)
      therefore reserved */
     source_clear_source(source);
 
-    global_lock();
-    global.sources--;
-    stats_event_args(NULL, "sources", "%d", global.sources);
-    global_unlock();
+    stats_event_args(NULL, "sources", "%d", global_sources_add(-1));
 
     /* release our hold on the lock so the main thread can continue cleaning up */
     thread_rwlock_unlock(source->shutdown_rwlock);
 }
 
 
-static int _compare_clients(void *compare_arg, void *a, void *b)
-{
-    client_t *clienta = (client_t *) a;
-    client_t *clientb = (client_t *) b;
-
-    (void)compare_arg;
-
-    connection_t *cona = clienta->con;
-    connection_t *conb = clientb->con;
-
-    if (cona->id < conb->id) return -1;
-    if (cona->id > conb->id) return 1;
-
-    return 0;
-}
-
-int source_remove_client(void *key)
-{
-    return 1;
-}
-
 static int _free_client(void *key)
 {
     client_t *client = (client_t *)key;
@@ -1013,7 +2505,7 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
     acl_t *acl = NULL;
 
     ICECAST_LOG_DEBUG("Applying mount information for \"%s\"", source->mount);
-    avl_tree_rlock (source->client_tree);
+    listener_list_rlock (&source->client_list);
     stats_event_args (source->mount, "listener_peak", "%lu", source->peak_listeners);
 
     if (mountinfo)
@@ -1030,6 +2522,8 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
         parser = source->client->parser;
 
     /* to be done before possible non-utf8 stats */
+    if (source->format)
+        source->format->metadata_interval = mountinfo ? mountinfo->metadata_interval : 0;
     if (source->format && source->format->apply_settings)
         source->format->apply_settings (source->client, source->format, mountinfo);
 
@@ -1183,15 +2677,23 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
         char *filename = source->dumpfilename;
         source->dumpfilename = strdup (mountinfo->dumpfile);
         free (filename);
+        source->dumpfile_queue_size = mountinfo->dumpfile_queue_size;
+        source->dumpfile_overflow = mountinfo->dumpfile_overflow;
+        source->dumpfile_preallocate = mountinfo->dumpfile_preallocate;
     }
     else
         source->dumpfilename = NULL;
 
+    thread_mutex_lock (&source->intro_lock);
     if (source->intro_file)
     {
         fclose (source->intro_file);
         source->intro_file = NULL;
     }
+    refbuf_release (source->intro);
+    source->intro = NULL;
+    free (source->intro_path);
+    source->intro_path = NULL;
     if (mountinfo && mountinfo->intro_filename)
     {
         ice_config_t *config = config_get_config_unlocked ();
@@ -1204,14 +2706,21 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
             snprintf (path, len, "%s" PATH_SEPARATOR "%s", config->webroot_dir,
                     mountinfo->intro_filename);
 
-            f = fopen (path, "rb");
-            if (f)
+            /* mounts sharing an intro share the one copy of it */
+            source->intro = intro_cache_get (path);
+            if (source->intro)
+            {
+                source->intro_path = path;
+                path = NULL;
+            }
+            else if ((f = fopen (path, "rb")) != NULL)
                 source->intro_file = f;
             else
                 ICECAST_LOG_WARN("Cannot open intro file \"%s\": %s", path, strerror(errno));
             free (path);
         }
     }
+    thread_mutex_unlock (&source->intro_lock);
 
     if (mountinfo && mountinfo->queue_size_limit)
         source->queue_size_limit = mountinfo->queue_size_limit;
@@ -1222,13 +2731,51 @@ static void source_apply_mount (ice_config_t *config, source_t *source, mount_pr
     if (mountinfo && mountinfo->burst_size >= 0)
         source->burst_size = (unsigned int) mountinfo->burst_size;
 
+    source->burst_duration = mountinfo ? mountinfo->burst_duration : 0;
+
+    /* listeners start at the newest point they can decode from */
+    source->low_latency = mountinfo ? mountinfo->low_latency : 0;
+    if (source->low_latency)
+    {
+        source->burst_size = 0;
+        source->burst_duration = 0;
+    }
+
     if (mountinfo && mountinfo->fallback_when_full)
         source->fallback_when_full = mountinfo->fallback_when_full;
 
     if (mountinfo && mountinfo->max_history > 0)
         playlist_set_max_tracks(source->history, mountinfo->max_history);
 
-    avl_tree_unlock(source->client_tree);
+    /* only picked up when the source starts */
+    if (mountinfo)
+    {
+        source->sender_threads = mountinfo->sender_threads;
+        source->queue_ring = mountinfo->queue_ring;
+        source->listener_events = mountinfo->listener_events;
+        source->zerocopy = mountinfo->zerocopy;
+        source->io_uring = mountinfo->io_uring;
+    }
+    if (mountinfo)
+    {
+        source->slow_listener_action = mountinfo->slow_listener_action;
+        source->so_sndbuf = mountinfo->so_sndbuf;
+        source->so_notsent_lowat = mountinfo->so_notsent_lowat;
+        if (source->low_latency && source->so_sndbuf == 0)
+            source->so_sndbuf = SOURCE_LOW_LATENCY_SNDBUF;
+        if (source->low_latency && source->so_notsent_lowat == 0)
+            source->so_notsent_lowat = SOURCE_LOW_LATENCY_LOWAT;
+        connection_rate_set(&source->listener_rate, mountinfo->listener_rate, mountinfo->listener_burst);
+    }
+    else
+    {
+        source->slow_listener_action = SLOW_LISTENER_DISCONNECT;
+        source->so_sndbuf = 0;
+        source->so_notsent_lowat = 0;
+        connection_rate_set(&source->listener_rate, 0, 0);
+    }
+
+    listener_list_unlock (&source->client_list);
 }
 
 
@@ -1255,6 +2802,7 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
             config->hostname, config->port, source->mount);
 
     source_apply_mount (config, source, mountinfo);
+    format_invalidate_headers (source);
 
     if (source->fallback_mount)
         ICECAST_LOG_DEBUG("fallback %s", source->fallback_mount);
@@ -1289,8 +2837,12 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
     }
     ICECAST_LOG_DEBUG("public set to %d", source->yp_public);
     ICECAST_LOG_DEBUG("max listeners to %ld", source->max_listeners);
+    source->queue_size_max = source->queue_size_limit;
+    source->budget_checked = 0;
     ICECAST_LOG_DEBUG("queue size to %u", source->queue_size_limit);
     ICECAST_LOG_DEBUG("burst size to %u", source->burst_size);
+    if (source->burst_duration)
+        ICECAST_LOG_DEBUG("burst duration to %ums", source->burst_duration);
     ICECAST_LOG_DEBUG("source timeout to %u", source->timeout);
     ICECAST_LOG_DEBUG("fallback_when_full to %u", source->fallback_when_full);
     thread_mutex_unlock(&source->lock);
@@ -1301,6 +2853,7 @@ void *source_client_thread (void *arg)
 {
     source_t *source = arg;
 
+    affinity_apply (AFFINITY_SOURCE);
     stats_event_inc(NULL, "source_client_connections");
     stats_event (source->mount, "listeners", "0");
 
@@ -1321,9 +2874,7 @@ void source_client_callback (client_t *client, void *arg)
 
     if (client->con->error)
     {
-        global_lock();
-        global.sources--;
-        global_unlock();
+        global_sources_add(-1);
         source_clear_source (source);
         source_free_source (source);
         return;
@@ -1347,6 +2898,7 @@ static void *source_fallback_file (void *arg)
     char *path;
     unsigned int len;
     FILE *file = NULL;
+    refbuf_t *intro = NULL;
     source_t *source = NULL;
     ice_config_t *config;
     http_parser_t *parser;
@@ -1365,18 +2917,20 @@ static void *source_fallback_file (void *arg)
         if (path == NULL)
             break;
 
-        file = fopen (path, "rb");
-        if (file == NULL)
+        intro = intro_cache_get (path);
+        if (intro == NULL)
+            file = fopen (path, "rb");
+        if (intro == NULL && file == NULL)
         {
             ICECAST_LOG_WARN("unable to open file \"%s\"", path);
             free (path);
             break;
         }
-        free (path);
         source = source_reserve (mount);
         if (source == NULL)
         {
             ICECAST_LOG_WARN("mountpoint \"%s\" already reserved", mount);
+            free (path);
             break;
         }
         ICECAST_LOG_INFO("mountpoint %s is reserved", mount);
@@ -1391,6 +2945,14 @@ static void *source_fallback_file (void *arg)
         source->intro_file = file;
         source->parser = parser;
         file = NULL;
+        if (intro)
+        {
+            source->intro = intro;
+            source->intro_path = path;
+            intro = NULL;
+        }
+        else
+            free (path);
 
         if (connection_complete_source (source, 0) < 0)
             break;
@@ -1399,11 +2961,53 @@ static void *source_fallback_file (void *arg)
     } while (0);
     if (file)
         fclose (file);
+    refbuf_release (intro);
     free (mount);
     return NULL;
 }
 
 
+/* MUST be called with the source tree and the config locked */
+static void source_recheck_mount (ice_config_t *config, mount_proxy *mount, int update_all)
+{
+    source_t *source = source_find_mount (mount->mountname);
+
+    if (source)
+    {
+        source = source_find_mount_raw (mount->mountname);
+        if (source)
+        {
+            mount_proxy *mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
+            source_update_settings (config, source, mountinfo);
+        }
+        else if (update_all)
+        {
+            stats_event_hidden (mount->mountname, NULL, mount->hidden);
+            stats_event_args (mount->mountname, "listenurl", "http://%s:%d%s",
+                    config->hostname, config->port, mount->mountname);
+            stats_event (mount->mountname, "listeners", "0");
+            if (mount->max_listeners < 0)
+                stats_event (mount->mountname, "max_listeners", "unlimited");
+            else
+                stats_event_args (mount->mountname, "max_listeners", "%d", mount->max_listeners);
+        }
+    }
+    else
+        stats_event (mount->mountname, NULL, NULL);
+
+    /* check for fallback to file */
+    if (global.running == ICECAST_RUNNING && mount->fallback_mount)
+    {
+        source_t *fallback = source_find_mount (mount->fallback_mount);
+        if (fallback == NULL)
+        {
+            thread_create ("Fallback file thread", source_fallback_file,
+                    strdup (mount->fallback_mount), THREAD_DETACHED);
+        }
+    }
+}
+
+
 /* rescan the mount list, so that xsl files are updated to show
  * unconnected but active fallback mountpoints
  */
@@ -1412,6 +3016,8 @@ void source_recheck_mounts (int update_all)
     ice_config_t *config;
     mount_proxy *mount;
 
+    /* fallbacks may have changed */
+    source_routes_changed ();
     avl_tree_rlock (global.source_tree);
     config = config_get_config();
     mount = config->mounts;
@@ -1423,42 +3029,40 @@ void source_recheck_mounts (int update_all)
     {
         if (mount->mounttype != MOUNT_TYPE_NORMAL)
             continue;
+        source_recheck_mount (config, mount, update_all);
+    }
+    avl_tree_unlock (global.source_tree);
+    config_release_config();
+}
 
-        source_t *source = source_find_mount (mount->mountname);
 
-        if (source)
-        {
-            source = source_find_mount_raw (mount->mountname);
-            if (source)
-            {
-                mount_proxy *mountinfo = config_find_mount (config, source->mount, MOUNT_TYPE_NORMAL);
-                source_update_settings (config, source, mountinfo);
-            }
-            else if (update_all)
-            {
-                stats_event_hidden (mount->mountname, NULL, mount->hidden);
-                stats_event_args (mount->mountname, "listenurl", "http://%s:%d%s",
-                        config->hostname, config->port, mount->mountname);
-                stats_event (mount->mountname, "listeners", "0");
-                if (mount->max_listeners < 0)
-                    stats_event (mount->mountname, "max_listeners", "unlimited");
-                else
-                    stats_event_args (mount->mountname, "max_listeners", "%d", mount->max_listeners);
-            }
-        }
-        else
-            stats_event (mount->mountname, NULL, NULL);
+/* as source_recheck_mounts(1) but only for the mounts a reload changed */
+void source_recheck_changed_mounts (config_reload_diff_t *diff)
+{
+    ice_config_t *config;
+    size_t i;
+
+    source_routes_changed ();
+    avl_tree_rlock (global.source_tree);
+    config = config_get_config();
+
+    for (i = 0; i < diff->count; i++)
+    {
+        const char *name = diff->mounts[i];
+        mount_proxy *mount = config_find_mount (config, name, MOUNT_TYPE_NORMAL);
+        source_t *source;
 
-        /* check for fallback to file */
-        if (global.running == ICECAST_RUNNING && mount->fallback_mount)
+        if (mount && mount->mounttype == MOUNT_TYPE_NORMAL)
         {
-            source_t *fallback = source_find_mount (mount->fallback_mount);
-            if (fallback == NULL)
-            {
-                thread_create ("Fallback file thread", source_fallback_file,
-                        strdup (mount->fallback_mount), THREAD_DETACHED);
-            }
+            source_recheck_mount (config, mount, 1);
+            continue;
         }
+        /* removed, a running source falls back to the default mount */
+        source = source_find_mount_raw (name);
+        if (source)
+            source_update_settings (config, source, mount);
+        else
+            stats_event (name, NULL, NULL);
     }
     avl_tree_unlock (global.source_tree);
     config_release_config();
@@ -19,10 +19,47 @@
 #include "util.h"
 #include "format.h"
 #include "playlist.h"
+#include "listeners.h"
 #include "common/thread/thread.h"
 
 #include <stdio.h>
 
+/* max number of writable listeners picked up in one wakeup */
+#define SOURCE_READY_MAX 64
+
+/* The stream queue of a source can be tracked on a ring. Listeners on the
+ * ring keep a sequence number rather than a reference to their buffer, so
+ * their buffer is only valid while the sequence is not older than head.
+ */
+typedef struct source_ring_tag
+{
+    refbuf_t **entries;
+    uint64_t *offsets;      /* stream byte offset at the start of each entry */
+    unsigned long mask;
+    uint64_t head;          /* sequence of the oldest queued buffer */
+    uint64_t tail;          /* sequence the next buffer will get */
+    uint64_t tail_offset;   /* stream bytes queued so far */
+} source_ring_t;
+
+/* A filter over the listeners of a source, applied by the source thread
+ * between cycles. Matching listeners are dropped, or moved if there is a
+ * destination. Once queued the source owns it and calls done with the
+ * number of listeners acted on, or -1 if it was not applied, with no locks
+ * held. done frees the filter.
+ */
+typedef struct source_filter_tag
+{
+    struct matchfile_tag *ips;  /* addresses and CIDR ranges */
+    char *useragent;            /* part of the user agent */
+    time_t min_connected;       /* seconds, 0 for no limit */
+    time_t max_connected;
+    unsigned int percent;       /* share of the matches to act on */
+    char *dest_mount;
+
+    void (*done)(struct source_filter_tag *filter, const char *mount, long count);
+    void *arg;
+} source_filter_t;
+
 typedef struct source_tag
 {
     mutex_t lock;
@@ -30,6 +67,7 @@ typedef struct source_tag
     connection_t *con;
     http_parser_t *parser;
     time_t client_stats_update;
+    struct stats_counters_tag *counters;
     
     char *mount;
 
@@ -42,16 +80,28 @@ typedef struct source_tag
 
     struct _format_plugin_tag *format;
 
-    avl_tree *client_tree;
-    avl_tree *pending_tree;
+    listener_list_t client_list;
+    listener_queue_t pending;
 
     rwlock_t *shutdown_rwlock;
     util_dict *audio_info;
 
     FILE *intro_file;
+    /* shared copy of the intro when small enough, used instead of the file */
+    refbuf_t *intro;
+    char *intro_path;
+    /* serialises intro file reads between sender threads */
+    mutex_t intro_lock;
 
     char *dumpfilename; /* Name of a file to dump incoming stream to */
-    FILE *dumpfile;
+    struct dumpfile_tag *dumpfile;
+    unsigned int dumpfile_queue_size;
+    dumpfile_overflow_action dumpfile_overflow;
+    unsigned int dumpfile_preallocate;
+    /* segmented recording if enabled, changed under the lock */
+    struct timeshift_tag *timeshift;
+    /* live HLS output if enabled, changed under the lock */
+    struct hls_tag *hls;
 
     unsigned long peak_listeners;
     unsigned long listeners;
@@ -66,13 +116,72 @@ typedef struct source_tag
     unsigned int burst_size;    /* trigger level for burst on connect */
     unsigned int burst_offset; 
     refbuf_t *burst_point;
+    /* ms of stream kept for a burst instead of burst_size if set, with the
+     * first sync point after the burst point, NULL if none queued yet */
+    unsigned int burst_duration;
+    refbuf_t *burst_sync;
+
+    /* copy of the burst data in one buffer, rebuilt when needed after the
+     * burst point moves. Covers the queue from start to end */
+    mutex_t burst_lock;
+    refbuf_t *burst_snapshot;
+    refbuf_t *burst_snapshot_start;
+    refbuf_t *burst_snapshot_end;
+
+    /* icy headers sent to each listener, built for the first one and
+     * dropped when the source client or mount settings change */
+    mutex_t headers_lock;
+    char *icy_headers;
+    size_t icy_headers_len;
 
     unsigned int queue_size;
     unsigned int queue_size_limit;
+    /* the configured limit, the one above is lowered from it while the
+     * server is over its memory budget */
+    unsigned int queue_size_max;
+    time_t budget_checked;
+    unsigned int published_queue_size;
+
+    /* optional ring over the stream queue */
+    int queue_ring;
+    source_ring_t *ring;
+
+    slow_listener_action slow_listener_action;
+
+    /* listeners are sent to with zero copy sends where possible */
+    int zerocopy;
+
+    /* no burst, small socket buffers and prioritised listener sockets */
+    int low_latency;
+    /* delivery times reported so far as latency_ms */
+    uint64_t latency_count, latency_sum;
+
+    /* applied to listener sockets as they join */
+    int so_sndbuf;
+    int so_notsent_lowat;
+
+    /* limits how fast new listeners are taken on */
+    connection_rate_t listener_rate;
+
+    /* listener fan-out can be split over a pool of sender threads */
+    unsigned int sender_threads;
+    struct source_sender_pool_tag *sender_pool;
+
+    /* listener writes of the source thread submitted through io_uring */
+    int io_uring;
+    struct send_batch_tag *send_batch;
+
+    /* listener sockets which could not take more data are registered
+     * for writability, so they can be serviced as soon as they drain */
+    int listener_events;
+    int listener_poll_fd;
+    unsigned int listeners_ready;
+    unsigned long listener_ready_id[SOURCE_READY_MAX];
 
     unsigned timeout;  /* source timeout in seconds */
     int on_demand;
     int on_demand_req;
+    int on_demand_warm; /* stay connected without listeners */
     int hidden;
     time_t last_read;
     int short_delay;
@@ -82,6 +191,16 @@ typedef struct source_tag
 
     playlist_t *history;
 
+    /* run a cycle at a time by a thread serving several sources */
+    int stepped;
+
+    /* listener filter waiting for the source thread, under the lock */
+    source_filter_t *filter;
+
+    /* chain in the mount hash, under the source tree write lock */
+    struct source_tag *hash_next;
+    uint32_t hash;
+
 } source_t;
 
 source_t *source_reserve (const char *mount);
@@ -91,13 +210,21 @@ void source_update_settings (ice_config_t *config, source_t *source, mount_proxy
 void source_clear_source (source_t *source);
 source_t *source_find_mount(const char *mount);
 source_t *source_find_mount_raw(const char *mount);
+void source_routes_initialize (void);
+void source_routes_shutdown (void);
+void source_routes_changed (void);
 client_t *source_find_client(source_t *source, int id);
+refbuf_t *source_burst_snapshot (source_t *source, refbuf_t *start, refbuf_t **end);
 int source_compare_sources(void *arg, void *a, void *b);
 void source_free_source(source_t *source);
 void source_move_clients (source_t *source, source_t *dest);
-int source_remove_client(void *key);
+int source_filter_listeners (source_t *source, source_filter_t *filter);
 void source_main(source_t *source);
+void source_step_start (source_t *source);
+int source_step_fd (source_t *source);
+int source_step (source_t *source);
 void source_recheck_mounts (int update_all);
+void source_recheck_changed_mounts (config_reload_diff_t *diff);
 
 extern mutex_t move_clients_mutex;
 
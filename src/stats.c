@@ -20,6 +20,12 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
+#ifdef HAVE_STDATOMIC_H
+#include <stdatomic.h>
+#endif
+#ifdef HAVE_GETTIMEOFDAY
+#include <sys/time.h>
+#endif
 
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
@@ -29,18 +35,21 @@
 #include "common/avl/avl.h"
 #include "common/httpp/httpp.h"
 #include "common/net/sock.h"
+#include "common/timing/timing.h"
 
 #include "connection.h"
 
 #include "source.h"
 #include "global.h"
 #include "refbuf.h"
+#include "objpool.h"
 #include "client.h"
 #include "admin.h"
 #include "stats.h"
 #include "xslt.h"
 #include "util.h"
 #include "auth.h"
+#include "trace.h"
 #define CATMODULE "stats"
 #include "logging.h"
 
@@ -58,17 +67,15 @@
 #define STATS_EVENT_REMOVE  5
 #define STATS_EVENT_HIDDEN  6
 
-typedef struct _event_queue_tag
-{
-    volatile stats_event_t *head;
-    volatile stats_event_t **tail;
-} event_queue_t;
-
-#define event_queue_init(qp)    { (qp)->head = NULL; (qp)->tail = &(qp)->head; }
-
+/* Each event is written out once as an "EVENT" line, stats listeners
+ * queue references to the shared line in a ring.
+ */
 typedef struct _event_listener_tag
 {
-    event_queue_t queue;
+    refbuf_t **lines;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
     mutex_t mutex;
 
     struct _event_listener_tag *next;
@@ -81,8 +88,107 @@ static volatile int _stats_threads = 0;
 static stats_t _stats;
 static mutex_t _stats_mutex;
 
-static event_queue_t _global_event_queue;
-mutex_t _global_event_mutex;
+/* Events for the stats thread. Any thread can push without blocking, the
+ * stats thread takes the whole list at once. Pushed newest first.
+ */
+#ifdef HAVE_STDATOMIC_H
+static _Atomic(stats_event_t *) _global_events;
+#else
+static stats_event_t *_global_events;
+static spin_t _global_event_lock;
+#endif
+static cond_t _global_event_cond;
+
+/* bucket i counts values up to 2^i, the last one anything larger */
+#define STATS_HISTOGRAM_BUCKETS     33
+
+typedef struct
+{
+#ifdef HAVE_STDATOMIC_H
+    _Atomic(uint64_t) bucket [STATS_HISTOGRAM_BUCKETS];
+    _Atomic(uint64_t) sum;
+#else
+    spin_t lock;
+    uint64_t bucket [STATS_HISTOGRAM_BUCKETS];
+    uint64_t sum;
+#endif
+} stats_histogram_t;
+
+struct stats_counters_tag
+{
+#ifdef HAVE_STDATOMIC_H
+    _Atomic(uint64_t) value [STATS_COUNTER_MAX];
+#else
+    spin_t lock;
+    uint64_t value [STATS_COUNTER_MAX];
+#endif
+    uint64_t published [STATS_COUNTER_MAX]; /* last value made into a stat */
+    stats_histogram_t histogram [STATS_HISTOGRAM_MOUNT_MAX];
+    char *mount;
+    struct stats_counters_tag *next;
+};
+
+static const char *_counter_names [STATS_COUNTER_MAX] = {
+    "connections",
+    "slow_listeners",
+    "slow_listener_skips",
+    "total_bytes_read",
+    "total_bytes_sent"
+};
+
+static stats_counters_t *_counters; /* protected by _stats_mutex */
+
+/* the last stream list and the streams_version it is for, under _stats_mutex */
+static refbuf_t *_streams;
+static unsigned int _streams_version;
+static stats_histogram_t _global_histogram [STATS_HISTOGRAM_MAX];
+
+/* metric family names, the unit is part of the name */
+static const char *_histogram_names [STATS_HISTOGRAM_MAX] = {
+    "fanout_microseconds",
+    "read_wait_microseconds",
+    "listener_lag_bytes",
+    "write_bytes",
+    "delivery_microseconds",
+    "request_scan_microseconds",
+    "auth_wait_microseconds",
+    "fserve_loop_microseconds"
+};
+
+/* A read only copy of the stats trees for rendering. The stats thread
+ * publishes a new one when the stats have changed, at most once a second,
+ * readers hold a reference to the one they render from.
+ */
+typedef struct stats_snapshot_node_tag
+{
+    const char *name;
+    const char *value;
+    int hidden;
+} stats_snapshot_node_t;
+
+typedef struct stats_snapshot_source_tag
+{
+    const char *source;
+    int hidden;
+    unsigned int count;
+    stats_snapshot_node_t *nodes;
+} stats_snapshot_source_t;
+
+typedef struct stats_snapshot_tag
+{
+    int refcount;
+    unsigned int global_count;
+    stats_snapshot_node_t *global;
+    unsigned int source_count;
+    stats_snapshot_source_t *sources;
+    refbuf_t *metrics; /* rendered on first request, under _snapshot_lock */
+    /* the arrays and strings follow in the same allocation */
+} stats_snapshot_t;
+
+static stats_snapshot_t *_snapshot;
+static unsigned int _snapshot_generation; /* bumped per published snapshot, under _snapshot_lock */
+static mutex_t _snapshot_lock; // protects _snapshot and the refcounts
+static int _stats_dirty; /* stats changed since the last snapshot, under _stats_mutex */
 
 static volatile event_listener_t *_event_listeners;
 
@@ -92,12 +198,16 @@ static int _compare_stats(void *a, void *b, void *arg);
 static int _compare_source_stats(void *a, void *b, void *arg);
 static int _free_stats(void *key);
 static int _free_source_stats(void *key);
-static void _add_event_to_queue(stats_event_t *event, event_queue_t *queue);
+static void _queue_line(event_listener_t *listener, refbuf_t *line);
 static stats_node_t *_find_node(avl_tree *tree, const char *name);
 static stats_source_t *_find_source(avl_tree *tree, const char *source);
 static void _free_event(stats_event_t *event);
-static stats_event_t *_get_event_from_queue(event_queue_t *queue);
+static refbuf_t *_event_line(const char *source, const char *name, const char *value);
 static void __add_metadata(xmlNodePtr node, const char *tag);
+static void _sync_counters(void);
+static void _snapshot_release(struct stats_snapshot_tag *snapshot);
+static void _histogram_init(stats_histogram_t *histogram);
+static void _histogram_destroy(stats_histogram_t *histogram);
 
 
 /* simple helper function for creating an event */
@@ -122,25 +232,80 @@ static stats_event_t *build_event (const char *source, const char *name, const c
 
 static void queue_global_event (stats_event_t *event)
 {
-    thread_mutex_lock(&_global_event_mutex);
-    _add_event_to_queue (event, &_global_event_queue);
-    thread_mutex_unlock(&_global_event_mutex);
+    stats_event_t *head;
+
+#ifdef HAVE_STDATOMIC_H
+    head = atomic_load_explicit (&_global_events, memory_order_relaxed);
+    do
+    {
+        event->next = head;
+    } while (atomic_compare_exchange_weak_explicit (&_global_events, &head, event,
+                memory_order_release, memory_order_relaxed) == 0);
+#else
+    thread_spin_lock (&_global_event_lock);
+    head = _global_events;
+    event->next = head;
+    _global_events = event;
+    thread_spin_unlock (&_global_event_lock);
+#endif
+    /* only the first event of a batch needs to wake the stats thread */
+    if (head == NULL)
+        thread_cond_signal (&_global_event_cond);
+}
+
+
+/* take all queued events, returned oldest first */
+static stats_event_t *take_global_events (void)
+{
+    stats_event_t *event, *list = NULL;
+
+#ifdef HAVE_STDATOMIC_H
+    event = atomic_exchange_explicit (&_global_events, NULL, memory_order_acquire);
+#else
+    thread_spin_lock (&_global_event_lock);
+    event = _global_events;
+    _global_events = NULL;
+    thread_spin_unlock (&_global_event_lock);
+#endif
+    while (event)
+    {
+        stats_event_t *next = event->next;
+
+        event->next = list;
+        list = event;
+        event = next;
+    }
+    return list;
 }
 
 void stats_initialize(void)
 {
+    int n;
+
     _event_listeners = NULL;
 
     /* set up global struct */
     _stats.global_tree = avl_tree_new(_compare_stats, NULL);
     _stats.source_tree = avl_tree_new(_compare_source_stats, NULL);
+    _stats.streams_epoch = time (NULL);
+    _stats.streams_version = 0;
 
     /* set up global mutex */
     thread_mutex_create(&_stats_mutex);
+    thread_mutex_create(&_snapshot_lock);
+    _snapshot = NULL;
+    _stats_dirty = 1;
 
     /* set up stats queues */
-    event_queue_init(&_global_event_queue);
-    thread_mutex_create(&_global_event_mutex);
+#ifdef HAVE_STDATOMIC_H
+    atomic_init (&_global_events, NULL);
+#else
+    _global_events = NULL;
+    thread_spin_create (&_global_event_lock);
+#endif
+    thread_cond_create (&_global_event_cond);
+    for (n = STATS_HISTOGRAM_MOUNT_MAX; n < STATS_HISTOGRAM_MAX; n++)
+        _histogram_init (&_global_histogram[n]);
 
     /* fire off the stats thread */
     _stats_running = 1;
@@ -149,6 +314,7 @@ void stats_initialize(void)
 
 void stats_shutdown(void)
 {
+    stats_event_t *event;
     int n;
 
     if (!_stats_running) /* We can't shutdown if we're not running. */
@@ -156,6 +322,7 @@ void stats_shutdown(void)
 
     /* wait for thread to exit */
     _stats_running = 0;
+    thread_cond_signal (&_global_event_cond);
     thread_join(_stats_thread_id);
 
     /* wait for other threads to shut down */
@@ -169,25 +336,31 @@ void stats_shutdown(void)
 
     /* free the queues */
 
-    /* destroy the queue mutexes */
-    thread_mutex_destroy(&_global_event_mutex);
+    _snapshot_release (_snapshot);
+    _snapshot = NULL;
+    thread_mutex_destroy(&_snapshot_lock);
 
+    refbuf_release (_streams);
+    _streams = NULL;
     thread_mutex_destroy(&_stats_mutex);
     avl_tree_free(_stats.source_tree, _free_source_stats);
     avl_tree_free(_stats.global_tree, _free_stats);
 
-    while (1)
+    event = take_global_events ();
+    while (event)
     {
-        stats_event_t *event = _get_event_from_queue (&_global_event_queue);
-        if (event == NULL) break;
-        if(event->source)
-            free(event->source);
-        if(event->value)
-            free(event->value);
-        if(event->name)
-            free(event->name);
-        free(event);
+        stats_event_t *next = event->next;
+        _free_event (event);
+        event = next;
     }
+
+    /* destroy the queue locks */
+    thread_cond_destroy (&_global_event_cond);
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy (&_global_event_lock);
+#endif
+    for (n = STATS_HISTOGRAM_MOUNT_MAX; n < STATS_HISTOGRAM_MAX; n++)
+        _histogram_destroy (&_global_histogram[n]);
 }
 
 stats_t *stats_get_stats(void)
@@ -292,6 +465,7 @@ static char *_get_stats(const char *source, const char *name)
     char *value = NULL;
 
     thread_mutex_lock(&_stats_mutex);
+    _sync_counters ();
 
     if (source == NULL) {
         stats = _find_node(_stats.global_tree, name);
@@ -314,6 +488,41 @@ char *stats_get_value(const char *source, const char *name)
     return(_get_stats(source, name));
 }
 
+/* look up several values of one source under a single lock, the ones not
+ * there are set to NULL. Returns how many were found */
+size_t stats_get_values(const char *source, const char * const *names, char **values, size_t count)
+{
+    stats_source_t *src = NULL;
+    avl_tree *tree = NULL;
+    size_t i, found = 0;
+
+    thread_mutex_lock(&_stats_mutex);
+    _sync_counters ();
+
+    if (source == NULL) {
+        tree = _stats.global_tree;
+    } else {
+        src = _find_source(_stats.source_tree, source);
+        if (src)
+            tree = src->stats_tree;
+    }
+
+    for (i = 0; i < count; i++) {
+        stats_node_t *stats = tree ? _find_node(tree, names[i]) : NULL;
+
+        values[i] = NULL;
+        if (stats && stats->value) {
+            values[i] = strdup(stats->value);
+            if (values[i])
+                found++;
+        }
+    }
+
+    thread_mutex_unlock(&_stats_mutex);
+
+    return found;
+}
+
 /* increase the value in the provided stat by 1 */
 void stats_event_inc(const char *source, const char *name)
 {
@@ -416,26 +625,6 @@ static stats_source_t *_find_source(avl_tree *source_tree, const char *source)
     return NULL;
 }
 
-static stats_event_t *_copy_event(stats_event_t *event)
-{
-    stats_event_t *copy = (stats_event_t *)calloc(1, sizeof(stats_event_t));
-    if (event->source)
-        copy->source = (char *)strdup(event->source);
-    else
-        copy->source = NULL;
-    if (event->name)
-        copy->name = (char *)strdup(event->name);
-    if (event->value)
-        copy->value = (char *)strdup(event->value);
-    else
-        copy->value = NULL;
-    copy->hidden = event->hidden;
-    copy->next = NULL;
-
-    return copy;
-}
-
-
 /* helper to apply specialised changes to a stats node */
 static void modify_node_event(stats_node_t *node, stats_event_t *event)
 {
@@ -536,6 +725,8 @@ static void process_source_event (stats_event_t *event)
             snode->hidden = 0;
 
         avl_insert(_stats.source_tree, (void *) snode);
+        if (snode->hidden == 0)
+            _stats.streams_version++;
     }
     if (event->name)
     {
@@ -569,11 +760,11 @@ static void process_source_event (stats_event_t *event)
     if (event->action == STATS_EVENT_HIDDEN)
     {
         avl_node *node = avl_get_first (snode->stats_tree);
+        int hidden = event->value ? 1 : 0;
 
-        if (event->value)
-            snode->hidden = 1;
-        else
-            snode->hidden = 0;
+        if (snode->hidden != hidden)
+            _stats.streams_version++;
+        snode->hidden = hidden;
         while (node)
         {
             stats_node_t *stats = (stats_node_t*)node->key;
@@ -585,6 +776,8 @@ static void process_source_event (stats_event_t *event)
     if (event->action == STATS_EVENT_REMOVE)
     {
         ICECAST_LOG_DEBUG("delete source node %s", event->source);
+        if (snode->hidden == 0)
+            _stats.streams_version++;
         avl_delete(_stats.source_tree, (void *)snode, _free_source_stats);
     }
 }
@@ -638,6 +831,413 @@ static inline void __format_time(char * buffer, size_t len, const char * format)
     snprintf(buffer, len, "%s%s", timebuffer, tzbuffer);
 }
 
+stats_counters_t *stats_counters_register (const char *mount)
+{
+    stats_counters_t *counters = calloc (1, sizeof (stats_counters_t));
+    int i;
+
+    if (counters == NULL)
+        return NULL;
+    counters->mount = strdup (mount);
+#ifdef HAVE_STDATOMIC_H
+    for (i = 0; i < STATS_COUNTER_MAX; i++)
+        atomic_init (&counters->value[i], 0);
+#else
+    thread_spin_create (&counters->lock);
+#endif
+    for (i = 0; i < STATS_HISTOGRAM_MOUNT_MAX; i++)
+        _histogram_init (&counters->histogram[i]);
+    thread_mutex_lock (&_stats_mutex);
+    counters->next = _counters;
+    _counters = counters;
+    thread_mutex_unlock (&_stats_mutex);
+    return counters;
+}
+
+
+/* the counters stop being reported, pending changes are dropped */
+void stats_counters_release (stats_counters_t *counters)
+{
+    stats_counters_t **trail;
+    int i;
+
+    if (counters == NULL)
+        return;
+    thread_mutex_lock (&_stats_mutex);
+    for (trail = &_counters; *trail; trail = &(*trail)->next)
+    {
+        if (*trail == counters)
+        {
+            *trail = counters->next;
+            break;
+        }
+    }
+    thread_mutex_unlock (&_stats_mutex);
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy (&counters->lock);
+#endif
+    for (i = 0; i < STATS_HISTOGRAM_MOUNT_MAX; i++)
+        _histogram_destroy (&counters->histogram[i]);
+    free (counters->mount);
+    free (counters);
+}
+
+
+void stats_counter_add (stats_counters_t *counters, stats_counter_id id, uint64_t value)
+{
+    if (counters == NULL)
+        return;
+#ifdef HAVE_STDATOMIC_H
+    atomic_fetch_add_explicit (&counters->value[id], value, memory_order_relaxed);
+#else
+    thread_spin_lock (&counters->lock);
+    counters->value[id] += value;
+    thread_spin_unlock (&counters->lock);
+#endif
+}
+
+
+void stats_counter_set (stats_counters_t *counters, stats_counter_id id, uint64_t value)
+{
+    if (counters == NULL)
+        return;
+#ifdef HAVE_STDATOMIC_H
+    atomic_store_explicit (&counters->value[id], value, memory_order_relaxed);
+#else
+    thread_spin_lock (&counters->lock);
+    counters->value[id] = value;
+    thread_spin_unlock (&counters->lock);
+#endif
+}
+
+
+static uint64_t _counter_get (stats_counters_t *counters, stats_counter_id id)
+{
+    uint64_t value;
+#ifdef HAVE_STDATOMIC_H
+    value = atomic_load_explicit (&counters->value[id], memory_order_relaxed);
+#else
+    thread_spin_lock (&counters->lock);
+    value = counters->value[id];
+    thread_spin_unlock (&counters->lock);
+#endif
+    return value;
+}
+
+
+static void _histogram_init (stats_histogram_t *histogram)
+{
+#ifdef HAVE_STDATOMIC_H
+    int i;
+
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        atomic_init (&histogram->bucket[i], 0);
+    atomic_init (&histogram->sum, 0);
+#else
+    memset (histogram->bucket, 0, sizeof (histogram->bucket));
+    histogram->sum = 0;
+    thread_spin_create (&histogram->lock);
+#endif
+}
+
+
+static void _histogram_destroy (stats_histogram_t *histogram)
+{
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_destroy (&histogram->lock);
+#else
+    (void)histogram;
+#endif
+}
+
+
+static void _histogram_add (stats_histogram_t *histogram, uint64_t value)
+{
+    unsigned int i = 0;
+
+    while (i < STATS_HISTOGRAM_BUCKETS-1 && value > ((uint64_t)1 << i))
+        i++;
+#ifdef HAVE_STDATOMIC_H
+    atomic_fetch_add_explicit (&histogram->bucket[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&histogram->sum, value, memory_order_relaxed);
+#else
+    thread_spin_lock (&histogram->lock);
+    histogram->bucket[i]++;
+    histogram->sum += value;
+    thread_spin_unlock (&histogram->lock);
+#endif
+}
+
+
+/* copy out the buckets and sum, returns the number of values */
+static uint64_t _histogram_read (stats_histogram_t *histogram, uint64_t *bucket, uint64_t *sum)
+{
+    uint64_t count = 0;
+    int i;
+
+#ifndef HAVE_STDATOMIC_H
+    thread_spin_lock (&histogram->lock);
+#endif
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+#ifdef HAVE_STDATOMIC_H
+        bucket[i] = atomic_load_explicit (&histogram->bucket[i], memory_order_relaxed);
+#else
+        bucket[i] = histogram->bucket[i];
+#endif
+        count += bucket[i];
+    }
+#ifdef HAVE_STDATOMIC_H
+    *sum = atomic_load_explicit (&histogram->sum, memory_order_relaxed);
+#else
+    *sum = histogram->sum;
+    thread_spin_unlock (&histogram->lock);
+#endif
+    return count;
+}
+
+
+void stats_histogram_record (stats_counters_t *counters, stats_histogram_id id, uint64_t value)
+{
+    if (counters == NULL || id >= STATS_HISTOGRAM_MOUNT_MAX)
+        return;
+    _histogram_add (&counters->histogram[id], value);
+}
+
+
+/* the number of values recorded for a mount so far, and their sum */
+uint64_t stats_histogram_totals (stats_counters_t *counters, stats_histogram_id id, uint64_t *sum)
+{
+    uint64_t bucket [STATS_HISTOGRAM_BUCKETS];
+
+    *sum = 0;
+    if (counters == NULL || id >= STATS_HISTOGRAM_MOUNT_MAX)
+        return 0;
+    return _histogram_read (&counters->histogram[id], bucket, sum);
+}
+
+
+void stats_histogram_record_global (stats_histogram_id id, uint64_t value)
+{
+    if (id < STATS_HISTOGRAM_MOUNT_MAX || id >= STATS_HISTOGRAM_MAX)
+        return;
+    _histogram_add (&_global_histogram[id], value);
+}
+
+
+/* a microsecond clock for the histograms */
+uint64_t stats_time_us (void)
+{
+#ifdef HAVE_GETTIMEOFDAY
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    return timing_get_time() * 1000;
+#endif
+}
+
+
+/* hand an event processed into the stats on to the stats listeners,
+ * _stats_mutex must be held */
+static void _dispatch_event (stats_event_t *event)
+{
+    event_listener_t *listener = (event_listener_t *)_event_listeners;
+    refbuf_t *line;
+
+    if (listener == NULL)
+        return;
+    line = _event_line (event->source, event->name, event->value);
+    if (line == NULL)
+        return;
+    while (listener) {
+        refbuf_addref (line);
+        _queue_line (listener, line);
+        listener = listener->next;
+    }
+    refbuf_release (line);
+}
+
+
+/* bring changed counters into the stats trees, _stats_mutex must be held.
+ * Counters of a mount without stats yet are left until it has some.
+ */
+static void _sync_counters (void)
+{
+    stats_counters_t *counters;
+
+    for (counters = _counters; counters; counters = counters->next)
+    {
+        stats_source_t *snode = NULL;
+        int i;
+
+        for (i = 0; i < STATS_COUNTER_MAX; i++)
+        {
+            uint64_t value = _counter_get (counters, i);
+            stats_event_t *event;
+            char buf [24];
+
+            if (value == counters->published[i])
+                continue;
+            _stats_dirty = 1;
+            if (snode == NULL)
+            {
+                snode = _find_source (_stats.source_tree, counters->mount);
+                if (snode == NULL)
+                    break;
+            }
+            counters->published[i] = value;
+            snprintf (buf, sizeof (buf), "%" PRIu64, value);
+            event = build_event (counters->mount, _counter_names[i], buf);
+            if (event == NULL)
+                continue;
+            process_source_event (event);
+            _dispatch_event (event);
+            _free_event (event);
+        }
+    }
+}
+
+
+static char *_snapshot_string (char **arena, const char *str)
+{
+    char *copy = *arena;
+    size_t len = strlen (str) + 1;
+
+    memcpy (copy, str, len);
+    *arena += len;
+    return copy;
+}
+
+
+/* copy the stats trees into a new snapshot, _stats_mutex must be held */
+static stats_snapshot_t *_build_snapshot (void)
+{
+    stats_snapshot_t *snapshot;
+    stats_snapshot_node_t *nodes;
+    avl_node *node, *node2;
+    size_t size = sizeof (stats_snapshot_t);
+    unsigned int count = 0, sources = 0, i = 0, j = 0;
+    char *arena;
+
+    /* size it all up first so it takes one allocation */
+    for (node = avl_get_first (_stats.global_tree); node; node = avl_get_next (node))
+    {
+        stats_node_t *stat = node->key;
+        size += strlen (stat->name) + strlen (stat->value) + 2;
+        count++;
+    }
+    for (node = avl_get_first (_stats.source_tree); node; node = avl_get_next (node))
+    {
+        stats_source_t *source = node->key;
+        size += strlen (source->source) + 1;
+        sources++;
+        for (node2 = avl_get_first (source->stats_tree); node2; node2 = avl_get_next (node2))
+        {
+            stats_node_t *stat = node2->key;
+            size += strlen (stat->name) + strlen (stat->value) + 2;
+            count++;
+        }
+    }
+    size += sources * sizeof (stats_snapshot_source_t) + count * sizeof (stats_snapshot_node_t);
+    snapshot = calloc (1, size);
+    if (snapshot == NULL)
+        return NULL;
+    snapshot->refcount = 1;
+    snapshot->sources = (stats_snapshot_source_t *)(snapshot + 1);
+    nodes = (stats_snapshot_node_t *)(snapshot->sources + sources);
+    arena = (char *)(nodes + count);
+
+    snapshot->global = nodes;
+    for (node = avl_get_first (_stats.global_tree); node; node = avl_get_next (node))
+    {
+        stats_node_t *stat = node->key;
+        nodes[j].name = _snapshot_string (&arena, stat->name);
+        nodes[j].value = _snapshot_string (&arena, stat->value);
+        nodes[j].hidden = stat->hidden;
+        j++;
+    }
+    snapshot->global_count = j;
+    for (node = avl_get_first (_stats.source_tree); node; node = avl_get_next (node), i++)
+    {
+        stats_source_t *source = node->key;
+        stats_snapshot_source_t *copy = &snapshot->sources[i];
+
+        copy->source = _snapshot_string (&arena, source->source);
+        copy->hidden = source->hidden;
+        copy->nodes = nodes + j;
+        for (node2 = avl_get_first (source->stats_tree); node2; node2 = avl_get_next (node2))
+        {
+            stats_node_t *stat = node2->key;
+            nodes[j].name = _snapshot_string (&arena, stat->name);
+            nodes[j].value = _snapshot_string (&arena, stat->value);
+            nodes[j].hidden = stat->hidden;
+            j++;
+        }
+        copy->count = (unsigned int)(nodes + j - copy->nodes);
+    }
+    snapshot->source_count = sources;
+    return snapshot;
+}
+
+
+static void _snapshot_release (stats_snapshot_t *snapshot)
+{
+    int refcount;
+
+    if (snapshot == NULL)
+        return;
+    thread_mutex_lock (&_snapshot_lock);
+    refcount = --snapshot->refcount;
+    thread_mutex_unlock (&_snapshot_lock);
+    if (refcount == 0)
+    {
+        refbuf_release (snapshot->metrics);
+        free (snapshot);
+    }
+}
+
+
+static stats_snapshot_t *_snapshot_get (void)
+{
+    stats_snapshot_t *snapshot;
+
+    thread_mutex_lock (&_snapshot_lock);
+    snapshot = _snapshot;
+    if (snapshot)
+        snapshot->refcount++;
+    thread_mutex_unlock (&_snapshot_lock);
+    return snapshot;
+}
+
+
+/* replace the published snapshot if the stats have changed, called by the
+ * stats thread */
+static void _publish_snapshot (void)
+{
+    stats_snapshot_t *snapshot = NULL, *old;
+
+    thread_mutex_lock (&_stats_mutex);
+    if (_stats_dirty)
+    {
+        snapshot = _build_snapshot ();
+        if (snapshot)
+            _stats_dirty = 0;
+    }
+    thread_mutex_unlock (&_stats_mutex);
+    if (snapshot == NULL)
+        return;
+
+    thread_mutex_lock (&_snapshot_lock);
+    old = _snapshot;
+    _snapshot = snapshot;
+    _snapshot_generation++;
+    thread_mutex_unlock (&_snapshot_lock);
+    _snapshot_release (old);
+}
+
+
 void stats_event_time (const char *mount, const char *name)
 {
     char buffer[100];
@@ -668,8 +1268,8 @@ void stats_global (ice_config_t *config)
 static void *_stats_thread(void *arg)
 {
     stats_event_t *event;
-    stats_event_t *copy;
-    event_listener_t *listener;
+    time_t counters_synced = 0;
+    long queue_bytes, published_queue_bytes = -1;
 
     (void)arg;
 
@@ -693,17 +1293,37 @@ static void *_stats_thread(void *arg)
 
     ICECAST_LOG_INFO("stats thread started");
     while (_stats_running) {
-        thread_mutex_lock(&_global_event_mutex);
-        if (_global_event_queue.head != NULL) {
-            /* grab the next event from the queue */
-            event = _get_event_from_queue (&_global_event_queue);
-            thread_mutex_unlock(&_global_event_mutex);
-
-            if (event == NULL)
-                continue;
-            event->next = NULL;
+        /* grab everything queued, processed as one batch */
+        stats_event_t *batch = take_global_events ();
+        time_t now = time (NULL);
 
+        if (now != counters_synced) {
             thread_mutex_lock(&_stats_mutex);
+            _sync_counters ();
+            thread_mutex_unlock(&_stats_mutex);
+            _publish_snapshot ();
+            objpool_stats ();
+            queue_bytes = global_queue_bytes ();
+            if (queue_bytes != published_queue_bytes) {
+                stats_event_args (NULL, "queue_bytes", "%ld", queue_bytes);
+                published_queue_bytes = queue_bytes;
+            }
+            counters_synced = now;
+        }
+        if (batch == NULL) {
+            /* a wakeup missed between the check and the wait only delays
+             * the next batch */
+            config_drop_pin ();
+            thread_cond_timedwait (&_global_event_cond, 300);
+            continue;
+        }
+
+        thread_mutex_lock(&_stats_mutex);
+        _stats_dirty = 1;
+        while (batch) {
+            event = batch;
+            batch = event->next;
+            event->next = NULL;
 
             /* check if we are dealing with a global or source event */
             if (event->source == NULL)
@@ -711,30 +1331,16 @@ static void *_stats_thread(void *arg)
             else
                 process_source_event (event);
 
+            ICECAST_TRACE3 (stats_event, event->source, event->name, event->value);
+
             /* now we have an event that's been processed into the running stats */
             /* this event should get copied to event listeners' queues */
-            listener = (event_listener_t *)_event_listeners;
-            while (listener) {
-                copy = _copy_event(event);
-                thread_mutex_lock (&listener->mutex);
-                _add_event_to_queue (copy, &listener->queue);
-                thread_mutex_unlock (&listener->mutex);
-
-                listener = listener->next;
-            }
+            _dispatch_event (event);
 
             /* now we need to destroy the event */
             _free_event(event);
-
-            thread_mutex_unlock(&_stats_mutex);
-            continue;
-        }
-        else
-        {
-            thread_mutex_unlock(&_global_event_mutex);
         }
-
-        thread_sleep(300000);
+        thread_mutex_unlock(&_stats_mutex);
     }
 
     return NULL;
@@ -758,63 +1364,69 @@ static void _unregister_listener(event_listener_t *listener)
 }
 
 
-static stats_event_t *_make_event_from_node(stats_node_t *node, char *source)
+/* the line sent to stats listeners for an event, shared between them */
+static refbuf_t *_event_line (const char *source, const char *name, const char *value)
 {
-    stats_event_t *event = (stats_event_t *)malloc(sizeof(stats_event_t));
-
-    if (source != NULL)
-        event->source = (char *)strdup(source);
-    else
-        event->source = NULL;
-    event->name = (char *)strdup(node->name);
-    event->value = (char *)strdup(node->value);
-    event->hidden = node->hidden;
-    event->action = STATS_EVENT_SET;
-    event->next = NULL;
-
-    return event;
-}
-
+    refbuf_t *line;
+    int len;
 
-static void _add_event_to_queue(stats_event_t *event, event_queue_t *queue)
-{
-    *queue->tail = event;
-    queue->tail = (volatile stats_event_t **)&event->next;
+    if (source == NULL)
+        source = "global";
+    if (name == NULL)
+        name = "null";
+    if (value == NULL)
+        value = "null";
+    len = strlen (source) + strlen (name) + strlen (value) + 9;
+    line = refbuf_new (len);
+    if (line == NULL)
+        return NULL;
+    line->len = snprintf (line->data, len, "EVENT %s %s %s\n", source, name, value);
+    return line;
 }
 
 
-static stats_event_t *_get_event_from_queue (event_queue_t *queue)
+/* add a reference to the line to the listener ring, taking over the
+ * caller's reference */
+static void _queue_line (event_listener_t *listener, refbuf_t *line)
 {
-    stats_event_t *event = NULL;
-
-    if (queue && queue->head)
+    thread_mutex_lock (&listener->mutex);
+    if (listener->count == listener->size)
     {
-        event = (stats_event_t *)queue->head;
-        queue->head = event->next;
-        if (queue->head == NULL)
-            queue->tail = &queue->head;
-    }
+        unsigned int size = listener->size ? listener->size * 2 : 64, i;
+        refbuf_t **lines = malloc (size * sizeof (refbuf_t *));
 
-    return event;
+        if (lines == NULL)
+        {
+            thread_mutex_unlock (&listener->mutex);
+            refbuf_release (line);
+            return;
+        }
+        for (i = 0; i < listener->count; i++)
+            lines[i] = listener->lines[(listener->head + i) % listener->size];
+        free (listener->lines);
+        listener->lines = lines;
+        listener->head = 0;
+        listener->size = size;
+    }
+    listener->lines[(listener->head + listener->count) % listener->size] = line;
+    listener->count++;
+    thread_mutex_unlock (&listener->mutex);
 }
 
-static int _send_event_to_client(stats_event_t *event, client_t *client)
+
+static refbuf_t *_take_line (event_listener_t *listener)
 {
-    int len;
-    char buf [200];
-
-    /* send data to the client!!!! */
-    len = snprintf (buf, sizeof (buf), "EVENT %s %s %s\n",
-            (event->source != NULL) ? event->source : "global",
-            event->name ? event->name : "null",
-            event->value ? event->value : "null");
-    if (len > 0 && len < (int)sizeof (buf))
+    refbuf_t *line = NULL;
+
+    thread_mutex_lock (&listener->mutex);
+    if (listener->count)
     {
-        client_send_bytes (client, buf, len);
-        if (client->con->error)
-            return -1;
+        line = listener->lines[listener->head];
+        listener->head = (listener->head + 1) % listener->size;
+        listener->count--;
     }
-    return 0;
+    thread_mutex_unlock (&listener->mutex);
+    return line;
 }
 
 static inline void __add_authstack (auth_stack_t *stack, xmlNodePtr parent) {
@@ -830,29 +1442,29 @@ static inline void __add_authstack (auth_stack_t *stack, xmlNodePtr parent) {
         auth_stack_next(&stack);
    }
 }
+/* render from the published snapshot, so the stats thread carries on
+ * applying events meanwhile */
 static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, int hidden) {
-    avl_node *avlnode;
+    stats_snapshot_t *snapshot = _snapshot_get ();
     xmlNodePtr ret = NULL;
     ice_config_t *config;
+    unsigned int i, j;
 
-    thread_mutex_lock(&_stats_mutex);
+    if (snapshot == NULL)
+        return NULL;
     /* general stats first */
-    avlnode = avl_get_first(_stats.global_tree);
-
-    while (avlnode) {
-        stats_node_t *stat = avlnode->key;
+    for (i = 0; i < snapshot->global_count; i++) {
+        stats_snapshot_node_t *stat = &snapshot->global[i];
         if (stat->hidden <=  hidden)
             xmlNewTextChild (root, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
-        avlnode = avl_get_next (avlnode);
     }
     /* now per mount stats */
-    avlnode = avl_get_first(_stats.source_tree);
     config = config_get_config();
     __add_authstack(config->authstack, root);
     config_release_config();
 
-    while (avlnode) {
-        stats_source_t *source = (stats_source_t *)avlnode->key;
+    for (i = 0; i < snapshot->source_count; i++) {
+        stats_snapshot_source_t *source = &snapshot->sources[i];
 
         if (source->hidden <= hidden &&
                 (show_mount == NULL || strcmp (show_mount, source->source) == 0))
@@ -860,42 +1472,43 @@ static xmlNodePtr _dump_stats_to_doc (xmlNodePtr root, const char *show_mount, i
             xmlNodePtr metadata, history;
             source_t *source_real;
             mount_proxy *mountproxy;
-            int i;
+            int k;
 
-            avl_node *avlnode2 = avl_get_first (source->stats_tree);
             xmlNodePtr xmlnode = xmlNewTextChild (root, NULL, XMLSTR("source"), NULL);
 
             xmlSetProp (xmlnode, XMLSTR("mount"), XMLSTR(source->source));
             if (ret == NULL)
                 ret = xmlnode;
-            while (avlnode2)
+            for (j = 0; j < source->count; j++)
             {
-                stats_node_t *stat = avlnode2->key;
+                stats_snapshot_node_t *stat = &source->nodes[j];
                 xmlNewTextChild (xmlnode, NULL, XMLSTR(stat->name), XMLSTR(stat->value));
-                avlnode2 = avl_get_next (avlnode2);
             }
 
 
+            /* the snapshot may name a mount that has since gone */
             avl_tree_rlock(global.source_tree);
             source_real = source_find_mount_raw(source->source);
-            history = playlist_render_xspf(source_real->history);
-            if (history)
-                xmlAddChild(xmlnode, history);
-            metadata = xmlNewTextChild(xmlnode, NULL, XMLSTR("metadata"), NULL);
-            if (source_real->format) {
-                for (i = 0; i < source_real->format->vc.comments; i++)
-                    __add_metadata(metadata, source_real->format->vc.user_comments[i]);
+            if (source_real) {
+                history = playlist_render_xspf(source_real->history);
+                if (history)
+                    xmlAddChild(xmlnode, history);
+                metadata = xmlNewTextChild(xmlnode, NULL, XMLSTR("metadata"), NULL);
+                if (source_real->format) {
+                    for (k = 0; k < source_real->format->vc.comments; k++)
+                        __add_metadata(metadata, source_real->format->vc.user_comments[k]);
+                }
             }
             avl_tree_unlock(global.source_tree);
 
             config = config_get_config();
             mountproxy = config_find_mount(config, source->source, MOUNT_TYPE_NORMAL);
-            __add_authstack(mountproxy->authstack, xmlnode);
+            if (mountproxy)
+                __add_authstack(mountproxy->authstack, xmlnode);
             config_release_config();
         }
-        avlnode = avl_get_next (avlnode);
     }
-    thread_mutex_unlock(&_stats_mutex);
+    _snapshot_release (snapshot);
     return ret;
 }
 
@@ -909,18 +1522,22 @@ static void _register_listener (event_listener_t *listener)
 {
     avl_node *node;
     avl_node *node2;
-    stats_event_t *event;
+    stats_node_t *stat;
+    refbuf_t *line;
     stats_source_t *source;
 
     thread_mutex_lock(&_stats_mutex);
+    _sync_counters ();
 
     /* first we fill our queue with the current stats */
 
     /* start with the global stats */
     node = avl_get_first(_stats.global_tree);
     while (node) {
-        event = _make_event_from_node((stats_node_t *) node->key, NULL);
-        _add_event_to_queue(event, &listener->queue);
+        stat = (stats_node_t *)node->key;
+        line = _event_line (NULL, stat->name, stat->value);
+        if (line)
+            _queue_line (listener, line);
 
         node = avl_get_next(node);
     }
@@ -931,8 +1548,10 @@ static void _register_listener (event_listener_t *listener)
         source = (stats_source_t *)node->key;
         node2 = avl_get_first(source->stats_tree);
         while (node2) {
-            event = _make_event_from_node((stats_node_t *)node2->key, source->source);
-            _add_event_to_queue (event, &listener->queue);
+            stat = (stats_node_t *)node2->key;
+            line = _event_line (source->source, stat->name, stat->value);
+            if (line)
+                _queue_line (listener, line);
 
             node2 = avl_get_next(node2);
         }
@@ -950,12 +1569,12 @@ static void _register_listener (event_listener_t *listener)
 void *stats_connection(void *arg)
 {
     client_t *client = (client_t *)arg;
-    stats_event_t *event;
+    refbuf_t *line;
     event_listener_t listener;
 
     ICECAST_LOG_INFO("stats client starting");
 
-    event_queue_init (&listener.queue);
+    memset (&listener, 0, sizeof (listener));
     /* increment the thread count */
     thread_mutex_lock(&_stats_mutex);
     _stats_threads++;
@@ -967,15 +1586,12 @@ void *stats_connection(void *arg)
     _register_listener (&listener);
 
     while (_stats_running) {
-        thread_mutex_lock (&listener.mutex);
-        event = _get_event_from_queue (&listener.queue);
-        thread_mutex_unlock (&listener.mutex);
-        if (event != NULL) {
-            if (_send_event_to_client(event, client) < 0) {
-                _free_event(event);
+        line = _take_line (&listener);
+        if (line != NULL) {
+            client_send_bytes (client, line->data, line->len);
+            refbuf_release (line);
+            if (client->con->error)
                 break;
-            }
-            _free_event(event);
             continue;
         }
         thread_sleep (500000);
@@ -987,6 +1603,10 @@ void *stats_connection(void *arg)
     stats_event_args (NULL, "stats", "%d", _stats_threads);
     thread_mutex_unlock(&_stats_mutex);
 
+    while ((line = _take_line (&listener)))
+        refbuf_release (line);
+    free (listener.lines);
+
     thread_mutex_destroy (&listener.mutex);
     client_destroy (client);
     ICECAST_LOG_INFO("stats client finished");
@@ -1017,15 +1637,34 @@ typedef struct _source_xml_tag {
 } source_xml_t;
 
 
+/* identifies the current stats, for caching output built from them */
+unsigned int stats_get_generation (void)
+{
+    unsigned int generation;
+
+    thread_mutex_lock (&_snapshot_lock);
+    generation = _snapshot_generation;
+    thread_mutex_unlock (&_snapshot_lock);
+    return generation;
+}
+
+
 void stats_transform_xslt(client_t *client, const char *uri)
 {
     xmlDocPtr doc;
     char *xslpath = util_get_path_from_normalised_uri(uri);
     const char *mount = httpp_get_query_param(client->parser, "mount");
+    unsigned int generation = stats_get_generation ();
 
+    /* public status pages are requested often, reuse recent output */
+    if (xslt_send_cached (xslpath, mount, generation, client) == 0)
+    {
+        free (xslpath);
+        return;
+    }
     doc = stats_get_xml(0, mount, client->mode);
 
-    xslt_transform(doc, xslpath, client);
+    xslt_transform_cached(doc, xslpath, mount, generation, client);
 
     xmlFreeDoc(doc);
     free(xslpath);
@@ -1126,44 +1765,361 @@ static void _free_event(stats_event_t *event)
 }
 
 
-refbuf_t *stats_get_streams (void)
+/* stats that only ever go up, reported as OpenMetrics counters */
+static const char *_metrics_counters[] = {
+    "client_connections", "connections", "connections_rejected",
+    "listener_connections", "listener_redirects", "slow_listener_skips",
+    "slow_listeners", "source_client_connections", "source_relay_connections",
+    "source_total_connections", "stats_connections", "total_bytes_read",
+    "total_bytes_sent", NULL
+};
+
+typedef struct
 {
-#define STREAMLIST_BLKSIZE  4096
-    avl_node *node;
-    unsigned int remaining = STREAMLIST_BLKSIZE;
-    refbuf_t *start = refbuf_new (remaining), *cur = start;
-    char *buffer = cur->data;
+    char *data;
+    size_t len;
+    size_t size;
+} metrics_buffer_t;
 
-    /* now the stats for each source */
-    thread_mutex_lock (&_stats_mutex);
-    node = avl_get_first(_stats.source_tree);
-    while (node)
+typedef struct
+{
+    const stats_snapshot_node_t *node;
+    const char *mount;
+    unsigned int order;
+} metrics_sample_t;
+
+
+static void _metrics_printf (metrics_buffer_t *buf, const char *format, ...)
+{
+    va_list ap;
+    int ret = 0;
+
+    while (1)
     {
-        int ret;
-        stats_source_t *source = (stats_source_t *)node->key;
+        size_t room = buf->size - buf->len;
+        char *data;
 
-        if (source->hidden == 0)
+        if (room)
         {
-            if (remaining <= strlen (source->source) + 3)
+            va_start (ap, format);
+            ret = vsnprintf (buf->data + buf->len, room, format, ap);
+            va_end (ap);
+            if (ret < 0)
+                return;
+            if ((size_t)ret < room)
             {
-                cur->len = STREAMLIST_BLKSIZE - remaining;
-                cur->next = refbuf_new (STREAMLIST_BLKSIZE);
-                remaining = STREAMLIST_BLKSIZE;
-                cur = cur->next;
-                buffer = cur->data;
+                buf->len += ret;
+                return;
             }
-            ret = snprintf (buffer, remaining, "%s\r\n", source->source);
-            if (ret > 0)
+        }
+        data = realloc (buf->data, buf->size + 8192 + ret);
+        if (data == NULL)
+            return;
+        buf->data = data;
+        buf->size += 8192 + ret;
+    }
+}
+
+
+static int _metrics_numeric (const char *value)
+{
+    char *end;
+
+    if (*value == '\0')
+        return 0;
+    strtod (value, &end);
+    return *end == '\0';
+}
+
+
+static int _metrics_is_counter (const char *name)
+{
+    int i;
+
+    for (i = 0; _metrics_counters[i]; i++)
+        if (strcmp (_metrics_counters[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+
+/* metric family line for a stat, names are limited to [a-zA-Z0-9_] */
+static void _metrics_family (metrics_buffer_t *buf, const char *prefix, const char *name,
+        char *family, size_t len)
+{
+    size_t i, off = snprintf (family, len, "%s", prefix);
+
+    for (i = 0; name[i] && off < len - 1; i++, off++)
+        family[off] = isalnum ((unsigned char)name[i]) ? name[i] : '_';
+    family[off] = '\0';
+    _metrics_printf (buf, "# TYPE %s %s\n", family,
+            _metrics_is_counter (name) ? "counter" : "gauge");
+}
+
+
+static void _metrics_label_value (metrics_buffer_t *buf, const char *value)
+{
+    for (; *value; value++)
+    {
+        if (*value == '\\' || *value == '"')
+            _metrics_printf (buf, "\\%c", *value);
+        else if (*value == '\n')
+            _metrics_printf (buf, "\\n");
+        else
+            _metrics_printf (buf, "%c", *value);
+    }
+}
+
+
+static int _metrics_compare (const void *a, const void *b)
+{
+    const metrics_sample_t *sa = a, *sb = b;
+    int ret = strcmp (sa->node->name, sb->node->name);
+
+    if (ret == 0)
+        ret = sa->order < sb->order ? -1 : (sa->order > sb->order);
+    return ret;
+}
+
+
+static void _metrics_histogram_sample (metrics_buffer_t *buf, const char *family,
+        const char *mount, stats_histogram_t *histogram)
+{
+    uint64_t bucket [STATS_HISTOGRAM_BUCKETS], sum, count, total = 0;
+    int i, last;
+
+    count = _histogram_read (histogram, bucket, &sum);
+    /* buckets beyond the largest value seen add nothing */
+    for (last = STATS_HISTOGRAM_BUCKETS-2; last > 0 && bucket[last] == 0; last--)
+        ;
+    for (i = 0; i <= STATS_HISTOGRAM_BUCKETS-1; i++)
+    {
+        if (i > last && i != STATS_HISTOGRAM_BUCKETS-1)
+            continue;
+        total += bucket[i];
+        _metrics_printf (buf, "%s_bucket{", family);
+        if (mount)
+        {
+            _metrics_printf (buf, "mount=\"");
+            _metrics_label_value (buf, mount);
+            _metrics_printf (buf, "\",");
+        }
+        if (i == STATS_HISTOGRAM_BUCKETS-1)
+            _metrics_printf (buf, "le=\"+Inf\"} %" PRIu64 "\n", count);
+        else
+            _metrics_printf (buf, "le=\"%" PRIu64 "\"} %" PRIu64 "\n", (uint64_t)1 << i, total);
+    }
+    _metrics_printf (buf, "%s_count", family);
+    if (mount)
+    {
+        _metrics_printf (buf, "{mount=\"");
+        _metrics_label_value (buf, mount);
+        _metrics_printf (buf, "\"}");
+    }
+    _metrics_printf (buf, " %" PRIu64 "\n%s_sum", count, family);
+    if (mount)
+    {
+        _metrics_printf (buf, "{mount=\"");
+        _metrics_label_value (buf, mount);
+        _metrics_printf (buf, "\"}");
+    }
+    _metrics_printf (buf, " %" PRIu64 "\n", sum);
+}
+
+
+/* the histograms are read live rather than from the snapshot */
+static void _metrics_histograms (metrics_buffer_t *buf)
+{
+    stats_counters_t *counters;
+    char family [128];
+    int i;
+
+    thread_mutex_lock (&_stats_mutex);
+    for (i = 0; i < STATS_HISTOGRAM_MOUNT_MAX; i++)
+    {
+        if (_counters == NULL)
+            break;
+        snprintf (family, sizeof (family), "icecast_source_%s", _histogram_names[i]);
+        _metrics_printf (buf, "# TYPE %s histogram\n", family);
+        for (counters = _counters; counters; counters = counters->next)
+            _metrics_histogram_sample (buf, family, counters->mount, &counters->histogram[i]);
+    }
+    thread_mutex_unlock (&_stats_mutex);
+
+    for (i = STATS_HISTOGRAM_MOUNT_MAX; i < STATS_HISTOGRAM_MAX; i++)
+    {
+        snprintf (family, sizeof (family), "icecast_%s", _histogram_names[i]);
+        _metrics_printf (buf, "# TYPE %s histogram\n", family);
+        _metrics_histogram_sample (buf, family, NULL, &_global_histogram[i]);
+    }
+}
+
+
+static refbuf_t *_render_metrics (stats_snapshot_t *snapshot)
+{
+    metrics_buffer_t buf = { NULL, 0, 0 };
+    metrics_sample_t *samples;
+    unsigned int i, j, count = 0;
+    char family [128];
+    refbuf_t *metrics;
+
+    for (i = 0; i < snapshot->global_count; i++)
+    {
+        const stats_snapshot_node_t *stat = &snapshot->global[i];
+
+        if (_metrics_numeric (stat->value) == 0)
+            continue;
+        _metrics_family (&buf, "icecast_", stat->name, family, sizeof (family));
+        _metrics_printf (&buf, "%s%s %s\n", family,
+                _metrics_is_counter (stat->name) ? "_total" : "", stat->value);
+    }
+
+    /* samples of a family have to be together, so group by stat name */
+    for (i = 0; i < snapshot->source_count; i++)
+        count += snapshot->sources[i].count;
+    samples = calloc (count ? count : 1, sizeof (metrics_sample_t));
+    if (samples == NULL)
+    {
+        free (buf.data);
+        return NULL;
+    }
+    count = 0;
+    for (i = 0; i < snapshot->source_count; i++)
+    {
+        const stats_snapshot_source_t *source = &snapshot->sources[i];
+
+        for (j = 0; j < source->count; j++)
+        {
+            if (_metrics_numeric (source->nodes[j].value) == 0)
+                continue;
+            samples[count].node = &source->nodes[j];
+            samples[count].mount = source->source;
+            samples[count].order = count;
+            count++;
+        }
+    }
+    qsort (samples, count, sizeof (metrics_sample_t), _metrics_compare);
+    for (i = 0; i < count; i++)
+    {
+        const char *name = samples[i].node->name;
+        int counter = _metrics_is_counter (name);
+
+        if (i == 0 || strcmp (name, samples[i-1].node->name) != 0)
+            _metrics_family (&buf, "icecast_source_", name, family, sizeof (family));
+        _metrics_printf (&buf, "%s%s{mount=\"", family, counter ? "_total" : "");
+        _metrics_label_value (&buf, samples[i].mount);
+        _metrics_printf (&buf, "\"} %s\n", samples[i].node->value);
+    }
+    free (samples);
+    _metrics_histograms (&buf);
+    _metrics_printf (&buf, "# EOF\n");
+
+    metrics = refbuf_new (buf.len);
+    memcpy (metrics->data, buf.data, buf.len);
+    metrics->len = buf.len;
+    free (buf.data);
+    return metrics;
+}
+
+
+/* the stats in OpenMetrics text format, rendered once per snapshot. The
+ * caller gets a reference and must release it.
+ */
+refbuf_t *stats_get_metrics (void)
+{
+    stats_snapshot_t *snapshot = _snapshot_get ();
+    refbuf_t *metrics = NULL;
+
+    if (snapshot == NULL)
+        return NULL;
+
+    thread_mutex_lock (&_snapshot_lock);
+    metrics = snapshot->metrics;
+    if (metrics)
+        refbuf_addref (metrics);
+    thread_mutex_unlock (&_snapshot_lock);
+
+    if (metrics == NULL)
+    {
+        /* concurrent first requests may both render, one copy is kept */
+        metrics = _render_metrics (snapshot);
+        if (metrics)
+        {
+            thread_mutex_lock (&_snapshot_lock);
+            if (snapshot->metrics == NULL)
             {
-                buffer += ret;
-                remaining -= ret;
+                snapshot->metrics = metrics;
+                refbuf_addref (metrics);
             }
+            thread_mutex_unlock (&_snapshot_lock);
         }
-        node = avl_get_next(node);
     }
-    thread_mutex_unlock(&_stats_mutex);
-    cur->len = STREAMLIST_BLKSIZE - remaining;
-    return start;
+    _snapshot_release (snapshot);
+    return metrics;
+}
+
+
+/* build the list of visible mounts, _stats_mutex must be held */
+static refbuf_t *_build_streams (void)
+{
+    avl_node *node;
+    size_t len = 0;
+    refbuf_t *streams;
+    char *buffer;
+
+    for (node = avl_get_first(_stats.source_tree); node; node = avl_get_next(node))
+    {
+        stats_source_t *source = (stats_source_t *)node->key;
+
+        if (source->hidden == 0)
+            len += strlen (source->source) + 2;
+    }
+    streams = refbuf_new (len + 1);
+    if (streams == NULL)
+        return NULL;
+    buffer = streams->data;
+    for (node = avl_get_first(_stats.source_tree); node; node = avl_get_next(node))
+    {
+        stats_source_t *source = (stats_source_t *)node->key;
+
+        if (source->hidden == 0)
+            buffer += sprintf (buffer, "%s\r\n", source->source);
+    }
+    streams->len = len;
+    return streams;
+}
+
+
+/* The list of visible mounts for slaves. It is only rebuilt when the
+ * list changes, the caller gets a reference to the shared copy.
+ */
+refbuf_t *stats_get_streams (void)
+{
+    refbuf_t *streams = NULL;
+
+    thread_mutex_lock (&_stats_mutex);
+    if (_streams == NULL || _streams_version != _stats.streams_version)
+    {
+        refbuf_release (_streams);
+        _streams = _build_streams ();
+        _streams_version = _stats.streams_version;
+    }
+    if (_streams)
+        streams = refbuf_slice (_streams, 0, _streams->len);
+    thread_mutex_unlock (&_stats_mutex);
+    return streams;
+}
+
+
+/* an entity tag for the list stats_get_streams returns. Take it before the
+ * list so a change in between can only make a slave fetch it again.
+ */
+void stats_get_streams_etag (char *buffer, size_t len)
+{
+    thread_mutex_lock (&_stats_mutex);
+    snprintf (buffer, len, "\"%lx-%x\"", (unsigned long)_stats.streams_epoch,
+            _stats.streams_version);
+    thread_mutex_unlock (&_stats_mutex);
 }
 
 
@@ -1188,6 +2144,9 @@ void stats_clear_virtual_mounts (void)
             /* no source_t is reserved so remove them now */
             snode = avl_get_next (snode);
             ICECAST_LOG_DEBUG("releasing %s stats", src->source);
+            if (src->hidden == 0)
+                _stats.streams_version++;
+            _stats_dirty = 1;
             avl_delete (_stats.source_tree, src, _free_source_stats);
             continue;
         }
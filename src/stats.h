@@ -63,6 +63,11 @@ typedef struct _stats_tag
 
     avl_tree *source_tree;
 
+    /* bumped when the list of visible sources changes, with the time
+     * stats started it identifies a stream list for conditional requests */
+    unsigned int streams_version;
+    time_t streams_epoch;
+
     /* stats by source, and for stats
     start_time
     total_users
@@ -71,12 +76,57 @@ typedef struct _stats_tag
 
 } stats_t;
 
+/* Per mount counters updated without going through the event queue, the
+ * stats thread turns them into ordinary stats when they are rendered or
+ * about once a second for stats listeners.
+ */
+typedef enum {
+    STATS_COUNTER_CONNECTIONS,
+    STATS_COUNTER_SLOW_LISTENERS,
+    STATS_COUNTER_SLOW_LISTENER_SKIPS,
+    STATS_COUNTER_BYTES_READ,
+    STATS_COUNTER_BYTES_SENT,
+    STATS_COUNTER_MAX
+} stats_counter_id;
+
+/* Distributions of hot path timings and sizes, kept in power of two
+ * buckets and reported through the metrics. The first ones are per mount,
+ * the rest are for the whole server. Times are in microseconds.
+ */
+typedef enum {
+    STATS_HISTOGRAM_FANOUT,         /* sending a cycle to the listeners */
+    STATS_HISTOGRAM_READ_WAIT,      /* waiting for the source in get_next_buffer */
+    STATS_HISTOGRAM_LISTENER_LAG,   /* bytes a listener is behind the newest data */
+    STATS_HISTOGRAM_WRITE_SIZE,     /* bytes per listener write */
+    STATS_HISTOGRAM_DELIVERY,       /* from a buffer arriving to a listener being sent all of it */
+    STATS_HISTOGRAM_REQUEST_SCAN,   /* a pass over the pending requests */
+    STATS_HISTOGRAM_AUTH_WAIT,      /* time a client is queued for auth */
+    STATS_HISTOGRAM_FSERVE_LOOP,    /* a pass of a file serving thread */
+    STATS_HISTOGRAM_MAX
+} stats_histogram_id;
+
+#define STATS_HISTOGRAM_MOUNT_MAX   STATS_HISTOGRAM_REQUEST_SCAN
+
+typedef struct stats_counters_tag stats_counters_t;
+
+stats_counters_t *stats_counters_register (const char *mount);
+void stats_counters_release (stats_counters_t *counters);
+void stats_counter_add (stats_counters_t *counters, stats_counter_id id, uint64_t value);
+void stats_counter_set (stats_counters_t *counters, stats_counter_id id, uint64_t value);
+void stats_histogram_record (stats_counters_t *counters, stats_histogram_id id, uint64_t value);
+void stats_histogram_record_global (stats_histogram_id id, uint64_t value);
+uint64_t stats_histogram_totals (stats_counters_t *counters, stats_histogram_id id, uint64_t *sum);
+uint64_t stats_time_us (void);
+
 void stats_initialize(void);
 void stats_shutdown(void);
 
 void stats_global(ice_config_t *config);
 stats_t *stats_get_stats(void);
 refbuf_t *stats_get_streams (void);
+refbuf_t *stats_get_metrics (void);
+void stats_get_streams_etag (char *buffer, size_t len);
+unsigned int stats_get_generation (void);
 void stats_clear_virtual_mounts (void);
 
 void stats_event(const char *source, const char *name, const char *value);
@@ -98,6 +148,7 @@ void stats_transform_xslt(client_t *client, const char *uri);
 void stats_sendxml(client_t *client);
 xmlDocPtr stats_get_xml(int show_hidden, const char *show_mount, operation_mode mode);
 char *stats_get_value(const char *source, const char *name);
+size_t stats_get_values(const char *source, const char * const *names, char **values, size_t count);
 
 #endif  /* __STATS_H__ */
 
@@ -0,0 +1,384 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* timeshift.c
+ **
+ ** recording of a stream for listeners starting some time back. The stream
+ ** is written out in segments, each starting on a sync point with the
+ ** stream headers ahead of it, so any one of them can be played from its
+ ** start. The segments are written by a dump file writer and are only
+ ** listed as ready once written. A listener asking to start back in time
+ ** is sent the segments from the one covering that time through to the
+ ** newest one ready, from disk by the file serving threads.
+ **
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "common/thread/thread.h"
+#include "common/timing/timing.h"
+
+#include "timeshift.h"
+#include "dumpfile.h"
+#include "source.h"
+#include "format.h"
+#include "fserve.h"
+#include "util.h"
+#include "logging.h"
+
+#define CATMODULE "timeshift"
+
+/* segment files removed in one go after one has been written */
+#define TIMESHIFT_PRUNE_MAX 8
+
+typedef struct timeshift_segment_tag
+{
+    /* in ms, also the name of the file */
+    uint64_t start;
+    /* 1 once written, -1 if that failed */
+    int done;
+} timeshift_segment_t;
+
+struct timeshift_tag
+{
+    mutex_t lock;
+    unsigned int refcount;
+    char *directory;
+    char *name;
+    unsigned int segment_ms;
+    unsigned int duration_ms;
+
+    /* only used by the source thread */
+    dumpfile_t *dump;
+    uint64_t segment_start;
+
+    /* oldest first, protected by the lock */
+    timeshift_segment_t *segments;
+    unsigned int max, first, count;
+};
+
+/* a listener working through the segments */
+typedef struct timeshift_client_tag
+{
+    timeshift_t *ts;
+    uint64_t start;
+} timeshift_client_t;
+
+
+static void timeshift_segment_path (timeshift_t *ts, uint64_t start, char *path, size_t len)
+{
+    snprintf (path, len, "%s/%s.%" PRIu64, ts->directory, ts->name, start);
+}
+
+
+/* the writer is done with a segment, so it can be listed for listeners,
+ * and the ones past the duration go */
+static void timeshift_segment_done (void *arg, const char *filename, int failed)
+{
+    timeshift_t *ts = arg;
+    uint64_t now = timing_get_time();
+    uint64_t expired [TIMESHIFT_PRUNE_MAX];
+    unsigned int i, count = 0;
+
+    thread_mutex_lock (&ts->lock);
+    /* they are finished in the order they were started */
+    for (i = 0; i < ts->count; i++)
+    {
+        timeshift_segment_t *segment = &ts->segments [(ts->first + i) % ts->max];
+
+        if (segment->done == 0)
+        {
+            segment->done = failed ? -1 : 1;
+            break;
+        }
+    }
+    while (ts->count > 1 && count < TIMESHIFT_PRUNE_MAX)
+    {
+        timeshift_segment_t *segment = &ts->segments [ts->first];
+
+        if (segment->done == 0 || segment->start + ts->duration_ms > now)
+            break;
+        expired [count++] = segment->start;
+        ts->first = (ts->first + 1) % ts->max;
+        ts->count--;
+    }
+    thread_mutex_unlock (&ts->lock);
+
+    if (failed)
+        ICECAST_LOG_WARN("timeshift segment %s was not written", filename);
+    for (i = 0; i < count; i++)
+    {
+        char path [PATH_MAX];
+
+        timeshift_segment_path (ts, expired [i], path, sizeof (path));
+        if (unlink (path) < 0)
+            ICECAST_LOG_DEBUG("cannot remove %s", path);
+    }
+}
+
+
+/* start recording the stream for the mount into the directory */
+timeshift_t *timeshift_start (const char *mount, const char *directory,
+        unsigned int segment, unsigned int duration)
+{
+    timeshift_t *ts = calloc (1, sizeof (timeshift_t));
+    char *p;
+
+    if (ts == NULL)
+        return NULL;
+    if (segment == 0)
+        segment = TIMESHIFT_SEGMENT_DEFAULT;
+    if (duration == 0)
+        duration = TIMESHIFT_DURATION_DEFAULT;
+    ts->segment_ms = segment * 1000;
+    ts->duration_ms = duration * 1000;
+    /* room for those being written and any still being sent */
+    ts->max = duration / segment + 4;
+    ts->segments = calloc (ts->max, sizeof (timeshift_segment_t));
+    ts->directory = strdup (directory);
+    /* the mount without slashes names the files */
+    ts->name = strdup (mount[0] == '/' ? mount + 1 : mount);
+    if (ts->segments == NULL || ts->directory == NULL || ts->name == NULL)
+    {
+        free (ts->segments);
+        free (ts->directory);
+        free (ts->name);
+        free (ts);
+        return NULL;
+    }
+    for (p = ts->name; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    ts->refcount = 1;
+    thread_mutex_create (&ts->lock);
+    ICECAST_LOG_INFO("timeshift for %s in %s, %u second segments", mount, directory, segment);
+    return ts;
+}
+
+
+/* move the recording on to a new segment starting with refbuf */
+static void timeshift_new_segment (timeshift_t *ts, source_t *source, refbuf_t *refbuf, uint64_t now)
+{
+    char path [PATH_MAX];
+    refbuf_t *headers = NULL;
+    uint64_t forget = 0;
+
+    timeshift_segment_path (ts, now, path, sizeof (path));
+    /* tried again on the next segment if this fails */
+    ts->segment_start = now;
+    if (ts->dump == NULL)
+    {
+        ts->dump = dumpfile_open (path, 0, DUMPFILE_OVERFLOW_DROP, 0);
+        if (ts->dump == NULL)
+        {
+            ICECAST_LOG_WARN("Cannot open timeshift segment %s", path);
+            return;
+        }
+        dumpfile_set_callback (ts->dump, timeshift_segment_done, ts);
+    }
+    else if (dumpfile_switch (ts->dump, path) < 0)
+        return;
+
+    thread_mutex_lock (&ts->lock);
+    if (ts->count == ts->max)
+    {
+        /* too many in hand, forget the oldest */
+        if (ts->segments [ts->first].done)
+            forget = ts->segments [ts->first].start;
+        ts->first = (ts->first + 1) % ts->max;
+        ts->count--;
+    }
+    ts->segments [(ts->first + ts->count) % ts->max].start = now;
+    ts->segments [(ts->first + ts->count) % ts->max].done = 0;
+    ts->count++;
+    thread_mutex_unlock (&ts->lock);
+
+    if (forget)
+    {
+        timeshift_segment_path (ts, forget, path, sizeof (path));
+        unlink (path);
+    }
+
+    if (source->format->get_headers)
+        headers = source->format->get_headers (source, refbuf);
+    if (headers)
+        dumpfile_write (ts->dump, headers);
+}
+
+
+/* record the buffer queued by the source, a new segment is started on the
+ * first sync point after the segment length */
+void timeshift_write (timeshift_t *ts, source_t *source, refbuf_t *refbuf)
+{
+    if (refbuf->sync_point)
+    {
+        uint64_t now = timing_get_time();
+
+        if (ts->segment_start == 0 || now - ts->segment_start >= ts->segment_ms)
+            timeshift_new_segment (ts, source, refbuf, now);
+    }
+    if (ts->dump)
+        dumpfile_write (ts->dump, refbuf);
+}
+
+
+/* stop recording, once the writes are done. Listeners still being sent
+ * segments keep their own reference */
+void timeshift_stop (timeshift_t *ts)
+{
+    if (ts == NULL)
+        return;
+    dumpfile_close (ts->dump);
+    ts->dump = NULL;
+    timeshift_release (ts);
+}
+
+
+void timeshift_addref (timeshift_t *ts)
+{
+    thread_mutex_lock (&ts->lock);
+    ts->refcount++;
+    thread_mutex_unlock (&ts->lock);
+}
+
+
+void timeshift_release (timeshift_t *ts)
+{
+    unsigned int refcount;
+
+    thread_mutex_lock (&ts->lock);
+    refcount = --ts->refcount;
+    thread_mutex_unlock (&ts->lock);
+    if (refcount)
+        return;
+    thread_mutex_destroy (&ts->lock);
+    free (ts->segments);
+    free (ts->directory);
+    free (ts->name);
+    free (ts);
+}
+
+
+/* the start of the first written segment after start, 0 if there is none
+ * yet. Call with the lock held */
+static uint64_t timeshift_next_start (timeshift_t *ts, uint64_t start)
+{
+    unsigned int i;
+
+    for (i = 0; i < ts->count; i++)
+    {
+        timeshift_segment_t *segment = &ts->segments [(ts->first + i) % ts->max];
+
+        if (segment->done == 0)
+            break;
+        if (segment->done > 0 && segment->start > start)
+            return segment->start;
+    }
+    return 0;
+}
+
+
+/* fserve is done with a segment, send the next one or finish */
+static void timeshift_client_next (client_t *client, void *arg)
+{
+    timeshift_client_t *tsc = arg;
+    char path [PATH_MAX];
+    uint64_t start = 0;
+
+    if (client->con->error == 0)
+    {
+        thread_mutex_lock (&tsc->ts->lock);
+        start = timeshift_next_start (tsc->ts, tsc->start);
+        thread_mutex_unlock (&tsc->ts->lock);
+    }
+    if (start)
+    {
+        tsc->start = start;
+        timeshift_segment_path (tsc->ts, start, path, sizeof (path));
+        if (fserve_add_file_callback (client, path, 0, timeshift_client_next, tsc) == 0)
+            return;
+    }
+    /* caught up with the recording */
+    timeshift_release (tsc->ts);
+    free (tsc);
+    client_destroy (client);
+}
+
+
+/* send the recorded stream to the listener from offset seconds ago, from
+ * the start of the segment covering that time. Returns -1 if there is
+ * nothing recorded to send, the client is left alone then
+ */
+int timeshift_add_client (timeshift_t *ts, client_t *client,
+        const char *contenttype, unsigned long offset)
+{
+    timeshift_client_t *tsc;
+    uint64_t now = timing_get_time(), target, start = 0;
+    char path [PATH_MAX];
+    unsigned int i;
+    ssize_t bytes;
+
+    target = now - (uint64_t)offset * 1000;
+    thread_mutex_lock (&ts->lock);
+    for (i = 0; i < ts->count; i++)
+    {
+        timeshift_segment_t *segment = &ts->segments [(ts->first + i) % ts->max];
+
+        if (segment->done == 0)
+            break;
+        if (segment->done < 0)
+            continue;
+        /* the oldest there is if the time is before any of them */
+        if (start && segment->start > target)
+            break;
+        start = segment->start;
+    }
+    thread_mutex_unlock (&ts->lock);
+    if (start == 0)
+        return -1;
+
+    tsc = calloc (1, sizeof (timeshift_client_t));
+    if (tsc == NULL)
+        return -1;
+    bytes = util_http_build_header (client->refbuf->data, PER_CLIENT_REFBUF_SIZE, 0,
+            0, 200, NULL, contenttype, NULL, "", NULL, client);
+    if (bytes < 0)
+    {
+        free (tsc);
+        return -1;
+    }
+    timeshift_addref (ts);
+    tsc->ts = ts;
+    tsc->start = start;
+    client->respcode = 200;
+    client->refbuf->len = bytes;
+    client->pos = 0;
+
+    timeshift_segment_path (ts, start, path, sizeof (path));
+    if (fserve_add_file_callback (client, path, 0, timeshift_client_next, tsc) < 0)
+    {
+        timeshift_release (ts);
+        free (tsc);
+        return -1;
+    }
+    ICECAST_LOG_DEBUG("timeshift listener starting %" PRIu64 "ms back", now - start);
+    return 0;
+}
@@ -0,0 +1,40 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org, 
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* timeshift.h
+**
+** recording a stream in segments for listeners to start back in time
+**
+*/
+#ifndef __TIMESHIFT_H__
+#define __TIMESHIFT_H__
+
+#include "refbuf.h"
+#include "client.h"
+
+/* seconds in a segment and kept in all by default */
+#define TIMESHIFT_SEGMENT_DEFAULT   10
+#define TIMESHIFT_DURATION_DEFAULT  3600
+
+struct source_tag;
+typedef struct timeshift_tag timeshift_t;
+
+timeshift_t *timeshift_start (const char *mount, const char *directory,
+        unsigned int segment, unsigned int duration);
+void timeshift_write (timeshift_t *ts, struct source_tag *source, refbuf_t *refbuf);
+void timeshift_stop (timeshift_t *ts);
+void timeshift_addref (timeshift_t *ts);
+void timeshift_release (timeshift_t *ts);
+int timeshift_add_client (timeshift_t *ts, client_t *client,
+        const char *contenttype, unsigned long offset);
+
+#endif  /* __TIMESHIFT_H__ */
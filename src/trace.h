@@ -0,0 +1,43 @@
+/* Icecast
+ *
+ * This program is distributed under the GNU General Public License, version 2.
+ * A copy of this license is included with this source.
+ *
+ * Copyright 2000-2004, Jack Moffitt <jack@xiph.org,
+ *                      Michael Smith <msmith@xiph.org>,
+ *                      oddsock <oddsock@xiph.org>,
+ *                      Karl Heyes <karl@xiph.org>
+ *                      and others (see AUTHORS for details).
+ */
+
+/* trace.h
+**
+** static tracepoints on the hot paths, for SystemTap, DTrace or bpftrace.
+** Built in with --enable-usdt, otherwise they compile to nothing.
+**
+** Probes in the icecast provider, strings are char * and ids unsigned long
+**   source_read        (mount, bytes)
+**   refbuf_append      (mount, bytes, queue_size)
+**   listener_send      (mount, client id, bytes)
+**   listener_add       (mount, client id)
+**   listener_remove    (mount, client id)
+**   slow_listener      (mount, client id)
+**   auth_enqueue       (mount, client id)
+**   auth_complete      (mount, client id, result)
+**   fserve_send        (client id, bytes)
+**   stats_event        (mount or NULL, name, value)
+*/
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define ICECAST_TRACE2(name,a,b)        DTRACE_PROBE2(icecast, name, a, b)
+#define ICECAST_TRACE3(name,a,b,c)      DTRACE_PROBE3(icecast, name, a, b, c)
+#else
+#define ICECAST_TRACE2(name,a,b)        do { } while (0)
+#define ICECAST_TRACE3(name,a,b,c)      do { } while (0)
+#endif
+
+#endif  /* __TRACE_H__ */
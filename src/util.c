@@ -79,6 +79,25 @@ static const char safechars[256] = {
     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
 };
 
+static const signed char hexvals[256] = {
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  10,  11,  12,  13,  14,  15,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  10,  11,  12,  13,  14,  15,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+     -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1
+};
+
 static const char base64table[64] = {
     'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P',
     'Q','R','S','T','U','V','W','X','Y','Z','a','b','c','d','e','f',
@@ -187,6 +206,38 @@ int util_read_header(sock_t sock, char *buff, unsigned long len, int entire)
     return ret;
 }
 
+/* Scan data of len bytes for the end of a line, or of the headers if
+ * headers is set, starting at *from which is moved on so that the next
+ * call only looks at data which has arrived since. Lines may be ended with
+ * \n, \r\n, or \r\r\n as nsvcap does, the headers by an empty line of any
+ * of those. Every terminator ends with \n so memchr does the searching.
+ * Returns the offset just after the terminator, 0 if there is none yet.
+ */
+size_t util_find_terminator(const char *data, size_t len, size_t *from, int headers)
+{
+    size_t pos = *from;
+
+    while (pos < len) {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        size_t i;
+
+        if (nl == NULL)
+            break;
+        i = nl - data;
+        pos = i + 1;
+        if (headers == 0)
+            return pos;
+        if (i >= 1 && data[i-1] == '\n')
+            return pos;
+        if (i >= 3 && memcmp(data + i - 3, "\r\n\r", 3) == 0)
+            return pos;
+        if (i >= 5 && memcmp(data + i - 5, "\r\r\n\r\r", 5) == 0)
+            return pos;
+    }
+    *from = len;
+    return 0;
+}
+
 char *util_get_extension(const char *path) {
     char *ext = strrchr(path, '.');
 
@@ -228,18 +279,6 @@ int util_check_valid_extension(const char *uri) {
     return ret;
 }
 
-static int hex(char c)
-{
-    if(c >= '0' && c <= '9')
-        return c - '0';
-    else if(c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    else if(c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    else
-        return -1;
-}
-
 static int verify_path(char *path) {
     int dir = 0, indotseq = 0;
 
@@ -269,16 +308,21 @@ static int verify_path(char *path) {
 }
 
 char *util_get_path_from_uri(char *uri) {
-    char *path = util_normalise_uri(uri);
+    char buf[1024];
+    char *path = buf;
     char *fullpath;
 
-    if(!path)
+    if (strlen(uri) < sizeof(buf)) {
+        if (util_normalise_uri_buf(uri, buf, sizeof(buf)) < 0)
+            return NULL;
+    } else if ((path = util_normalise_uri(uri)) == NULL) {
         return NULL;
-    else {
-        fullpath = util_get_path_from_normalised_uri(path);
-        free(path);
-        return fullpath;
     }
+
+    fullpath = util_get_path_from_normalised_uri(path);
+    if (path != buf)
+        free(path);
+    return fullpath;
 }
 
 char *util_get_path_from_normalised_uri(const char *uri) {
@@ -296,101 +340,120 @@ char *util_get_path_from_normalised_uri(const char *uri) {
     return fullpath;
 }
 
-char *util_url_escape (const char *src)
+/* escape src into the caller's buffer, returns the length written or -1 if
+ * size is too small. size of strlen(src)*3+1 is always enough.
+ */
+ssize_t util_url_escape_buf (const char *src, char *dst, size_t size)
 {
-    size_t len;
-    char *dst;
-    unsigned char *source = (unsigned char *)src;
-    size_t i, j;
-
-    if (!src)
-        return NULL;
+    const unsigned char *source = (const unsigned char *)src;
+    size_t j = 0;
 
-    len = strlen(src);
-    /* Efficiency not a big concern here, keep the code simple/conservative */
-    dst = calloc(1, len*3 + 1);
+    if (!src || !dst)
+        return -1;
 
-    for(i = 0, j = 0; i < len; i++) {
-        if(safechars[source[i]]) {
-            dst[j++] = source[i];
+    for (; *source; source++) {
+        if (safechars[*source]) {
+            if (j + 1 >= size)
+                return -1;
+            dst[j++] = *source;
         } else {
+            if (j + 3 >= size)
+                return -1;
             dst[j++] = '%';
-            dst[j++] = hexchars[(source[i] >> 4) & 0x0F];
-            dst[j++] = hexchars[ source[i]       & 0x0F];
+            dst[j++] = hexchars[(*source >> 4) & 0x0F];
+            dst[j++] = hexchars[ *source       & 0x0F];
         }
     }
 
+    if (j >= size)
+        return -1;
     dst[j] = 0;
-    return dst;
+    return j;
 }
 
-char *util_url_unescape (const char *src)
+char *util_url_escape (const char *src)
 {
-    int len = strlen(src);
-    char *decoded;
-    int i;
+    size_t len;
     char *dst;
-    int done = 0;
 
-    decoded = calloc(1, len + 1);
+    if (!src)
+        return NULL;
 
-    dst = decoded;
+    len = strlen(src)*3 + 1;
+    dst = malloc(len);
+    if (dst && util_url_escape_buf(src, dst, len) < 0) {
+        free(dst);
+        return NULL;
+    }
+    return dst;
+}
 
-    for(i=0; i < len; i++) {
-        switch(src[i]) {
-            case '%':
-                if(i+2 >= len) {
-                    free(decoded);
-                    return NULL;
-                }
-                if(hex(src[i+1]) == -1 || hex(src[i+2]) == -1 ) {
-                    free(decoded);
-                    return NULL;
-                }
+/* decode src into the caller's buffer, stopping at a '#'. Runs without
+ * escapes are copied as a block. Returns the decoded length, or -1 if src
+ * has a bad escape or does not fit, strlen(src)+1 is always enough.
+ */
+ssize_t util_url_unescape_buf (const char *src, char *dst, size_t size)
+{
+    const char *p = src;
+    char *out = dst;
+    char *end = dst + size;
+    size_t run;
+    int hi, lo;
 
-                *dst++ = hex(src[i+1]) * 16  + hex(src[i+2]);
-                i+= 2;
-                break;
-            case '#':
-                done = 1;
-                break;
-            case 0:
-                ICECAST_LOG_ERROR("Fatal internal logic error in util_url_unescape()");
-                free(decoded);
-                return NULL;
-                break;
-            default:
-                *dst++ = src[i];
-                break;
-        }
-        if(done)
-            break;
+    if (!src || !dst || size == 0)
+        return -1;
+
+    while (1) {
+        run = strcspn(p, "%#");
+        if ((size_t)(end - out) <= run)
+            return -1;
+        memcpy(out, p, run);
+        out += run;
+        p += run;
+
+        if (*p != '%')
+            break; /* end of string or start of the fragment */
+
+        hi = hexvals[(unsigned char)p[1]];
+        lo = hi < 0 ? -1 : hexvals[(unsigned char)p[2]];
+        if (lo < 0 || end - out < 2)
+            return -1;
+        *out++ = (hi << 4) | lo;
+        p += 3;
     }
 
-    *dst = 0; /* null terminator */
+    *out = 0; /* null terminator */
+    return out - dst;
+}
+
+char *util_url_unescape (const char *src)
+{
+    size_t len = strlen(src) + 1;
+    char *decoded = malloc(len);
 
+    if (decoded && util_url_unescape_buf(src, decoded, len) < 0) {
+        free(decoded);
+        return NULL;
+    }
     return decoded;
 }
 
-/* Get an absolute path (from the webroot dir) from a URI. Return NULL if the
- * path contains 'disallowed' sequences like foo/../ (which could be used to
- * escape from the webroot) or if it cannot be URI-decoded.
- * Caller should free the path.
+/* Get an absolute path (from the webroot dir) from a URI into the caller's
+ * buffer. Return -1 if the path contains 'disallowed' sequences like
+ * foo/../ (which could be used to escape from the webroot), if it cannot be
+ * URI-decoded or does not fit in size bytes.
  */
-char *util_normalise_uri(const char *uri) {
-    char *path;
+int util_normalise_uri_buf(const char *uri, char *path, size_t size) {
 #ifdef _WIN32
     size_t len;
 #endif
 
     if(uri[0] != '/')
-        return NULL;
-
-    path = util_url_unescape(uri);
+        return -1;
 
-    if(path == NULL) {
+    if(util_url_unescape_buf(uri, path, size) < 0) {
         ICECAST_LOG_WARN("Error decoding URI: %s\n", uri);
-        return NULL;
+        return -1;
     }
 
 #ifdef _WIN32
@@ -401,12 +464,22 @@ char *util_normalise_uri(const char *uri) {
 
     /* We now have a full URI-decoded path. Check it for allowability */
     if(verify_path(path))
-        return path;
-    else {
-        ICECAST_LOG_WARN("Rejecting invalid path \"%s\"", path);
+        return 0;
+
+    ICECAST_LOG_WARN("Rejecting invalid path \"%s\"", path);
+    return -1;
+}
+
+/* as util_normalise_uri_buf() but allocated, caller should free the path. */
+char *util_normalise_uri(const char *uri) {
+    size_t len = strlen(uri) + 1;
+    char *path = malloc(len);
+
+    if (path && util_normalise_uri_buf(uri, path, len) < 0) {
         free(path);
         return NULL;
     }
+    return path;
 }
 
 char *util_bin_to_hex(unsigned char *data, int len)
@@ -457,30 +530,28 @@ char *util_base64_encode(const char *data, size_t len) {
     return result;
 }
 
-char *util_base64_decode(const char *data)
+/* decode into the caller's buffer, returns the decoded length or -1 for
+ * invalid data or a too small buffer. strlen(data)*3/4+1 is always enough.
+ * Padding is decoded as zero bytes, as before.
+ */
+ssize_t util_base64_decode_buf(const char *data, char *out, size_t size)
 {
     const unsigned char *input = (const unsigned char *)data;
-    int len = strlen (data);
-    char *out = malloc(len*3/4 + 5);
+    size_t len = strlen (data);
     char *result = out;
     signed char vals[4];
 
-    while(len > 0) {
-        if(len < 4)
-        {
-            free(result);
-            return NULL; /* Invalid Base64 data */
-        }
+    if (len % 4 || len / 4 * 3 >= size)
+        return -1; /* Invalid Base64 data or no room */
 
-        vals[0] = base64decode[*input++];
-        vals[1] = base64decode[*input++];
-        vals[2] = base64decode[*input++];
-        vals[3] = base64decode[*input++];
+    for (; len; len -= 4, input += 4) {
+        vals[0] = base64decode[input[0]];
+        vals[1] = base64decode[input[1]];
+        vals[2] = base64decode[input[2]];
+        vals[3] = base64decode[input[3]];
 
-        if(vals[0] < 0 || vals[1] < 0 || vals[2] < -1 || vals[3] < -1) {
-            len -= 4;
+        if(vals[0] < 0 || vals[1] < 0 || vals[2] < -1 || vals[3] < -1)
             continue;
-        }
 
         *out++ = vals[0]<<2 | vals[1]>>4;
         /* vals[3] and (if that is) vals[2] can be '=' as padding, which is
@@ -496,12 +567,22 @@ char *util_base64_decode(const char *data)
             *out++ = ((vals[2]&0x03)<<6) | (vals[3]);
         else
             *out++ = 0;
-
-        len -= 4;
     }
     *out = 0;
 
-    return result;
+    return out - result;
+}
+
+char *util_base64_decode(const char *data)
+{
+    size_t len = strlen (data)*3/4 + 5;
+    char *out = malloc(len);
+
+    if (out && util_base64_decode_buf(data, out, len) < 0) {
+        free(out);
+        return NULL;
+    }
+    return out;
 }
 
 util_hostcheck_type util_hostcheck(const char *hostname) {
@@ -624,7 +705,12 @@ static inline void   _build_headers_loop(char **ret, size_t *len, ice_config_htt
     } while ((header = header->next));
     *ret = r;
 }
-static inline char * _build_headers(int status, ice_config_t *config, source_t *source) {
+/* returns the configured headers for this status. The precompiled strings
+ * are used as they are unless some header is limited to a status, only then
+ * is a buffer built that the caller must free via *alloc.
+ */
+static inline const char * _build_headers(int status, ice_config_t *config, source_t *source,
+        const char **mount_headers, char **alloc) {
     mount_proxy *mountproxy = NULL;
     char *ret = NULL;
     size_t len = 1;
@@ -632,13 +718,24 @@ static inline char * _build_headers(int status, ice_config_t *config, source_t *
     if (source)
         mountproxy = config_find_mount(config, source->mount, MOUNT_TYPE_NORMAL);
 
+    *alloc = NULL;
+    *mount_headers = "";
+    if (!config->http_headers_per_status && config->http_headers_compiled &&
+            (!mountproxy || (!mountproxy->http_headers_per_status && mountproxy->http_headers_compiled))) {
+        if (mountproxy)
+            *mount_headers = mountproxy->http_headers_compiled;
+        return config->http_headers_compiled;
+    }
+
     ret = calloc(1, 1);
-    *ret = 0;
+    if (!ret)
+        return "";
 
     _build_headers_loop(&ret, &len, config->http_headers, status);
     if (mountproxy && mountproxy->http_headers)
         _build_headers_loop(&ret, &len, mountproxy->http_headers, status);
 
+    *alloc = ret;
     return ret;
 }
 
@@ -657,7 +754,9 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
     char status_buffer[80];
     char contenttype_buffer[80];
     ssize_t ret;
-    char * extra_headers;
+    const char *extra_headers;
+    const char *mount_headers;
+    char *extra_alloc;
     const char *connection_header = "Close";
 
     if (!out)
@@ -691,6 +790,8 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
                 case 101: statusmsg = "Switching Protocols"; http_version = "1.1"; break;
                 case 200: statusmsg = "OK"; break;
                 case 206: statusmsg = "Partial Content"; http_version = "1.1"; break;
+                case 302: statusmsg = "Found"; break;
+                case 304: statusmsg = "Not Modified"; break;
                 case 400: statusmsg = "Bad Request"; break;
                 case 401: statusmsg = "Authentication Required"; break;
                 case 403: statusmsg = "Forbidden"; break;
@@ -698,6 +799,7 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
                 case 416: statusmsg = "Request Range Not Satisfiable"; break;
                 case 426: statusmsg = "Upgrade Required"; http_version = "1.1"; break;
                 case 501: statusmsg = "Unimplemented"; break;
+                case 503: statusmsg = "Service Unavailable"; break;
                 default:  statusmsg = "(unknown status code)"; break;
             }
         }
@@ -734,8 +836,8 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
         currenttime_buffer[0] = '\0';
 
     config = config_get_config();
-    extra_headers = _build_headers(status, config, source);
-    ret = snprintf (out, len, "%sServer: %s\r\nConnection: %s\r\nAccept-Encoding: identity\r\nAllow: %s\r\n%s%s%s%s%s%s%s%s",
+    extra_headers = _build_headers(status, config, source, &mount_headers, &extra_alloc);
+    ret = snprintf (out, len, "%sServer: %s\r\nConnection: %s\r\nAccept-Encoding: identity\r\nAllow: %s\r\n%s%s%s%s%s%s%s%s%s",
                               status_buffer,
                               config->server_id,
                               connection_header,
@@ -749,9 +851,10 @@ ssize_t util_http_build_header(char * out, size_t len, ssize_t offset,
                                                 "Expires: Mon, 26 Jul 1997 05:00:00 GMT\r\n"
                                                 "Pragma: no-cache\r\n"),
                               extra_headers,
+                              mount_headers,
                               (datablock ? "\r\n" : ""),
                               (datablock ? datablock : ""));
-    free(extra_headers);
+    free(extra_alloc);
     config_release_config();
 
     return ret;
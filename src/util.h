@@ -27,13 +27,16 @@
 
 int util_timed_wait_for_fd(sock_t fd, int timeout);
 int util_read_header(sock_t sock, char *buff, unsigned long len, int entire);
+size_t util_find_terminator(const char *data, size_t len, size_t *from, int headers);
 int util_check_valid_extension(const char *uri);
 char *util_get_extension(const char *path);
 char *util_get_path_from_uri(char *uri);
 char *util_get_path_from_normalised_uri(const char *uri);
 char *util_normalise_uri(const char *uri);
+int util_normalise_uri_buf(const char *uri, char *path, size_t size);
 char *util_base64_encode(const char *data, size_t len);
 char *util_base64_decode(const char *input);
+ssize_t util_base64_decode_buf(const char *input, char *out, size_t size);
 char *util_bin_to_hex(unsigned char *data, int len);
 
 typedef enum _util_hostcheck_tag {
@@ -53,6 +56,8 @@ int util_str_to_loglevel(const char *str);
 
 char *util_url_unescape(const char *src);
 char *util_url_escape(const char *src);
+ssize_t util_url_unescape_buf(const char *src, char *dst, size_t size);
+ssize_t util_url_escape_buf(const char *src, char *dst, size_t size);
 
 /* Function to build up a HTTP header.
  * out is the pointer to storage.
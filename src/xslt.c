@@ -66,6 +66,20 @@ typedef struct {
     xsltStylesheetPtr stylesheet;
 } stylesheet_cache_t;
 
+/* Rendered status pages, keyed by stylesheet, mount and mode. An entry is
+ * used while the stats generation is unchanged and it is not too old.
+ */
+typedef struct {
+    char *filename;
+    char *mount;
+    operation_mode mode;
+    unsigned int generation;
+    time_t expires;
+    refbuf_t *body;
+    char *mediatype;
+    char *charset;
+} output_cache_t;
+
 #ifndef HAVE_XSLTSAVERESULTTOSTRING
 int xsltSaveResultToString(xmlChar **doc_txt_ptr, int * doc_txt_len, xmlDocPtr result, xsltStylesheetPtr style) {
     xmlOutputBufferPtr buf;
@@ -98,6 +112,13 @@ int xsltSaveResultToString(xmlChar **doc_txt_ptr, int * doc_txt_len, xmlDocPtr r
 static stylesheet_cache_t cache[CACHESIZE];
 static mutex_t xsltlock;
 
+#define OUTPUT_CACHESIZE    8
+#define OUTPUT_CACHE_TTL    2
+
+static output_cache_t output_cache[OUTPUT_CACHESIZE];
+static mutex_t output_lock;
+static unsigned int output_next; /* entry to replace next */
+
 /* Reference to the original xslt loader func */
 static xsltDocLoaderFunc xslt_loader;
 /* Admin path cache */
@@ -107,6 +128,9 @@ void xslt_initialize(void)
 {
     memset(cache, 0, sizeof(stylesheet_cache_t) * CACHESIZE);
     thread_mutex_create(&xsltlock);
+    memset(output_cache, 0, sizeof(output_cache));
+    thread_mutex_create(&output_lock);
+    output_next = 0;
     xmlInitParser();
     LIBXML_TEST_VERSION
     xmlSubstituteEntitiesDefault(1);
@@ -114,6 +138,16 @@ void xslt_initialize(void)
     xslt_loader = xsltDocDefaultLoader;
 }
 
+static void output_cache_clear (output_cache_t *entry)
+{
+    free (entry->filename);
+    free (entry->mount);
+    free (entry->mediatype);
+    free (entry->charset);
+    refbuf_release (entry->body);
+    memset (entry, 0, sizeof (output_cache_t));
+}
+
 void xslt_shutdown(void) {
     int i;
 
@@ -123,8 +157,11 @@ void xslt_shutdown(void) {
         if(cache[i].stylesheet)
             xsltFreeStylesheet(cache[i].stylesheet);
     }
+    for (i = 0; i < OUTPUT_CACHESIZE; i++)
+        output_cache_clear (&output_cache[i]);
 
     thread_mutex_destroy (&xsltlock);
+    thread_mutex_destroy (&output_lock);
     xmlCleanupParser();
     xsltCleanupGlobals();
     if (admin_path)
@@ -286,14 +323,17 @@ static xmlDocPtr custom_loader(const        xmlChar *URI,
     return ret;
 }
 
-void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client)
+/* apply the stylesheet, the output is returned along with copies of the
+ * content type and charset. Returns 0 on success, -1 if the stylesheet
+ * could not be loaded and -2 if it could not be applied.
+ */
+static int xslt_render(xmlDocPtr doc, const char *xslfilename,
+        refbuf_t **body, char **mediatype, char **charset)
 {
     xmlDocPtr res;
     xsltStylesheetPtr cur;
     xmlChar *string;
-    int len, problem = 0;
-    const char *mediatype = NULL;
-    const char *charset = NULL;
+    int len, ret = 0;
 
     xmlSetGenericErrorFunc("", log_parse_failure);
     xsltSetGenericErrorFunc("", log_parse_failure);
@@ -306,88 +346,195 @@ void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client)
     {
         thread_mutex_unlock(&xsltlock);
         ICECAST_LOG_ERROR("problem reading stylesheet \"%s\"", xslfilename);
-        client_send_error(client, 404, 0, "Could not parse XSLT file");
-        return;
+        return -1;
     }
 
     res = xsltApplyStylesheet(cur, doc, NULL);
 
     if (xsltSaveResultToString (&string, &len, res, cur) < 0)
-        problem = 1;
-
-    /* lets find out the content type and character encoding to use */
-    if (cur->encoding)
-       charset = (char *)cur->encoding;
-
-    if (cur->mediaType)
-        mediatype = (char *)cur->mediaType;
+        ret = -2;
     else
     {
-        /* check method for the default, a missing method assumes xml */
-        if (cur->method && xmlStrcmp (cur->method, XMLSTR("html")) == 0)
-            mediatype = "text/html";
+        *body = refbuf_new (len + 1);
+        if (string)
+            memcpy ((*body)->data, string, len);
+        else
+            len = 0;
+        (*body)->data[len] = '\0';
+        (*body)->len = len;
+        xmlFree (string);
+
+        /* lets find out the content type and character encoding to use */
+        *charset = cur->encoding ? strdup ((char *)cur->encoding) : NULL;
+
+        if (cur->mediaType)
+            *mediatype = strdup ((char *)cur->mediaType);
         else
-            if (cur->method && xmlStrcmp (cur->method, XMLSTR("text")) == 0)
-                mediatype = "text/plain";
+        {
+            /* check method for the default, a missing method assumes xml */
+            if (cur->method && xmlStrcmp (cur->method, XMLSTR("html")) == 0)
+                *mediatype = strdup ("text/html");
             else
-                mediatype = "text/xml";
+                if (cur->method && xmlStrcmp (cur->method, XMLSTR("text")) == 0)
+                    *mediatype = strdup ("text/plain");
+                else
+                    *mediatype = strdup ("text/xml");
+        }
     }
-    if (problem == 0)
-    {
-        ssize_t ret;
-        int failed = 0;
-        refbuf_t *refbuf;
-        ssize_t full_len = strlen(mediatype) + (ssize_t)len + (ssize_t)1024;
-        if (full_len < 4096)
-            full_len = 4096;
-        refbuf = refbuf_new (full_len);
-
-        if (string == NULL)
-            string = xmlCharStrdup ("");
-        ret = util_http_build_header(refbuf->data, full_len, 0, 0, 200, NULL, mediatype, charset, NULL, NULL, client);
-        if (ret == -1) {
-            ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-            client_send_error(client, 500, 0, "Header generation failed.");
-        } else {
-            if ( full_len < (ret + (ssize_t)len + (ssize_t)64) ) {
-                void *new_data;
-                full_len = ret + (ssize_t)len + (ssize_t)64;
-                new_data = realloc(refbuf->data, full_len);
-                if (new_data) {
-                    ICECAST_LOG_DEBUG("Client buffer reallocation succeeded.");
-                    refbuf->data = new_data;
-                    refbuf->len = full_len;
-                    ret = util_http_build_header(refbuf->data, full_len, 0, 0, 200, NULL, mediatype, charset, NULL, NULL, client);
-                    if (ret == -1) {
-                        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
-                        client_send_error(client, 500, 0, "Header generation failed.");
-                        failed = 1;
-                    }
-                } else {
-                    ICECAST_LOG_ERROR("Client buffer reallocation failed. Dropping client.");
-                    client_send_error(client, 500, 0, "Buffer reallocation failed.");
-                    failed = 1;
-                }
-            }
+    thread_mutex_unlock (&xsltlock);
+    xmlFreeDoc(res);
+    return ret;
+}
 
-            if (!failed) {
-                  snprintf(refbuf->data + ret, full_len - ret, "Content-Length: %d\r\n\r\n%s", len, string);
 
-                client->respcode = 200;
-                client_set_queue (client, NULL);
-                client->refbuf = refbuf;
-                refbuf->len = strlen (refbuf->data);
-                fserve_add_client (client, NULL);
-            }
-        }
-        xmlFree (string);
+/* send the rendered output, the body is referenced by the response */
+static void xslt_send_output(client_t *client, refbuf_t *body,
+        const char *mediatype, const char *charset)
+{
+    ssize_t ret;
+    refbuf_t *refbuf;
+    ssize_t full_len = strlen(mediatype) + (ssize_t)1024;
+
+    if (full_len < 4096)
+        full_len = 4096;
+    refbuf = refbuf_new (full_len);
+
+    client_keepalive(client);
+    ret = util_http_build_header(refbuf->data, full_len, 0, 0, 200, NULL, mediatype, charset, NULL, NULL, client);
+    if (ret == -1 || ret + 64 > full_len) {
+        ICECAST_LOG_ERROR("Dropping client as we can not build response headers.");
+        client_send_error(client, 500, 0, "Header generation failed.");
+        refbuf_release (refbuf);
+        return;
     }
+    snprintf(refbuf->data + ret, full_len - ret, "Content-Length: %u\r\n\r\n", body->len);
+
+    client->respcode = 200;
+    client_set_queue (client, NULL);
+    client->refbuf = refbuf;
+    refbuf->len = strlen (refbuf->data);
+    if (body->len)
+        refbuf->next = refbuf_slice (body, 0, body->len);
+    fserve_add_client (client, NULL);
+}
+
+
+static void xslt_send_error(client_t *client, int ret, const char *xslfilename)
+{
+    if (ret == -1)
+        client_send_error(client, 404, 0, "Could not parse XSLT file");
     else
     {
         ICECAST_LOG_WARN("problem applying stylesheet \"%s\"", xslfilename);
         client_send_error(client, 404, 0, "XSLT problem");
     }
-    thread_mutex_unlock (&xsltlock);
-    xmlFreeDoc(res);
 }
 
+
+void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client)
+{
+    refbuf_t *body = NULL;
+    char *mediatype = NULL, *charset = NULL;
+    int ret = xslt_render (doc, xslfilename, &body, &mediatype, &charset);
+
+    if (ret < 0)
+    {
+        xslt_send_error (client, ret, xslfilename);
+        return;
+    }
+    xslt_send_output (client, body, mediatype, charset);
+    refbuf_release (body);
+    free (mediatype);
+    free (charset);
+}
+
+
+static output_cache_t *output_cache_find(const char *xslfilename, const char *mount, operation_mode mode)
+{
+    int i;
+
+    for (i = 0; i < OUTPUT_CACHESIZE; i++)
+    {
+        output_cache_t *entry = &output_cache[i];
+
+        if (entry->filename == NULL || entry->mode != mode ||
+                strcmp (entry->filename, xslfilename) != 0)
+            continue;
+        if ((mount == NULL) != (entry->mount == NULL) ||
+                (mount && strcmp (mount, entry->mount) != 0))
+            continue;
+        return entry;
+    }
+    return NULL;
+}
+
+
+/* send a previously rendered page if it is still current. Returns 0 if
+ * the client has been handled */
+int xslt_send_cached(const char *xslfilename, const char *mount,
+        unsigned int generation, client_t *client)
+{
+    output_cache_t *entry;
+    refbuf_t *body;
+    char *mediatype, *charset;
+
+    thread_mutex_lock (&output_lock);
+    entry = output_cache_find (xslfilename, mount, client->mode);
+    if (entry == NULL || entry->generation != generation || time(NULL) >= entry->expires)
+    {
+        thread_mutex_unlock (&output_lock);
+        return -1;
+    }
+    body = entry->body;
+    refbuf_addref (body);
+    mediatype = strdup (entry->mediatype);
+    charset = entry->charset ? strdup (entry->charset) : NULL;
+    thread_mutex_unlock (&output_lock);
+
+    xslt_send_output (client, body, mediatype, charset);
+    refbuf_release (body);
+    free (mediatype);
+    free (charset);
+    return 0;
+}
+
+
+/* as xslt_transform, keeping the output for xslt_send_cached */
+void xslt_transform_cached(xmlDocPtr doc, const char *xslfilename,
+        const char *mount, unsigned int generation, client_t *client)
+{
+    output_cache_t *entry;
+    refbuf_t *body = NULL;
+    char *mediatype = NULL, *charset = NULL;
+    int ret = xslt_render (doc, xslfilename, &body, &mediatype, &charset);
+
+    if (ret < 0)
+    {
+        xslt_send_error (client, ret, xslfilename);
+        return;
+    }
+
+    thread_mutex_lock (&output_lock);
+    entry = output_cache_find (xslfilename, mount, client->mode);
+    if (entry == NULL)
+    {
+        entry = &output_cache[output_next];
+        output_next = (output_next + 1) % OUTPUT_CACHESIZE;
+    }
+    output_cache_clear (entry);
+    entry->filename = strdup (xslfilename);
+    entry->mount = mount ? strdup (mount) : NULL;
+    entry->mode = client->mode;
+    entry->generation = generation;
+    entry->expires = time(NULL) + OUTPUT_CACHE_TTL;
+    entry->body = body;
+    refbuf_addref (body);
+    entry->mediatype = strdup (mediatype);
+    entry->charset = charset ? strdup (charset) : NULL;
+    thread_mutex_unlock (&output_lock);
+
+    xslt_send_output (client, body, mediatype, charset);
+    refbuf_release (body);
+    free (mediatype);
+    free (charset);
+}
@@ -35,6 +35,10 @@
 
 
 void xslt_transform(xmlDocPtr doc, const char *xslfilename, client_t *client);
+int xslt_send_cached(const char *xslfilename, const char *mount,
+        unsigned int generation, client_t *client);
+void xslt_transform_cached(xmlDocPtr doc, const char *xslfilename,
+        const char *mount, unsigned int generation, client_t *client);
 void xslt_initialize(void);
 void xslt_shutdown(void);
 
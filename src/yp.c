@@ -37,6 +37,22 @@
 
 #define CATMODULE "yp"
 
+/* requests to one directory server at the same time */
+#define YP_MAX_INFLIGHT_DEFAULT     4
+#define YP_MAX_INFLIGHT_LIMIT       32
+
+/* Add, touch and remove requests run through one multi handle, so a slow
+ * directory server does not hold up the others. Each server has a few
+ * easy handles, a ypdata entry uses one while its request is in flight.
+ */
+typedef struct yp_request_tag
+{
+    CURL *curl;
+    struct ypdata_tag *yp;      /* NULL while the handle is free */
+    const char *cmd;
+    char curl_error[CURL_ERROR_SIZE];
+} yp_request_t;
+
 struct yp_server
 {
     char        *url;
@@ -45,10 +61,11 @@ struct yp_server
     unsigned    touch_interval;
     int         remove;
 
-    CURL *curl;
+    unsigned    max_inflight;
+    unsigned    inflight;
+    yp_request_t *requests;
     struct ypdata_tag *mounts, *pending_mounts;
     struct yp_server *next;
-    char curl_error[CURL_ERROR_SIZE];
 };
 
 
@@ -74,6 +91,7 @@ typedef struct ypdata_tag
     char *subtype;
 
     struct yp_server *server;
+    yp_request_t *request;      /* while talking to the server */
     time_t next_update;
     unsigned touch_interval;
     char *error_msg;
@@ -89,6 +107,7 @@ static mutex_t yp_pending_lock;
 static volatile struct yp_server *active_yps = NULL, *pending_yps = NULL;
 static volatile int yp_update = 0;
 static int yp_running;
+static CURLM *yp_multi;
 static time_t now;
 static thread_type *yp_thread;
 static volatile unsigned client_limit = 0;
@@ -102,6 +121,7 @@ static int do_yp_touch(ypdata_t *yp, char *s, unsigned len);
 static void add_pending_yp (struct yp_server *server);
 static void delete_marked_yp(struct yp_server *server);
 static void yp_destroy_ypdata(ypdata_t *ypdata);
+static void yp_request_done(yp_request_t *request, CURLcode curlcode);
 
 
 /* curl callback used to parse headers coming back from the YP server */
@@ -174,11 +194,25 @@ static struct yp_server *find_yp_server (const char *url)
 static void destroy_yp_server (struct yp_server *server)
 {
     ypdata_t *yp;
+    unsigned i;
 
     if (server == NULL)
         return;
     ICECAST_LOG_DEBUG("Removing YP server entry for %s", server->url);
 
+    /* abandon requests still in flight */
+    for (i = 0; server->requests && i < server->max_inflight; i++)
+    {
+        yp_request_t *request = &server->requests[i];
+
+        if (request->yp == NULL)
+            continue;
+        curl_multi_remove_handle (yp_multi, request->curl);
+        request->yp->request = NULL;
+        request->yp = NULL;
+        server->inflight--;
+    }
+
     /* delete yps:
      * first move all pendings into main queue.
      * then mark all main queue entries for deleting.
@@ -192,7 +226,10 @@ static void destroy_yp_server (struct yp_server *server)
     }
     delete_marked_yp(server);
 
-    icecast_curl_free(server->curl);
+    for (i = 0; server->requests && i < server->max_inflight; i++)
+        if (server->requests[i].curl)
+            icecast_curl_free (server->requests[i].curl);
+    free (server->requests);
     if (server->mounts) ICECAST_LOG_WARN("active ypdata not freed");
     if (server->pending_mounts) ICECAST_LOG_WARN("pending ypdata not freed");
     free (server->url);
@@ -219,6 +256,7 @@ static ypdata_t *find_yp_mount (ypdata_t *mounts, const char *mount)
 void yp_recheck_config (ice_config_t *config)
 {
     int i;
+    unsigned j;
     struct yp_server *server;
 
     ICECAST_LOG_DEBUG("Updating YP configuration");
@@ -251,21 +289,41 @@ void yp_recheck_config (ice_config_t *config)
             server->url = strdup (config->yp_url[i]);
             server->url_timeout = config->yp_url_timeout[i];
             server->touch_interval = config->yp_touch_interval[i];
-            server->curl = icecast_curl_new(server->url, &(server->curl_error[0]));
-            if (server->curl == NULL)
-            {
-                destroy_yp_server (server);
-                break;
-            }
+            server->max_inflight = config->yp_max_inflight[i];
             if (server->url_timeout > 10 || server->url_timeout < 1)
                 server->url_timeout = 6;
             if (server->touch_interval < 30)
                 server->touch_interval = 30;
-            curl_easy_setopt (server->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
+            if (server->max_inflight < 1)
+                server->max_inflight = YP_MAX_INFLIGHT_DEFAULT;
+            if (server->max_inflight > YP_MAX_INFLIGHT_LIMIT)
+                server->max_inflight = YP_MAX_INFLIGHT_LIMIT;
+            server->requests = calloc (server->max_inflight, sizeof (yp_request_t));
+            if (server->requests == NULL)
+            {
+                destroy_yp_server (server);
+                break;
+            }
+            for (j = 0; j < server->max_inflight; j++)
+            {
+                yp_request_t *request = &server->requests[j];
+
+                request->curl = icecast_curl_new (server->url, &(request->curl_error[0]));
+                if (request->curl == NULL)
+                    break;
+                curl_easy_setopt (request->curl, CURLOPT_HEADERFUNCTION, handle_returned_header);
+                curl_easy_setopt (request->curl, CURLOPT_TIMEOUT, (long)server->url_timeout);
+                curl_easy_setopt (request->curl, CURLOPT_PRIVATE, request);
+            }
+            if (j < server->max_inflight)
+            {
+                destroy_yp_server (server);
+                break;
+            }
             server->next = (struct yp_server *)pending_yps;
             pending_yps = server;
-            ICECAST_LOG_INFO("Adding new YP server \"%s\" (timeout %ds, default interval %ds)",
-                    server->url, server->url_timeout, server->touch_interval);
+            ICECAST_LOG_INFO("Adding new YP server \"%s\" (timeout %ds, default interval %ds, %u requests at a time)",
+                    server->url, server->url_timeout, server->touch_interval, server->max_inflight);
         }
         else
         {
@@ -282,6 +340,9 @@ void yp_initialize(void)
     ice_config_t *config = config_get_config();
     thread_rwlock_create (&yp_lock);
     thread_mutex_create (&yp_pending_lock);
+    yp_multi = curl_multi_init ();
+    if (yp_multi == NULL)
+        ICECAST_LOG_ERROR("Unable to set up YP requests, no directory listings");
     yp_recheck_config (config);
     config_release_config ();
     yp_thread = thread_create("YP Touch Thread", yp_update_thread,
@@ -290,25 +351,55 @@ void yp_initialize(void)
 
 
 
-/* handler for curl, checks if successful handling occurred
+/* start a request on a free handle of the server, the result is handled
+ * by yp_request_done() once it completes */
+static void send_to_yp (const char *cmd, ypdata_t *yp, char *post)
+{
+    struct yp_server *server = yp->server;
+    yp_request_t *request = NULL;
+    unsigned i;
+
+    for (i = 0; i < server->max_inflight; i++)
+    {
+        if (server->requests[i].yp == NULL)
+        {
+            request = &server->requests[i];
+            break;
+        }
+    }
+    if (request == NULL)
+        return; /* the caller checks there is room */
+
+    /* ICECAST_LOG_DEBUG("send YP (%s):%s", cmd, post); */
+    yp->cmd_ok = 0;
+    yp->request = request;
+    request->yp = yp;
+    request->cmd = cmd;
+    request->curl_error[0] = '\0';
+    server->inflight++;
+    curl_easy_setopt (request->curl, CURLOPT_COPYPOSTFIELDS, post);
+    curl_easy_setopt (request->curl, CURLOPT_WRITEHEADER, yp);
+    if (curl_multi_add_handle (yp_multi, request->curl) != CURLM_OK)
+        yp_request_done (request, CURLE_FAILED_INIT);
+}
+
+
+/* checks if successful handling occurred
  * return 0 for ok, -1 for this entry failed, -2 for server fail.
  * On failure case, update and process are modified
  */
-static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
+static int yp_check_response (yp_request_t *request, CURLcode curlcode)
 {
-    int curlcode;
+    ypdata_t *yp = request->yp;
     struct yp_server *server = yp->server;
+    const char *cmd = request->cmd;
 
-    /* ICECAST_LOG_DEBUG("send YP (%s):%s", cmd, post); */
-    yp->cmd_ok = 0;
-    curl_easy_setopt (server->curl, CURLOPT_POSTFIELDS, post);
-    curl_easy_setopt (server->curl, CURLOPT_WRITEHEADER, yp);
-    curlcode = curl_easy_perform (server->curl);
     if (curlcode)
     {
         yp->process = do_yp_add;
         yp->next_update = now + 1200;
-        ICECAST_LOG_ERROR("connection to %s failed with \"%s\"", server->url, server->curl_error);
+        ICECAST_LOG_ERROR("connection to %s failed with \"%s\"", server->url,
+                request->curl_error[0] ? request->curl_error : curl_easy_strerror (curlcode));
         return -2;
     }
     if (yp->cmd_ok == 0)
@@ -344,6 +435,61 @@ static int send_to_yp (const char *cmd, ypdata_t *yp, char *post)
 }
 
 
+static void yp_request_done (yp_request_t *request, CURLcode curlcode)
+{
+    ypdata_t *yp = request->yp;
+    struct yp_server *server = yp->server;
+    int (*process)(ypdata_t *yp, char *s, unsigned len) = yp->process;
+    int ret;
+
+    now = time (NULL);
+    ret = yp_check_response (request, curlcode);
+    request->yp = NULL;
+    yp->request = NULL;
+    server->inflight--;
+
+    if (process == do_yp_add)
+    {
+        if (ret == 0)
+        {
+            yp->process = do_yp_touch;
+            /* force first touch in 5 secs */
+            yp->next_update = now + 5;
+        }
+    }
+    else if (process == do_yp_touch)
+    {
+        if (ret == 0)
+            yp->next_update = now + yp->touch_interval;
+    }
+    else if (process == do_yp_remove)
+    {
+        free (yp->sid);
+        yp->sid = NULL;
+        yp->remove = 1;
+        yp->process = do_yp_add;
+        yp_update = 1;
+    }
+
+    /* if one of the streams shows that the server cannot be contacted then mark the
+     * other entries for an update later. Assume YP server is dead and skip it for now
+     */
+    if (ret == -2)
+    {
+        ypdata_t *entry;
+
+        for (entry = server->mounts; entry; entry = entry->next)
+        {
+            if (entry == yp || entry->request || entry->release)
+                continue;
+            ICECAST_LOG_DEBUG("skiping %s on %s", entry->mount, server->url);
+            entry->process = do_yp_add;
+            entry->next_update += 900;
+        }
+    }
+}
+
+
 /* routines for building and issues requests to the YP server */
 static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
 {
@@ -356,9 +502,9 @@ static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
             return ret+1;
 
         ICECAST_LOG_INFO("clearing up YP entry for %s", yp->mount);
-        ret = send_to_yp ("remove", yp, s);
-        free (yp->sid);
-        yp->sid = NULL;
+        /* the entry goes once the request is done */
+        send_to_yp ("remove", yp, s);
+        return 0;
     }
     yp->remove = 1;
     yp->process = do_yp_add;
@@ -368,50 +514,41 @@ static int do_yp_remove (ypdata_t *yp, char *s, unsigned len)
 }
 
 
+/* taken from the stats in one go, in the order of the YP_ info types */
+static const char * const yp_add_stats[] = {
+    "server_type", "server_name", "server_url", "genre", "bitrate",
+    "ice-bitrate", "server_description", "subtype", "audio_info"
+};
+static const int yp_add_types[] = {
+    YP_SERVER_TYPE, YP_SERVER_NAME, YP_SERVER_URL, YP_SERVER_GENRE, YP_BITRATE,
+    YP_BITRATE, YP_SERVER_DESC, YP_SUBTYPE, YP_AUDIO_INFO
+};
+#define YP_ADD_STATS    (sizeof (yp_add_stats) / sizeof (yp_add_stats[0]))
+#define YP_ADD_BITRATE  4   /* ice-bitrate is only used without bitrate */
+
 static int do_yp_add (ypdata_t *yp, char *s, unsigned len)
 {
     int ret;
-    char *value;
+    char *values[YP_ADD_STATS];
     ice_config_t *config;
     char *admin;
+    size_t i;
 
     config = config_get_config();
     admin = util_url_escape(config->admin);
     config_release_config();
 
-    value = stats_get_value (yp->mount, "server_type");
-    add_yp_info (yp, value, YP_SERVER_TYPE);
-    free (value);
-
-    value = stats_get_value (yp->mount, "server_name");
-    add_yp_info (yp, value, YP_SERVER_NAME);
-    free (value);
-
-    value = stats_get_value (yp->mount, "server_url");
-    add_yp_info (yp, value, YP_SERVER_URL);
-    free (value);
-
-    value = stats_get_value (yp->mount, "genre");
-    add_yp_info (yp, value, YP_SERVER_GENRE);
-    free (value);
-
-    value = stats_get_value (yp->mount, "bitrate");
-    if (value == NULL)
-        value = stats_get_value (yp->mount, "ice-bitrate");
-    add_yp_info (yp, value, YP_BITRATE);
-    free (value);
-
-    value = stats_get_value (yp->mount, "server_description");
-    add_yp_info (yp, value, YP_SERVER_DESC);
-    free (value);
-
-    value = stats_get_value (yp->mount, "subtype");
-    add_yp_info (yp, value, YP_SUBTYPE);
-    free (value);
-
-    value = stats_get_value (yp->mount, "audio_info");
-    add_yp_info (yp, value, YP_AUDIO_INFO);
-    free (value);
+    stats_get_values (yp->mount, yp_add_stats, values, YP_ADD_STATS);
+    for (i = 0; i < YP_ADD_STATS; i++)
+    {
+        if (i == YP_ADD_BITRATE + 1 && values[YP_ADD_BITRATE])
+        {
+            free (values[i]);
+            continue;
+        }
+        add_yp_info (yp, values[i], yp_add_types[i]);
+        free (values[i]);
+    }
 
     ret = snprintf (s, len, "action=add&admin=%s&sn=%s&genre=%s&cpswd=%s&desc="
                     "%s&url=%s&listenurl=%s&type=%s&stype=%s&b=%s&%s\r\n",
@@ -423,25 +560,26 @@ static int do_yp_add (ypdata_t *yp, char *s, unsigned len)
 
     if (ret >= (signed)len)
         return ret+1;
-    ret = send_to_yp ("add", yp, s);
-    if (ret == 0)
-    {
-        yp->process = do_yp_touch;
-        /* force first touch in 5 secs */
-        yp->next_update = time(NULL) + 5;
-    }
-    return ret;
+    send_to_yp ("add", yp, s);
+    return 0;
 }
 
 
+enum { YP_TOUCH_ARTIST, YP_TOUCH_TITLE, YP_TOUCH_LISTENERS, YP_TOUCH_MAX_LISTENERS, YP_TOUCH_SUBTYPE, YP_TOUCH_STATS };
+static const char * const yp_touch_stats[YP_TOUCH_STATS] = {
+    "artist", "title", "listeners", "max_listeners", "subtype"
+};
+
 static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
 {
     unsigned listeners = 0, max_listeners = 1;
+    char *values[YP_TOUCH_STATS];
     char *val, *artist, *title;
     int ret;
 
-    artist = (char *)stats_get_value (yp->mount, "artist");
-    title = (char *)stats_get_value (yp->mount, "title");
+    stats_get_values (yp->mount, yp_touch_stats, values, YP_TOUCH_STATS);
+    artist = values[YP_TOUCH_ARTIST];
+    title = values[YP_TOUCH_TITLE];
     if (artist || title)
     {
          char *song;
@@ -464,20 +602,20 @@ static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
     free (artist);
     free (title);
 
-    val = (char *)stats_get_value (yp->mount, "listeners");
+    val = values[YP_TOUCH_LISTENERS];
     if (val)
     {
         listeners = atoi (val);
         free (val);
     }
-    val = stats_get_value (yp->mount, "max_listeners");
+    val = values[YP_TOUCH_MAX_LISTENERS];
     if (val == NULL || strcmp (val, "unlimited") == 0 || atoi(val) < 0)
         max_listeners = client_limit;
     else
         max_listeners = atoi (val);
     free (val);
 
-    val = stats_get_value (yp->mount, "subtype");
+    val = values[YP_TOUCH_SUBTYPE];
     if (val)
     {
         add_yp_info (yp, val, YP_SUBTYPE);
@@ -491,12 +629,8 @@ static int do_yp_touch (ypdata_t *yp, char *s, unsigned len)
     if (ret >= (signed)len)
         return ret+1; /* space required for above text and nul*/
 
-    if (send_to_yp ("touch", yp, s) == 0)
-    {
-        yp->next_update = now + yp->touch_interval;
-        return 0;
-    }
-    return -1;
+    send_to_yp ("touch", yp, s);
+    return 0;
 }
 
 
@@ -535,29 +669,43 @@ static int process_ypdata(struct yp_server *server, ypdata_t *yp)
 }
 
 
+/* start the requests that are due, as far as the server has free handles */
 static void yp_process_server (struct yp_server *server)
 {
     ypdata_t *yp;
-    int state = 0;
 
     /* ICECAST_LOG_DEBUG("processing yp server %s", server->url); */
-    yp = server->mounts;
-    while (yp)
+    now = time (NULL);
+    for (yp = server->mounts; yp && server->inflight < server->max_inflight; yp = yp->next)
     {
-        now = time (NULL);
-        /* if one of the streams shows that the server cannot be contacted then mark the
-         * other entries for an update later. Assume YP server is dead and skip it for now
-         */
-        if (state == -2)
-        {
-            ICECAST_LOG_DEBUG("skiping %s on %s", yp->mount, server->url);
-            yp->process = do_yp_add;
-            yp->next_update += 900;
-        }
-        else
-            state = process_ypdata (server, yp);
-        yp = yp->next;
+        if (yp->request)
+            continue;
+        process_ypdata (server, yp);
+    }
+}
+
+
+/* move the transfers along and handle the ones that completed,
+ * returns how many are still running */
+static int yp_process_requests (void)
+{
+    CURLMsg *msg;
+    int running = 0, left;
+
+    if (curl_multi_perform (yp_multi, &running) != CURLM_OK)
+        return 0;
+    while ((msg = curl_multi_info_read (yp_multi, &left)))
+    {
+        char *priv = NULL;
+
+        if (msg->msg != CURLMSG_DONE)
+            continue;
+        curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        curl_multi_remove_handle (yp_multi, msg->easy_handle);
+        if (priv && ((yp_request_t *)priv)->yp)
+            yp_request_done ((yp_request_t *)priv, msg->data.result);
     }
+    return running;
 }
 
 
@@ -722,6 +870,8 @@ static void delete_marked_yp(struct yp_server *server)
 
 static void *yp_update_thread(void *arg)
 {
+    int running = 0;
+
     ICECAST_LOG_INFO("YP update thread started");
 
     yp_running = 1;
@@ -729,17 +879,23 @@ static void *yp_update_thread(void *arg)
     {
         struct yp_server *server;
 
-        thread_sleep (200000);
+        config_drop_pin ();
+        /* woken early by the transfers in flight */
+        if (running && yp_multi)
+            curl_multi_wait (yp_multi, NULL, 0, 200, NULL);
+        else
+            thread_sleep (200000);
 
         /* do the YP communication */
         thread_rwlock_rlock (&yp_lock);
         server = (struct yp_server *)active_yps;
-        while (server)
+        while (yp_multi && server)
         {
             /* ICECAST_LOG_DEBUG("trying %s", server->url); */
             yp_process_server (server);
             server = server->next;
         }
+        running = yp_multi ? yp_process_requests () : 0;
         thread_rwlock_unlock (&yp_lock);
 
         /* update the local YP structure */
@@ -768,6 +924,9 @@ static void *yp_update_thread(void *arg)
         active_yps = server->next;
         destroy_yp_server (server);
     }
+    if (yp_multi)
+        curl_multi_cleanup (yp_multi);
+    yp_multi = NULL;
 
     return NULL;
 }